@@ -0,0 +1,38 @@
+#ifndef NFTABLES_ASYNC_H
+#define NFTABLES_ASYNC_H
+
+#include <nftables/libnftables.h>
+#include <list.h>
+
+struct nft_async_ctx;
+
+struct nft_async_ctx *nft_async_ctx_alloc(struct nft_ctx *nft);
+void nft_async_ctx_free(struct nft_async_ctx *actx);
+
+int nft_async_ctx_fd(const struct nft_async_ctx *actx);
+struct nft_async *nft_async_ctx_submit(struct nft_async_ctx *actx,
+				       const char *buf, nft_async_cb_t cb,
+				       void *data);
+int nft_async_ctx_cancel(struct nft_async *op);
+int nft_async_ctx_process(struct nft_async_ctx *actx);
+
+int nft_parallel_run(struct nft_ctx **ctxs, unsigned int num,
+		     const char *buf, unsigned int jobs,
+		     struct nft_run_result *results);
+
+struct cmd;
+
+struct nft_eval_slot {
+	struct cmd		*cmd;
+	struct list_head	cmds;
+	struct list_head	msgs;
+	int			err;
+};
+
+void nft_eval_parallel(struct nft_ctx *nft, struct nft_eval_slot *slots,
+		       unsigned int num);
+
+int nft_run_cmd_capture(struct nft_ctx *nft, const char *buf,
+			char **output, char **error);
+
+#endif /* NFTABLES_ASYNC_H */
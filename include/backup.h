@@ -0,0 +1,10 @@
+#ifndef NFTABLES_BACKUP_H
+#define NFTABLES_BACKUP_H
+
+struct nft_ctx;
+
+int nft_backup_save(struct nft_ctx *nft, const char *filename);
+bool nft_backup_file(const char *filename);
+int nft_backup_restore(struct nft_ctx *nft, const char *filename);
+
+#endif /* NFTABLES_BACKUP_H */
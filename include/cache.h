@@ -13,7 +13,8 @@ enum cache_level_bits {
 	NFT_CACHE_OBJECT_BIT	= (1 << 4),
 	NFT_CACHE_SETELEM_BIT	= (1 << 5),
 	NFT_CACHE_RULE_BIT	= (1 << 6),
-	__NFT_CACHE_MAX_BIT	= (1 << 7),
+	NFT_CACHE_RULE_STMT_BIT	= (1 << 7),
+	__NFT_CACHE_MAX_BIT	= (1 << 8),
 };
 
 enum cache_level_flags {
@@ -33,6 +34,7 @@ enum cache_level_flags {
 	NFT_CACHE_RULE		= NFT_CACHE_TABLE_BIT |
 				  NFT_CACHE_RULE_BIT,
 	NFT_CACHE_FULL		= __NFT_CACHE_MAX_BIT - 1,
+	NFT_CACHE_STREAM	= (1 << 26),
 	NFT_CACHE_TERSE		= (1 << 27),
 	NFT_CACHE_SETELEM_MAYBE	= (1 << 28),
 	NFT_CACHE_REFRESH	= (1 << 29),
@@ -41,13 +43,18 @@ enum cache_level_flags {
 };
 
 struct nft_filter_obj {
-	struct list_head list;
+	uint32_t	hash;
 	uint32_t	family;
 	const char	*table;
 	const char	*set;
 };
 
-#define NFT_CACHE_HSIZE	8192
+/* open addressing hashtable, allocated on the first insertion. */
+struct nft_filter_ht {
+	struct nft_filter_obj	*slot;
+	uint32_t		size;
+	uint32_t		count;
+};
 
 struct nft_cache_filter {
 	struct {
@@ -61,9 +68,12 @@ struct nft_cache_filter {
 		uint64_t	rule_handle;
 	} list;
 
-	struct {
-		struct list_head head;
-	} obj[NFT_CACHE_HSIZE];
+	/* sets whose elements are not fetched. */
+	struct nft_filter_ht	obj;
+	/* tables referenced by a batch of table scoped commands, the only
+	 * ones that are fetched.
+	 */
+	struct nft_filter_ht	table;
 
 	struct {
 		bool		obj;
@@ -73,7 +83,10 @@ struct nft_cache_filter {
 };
 
 struct nft_cache;
+struct nft_cache_shared;
 struct nft_ctx;
+struct netlink_ctx;
+struct cmd;
 enum cmd_ops;
 
 int nft_cache_evaluate(struct nft_ctx *nft, struct list_head *cmds,
@@ -83,14 +96,23 @@ int nft_cache_update(struct nft_ctx *ctx, unsigned int flags,
 		     struct list_head *msgs,
 		     const struct nft_cache_filter *filter);
 bool nft_cache_needs_update(struct nft_cache *cache);
+bool nft_cache_covers(const struct nft_cache *cache, unsigned int flags);
+int nft_cache_list_refresh(struct netlink_ctx *ctx, const struct cmd *cmd);
 void nft_cache_release(struct nft_cache *cache);
+struct nft_cache *nft_cache_alloc(void);
+void nft_cache_free(struct nft_cache *cache);
+
+struct nft_cache_shared *nft_cache_shared_alloc(void);
+void nft_cache_shared_free(struct nft_cache_shared *shared);
+int nft_cache_snapshot_get(struct nft_ctx *nft, struct list_head *msgs);
+void nft_cache_snapshot_put(struct nft_ctx *nft);
 
 static inline uint32_t djb_hash(const char *key)
 {
-	uint32_t i, hash = 5381;
+	uint32_t hash = 5381;
 
-	for (i = 0; i < strlen(key); i++)
-		hash = ((hash << 5) + hash) + key[i];
+	for (; *key; key++)
+		hash = ((hash << 5) + hash) + *key;
 
 	return hash;
 }
@@ -111,16 +133,31 @@ void set_cache_add(struct set *set, struct table *table);
 void set_cache_del(struct set *set);
 struct set *set_cache_find(const struct table *table, const char *name);
 
+/* Initial number of buckets, the hashtable doubles once it holds more items
+ * than buckets and it halves once it is less than one quarter full.
+ */
+#define NFT_CACHE_HSIZE_MIN	16
+
 struct cache {
 	struct list_head	*ht;
+	uint32_t		hsize;
+	uint32_t		count;
 	struct list_head	list;
 };
 
 struct cache_item {
 	struct list_head	hlist;
 	struct list_head	list;
+	struct cache		*cache;
+	uint32_t		hash;
 };
 
+static inline struct list_head *cache_bucket(const struct cache *cache,
+					     uint32_t hash)
+{
+	return &cache->ht[hash & (cache->hsize - 1)];
+}
+
 void cache_init(struct cache *cache);
 void cache_free(struct cache *cache);
 void cache_add(struct cache_item *item, struct cache *cache, uint32_t hash);
@@ -148,11 +185,18 @@ struct nft_cache {
 	struct cache		table_cache;
 	uint32_t		seqnum;
 	uint32_t		flags;
+	unsigned int		refcnt;
 };
 
-struct netlink_ctx;
-
 void nft_chain_cache_update(struct netlink_ctx *ctx, struct table *table,
 			    const char *chain);
 
+int table_stream_fetch(struct netlink_ctx *ctx, struct table *table);
+void table_stream_release(struct netlink_ctx *ctx, struct table *table);
+int chain_stream_fetch(struct netlink_ctx *ctx, struct table *table,
+		       struct chain *chain);
+void chain_stream_release(struct netlink_ctx *ctx, struct chain *chain);
+int set_stream_fetch(struct netlink_ctx *ctx, struct set *set);
+void set_stream_release(struct netlink_ctx *ctx, struct set *set);
+
 #endif /* _NFT_CACHE_H_ */
@@ -0,0 +1,15 @@
+#ifndef NFTABLES_COMPILE_H
+#define NFTABLES_COMPILE_H
+
+struct nft_ctx;
+struct mnl_batch;
+struct list_head;
+
+bool nft_compiled_file(const char *filename);
+int nft_compile_check(struct nft_ctx *nft, const struct list_head *cmds,
+		      struct list_head *msgs);
+int nft_compile_write(struct nft_ctx *nft, struct mnl_batch *batch,
+		      const struct list_head *cmds, struct list_head *msgs);
+int nft_compiled_run(struct nft_ctx *nft, const char *filename);
+
+#endif
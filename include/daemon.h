@@ -0,0 +1,11 @@
+#ifndef _NFT_DAEMON_H_
+#define _NFT_DAEMON_H_
+
+#include <nftables/libnftables.h>
+
+#define NFT_DAEMON_WINDOW_DEFAULT	10
+
+extern int daemon_run(struct nft_ctx *nft, const char *path,
+		      unsigned int window_ms);
+
+#endif
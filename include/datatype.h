@@ -1,6 +1,7 @@
 #ifndef NFTABLES_DATATYPE_H
 #define NFTABLES_DATATYPE_H
 
+#include <stdio.h>
 #include <json.h>
 
 /**
@@ -121,6 +122,7 @@ enum byteorder {
 struct expr;
 
 struct parse_ctx;
+struct nft_resolver;
 /**
  * struct datatype
  *
@@ -174,6 +176,7 @@ bool datatype_prefix_notation(const struct datatype *dtype);
 struct parse_ctx {
 	struct symbol_tables	*tbl;
 	const struct input_ctx	*input;
+	struct nft_resolver	*resolver;
 };
 
 extern struct error_record *symbol_parse(struct parse_ctx *ctx,
@@ -222,10 +225,14 @@ enum base {
  * struct symbol_table - type construction from symbolic values
  *
  * @base:	base of symbols representation
+ * @hash:	open addressing index on identifiers, runtime tables only
+ * @hash_mask:	number of @hash slots minus one
  * @symbols:	the symbols
  */
 struct symbol_table {
 	enum base 			base;
+	unsigned int			*hash;
+	unsigned int			hash_mask;
 	struct symbolic_constant	symbols[];
 };
 
@@ -243,6 +250,24 @@ extern void symbol_table_print(const struct symbol_table *tbl,
 
 extern struct symbol_table *rt_symbol_table_init(const char *filename);
 extern void rt_symbol_table_free(const struct symbol_table *tbl);
+
+/**
+ * struct rt_symbol_db - iproute2 database, loaded on first use
+ *
+ * @filename:	database file, relative to /etc/iproute2 unless absolute
+ * @tbl:	the symbols, shared by all contexts in the process
+ * @next:	next loaded database
+ */
+struct rt_symbol_db {
+	const char		*filename;
+	struct symbol_table	*tbl;
+	struct rt_symbol_db	*next;
+};
+
+extern FILE *rt_symbol_db_open(const char *filename, char **path);
+extern const struct symbol_table *rt_symbol_db_get(struct rt_symbol_db *db,
+						   const struct symbol_table **tbl);
+extern const struct rt_symbol_db *rt_symbol_db_loaded(void);
 extern void rt_symbol_table_describe(struct output_ctx *octx, const char *name,
 				     const struct symbol_table *tbl,
 				     const struct datatype *type);
@@ -272,6 +297,8 @@ extern const struct datatype time_type;
 extern const struct datatype boolean_type;
 extern const struct datatype priority_type;
 extern const struct datatype policy_type;
+#define SYSFS_CGROUPSV2_PATH	"/sys/fs/cgroup"
+
 extern const struct datatype cgroupv2_type;
 
 /* private datatypes for reject statement. */
@@ -0,0 +1,14 @@
+#ifndef NFTABLES_DIFF_H
+#define NFTABLES_DIFF_H
+
+#include <nftables.h>
+
+/* flush ruleset without a family */
+#define NFT_DIFF_ALL_FAMILIES	(~0U)
+
+int nft_diff_prepare(struct nft_ctx *nft, struct list_head *msgs,
+		     struct list_head *cmds);
+int nft_diff(struct nft_ctx *nft, struct list_head *msgs,
+	     struct list_head *cmds);
+
+#endif /* NFTABLES_DIFF_H */
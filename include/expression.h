@@ -2,6 +2,7 @@
 #define NFTABLES_EXPRESSION_H
 
 #include <gmputil.h>
+#include <netinet/in.h>
 #include <linux/netfilter/nf_tables.h>
 
 #include <nftables.h>
@@ -113,6 +114,24 @@ extern const char *expr_op_symbols[];
 enum symbol_types {
 	SYMBOL_VALUE,
 	SYMBOL_SET,
+	SYMBOL_PARAM,
+};
+
+/*
+ * Value of a numeric literal that was already parsed by the scanner or the
+ * parser, see symbol_literal_parse().
+ */
+enum symbol_literal_types {
+	SYMBOL_LITERAL_NONE,
+	SYMBOL_LITERAL_IP4,
+	SYMBOL_LITERAL_IP6,
+	SYMBOL_LITERAL_INTEGER,
+};
+
+union symbol_literal {
+	struct in_addr		in;
+	struct in6_addr		in6;
+	uint64_t		num;
 };
 
 /**
@@ -262,6 +281,8 @@ struct expr {
 			const struct scope	*scope;
 			const char		*identifier;
 			enum symbol_types	symtype;
+			enum symbol_literal_types littype;
+			union symbol_literal	literal;
 		};
 		struct {
 			/* EXPR_VARIABLE */
@@ -406,6 +427,7 @@ extern struct expr *expr_alloc(const struct location *loc,
 extern struct expr *expr_clone(const struct expr *expr);
 extern struct expr *expr_get(struct expr *expr);
 extern void expr_free(struct expr *expr);
+extern void expr_node_cache_release(void);
 extern void expr_print(const struct expr *expr, struct output_ctx *octx);
 extern bool expr_cmp(const struct expr *e1, const struct expr *e2);
 extern void expr_describe(const struct expr *expr, struct output_ctx *octx);
@@ -452,6 +474,9 @@ extern struct expr *verdict_expr_alloc(const struct location *loc,
 extern struct expr *symbol_expr_alloc(const struct location *loc,
 				      enum symbol_types type, struct scope *scope,
 				      const char *identifier);
+extern void symbol_expr_set_literal(struct expr *expr,
+				   enum symbol_literal_types type,
+				   const union symbol_literal *literal);
 
 const char *expr_name(const struct expr *e);
 
@@ -492,6 +517,7 @@ extern struct expr *compound_expr_alloc(const struct location *loc,
 extern void compound_expr_add(struct expr *compound, struct expr *expr);
 extern void compound_expr_remove(struct expr *compound, struct expr *expr);
 extern void list_expr_sort(struct list_head *head);
+extern void list_expr_sort_jobs(struct list_head *head, unsigned int jobs);
 extern void list_splice_sorted(struct list_head *list, struct list_head *head);
 
 extern struct expr *concat_expr_alloc(const struct location *loc);
@@ -0,0 +1,34 @@
+#ifndef NFTABLES_FINGERPRINT_H
+#define NFTABLES_FINGERPRINT_H
+
+#include <libnftnl/udata.h>
+
+#include <nftables.h>
+
+/* Table userdata of nftables itself, after the libnftnl types. Older
+ * versions skip it.
+ */
+#define NFT_UDATA_TABLE_FINGERPRINT	(NFTNL_UDATA_TABLE_MAX + 1)
+
+/* flush ruleset without a family */
+#define NFT_FINGERPRINT_ALL_FAMILIES	(~0U)
+
+struct nlmsghdr;
+struct netlink_ctx;
+
+/* Fingerprint placeholders in the new table messages of a batch. */
+struct nft_fingerprint {
+	uint8_t		**values;
+	unsigned int	num;
+	unsigned int	size;
+};
+
+int nft_fingerprint_prepare(struct nft_ctx *nft, struct list_head *msgs,
+			    const struct list_head *cmds);
+void nft_fingerprint_add_table(struct nft_fingerprint *fp,
+			       struct nlmsghdr *nlh);
+bool nft_fingerprint_check(struct netlink_ctx *ctx,
+			   const struct list_head *cmds);
+void nft_fingerprint_free(struct nft_fingerprint *fp);
+
+#endif /* NFTABLES_FINGERPRINT_H */
@@ -7,4 +7,14 @@ extern struct expr *hash_expr_alloc(const struct location *loc,
 				    uint32_t offset,
 				    enum nft_hash_types type);
 
+/* upper bound for the number of slots of a maglev table */
+#define MAGLEV_SIZE_MAX		(1 << 20)
+
+struct set;
+
+extern bool maglev_size_valid(uint64_t size);
+extern struct expr *maglev_table_alloc(const struct set *set,
+				       const struct expr *backends,
+				       const struct expr **dup);
+
 #endif /* NFTABLES_HASH_H */
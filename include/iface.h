@@ -3,9 +3,11 @@
 
 #include <net/if.h>
 #include <list.h>
+#include <cache.h>
 
 struct iface {
-	struct list_head	list;
+	struct cache_item	name_cache;
+	struct cache_item	index_cache;
 	char			name[IFNAMSIZ];
 	uint32_t		ifindex;
 };
@@ -15,6 +17,8 @@ char *nft_if_indextoname(unsigned int ifindex, char *name);
 
 void iface_cache_update(void);
 void iface_cache_release(void);
+void iface_cache_hold(void);
+void iface_cache_put(void);
 
 const struct iface *iface_cache_get_next_entry(const struct iface *prev);
 #endif
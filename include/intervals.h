@@ -1,11 +1,18 @@
 #ifndef NFTABLES_INTERVALS_H
 #define NFTABLES_INTERVALS_H
 
+struct interval_index;
+
 int set_automerge(struct list_head *msgs, struct cmd *cmd, struct set *set,
-		  struct expr *init, unsigned int debug_mask);
+		  struct expr *init, unsigned int debug_mask, unsigned int jobs);
 int set_delete(struct list_head *msgs, struct cmd *cmd, struct set *set,
-	       struct expr *init, unsigned int debug_mask);
-int set_overlap(struct list_head *msgs, struct set *set, struct expr *init);
+	       struct expr *init, unsigned int debug_mask, unsigned int jobs);
+int set_overlap(struct list_head *msgs, struct set *set, struct expr *init,
+		unsigned int jobs);
+unsigned int set_count_intervals(const struct set *set, struct expr *init,
+				 unsigned int jobs);
+void interval_index_free(struct interval_index *index);
+void interval_index_invalidate(struct set *set);
 int set_to_intervals(const struct set *set, struct expr *init, bool add);
 
 #endif
@@ -0,0 +1,44 @@
+#ifndef NFTABLES_JOURNAL_H
+#define NFTABLES_JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <list.h>
+
+struct output_ctx;
+
+/* Changes of one transaction, as printed by monitor replicate. */
+struct nft_journal_entry {
+	struct list_head	list;
+	uint32_t		genid;
+	/* tables, chains or rules changed, the commands are not complete */
+	bool			reload;
+	char			*cmds;
+};
+
+/*
+ * Changes of the ruleset, kept from the events that bring the persistent
+ * cache up to date. The journal holds every transaction after generation
+ * @start up to @genid, it is not valid until the cache was fetched once.
+ */
+struct nft_journal {
+	struct list_head	entries;
+	unsigned int		num_entries;
+	uint32_t		start;
+	uint32_t		genid;
+	bool			valid;
+};
+
+#define NFT_JOURNAL_MAX		4096
+
+struct nft_journal *nft_journal_alloc(void);
+void nft_journal_free(struct nft_journal *journal);
+void nft_journal_sync(struct nft_journal *journal, uint32_t genid);
+void nft_journal_invalidate(struct nft_journal *journal);
+void nft_journal_add(struct nft_journal *journal, uint32_t genid,
+		     char *cmds, bool reload);
+bool nft_journal_covers(const struct nft_journal *journal, uint32_t genid);
+void nft_journal_print(const struct nft_journal *journal, uint32_t genid,
+		       struct output_ctx *octx);
+
+#endif /* NFTABLES_JOURNAL_H */
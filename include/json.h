@@ -15,6 +15,10 @@ struct stmt;
 struct symbol_table;
 struct table;
 struct netlink_mon_handler;
+struct trace_aggr;
+struct trace_aggr_entry;
+struct elem_aggr;
+struct elem_aggr_entry;
 struct nft_ctx;
 struct location;
 struct output_ctx;
@@ -121,6 +125,15 @@ int json_events_cb(const struct nlmsghdr *nlh,
 void json_alloc_echo(struct nft_ctx *ctx);
 void json_print_echo(struct nft_ctx *ctx);
 
+void optimize_stats_print_json(struct output_ctx *octx,
+			       const struct list_head *stats);
+void trace_aggr_print_json(struct output_ctx *octx,
+			   const struct trace_aggr *aggr,
+			   struct trace_aggr_entry **entries);
+void elem_aggr_print_json(struct output_ctx *octx,
+			  const struct elem_aggr *aggr,
+			  struct elem_aggr_entry **entries);
+
 #else /* ! HAVE_LIBJANSSON */
 
 typedef void json_t;
@@ -276,6 +289,26 @@ static inline void json_print_echo(struct nft_ctx *ctx)
 	/* empty */
 }
 
+static inline void optimize_stats_print_json(struct output_ctx *octx,
+					     const struct list_head *stats)
+{
+	/* empty */
+}
+
+static inline void trace_aggr_print_json(struct output_ctx *octx,
+					 const struct trace_aggr *aggr,
+					 struct trace_aggr_entry **entries)
+{
+	/* empty */
+}
+
+static inline void elem_aggr_print_json(struct output_ctx *octx,
+					const struct elem_aggr *aggr,
+					struct elem_aggr_entry **entries)
+{
+	/* empty */
+}
+
 #endif /* HAVE_LIBJANSSON */
 
 #endif /* NFTABLES_JSON_H */
@@ -7,6 +7,7 @@
 #include <libmnl/libmnl.h>
 
 struct mnl_socket *nft_mnl_socket_open(void);
+struct mnl_socket *nft_mnl_event_socket_open(void);
 
 uint32_t mnl_seqnum_inc(uint32_t *seqnum);
 uint32_t mnl_genid_get(struct netlink_ctx *ctx);
@@ -20,13 +21,47 @@ struct mnl_err {
 
 void mnl_err_list_free(struct mnl_err *err);
 
-struct nftnl_batch *mnl_batch_init(void);
-bool mnl_batch_ready(struct nftnl_batch *batch);
-void mnl_batch_reset(struct nftnl_batch *batch);
-uint32_t mnl_batch_begin(struct nftnl_batch *batch, uint32_t seqnum);
-void mnl_batch_end(struct nftnl_batch *batch, uint32_t seqnum);
+struct mnl_batch;
+struct mnl_batch_pool;
+
+struct mnl_batch *mnl_batch_init(struct nft_ctx *nft);
+void mnl_batch_pool_free(struct mnl_batch_pool *pool);
+void *mnl_batch_buffer(struct mnl_batch *batch);
+void mnl_nft_batch_continue(struct mnl_batch *batch);
+uint32_t mnl_batch_iovec_len(const struct mnl_batch *batch);
+void mnl_batch_iovec(const struct mnl_batch *batch, struct iovec *iov,
+		     uint32_t iov_len);
+bool mnl_batch_ready(struct mnl_batch *batch);
+void mnl_batch_reset(struct mnl_batch *batch);
+uint32_t mnl_batch_begin(struct mnl_batch *batch, uint32_t seqnum);
+void mnl_batch_end(struct mnl_batch *batch, uint32_t seqnum);
 int mnl_batch_talk(struct netlink_ctx *ctx, struct list_head *err_list,
 		   uint32_t num_cmds);
+int mnl_batch_replay(struct netlink_ctx *ctx, const void *buf, uint32_t len,
+		     struct list_head *err_list, uint32_t num_cmds);
+void mnl_nft_restore_msg(struct mnl_batch *batch,
+			 const struct nlmsghdr *nlh, uint32_t seqnum);
+void mnl_nft_restore_flush(struct mnl_batch *batch, uint32_t seqnum);
+int mnl_nft_dump_raw(struct netlink_ctx *ctx, uint16_t type,
+		     int (*cb)(const struct nlmsghdr *nlh, void *data),
+		     void *data);
+int mnl_nft_rule_dump_raw(struct netlink_ctx *ctx, int family,
+			  const char *table,
+			  int (*cb)(const struct nlmsghdr *nlh, void *data),
+			  void *data);
+int mnl_nft_setelem_dump_raw(struct netlink_ctx *ctx, int family,
+			     const char *table, const char *set,
+			     int (*cb)(const struct nlmsghdr *nlh, void *data),
+			     void *data);
+
+struct mnl_split_stats {
+	unsigned int	sent;
+	unsigned int	total;
+};
+
+int mnl_batch_talk_split(struct netlink_ctx *ctx, struct list_head *err_list,
+			 uint32_t num_cmds, uint32_t atomic_seq,
+			 struct mnl_split_stats *stats);
 
 int mnl_nft_rule_add(struct netlink_ctx *ctx, struct cmd *cmd,
 		     unsigned int flags);
@@ -37,6 +72,9 @@ struct nftnl_rule_list *mnl_nft_rule_dump(struct netlink_ctx *ctx, int family,
 					  const char *table, const char *chain,
 					  uint64_t rule_handle,
 					  bool dump, bool reset);
+int mnl_nft_rule_dump_terse(struct netlink_ctx *ctx, int family,
+			    const char *table, const char *chain,
+			    struct list_head *rules);
 
 int mnl_nft_chain_add(struct netlink_ctx *ctx, struct cmd *cmd,
 		      unsigned int flags);
@@ -70,10 +108,82 @@ int mnl_nft_setelem_del(struct netlink_ctx *ctx, struct cmd *cmd,
 int mnl_nft_setelem_flush(struct netlink_ctx *ctx, const struct cmd *cmd);
 int mnl_nft_setelem_get(struct netlink_ctx *ctx, struct nftnl_set *nls,
 			bool reset);
+
+struct mnl_setelem_top;
+
+/* Counts the elements of a set in @count, only @limit of them after @offset
+ * are parsed into the set. With @top, the @top elements with the most bytes
+ * or packets instead, highest first.
+ */
+struct mnl_setelem_window {
+	uint64_t		offset;
+	uint64_t		limit;
+	uint64_t		count;
+	uint64_t		top;
+	bool			top_bytes;
+	struct nftnl_set	*nls;
+	/* min-heap of the elements with the highest counters so far */
+	struct mnl_setelem_top	*heap;
+	uint64_t		heap_len;
+	uint64_t		heap_size;
+	struct nlmsghdr		*hdr;
+};
+
+int mnl_nft_setelem_get_window(struct netlink_ctx *ctx, struct nftnl_set *nls,
+			       struct mnl_setelem_window *w);
+
+int mnl_nft_setelem_dump(struct netlink_ctx *ctx, struct nftnl_set *nls,
+			 bool reset,
+			 int (*cb)(const struct nlmsghdr *nlh,
+				   const struct nlattr *elem, void *data),
+			 void *data);
+void mnl_nft_setelem_parse(const struct nlmsghdr *nlh,
+			   const struct nlattr *elem, struct nftnl_set *nls);
 struct nftnl_set *mnl_nft_setelem_get_one(struct netlink_ctx *ctx,
 					  struct nftnl_set *nls,
 					  bool reset);
 
+/* Elements given as raw keys and data in network byte order, there is one
+ * entry per key in each of the optional arrays. The position of each element
+ * in the batch is recorded in @seqnums and @offsets for error reporting.
+ */
+struct mnl_setelem_raw {
+	const uint8_t		*keys;
+	uint32_t		key_len;
+	const uint8_t		*data;
+	uint32_t		data_len;
+	const uint64_t		*timeouts;
+	const uint64_t		*packets;
+	const uint64_t		*bytes;
+	size_t			n;
+	uint32_t		*seqnums;
+	uint32_t		*offsets;
+};
+
+void mnl_nft_setelem_raw(struct netlink_ctx *ctx, uint16_t msg_type,
+			 const struct handle *h, struct mnl_setelem_raw *elems);
+int mnl_nft_setelem_raw_query(struct netlink_ctx *ctx, const struct handle *h,
+			      const void *keys, uint32_t key_len, size_t n,
+			      uint8_t *bitmap);
+
+struct mnl_counter_array {
+	struct nft_counter	*counters;
+	size_t			num;
+	size_t			size;
+};
+
+int mnl_nft_counters_dump(struct netlink_ctx *ctx, int family,
+			  const char *table, bool rules, bool reset,
+			  struct mnl_counter_array *array);
+
+struct mnl_set_counter_dump {
+	nft_set_counter_cb_t	cb;
+	void			*data;
+};
+
+int mnl_nft_set_counters_dump(struct netlink_ctx *ctx, const struct handle *h,
+			      bool reset, struct mnl_set_counter_dump *dump);
+
 struct nftnl_obj_list *mnl_nft_obj_dump(struct netlink_ctx *ctx, int family,
 					const char *table,
 					const char *name, uint32_t type,
@@ -93,13 +203,30 @@ int mnl_nft_flowtable_del(struct netlink_ctx *ctx, struct cmd *cmd);
 int mnl_nft_dump_nf_hooks(struct netlink_ctx *ctx, int family,
 			  const char *devname);
 
+int mnl_nft_event_drain(struct mnl_socket *nf_sock,
+			int (*cb)(const struct nlmsghdr *nlh, void *data),
+			void *cb_data);
+
+/*
+ * @lost is called if events were dropped, e.g. to resynchronize a cache
+ * that is kept up to date through events. If set, @tick is called every
+ * @interval milliseconds.
+ */
+struct mnl_event_ops {
+	int		(*event)(const struct nlmsghdr *nlh, void *data);
+	int		(*lost)(void *data);
+	int		(*tick)(void *data);
+	uint64_t	interval;
+};
+
 int mnl_nft_event_listener(struct mnl_socket *nf_sock, unsigned int debug_mask,
 			   struct output_ctx *octx,
-			   int (*cb)(const struct nlmsghdr *nlh, void *data),
-			   void *cb_data);
+			   const struct mnl_event_ops *ops, void *cb_data);
 
 int nft_mnl_talk(struct netlink_ctx *ctx, const void *data, unsigned int len,
 		 int (*cb)(const struct nlmsghdr *nlh, void *data),
 		 void *cb_data);
+int nft_mnl_send_requests(struct netlink_ctx *ctx, const void *data,
+			  unsigned int len);
 
 #endif /* _NFTABLES_MNL_H_ */
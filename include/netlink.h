@@ -16,6 +16,22 @@
 
 #define MAX_REGS	(1 + NFT_REG32_15 - NFT_REG32_00)
 
+/* Set userdata of nftables itself, after the libnftnl types: the maglev
+ * declaration of a map, listed instead of the elements generated from it.
+ * Older versions skip it.
+ */
+#define NFT_UDATA_SET_MAGLEV	(NFTNL_UDATA_SET_MAX + 1)
+
+enum nft_udata_set_maglev {
+	NFT_UDATA_SET_MAGLEV_SIZE,
+	NFT_UDATA_SET_MAGLEV_BACKEND,
+	NFT_UDATA_SET_MAGLEV_WEIGHT,
+};
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK			10
+#endif
+
 #ifndef NETLINK_EXT_ACK
 #define NETLINK_EXT_ACK                 11
 
@@ -71,21 +87,31 @@ extern const struct location netlink_location;
  * struct netlink_ctx
  *
  * @nft:	nftables context
+ * @nf_sock:	netlink socket for dumps, NULL to use the one in @nft
  * @msgs:	message queue
  * @list:	list of parsed rules/chains/tables
  * @set:	current set
  * @data:	pointer to pass data to callback
  * @seqnum:	sequence number
+ * @ack_stats:	batch acknowledgment counters
  */
 struct netlink_ctx {
 	struct nft_ctx		*nft;
+	struct mnl_socket	*nf_sock;
 	struct list_head	*msgs;
 	struct list_head	list;
 	struct set		*set;
 	const void		*data;
 	uint32_t		seqnum;
-	struct nftnl_batch	*batch;
+	struct mnl_batch	*batch;
+	struct nft_fingerprint	*fingerprint;
 	int			maybe_emsgsize;
+	struct {
+		uint32_t	msgs;
+		uint32_t	bytes;
+		uint32_t	errors;
+		uint32_t	calls;
+	} ack_stats;
 };
 
 extern struct nftnl_expr *alloc_nft_expr(const char *name);
@@ -93,6 +119,34 @@ extern void alloc_setelem_cache(const struct expr *set, struct nftnl_set *nls);
 struct nftnl_set_elem *alloc_nftnl_setelem(const struct expr *set,
 					   const struct expr *expr);
 
+/**
+ * struct netlink_concat_layout - key layout of a concatenation of ranges
+ *
+ * @len:	key length in bytes, with padding
+ * @count:	number of fields
+ * @field:	per field, length in bytes, length with padding, byte order of
+ *		the element values and byte order of the key data
+ *
+ * Computed once per set, so that the start and end keys of its elements
+ * can be packed without looking at the datatypes again.
+ */
+struct netlink_concat_layout {
+	unsigned int		len;
+	unsigned int		count;
+	struct {
+		uint8_t		len;
+		uint8_t		padded;
+		enum byteorder	byteorder;
+		enum byteorder	key_byteorder;
+	} field[NFT_REG32_COUNT];
+};
+
+bool netlink_concat_layout_init(struct netlink_concat_layout *layout,
+				const struct expr *set);
+bool netlink_gen_setelem(struct nlmsghdr *nlh, const struct expr *set,
+			 const struct expr *expr,
+			 const struct netlink_concat_layout *layout);
+
 extern struct nftnl_table *netlink_table_alloc(const struct nlmsghdr *nlh);
 extern struct nftnl_chain *netlink_chain_alloc(const struct nlmsghdr *nlh);
 extern struct nftnl_set *netlink_set_alloc(const struct nlmsghdr *nlh);
@@ -148,6 +202,8 @@ extern void netlink_linearize_rule(struct netlink_ctx *ctx,
 				   struct netlink_linearize_ctx *lctx);
 extern struct rule *netlink_delinearize_rule(struct netlink_ctx *ctx,
 					     struct nftnl_rule *r);
+struct rule *netlink_delinearize_rule_handle(struct nftnl_rule *nlr);
+struct rule *netlink_delinearize_rule_nlmsg(const struct nlmsghdr *nlh);
 
 extern int netlink_list_chains(struct netlink_ctx *ctx, const struct handle *h);
 extern struct chain *netlink_delinearize_chain(struct netlink_ctx *ctx,
@@ -168,9 +224,23 @@ extern struct stmt *netlink_parse_set_expr(const struct set *set,
 extern int netlink_list_setelems(struct netlink_ctx *ctx,
 				 const struct handle *h, struct set *set,
 				 bool reset);
+extern int netlink_list_setelems_window(struct netlink_ctx *ctx,
+					const struct handle *h, struct set *set,
+					const struct set_window *window,
+					uint64_t *count);
+extern int netlink_count_setelems(struct netlink_ctx *ctx,
+				  const struct handle *h, uint64_t *count);
 extern int netlink_get_setelem(struct netlink_ctx *ctx, const struct handle *h,
 			       const struct location *loc, struct set *cache_set,
 			       struct set *set, struct expr *init, bool reset);
+int netlink_get_setelem_ranges(struct netlink_ctx *ctx, struct set *set,
+			       const struct expr *init);
+struct setelem_index;
+void setelem_index_free(struct setelem_index *index);
+struct setelem_data_index;
+void setelem_data_index_free(struct setelem_data_index *index);
+int netlink_setelem_cache_event(struct set *set, struct nftnl_set *nls,
+				int type, struct nft_cache *cache);
 extern int netlink_delinearize_setelem(struct nftnl_set_elem *nlse,
 				       struct set *set,
 				       struct nft_cache *cache);
@@ -204,6 +274,60 @@ extern int netlink_io_error(struct netlink_ctx *ctx,
 	__netlink_init_error(__FILE__, __LINE__, strerror(errno));
 extern void __noreturn __netlink_init_error(const char *file, int line, const char *reason);
 
+#define NFT_TRACE_AGGR_HSIZE	512
+#define NFT_TRACE_AGGR_TOP	10
+#define NFT_TRACE_AGGR_VERDICTS	16
+
+/* Hits of one rule, chain policy or chain return with a given verdict. */
+struct trace_aggr_entry {
+	struct list_head	hlist;
+	uint32_t		family;
+	const char		*table;
+	const char		*chain;
+	uint64_t		handle;
+	uint32_t		type;
+	int			verdict;
+	uint64_t		hits;
+};
+
+struct trace_aggr {
+	uint64_t		interval;
+	uint64_t		events;
+	unsigned int		num_entries;
+	struct list_head	ht[NFT_TRACE_AGGR_HSIZE];
+};
+
+struct trace_aggr *trace_aggr_alloc(uint64_t interval);
+void trace_aggr_free(struct trace_aggr *aggr);
+const char *trace_aggr_verdict(int verdict);
+
+/* Elements added to and deleted from one set over the interval. */
+struct elem_aggr_entry {
+	struct list_head	list;
+	uint32_t		family;
+	const char		*table;
+	const char		*set;
+	uint64_t		added;
+	uint64_t		deleted;
+};
+
+struct elem_aggr {
+	uint64_t		interval;
+	unsigned int		num_entries;
+	struct list_head	entries;
+};
+
+struct elem_aggr *elem_aggr_alloc(uint64_t interval);
+void elem_aggr_free(struct elem_aggr *aggr);
+
+/* Changes of the transaction in progress, see netlink_events_replica_cb(). */
+struct netlink_replica {
+	FILE			*fp;
+	char			*buf;
+	size_t			len;
+	bool			reload;
+};
+
 struct netlink_mon_handler {
 	uint32_t		monitor_flags;
 	uint32_t		format;
@@ -211,10 +335,21 @@ struct netlink_mon_handler {
 	const struct location	*loc;
 	unsigned int		debug_mask;
 	struct nft_cache	*cache;
+	bool			resync;
+	uint16_t		resync_genid;
+	struct list_head	resync_events;
+	struct trace_aggr	*trace_aggr;
+	struct elem_aggr	*elem_aggr;
+	uint32_t		filter_family;
+	const char		*filter_table;
+	bool			replicate;
+	struct netlink_replica	replica;
 };
 
 extern int netlink_monitor(struct netlink_mon_handler *monhandler,
 			    struct mnl_socket *nf_sock);
+int netlink_cache_events(struct netlink_ctx *ctx, struct mnl_socket *ev_sock,
+			 uint32_t genid);
 struct netlink_cb_data {
 	struct netlink_ctx	*nl_ctx;
 	struct list_head	*err_list;
@@ -230,6 +365,12 @@ struct nftnl_parse_ctx;
 
 int netlink_events_trace_cb(const struct nlmsghdr *nlh, int type,
 			    struct netlink_mon_handler *monh);
+int netlink_events_trace_aggr_cb(const struct nlmsghdr *nlh,
+				 struct netlink_mon_handler *monh);
+int netlink_trace_aggr_flush(struct netlink_mon_handler *monh);
+int netlink_events_elem_aggr_cb(const struct nlmsghdr *nlh, int type,
+				struct netlink_mon_handler *monh);
+int netlink_elem_aggr_flush(struct netlink_mon_handler *monh);
 
 enum nft_data_types dtype_map_to_kernel(const struct datatype *dtype);
 
@@ -237,16 +378,29 @@ void netlink_linearize_init(struct netlink_linearize_ctx *lctx,
 			    struct nftnl_rule *nlr);
 void netlink_linearize_fini(struct netlink_linearize_ctx *lctx);
 
+#define NFT_PINNED_LOADS_MAX	4
+
+/* Load kept in a register for reuse by later matches in the same rule. */
+struct netlink_pinned_load {
+	const struct expr	*expr;
+	enum nft_registers	reg;
+	bool			loaded;
+};
+
 struct netlink_linearize_ctx {
 	struct nftnl_rule	*nlr;
 	unsigned int		reg_low;
-	struct list_head	*expr_loc_htable;
+	struct nft_expr_loc	*expr_loc;
+	unsigned int		num_expr_loc;
+	unsigned int		expr_loc_size;
+	unsigned int		expr_loc_next;
+	struct netlink_pinned_load pinned[NFT_PINNED_LOADS_MAX];
+	unsigned int		num_pinned;
+	unsigned int		pinned_space;
+	unsigned int		loads_saved;
 };
 
-#define NFT_EXPR_LOC_HSIZE      128
-
 struct nft_expr_loc {
-	struct list_head	hlist;
 	const struct nftnl_expr	*nle;
 	const struct location	*loc;
 };
@@ -7,12 +7,17 @@
 #include <cache.h>
 #include <nftables/libnftables.h>
 
+struct nft_resolver;
+struct xt_xlate_cache;
+
 struct cookie {
 	FILE *fp;
 	FILE *orig_fp;
 	char *buf;
 	size_t buflen;
 	size_t pos;
+	nft_output_cb_t cb;
+	void *cb_data;
 };
 
 struct symbol_tables {
@@ -20,6 +25,8 @@ struct symbol_tables {
 	const struct symbol_table	*devgroup;
 	const struct symbol_table	*ct_label;
 	const struct symbol_table	*realm;
+	const struct symbol_table	*services;
+	const struct symbol_table	*protocols;
 };
 
 struct input_ctx {
@@ -36,6 +43,26 @@ static inline bool nft_input_json(const struct input_ctx *ictx)
 	return ictx->flags & NFT_CTX_INPUT_JSON;
 }
 
+static inline bool nft_input_split_elements(const struct input_ctx *ictx)
+{
+	return ictx->flags & NFT_CTX_INPUT_SPLIT_ELEMENTS;
+}
+
+static inline bool nft_input_diff(const struct input_ctx *ictx)
+{
+	return ictx->flags & NFT_CTX_INPUT_DIFF;
+}
+
+static inline bool nft_input_if_changed(const struct input_ctx *ictx)
+{
+	return ictx->flags & NFT_CTX_INPUT_IF_CHANGED;
+}
+
+static inline bool nft_input_set_hints(const struct input_ctx *ictx)
+{
+	return ictx->flags & NFT_CTX_INPUT_SET_HINTS;
+}
+
 struct output_ctx {
 	unsigned int flags;
 	union {
@@ -47,6 +74,8 @@ struct output_ctx {
 		struct cookie error_cookie;
 	};
 	struct symbol_tables tbl;
+	struct nft_resolver *resolver;
+	struct xt_xlate_cache *xt_cache;
 };
 
 static inline bool nft_output_reversedns(const struct output_ctx *octx)
@@ -74,11 +103,21 @@ static inline bool nft_output_json(const struct output_ctx *octx)
 	return octx->flags & NFT_CTX_OUTPUT_JSON;
 }
 
+static inline bool nft_output_cbor(const struct output_ctx *octx)
+{
+	return octx->flags & NFT_CTX_OUTPUT_CBOR;
+}
+
 static inline bool nft_output_echo(const struct output_ctx *octx)
 {
 	return octx->flags & NFT_CTX_OUTPUT_ECHO;
 }
 
+static inline bool nft_output_echo_handles(const struct output_ctx *octx)
+{
+	return octx->flags & NFT_CTX_OUTPUT_ECHO_HANDLES;
+}
+
 static inline bool nft_output_guid(const struct output_ctx *octx)
 {
 	return octx->flags & NFT_CTX_OUTPUT_GUID;
@@ -122,6 +161,7 @@ struct nft_vars {
 
 struct nft_ctx {
 	struct mnl_socket	*nf_sock;
+	struct mnl_socket	*ev_sock;
 	char			**include_paths;
 	unsigned int		num_include_paths;
 	struct nft_vars		*vars;
@@ -135,15 +175,53 @@ struct nft_ctx {
 	struct input_ctx	input;
 	struct output_ctx	output;
 	bool			check;
-	struct nft_cache	cache;
+	struct nft_cache	*cache;
+	struct nft_cache_shared	*shared;
+	struct nft_ctx		*parent;
+	struct list_head	*params;
 	uint32_t		flags;
 	uint32_t		optimize_flags;
+	unsigned int		jobs;
+	struct nft_resolver	*resolver;
+	struct payload_dep_cache *dep_cache;
+	/* netlink batch pages kept between runs, see mnl_batch_init() */
+	struct mnl_batch_pool	*batch_pool;
+	/* io_uring netlink backend, see nft_mnl_uring() */
+	struct nft_uring	*uring;
+	/* evaluated anonymous sets of the current batch, see evaluate.c */
+	struct anon_set_cache	*anon_sets;
+	/* included files kept between runs, see include_cache_get() */
+	struct include_cache	*include_cache;
+	struct nft_timing	*timing;
+	/* families flushed by the file in --diff mode, see nft_diff() */
+	unsigned int		diff_flushed;
+	/* same for --if-changed, see nft_fingerprint_check() */
+	unsigned int		fingerprint_flushed;
+	struct nft_async_ctx	*async;
+	/* changes seen by the persistent cache, see nft_journal_add() */
+	struct nft_journal	*journal;
 	struct parser_state	*state;
 	void			*scanner;
 	struct scope		*top_scope;
 	void			*json_root;
 	json_t			*json_echo;
+	/* see nft_ctx_get_echo_handles() */
+	struct {
+		struct nft_echo_handle	*handles;
+		unsigned int		num;
+		unsigned int		size;
+	} echo;
 	const char		*stdin_buf;
+	struct {
+		char		*output;
+		const char	*source;
+	} compile;
+	/* ruleset listing that replaces the kernel, see nft_ctx_set_offline() */
+	struct {
+		char			*file;
+		struct parser_state	*state;
+		void			*scanner;
+	} offline;
 };
 
 enum nftables_exit_codes {
@@ -154,11 +232,16 @@ enum nftables_exit_codes {
 };
 
 struct input_descriptor;
+struct include_unit;
+/*
+ * Embedded in every expression, statement and rule, keep it small. The
+ * offset of the token itself is only tracked by the input descriptor,
+ * error reporting only needs the beginning of its line.
+ */
 struct location {
 	const struct input_descriptor		*indesc;
 	union {
 		struct {
-			off_t			token_offset;
 			off_t			line_offset;
 
 			unsigned int		first_line;
@@ -199,6 +282,7 @@ enum input_descriptor_types {
  *
  * @location:		location, used for include statements
  * @f:			file descriptor
+ * @unit:		cached contents of an included file
  * @depth:		include depth of the descriptor
  * @type:		input descriptor type
  * @name:		name describing the input
@@ -211,6 +295,9 @@ enum input_descriptor_types {
 struct input_descriptor {
 	struct list_head		list;
 	FILE				*f;
+	void				*map;
+	size_t				map_len;
+	struct include_unit		*unit;
 	unsigned int			depth;
 	struct location			location;
 	enum input_descriptor_types	type;
@@ -222,20 +309,21 @@ struct input_descriptor {
 	off_t				line_offset;
 };
 
-void ct_label_table_init(struct nft_ctx *ctx);
-void mark_table_init(struct nft_ctx *ctx);
-void realm_table_rt_init(struct nft_ctx *ctx);
-void devgroup_table_init(struct nft_ctx *ctx);
+const struct symbol_table *ct_label_table(struct symbol_tables *tbl);
+const struct symbol_table *mark_table(struct symbol_tables *tbl);
+const struct symbol_table *devgroup_table(struct symbol_tables *tbl);
 void xt_init(void);
 
-void ct_label_table_exit(struct nft_ctx *ctx);
-void mark_table_exit(struct nft_ctx *ctx);
-void devgroup_table_exit(struct nft_ctx *ctx);
-void realm_table_rt_exit(struct nft_ctx *ctx);
+void netdb_table_exit(struct nft_ctx *ctx);
 
 int nft_print(struct output_ctx *octx, const char *fmt, ...)
 	__attribute__((format(printf, 2, 3)));
 int nft_gmp_print(struct output_ctx *octx, const char *fmt, ...);
+void nft_print_flush(struct output_ctx *octx);
+int nft_print_str(struct output_ctx *octx, const char *str);
+int nft_print_u64(struct output_ctx *octx, uint64_t val);
+int nft_print_ipv4(struct output_ctx *octx, const void *addr);
+int nft_print_ipv6(struct output_ctx *octx, const void *addr);
 
 int nft_optimize(struct nft_ctx *nft, struct list_head *cmds);
 
@@ -27,29 +27,52 @@ enum nft_debug_level {
 	NFT_DEBUG_MNL			= 0x10,
 	NFT_DEBUG_PROTO_CTX		= 0x20,
 	NFT_DEBUG_SEGTREE		= 0x40,
+	NFT_DEBUG_TIMING		= 0x80,
+	NFT_DEBUG_MEMORY		= 0x100,
 };
 
 /**
  * Possible flags to pass to nft_ctx_new()
  */
 #define NFT_CTX_DEFAULT		0
+#define NFT_CTX_PARALLEL_CACHE	(1 << 0)
+#define NFT_CTX_PERSISTENT_CACHE	(1 << 1)
+#define NFT_CTX_STREAM_LIST	(1 << 2)
 
 struct nft_ctx *nft_ctx_new(uint32_t flags);
 void nft_ctx_free(struct nft_ctx *ctx);
+struct nft_ctx *nft_ctx_session_new(struct nft_ctx *parent);
 
 bool nft_ctx_get_dry_run(struct nft_ctx *ctx);
 void nft_ctx_set_dry_run(struct nft_ctx *ctx, bool dry);
 
 enum nft_optimize_flags {
 	NFT_OPTIMIZE_ENABLED		= 0x1,
+	NFT_OPTIMIZE_REORDER		= 0x2,
+	NFT_OPTIMIZE_STATS		= 0x4,
+	NFT_OPTIMIZE_SETS		= 0x8,
+	NFT_OPTIMIZE_PROFILE		= 0x10,
 };
 
 uint32_t nft_ctx_get_optimize(struct nft_ctx *ctx);
 void nft_ctx_set_optimize(struct nft_ctx *ctx, uint32_t flags);
 
+unsigned int nft_ctx_get_jobs(struct nft_ctx *ctx);
+void nft_ctx_set_jobs(struct nft_ctx *ctx, unsigned int jobs);
+
+const char *nft_ctx_get_compile_output(struct nft_ctx *ctx);
+int nft_ctx_set_compile_output(struct nft_ctx *ctx, const char *filename);
+
+const char *nft_ctx_get_offline(struct nft_ctx *ctx);
+int nft_ctx_set_offline(struct nft_ctx *ctx, const char *filename);
+
 enum {
 	NFT_CTX_INPUT_NO_DNS		= (1 << 0),
 	NFT_CTX_INPUT_JSON		= (1 << 1),
+	NFT_CTX_INPUT_SPLIT_ELEMENTS	= (1 << 2),
+	NFT_CTX_INPUT_DIFF		= (1 << 3),
+	NFT_CTX_INPUT_IF_CHANGED	= (1 << 4),
+	NFT_CTX_INPUT_SET_HINTS		= (1 << 5),
 };
 
 unsigned int nft_ctx_input_get_flags(struct nft_ctx *ctx);
@@ -72,6 +95,8 @@ enum {
 					   NFT_CTX_OUTPUT_NUMERIC_SYMBOL |
 					   NFT_CTX_OUTPUT_NUMERIC_TIME),
 	NFT_CTX_OUTPUT_TERSE		= (1 << 11),
+	NFT_CTX_OUTPUT_ECHO_HANDLES	= (1 << 12),
+	NFT_CTX_OUTPUT_CBOR		= (1 << 13),
 };
 
 unsigned int nft_ctx_output_get_flags(struct nft_ctx *ctx);
@@ -80,11 +105,44 @@ void nft_ctx_output_set_flags(struct nft_ctx *ctx, unsigned int flags);
 unsigned int nft_ctx_output_get_debug(struct nft_ctx *ctx);
 void nft_ctx_output_set_debug(struct nft_ctx *ctx, unsigned int mask);
 
+struct nft_timing_stat {
+	const char	*phase;
+	uint64_t	nsec;
+	uint32_t	count;
+	uint64_t	alloc_bytes;
+	uint64_t	alloc_objects;
+	uint64_t	max_rss_kb;
+};
+
+int nft_ctx_get_timing(struct nft_ctx *ctx, struct nft_timing_stat *stats,
+		       unsigned int num);
+
+enum nft_echo_type {
+	NFT_ECHO_TABLE,
+	NFT_ECHO_CHAIN,
+	NFT_ECHO_RULE,
+	NFT_ECHO_SET,
+	NFT_ECHO_OBJ,
+	NFT_ECHO_FLOWTABLE,
+};
+
+struct nft_echo_handle {
+	unsigned int		cmd;
+	enum nft_echo_type	type;
+	uint64_t		handle;
+};
+
+const struct nft_echo_handle *nft_ctx_get_echo_handles(struct nft_ctx *ctx,
+							unsigned int *num);
+
 FILE *nft_ctx_set_output(struct nft_ctx *ctx, FILE *fp);
 int nft_ctx_buffer_output(struct nft_ctx *ctx);
 int nft_ctx_unbuffer_output(struct nft_ctx *ctx);
 const char *nft_ctx_get_output_buffer(struct nft_ctx *ctx);
 
+typedef int (*nft_output_cb_t)(const char *buf, size_t len, void *data);
+int nft_ctx_set_output_cb(struct nft_ctx *ctx, nft_output_cb_t cb, void *data);
+
 FILE *nft_ctx_set_error(struct nft_ctx *ctx, FILE *fp);
 int nft_ctx_buffer_error(struct nft_ctx *ctx);
 int nft_ctx_unbuffer_error(struct nft_ctx *ctx);
@@ -98,6 +156,145 @@ void nft_ctx_clear_vars(struct nft_ctx *ctx);
 
 int nft_run_cmd_from_buffer(struct nft_ctx *nft, const char *buf);
 int nft_run_cmd_from_filename(struct nft_ctx *nft, const char *filename);
+int nft_save_raw(struct nft_ctx *nft, const char *filename);
+
+enum {
+	NFT_ELEMENTS_BINARY	= (1 << 0),
+};
+
+int nft_run_add_elements_from_filename(struct nft_ctx *nft, const char *family,
+				       const char *table, const char *set,
+				       const char *filename, const char *format,
+				       uint32_t flags);
+
+struct nft_elements_opts {
+	const void	*data;
+	size_t		data_len;
+	const uint64_t	*timeouts;
+	const uint64_t	*packets;
+	const uint64_t	*bytes;
+};
+
+int nft_set_elements_add(struct nft_ctx *nft, const char *family,
+			 const char *table, const char *set,
+			 const void *keys, size_t key_len, size_t n,
+			 const struct nft_elements_opts *opts);
+int nft_set_elements_delete(struct nft_ctx *nft, const char *family,
+			    const char *table, const char *set,
+			    const void *keys, size_t key_len, size_t n);
+int nft_set_elements_get(struct nft_ctx *nft, const char *family,
+			 const char *table, const char *set,
+			 const void *keys, size_t key_len, size_t n,
+			 bool *found);
+int nft_set_elements_query(struct nft_ctx *nft, const char *family,
+			   const char *table, const char *set,
+			   const void *keys, size_t key_len, size_t n,
+			   uint8_t *bitmap);
+
+enum nft_counter_type {
+	NFT_COUNTER_OBJ		= 0,
+	NFT_COUNTER_QUOTA,
+	NFT_COUNTER_RULE,
+};
+
+struct nft_counter {
+	uint32_t	type;
+	uint32_t	family;
+	char		*table;
+	char		*name;
+	uint64_t	handle;
+	uint64_t	packets;
+	uint64_t	bytes;
+	uint64_t	quota;
+};
+
+enum {
+	NFT_COUNTERS_RULES	= (1 << 0),
+	NFT_COUNTERS_RESET	= (1 << 1),
+};
+
+int nft_counters_dump(struct nft_ctx *nft, const char *family,
+		      const char *table, unsigned int flags,
+		      struct nft_counter **counters, size_t *n);
+void nft_counters_free(struct nft_counter *counters, size_t n);
+
+struct nft_set_counter {
+	const void	*key;
+	size_t		key_len;
+	uint64_t	packets;
+	uint64_t	bytes;
+};
+
+typedef void (*nft_set_counter_cb_t)(const struct nft_set_counter *counter,
+				     void *data);
+
+int nft_set_counters_dump(struct nft_ctx *nft, const char *family,
+			  const char *table, const char *set,
+			  unsigned int flags, nft_set_counter_cb_t cb,
+			  void *data);
+
+struct nft_set_stat {
+	uint32_t	family;
+	char		*table;
+	char		*name;
+	uint32_t	flags;
+	uint32_t	key_len;
+	uint32_t	data_len;
+	uint32_t	size;
+	uint64_t	elements;
+	uint64_t	memory;
+};
+
+int nft_set_stats_dump(struct nft_ctx *nft, const char *family,
+		       const char *table, struct nft_set_stat **stats,
+		       size_t *n);
+void nft_set_stats_free(struct nft_set_stat *stats, size_t n);
+
+int nft_ruleset_changes(struct nft_ctx *nft, uint32_t genid, char **changes);
+
+struct nft_stmt;
+
+struct nft_stmt *nft_prepare(struct nft_ctx *nft, const char *buf);
+int nft_bind_str(struct nft_stmt *stmt, const char *name, const char *value);
+int nft_bind_u64(struct nft_stmt *stmt, const char *name, uint64_t value);
+int nft_bind_data(struct nft_stmt *stmt, const char *name,
+		  const void *data, size_t len);
+int nft_bind_var(struct nft_stmt *stmt, const char *var);
+int nft_execute(struct nft_stmt *stmt);
+int nft_execute_on(struct nft_stmt *stmt, struct nft_ctx *nft);
+void nft_stmt_free(struct nft_stmt *stmt);
+
+struct nft_txn;
+
+struct nft_txn *nft_txn_begin(struct nft_ctx *nft);
+int nft_txn_add_cmd(struct nft_txn *txn, const char *buf);
+int nft_txn_commit(struct nft_txn *txn);
+void nft_txn_abort(struct nft_txn *txn);
+
+struct nft_async;
+
+typedef void (*nft_async_cb_t)(struct nft_async *op, int rc,
+			       const char *output, const char *error,
+			       void *data);
+
+int nft_ctx_async_fd(struct nft_ctx *nft);
+struct nft_async *nft_async_submit(struct nft_ctx *nft, const char *buf,
+				   nft_async_cb_t cb, void *data);
+int nft_async_cancel(struct nft_async *op);
+int nft_async_process(struct nft_ctx *nft);
+
+int nft_ctx_set_netns(struct nft_ctx *ctx, const char *path);
+
+struct nft_run_result {
+	int	rc;
+	char	*output;
+	char	*error;
+};
+
+int nft_run_cmd_parallel(struct nft_ctx **ctxs, unsigned int num,
+			 const char *buf, unsigned int jobs,
+			 struct nft_run_result **results);
+void nft_run_results_free(struct nft_run_result *results, unsigned int num);
 
 #ifdef __cplusplus
 } /* extern "C" */
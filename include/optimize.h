@@ -0,0 +1,35 @@
+#ifndef NFTABLES_OPTIMIZE_H
+#define NFTABLES_OPTIMIZE_H
+
+#include <list.h>
+
+/*
+ * Static per-packet cost of a chain, estimated from the ruleset as it is
+ * parsed: implicit protocol dependencies are not accounted for.
+ */
+struct chain_cost {
+	unsigned int		rules;
+	unsigned int		exprs;
+	unsigned int		loads;
+	unsigned int		lookups;
+	unsigned int		worst_rules;
+	unsigned int		depth;
+};
+
+struct table;
+struct chain;
+
+void chain_cost_estimate(const struct table *table, const struct chain *chain,
+			 struct chain_cost *cost);
+
+struct optimize_stats {
+	struct list_head	list;
+	const char		*family;
+	const char		*table;
+	const char		*chain;
+	const char		*hook;
+	struct chain_cost	before;
+	struct chain_cost	after;
+};
+
+#endif /* NFTABLES_OPTIMIZE_H */
@@ -1,6 +1,8 @@
 #ifndef _NFT_OWNER_H_
 #define _NFT_OWNER_H_
 
-char *get_progname(uint32_t portid);
+#define NFT_PROGNAME_MAXLEN	64
+
+char *get_progname(uint32_t portid, char *buf, size_t len);
 
 #endif
@@ -0,0 +1,7 @@
+#ifndef NFTABLES_PARALLEL_H
+#define NFTABLES_PARALLEL_H
+
+void nft_parallel_for(unsigned int jobs, unsigned int num,
+		      void (*fn)(void *data, unsigned int i), void *data);
+
+#endif /* NFTABLES_PARALLEL_H */
@@ -28,6 +28,11 @@ struct parser_state {
 	unsigned int			startcond_type;
 	struct list_head		*cmds;
 	unsigned int			*startcond_active;
+
+	/* last address literal returned by the scanner, see symbol_expr */
+	char				literal_text[INET6_ADDRSTRLEN];
+	enum symbol_literal_types	literal_type;
+	union symbol_literal		literal;
 };
 
 enum startcond_type {
@@ -36,6 +41,7 @@ enum startcond_type {
 	PARSER_SC_AT,
 	PARSER_SC_CT,
 	PARSER_SC_COUNTER,
+	PARSER_SC_ELEMENT,
 	PARSER_SC_ETH,
 	PARSER_SC_GRE,
 	PARSER_SC_ICMP,
@@ -58,6 +64,7 @@ enum startcond_type {
 	PARSER_SC_CMD_IMPORT,
 	PARSER_SC_CMD_LIST,
 	PARSER_SC_CMD_MONITOR,
+	PARSER_SC_CMD_PROFILE,
 	PARSER_SC_CMD_RESET,
 	PARSER_SC_EXPR_AH,
 	PARSER_SC_EXPR_COMP,
@@ -100,6 +107,8 @@ extern int nft_parse(struct nft_ctx *ctx, void *, struct parser_state *state);
 
 extern void *scanner_init(struct parser_state *state);
 extern void scanner_destroy(struct nft_ctx *nft);
+extern void scanner_free(void *scanner);
+extern void scanner_include_cache_free(struct nft_ctx *nft);
 
 extern int scanner_read_file(struct nft_ctx *nft, const char *filename,
 			     const struct location *loc);
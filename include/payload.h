@@ -20,6 +20,10 @@ int payload_gen_inner_dependency(struct eval_ctx *ctx, const struct expr *expr,
 extern int payload_gen_icmp_dependency(struct eval_ctx *ctx,
 				       const struct expr *expr,
 				       struct stmt **res);
+
+struct payload_dep_cache;
+struct payload_dep_cache *payload_dep_cache_alloc(void);
+void payload_dep_cache_free(struct payload_dep_cache *cache);
 extern int exthdr_gen_dependency(struct eval_ctx *ctx, const struct expr *expr,
 				 const struct proto_desc *dependency,
 				 enum proto_bases pb, struct stmt **res);
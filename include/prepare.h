@@ -0,0 +1,46 @@
+#ifndef NFTABLES_PREPARE_H
+#define NFTABLES_PREPARE_H
+
+#include <list.h>
+
+struct cmd;
+struct expr;
+struct nft_ctx;
+struct parser_state;
+
+/* One placeholder occurrence, @expr is the constant in the evaluated
+ * commands that binding updates in place, @cmd is the command it is in.
+ */
+struct nft_param {
+	struct list_head	list;
+	const char		*name;
+	struct expr		*expr;
+	const struct cmd	*cmd;
+	bool			bound;
+};
+
+struct nft_stmt {
+	struct nft_ctx		*nft;
+	struct parser_state	*state;
+	void			*scanner;
+	char			*buf;
+	struct list_head	cmds;
+	struct list_head	params;
+};
+
+void nft_param_add(struct list_head *params, const char *name,
+		   struct expr *expr, const struct cmd *cmd);
+int nft_stmt_check(struct nft_stmt *stmt, struct list_head *msgs);
+int nft_stmt_check_bound(struct nft_stmt *stmt, struct list_head *msgs);
+void nft_stmt_release(struct nft_stmt *stmt);
+
+int nft_stmt_bind_str(struct nft_stmt *stmt, const char *name,
+		      const char *value, struct list_head *msgs);
+int nft_stmt_bind_u64(struct nft_stmt *stmt, const char *name,
+		      uint64_t value, struct list_head *msgs);
+int nft_stmt_bind_var(struct nft_stmt *stmt, const char *var,
+		      struct list_head *msgs);
+int nft_stmt_bind_data(struct nft_stmt *stmt, const char *name,
+		       const void *data, size_t len, struct list_head *msgs);
+
+#endif /* NFTABLES_PREPARE_H */
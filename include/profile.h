@@ -0,0 +1,12 @@
+#ifndef NFTABLES_PROFILE_H
+#define NFTABLES_PROFILE_H
+
+#include <stdbool.h>
+
+struct netlink_ctx;
+struct cmd;
+
+int profile_rules(struct netlink_ctx *ctx, const struct cmd *cmd, bool start);
+void profile_report(struct netlink_ctx *ctx, const struct cmd *cmd);
+
+#endif /* NFTABLES_PROFILE_H */
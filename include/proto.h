@@ -231,6 +231,8 @@ const struct proto_desc *proto_find_inner(uint32_t type, uint32_t hdrsize,
 					  uint32_t flags);
 
 extern const struct proto_desc *proto_find_desc(enum proto_desc_id desc_id);
+extern int proto_find_tmpl(const struct proto_desc *desc, unsigned int offset,
+			   unsigned int len, int prev);
 
 enum eth_hdr_fields {
 	ETHHDR_INVALID,
@@ -0,0 +1,31 @@
+#ifndef NFTABLES_RESOLVE_H
+#define NFTABLES_RESOLVE_H
+
+#include <netinet/in.h>
+
+struct nft_ctx;
+struct list_head;
+struct nft_resolver;
+struct cmd;
+
+union nft_resolve_addr {
+	struct in_addr	in;
+	struct in6_addr	in6;
+};
+
+struct nft_resolver *nft_resolver_alloc(void);
+void nft_resolver_free(struct nft_resolver *resolver);
+
+void nft_resolver_prefetch(struct nft_ctx *nft, struct list_head *cmds);
+int nft_resolve(struct nft_resolver *resolver, const char *name, int family,
+		union nft_resolve_addr *addr, unsigned int *naddrs);
+
+void nft_resolver_prefetch_names(struct nft_ctx *nft, const struct cmd *cmd);
+bool nft_resolver_name(struct nft_resolver *resolver, int family,
+		       const void *addr, char *buf, size_t len);
+bool nft_resolver_service(struct nft_resolver *resolver, uint16_t port,
+			  char *buf, size_t len);
+bool nft_resolver_cgroup(struct nft_resolver *resolver, uint64_t id,
+			 char *buf, size_t len);
+
+#endif
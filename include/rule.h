@@ -91,36 +91,48 @@ extern void handle_free(struct handle *h);
  * struct scope
  *
  * @parent:	pointer to parent scope
- * @symbols:	symbols bound in the scope
+ * @symbols:	symbols bound in the scope, most recently bound first
+ * @hash:	hash index of @symbols, allocated once the scope grows large
+ * @hash_size:	number of buckets in @hash
+ * @num_symbols: number of symbols in @symbols
  */
 struct scope {
 	const struct scope	*parent;
 	struct list_head	symbols;
+	struct hlist_head	*hash;
+	unsigned int		hash_size;
+	unsigned int		num_symbols;
 };
 
 extern struct scope *scope_alloc(void);
 extern struct scope *scope_init(struct scope *scope, const struct scope *parent);
-extern void scope_release(const struct scope *scope);
+extern void scope_release(struct scope *scope);
 extern void scope_free(struct scope *scope);
 
 /**
  * struct symbol
  *
  * @list:	scope symbol list node
+ * @hnode:	scope symbol hash node
  * @identifier:	identifier
  * @expr:	initializer
  * @refcnt:	reference counter
+ * @eval:	initializer as evaluated by a previous expansion
+ * @eval_ectx:	expression context @eval was evaluated in
  */
 struct symbol {
 	struct list_head	list;
+	struct hlist_node	hnode;
 	const char		*identifier;
 	struct expr		*expr;
 	int			refcnt;
+	struct expr		*eval;
+	struct expr_ctx		*eval_ectx;
 };
 
 extern void symbol_bind(struct scope *scope, const char *identifier,
 			struct expr *expr);
-extern int symbol_unbind(const struct scope *scope, const char *identifier);
+extern int symbol_unbind(struct scope *scope, const char *identifier);
 extern struct symbol *symbol_lookup(const struct scope *scope,
 				    const char *identifier);
 struct symbol *symbol_lookup_fuzzy(const struct scope *scope,
@@ -169,6 +181,7 @@ struct table {
 	unsigned int		refcnt;
 	uint32_t		owner;
 	const char		*comment;
+	uint64_t		fingerprint;
 	bool			has_xt_stmts;
 };
 
@@ -235,6 +248,8 @@ struct chain_type_spec {
  * @dev:	device (if any)
  * @rules:	rules contained in the chain
  */
+struct rule_index;
+
 struct chain {
 	struct list_head	list;
 	struct cache_item	cache;
@@ -255,6 +270,7 @@ struct chain {
 	};
 	struct scope		scope;
 	struct list_head	rules;
+	struct rule_index	*rule_index;
 };
 
 #define STD_PRIO_BUFSIZE 100
@@ -292,6 +308,7 @@ extern void chain_rules_print(const struct chain *chain,
  */
 struct rule {
 	struct list_head	list;
+	struct hlist_node	hnode;
 	struct handle		handle;
 	struct location		location;
 	struct list_head	stmts;
@@ -305,7 +322,7 @@ extern struct rule *rule_alloc(const struct location *loc,
 extern struct rule *rule_get(struct rule *rule);
 extern void rule_free(struct rule *rule);
 extern void rule_print(const struct rule *rule, struct output_ctx *octx);
-extern struct rule *rule_lookup(const struct chain *chain, uint64_t handle);
+extern struct rule *rule_lookup(struct chain *chain, uint64_t handle);
 extern struct rule *rule_lookup_by_index(const struct chain *chain,
 					 uint64_t index);
 void rule_stmt_append(struct rule *rule, struct stmt *stmt);
@@ -327,6 +344,8 @@ void rule_stmt_insert_at(struct rule *rule, struct stmt *nstmt,
  * @objtype:	mapping object type
  * @existing_set: reference to existing set in the kernel
  * @init:	initializer
+ * @index:	sorted interval boundaries of @init, see intervals.c
+ * @data_index: data shared by cached map elements, see netlink.c
  * @rg_cache:	cached range element (left)
  * @policy:	set mechanism policy
  * @automerge:	merge adjacents and overlapping elements, if possible
@@ -350,6 +369,9 @@ struct set {
 	uint32_t		objtype;
 	struct set		*existing_set;
 	struct expr		*init;
+	struct interval_index	*index;
+	struct setelem_index	*elem_index;
+	struct setelem_data_index *data_index;
 	struct expr		*rg_cache;
 	uint32_t		policy;
 	struct list_head	stmt_list;
@@ -363,6 +385,47 @@ struct set {
 		uint8_t		field_len[NFT_REG32_COUNT];
 		uint8_t		field_count;
 	} desc;
+	struct {
+		uint64_t	size;
+		struct expr	*backends;
+	} maglev;
+};
+
+enum set_window_by {
+	SET_WINDOW_BY_PACKETS,
+	SET_WINDOW_BY_BYTES,
+};
+
+/**
+ * struct set_window - elements to show in a set listing
+ *
+ * @offset:	elements to skip
+ * @limit:	elements to show after these
+ * @count:	only show the number of elements
+ * @top:	only show the elements with the highest counters, this many
+ * @by:	counter value that ranks the elements
+ *
+ * Given as the argument of a list set, list map or list meter command.
+ */
+struct set_window {
+	uint64_t		offset;
+	uint64_t		limit;
+	bool			count;
+	uint64_t		top;
+	enum set_window_by	by;
+};
+
+/**
+ * struct set_stats - fill level of a set
+ *
+ * @elements:	elements in the kernel, an interval counts once
+ * @memory:	estimated kernel memory used by these elements, in bytes
+ *
+ * Shown by list sets, list maps and list meters with --stats.
+ */
+struct set_stats {
+	uint64_t		elements;
+	uint64_t		memory;
 };
 
 extern struct set *set_alloc(const struct location *loc);
@@ -377,6 +440,13 @@ extern struct set *set_lookup_fuzzy(const char *set_name,
 extern const char *set_policy2str(uint32_t policy);
 extern void set_print(const struct set *set, struct output_ctx *octx);
 extern void set_print_plain(const struct set *s, struct output_ctx *octx);
+extern void set_print_window(const struct set *set,
+			     const struct set_window *window, uint64_t count,
+			     struct output_ctx *octx);
+extern void set_print_stats(const struct set *set,
+			    const struct set_stats *stats,
+			    struct output_ctx *octx);
+extern uint64_t set_memory_estimate(const struct set *set, uint64_t elements);
 
 static inline bool set_is_datamap(uint32_t set_flags)
 {
@@ -571,6 +641,7 @@ void flowtable_print(const struct flowtable *n, struct output_ctx *octx);
  * @CMD_MONITOR:	event listener
  * @CMD_DESCRIBE:	describe an expression
  * @CMD_DESTROY:	destroy object
+ * @CMD_PROFILE:	count the packets that each rule matches
  */
 enum cmd_ops {
 	CMD_INVALID,
@@ -589,6 +660,7 @@ enum cmd_ops {
 	CMD_MONITOR,
 	CMD_DESCRIBE,
 	CMD_DESTROY,
+	CMD_PROFILE,
 };
 
 /**
@@ -609,6 +681,7 @@ enum cmd_ops {
  * @CMD_OBJ_EXPR:	expression
  * @CMD_OBJ_MONITOR:	monitor
  * @CMD_OBJ_MARKUP:    import/export
+ * @CMD_OBJ_PROFILE:	rule profiling
  * @CMD_OBJ_METER:	meter
  * @CMD_OBJ_METERS:	meters
  * @CMD_OBJ_COUNTER:	counter
@@ -637,6 +710,7 @@ enum cmd_obj {
 	CMD_OBJ_EXPR,
 	CMD_OBJ_MONITOR,
 	CMD_OBJ_MARKUP,
+	CMD_OBJ_PROFILE,
 	CMD_OBJ_METER,
 	CMD_OBJ_METERS,
 	CMD_OBJ_MAP,
@@ -669,6 +743,19 @@ struct markup {
 struct markup *markup_alloc(uint32_t format);
 void markup_free(struct markup *m);
 
+enum {
+	CMD_PROFILE_START,
+	CMD_PROFILE_STOP,
+	CMD_PROFILE_REPORT,
+};
+
+struct profile {
+	uint32_t	action;
+};
+
+struct profile *profile_alloc(uint32_t action);
+void profile_free(struct profile *p);
+
 enum {
 	CMD_MONITOR_OBJ_ANY,
 	CMD_MONITOR_OBJ_TABLES,
@@ -678,6 +765,7 @@ enum {
 	CMD_MONITOR_OBJ_ELEMS,
 	CMD_MONITOR_OBJ_RULESET,
 	CMD_MONITOR_OBJ_TRACE,
+	CMD_MONITOR_OBJ_REPLICATE,
 	CMD_MONITOR_OBJ_MAX
 };
 
@@ -687,6 +775,7 @@ struct monitor {
 	uint32_t	flags;
 	uint32_t	type;
 	const char	*event;
+	uint64_t	aggregate;
 };
 
 struct monitor *monitor_alloc(uint32_t format, uint32_t type, const char *event);
@@ -720,6 +809,8 @@ struct cmd {
 	struct handle		handle;
 	uint32_t		seqnum_from;
 	uint32_t		seqnum_to;
+	/* position of the input command this one comes from */
+	unsigned int		index;
 	union {
 		void		*data;
 		struct expr	*expr;
@@ -734,8 +825,11 @@ struct cmd {
 		struct flowtable *flowtable;
 		struct monitor	*monitor;
 		struct markup	*markup;
+		struct profile	*profile;
 		struct obj	*object;
 	};
+	/* handle list of a bulk delete, destroy or replace rule command */
+	struct expr		*handles;
 	struct nlerr_loc	*attr;
 	uint32_t		attr_array_len;
 	uint32_t		num_attrs;
@@ -788,6 +882,10 @@ struct eval_ctx {
 
 extern int cmd_evaluate(struct eval_ctx *ctx, struct cmd *cmd);
 
+struct anon_set_cache;
+extern struct anon_set_cache *anon_set_cache_alloc(void);
+extern void anon_set_cache_free(struct anon_set_cache *cache);
+
 extern struct error_record *rule_postprocess(struct rule *rule);
 
 struct netlink_ctx;
@@ -0,0 +1,12 @@
+#ifndef NFTABLES_SETELEM_FILE_H
+#define NFTABLES_SETELEM_FILE_H
+
+struct expr;
+struct location;
+struct list_head;
+
+struct expr *setelem_file_load(const struct location *loc,
+			       const char *filename, const char *format,
+			       bool binary, struct list_head *msgs);
+
+#endif
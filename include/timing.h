@@ -0,0 +1,60 @@
+#ifndef NFTABLES_TIMING_H
+#define NFTABLES_TIMING_H
+
+#include <time.h>
+#include <nftables.h>
+
+/*
+ * Time and memory spent per phase of a run, with NFT_DEBUG_TIMING and
+ * NFT_DEBUG_MEMORY. Phases may nest, intervals are part of evaluation and
+ * send includes the kernel processing the batch. Allocations are accounted
+ * to the innermost phase.
+ */
+enum nft_timing_phase {
+	NFT_TIMING_PARSE,
+	NFT_TIMING_CACHE,
+	NFT_TIMING_EVAL,
+	NFT_TIMING_INTERVALS,
+	NFT_TIMING_DIFF,
+	NFT_TIMING_BATCH,
+	NFT_TIMING_SEND,
+	NFT_TIMING_ACK,
+	__NFT_TIMING_MAX
+};
+
+#define NFT_DEBUG_TIMING_MASK	(NFT_DEBUG_TIMING | NFT_DEBUG_MEMORY)
+
+struct nft_timing {
+	uint64_t		nsec[__NFT_TIMING_MAX];
+	uint32_t		count[__NFT_TIMING_MAX];
+	struct mem_stats	mem[__NFT_TIMING_MAX];
+	/* peak resident set size at the end of the phase, in kbytes */
+	uint64_t		max_rss[__NFT_TIMING_MAX];
+};
+
+struct nft_timing_span {
+	enum nft_timing_phase	phase;
+	struct timespec		start;
+	struct mem_stats	*prev;
+};
+
+void __nft_timing_start(struct nft_ctx *nft, enum nft_timing_phase phase,
+			struct nft_timing_span *span);
+
+static inline bool nft_timing_start(struct nft_ctx *nft,
+				    enum nft_timing_phase phase,
+				    struct nft_timing_span *span)
+{
+	if (!(nft->debug_mask & NFT_DEBUG_TIMING_MASK))
+		return false;
+
+	__nft_timing_start(nft, phase, span);
+	return true;
+}
+
+void nft_timing_stop(struct nft_ctx *nft, const struct nft_timing_span *span,
+		     uint32_t count);
+void nft_timing_reset(struct nft_ctx *nft);
+void nft_timing_print(struct nft_ctx *nft);
+
+#endif /* NFTABLES_TIMING_H */
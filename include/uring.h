@@ -0,0 +1,38 @@
+#ifndef NFTABLES_URING_H
+#define NFTABLES_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct msghdr;
+struct nft_uring;
+
+/* Called for each datagram, return > 0 to continue, 0 or -1 to stop. */
+typedef int (*nft_uring_cb_t)(const void *buf, size_t len, void *data);
+
+#ifdef HAVE_IO_URING
+struct nft_uring *nft_uring_open(size_t bufsiz);
+void nft_uring_free(struct nft_uring *ring);
+int nft_uring_sendmsg(struct nft_uring *ring, int fd, const struct msghdr *msg);
+int nft_uring_recv(struct nft_uring *ring, int fd, nft_uring_cb_t cb,
+		   void *data, unsigned int *calls);
+#else
+static inline struct nft_uring *nft_uring_open(size_t bufsiz)
+{
+	return NULL;
+}
+static inline void nft_uring_free(struct nft_uring *ring) {}
+static inline int nft_uring_sendmsg(struct nft_uring *ring, int fd,
+				    const struct msghdr *msg)
+{
+	return -1;
+}
+static inline int nft_uring_recv(struct nft_uring *ring, int fd,
+				 nft_uring_cb_t cb, void *data,
+				 unsigned int *calls)
+{
+	return -1;
+}
+#endif
+
+#endif /* NFTABLES_URING_H */
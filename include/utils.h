@@ -142,6 +142,17 @@ extern void __memory_allocation_error(const char *filename, uint32_t line) __nor
 #define memory_allocation_error()		\
 	__memory_allocation_error(__FILE__, __LINE__);
 
+/*
+ * Allocations through the functions below are counted in mem_stats if set,
+ * per thread. Memory released with free() is not accounted for.
+ */
+struct mem_stats {
+	uint64_t	bytes;
+	uint64_t	objects;
+};
+
+extern __thread struct mem_stats *mem_stats;
+
 extern void *xmalloc(size_t size);
 extern void *xmalloc_array(size_t nmemb, size_t size);
 extern void *xrealloc(void *ptr, size_t size);
@@ -151,4 +162,19 @@ extern char *xstrdup(const char *s);
 extern void xstrunescape(const char *in, char *out);
 extern int round_pow_2(unsigned int value);
 
+/*
+ * Free list of fixed size nodes. Released nodes are kept for reuse, up to
+ * NODE_CACHE_MAX of them, instead of going back to malloc().
+ */
+#define NODE_CACHE_MAX	4096
+
+struct node_cache {
+	void		*head;
+	unsigned int	count;
+};
+
+extern void *node_cache_zalloc(struct node_cache *cache, size_t size);
+extern void node_cache_free(struct node_cache *cache, void *ptr);
+extern void node_cache_release(struct node_cache *cache);
+
 #endif /* NFTABLES_UTILS_H */
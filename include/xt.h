@@ -10,6 +10,7 @@ struct output_ctx;
 
 void xt_stmt_xlate(const struct stmt *stmt, struct output_ctx *octx);
 void xt_stmt_destroy(struct stmt *stmt);
+void xt_xlate_cache_free(struct output_ctx *octx);
 
 void netlink_parse_target(struct netlink_parse_ctx *ctx,
 			  const struct location *loc,
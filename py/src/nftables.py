@@ -15,12 +15,92 @@
 # Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
 import json
+from array import array
 from ctypes import *
 import sys
 import os
 
 NFTABLES_VERSION = "0.1"
 
+class NftElementsOpts(Structure):
+    """Mirror of struct nft_elements_opts in libnftables.h"""
+    _fields_ = [("data", c_void_p),
+                ("data_len", c_size_t),
+                ("timeouts", POINTER(c_uint64)),
+                ("packets", POINTER(c_uint64)),
+                ("bytes", POINTER(c_uint64))]
+
+class NftEchoHandle(Structure):
+    """Mirror of struct nft_echo_handle in libnftables.h"""
+    _fields_ = [("cmd", c_uint),
+                ("type", c_int),
+                ("handle", c_uint64)]
+
+class NftCounter(Structure):
+    """Mirror of struct nft_counter in libnftables.h"""
+    _fields_ = [("type", c_uint32),
+                ("family", c_uint32),
+                ("table", c_char_p),
+                ("name", c_char_p),
+                ("handle", c_uint64),
+                ("packets", c_uint64),
+                ("bytes", c_uint64),
+                ("quota", c_uint64)]
+
+class NftSetCounter(Structure):
+    """Mirror of struct nft_set_counter in libnftables.h"""
+    _fields_ = [("key", c_void_p),
+                ("key_len", c_size_t),
+                ("packets", c_uint64),
+                ("bytes", c_uint64)]
+
+NftSetCounterCb = CFUNCTYPE(None, POINTER(NftSetCounter), c_void_p)
+
+class NftStatement:
+    """A prepared statement, as returned by Nftables.prepare()"""
+
+    def __init__(self, nft, stmt):
+        self.__nft = nft
+        self.__stmt = stmt
+
+    def __del__(self):
+        self.free()
+
+    def free(self):
+        """Free the statement, it cannot be executed afterwards."""
+        if self.__stmt is not None:
+            self.__nft.nft_stmt_free(self.__stmt)
+            self.__stmt = None
+
+    def bind(self, name, value):
+        """Bind a value to the placeholder name, given without the '$'.
+
+        A str is parsed as the type of the placeholder, an int sets an
+        integer placeholder and a bytes-like object (bytes, bytearray,
+        memoryview, array) is copied as is, in the byte order the kernel
+        uses for the type of the placeholder.
+
+        Returns True on success, False otherwise.
+        """
+        name = name.encode("utf-8")
+        if isinstance(value, str):
+            rc = self.__nft.nft_bind_str(self.__stmt, name,
+                                         value.encode("utf-8"))
+        elif isinstance(value, int):
+            rc = self.__nft.nft_bind_u64(self.__stmt, name, value)
+        else:
+            buf, size = self.__nft._buffer(value)
+            rc = self.__nft.nft_bind_data(self.__stmt, name, buf, size)
+        return rc == 0
+
+    def execute(self):
+        """Send the prepared commands with the values bound at this moment.
+
+        Returns a tuple (rc, output, error) as Nftables.cmd() does.
+        """
+        rc = self.__nft.nft_execute(self.__stmt)
+        return self.__nft._elements_result(rc)
+
 class SchemaValidator:
     """Libnftables JSON validator using jsonschema"""
 
@@ -40,6 +120,10 @@ class Nftables:
     input_flags = {
         "no-dns": 0x1,
         "json": 0x2,
+        "split-elements": 0x4,
+        "diff": 0x8,
+        "if-changed": 0x10,
+        "set-hints": 0x20,
     }
 
     debug_flags = {
@@ -50,6 +134,8 @@ class Nftables:
         "mnl":       0x10,
         "proto-ctx": 0x20,
         "segtree":   0x40,
+        "timing":    0x80,
+        "memory":    0x100,
     }
 
     output_flags = {
@@ -65,6 +151,16 @@ class Nftables:
         "numeric_symbol": (1 << 9),
         "numeric_time":   (1 << 10),
         "terse":          (1 << 11),
+        "echo_handles":   (1 << 12),
+    }
+
+    echo_types = ["table", "chain", "rule", "set", "obj", "flowtable"]
+
+    counter_types = ["counter", "quota", "rule"]
+
+    counters_flags = {
+        "rules": 0x1,
+        "reset": 0x2,
     }
 
     validator = None
@@ -111,6 +207,10 @@ class Nftables:
         self.nft_ctx_output_set_debug = lib.nft_ctx_output_set_debug
         self.nft_ctx_output_set_debug.argtypes = [c_void_p, c_int]
 
+        self.nft_ctx_get_echo_handles = lib.nft_ctx_get_echo_handles
+        self.nft_ctx_get_echo_handles.restype = POINTER(NftEchoHandle)
+        self.nft_ctx_get_echo_handles.argtypes = [c_void_p, POINTER(c_uint)]
+
         self.nft_ctx_buffer_output = lib.nft_ctx_buffer_output
         self.nft_ctx_buffer_output.restype = c_int
         self.nft_ctx_buffer_output.argtypes = [c_void_p]
@@ -156,6 +256,69 @@ class Nftables:
         self.nft_ctx_clear_vars = lib.nft_ctx_clear_vars
         self.nft_ctx_clear_vars.argtypes = [c_void_p]
 
+        self.nft_set_elements_add = lib.nft_set_elements_add
+        self.nft_set_elements_add.restype = c_int
+        self.nft_set_elements_add.argtypes = [c_void_p, c_char_p, c_char_p,
+                                              c_char_p, c_void_p, c_size_t,
+                                              c_size_t,
+                                              POINTER(NftElementsOpts)]
+
+        self.nft_set_elements_delete = lib.nft_set_elements_delete
+        self.nft_set_elements_delete.restype = c_int
+        self.nft_set_elements_delete.argtypes = [c_void_p, c_char_p, c_char_p,
+                                                 c_char_p, c_void_p, c_size_t,
+                                                 c_size_t]
+
+        self.nft_set_elements_get = lib.nft_set_elements_get
+        self.nft_set_elements_get.restype = c_int
+        self.nft_set_elements_get.argtypes = [c_void_p, c_char_p, c_char_p,
+                                              c_char_p, c_void_p, c_size_t,
+                                              c_size_t, POINTER(c_bool)]
+
+        self.nft_set_elements_query = lib.nft_set_elements_query
+        self.nft_set_elements_query.restype = c_int
+        self.nft_set_elements_query.argtypes = [c_void_p, c_char_p, c_char_p,
+                                                c_char_p, c_void_p, c_size_t,
+                                                c_size_t, c_char_p]
+
+        self.nft_prepare = lib.nft_prepare
+        self.nft_prepare.restype = c_void_p
+        self.nft_prepare.argtypes = [c_void_p, c_char_p]
+
+        self.nft_bind_str = lib.nft_bind_str
+        self.nft_bind_str.restype = c_int
+        self.nft_bind_str.argtypes = [c_void_p, c_char_p, c_char_p]
+
+        self.nft_bind_u64 = lib.nft_bind_u64
+        self.nft_bind_u64.restype = c_int
+        self.nft_bind_u64.argtypes = [c_void_p, c_char_p, c_uint64]
+
+        self.nft_bind_data = lib.nft_bind_data
+        self.nft_bind_data.restype = c_int
+        self.nft_bind_data.argtypes = [c_void_p, c_char_p, c_void_p, c_size_t]
+
+        self.nft_execute = lib.nft_execute
+        self.nft_execute.restype = c_int
+        self.nft_execute.argtypes = [c_void_p]
+
+        self.nft_stmt_free = lib.nft_stmt_free
+        self.nft_stmt_free.argtypes = [c_void_p]
+
+        self.nft_counters_dump = lib.nft_counters_dump
+        self.nft_counters_dump.restype = c_int
+        self.nft_counters_dump.argtypes = [c_void_p, c_char_p, c_char_p,
+                                           c_uint, POINTER(POINTER(NftCounter)),
+                                           POINTER(c_size_t)]
+
+        self.nft_counters_free = lib.nft_counters_free
+        self.nft_counters_free.argtypes = [POINTER(NftCounter), c_size_t]
+
+        self.nft_set_counters_dump = lib.nft_set_counters_dump
+        self.nft_set_counters_dump.restype = c_int
+        self.nft_set_counters_dump.argtypes = [c_void_p, c_char_p, c_char_p,
+                                               c_char_p, c_uint,
+                                               NftSetCounterCb, c_void_p]
+
         self.nft_ctx_free = lib.nft_ctx_free
         lib.nft_ctx_free.argtypes = [c_void_p]
 
@@ -213,13 +376,22 @@ class Nftables:
         of flags. Each flag might be given either as string or integer value as
         shown in the following table:
 
-        Name      | Value (hex)
-        -----------------------
-        "no-dns"  | 0x1
-        "json"    | 0x2
+        Name              | Value (hex)
+        -------------------------------
+        "no-dns"          | 0x1
+        "json"            | 0x2
+        "split-elements"  | 0x4
+        "diff"            | 0x8
+        "if-changed"      | 0x10
+        "set-hints"       | 0x20
 
         "no-dns" disables blocking address lookup.
         "json" enables JSON mode for input.
+        "split-elements" commits element updates too large for one batch
+        in several transactions.
+        "diff" only sends what differs from the current ruleset.
+        "if-changed" skips commands the current ruleset was loaded from.
+        "set-hints" sizes new sets after the elements they are created with.
 
         Returns a set of previously active input flags, as returned by
         get_input_flags() method.
@@ -441,6 +613,38 @@ class Nftables:
         """
         return self.__set_output_flag("terse", val)
 
+    def get_echo_handles_output(self):
+        """Get the current state of handles-only echo output.
+
+        Returns a boolean indicating whether handles-only echo output is
+        active or not.
+        """
+        return self.__get_output_flag("echo_handles")
+
+    def set_echo_handles_output(self, val):
+        """Enable or disable handles-only echo output.
+
+        Accepts a boolean turning handles-only echo output either on or off.
+        Handles of the objects created by the following commands are then
+        returned by get_echo_handles() instead of being printed.
+
+        Returns the previous value.
+        """
+        return self.__set_output_flag("echo_handles", val)
+
+    def get_echo_handles(self):
+        """Get the handles echoed by the kernel in the last run.
+
+        Returns a list of tuples (cmd, type, handle):
+        cmd    -- position of the command in the input, starting at zero
+        type   -- one of "table", "chain", "rule", "set", "obj", "flowtable"
+        handle -- the handle of the created object
+        """
+        num = c_uint(0)
+        handles = self.nft_ctx_get_echo_handles(self.__ctx, byref(num))
+        return [(handles[i].cmd, self.echo_types[handles[i].type],
+                 handles[i].handle) for i in range(num.value)]
+
     def get_debug(self):
         """Get currently active debug flags.
 
@@ -465,6 +669,8 @@ class Nftables:
         mnl       | 0x10
         proto-ctx | 0x20
         segtree   | 0x40
+        timing    | 0x80
+        memory    | 0x100
 
         Returns a set of previously active debug flags, as returned by
         get_debug() method.
@@ -602,3 +808,264 @@ class Nftables:
         """Clear variable list
         """
         self.nft_ctx_clear_vars(self.__ctx)
+
+    def _buffer(self, obj):
+        """Get a pointer to the contents of a bytes-like object
+
+        Writable buffers (bytearray, array, writable memoryview) are passed
+        to the library without a copy.
+
+        Returns a tuple (pointer, size in bytes).
+        """
+        if isinstance(obj, bytes):
+            return (obj, len(obj))
+        view = memoryview(obj)
+        if not view.c_contiguous:
+            raise ValueError("buffer must be contiguous")
+        if view.readonly:
+            data = view.tobytes()
+            return (data, len(data))
+        view = view.cast("B")
+        return ((c_char * view.nbytes).from_buffer(view), view.nbytes)
+
+    def _elements_keys(self, keys, key_len=None):
+        """Pack keys into a single buffer
+
+        keys is either a list of bytes objects of equal length, or a
+        bytes-like object holding the keys back to back, key_len bytes each.
+
+        Returns a tuple (buffer, key_len, number of keys).
+        """
+        if isinstance(keys, (list, tuple)):
+            if not keys:
+                return (b"", 0, 0)
+            key_len = len(keys[0])
+            for key in keys:
+                if len(key) != key_len:
+                    raise ValueError("keys must have the same length")
+            return (b"".join(keys), key_len, len(keys))
+
+        if not key_len:
+            raise ValueError("key_len is required for packed keys")
+        buf, size = self._buffer(keys)
+        if size % key_len:
+            raise ValueError("buffer size is not a multiple of key_len")
+        return (buf, key_len, size // key_len)
+
+    def _u64_array(self, values, n, name):
+        """Get a pointer to n 64 bit integers
+
+        values is either a list of integers, or a bytes-like object of
+        64 bit integers in host byte order, e.g. array("Q").
+        """
+        if isinstance(values, (list, tuple)):
+            if len(values) != n:
+                raise ValueError("%s must have one entry per key" % name)
+            return (c_uint64 * n)(*values)
+
+        view = memoryview(values)
+        if view.itemsize != 8 or view.nbytes != n * 8:
+            raise ValueError("%s must have one 64 bit entry per key" % name)
+        buf, size = self._buffer(values)
+        if isinstance(buf, bytes):
+            buf = create_string_buffer(buf, size)
+        return cast(buf, POINTER(c_uint64))
+
+    def _elements_result(self, rc):
+        output = self.nft_ctx_get_output_buffer(self.__ctx).decode("utf-8")
+        error = self.nft_ctx_get_error_buffer(self.__ctx).decode("utf-8")
+        return (rc, output, error)
+
+    def add_elements(self, family, table, set, keys, data=None,
+                     timeouts=None, packets=None, bytes=None, key_len=None):
+        """Add elements to a set without going through the parser
+
+        keys is a list of bytes objects holding the keys in the byte order
+        the kernel uses for the key type of the set, e.g. network byte order
+        for addresses and ports. data, if given, is a list of bytes objects
+        holding the map values in the same layout. timeouts (in
+        milliseconds), packets and bytes are optional lists of integers
+        with one entry per key.
+
+        For bulk updates, keys and data can also be single bytes-like
+        objects (bytes, bytearray, memoryview, array) holding all keys or
+        values back to back, key_len bytes per key, and timeouts, packets
+        and bytes can be bytes-like objects of 64 bit integers such as
+        array("Q"). They are passed to the library as they are, without
+        creating a Python object per element.
+
+        Returns a tuple (rc, output, error):
+        rc     -- return code as returned by nft_set_elements_add() function
+        output -- a string containing output written to stdout
+        error  -- a string containing output written to stderr
+        """
+        buf, key_len, n = self._elements_keys(keys, key_len)
+        opts = NftElementsOpts()
+        if data is not None:
+            if isinstance(data, (list, tuple)):
+                if len(data) != n:
+                    raise ValueError("data must have one entry per key")
+                data_buf, opts.data_len, _ = self._elements_keys(data)
+                data_buf = create_string_buffer(data_buf, len(data_buf))
+            else:
+                data_buf, size = self._buffer(data)
+                if n == 0 or size % n:
+                    raise ValueError("data must have one entry per key")
+                opts.data_len = size // n
+                if isinstance(data_buf, bytes):
+                    data_buf = create_string_buffer(data_buf, size)
+            opts.data = cast(data_buf, c_void_p)
+        arrays = []
+        for name, values in (("timeouts", timeouts), ("packets", packets),
+                             ("bytes", bytes)):
+            if values is None:
+                continue
+            arrays.append(self._u64_array(values, n, name))
+            setattr(opts, name, arrays[-1])
+
+        rc = self.nft_set_elements_add(self.__ctx, family.encode("utf-8"),
+                                       table.encode("utf-8"),
+                                       set.encode("utf-8"),
+                                       buf, key_len, n, byref(opts))
+        return self._elements_result(rc)
+
+    def delete_elements(self, family, table, set, keys, key_len=None):
+        """Delete elements from a set without going through the parser
+
+        keys is a list of bytes objects or a bytes-like object, laid out as
+        for add_elements().
+
+        Returns a tuple (rc, output, error) as add_elements() does.
+        """
+        buf, key_len, n = self._elements_keys(keys, key_len)
+        rc = self.nft_set_elements_delete(self.__ctx, family.encode("utf-8"),
+                                          table.encode("utf-8"),
+                                          set.encode("utf-8"),
+                                          buf, key_len, n)
+        return self._elements_result(rc)
+
+    def get_elements(self, family, table, set, keys, key_len=None):
+        """Look up keys in a set without going through the parser
+
+        keys is a list of bytes objects or a bytes-like object, laid out as
+        for add_elements().
+
+        Returns a tuple (rc, found, error):
+        rc    -- return code as returned by nft_set_elements_get() function
+        found -- a list of booleans, True for each key that is in the set
+        error -- a string containing output written to stderr
+        """
+        buf, key_len, n = self._elements_keys(keys, key_len)
+        found = (c_bool * n)()
+        rc = self.nft_set_elements_get(self.__ctx, family.encode("utf-8"),
+                                       table.encode("utf-8"),
+                                       set.encode("utf-8"),
+                                       buf, key_len, n, found)
+        rc, output, error = self._elements_result(rc)
+        return (rc, list(found), error)
+
+    def query_elements(self, family, table, set, keys, key_len=None):
+        """Look up keys in a set, returning a bitmap
+
+        keys is a list of bytes objects or a bytes-like object, laid out as
+        for add_elements().
+
+        Returns a tuple (rc, bitmap, error):
+        rc     -- return code as returned by nft_set_elements_query() function
+        bitmap -- a bytes object, bit i % 8 of byte i // 8 is set if key i
+                  is in the set
+        error  -- a string containing output written to stderr
+        """
+        buf, key_len, n = self._elements_keys(keys, key_len)
+        bitmap = create_string_buffer(n // 8 + 1)
+        rc = self.nft_set_elements_query(self.__ctx, family.encode("utf-8"),
+                                         table.encode("utf-8"),
+                                         set.encode("utf-8"),
+                                         buf, key_len, n, bitmap)
+        rc, output, error = self._elements_result(rc)
+        return (rc, bitmap.raw[:(n + 7) // 8], error)
+
+    def prepare(self, cmdline):
+        """Parse and evaluate commands once, to run them many times
+
+        Accepts a string in which every '$name' that is not a defined
+        variable is a placeholder, see nft_prepare() in libnftables(3).
+
+        Returns an NftStatement, or None if the commands could not be
+        prepared; the error is then available from get_error().
+        Statements must be freed before this object.
+        """
+        stmt = self.nft_prepare(self.__ctx, cmdline.encode("utf-8"))
+        if not stmt:
+            return None
+        return NftStatement(self, stmt)
+
+    def get_error(self):
+        """Get the library error output of the last call."""
+        return self.nft_ctx_get_error_buffer(self.__ctx).decode("utf-8")
+
+    def counters(self, family=None, table=None, flags=()):
+        """Read named counters and quotas straight from the kernel
+
+        family and table restrict the dump, flags is a list of "rules"
+        to also dump the counters of rules and "reset" to reset the
+        counters while they are dumped.
+
+        Returns a tuple (rc, counters, error) where counters is a list of
+        tuples (type, family, table, name, handle, packets, bytes, quota),
+        type being one of "counter", "quota" or "rule", see
+        nft_counters_dump() in libnftables(3).
+        """
+        val = self._flags_to_numeric(self.counters_flags, flags)
+        counters = POINTER(NftCounter)()
+        n = c_size_t(0)
+        rc = self.nft_counters_dump(self.__ctx,
+                                    family.encode("utf-8") if family else None,
+                                    table.encode("utf-8") if table else None,
+                                    val, byref(counters), byref(n))
+        result = []
+        if rc == 0:
+            for i in range(n.value):
+                c = counters[i]
+                result.append((self.counter_types[c.type], c.family,
+                               c.table.decode("utf-8"),
+                               c.name.decode("utf-8") if c.name else None,
+                               c.handle,
+                               c.packets, c.bytes, c.quota))
+            self.nft_counters_free(counters, n)
+        rc, output, error = self._elements_result(rc)
+        return (rc, result, error)
+
+    def set_counters(self, family, table, set, reset=False):
+        """Read the counters of the elements of a set
+
+        Only the key and counter of each element are decoded, as the
+        elements are dumped by the kernel. If reset is True, the counters
+        are reset while they are dumped.
+
+        Returns a tuple (rc, keys, key_len, packets, bytes, error):
+        keys    -- a bytes object holding the keys back to back, laid out
+                   as for add_elements()
+        packets -- an array("Q") with the packets of each element
+        bytes   -- an array("Q") with the bytes of each element
+        """
+        keys = bytearray()
+        npackets = array("Q")
+        nbytes = array("Q")
+        key_len = [0]
+
+        def cb(counter, data):
+            c = counter.contents
+            key_len[0] = c.key_len
+            keys.extend(string_at(c.key, c.key_len))
+            npackets.append(c.packets)
+            nbytes.append(c.bytes)
+
+        rc = self.nft_set_counters_dump(self.__ctx, family.encode("utf-8"),
+                                        table.encode("utf-8"),
+                                        set.encode("utf-8"),
+                                        self.counters_flags["reset"] if reset
+                                        else 0,
+                                        NftSetCounterCb(cb), None)
+        rc, output, error = self._elements_result(rc)
+        return (rc, bytes(keys), key_len[0], npackets, nbytes, error)
@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Asynchronous command runs. nf_tables processes batches and dumps from
+ * sendmsg() and recvmsg(), in the context of the calling thread, so waiting
+ * for the netlink socket to become readable does not keep the caller from
+ * blocking. Instead, submitted commands are queued to a worker thread that
+ * runs them one after another on the context. Each finished run is signalled
+ * through an eventfd, nft_async_process() then calls the completion callbacks
+ * from the thread of the caller, with the output and errors of the run.
+ */
+
+#include <nft.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <nftables.h>
+#include <expression.h>
+#include <statement.h>
+#include <rule.h>
+#include <async.h>
+#include <parallel.h>
+#include <list.h>
+#include <utils.h>
+
+struct nft_async {
+	struct list_head	list;
+	struct nft_async_ctx	*actx;
+	char			*buf;
+	nft_async_cb_t		cb;
+	void			*cb_data;
+	int			rc;
+	char			*output;
+	char			*error;
+	bool			queued;
+};
+
+struct nft_async_ctx {
+	struct nft_ctx		*nft;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	pending;
+	struct list_head	done;
+	int			efd;
+	bool			stop;
+};
+
+static void nft_async_free(struct nft_async *op)
+{
+	free(op->buf);
+	free(op->output);
+	free(op->error);
+	free(op);
+}
+
+static void nft_async_signal(struct nft_async_ctx *actx)
+{
+	uint64_t val = 1;
+
+	/* only fails if the counter overflows, it is read before that. */
+	if (write(actx->efd, &val, sizeof(val)) < 0)
+		return;
+}
+
+static void *nft_async_run(void *arg)
+{
+	struct nft_async_ctx *actx = arg;
+	struct nft_async *op;
+
+	for (;;) {
+		pthread_mutex_lock(&actx->lock);
+		while (list_empty(&actx->pending) && !actx->stop)
+			pthread_cond_wait(&actx->cond, &actx->lock);
+
+		if (actx->stop) {
+			pthread_mutex_unlock(&actx->lock);
+			break;
+		}
+		op = list_first_entry(&actx->pending, struct nft_async, list);
+		list_del(&op->list);
+		op->queued = false;
+		pthread_mutex_unlock(&actx->lock);
+
+		op->rc = nft_run_cmd_capture(actx->nft, op->buf,
+					     &op->output, &op->error);
+
+		pthread_mutex_lock(&actx->lock);
+		list_add_tail(&op->list, &actx->done);
+		pthread_mutex_unlock(&actx->lock);
+
+		nft_async_signal(actx);
+	}
+
+	stmt_node_cache_release();
+	expr_node_cache_release();
+
+	return NULL;
+}
+
+struct nft_async_ctx *nft_async_ctx_alloc(struct nft_ctx *nft)
+{
+	struct nft_async_ctx *actx;
+
+	actx = xzalloc(sizeof(*actx));
+	actx->nft = nft;
+	init_list_head(&actx->pending);
+	init_list_head(&actx->done);
+
+	actx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (actx->efd < 0) {
+		free(actx);
+		return NULL;
+	}
+
+	pthread_mutex_init(&actx->lock, NULL);
+	pthread_cond_init(&actx->cond, NULL);
+
+	if (pthread_create(&actx->thread, NULL, nft_async_run, actx) != 0) {
+		pthread_cond_destroy(&actx->cond);
+		pthread_mutex_destroy(&actx->lock);
+		close(actx->efd);
+		free(actx);
+		return NULL;
+	}
+
+	return actx;
+}
+
+/* Waits for the run in progress, if any. Queued and finished runs are
+ * released without calling their callbacks.
+ */
+void nft_async_ctx_free(struct nft_async_ctx *actx)
+{
+	struct nft_async *op, *next;
+
+	pthread_mutex_lock(&actx->lock);
+	actx->stop = true;
+	pthread_cond_signal(&actx->cond);
+	pthread_mutex_unlock(&actx->lock);
+
+	pthread_join(actx->thread, NULL);
+
+	list_for_each_entry_safe(op, next, &actx->pending, list) {
+		list_del(&op->list);
+		nft_async_free(op);
+	}
+	list_for_each_entry_safe(op, next, &actx->done, list) {
+		list_del(&op->list);
+		nft_async_free(op);
+	}
+
+	pthread_cond_destroy(&actx->cond);
+	pthread_mutex_destroy(&actx->lock);
+	close(actx->efd);
+	free(actx);
+}
+
+int nft_async_ctx_fd(const struct nft_async_ctx *actx)
+{
+	return actx->efd;
+}
+
+struct nft_async *nft_async_ctx_submit(struct nft_async_ctx *actx,
+				       const char *buf, nft_async_cb_t cb,
+				       void *data)
+{
+	struct nft_async *op;
+
+	op = xzalloc(sizeof(*op));
+	op->actx = actx;
+	op->buf = xstrdup(buf);
+	op->cb = cb;
+	op->cb_data = data;
+
+	pthread_mutex_lock(&actx->lock);
+	op->queued = true;
+	list_add_tail(&op->list, &actx->pending);
+	pthread_cond_signal(&actx->cond);
+	pthread_mutex_unlock(&actx->lock);
+
+	return op;
+}
+
+/* Only runs that did not start yet can be cancelled. */
+int nft_async_ctx_cancel(struct nft_async *op)
+{
+	struct nft_async_ctx *actx = op->actx;
+	bool queued;
+
+	pthread_mutex_lock(&actx->lock);
+	queued = op->queued;
+	if (queued)
+		list_del(&op->list);
+	pthread_mutex_unlock(&actx->lock);
+
+	if (!queued)
+		return -1;
+
+	nft_async_free(op);
+
+	return 0;
+}
+
+int nft_async_ctx_process(struct nft_async_ctx *actx)
+{
+	struct nft_async *op, *next;
+	LIST_HEAD(done);
+	uint64_t val;
+	int n = 0;
+
+	if (read(actx->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -1;
+
+	pthread_mutex_lock(&actx->lock);
+	list_splice_tail_init(&actx->done, &done);
+	pthread_mutex_unlock(&actx->lock);
+
+	list_for_each_entry_safe(op, next, &done, list) {
+		list_del(&op->list);
+		op->cb(op, op->rc, op->output, op->error, op->cb_data);
+		nft_async_free(op);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Parallel runs of the same commands on many contexts, typically bound to
+ * different network namespaces. Each context is run by one worker at a time.
+ */
+struct nft_parallel {
+	struct nft_ctx		**ctxs;
+	const char		*buf;
+	struct nft_run_result	*results;
+};
+
+static void nft_parallel_work(void *data, unsigned int i)
+{
+	struct nft_parallel *par = data;
+	struct nft_run_result *res = &par->results[i];
+
+	res->rc = nft_run_cmd_capture(par->ctxs[i], par->buf,
+				      &res->output, &res->error);
+}
+
+/* Returns the number of runs that failed. */
+int nft_parallel_run(struct nft_ctx **ctxs, unsigned int num,
+		     const char *buf, unsigned int jobs,
+		     struct nft_run_result *results)
+{
+	struct nft_parallel par = {
+		.ctxs		= ctxs,
+		.buf		= buf,
+		.results	= results,
+	};
+	unsigned int i;
+	int failed = 0;
+
+	nft_parallel_for(jobs, num, nft_parallel_work, &par);
+
+	for (i = 0; i < num; i++) {
+		if (results[i].rc)
+			failed++;
+	}
+
+	return failed;
+}
+
+/*
+ * Parallel evaluation of a run of rule commands. Rules of different tables
+ * share no objects, so the commands are grouped by table and each group is
+ * evaluated by one worker at a time, in command order. Every command is
+ * moved to its own slot, so the commands that its evaluation adds are
+ * queued right before it, and its errors are collected apart from those of
+ * the other commands. The caller merges slots back in command order.
+ */
+struct nft_eval_parallel {
+	struct nft_ctx		*nft;
+	struct nft_eval_slot	**slots;
+	unsigned int		*groups;
+};
+
+static int nft_eval_slot_cmp(const void *a, const void *b)
+{
+	const struct nft_eval_slot *slot_a = *(struct nft_eval_slot * const *)a;
+	const struct nft_eval_slot *slot_b = *(struct nft_eval_slot * const *)b;
+	const struct handle *h_a = &slot_a->cmd->handle;
+	const struct handle *h_b = &slot_b->cmd->handle;
+	int ret;
+
+	if (h_a->family != h_b->family)
+		return h_a->family < h_b->family ? -1 : 1;
+
+	ret = strcmp(h_a->table.name, h_b->table.name);
+	if (ret)
+		return ret;
+
+	return slot_a->cmd->index < slot_b->cmd->index ? -1 : 1;
+}
+
+static void nft_eval_group(void *data, unsigned int i)
+{
+	struct nft_eval_parallel *par = data;
+	unsigned int k = i ? par->groups[i - 1] : 0;
+	struct nft_eval_slot *slot;
+
+	for (; k < par->groups[i]; k++) {
+		struct eval_ctx ectx = {
+			.nft	= par->nft,
+			.msgs	= &par->slots[k]->msgs,
+		};
+
+		slot = par->slots[k];
+		slot->err = cmd_evaluate(&ectx, slot->cmd);
+	}
+}
+
+void nft_eval_parallel(struct nft_ctx *nft, struct nft_eval_slot *slots,
+		       unsigned int num)
+{
+	struct nft_eval_parallel par = {
+		.nft		= nft,
+	};
+	unsigned int i, num_groups = 0;
+
+	par.slots = xmalloc_array(num, sizeof(*par.slots));
+	for (i = 0; i < num; i++)
+		par.slots[i] = &slots[i];
+
+	qsort(par.slots, num, sizeof(*par.slots), nft_eval_slot_cmp);
+
+	/* groups[i] is the end of the i-th group in the sorted slots. */
+	par.groups = xmalloc_array(num, sizeof(*par.groups));
+	for (i = 1; i <= num; i++) {
+		if (i == num ||
+		    par.slots[i]->cmd->handle.family !=
+		    par.slots[i - 1]->cmd->handle.family ||
+		    strcmp(par.slots[i]->cmd->handle.table.name,
+			   par.slots[i - 1]->cmd->handle.table.name))
+			par.groups[num_groups++] = i;
+	}
+
+	nft_parallel_for(nft->jobs, num_groups, nft_eval_group, &par);
+
+	free(par.groups);
+	free(par.slots);
+}
@@ -0,0 +1,535 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Raw ruleset backups. Saving dumps tables, chains, stateful objects,
+ * flowtables, sets, set elements and rules, in this order, and writes the
+ * netlink messages to a file as the kernel sent them. Restoring turns them
+ * back into requests and sends them in one transaction that replaces the
+ * whole ruleset. Neither step parses, evaluates or prints the ruleset.
+ *
+ * Like compiled rulesets, a backup is only meant for this host: it is in
+ * the format of the kernel that dumped it, the header is in host byte order.
+ */
+
+#include <nft.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include <nftables.h>
+#include <mnl.h>
+#include <netlink.h>
+#include <erec.h>
+#include <utils.h>
+#include <backup.h>
+
+#define NFT_BACKUP_MAGIC	"NFTB"
+#define NFT_BACKUP_VERSION	1
+
+/* Followed by @num_msgs messages, each one aligned to NLMSG_ALIGNTO. */
+struct backup_hdr {
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	genid;
+	uint32_t	num_msgs;
+};
+
+struct backup_obj {
+	uint8_t		family;
+	const char	*table;
+	const char	*name;
+};
+
+struct backup_writer {
+	FILE			*f;
+	uint32_t		num_msgs;
+	/* sets to dump the elements of */
+	struct backup_obj	*sets;
+	unsigned int		num_sets;
+	unsigned int		size;
+};
+
+struct backup {
+	char			*buf;
+	struct backup_hdr	hdr;
+	const struct nlmsghdr	**msgs;
+	/* anonymous chains, their rules are added before they are bound */
+	struct backup_obj	*bindings;
+	unsigned int		num_bindings;
+	unsigned int		size;
+};
+
+/* Tables, chains, sets and such that other objects refer to come first. */
+static const uint16_t backup_dump_types[] = {
+	NFT_MSG_GETTABLE,
+	NFT_MSG_GETCHAIN,
+	NFT_MSG_GETOBJ,
+	NFT_MSG_GETFLOWTABLE,
+	NFT_MSG_GETSET,
+};
+
+static bool backup_obj_parse(const struct nlmsghdr *nlh, uint16_t table_attr,
+			     uint16_t name_attr, struct backup_obj *obj)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+
+	memset(obj, 0, sizeof(*obj));
+	obj->family = nfg->nfgen_family;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+			continue;
+
+		if (mnl_attr_get_type(attr) == table_attr)
+			obj->table = mnl_attr_get_str(attr);
+		else if (mnl_attr_get_type(attr) == name_attr)
+			obj->name = mnl_attr_get_str(attr);
+	}
+
+	return obj->table && obj->name;
+}
+
+static void backup_obj_add(struct backup_obj **objs, unsigned int *num,
+			   unsigned int *size, const struct backup_obj *obj)
+{
+	if (*num == *size) {
+		*size = *size ? *size * 2 : 16;
+		*objs = xrealloc(*objs, *size * sizeof(**objs));
+	}
+	(*objs)[(*num)++] = *obj;
+}
+
+static void backup_writer_reset(struct backup_writer *w)
+{
+	unsigned int i;
+
+	for (i = 0; i < w->num_sets; i++) {
+		free_const(w->sets[i].table);
+		free_const(w->sets[i].name);
+	}
+	w->num_sets = 0;
+	w->num_msgs = 0;
+}
+
+static int backup_write_cb(const struct nlmsghdr *nlh, void *data)
+{
+	static const char pad[NLMSG_ALIGNTO];
+	uint32_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+	struct backup_writer *w = data;
+	struct backup_obj set;
+
+	if (fwrite(nlh, nlh->nlmsg_len, 1, w->f) != 1 ||
+	    (len > nlh->nlmsg_len &&
+	     fwrite(pad, len - nlh->nlmsg_len, 1, w->f) != 1))
+		return MNL_CB_ERROR;
+
+	w->num_msgs++;
+
+	if (NFNL_MSG_TYPE(nlh->nlmsg_type) == NFT_MSG_NEWSET &&
+	    backup_obj_parse(nlh, NFTA_SET_TABLE, NFTA_SET_NAME, &set)) {
+		/* the receive buffer is reused, keep a copy of the names. */
+		set.table = xstrdup(set.table);
+		set.name = xstrdup(set.name);
+		backup_obj_add(&w->sets, &w->num_sets, &w->size, &set);
+	}
+
+	return MNL_CB_OK;
+}
+
+static int backup_dump(struct netlink_ctx *ctx, struct backup_writer *w)
+{
+	const struct backup_obj *set;
+	unsigned int i;
+
+	for (i = 0; i < array_size(backup_dump_types); i++) {
+		if (mnl_nft_dump_raw(ctx, backup_dump_types[i],
+				     backup_write_cb, w) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < w->num_sets; i++) {
+		set = &w->sets[i];
+		if (mnl_nft_setelem_dump_raw(ctx, set->family, set->table,
+					     set->name, backup_write_cb, w) < 0)
+			return -1;
+	}
+
+	return mnl_nft_dump_raw(ctx, NFT_MSG_GETRULE, backup_write_cb, w);
+}
+
+/* Retry until the ruleset does not change while it is dumped, as the cache
+ * does. The header goes last, once the number of messages is known.
+ */
+static int backup_write(struct netlink_ctx *ctx, struct backup_writer *w)
+{
+	struct backup_hdr hdr = {};
+	uint32_t genid;
+	int ret;
+
+replay:
+	backup_writer_reset(w);
+	if (fflush(w->f) != 0 ||
+	    ftruncate(fileno(w->f), sizeof(hdr)) < 0 ||
+	    fseek(w->f, sizeof(hdr), SEEK_SET) < 0)
+		return -1;
+
+	genid = mnl_genid_get(ctx);
+	ret = backup_dump(ctx, w);
+	if (ret < 0 && errno != EINTR && errno != ENOENT)
+		return -1;
+	if (ret < 0 || mnl_genid_get(ctx) != genid)
+		goto replay;
+
+	memcpy(hdr.magic, NFT_BACKUP_MAGIC, sizeof(hdr.magic));
+	hdr.version = NFT_BACKUP_VERSION;
+	hdr.genid = genid;
+	hdr.num_msgs = w->num_msgs;
+
+	rewind(w->f);
+	if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1)
+		return -1;
+
+	return 0;
+}
+
+int nft_backup_save(struct nft_ctx *nft, const char *filename)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.list	= LIST_HEAD_INIT(ctx.list),
+	};
+	struct backup_writer w = {};
+	char *tmpname;
+	LIST_HEAD(msgs);
+	int fd, ret = -1;
+
+	ctx.msgs = &msgs;
+
+	/* Write to a temporary file first, like compiled rulesets. */
+	if (asprintf(&tmpname, "%s.XXXXXX", filename) < 0)
+		memory_allocation_error();
+
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		goto err;
+
+	w.f = fdopen(fd, "w");
+	if (!w.f) {
+		close(fd);
+		goto err_unlink;
+	}
+
+	if (backup_write(&ctx, &w) < 0) {
+		fclose(w.f);
+		goto err_unlink;
+	}
+
+	if (fclose(w.f) != 0 || rename(tmpname, filename) < 0)
+		goto err_unlink;
+
+	ret = 0;
+	goto out;
+
+err_unlink:
+	unlink(tmpname);
+err:
+	erec_queue(error(&internal_location, "Could not save \"%s\": %s",
+			 filename, strerror(errno)), &msgs);
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	backup_writer_reset(&w);
+	free(w.sets);
+	free(tmpname);
+
+	return ret;
+}
+
+bool nft_backup_file(const char *filename)
+{
+	char magic[4];
+	struct stat sb;
+	bool ret;
+	FILE *f;
+
+	/* Do not consume input from fifos. */
+	if (stat(filename, &sb) < 0 || !S_ISREG(sb.st_mode))
+		return false;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return false;
+
+	ret = fread(magic, sizeof(magic), 1, f) == 1 &&
+	      !memcmp(magic, NFT_BACKUP_MAGIC, sizeof(magic));
+
+	fclose(f);
+
+	return ret;
+}
+
+static void backup_free(struct backup *b)
+{
+	free(b->buf);
+	free(b->msgs);
+	free(b->bindings);
+}
+
+static bool backup_msg_valid(const struct nlmsghdr *nlh)
+{
+	if (NFNL_SUBSYS_ID(nlh->nlmsg_type) != NFNL_SUBSYS_NFTABLES ||
+	    nlh->nlmsg_len < NLMSG_HDRLEN + sizeof(struct nfgenmsg))
+		return false;
+
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case NFT_MSG_NEWTABLE:
+	case NFT_MSG_NEWCHAIN:
+	case NFT_MSG_NEWOBJ:
+	case NFT_MSG_NEWFLOWTABLE:
+	case NFT_MSG_NEWSET:
+	case NFT_MSG_NEWSETELEM:
+	case NFT_MSG_NEWRULE:
+		return true;
+	}
+
+	return false;
+}
+
+static void backup_binding_add(struct backup *b, const struct nlmsghdr *nlh)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+	struct backup_obj chain;
+	uint32_t flags = 0;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		if (mnl_attr_get_type(attr) == NFTA_CHAIN_FLAGS &&
+		    mnl_attr_validate(attr, MNL_TYPE_U32) == 0)
+			flags = ntohl(mnl_attr_get_u32(attr));
+	}
+
+	if ((flags & NFT_CHAIN_BINDING) &&
+	    backup_obj_parse(nlh, NFTA_CHAIN_TABLE, NFTA_CHAIN_NAME, &chain))
+		backup_obj_add(&b->bindings, &b->num_bindings, &b->size,
+			       &chain);
+}
+
+static int backup_parse(struct backup *b, size_t len)
+{
+	const struct nlmsghdr *nlh;
+	int remain;
+	uint32_t i;
+
+	if (len < sizeof(b->hdr))
+		return -1;
+
+	memcpy(&b->hdr, b->buf, sizeof(b->hdr));
+	if (memcmp(b->hdr.magic, NFT_BACKUP_MAGIC, sizeof(b->hdr.magic)) ||
+	    b->hdr.version != NFT_BACKUP_VERSION ||
+	    b->hdr.num_msgs > len / NLMSG_HDRLEN ||
+	    len - sizeof(b->hdr) > INT_MAX)
+		return -1;
+
+	b->msgs = xmalloc((b->hdr.num_msgs + 1) * sizeof(*b->msgs));
+
+	nlh = (const struct nlmsghdr *)(b->buf + sizeof(b->hdr));
+	remain = len - sizeof(b->hdr);
+	for (i = 0; i < b->hdr.num_msgs; i++) {
+		if (!mnl_nlmsg_ok(nlh, remain) || !backup_msg_valid(nlh))
+			return -1;
+
+		if (NFNL_MSG_TYPE(nlh->nlmsg_type) == NFT_MSG_NEWCHAIN)
+			backup_binding_add(b, nlh);
+
+		b->msgs[i] = nlh;
+		nlh = mnl_nlmsg_next(nlh, &remain);
+	}
+
+	return remain == 0 ? 0 : -1;
+}
+
+static int backup_read_file(const char *filename, struct backup *b,
+			    size_t *len)
+{
+	struct stat sb;
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	if (fstat(fileno(f), &sb) < 0)
+		goto out;
+
+	*len = sb.st_size;
+	b->buf = xmalloc(*len + 1);
+	if (fread(b->buf, 1, *len, f) == *len)
+		ret = 0;
+out:
+	fclose(f);
+
+	return ret;
+}
+
+static bool backup_rule_is_bound(const struct backup *b,
+				 const struct nlmsghdr *nlh)
+{
+	struct backup_obj rule;
+	unsigned int i;
+
+	if (!b->num_bindings ||
+	    !backup_obj_parse(nlh, NFTA_RULE_TABLE, NFTA_RULE_CHAIN, &rule))
+		return false;
+
+	for (i = 0; i < b->num_bindings; i++) {
+		if (b->bindings[i].family == rule.family &&
+		    !strcmp(b->bindings[i].name, rule.name) &&
+		    !strcmp(b->bindings[i].table, rule.table))
+			return true;
+	}
+
+	return false;
+}
+
+static const char *backup_msg_name(const struct nlmsghdr *nlh)
+{
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case NFT_MSG_NEWTABLE:
+		return "table";
+	case NFT_MSG_NEWCHAIN:
+		return "chain";
+	case NFT_MSG_NEWOBJ:
+		return "object";
+	case NFT_MSG_NEWFLOWTABLE:
+		return "flowtable";
+	case NFT_MSG_NEWSET:
+		return "set";
+	case NFT_MSG_NEWSETELEM:
+		return "set elements";
+	case NFT_MSG_NEWRULE:
+		return "rule";
+	}
+
+	return "ruleset";
+}
+
+/* Rules of anonymous chains have to be there before the rule that jumps to
+ * the chain binds it, after the sets that they may refer to.
+ */
+static uint32_t backup_batch(struct mnl_batch *batch, const struct backup *b,
+			     const struct nlmsghdr **order, bool check)
+{
+	uint32_t seqnum = 0, first, i, n = 0;
+	const struct nlmsghdr *nlh;
+	int pass;
+
+	mnl_batch_begin(batch, mnl_seqnum_inc(&seqnum));
+	mnl_nft_restore_flush(batch, mnl_seqnum_inc(&seqnum));
+	first = seqnum;
+
+	for (pass = 0; pass < 3; pass++) {
+		for (i = 0; i < b->hdr.num_msgs; i++) {
+			nlh = b->msgs[i];
+			if (NFNL_MSG_TYPE(nlh->nlmsg_type) != NFT_MSG_NEWRULE) {
+				if (pass != 0)
+					continue;
+			} else if (pass == 0 ||
+				   backup_rule_is_bound(b, nlh) != (pass == 1)) {
+				continue;
+			}
+
+			order[n++] = nlh;
+			mnl_nft_restore_msg(batch, nlh, mnl_seqnum_inc(&seqnum));
+		}
+	}
+
+	if (!check)
+		mnl_batch_end(batch, mnl_seqnum_inc(&seqnum));
+
+	return first;
+}
+
+static int backup_send(struct nft_ctx *nft, const struct backup *b,
+		       struct list_head *msgs)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.msgs	= msgs,
+		.list	= LIST_HEAD_INIT(ctx.list),
+		.batch	= mnl_batch_init(nft),
+	};
+	const struct nlmsghdr **order;
+	struct mnl_err *err, *tmp;
+	LIST_HEAD(err_list);
+	uint32_t first;
+	int ret;
+
+	order = xmalloc((b->hdr.num_msgs + 1) * sizeof(*order));
+	first = backup_batch(ctx.batch, b, order, nft->check);
+
+	ret = mnl_batch_talk(&ctx, &err_list, b->hdr.num_msgs + 1);
+	if (ret < 0) {
+		netlink_io_error(&ctx, NULL, "Could not restore ruleset: %s",
+				 strerror(errno));
+		goto out;
+	}
+
+	list_for_each_entry_safe(err, tmp, &err_list, head) {
+		if (err->seqnum >= first &&
+		    err->seqnum - first < b->hdr.num_msgs)
+			netlink_io_error(&ctx, NULL,
+					 "Could not restore %s: %s",
+					 backup_msg_name(order[err->seqnum - first]),
+					 strerror(err->err));
+		else
+			netlink_io_error(&ctx, NULL,
+					 "Could not restore ruleset: %s",
+					 strerror(err->err));
+
+		errno = err->err;
+		mnl_err_list_free(err);
+		ret = -1;
+	}
+out:
+	mnl_batch_reset(ctx.batch);
+	free(order);
+
+	return ret;
+}
+
+int nft_backup_restore(struct nft_ctx *nft, const char *filename)
+{
+	struct backup b = {};
+	LIST_HEAD(msgs);
+	size_t len;
+	int ret = -1;
+
+	if (backup_read_file(filename, &b, &len) < 0) {
+		erec_queue(error(&internal_location,
+				 "Could not read \"%s\": %s",
+				 filename, strerror(errno)), &msgs);
+		goto out;
+	}
+
+	if (backup_parse(&b, len) < 0) {
+		erec_queue(error(&internal_location,
+				 "\"%s\" is not a valid ruleset backup",
+				 filename), &msgs);
+		goto out;
+	}
+
+	ret = backup_send(nft, &b, &msgs);
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	backup_free(&b);
+
+	return ret;
+}
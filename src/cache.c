@@ -16,9 +16,14 @@
 #include <cache.h>
 #include <netlink.h>
 #include <mnl.h>
+#include <journal.h>
+#include <parallel.h>
+#include <intervals.h>
 #include <libnftnl/chain.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <pthread.h>
+#include <unistd.h>
 
 static unsigned int evaluate_cache_add(struct cmd *cmd, unsigned int flags)
 {
@@ -58,8 +63,11 @@ static unsigned int evaluate_cache_add(struct cmd *cmd, unsigned int flags)
 		flags |= NFT_CACHE_TABLE |
 			 NFT_CACHE_SET;
 
+		/* rule statements are not needed to resolve the index. */
 		if (cmd->handle.index.id)
-			flags |= NFT_CACHE_FULL | NFT_CACHE_UPDATE;
+			flags |= NFT_CACHE_CHAIN |
+				 NFT_CACHE_RULE |
+				 NFT_CACHE_UPDATE;
 		break;
 	default:
 		break;
@@ -72,9 +80,20 @@ static unsigned int evaluate_cache_del(struct cmd *cmd, unsigned int flags)
 {
 	switch (cmd->obj) {
 	case CMD_OBJ_ELEMENTS:
-		flags |= NFT_CACHE_SET |
-			 NFT_CACHE_SETELEM_MAYBE;
+		/* interval sets: the ranges that contain the elements are
+		 * fetched from evaluation, see interval_set_fetch().
+		 */
+		flags |= NFT_CACHE_SET;
 		break;
+	case CMD_OBJ_RULE:
+		/* handle lists are checked against the rules, without their
+		 * statements.
+		 */
+		if (cmd->handles) {
+			flags |= NFT_CACHE_CHAIN | NFT_CACHE_RULE;
+			break;
+		}
+		/* fall through */
 	default:
 		flags = NFT_CACHE_TABLE;
 		break;
@@ -100,61 +119,201 @@ static unsigned int evaluate_cache_get(struct cmd *cmd, unsigned int flags)
 
 struct nft_cache_filter *nft_cache_filter_init(void)
 {
-	struct nft_cache_filter *filter;
-	int i;
+	return xzalloc(sizeof(struct nft_cache_filter));
+}
 
-	filter = xzalloc(sizeof(struct nft_cache_filter));
-	memset(&filter->list, 0, sizeof(filter->list));
-	for (i = 0; i < NFT_CACHE_HSIZE; i++)
-		init_list_head(&filter->obj[i].head);
+void nft_cache_filter_fini(struct nft_cache_filter *filter)
+{
+	free(filter->obj.slot);
+	free(filter->table.slot);
+	free(filter);
+}
+
+#define NFT_CACHE_FILTER_HSIZE_MIN	16
 
-	return filter;
+static void cache_filter_insert(struct nft_filter_ht *ht,
+				const struct nft_filter_obj *obj)
+{
+	uint32_t mask = ht->size - 1;
+	uint32_t i = obj->hash & mask;
+
+	while (ht->slot[i].table)
+		i = (i + 1) & mask;
+
+	ht->slot[i] = *obj;
 }
 
-void nft_cache_filter_fini(struct nft_cache_filter *filter)
+static void cache_filter_grow(struct nft_filter_ht *ht)
 {
-	int i;
+	struct nft_filter_obj *slot = ht->slot;
+	uint32_t i, size = ht->size;
+
+	if (size)
+		ht->size = size * 2;
+	else
+		ht->size = NFT_CACHE_FILTER_HSIZE_MIN;
+
+	ht->slot = xzalloc(sizeof(struct nft_filter_obj) * ht->size);
+	for (i = 0; i < size; i++) {
+		if (slot[i].table)
+			cache_filter_insert(ht, &slot[i]);
+	}
+	free(slot);
+}
+
+static void cache_filter_ht_add(struct nft_filter_ht *ht,
+				const struct nft_filter_obj *obj)
+{
+	/* keep the load factor below one half. */
+	if ((ht->count + 1) * 2 > ht->size)
+		cache_filter_grow(ht);
+
+	cache_filter_insert(ht, obj);
+	ht->count++;
+}
+
+/* table entries have no set, these match any entry of the table. */
+static bool cache_filter_ht_find(const struct nft_filter_ht *ht,
+				 const struct nft_filter_obj *key)
+{
+	const struct nft_filter_obj *obj;
+	uint32_t mask, i;
+
+	if (!ht->count)
+		return false;
 
-	for (i = 0; i < NFT_CACHE_HSIZE; i++) {
-		struct nft_filter_obj *obj, *next;
+	mask = ht->size - 1;
 
-		list_for_each_entry_safe(obj, next, &filter->obj[i].head, list)
-			free(obj);
+	for (i = key->hash & mask; ht->slot[i].table; i = (i + 1) & mask) {
+		obj = &ht->slot[i];
+
+		if (obj->hash == key->hash &&
+		    obj->family == key->family &&
+		    !strcmp(obj->table, key->table) &&
+		    (!key->set || !strcmp(obj->set, key->set)))
+			return true;
 	}
-	free(filter);
+
+	return false;
 }
 
 static void cache_filter_add(struct nft_cache_filter *filter,
 			     const struct cmd *cmd)
 {
-	struct nft_filter_obj *obj;
-	uint32_t hash;
+	struct nft_filter_obj obj = {
+		.hash	= djb_hash(cmd->handle.set.name),
+		.family	= cmd->handle.family,
+		.table	= cmd->handle.table.name,
+		.set	= cmd->handle.set.name,
+	};
 
-	obj = xmalloc(sizeof(struct nft_filter_obj));
-	obj->family = cmd->handle.family;
-	obj->table = cmd->handle.table.name;
-	obj->set = cmd->handle.set.name;
+	cache_filter_ht_add(&filter->obj, &obj);
+}
+
+static bool cache_filter_is_empty(const struct nft_cache_filter *filter)
+{
+	if (!filter)
+		return true;
 
-	hash = djb_hash(cmd->handle.set.name) % NFT_CACHE_HSIZE;
-	list_add_tail(&obj->list, &filter->obj[hash].head);
+	return !filter->list.family && !filter->list.table &&
+	       !filter->list.obj_type && !filter->obj.count &&
+	       !filter->table.count && !filter->reset.obj &&
+	       !filter->reset.rule && !filter->reset.elem;
 }
 
 static bool cache_filter_find(const struct nft_cache_filter *filter,
 			      const struct handle *handle)
 {
-	struct nft_filter_obj *obj;
-	uint32_t hash;
+	struct nft_filter_obj key = {
+		.hash	= djb_hash(handle->set.name),
+		.family	= handle->family,
+		.table	= handle->table.name,
+		.set	= handle->set.name,
+	};
+
+	return cache_filter_ht_find(&filter->obj, &key);
+}
 
-	hash = djb_hash(handle->set.name) % NFT_CACHE_HSIZE;
+static void cache_filter_table_add(struct nft_cache_filter *filter,
+				   const struct handle *handle)
+{
+	struct nft_filter_obj obj = {
+		.hash	= djb_hash(handle->table.name),
+		.family	= handle->family,
+		.table	= handle->table.name,
+	};
 
-	list_for_each_entry(obj, &filter->obj[hash].head, list) {
-		if (obj->family == handle->family &&
-		    !strcmp(obj->table, handle->table.name) &&
-		    !strcmp(obj->set, handle->set.name))
-			return true;
+	if (!cache_filter_ht_find(&filter->table, &obj))
+		cache_filter_ht_add(&filter->table, &obj);
+}
+
+static void cache_filter_table_reset(struct nft_cache_filter *filter)
+{
+	free(filter->table.slot);
+	memset(&filter->table, 0, sizeof(filter->table));
+}
+
+/* without a table scope, every table is fetched. */
+static bool cache_filter_table_match(const struct nft_cache_filter *filter,
+				     const struct table *table)
+{
+	struct nft_filter_obj key = {
+		.hash	= djb_hash(table->handle.table.name),
+		.family	= table->handle.family,
+		.table	= table->handle.table.name,
+	};
+
+	if (!filter || !filter->table.count)
+		return true;
+
+	return cache_filter_ht_find(&filter->table, &key);
+}
+
+/* A batch whose commands only name tables to update refers to no other
+ * tables: jumps and gotos, set and map references, and stateful object
+ * references never cross tables. Only the objects of these tables are
+ * fetched, which keeps cache work constant on hosts with many tables.
+ */
+static bool cmd_is_table_scoped(const struct cmd *cmd)
+{
+	if (!cmd->handle.table.name ||
+	    cmd->handle.family == NFPROTO_UNSPEC)
+		return false;
+
+	switch (cmd->op) {
+	case CMD_ADD:
+	case CMD_INSERT:
+	case CMD_CREATE:
+	case CMD_REPLACE:
+	case CMD_DELETE:
+	case CMD_DESTROY:
+	case CMD_GET:
+	case CMD_FLUSH:
+	case CMD_RENAME:
+		return true;
+	default:
+		return false;
 	}
+}
 
-	return false;
+/* With a single table, the kernel filters the dumps. */
+static void cache_filter_table_scope(struct nft_cache_filter *filter)
+{
+	const struct nft_filter_obj *obj;
+	uint32_t i;
+
+	if (filter->table.count != 1)
+		return;
+
+	for (i = 0; i < filter->table.size; i++) {
+		obj = &filter->table.slot[i];
+		if (!obj->table)
+			continue;
+
+		filter->list.family = obj->family;
+		filter->list.table = obj->table;
+		break;
+	}
 }
 
 static unsigned int evaluate_cache_flush(struct cmd *cmd, unsigned int flags,
@@ -206,6 +365,45 @@ static void obj_filter_setup(const struct cmd *cmd, unsigned int *flags,
 	*flags |= NFT_CACHE_TABLE | NFT_CACHE_OBJECT;
 }
 
+static void reset_filter(struct nft_cache_filter *filter)
+{
+	memset(&filter->list, 0, sizeof(filter->list));
+	memset(&filter->reset, 0, sizeof(filter->reset));
+}
+
+/* Ruleset events keep the cache up to date across commands. */
+static bool nft_cache_is_persistent(const struct nft_ctx *nft)
+{
+	return nft->ev_sock != NULL;
+}
+
+/* Rule and object state changes without ruleset events, listings that print
+ * it fetch the cache again. Set elements are fetched again while listing,
+ * see nft_cache_list_refresh().
+ */
+static bool list_cmd_is_stateful(const struct nft_ctx *nft,
+				 const struct cmd *cmd)
+{
+	if (nft_output_stateless(&nft->output))
+		return false;
+
+	switch (cmd->obj) {
+	case CMD_OBJ_TABLE:
+		return cmd->handle.table.name != NULL;
+	case CMD_OBJ_CHAIN:
+	case CMD_OBJ_RULESET:
+	case CMD_OBJ_RULES:
+	case CMD_OBJ_RULE:
+	case CMD_OBJ_COUNTER:
+	case CMD_OBJ_COUNTERS:
+	case CMD_OBJ_QUOTA:
+	case CMD_OBJ_QUOTAS:
+		return true;
+	default:
+		return false;
+	}
+}
+
 static unsigned int evaluate_cache_list(struct nft_ctx *nft, struct cmd *cmd,
 					unsigned int flags,
 					struct nft_cache_filter *filter)
@@ -235,12 +433,16 @@ static unsigned int evaluate_cache_list(struct nft_ctx *nft, struct cmd *cmd,
 		break;
 	case CMD_OBJ_SET:
 	case CMD_OBJ_MAP:
+	case CMD_OBJ_METER:
 		if (cmd->handle.table.name && cmd->handle.set.name) {
 			filter->list.family = cmd->handle.family;
 			filter->list.table = cmd->handle.table.name;
 			filter->list.set = cmd->handle.set.name;
 		}
-		if (filter->list.table && filter->list.set)
+		/* elements in a window are fetched when listing. */
+		if (filter->list.table && filter->list.set && cmd->arg)
+			flags |= NFT_CACHE_TABLE | NFT_CACHE_SET;
+		else if (filter->list.table && filter->list.set)
 			flags |= NFT_CACHE_TABLE | NFT_CACHE_SET | NFT_CACHE_SETELEM;
 		else
 			flags |= NFT_CACHE_FULL;
@@ -301,6 +503,18 @@ static unsigned int evaluate_cache_list(struct nft_ctx *nft, struct cmd *cmd,
 		flags |= NFT_CACHE_FULL;
 		break;
 	}
+
+	/* the whole ruleset is fetched once, ruleset events keep it up to
+	 * date for the following listings.
+	 */
+	if (nft_cache_is_persistent(nft)) {
+		reset_filter(filter);
+		flags &= ~NFT_CACHE_TERSE;
+		if (list_cmd_is_stateful(nft, cmd))
+			flags |= NFT_CACHE_REFRESH;
+
+		return flags;
+	}
 	flags |= NFT_CACHE_REFRESH;
 
 	if (nft_output_terse(&nft->output))
@@ -424,6 +638,7 @@ static int nft_handle_validate(const struct cmd *cmd, struct list_head *msgs)
 	case CMD_OBJ_RULESET:
 	case CMD_OBJ_MARKUP:
 	case CMD_OBJ_MONITOR:
+	case CMD_OBJ_PROFILE:
 	case CMD_OBJ_SETELEMS:
 	case CMD_OBJ_HOOKS:
 		break;
@@ -465,17 +680,12 @@ err_name_too_long:
 	return -1;
 }
 
-static void reset_filter(struct nft_cache_filter *filter)
-{
-	memset(&filter->list, 0, sizeof(filter->list));
-	memset(&filter->reset, 0, sizeof(filter->reset));
-}
-
 int nft_cache_evaluate(struct nft_ctx *nft, struct list_head *cmds,
 		       struct list_head *msgs, struct nft_cache_filter *filter,
 		       unsigned int *pflags)
 {
 	unsigned int flags, batch_flags = NFT_CACHE_EMPTY;
+	bool scoped = true;
 	struct cmd *cmd;
 
 	assert(filter);
@@ -495,6 +705,8 @@ int nft_cache_evaluate(struct nft_ctx *nft, struct list_head *cmds,
 			break;
 		case CMD_REPLACE:	/* only for rule */
 			flags = NFT_CACHE_TABLE | NFT_CACHE_SET;
+			if (cmd->handles)
+				flags |= NFT_CACHE_CHAIN | NFT_CACHE_RULE;
 			break;
 		case CMD_DELETE:
 		case CMD_DESTROY:
@@ -510,6 +722,27 @@ int nft_cache_evaluate(struct nft_ctx *nft, struct list_head *cmds,
 			flags = evaluate_cache_list(nft, cmd, flags, filter);
 			break;
 		case CMD_MONITOR:
+			/* aggregated traces are not matched against rules */
+			if (cmd->monitor->aggregate)
+				break;
+			if (cmd->handle.table.name &&
+			    cmd->handle.family != NFPROTO_UNSPEC) {
+				filter->list.family = cmd->handle.family;
+				filter->list.table = cmd->handle.table.name;
+			}
+			flags = NFT_CACHE_FULL;
+			break;
+		case CMD_PROFILE:
+			/* the rules to change are dumped as they are */
+			if (cmd->profile->action != CMD_PROFILE_REPORT) {
+				flags = NFT_CACHE_TABLE;
+				break;
+			}
+			if (cmd->handle.table.name &&
+			    cmd->handle.family != NFPROTO_UNSPEC) {
+				filter->list.family = cmd->handle.family;
+				filter->list.table = cmd->handle.table.name;
+			}
 			flags = NFT_CACHE_FULL;
 			break;
 		case CMD_FLUSH:
@@ -526,6 +759,46 @@ int nft_cache_evaluate(struct nft_ctx *nft, struct list_head *cmds,
 			break;
 		}
 		batch_flags |= flags;
+
+		if (cmd_is_table_scoped(cmd))
+			cache_filter_table_add(filter, &cmd->handle);
+		else if (cmd->op != CMD_DESCRIBE)
+			scoped = false;
+	}
+
+	/* the persistent cache holds the whole ruleset, --diff also looks
+	 * for the tables that the file lacks.
+	 */
+	if (!scoped || nft_cache_is_persistent(nft) ||
+	    nft_input_diff(&nft->input))
+		cache_filter_table_reset(filter);
+	else
+		cache_filter_table_scope(filter);
+
+	/* A lone list ruleset command fetches rules and named set elements
+	 * while printing, one chain or set at a time, see chain_stream_fetch()
+	 * and set_stream_fetch().
+	 */
+	if (nft->flags & NFT_CTX_STREAM_LIST &&
+	    !(nft->flags & NFT_CTX_PERSISTENT_CACHE) &&
+	    list_is_singular(cmds)) {
+		cmd = list_first_entry(cmds, struct cmd, list);
+		if (cmd->op == CMD_LIST && cmd->obj == CMD_OBJ_RULESET) {
+			batch_flags &= ~(NFT_CACHE_RULE_BIT |
+					 NFT_CACHE_RULE_STMT_BIT);
+			batch_flags |= NFT_CACHE_TERSE | NFT_CACHE_STREAM;
+		}
+	}
+	/* --diff compares the commands with the kernel objects, rules and
+	 * elements are fetched for the chains and sets in the file only, see
+	 * nft_diff(). After flush ruleset, ranges are not merged with the
+	 * elements in the kernel, these are replaced.
+	 */
+	if (nft_input_diff(&nft->input)) {
+		batch_flags |= NFT_CACHE_CHAIN | NFT_CACHE_SET |
+			       NFT_CACHE_OBJECT | NFT_CACHE_FLOWTABLE;
+		if (nft->diff_flushed)
+			batch_flags &= ~NFT_CACHE_SETELEM_MAYBE;
 	}
 	*pflags = batch_flags;
 
@@ -536,7 +809,7 @@ void table_cache_add(struct table *table, struct nft_cache *cache)
 {
 	uint32_t hash;
 
-	hash = djb_hash(table->handle.table.name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(table->handle.table.name);
 	cache_add(&table->cache, &cache->table_cache, hash);
 }
 
@@ -554,9 +827,10 @@ struct table *table_cache_find(const struct cache *cache,
 	if (!name)
 		return NULL;
 
-	hash = djb_hash(name) % NFT_CACHE_HSIZE;
-	list_for_each_entry(table, &cache->ht[hash], cache.hlist) {
-		if (table->handle.family == family &&
+	hash = djb_hash(name);
+	list_for_each_entry(table, cache_bucket(cache, hash), cache.hlist) {
+		if (table->cache.hash == hash &&
+		    table->handle.family == family &&
 		    !strcmp(table->handle.table.name, name))
 			return table;
 	}
@@ -584,7 +858,7 @@ static int chain_cache_cb(struct nftnl_chain *nlc, void *arg)
 		return 0;
 
 	chain_name = nftnl_chain_get_str(nlc, NFTNL_CHAIN_NAME);
-	hash = djb_hash(chain_name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(chain_name);
 	chain = netlink_delinearize_chain(ctx->nlctx, nlc);
 
 	if (chain->flags & CHAIN_F_BINDING) {
@@ -620,7 +894,7 @@ chain_cache_dump(struct netlink_ctx *ctx,
 	const char *chain = NULL;
 	int family = NFPROTO_UNSPEC;
 
-	if (filter && filter->list.table && filter->list.chain) {
+	if (filter && filter->list.table) {
 		family = filter->list.family;
 		table = filter->list.table;
 		chain = filter->list.chain;
@@ -658,7 +932,7 @@ void chain_cache_add(struct chain *chain, struct table *table)
 {
 	uint32_t hash;
 
-	hash = djb_hash(chain->handle.chain.name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(chain->handle.chain.name);
 	cache_add(&chain->cache, &table->chain_cache, hash);
 }
 
@@ -672,19 +946,46 @@ struct chain *chain_cache_find(const struct table *table, const char *name)
 	struct chain *chain;
 	uint32_t hash;
 
-	hash = djb_hash(name) % NFT_CACHE_HSIZE;
-	list_for_each_entry(chain, &table->chain_cache.ht[hash], cache.hlist) {
-		if (!strcmp(chain->handle.chain.name, name))
+	hash = djb_hash(name);
+	list_for_each_entry(chain, cache_bucket(&table->chain_cache, hash),
+			    cache.hlist) {
+		if (chain->cache.hash == hash &&
+		    !strcmp(chain->handle.chain.name, name))
 			return chain;
 	}
 
 	return NULL;
 }
 
+struct rule_cache_dump_ctx {
+	struct netlink_ctx	*nlctx;
+	const struct handle	*h;
+	bool			stmts;
+	bool			parallel;
+	struct nftnl_rule	**nlr;
+	unsigned int		num;
+	unsigned int		size;
+};
+
+static struct rule *rule_cache_parse(struct netlink_ctx *ctx,
+				     struct nftnl_rule *nlr, bool stmts)
+{
+	struct rule *rule;
+
+	if (stmts)
+		rule = netlink_delinearize_rule(ctx, nlr);
+	else
+		rule = netlink_delinearize_rule_handle(nlr);
+	assert(rule);
+
+	return rule;
+}
+
 static int list_rule_cb(struct nftnl_rule *nlr, void *data)
 {
-	struct netlink_ctx *ctx = data;
-	const struct handle *h = ctx->data;
+	struct rule_cache_dump_ctx *dump_ctx = data;
+	struct netlink_ctx *ctx = dump_ctx->nlctx;
+	const struct handle *h = dump_ctx->h;
 	const char *table, *chain;
 	struct rule *rule;
 	uint32_t family;
@@ -698,17 +999,134 @@ static int list_rule_cb(struct nftnl_rule *nlr, void *data)
 	    (h->chain.name && strcmp(chain, h->chain.name) != 0))
 		return 0;
 
+	if (dump_ctx->parallel) {
+		if (dump_ctx->num == dump_ctx->size) {
+			dump_ctx->size = dump_ctx->size ?
+					 dump_ctx->size * 2 : 1024;
+			dump_ctx->nlr = xrealloc(dump_ctx->nlr, dump_ctx->size *
+						 sizeof(*dump_ctx->nlr));
+		}
+		dump_ctx->nlr[dump_ctx->num++] = nlr;
+		return 0;
+	}
+
 	netlink_dump_rule(nlr, ctx);
-	rule = netlink_delinearize_rule(ctx, nlr);
-	assert(rule);
+	rule = rule_cache_parse(ctx, nlr, dump_ctx->stmts);
 	list_add_tail(&rule->list, &ctx->list);
 
 	return 0;
 }
 
+#define RULE_PARSE_THREADS	16
+#define RULE_PARSE_MIN_RULES	1024
+
+struct rule_parse_job {
+	struct netlink_ctx	ctx;
+	struct list_head	msgs;
+	struct nftnl_rule	**nlr;
+	struct rule		**rule;
+	unsigned int		num;
+};
+
+static void rule_parse_worker(void *data, unsigned int k)
+{
+	struct rule_parse_job *job = (struct rule_parse_job *)data + k;
+	unsigned int i;
+
+	for (i = 0; i < job->num; i++)
+		job->rule[i] = rule_cache_parse(&job->ctx, job->nlr[i], true);
+}
+
+/* Delinearize the collected rules from several threads. Each thread takes
+ * a contiguous slice of the dump, so rules are added to the list in the
+ * order the kernel reported them. Error records are queued per thread and
+ * appended to the caller's list once all threads are done.
+ */
+static void rule_cache_parse_parallel(struct rule_cache_dump_ctx *dump_ctx)
+{
+	struct rule_parse_job jobs[RULE_PARSE_THREADS] = {};
+	struct netlink_ctx *ctx = dump_ctx->nlctx;
+	unsigned int i, n, start = 0;
+	struct rule **rules;
+	long ncpus;
+
+	if (!dump_ctx->num)
+		return;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = ncpus > 1 ? min((unsigned int)ncpus, RULE_PARSE_THREADS) : 1;
+	n = min(n, div_round_up(dump_ctx->num, RULE_PARSE_MIN_RULES));
+
+	rules = xmalloc_array(dump_ctx->num, sizeof(*rules));
+
+	for (i = 0; i < n; i++) {
+		struct rule_parse_job *job = &jobs[i];
+
+		job->ctx.nft	= ctx->nft;
+		job->ctx.msgs	= &job->msgs;
+		job->ctx.seqnum	= ctx->seqnum;
+		init_list_head(&job->ctx.list);
+		init_list_head(&job->msgs);
+		job->nlr	= &dump_ctx->nlr[start];
+		job->rule	= &rules[start];
+		job->num	= (dump_ctx->num - start) / (n - i);
+		start += job->num;
+	}
+
+	nft_parallel_for(n, n, rule_parse_worker, jobs);
+
+	for (i = 0; i < n; i++)
+		list_splice_tail(&jobs[i].msgs, ctx->msgs);
+
+	for (i = 0; i < dump_ctx->num; i++)
+		list_add_tail(&rules[i]->list, &ctx->list);
+
+	free(rules);
+}
+
+static int rule_cache_dump_terse(struct netlink_ctx *ctx,
+				 const struct handle *h, int family,
+				 const char *table, const char *chain)
+{
+	struct rule *rule, *next;
+	LIST_HEAD(rules);
+
+	if (mnl_nft_rule_dump_terse(ctx, family, table, chain, &rules) < 0) {
+		list_for_each_entry_safe(rule, next, &rules, list) {
+			list_del(&rule->list);
+			rule_free(rule);
+		}
+		if (errno == EINTR)
+			return -1;
+
+		return 0;
+	}
+
+	list_for_each_entry_safe(rule, next, &rules, list) {
+		if ((h->family != NFPROTO_UNSPEC &&
+		     h->family != rule->handle.family) ||
+		    (h->table.name &&
+		     strcmp(rule->handle.table.name, h->table.name) != 0) ||
+		    (h->chain.name &&
+		     strcmp(rule->handle.chain.name, h->chain.name) != 0)) {
+			list_del(&rule->list);
+			rule_free(rule);
+			continue;
+		}
+		list_move_tail(&rule->list, &ctx->list);
+	}
+
+	return 0;
+}
+
 static int rule_cache_dump(struct netlink_ctx *ctx, const struct handle *h,
-			   const struct nft_cache_filter *filter)
+			   const struct nft_cache_filter *filter, bool stmts)
 {
+	struct rule_cache_dump_ctx dump_ctx = {
+		.nlctx	= ctx,
+		.h	= h,
+		.stmts	= stmts,
+	};
 	struct nftnl_rule_list *rule_cache;
 	const char *table = h->table.name;
 	const char *chain = NULL;
@@ -729,6 +1147,11 @@ static int rule_cache_dump(struct netlink_ctx *ctx, const struct handle *h,
 			family = filter->list.family;
 	}
 
+	/* without statements, the rules are parsed straight from the dump. */
+	if (!stmts && dump && !filter->reset.rule &&
+	    !(ctx->nft->debug_mask & NFT_DEBUG_NETLINK))
+		return rule_cache_dump_terse(ctx, h, family, table, chain);
+
 	rule_cache = mnl_nft_rule_dump(ctx, family,
 				       table, chain, rule_handle, dump,
 				       filter->reset.rule);
@@ -739,8 +1162,16 @@ static int rule_cache_dump(struct netlink_ctx *ctx, const struct handle *h,
 		return 0;
 	}
 
-	ctx->data = h;
-	nftnl_rule_list_foreach(rule_cache, list_rule_cb, ctx);
+	/* debugging output is not serialized across threads. */
+	dump_ctx.parallel = stmts &&
+			    ctx->nft->flags & NFT_CTX_PARALLEL_CACHE &&
+			    !ctx->nft->debug_mask;
+
+	nftnl_rule_list_foreach(rule_cache, list_rule_cb, &dump_ctx);
+	if (dump_ctx.parallel)
+		rule_cache_parse_parallel(&dump_ctx);
+
+	free(dump_ctx.nlr);
 	nftnl_rule_list_free(rule_cache);
 	return 0;
 }
@@ -771,7 +1202,7 @@ static int set_cache_cb(struct nftnl_set *nls, void *arg)
 		return -1;
 
 	set_name = nftnl_set_get_str(nls, NFTNL_SET_NAME);
-	hash = djb_hash(set_name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(set_name);
 	cache_add(&set->cache, &ctx->table->set_cache, hash);
 
 	nftnl_set_list_del(nls);
@@ -824,7 +1255,7 @@ void set_cache_add(struct set *set, struct table *table)
 {
 	uint32_t hash;
 
-	hash = djb_hash(set->handle.set.name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(set->handle.set.name);
 	cache_add(&set->cache, &table->set_cache, hash);
 }
 
@@ -838,9 +1269,11 @@ struct set *set_cache_find(const struct table *table, const char *name)
 	struct set *set;
 	uint32_t hash;
 
-	hash = djb_hash(name) % NFT_CACHE_HSIZE;
-	list_for_each_entry(set, &table->set_cache.ht[hash], cache.hlist) {
-		if (!strcmp(set->handle.set.name, name))
+	hash = djb_hash(name);
+	list_for_each_entry(set, cache_bucket(&table->set_cache, hash),
+			    cache.hlist) {
+		if (set->cache.hash == hash &&
+		    !strcmp(set->handle.set.name, name))
 			return set;
 	}
 
@@ -873,7 +1306,7 @@ static int obj_cache_cb(struct nftnl_obj *nlo, void *arg)
 		return -1;
 
 	obj_name = nftnl_obj_get_str(nlo, NFTNL_OBJ_NAME);
-	hash = djb_hash(obj_name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(obj_name);
 	cache_add(&obj->cache, &ctx->table->obj_cache, hash);
 
 	nftnl_obj_list_del(nlo);
@@ -936,7 +1369,7 @@ void obj_cache_add(struct obj *obj, struct table *table)
 {
 	uint32_t hash;
 
-	hash = djb_hash(obj->handle.obj.name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(obj->handle.obj.name);
 	cache_add(&obj->cache, &table->obj_cache, hash);
 }
 
@@ -951,10 +1384,12 @@ struct obj *obj_cache_find(const struct table *table, const char *name,
 	struct obj *obj;
 	uint32_t hash;
 
-	hash = djb_hash(name) % NFT_CACHE_HSIZE;
-	list_for_each_entry(obj, &table->obj_cache.ht[hash], cache.hlist) {
-		if (!strcmp(obj->handle.obj.name, name) &&
-		    obj->type == obj_type)
+	hash = djb_hash(name);
+	list_for_each_entry(obj, cache_bucket(&table->obj_cache, hash),
+			    cache.hlist) {
+		if (obj->cache.hash == hash &&
+		    obj->type == obj_type &&
+		    !strcmp(obj->handle.obj.name, name))
 			return obj;
 	}
 
@@ -987,7 +1422,7 @@ static int ft_cache_cb(struct nftnl_flowtable *nlf, void *arg)
 		return -1;
 
 	ft_name = nftnl_flowtable_get_str(nlf, NFTNL_FLOWTABLE_NAME);
-	hash = djb_hash(ft_name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(ft_name);
 	cache_add(&ft->cache, &ctx->table->ft_cache, hash);
 
 	nftnl_flowtable_list_del(nlf);
@@ -1041,7 +1476,7 @@ void ft_cache_add(struct flowtable *ft, struct table *table)
 {
 	uint32_t hash;
 
-	hash = djb_hash(ft->handle.flowtable.name) % NFT_CACHE_HSIZE;
+	hash = djb_hash(ft->handle.flowtable.name);
 	cache_add(&ft->cache, &table->ft_cache, hash);
 }
 
@@ -1055,9 +1490,11 @@ struct flowtable *ft_cache_find(const struct table *table, const char *name)
 	struct flowtable *ft;
 	uint32_t hash;
 
-	hash = djb_hash(name) % NFT_CACHE_HSIZE;
-	list_for_each_entry(ft, &table->ft_cache.ht[hash], cache.hlist) {
-		if (!strcmp(ft->handle.flowtable.name, name))
+	hash = djb_hash(name);
+	list_for_each_entry(ft, cache_bucket(&table->ft_cache, hash),
+			    cache.hlist) {
+		if (ft->cache.hash == hash &&
+		    !strcmp(ft->handle.flowtable.name, name))
 			return ft;
 	}
 
@@ -1077,6 +1514,10 @@ static int cache_init_tables(struct netlink_ctx *ctx, struct handle *h,
 
 	list_for_each_entry_safe(table, next, &ctx->list, list) {
 		list_del(&table->list);
+		if (!cache_filter_table_match(filter, table)) {
+			table_free(table);
+			continue;
+		}
 		table_cache_add(table, cache);
 	}
 
@@ -1084,13 +1525,15 @@ static int cache_init_tables(struct netlink_ctx *ctx, struct handle *h,
 }
 
 static int rule_init_cache(struct netlink_ctx *ctx, struct table *table,
-			   const struct nft_cache_filter *filter)
+			   const struct nft_cache_filter *filter,
+			   unsigned int flags)
 {
 	struct rule *rule, *nrule;
 	struct chain *chain;
 	int ret;
 
-	ret = rule_cache_dump(ctx, &table->handle, filter);
+	ret = rule_cache_dump(ctx, &table->handle, filter,
+			      flags & NFT_CACHE_RULE_STMT_BIT);
 
 	list_for_each_entry_safe(rule, nrule, &ctx->list, list) {
 		chain = chain_cache_find(table, rule->handle.chain.name);
@@ -1116,7 +1559,7 @@ err_ctx_list:
 }
 
 static int implicit_chain_cache(struct netlink_ctx *ctx, struct table *table,
-				const char *chain_name)
+				const char *chain_name, unsigned int flags)
 {
 	struct nft_cache_filter filter = {};
 	struct chain *chain;
@@ -1126,51 +1569,259 @@ static int implicit_chain_cache(struct netlink_ctx *ctx, struct table *table,
 		filter.list.table = table->handle.table.name;
 		filter.list.chain = chain->handle.chain.name;
 
-		ret = rule_init_cache(ctx, table, &filter);
+		ret = rule_init_cache(ctx, table, &filter, flags);
 	}
 
 	return ret;
 }
 
-static int cache_init_objects(struct netlink_ctx *ctx, unsigned int flags,
-			      const struct nft_cache_filter *filter)
+static bool nft_cache_is_stream(const struct nft_ctx *nft)
 {
-	struct nftnl_flowtable_list *ft_list = NULL;
-	struct nftnl_chain_list *chain_list = NULL;
-	struct nftnl_set_list *set_list = NULL;
-	struct nftnl_obj_list *obj_list = NULL;
-	struct table *table;
-	struct set *set;
+	return nft->cache->flags & NFT_CACHE_STREAM;
+}
+
+static int rule_cache_fetch(struct netlink_ctx *ctx, struct table *table,
+			    const char *chain)
+{
+	struct nft_cache_filter filter = {
+		.list	= {
+			.family	= table->handle.family,
+			.table	= table->handle.table.name,
+			.chain	= chain,
+		},
+	};
+
+	return rule_init_cache(ctx, table, &filter, NFT_CACHE_RULE_STMT_BIT);
+}
+
+static void chain_rules_free(struct chain *chain)
+{
+	struct rule *rule, *next;
+
+	list_for_each_entry_safe(rule, next, &chain->rules, list) {
+		list_del(&rule->list);
+		rule_free(rule);
+	}
+}
+
+/* Rules of chain bindings are printed inline by the rules that jump to
+ * them, keep them around while the table is listed.
+ */
+int table_stream_fetch(struct netlink_ctx *ctx, struct table *table)
+{
+	struct chain *chain;
+
+	if (!nft_cache_is_stream(ctx->nft))
+		return 0;
+
+	list_for_each_entry(chain, &table->chain_bindings, cache.list) {
+		if (rule_cache_fetch(ctx, table, chain->handle.chain.name) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void table_stream_release(struct netlink_ctx *ctx, struct table *table)
+{
+	struct chain *chain;
+
+	if (!nft_cache_is_stream(ctx->nft))
+		return;
+
+	list_for_each_entry(chain, &table->chain_bindings, cache.list)
+		chain_rules_free(chain);
+}
+
+int chain_stream_fetch(struct netlink_ctx *ctx, struct table *table,
+		       struct chain *chain)
+{
+	if (!nft_cache_is_stream(ctx->nft))
+		return 0;
+
+	return rule_cache_fetch(ctx, table, chain->handle.chain.name);
+}
+
+void chain_stream_release(struct netlink_ctx *ctx, struct chain *chain)
+{
+	if (nft_cache_is_stream(ctx->nft))
+		chain_rules_free(chain);
+}
+
+/* Elements of anonymous sets are fetched along with the cache. */
+int set_stream_fetch(struct netlink_ctx *ctx, struct set *set)
+{
+	if (!nft_cache_is_stream(ctx->nft) ||
+	    nft_output_terse(&ctx->nft->output) ||
+	    set_is_anonymous(set->flags))
+		return 0;
+
+	return netlink_list_setelems(ctx, &set->handle, set, false);
+}
+
+void set_stream_release(struct netlink_ctx *ctx, struct set *set)
+{
+	if (!nft_cache_is_stream(ctx->nft) ||
+	    set_is_anonymous(set->flags))
+		return;
+
+	interval_index_invalidate(set);
+	expr_free(set->init);
+	set->init = NULL;
+}
+
+enum cache_dump_type {
+	CACHE_DUMP_CHAIN,
+	CACHE_DUMP_SET,
+	CACHE_DUMP_OBJECT,
+	CACHE_DUMP_FLOWTABLE,
+	CACHE_DUMP_MAX
+};
+
+struct cache_dump_job {
+	struct netlink_ctx		ctx;
+	const struct nft_cache_filter	*filter;
+	enum cache_dump_type		type;
+	void				*list;
+	int				err;
+};
+
+static void cache_dump_worker(void *data, unsigned int k)
+{
+	struct cache_dump_job *job = ((struct cache_dump_job **)data)[k];
 	int ret = 0;
 
+	switch (job->type) {
+	case CACHE_DUMP_CHAIN:
+		job->list = chain_cache_dump(&job->ctx, job->filter, &ret);
+		break;
+	case CACHE_DUMP_SET:
+		job->list = set_cache_dump(&job->ctx, job->filter, &ret);
+		break;
+	case CACHE_DUMP_OBJECT:
+		job->list = obj_cache_dump(&job->ctx, job->filter);
+		break;
+	case CACHE_DUMP_FLOWTABLE:
+		job->list = ft_cache_dump(&job->ctx, job->filter);
+		break;
+	default:
+		BUG("unknown cache dump type %u\n", job->type);
+	}
+	if (!job->list)
+		job->err = errno;
+}
+
+/* Run the chain, set, object and flowtable dumps concurrently, each on its
+ * own netlink socket. Only the dumps run in parallel, the resulting lists
+ * are transferred to the cache from the caller's thread, the generation id
+ * check in nft_cache_update() covers these dumps as usual.
+ */
+static int cache_dump_parallel(struct netlink_ctx *ctx, unsigned int flags,
+			       const struct nft_cache_filter *filter,
+			       void *lists[CACHE_DUMP_MAX])
+{
+	static const unsigned int bits[CACHE_DUMP_MAX] = {
+		[CACHE_DUMP_CHAIN]	= NFT_CACHE_CHAIN_BIT,
+		[CACHE_DUMP_SET]	= NFT_CACHE_SET_BIT,
+		[CACHE_DUMP_OBJECT]	= NFT_CACHE_OBJECT_BIT,
+		[CACHE_DUMP_FLOWTABLE]	= NFT_CACHE_FLOWTABLE_BIT,
+	};
+	struct cache_dump_job jobs[CACHE_DUMP_MAX] = {};
+	struct cache_dump_job *run[CACHE_DUMP_MAX];
+	unsigned int i, num = 0;
+	int err = 0;
+
+	for (i = 0; i < CACHE_DUMP_MAX; i++) {
+		struct cache_dump_job *job = &jobs[i];
+
+		if (!(flags & bits[i]))
+			continue;
+
+		job->ctx.nft	= ctx->nft;
+		job->ctx.msgs	= ctx->msgs;
+		job->ctx.seqnum	= ctx->seqnum;
+		init_list_head(&job->ctx.list);
+		job->ctx.nf_sock = nft_mnl_socket_open();
+		job->filter	= filter;
+		job->type	= i;
+		run[num++]	= job;
+	}
+
+	nft_parallel_for(num, num, cache_dump_worker, run);
+
+	for (i = 0; i < num; i++) {
+		struct cache_dump_job *job = run[i];
+
+		mnl_socket_close(job->ctx.nf_sock);
+		lists[job->type] = job->list;
+		if (!job->list && !err)
+			err = job->err;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cache_dump_objects(struct netlink_ctx *ctx, unsigned int flags,
+			      const struct nft_cache_filter *filter,
+			      void *lists[CACHE_DUMP_MAX])
+{
+	int ret = 0;
+
+	/* debugging output is not serialized across threads. */
+	if (ctx->nft->flags & NFT_CTX_PARALLEL_CACHE &&
+	    !ctx->nft->debug_mask)
+		return cache_dump_parallel(ctx, flags, filter, lists);
+
 	if (flags & NFT_CACHE_CHAIN_BIT) {
-		chain_list = chain_cache_dump(ctx, filter, &ret);
-		if (!chain_list)
+		lists[CACHE_DUMP_CHAIN] = chain_cache_dump(ctx, filter, &ret);
+		if (!lists[CACHE_DUMP_CHAIN])
 			return -1;
 	}
 	if (flags & NFT_CACHE_SET_BIT) {
-		set_list = set_cache_dump(ctx, filter, &ret);
-		if (!set_list) {
-			ret = -1;
-			goto cache_fails;
-		}
+		lists[CACHE_DUMP_SET] = set_cache_dump(ctx, filter, &ret);
+		if (!lists[CACHE_DUMP_SET])
+			return -1;
 	}
 	if (flags & NFT_CACHE_OBJECT_BIT) {
-		obj_list = obj_cache_dump(ctx, filter);
-		if (!obj_list) {
-			ret = -1;
-			goto cache_fails;
-		}
+		lists[CACHE_DUMP_OBJECT] = obj_cache_dump(ctx, filter);
+		if (!lists[CACHE_DUMP_OBJECT])
+			return -1;
 	}
 	if (flags & NFT_CACHE_FLOWTABLE_BIT) {
-		ft_list = ft_cache_dump(ctx, filter);
-		if (!ft_list) {
-			ret = -1;
-			goto cache_fails;
-		}
+		lists[CACHE_DUMP_FLOWTABLE] = ft_cache_dump(ctx, filter);
+		if (!lists[CACHE_DUMP_FLOWTABLE])
+			return -1;
 	}
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	return 0;
+}
+
+static int cache_init_objects(struct netlink_ctx *ctx, unsigned int flags,
+			      const struct nft_cache_filter *filter)
+{
+	void *lists[CACHE_DUMP_MAX] = {};
+	struct nftnl_flowtable_list *ft_list = NULL;
+	struct nftnl_chain_list *chain_list = NULL;
+	struct nftnl_set_list *set_list = NULL;
+	struct nftnl_obj_list *obj_list = NULL;
+	struct table *table;
+	struct set *set;
+	int ret;
+
+	ret = cache_dump_objects(ctx, flags, filter, lists);
+	chain_list = lists[CACHE_DUMP_CHAIN];
+	set_list = lists[CACHE_DUMP_SET];
+	obj_list = lists[CACHE_DUMP_OBJECT];
+	ft_list = lists[CACHE_DUMP_FLOWTABLE];
+	if (ret < 0)
+		goto cache_fails;
+
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (flags & NFT_CACHE_SET_BIT) {
 			ret = set_cache_init(ctx, table, set_list);
 			if (ret < 0)
@@ -1220,12 +1871,14 @@ static int cache_init_objects(struct netlink_ctx *ctx, unsigned int flags,
 		}
 
 		if (flags & NFT_CACHE_RULE_BIT) {
-			ret = rule_init_cache(ctx, table, filter);
+			ret = rule_init_cache(ctx, table, filter, flags);
 			if (ret < 0)
 				goto cache_fails;
 
 			if (filter && filter->list.table && filter->list.chain) {
-				ret = implicit_chain_cache(ctx, table, filter->list.chain);
+				ret = implicit_chain_cache(ctx, table,
+							   filter->list.chain,
+							   flags);
 				if (ret < 0)
 					goto cache_fails;
 			}
@@ -1240,7 +1893,7 @@ cache_fails:
 	if (ft_list)
 		nftnl_flowtable_list_free(ft_list);
 
-	if (flags & NFT_CACHE_CHAIN_BIT)
+	if (chain_list)
 		nftnl_chain_list_free(chain_list);
 
 	return ret;
@@ -1258,7 +1911,7 @@ static int nft_cache_init(struct netlink_ctx *ctx, unsigned int flags,
 		return 0;
 
 	/* assume NFT_CACHE_TABLE is always set. */
-	ret = cache_init_tables(ctx, &handle, &ctx->nft->cache, filter);
+	ret = cache_init_tables(ctx, &handle, ctx->nft->cache, filter);
 	if (ret < 0)
 		return ret;
 	ret = cache_init_objects(ctx, flags, filter);
@@ -1284,6 +1937,34 @@ static bool nft_cache_is_updated(struct nft_cache *cache, uint16_t genid)
 	return genid && genid == cache->genid;
 }
 
+/* Transactions evaluate further commands against the cache they already
+ * hold, as long as it was fetched with every object these commands need.
+ */
+bool nft_cache_covers(const struct nft_cache *cache, unsigned int flags)
+{
+	return cache->genid &&
+	       !(cache->flags & NFT_CACHE_REFRESH) &&
+	       !(flags & NFT_CACHE_REFRESH) &&
+	       (cache->flags & flags) == flags;
+}
+
+/* In persistent cache mode, bring the cache up to date through the ruleset
+ * events that were received since the last update.
+ */
+static bool nft_cache_sync_events(struct netlink_ctx *ctx, uint16_t genid)
+{
+	struct nft_cache *cache = ctx->nft->cache;
+
+	if (!ctx->nft->ev_sock || !cache->genid)
+		return false;
+
+	if (netlink_cache_events(ctx, ctx->nft->ev_sock, genid) < 0)
+		return false;
+
+	cache->genid = genid;
+	return true;
+}
+
 bool nft_cache_needs_update(struct nft_cache *cache)
 {
 	return cache->flags & NFT_CACHE_UPDATE;
@@ -1298,17 +1979,35 @@ int nft_cache_update(struct nft_ctx *nft, unsigned int flags,
 		.nft		= nft,
 		.msgs		= msgs,
 	};
-	struct nft_cache *cache = &nft->cache;
+	struct nft_cache *cache = nft->cache;
 	uint32_t genid, genid_stop, oldflags;
 	int ret;
+
+	/* listing sessions never update the snapshot they share. */
+	if (nft->parent && cache->genid)
+		return 0;
+	/* the offline ruleset is all there is. */
+	if (nft->offline.file)
+		return 0;
 replay:
 	ctx.seqnum = cache->seqnum++;
 	genid = mnl_genid_get(&ctx);
 	if (!nft_cache_needs_refresh(cache, flags) &&
 	    nft_cache_is_complete(cache, flags) &&
-	    nft_cache_is_updated(cache, genid))
+	    (nft_cache_is_updated(cache, genid) ||
+	     nft_cache_sync_events(&ctx, genid)))
 		return 0;
 
+	/* the persistent cache only grows, ruleset events keep every part of
+	 * it up to date.
+	 */
+	if (nft_cache_is_persistent(nft)) {
+		flags |= cache->flags & NFT_CACHE_FULL;
+		/* the journal keeps the changes the cache did not see yet. */
+		if (cache->genid)
+			netlink_cache_events(&ctx, nft->ev_sock, genid);
+	}
+
 	if (cache->genid)
 		nft_cache_release(cache);
 
@@ -1343,6 +2042,104 @@ replay:
 skip:
 	cache->genid = genid;
 	cache->flags = flags;
+	if (nft->journal)
+		nft_journal_sync(nft->journal, genid);
+
+	/* a filtered cache lacks parts of the ruleset, do not keep it. */
+	if ((nft_cache_is_persistent(nft) && !cache_filter_is_empty(filter)) ||
+	    (filter && filter->table.count))
+		cache->flags |= NFT_CACHE_REFRESH;
+
+	return 0;
+}
+
+static bool set_elems_stateful(const struct set *set)
+{
+	const struct expr *i, *elem;
+
+	if (!list_empty(&set->stmt_list))
+		return true;
+	if (!set->init)
+		return false;
+
+	list_for_each_entry(i, &set->init->expressions, list) {
+		elem = i->etype == EXPR_MAPPING ? i->left : i;
+		if (elem->etype == EXPR_SET_ELEM &&
+		    !list_empty(&elem->stmt_list))
+			return true;
+	}
+
+	return false;
+}
+
+/* Elements that are added from the packet path or that expire, and the state
+ * of element statements, change without ruleset events.
+ */
+static bool set_elems_volatile(const struct nft_ctx *nft,
+			       const struct set *set)
+{
+	if (set->flags & (NFT_SET_EVAL | NFT_SET_TIMEOUT))
+		return true;
+
+	return !nft_output_stateless(&nft->output) && set_elems_stateful(set);
+}
+
+/* Listings reuse the persistent cache, fetch the elements of the listed sets
+ * whose content may have changed since the cache was populated.
+ */
+int nft_cache_list_refresh(struct netlink_ctx *ctx, const struct cmd *cmd)
+{
+	struct nft_ctx *nft = ctx->nft;
+	struct table *table;
+	struct set *set;
+
+	if (!nft_cache_is_persistent(nft) ||
+	    !(nft->cache->flags & NFT_CACHE_SETELEM_BIT) ||
+	    list_cmd_is_stateful(nft, cmd))
+		return 0;
+
+	switch (cmd->obj) {
+	case CMD_OBJ_TABLE:
+		if (!cmd->handle.table.name)
+			return 0;
+		break;
+	case CMD_OBJ_RULESET:
+	case CMD_OBJ_SET:
+	case CMD_OBJ_SETS:
+	case CMD_OBJ_MAP:
+	case CMD_OBJ_MAPS:
+	case CMD_OBJ_METER:
+	case CMD_OBJ_METERS:
+		break;
+	default:
+		return 0;
+	}
+
+	list_for_each_entry(table, &nft->cache->table_cache.list, cache.list) {
+		if (cmd->handle.family != NFPROTO_UNSPEC &&
+		    cmd->handle.family != table->handle.family)
+			continue;
+		if (cmd->handle.table.name &&
+		    strcmp(cmd->handle.table.name, table->handle.table.name))
+			continue;
+
+		list_for_each_entry(set, &table->set_cache.list, cache.list) {
+			if (set_is_anonymous(set->flags) ||
+			    !set_elems_volatile(nft, set))
+				continue;
+			if (cmd->handle.set.name &&
+			    strcmp(cmd->handle.set.name, set->handle.set.name))
+				continue;
+
+			interval_index_invalidate(set);
+			expr_free(set->init);
+			set->init = NULL;
+			if (netlink_list_setelems(ctx, &set->handle, set,
+						  false) < 0)
+				return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -1363,14 +2160,145 @@ void nft_cache_release(struct nft_cache *cache)
 	cache->flags = NFT_CACHE_EMPTY;
 }
 
-void cache_init(struct cache *cache)
+struct nft_cache *nft_cache_alloc(void)
+{
+	struct nft_cache *cache;
+
+	cache = xzalloc(sizeof(*cache));
+	cache_init(&cache->table_cache);
+	cache->refcnt = 1;
+
+	return cache;
+}
+
+void nft_cache_free(struct nft_cache *cache)
+{
+	nft_cache_release(cache);
+	cache_free(&cache->table_cache);
+	free(cache);
+}
+
+/* Ruleset snapshot shared by the listing sessions of a context, see
+ * nft_ctx_session_new(). Sessions only read from it, a new snapshot replaces
+ * it under the lock once the generation id changes, sessions that are still
+ * printing the old one keep it alive through their reference.
+ */
+struct nft_cache_shared {
+	pthread_mutex_t		lock;
+	struct nft_cache	*cache;
+};
+
+struct nft_cache_shared *nft_cache_shared_alloc(void)
 {
-	int i;
+	struct nft_cache_shared *shared;
+
+	shared = xzalloc(sizeof(*shared));
+	pthread_mutex_init(&shared->lock, NULL);
+
+	return shared;
+}
+
+void nft_cache_shared_free(struct nft_cache_shared *shared)
+{
+	if (shared->cache) {
+		assert(shared->cache->refcnt == 1);
+		nft_cache_free(shared->cache);
+	}
+	pthread_mutex_destroy(&shared->lock);
+	free(shared);
+}
+
+int nft_cache_snapshot_get(struct nft_ctx *nft, struct list_head *msgs)
+{
+	struct nft_cache_shared *shared = nft->shared;
+	struct netlink_ctx ctx = {
+		.list		= LIST_HEAD_INIT(ctx.list),
+		.nft		= nft,
+		.msgs		= msgs,
+	};
+	struct nft_cache *cache, *old = NULL;
+	uint32_t genid;
+	int ret = 0;
+
+	genid = mnl_genid_get(&ctx);
+
+	pthread_mutex_lock(&shared->lock);
+	cache = shared->cache;
+	if (!cache || cache->genid != genid) {
+		/* nft_cache_update() fills in the cache of the context. */
+		nft->cache = nft_cache_alloc();
+		ret = nft_cache_update(nft, NFT_CACHE_FULL, msgs, NULL);
+		if (ret < 0) {
+			nft_cache_free(nft->cache);
+			nft->cache = NULL;
+			goto out;
+		}
 
-	cache->ht = xmalloc(sizeof(struct list_head) * NFT_CACHE_HSIZE);
-	for (i = 0; i < NFT_CACHE_HSIZE; i++)
+		old = shared->cache;
+		if (old && --old->refcnt > 0)
+			old = NULL;
+
+		cache = nft->cache;
+		shared->cache = cache;
+	}
+	cache->refcnt++;
+	nft->cache = cache;
+out:
+	pthread_mutex_unlock(&shared->lock);
+
+	if (old)
+		nft_cache_free(old);
+
+	return ret;
+}
+
+void nft_cache_snapshot_put(struct nft_ctx *nft)
+{
+	struct nft_cache *cache = nft->cache;
+	bool last;
+
+	if (!cache)
+		return;
+
+	nft->cache = NULL;
+
+	pthread_mutex_lock(&nft->shared->lock);
+	last = --cache->refcnt == 0;
+	pthread_mutex_unlock(&nft->shared->lock);
+
+	if (last)
+		nft_cache_free(cache);
+}
+
+static void cache_alloc_buckets(struct cache *cache, uint32_t hsize)
+{
+	uint32_t i;
+
+	cache->ht = xmalloc(sizeof(struct list_head) * hsize);
+	for (i = 0; i < hsize; i++)
 		init_list_head(&cache->ht[i]);
 
+	cache->hsize = hsize;
+}
+
+/* Rehash all items, walking the ordered list keeps the insertion order in
+ * each bucket.
+ */
+static void cache_resize(struct cache *cache, uint32_t hsize)
+{
+	struct cache_item *item;
+
+	free(cache->ht);
+	cache_alloc_buckets(cache, hsize);
+
+	list_for_each_entry(item, &cache->list, list)
+		list_add_tail(&item->hlist, cache_bucket(cache, item->hash));
+}
+
+void cache_init(struct cache *cache)
+{
+	cache_alloc_buckets(cache, NFT_CACHE_HSIZE_MIN);
+	cache->count = 0;
 	init_list_head(&cache->list);
 }
 
@@ -1381,12 +2309,23 @@ void cache_free(struct cache *cache)
 
 void cache_add(struct cache_item *item, struct cache *cache, uint32_t hash)
 {
-	list_add_tail(&item->hlist, &cache->ht[hash]);
+	item->hash = hash;
+	item->cache = cache;
+	list_add_tail(&item->hlist, cache_bucket(cache, hash));
 	list_add_tail(&item->list, &cache->list);
+
+	if (++cache->count > cache->hsize)
+		cache_resize(cache, cache->hsize * 2);
 }
 
 void cache_del(struct cache_item *item)
 {
+	struct cache *cache = item->cache;
+
 	list_del(&item->hlist);
 	list_del(&item->list);
+
+	if (--cache->count < cache->hsize / 4 &&
+	    cache->hsize > NFT_CACHE_HSIZE_MIN)
+		cache_resize(cache, cache->hsize / 2);
 }
@@ -38,7 +38,7 @@ static int nft_cmd_enoent_table(struct netlink_ctx *ctx, const struct cmd *cmd,
 	if (!cmd->handle.table.name)
 		return 0;
 
-	table = table_lookup_fuzzy(&cmd->handle, &ctx->nft->cache);
+	table = table_lookup_fuzzy(&cmd->handle, ctx->nft->cache);
 	if (!table)
 		return 0;
 
@@ -51,7 +51,7 @@ static int nft_cmd_enoent_table(struct netlink_ctx *ctx, const struct cmd *cmd,
 static int table_fuzzy_check(struct netlink_ctx *ctx, const struct cmd *cmd,
 			     const struct table *table)
 {
-	if (table_cache_find(&ctx->nft->cache.table_cache,
+	if (table_cache_find(&ctx->nft->cache->table_cache,
 			     cmd->handle.table.name, cmd->handle.family))
 		return 0;
 
@@ -80,7 +80,7 @@ static int nft_cmd_enoent_chain(struct netlink_ctx *ctx, const struct cmd *cmd,
 			     ctx->msgs, NULL) < 0)
 		return 0;
 
-	chain = chain_lookup_fuzzy(&cmd->handle, &ctx->nft->cache, &table);
+	chain = chain_lookup_fuzzy(&cmd->handle, ctx->nft->cache, &table);
 	/* check table first. */
 	if (!table)
 		return 0;
@@ -109,7 +109,7 @@ static int nft_cmd_enoent_rule(struct netlink_ctx *ctx, const struct cmd *cmd,
 	if (nft_cache_update(ctx->nft, flags, ctx->msgs, NULL) < 0)
 		return 0;
 
-	chain = chain_lookup_fuzzy(&cmd->handle, &ctx->nft->cache, &table);
+	chain = chain_lookup_fuzzy(&cmd->handle, ctx->nft->cache, &table);
 	/* check table first. */
 	if (!table)
 		return 0;
@@ -145,7 +145,7 @@ static int nft_cmd_enoent_set(struct netlink_ctx *ctx, const struct cmd *cmd,
 			     ctx->msgs, NULL) < 0)
 		return 0;
 
-	set = set_lookup_fuzzy(cmd->handle.set.name, &ctx->nft->cache, &table);
+	set = set_lookup_fuzzy(cmd->handle.set.name, ctx->nft->cache, &table);
 	/* check table first. */
 	if (!table)
 		return 0;
@@ -178,7 +178,7 @@ static int nft_cmd_enoent_obj(struct netlink_ctx *ctx, const struct cmd *cmd,
 			     ctx->msgs, NULL) < 0)
 		return 0;
 
-	obj = obj_lookup_fuzzy(cmd->handle.obj.name, &ctx->nft->cache, &table);
+	obj = obj_lookup_fuzzy(cmd->handle.obj.name, ctx->nft->cache, &table);
 	/* check table first. */
 	if (!table)
 		return 0;
@@ -211,7 +211,7 @@ static int nft_cmd_enoent_flowtable(struct netlink_ctx *ctx,
 		return 0;
 
 	ft = flowtable_lookup_fuzzy(cmd->handle.flowtable.name,
-				    &ctx->nft->cache, &table);
+				    ctx->nft->cache, &table);
 	/* check table first. */
 	if (!table)
 		return 0;
@@ -295,7 +295,7 @@ static int nft_cmd_chain_error(struct netlink_ctx *ctx, struct cmd *cmd,
 						chain->type.str);
 		}
 
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name, cmd->handle.family);
 		if (table) {
 			existing_chain = chain_cache_find(table, cmd->handle.chain.name);
@@ -317,17 +317,44 @@ static int nft_cmd_chain_error(struct netlink_ctx *ctx, struct cmd *cmd,
 	return 0;
 }
 
+/*
+ * Attribute locations are recorded while the messages of the command are
+ * built, hence sorted by sequence number and then by offset. Look up the last
+ * one recorded for the attribute the kernel complains about.
+ */
+static const struct location *cmd_find_loc(const struct cmd *cmd,
+					   const struct mnl_err *err)
+{
+	uint32_t lo = 0, hi = cmd->num_attrs, mid;
+	const struct nlerr_loc *attr;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		attr = &cmd->attr[mid];
+
+		if (attr->seqnum < err->seqnum ||
+		    (attr->seqnum == err->seqnum && attr->offset <= err->offset))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return NULL;
+
+	attr = &cmd->attr[lo - 1];
+	if (attr->seqnum != err->seqnum || attr->offset != err->offset)
+		return NULL;
+
+	return attr->location;
+}
+
 void nft_cmd_error(struct netlink_ctx *ctx, struct cmd *cmd,
 		   struct mnl_err *err)
 {
-	const struct location *loc = NULL;
-	uint32_t i;
+	const struct location *loc;
 
-	for (i = 0; i < cmd->num_attrs; i++) {
-		if (cmd->attr[i].seqnum == err->seqnum &&
-		    cmd->attr[i].offset == err->offset)
-			loc = cmd->attr[i].location;
-	}
+	loc = cmd_find_loc(cmd, err);
 
 	if (loc) {
 		if (err->err == ENOENT) {
@@ -459,6 +486,8 @@ void nft_cmd_expand(struct cmd *cmd)
 		list_for_each_entry(chain, &table->chains, list)
 			nft_cmd_expand_chain(chain, &new_cmds);
 
+		list_for_each_entry(new, &new_cmds, list)
+			new->index = cmd->index;
 		list_splice(&new_cmds, &cmd->list);
 		break;
 	case CMD_OBJ_CHAIN:
@@ -467,18 +496,21 @@ void nft_cmd_expand(struct cmd *cmd)
 			break;
 
 		nft_cmd_expand_chain(chain, &new_cmds);
+		list_for_each_entry(new, &new_cmds, list)
+			new->index = cmd->index;
 		list_splice(&new_cmds, &cmd->list);
 		break;
 	case CMD_OBJ_SET:
 	case CMD_OBJ_MAP:
 		set = cmd->set;
-		if (!set->init)
+		if (!set->init && !set->maglev.backends)
 			break;
 
 		memset(&h, 0, sizeof(h));
 		handle_merge(&h, &set->handle);
 		new = cmd_alloc(CMD_ADD, CMD_OBJ_SETELEMS, &h,
 				&set->location, set_get(set));
+		new->index = cmd->index;
 		list_add(&new->list, &cmd->list);
 		break;
 	default:
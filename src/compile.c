@@ -0,0 +1,693 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Compiled rulesets. With a compile output set, the ruleset is parsed,
+ * evaluated and linearized as usual, but the resulting netlink batch is
+ * written to a file instead of being sent to the kernel. Loading that file
+ * sends the batch as is.
+ *
+ * The file records a fingerprint of what the batch was derived from: nft
+ * version, kernel release, context settings, the source files and the
+ * iproute2 databases that were used. If any of these changed, the batch is
+ * rebuilt from its source file before it is loaded.
+ *
+ * The ruleset in the kernel is not part of the fingerprint, a compiled
+ * batch fails to load in the same cases as its source file would, e.g.
+ * when it adds rules to a chain that does not exist. Commands that refer
+ * to objects by handle cannot be compiled.
+ */
+
+#include <nft.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#include <libnftnl/batch.h>
+
+#include <nftables.h>
+#include <rule.h>
+#include <cmd.h>
+#include <mnl.h>
+#include <netlink.h>
+#include <parser.h>
+#include <datatype.h>
+#include <erec.h>
+#include <utils.h>
+#include <compile.h>
+
+#define NFT_COMPILED_MAGIC	"NFTC"
+#define NFT_COMPILED_VERSION	1
+
+#define COMPILE_HASH_INIT	0xcbf29ce484222325ULL
+#define COMPILE_HASH_PRIME	0x100000001b3ULL
+
+enum compiled_source_type {
+	COMPILED_SOURCE_FILE,
+	COMPILED_SOURCE_RT_DB,
+};
+
+/* The file is only meant for this host, fields are in host byte order. */
+struct compiled_hdr {
+	char		magic[4];
+	uint32_t	version;
+	uint64_t	fingerprint;
+	uint32_t	num_sources;
+	uint32_t	num_cmds;
+	uint32_t	batch_len;
+	uint32_t	pad;
+};
+
+/* Followed by @name_len bytes of name, not NUL terminated. */
+struct compiled_source_hdr {
+	uint64_t	hash;
+	uint16_t	type;
+	uint16_t	name_len;
+	uint32_t	pad;
+};
+
+/* Source location of the commands, to report errors on load. */
+struct compiled_cmd {
+	uint32_t	seqnum_from;
+	uint32_t	seqnum_to;
+	uint32_t	source;
+	uint32_t	line;
+};
+
+struct compiled_source {
+	char		*name;
+	uint16_t	type;
+	uint64_t	hash;
+};
+
+struct compiled {
+	struct compiled_hdr	hdr;
+	struct compiled_source	*sources;
+	unsigned int		sources_size;
+	struct compiled_cmd	*cmds;
+	char			*buf;
+	const void		*batch;
+};
+
+static uint64_t compile_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= COMPILE_HASH_PRIME;
+	}
+
+	return hash;
+}
+
+static uint64_t compile_hash_str(uint64_t hash, const char *str)
+{
+	return compile_hash(hash, str, strlen(str) + 1);
+}
+
+/* Hash of the contents of a source, zero if it cannot be read. */
+static uint64_t compile_hash_source(uint16_t type, const char *name)
+{
+	uint64_t hash = COMPILE_HASH_INIT;
+	char buf[4096], *path = NULL;
+	size_t len;
+	FILE *f;
+
+	if (type == COMPILED_SOURCE_RT_DB)
+		f = rt_symbol_db_open(name, &path);
+	else
+		f = fopen(name, "r");
+
+	free(path);
+	if (!f)
+		return 0;
+
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		hash = compile_hash(hash, buf, len);
+
+	if (ferror(f))
+		hash = 0;
+
+	fclose(f);
+
+	return hash;
+}
+
+/*
+ * Settings that the batch depends on. Include paths are left out, the
+ * files that were actually included are recorded as sources.
+ */
+static uint64_t compile_fingerprint(const struct nft_ctx *nft)
+{
+	uint64_t hash = COMPILE_HASH_INIT;
+	struct utsname uts;
+	unsigned int i;
+
+	hash = compile_hash_str(hash, PACKAGE_VERSION);
+	if (uname(&uts) == 0) {
+		hash = compile_hash_str(hash, uts.release);
+		hash = compile_hash_str(hash, uts.machine);
+	}
+
+	for (i = 0; i < nft->num_vars; i++) {
+		hash = compile_hash_str(hash, nft->vars[i].key);
+		hash = compile_hash_str(hash, nft->vars[i].value);
+	}
+
+	hash = compile_hash(hash, &nft->input.flags, sizeof(nft->input.flags));
+	hash = compile_hash(hash, &nft->optimize_flags,
+			    sizeof(nft->optimize_flags));
+
+	return hash;
+}
+
+static unsigned int compile_source_add(struct compiled *c, uint16_t type,
+				       const char *name)
+{
+	struct compiled_source *source;
+	unsigned int i;
+
+	for (i = 0; i < c->hdr.num_sources; i++) {
+		if (c->sources[i].type == type &&
+		    !strcmp(c->sources[i].name, name))
+			return i;
+	}
+
+	if (c->hdr.num_sources == c->sources_size) {
+		c->sources_size = c->sources_size ? c->sources_size * 2 : 8;
+		c->sources = xrealloc(c->sources,
+				      c->sources_size * sizeof(*c->sources));
+	}
+
+	source = &c->sources[c->hdr.num_sources];
+	source->name = xstrdup(name);
+	source->type = type;
+	source->hash = compile_hash_source(type, name);
+
+	return c->hdr.num_sources++;
+}
+
+static unsigned int compile_source_file(struct compiled *c, const char *name)
+{
+	char path[PATH_MAX];
+
+	if (realpath(name, path))
+		name = path;
+
+	return compile_source_add(c, COMPILED_SOURCE_FILE, name);
+}
+
+static void compiled_free(struct compiled *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->hdr.num_sources; i++)
+		free(c->sources[i].name);
+
+	free(c->sources);
+	free(c->cmds);
+	free(c->buf);
+	memset(c, 0, sizeof(*c));
+}
+
+bool nft_compiled_file(const char *filename)
+{
+	char magic[4];
+	struct stat sb;
+	bool ret;
+	FILE *f;
+
+	/* Do not consume input from fifos. */
+	if (stat(filename, &sb) < 0 || !S_ISREG(sb.st_mode))
+		return false;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return false;
+
+	ret = fread(magic, sizeof(magic), 1, f) == 1 &&
+	      !memcmp(magic, NFT_COMPILED_MAGIC, sizeof(magic));
+
+	fclose(f);
+
+	return ret;
+}
+
+static bool compile_cmd_supported(const struct cmd *cmd)
+{
+	switch (cmd->op) {
+	case CMD_ADD:
+	case CMD_CREATE:
+	case CMD_INSERT:
+	case CMD_DELETE:
+	case CMD_DESTROY:
+	case CMD_FLUSH:
+		break;
+	default:
+		return false;
+	}
+
+	return !cmd->handle.handle.id &&
+	       !cmd->handle.position.id &&
+	       !cmd->handle.index.id;
+}
+
+int nft_compile_check(struct nft_ctx *nft, const struct list_head *cmds,
+		      struct list_head *msgs)
+{
+	const struct cmd *cmd;
+
+	if (!nft->compile.source || nft->stdin_buf) {
+		erec_queue(error(&internal_location,
+				 "Only rulesets read from a file can be compiled"),
+			   msgs);
+		return -1;
+	}
+
+	if (nft_output_echo(&nft->output) ||
+	    nft_output_echo_handles(&nft->output)) {
+		erec_queue(error(&internal_location,
+				 "Cannot compile a ruleset with echo output"),
+			   msgs);
+		return -1;
+	}
+
+	list_for_each_entry(cmd, cmds, list) {
+		if (compile_cmd_supported(cmd))
+			continue;
+
+		erec_queue(error(&cmd->location,
+				 "Cannot compile this command, only commands that add, flush or delete objects by name are supported"),
+			   msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool compiled_write(FILE *f, const struct compiled *c,
+			   const struct iovec *iov, unsigned int iov_len)
+{
+	struct compiled_source_hdr shdr = {};
+	unsigned int i;
+
+	fwrite(&c->hdr, sizeof(c->hdr), 1, f);
+
+	for (i = 0; i < c->hdr.num_sources; i++) {
+		shdr.hash = c->sources[i].hash;
+		shdr.type = c->sources[i].type;
+		shdr.name_len = strlen(c->sources[i].name);
+		fwrite(&shdr, sizeof(shdr), 1, f);
+		fwrite(c->sources[i].name, shdr.name_len, 1, f);
+	}
+
+	fwrite(c->cmds, sizeof(*c->cmds), c->hdr.num_cmds, f);
+
+	for (i = 0; i < iov_len; i++)
+		fwrite(iov[i].iov_base, iov[i].iov_len, 1, f);
+
+	return !ferror(f);
+}
+
+/* Write to a temporary file first, so the output is replaced atomically. */
+static int compiled_write_file(const char *filename, const struct compiled *c,
+			       const struct iovec *iov, unsigned int iov_len,
+			       struct list_head *msgs)
+{
+	char *tmpname;
+	FILE *f;
+	int fd;
+
+	if (asprintf(&tmpname, "%s.XXXXXX", filename) < 0)
+		memory_allocation_error();
+
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		goto err;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto err_unlink;
+	}
+
+	if (!compiled_write(f, c, iov, iov_len)) {
+		fclose(f);
+		goto err_unlink;
+	}
+
+	if (fclose(f) != 0 || rename(tmpname, filename) < 0)
+		goto err_unlink;
+
+	free(tmpname);
+
+	return 0;
+
+err_unlink:
+	unlink(tmpname);
+err:
+	erec_queue(error(&internal_location, "Could not write \"%s\": %s",
+			 filename, strerror(errno)), msgs);
+	free(tmpname);
+
+	return -1;
+}
+
+int nft_compile_write(struct nft_ctx *nft, struct mnl_batch *batch,
+		      const struct list_head *cmds, struct list_head *msgs)
+{
+	const struct input_descriptor *indesc, *last = NULL;
+	unsigned int i, num_cmds = 0, last_source = 0;
+	const struct rt_symbol_db *db;
+	struct compiled c = {};
+	const struct cmd *cmd;
+	struct compiled_cmd *ccmd;
+	unsigned int iov_len;
+	struct iovec *iov;
+	int ret;
+
+	compile_source_file(&c, nft->compile.source);
+
+	list_for_each_entry(cmd, cmds, list)
+		num_cmds++;
+
+	c.cmds = xzalloc(num_cmds * sizeof(*c.cmds));
+	list_for_each_entry(cmd, cmds, list) {
+		ccmd = &c.cmds[c.hdr.num_cmds++];
+		ccmd->seqnum_from = cmd->seqnum_from;
+		ccmd->seqnum_to = cmd->seqnum_to;
+		ccmd->source = UINT32_MAX;
+
+		indesc = cmd->location.indesc;
+		if (!indesc || indesc->type != INDESC_FILE)
+			continue;
+
+		if (indesc != last) {
+			last_source = compile_source_file(&c, indesc->name);
+			last = indesc;
+		}
+		ccmd->source = last_source;
+		ccmd->line = cmd->location.first_line;
+	}
+
+	/* Included files that did not provide any command. */
+	if (nft->state) {
+		list_for_each_entry(indesc, &nft->state->indesc_list, list) {
+			if (indesc->type == INDESC_FILE)
+				compile_source_file(&c, indesc->name);
+		}
+	}
+
+	for (db = rt_symbol_db_loaded(); db; db = db->next)
+		compile_source_add(&c, COMPILED_SOURCE_RT_DB, db->filename);
+
+	iov_len = mnl_batch_iovec_len(batch);
+	iov = xmalloc(iov_len * sizeof(*iov));
+	mnl_batch_iovec(batch, iov, iov_len);
+
+	for (i = 0; i < iov_len; i++)
+		c.hdr.batch_len += iov[i].iov_len;
+
+	memcpy(c.hdr.magic, NFT_COMPILED_MAGIC, sizeof(c.hdr.magic));
+	c.hdr.version = NFT_COMPILED_VERSION;
+	c.hdr.fingerprint = compile_fingerprint(nft);
+
+	ret = compiled_write_file(nft->compile.output, &c, iov, iov_len, msgs);
+
+	free(iov);
+	compiled_free(&c);
+
+	return ret;
+}
+
+struct compiled_reader {
+	const char	*buf;
+	size_t		len;
+	size_t		off;
+};
+
+static const void *compiled_read(struct compiled_reader *r, size_t len)
+{
+	const void *p;
+
+	if (r->len - r->off < len)
+		return NULL;
+
+	p = r->buf + r->off;
+	r->off += len;
+
+	return p;
+}
+
+static int compiled_read_file(const char *filename, struct compiled *c,
+			      size_t *len)
+{
+	struct stat sb;
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	if (fstat(fileno(f), &sb) < 0)
+		goto out;
+
+	*len = sb.st_size;
+	c->buf = xmalloc(*len + 1);
+	if (fread(c->buf, 1, *len, f) == *len)
+		ret = 0;
+out:
+	fclose(f);
+
+	return ret;
+}
+
+static int compiled_parse(struct compiled *c, size_t len)
+{
+	struct compiled_reader r = { .buf = c->buf, .len = len };
+	struct compiled_source_hdr shdr;
+	unsigned int i, num_sources;
+	const void *p;
+
+	p = compiled_read(&r, sizeof(c->hdr));
+	if (!p)
+		return -1;
+
+	/* compiled_free() only walks the sources that were read. */
+	memcpy(&c->hdr, p, sizeof(c->hdr));
+	num_sources = c->hdr.num_sources;
+	c->hdr.num_sources = 0;
+
+	if (memcmp(c->hdr.magic, NFT_COMPILED_MAGIC, sizeof(c->hdr.magic)) ||
+	    c->hdr.version != NFT_COMPILED_VERSION ||
+	    num_sources > len / sizeof(shdr))
+		return -1;
+
+	c->sources = xzalloc((num_sources + 1) * sizeof(*c->sources));
+	for (i = 0; i < num_sources; i++) {
+		p = compiled_read(&r, sizeof(shdr));
+		if (!p)
+			return -1;
+
+		memcpy(&shdr, p, sizeof(shdr));
+		p = compiled_read(&r, shdr.name_len);
+		if (!p)
+			return -1;
+
+		c->sources[i].name = xzalloc(shdr.name_len + 1);
+		memcpy(c->sources[i].name, p, shdr.name_len);
+		c->sources[i].type = shdr.type;
+		c->sources[i].hash = shdr.hash;
+		c->hdr.num_sources++;
+	}
+
+	p = compiled_read(&r, (size_t)c->hdr.num_cmds * sizeof(*c->cmds));
+	if (!p)
+		return -1;
+
+	c->cmds = xmalloc((c->hdr.num_cmds + 1) * sizeof(*c->cmds));
+	memcpy(c->cmds, p, c->hdr.num_cmds * sizeof(*c->cmds));
+
+	c->batch = compiled_read(&r, c->hdr.batch_len);
+	if (!c->batch || r.off != r.len)
+		return -1;
+
+	return 0;
+}
+
+static bool compiled_stale(const struct nft_ctx *nft, const struct compiled *c)
+{
+	unsigned int i;
+
+	if (c->hdr.fingerprint != compile_fingerprint(nft))
+		return true;
+
+	for (i = 0; i < c->hdr.num_sources; i++) {
+		if (compile_hash_source(c->sources[i].type,
+					c->sources[i].name) != c->sources[i].hash)
+			return true;
+	}
+
+	return false;
+}
+
+static int compiled_load(struct nft_ctx *nft, const char *filename,
+			 struct compiled *c, bool *stale,
+			 struct list_head *msgs)
+{
+	size_t len;
+
+	if (compiled_read_file(filename, c, &len) < 0) {
+		erec_queue(error(&internal_location,
+				 "Could not read \"%s\": %s",
+				 filename, strerror(errno)), msgs);
+		return -1;
+	}
+
+	if (compiled_parse(c, len) < 0) {
+		erec_queue(error(&internal_location,
+				 "\"%s\" is not a valid compiled ruleset",
+				 filename), msgs);
+		return -1;
+	}
+
+	*stale = compiled_stale(nft, c);
+
+	return 0;
+}
+
+/* In check mode, check the source file instead of rebuilding. */
+static int compiled_rebuild(struct nft_ctx *nft, const char *filename,
+			    const struct compiled *c, struct list_head *msgs)
+{
+	char *source;
+	int ret;
+
+	if (c->hdr.num_sources == 0 ||
+	    c->sources[0].type != COMPILED_SOURCE_FILE) {
+		erec_queue(error(&internal_location,
+				 "\"%s\" is stale and has no source file",
+				 filename), msgs);
+		return -1;
+	}
+
+	source = xstrdup(c->sources[0].name);
+	if (!nft->check)
+		nft->compile.output = xstrdup(filename);
+
+	ret = nft_run_cmd_from_filename(nft, source);
+
+	free(nft->compile.output);
+	nft->compile.output = NULL;
+	free(source);
+
+	return ret;
+}
+
+static const struct compiled_cmd *compiled_cmd_find(const struct compiled *c,
+						    uint32_t seqnum)
+{
+	unsigned int lo = 0, hi = c->hdr.num_cmds, mid;
+
+	/* Sequence numbers are monotonic. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (seqnum < c->cmds[mid].seqnum_from)
+			hi = mid;
+		else if (seqnum > c->cmds[mid].seqnum_to)
+			lo = mid + 1;
+		else
+			return &c->cmds[mid];
+	}
+
+	return NULL;
+}
+
+static int compiled_replay(struct nft_ctx *nft, const struct compiled *c,
+			   struct list_head *msgs)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.msgs	= msgs,
+		.list	= LIST_HEAD_INIT(ctx.list),
+	};
+	const struct compiled_cmd *ccmd;
+	struct mnl_err *err, *tmp;
+	LIST_HEAD(err_list);
+	int ret;
+
+	ret = mnl_batch_replay(&ctx, c->batch, c->hdr.batch_len, &err_list,
+			       c->hdr.num_cmds);
+	if (ret < 0) {
+		netlink_io_error(&ctx, NULL, "Could not process rule: %s",
+				 strerror(errno));
+		return -1;
+	}
+
+	list_for_each_entry_safe(err, tmp, &err_list, head) {
+		ccmd = compiled_cmd_find(c, err->seqnum);
+		if (ccmd && ccmd->source < c->hdr.num_sources)
+			netlink_io_error(&ctx, NULL,
+					 "%s:%u: Could not process rule: %s",
+					 c->sources[ccmd->source].name,
+					 ccmd->line, strerror(err->err));
+		else
+			netlink_io_error(&ctx, NULL,
+					 "Could not process rule: %s",
+					 strerror(err->err));
+
+		errno = err->err;
+		mnl_err_list_free(err);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int nft_compiled_run(struct nft_ctx *nft, const char *filename)
+{
+	struct compiled c = {};
+	bool stale = false;
+	LIST_HEAD(msgs);
+	int ret;
+
+	if (nft->compile.output) {
+		erec_queue(error(&internal_location,
+				 "\"%s\" is already compiled", filename),
+			   &msgs);
+		ret = -1;
+		goto out;
+	}
+
+	ret = compiled_load(nft, filename, &c, &stale, &msgs);
+	if (ret < 0 || !stale)
+		goto replay;
+
+	ret = compiled_rebuild(nft, filename, &c, &msgs);
+	compiled_free(&c);
+	if (ret < 0 || nft->check)
+		goto out;
+
+	ret = compiled_load(nft, filename, &c, &stale, &msgs);
+	if (ret == 0 && stale) {
+		erec_queue(error(&internal_location,
+				 "\"%s\" is still stale after rebuilding it",
+				 filename), &msgs);
+		ret = -1;
+	}
+replay:
+	if (ret == 0 && !nft->check)
+		ret = compiled_replay(nft, &c, &msgs);
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	compiled_free(&c);
+
+	return ret;
+}
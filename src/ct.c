@@ -143,6 +143,15 @@ const struct datatype ct_event_type = {
 
 #define CT_LABEL_BIT_SIZE 128
 
+static struct rt_symbol_db ct_label_db = {
+	.filename	= CONNLABEL_CONF,
+};
+
+const struct symbol_table *ct_label_table(struct symbol_tables *tbl)
+{
+	return rt_symbol_db_get(&ct_label_db, &tbl->ct_label);
+}
+
 const char *ct_label2str(const struct symbol_table *ct_label_tbl,
 			 unsigned long value)
 {
@@ -160,7 +169,7 @@ static void ct_label_type_print(const struct expr *expr,
 				 struct output_ctx *octx)
 {
 	unsigned long bit = mpz_scan1(expr->value, 0);
-	const char *labelstr = ct_label2str(octx->tbl.ct_label, bit);
+	const char *labelstr = ct_label2str(ct_label_table(&octx->tbl), bit);
 
 	if (labelstr) {
 		nft_print(octx, "\"%s\"", labelstr);
@@ -174,13 +183,14 @@ static struct error_record *ct_label_type_parse(struct parse_ctx *ctx,
 						const struct expr *sym,
 						struct expr **res)
 {
+	const struct symbol_table *tbl = ct_label_table(ctx->tbl);
 	const struct symbolic_constant *s;
 	const struct datatype *dtype;
 	uint8_t data[CT_LABEL_BIT_SIZE / BITS_PER_BYTE];
 	uint64_t bit;
 	mpz_t value;
 
-	for (s = ctx->tbl->ct_label->symbols; s->identifier != NULL; s++) {
+	for (s = tbl->symbols; s->identifier != NULL; s++) {
 		if (!strcmp(sym->identifier, s->identifier))
 			break;
 	}
@@ -219,7 +229,7 @@ static struct error_record *ct_label_type_parse(struct parse_ctx *ctx,
 static void ct_label_type_describe(struct output_ctx *octx)
 {
 	rt_symbol_table_describe(octx, CONNLABEL_CONF,
-				 octx->tbl.ct_label, &ct_label_type);
+				 ct_label_table(&octx->tbl), &ct_label_type);
 }
 
 const struct datatype ct_label_type = {
@@ -235,16 +245,6 @@ const struct datatype ct_label_type = {
 	.parse		= ct_label_type_parse,
 };
 
-void ct_label_table_init(struct nft_ctx *ctx)
-{
-	ctx->output.tbl.ct_label = rt_symbol_table_init(CONNLABEL_CONF);
-}
-
-void ct_label_table_exit(struct nft_ctx *ctx)
-{
-	rt_symbol_table_free(ctx->output.tbl.ct_label);
-}
-
 #ifndef NF_CT_HELPER_NAME_LEN
 #define NF_CT_HELPER_NAME_LEN	16
 #endif
@@ -0,0 +1,406 @@
+/*
+ * Command server on a unix socket
+ *
+ * Clients send one request per line, in the same syntax as nft -i. Each
+ * request is answered with a header line "<rc> <length>" followed by
+ * <length> bytes of output and error messages.
+ *
+ * The context lives as long as the server, so its cache stays warm across
+ * requests. Requests that update the ruleset are not run right away: those
+ * that arrive within the batch window are collected into one transaction
+ * and committed together. If the kernel rejects the transaction, they are
+ * run again one by one so that each client gets its own result. Any other
+ * request commits the pending transaction first, so it sees all updates
+ * that were requested before it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <nft.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <daemon.h>
+#include <utils.h>
+
+#define DAEMON_MAX_CLIENTS	256
+#define DAEMON_MAX_LINE		(1 << 20)
+#define DAEMON_READ_SIZE	65536
+
+struct daemon_client {
+	int			fd;
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	/* line waiting in the transaction, further lines wait for it. */
+	char			*pending;
+};
+
+struct daemon {
+	struct nft_ctx		*nft;
+	struct nft_txn		*txn;
+	struct timespec		deadline;
+	unsigned int		window_ms;
+	struct daemon_client	clients[DAEMON_MAX_CLIENTS];
+	unsigned int		num_clients;
+};
+
+static volatile sig_atomic_t daemon_quit;
+
+static void daemon_sig_handler(int sig)
+{
+	daemon_quit = 1;
+}
+
+static void daemon_reply(struct daemon_client *client, int rc,
+			 const char *output, const char *error)
+{
+	size_t olen = strlen(output), elen = strlen(error);
+	char hdr[64];
+	int len;
+
+	len = snprintf(hdr, sizeof(hdr), "%d %zu\n", rc, olen + elen);
+
+	/* a client that does not read its replies is dropped on the next
+	 * read, errors are not relevant here.
+	 */
+	if (write(client->fd, hdr, len) < 0 ||
+	    write(client->fd, output, olen) < 0 ||
+	    write(client->fd, error, elen) < 0)
+		return;
+}
+
+static void daemon_reply_ctx(struct daemon *d, struct daemon_client *client,
+			     int rc)
+{
+	const char *output, *error;
+
+	output = nft_ctx_get_output_buffer(d->nft);
+	error = nft_ctx_get_error_buffer(d->nft);
+	daemon_reply(client, rc, output, error);
+}
+
+static void daemon_run_cmd(struct daemon *d, struct daemon_client *client,
+			   const char *line)
+{
+	int rc;
+
+	rc = nft_run_cmd_from_buffer(d->nft, line);
+	daemon_reply_ctx(d, client, rc);
+}
+
+/* Commands that only update the ruleset can be batched with others. */
+static bool daemon_cmd_is_update(const char *line)
+{
+	static const char *const verbs[] = {
+		"add", "create", "insert", "replace", "delete", "destroy",
+		"flush", "rename",
+	};
+	unsigned int i;
+	size_t len;
+
+	while (isspace(*line))
+		line++;
+
+	for (i = 0; i < array_size(verbs); i++) {
+		len = strlen(verbs[i]);
+		if (!strncmp(line, verbs[i], len) && isspace(line[len]))
+			return true;
+	}
+
+	return false;
+}
+
+static void daemon_commit(struct daemon *d)
+{
+	struct daemon_client *client;
+	unsigned int i;
+	int rc;
+
+	if (!d->txn)
+		return;
+
+	rc = nft_txn_commit(d->txn);
+	d->txn = NULL;
+
+	/* errors of a failed transaction refer to one of the lines, they are
+	 * run again one by one below so that each client gets its own.
+	 */
+	nft_ctx_get_output_buffer(d->nft);
+	nft_ctx_get_error_buffer(d->nft);
+
+	for (i = 0; i < d->num_clients; i++) {
+		client = &d->clients[i];
+		if (!client->pending)
+			continue;
+
+		if (rc)
+			daemon_run_cmd(d, client, client->pending);
+		else
+			daemon_reply(client, 0, "", "");
+
+		free(client->pending);
+		client->pending = NULL;
+	}
+}
+
+static void daemon_deadline(struct daemon *d)
+{
+	clock_gettime(CLOCK_MONOTONIC, &d->deadline);
+	d->deadline.tv_sec += d->window_ms / 1000;
+	d->deadline.tv_nsec += (d->window_ms % 1000) * 1000000;
+	if (d->deadline.tv_nsec >= 1000000000) {
+		d->deadline.tv_sec++;
+		d->deadline.tv_nsec -= 1000000000;
+	}
+}
+
+static int daemon_timeout(const struct daemon *d)
+{
+	struct timespec now;
+	long ms;
+
+	if (!d->txn)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (d->deadline.tv_sec - now.tv_sec) * 1000 +
+	     (d->deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+static void daemon_line(struct daemon *d, struct daemon_client *client,
+			char *line)
+{
+	int rc;
+
+	if (!daemon_cmd_is_update(line) || d->window_ms == 0) {
+		daemon_commit(d);
+		daemon_run_cmd(d, client, line);
+		return;
+	}
+
+	if (!d->txn) {
+		d->txn = nft_txn_begin(d->nft);
+		if (!d->txn) {
+			daemon_run_cmd(d, client, line);
+			return;
+		}
+		daemon_deadline(d);
+	}
+
+	rc = nft_txn_add_cmd(d->txn, line);
+	if (rc) {
+		daemon_reply_ctx(d, client, rc);
+		return;
+	}
+
+	client->pending = strdup(line);
+	if (!client->pending) {
+		fprintf(stderr, "%s:%u: Memory allocation failure\n",
+			__FILE__, __LINE__);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Handle complete lines, unless a previous one is still pending. */
+static void daemon_client_lines(struct daemon *d,
+				struct daemon_client *client)
+{
+	char *line = client->buf, *nl;
+	size_t left = client->len;
+
+	while (!client->pending &&
+	       (nl = memchr(line, '\n', left)) != NULL) {
+		*nl = '\0';
+		left -= nl + 1 - line;
+
+		if (nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		if (*line != '\0')
+			daemon_line(d, client, line);
+
+		line = nl + 1;
+	}
+
+	memmove(client->buf, line, left);
+	client->len = left;
+}
+
+static void daemon_client_close(struct daemon *d, unsigned int i)
+{
+	struct daemon_client *client = &d->clients[i];
+
+	/* its transaction is committed anyway, the reply goes nowhere. */
+	if (client->pending)
+		daemon_commit(d);
+
+	close(client->fd);
+	free(client->buf);
+	d->clients[i] = d->clients[--d->num_clients];
+}
+
+static int daemon_client_read(struct daemon *d, struct daemon_client *client)
+{
+	ssize_t ret;
+	char *buf;
+
+	if (client->size - client->len < DAEMON_READ_SIZE) {
+		if (client->size >= DAEMON_MAX_LINE)
+			return -1;
+
+		buf = realloc(client->buf, client->size + DAEMON_READ_SIZE);
+		if (!buf)
+			return -1;
+		client->buf = buf;
+		client->size += DAEMON_READ_SIZE;
+	}
+
+	ret = read(client->fd, client->buf + client->len,
+		   client->size - client->len);
+	if (ret <= 0)
+		return ret < 0 && errno == EINTR ? 0 : -1;
+
+	client->len += ret;
+	daemon_client_lines(d, client);
+
+	return 0;
+}
+
+static void daemon_accept(struct daemon *d, int lfd)
+{
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (d->num_clients == DAEMON_MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+
+	memset(&d->clients[d->num_clients], 0, sizeof(struct daemon_client));
+	d->clients[d->num_clients++].fd = fd;
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family	= AF_UNIX,
+	};
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: socket path `%s' is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* leftover from a previous run, never remove anything else. */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto err;
+
+	umask(0077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 64) < 0) {
+		close(fd);
+		goto err;
+	}
+
+	return fd;
+err:
+	fprintf(stderr, "Error: cannot listen on `%s': %s\n", path,
+		strerror(errno));
+	return -1;
+}
+
+int daemon_run(struct nft_ctx *nft, const char *path, unsigned int window_ms)
+{
+	struct pollfd pfd[DAEMON_MAX_CLIENTS + 1];
+	struct daemon d = {
+		.nft		= nft,
+		.window_ms	= window_ms,
+	};
+	struct sigaction sa = {
+		.sa_handler	= daemon_sig_handler,
+	};
+	unsigned int i, n;
+	int lfd, ret;
+
+	if (nft_ctx_buffer_output(nft) || nft_ctx_buffer_error(nft)) {
+		fprintf(stderr, "Error: cannot buffer output\n");
+		return EXIT_FAILURE;
+	}
+
+	lfd = daemon_listen(path);
+	if (lfd < 0)
+		return EXIT_FAILURE;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!daemon_quit) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < d.num_clients; i++) {
+			pfd[i + 1].fd = d.clients[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		n = d.num_clients;
+
+		ret = poll(pfd, n + 1, daemon_timeout(&d));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* backwards, closing a client moves the last one into its
+		 * slot.
+		 */
+		for (i = n; i > 0; i--) {
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if (daemon_client_read(&d, &d.clients[i - 1]) < 0)
+				daemon_client_close(&d, i - 1);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			daemon_accept(&d, lfd);
+
+		if (d.txn && daemon_timeout(&d) == 0)
+			daemon_commit(&d);
+
+		/* lines that waited for a transaction that is committed now. */
+		for (i = 0; i < d.num_clients; i++)
+			daemon_client_lines(&d, &d.clients[i]);
+	}
+
+	daemon_commit(&d);
+	while (d.num_clients > 0)
+		daemon_client_close(&d, d.num_clients - 1);
+
+	close(lfd);
+	unlink(path);
+
+	return EXIT_SUCCESS;
+}
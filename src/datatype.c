@@ -18,7 +18,7 @@
 #include <linux/types.h>
 #include <linux/netfilter.h>
 #include <linux/icmpv6.h>
-#include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <nftables.h>
@@ -29,6 +29,7 @@
 #include <netlink.h>
 #include <json.h>
 #include <misspell.h>
+#include <resolve.h>
 #include "nftutils.h"
 
 #include <netinet/ip_icmp.h>
@@ -128,6 +129,53 @@ bool datatype_prefix_notation(const struct datatype *dtype)
 	return dtype->type == TYPE_IPADDR || dtype->type == TYPE_IP6ADDR;
 }
 
+/*
+ * Literals that were already parsed by the scanner are only used if the
+ * identifier would be parsed by the type they represent, the result is the
+ * same as parsing the identifier again.
+ */
+static bool symbol_literal_parse(const struct expr *sym, struct expr **res)
+{
+	const struct datatype *dtype = sym->dtype;
+
+	while (dtype->parse == NULL && dtype->sym_tbl == NULL) {
+		dtype = dtype->basetype;
+		if (dtype == NULL)
+			return false;
+	}
+
+	switch (sym->littype) {
+	case SYMBOL_LITERAL_IP4:
+		if (dtype != &ipaddr_type)
+			return false;
+		*res = constant_expr_alloc(&sym->location, &ipaddr_type,
+					   BYTEORDER_BIG_ENDIAN,
+					   sizeof(sym->literal.in) * BITS_PER_BYTE,
+					   &sym->literal.in);
+		return true;
+	case SYMBOL_LITERAL_IP6:
+		if (dtype != &ip6addr_type)
+			return false;
+		*res = constant_expr_alloc(&sym->location, &ip6addr_type,
+					   BYTEORDER_BIG_ENDIAN,
+					   sizeof(sym->literal.in6) * BITS_PER_BYTE,
+					   &sym->literal.in6);
+		return true;
+	case SYMBOL_LITERAL_INTEGER:
+		if (dtype != &integer_type)
+			return false;
+		*res = constant_expr_alloc(&sym->location, sym->dtype,
+					   BYTEORDER_HOST_ENDIAN, 1, NULL);
+		mpz_import_data((*res)->value, &sym->literal.num,
+				BYTEORDER_HOST_ENDIAN, sizeof(sym->literal.num));
+		return true;
+	case SYMBOL_LITERAL_NONE:
+		break;
+	}
+
+	return false;
+}
+
 struct error_record *symbol_parse(struct parse_ctx *ctx, const struct expr *sym,
 				  struct expr **res)
 {
@@ -138,6 +186,9 @@ struct error_record *symbol_parse(struct parse_ctx *ctx, const struct expr *sym,
 
 	if (dtype == NULL)
 		return error(&sym->location, "No symbol type information");
+	if (sym->littype != SYMBOL_LITERAL_NONE &&
+	    symbol_literal_parse(sym, res))
+		return NULL;
 	do {
 		if (dtype->parse != NULL)
 			return dtype->parse(ctx, sym, res);
@@ -194,6 +245,31 @@ static struct error_record *symbol_parse_fuzzy(const struct expr *sym,
 	return NULL;
 }
 
+/* Returns NULL if @identifier is not in @tbl. */
+static const struct symbolic_constant *
+symbol_table_lookup(const struct symbol_table *tbl, const char *identifier)
+{
+	const struct symbolic_constant *s;
+	unsigned int i, pos;
+
+	if (tbl->hash) {
+		i = djb_hash(identifier) & tbl->hash_mask;
+		while ((pos = tbl->hash[i]) != 0) {
+			s = &tbl->symbols[pos - 1];
+			if (!strcmp(identifier, s->identifier))
+				return s;
+			i = (i + 1) & tbl->hash_mask;
+		}
+		return NULL;
+	}
+
+	for (s = tbl->symbols; s->identifier != NULL; s++) {
+		if (!strcmp(identifier, s->identifier))
+			return s;
+	}
+	return NULL;
+}
+
 struct error_record *symbolic_constant_parse(struct parse_ctx *ctx,
 					     const struct expr *sym,
 					     const struct symbol_table *tbl,
@@ -203,12 +279,8 @@ struct error_record *symbolic_constant_parse(struct parse_ctx *ctx,
 	const struct datatype *dtype;
 	struct error_record *erec;
 
-	for (s = tbl->symbols; s->identifier != NULL; s++) {
-		if (!strcmp(sym->identifier, s->identifier))
-			break;
-	}
-
-	if (s->identifier != NULL)
+	s = symbol_table_lookup(tbl, sym->identifier);
+	if (s != NULL)
 		goto out;
 
 	dtype = sym->dtype;
@@ -267,12 +339,17 @@ void symbolic_constant_print(const struct symbol_table *tbl,
 
 static void switch_byteorder(void *data, unsigned int len)
 {
-	mpz_t op;
+	uint8_t *p = data, tmp;
+	unsigned int i;
 
-	mpz_init(op);
-	mpz_import_data(op, data, BYTEORDER_BIG_ENDIAN, len);
-	mpz_export_data(data, op, BYTEORDER_HOST_ENDIAN, len);
-	mpz_clear(op);
+	if (MPZ_HWO == MPZ_MSWF)
+		return;
+
+	for (i = 0; i < len / 2; i++) {
+		tmp = p[i];
+		p[i] = p[len - 1 - i];
+		p[len - 1 - i] = tmp;
+	}
 }
 
 void symbol_table_print(const struct symbol_table *tbl,
@@ -457,6 +534,11 @@ static void integer_type_print(const struct expr *expr, struct output_ctx *octx)
 		}
 	} while ((dtype = dtype->basetype));
 
+	if (!dtype && expr->len <= 64) {
+		nft_print_u64(octx, mpz_get_uint64(expr->value));
+		return;
+	}
+
 	nft_gmp_print(octx, fmt, expr->value);
 }
 
@@ -590,17 +672,15 @@ static void ipaddr_type_print(const struct expr *expr, struct output_ctx *octx)
 {
 	struct sockaddr_in sin = { .sin_family = AF_INET, };
 	char buf[NI_MAXHOST];
-	int err;
 
 	sin.sin_addr.s_addr = mpz_get_be32(expr->value);
-	err = getnameinfo((struct sockaddr *)&sin, sizeof(sin), buf,
-			  sizeof(buf), NULL, 0,
-			  nft_output_reversedns(octx) ? 0 : NI_NUMERICHOST);
-	if (err != 0) {
-		getnameinfo((struct sockaddr *)&sin, sizeof(sin), buf,
-			    sizeof(buf), NULL, 0, NI_NUMERICHOST);
+	if (!nft_output_reversedns(octx) ||
+	    !nft_resolver_name(octx->resolver, AF_INET, &sin.sin_addr,
+			       buf, sizeof(buf))) {
+		nft_print_ipv4(octx, &sin.sin_addr);
+		return;
 	}
-	nft_print(octx, "%s", buf);
+	nft_print_str(octx, buf);
 }
 
 static struct error_record *ipaddr_type_parse(struct parse_ctx *ctx,
@@ -613,23 +693,20 @@ static struct error_record *ipaddr_type_parse(struct parse_ctx *ctx,
 		if (inet_pton(AF_INET, sym->identifier, &addr) != 1)
 			return error(&sym->location, "Invalid IPv4 address");
 	} else {
-		struct addrinfo *ai, hints = { .ai_family = AF_INET,
-					       .ai_socktype = SOCK_DGRAM};
+		union nft_resolve_addr raddr;
+		unsigned int naddrs;
 		int err;
 
-		err = getaddrinfo(sym->identifier, NULL, &hints, &ai);
+		err = nft_resolve(ctx->resolver, sym->identifier, AF_INET,
+				  &raddr, &naddrs);
 		if (err != 0)
 			return error(&sym->location, "Could not resolve hostname: %s",
 				     gai_strerror(err));
 
-		if (ai->ai_next != NULL) {
-			freeaddrinfo(ai);
+		if (naddrs > 1)
 			return error(&sym->location,
 				     "Hostname resolves to multiple addresses");
-		}
-		assert(ai->ai_addr->sa_family == AF_INET);
-		addr = ((struct sockaddr_in *) (void *) ai->ai_addr)->sin_addr;
-		freeaddrinfo(ai);
+		addr = raddr.in;
 	}
 
 	*res = constant_expr_alloc(&sym->location, &ipaddr_type,
@@ -653,19 +730,17 @@ static void ip6addr_type_print(const struct expr *expr, struct output_ctx *octx)
 {
 	struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6 };
 	char buf[NI_MAXHOST];
-	int err;
 
 	mpz_export_data(&sin6.sin6_addr, expr->value, BYTEORDER_BIG_ENDIAN,
 			sizeof(sin6.sin6_addr));
 
-	err = getnameinfo((struct sockaddr *)&sin6, sizeof(sin6), buf,
-			  sizeof(buf), NULL, 0,
-			  nft_output_reversedns(octx) ? 0 : NI_NUMERICHOST);
-	if (err != 0) {
-		getnameinfo((struct sockaddr *)&sin6, sizeof(sin6), buf,
-			    sizeof(buf), NULL, 0, NI_NUMERICHOST);
+	if (!nft_output_reversedns(octx) ||
+	    !nft_resolver_name(octx->resolver, AF_INET6, &sin6.sin6_addr,
+			       buf, sizeof(buf))) {
+		nft_print_ipv6(octx, &sin6.sin6_addr);
+		return;
 	}
-	nft_print(octx, "%s", buf);
+	nft_print_str(octx, buf);
 }
 
 static struct error_record *ip6addr_type_parse(struct parse_ctx *ctx,
@@ -678,24 +753,20 @@ static struct error_record *ip6addr_type_parse(struct parse_ctx *ctx,
 		if (inet_pton(AF_INET6, sym->identifier, &addr) != 1)
 			return error(&sym->location, "Invalid IPv6 address");
 	} else {
-		struct addrinfo *ai, hints = { .ai_family = AF_INET6,
-					       .ai_socktype = SOCK_DGRAM};
+		union nft_resolve_addr raddr;
+		unsigned int naddrs;
 		int err;
 
-		err = getaddrinfo(sym->identifier, NULL, &hints, &ai);
+		err = nft_resolve(ctx->resolver, sym->identifier, AF_INET6,
+				  &raddr, &naddrs);
 		if (err != 0)
 			return error(&sym->location, "Could not resolve hostname: %s",
 				     gai_strerror(err));
 
-		if (ai->ai_next != NULL) {
-			freeaddrinfo(ai);
+		if (naddrs > 1)
 			return error(&sym->location,
 				     "Hostname resolves to multiple addresses");
-		}
-
-		assert(ai->ai_addr->sa_family == AF_INET6);
-		addr = ((struct sockaddr_in6 *)(void *)ai->ai_addr)->sin6_addr;
-		freeaddrinfo(ai);
+		addr = raddr.in6;
 	}
 
 	*res = constant_expr_alloc(&sym->location, &ip6addr_type,
@@ -744,6 +815,9 @@ static void inet_protocol_type_describe(struct output_ctx *octx)
 	}
 }
 
+static const struct symbol_table *netdb_protocols(struct parse_ctx *ctx);
+static const struct symbol_table *netdb_services(struct parse_ctx *ctx);
+
 static struct error_record *inet_protocol_type_parse(struct parse_ctx *ctx,
 						     const struct expr *sym,
 						     struct expr **res)
@@ -760,13 +834,20 @@ static struct error_record *inet_protocol_type_parse(struct parse_ctx *ctx,
 
 		proto = i;
 	} else {
+		const struct symbolic_constant *s;
 		int r;
 
-		r = nft_getprotobyname(sym->identifier);
-		if (r < 0)
-			return error(&sym->location, "Could not resolve protocol name");
+		s = symbol_table_lookup(netdb_protocols(ctx), sym->identifier);
+		if (s) {
+			proto = s->value;
+		} else {
+			r = nft_getprotobyname(sym->identifier);
+			if (r < 0)
+				return error(&sym->location,
+					     "Could not resolve protocol name");
 
-		proto = r;
+			proto = r;
+		}
 	}
 
 	*res = constant_expr_alloc(&sym->location, &inet_protocol_type,
@@ -792,8 +873,8 @@ static void inet_service_print(const struct expr *expr, struct output_ctx *octx)
 	uint16_t port = mpz_get_be16(expr->value);
 	char name[NFT_SERVNAME_MAXSIZE];
 
-	if (!nft_getservbyport(port, NULL, name, sizeof(name)))
-		nft_print(octx, "%hu", ntohs(port));
+	if (!nft_resolver_service(octx->resolver, port, name, sizeof(name)))
+		nft_print_u64(octx, ntohs(port));
 	else
 		nft_print(octx, "\"%s\"", name);
 }
@@ -812,6 +893,7 @@ static struct error_record *inet_service_type_parse(struct parse_ctx *ctx,
 						    const struct expr *sym,
 						    struct expr **res)
 {
+	const struct symbolic_constant *s;
 	struct addrinfo *ai;
 	uint16_t port;
 	uintmax_t i;
@@ -825,6 +907,9 @@ static struct error_record *inet_service_type_parse(struct parse_ctx *ctx,
 			return error(&sym->location, "Service out of range");
 
 		port = htons(i);
+	} else if ((s = symbol_table_lookup(netdb_services(ctx),
+					    sym->identifier)) != NULL) {
+		port = htons(s->value);
 	} else {
 		err = getaddrinfo(NULL, sym->identifier, NULL, &ai);
 		if (err != 0)
@@ -860,7 +945,7 @@ const struct datatype inet_service_type = {
 
 #define RT_SYM_TAB_INITIAL_SIZE		16
 
-static FILE *open_iproute2_db(const char *filename, char **path)
+FILE *rt_symbol_db_open(const char *filename, char **path)
 {
 	FILE *ret;
 
@@ -888,6 +973,32 @@ fail:
 	return NULL;
 }
 
+/* Index symbols by identifier, first entry wins on duplicates. */
+static void rt_symbol_table_hash(struct symbol_table *tbl, unsigned int nelems)
+{
+	unsigned int i, j, size = 1;
+
+	while (size < 2 * nelems)
+		size <<= 1;
+
+	tbl->hash = xzalloc(size * sizeof(*tbl->hash));
+	tbl->hash_mask = size - 1;
+
+	for (i = 0; i < nelems; i++) {
+		const char *identifier = tbl->symbols[i].identifier;
+
+		j = djb_hash(identifier) & tbl->hash_mask;
+		while (tbl->hash[j] != 0) {
+			if (!strcmp(tbl->symbols[tbl->hash[j] - 1].identifier,
+				    identifier))
+				break;
+			j = (j + 1) & tbl->hash_mask;
+		}
+		if (tbl->hash[j] == 0)
+			tbl->hash[j] = i + 1;
+	}
+}
+
 struct symbol_table *rt_symbol_table_init(const char *filename)
 {
 	char buf[512], namebuf[512], *p, *path = NULL;
@@ -899,9 +1010,11 @@ struct symbol_table *rt_symbol_table_init(const char *filename)
 	size = RT_SYM_TAB_INITIAL_SIZE;
 	tbl = xmalloc(sizeof(*tbl) + size * sizeof(s));
 	tbl->base = BASE_DECIMAL;
+	tbl->hash = NULL;
+	tbl->hash_mask = 0;
 	nelems = 0;
 
-	f = open_iproute2_db(filename, &path);
+	f = rt_symbol_db_open(filename, &path);
 	if (f == NULL)
 		goto out;
 
@@ -939,6 +1052,8 @@ out:
 	if (path)
 		free(path);
 	tbl->symbols[nelems] = SYMBOL_LIST_END;
+	if (nelems > 0)
+		rt_symbol_table_hash(tbl, nelems);
 	return tbl;
 }
 
@@ -948,9 +1063,123 @@ void rt_symbol_table_free(const struct symbol_table *tbl)
 
 	for (s = tbl->symbols; s->identifier != NULL; s++)
 		free_const(s->identifier);
+	free(tbl->hash);
 	free_const(tbl);
 }
 
+#ifndef _PATH_SERVICES
+#define _PATH_SERVICES	"/etc/services"
+#endif
+#ifndef _PATH_PROTOCOLS
+#define _PATH_PROTOCOLS	"/etc/protocols"
+#endif
+
+/*
+ * Load names and aliases from a services(5) or protocols(5) file, so that
+ * symbolic ports and protocols do not go through NSS one at a time. The
+ * first entry wins on duplicate names, as with getaddrinfo().
+ */
+static struct symbol_table *netdb_symbol_table_init(const char *filename,
+						    bool service)
+{
+	unsigned int size, nelems, val;
+	struct symbolic_constant s;
+	struct symbol_table *tbl;
+	char buf[1024], *name, *p, *tok;
+	FILE *f;
+
+	size = RT_SYM_TAB_INITIAL_SIZE;
+	tbl = xzalloc(sizeof(*tbl) + size * sizeof(s));
+	tbl->base = BASE_DECIMAL;
+	nelems = 0;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		goto out;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		p = strchr(buf, '#');
+		if (p)
+			*p = '\0';
+
+		name = strtok_r(buf, " \t\n", &p);
+		if (!name)
+			continue;
+		tok = strtok_r(NULL, " \t\n", &p);
+		if (!tok)
+			continue;
+
+		if (service) {
+			if (sscanf(tok, "%u/", &val) != 1 || val > UINT16_MAX)
+				continue;
+		} else {
+			if (sscanf(tok, "%u", &val) != 1 || val > UINT8_MAX)
+				continue;
+		}
+
+		/* Name first, then aliases, one element for list terminator */
+		for (tok = name; tok; tok = strtok_r(NULL, " \t\n", &p)) {
+			if (nelems == size - 2) {
+				size *= 2;
+				tbl = xrealloc(tbl, sizeof(*tbl) + size * sizeof(s));
+			}
+			tbl->symbols[nelems].identifier = xstrdup(tok);
+			tbl->symbols[nelems].value = val;
+			nelems++;
+		}
+	}
+
+	fclose(f);
+out:
+	tbl->symbols[nelems] = SYMBOL_LIST_END;
+	if (nelems > 0)
+		rt_symbol_table_hash(tbl, nelems);
+	return tbl;
+}
+
+/*
+ * Set elements and rules of different tables are parsed from several
+ * threads. The first thread that needs a table builds it, a thread that
+ * loses the race frees its copy and uses the one that was published.
+ */
+static const struct symbol_table *
+netdb_table_get(const struct symbol_table **tbl, const char *filename,
+		bool service)
+{
+	const struct symbol_table *res, *expected = NULL;
+	struct symbol_table *new;
+
+	res = __atomic_load_n(tbl, __ATOMIC_ACQUIRE);
+	if (res)
+		return res;
+
+	new = netdb_symbol_table_init(filename, service);
+	if (__atomic_compare_exchange_n(tbl, &expected, new, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return new;
+
+	rt_symbol_table_free(new);
+	return expected;
+}
+
+static const struct symbol_table *netdb_services(struct parse_ctx *ctx)
+{
+	return netdb_table_get(&ctx->tbl->services, _PATH_SERVICES, true);
+}
+
+static const struct symbol_table *netdb_protocols(struct parse_ctx *ctx)
+{
+	return netdb_table_get(&ctx->tbl->protocols, _PATH_PROTOCOLS, false);
+}
+
+void netdb_table_exit(struct nft_ctx *ctx)
+{
+	if (ctx->output.tbl.services)
+		rt_symbol_table_free(ctx->output.tbl.services);
+	if (ctx->output.tbl.protocols)
+		rt_symbol_table_free(ctx->output.tbl.protocols);
+}
+
 void rt_symbol_table_describe(struct output_ctx *octx, const char *name,
 			      const struct symbol_table *tbl,
 			      const struct datatype *type)
@@ -961,7 +1190,7 @@ void rt_symbol_table_describe(struct output_ctx *octx, const char *name,
 	if (!tbl || !tbl->symbols[0].identifier)
 		return;
 
-	f = open_iproute2_db(name, &path);
+	f = rt_symbol_db_open(name, &path);
 	if (f)
 		fclose(f);
 	if (!path && asprintf(&path, "%s%s",
@@ -978,32 +1207,75 @@ void rt_symbol_table_describe(struct output_ctx *octx, const char *name,
 	free(path);
 }
 
-void mark_table_init(struct nft_ctx *ctx)
+static pthread_mutex_t rt_symbol_db_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rt_symbol_db *rt_symbol_dbs;
+
+/*
+ * Databases are parsed the first time a context needs them and kept until
+ * the process exits. @tbl caches the result in the calling context, so the
+ * lock is only taken once per context and database. Rules of different
+ * tables are evaluated from several threads with --jobs, all of them may
+ * fill in @tbl of their context.
+ */
+const struct symbol_table *rt_symbol_db_get(struct rt_symbol_db *db,
+					    const struct symbol_table **tbl)
 {
-	ctx->output.tbl.mark = rt_symbol_table_init("rt_marks");
+	const struct symbol_table *res;
+
+	res = __atomic_load_n(tbl, __ATOMIC_ACQUIRE);
+	if (res)
+		return res;
+
+	pthread_mutex_lock(&rt_symbol_db_lock);
+	if (!db->tbl) {
+		db->tbl = rt_symbol_table_init(db->filename);
+		db->next = rt_symbol_dbs;
+		rt_symbol_dbs = db;
+	}
+	res = db->tbl;
+	__atomic_store_n(tbl, res, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rt_symbol_db_lock);
+
+	return res;
 }
 
-void mark_table_exit(struct nft_ctx *ctx)
+/* Databases loaded so far, most recent first. */
+const struct rt_symbol_db *rt_symbol_db_loaded(void)
 {
-	rt_symbol_table_free(ctx->output.tbl.mark);
+	const struct rt_symbol_db *db;
+
+	pthread_mutex_lock(&rt_symbol_db_lock);
+	db = rt_symbol_dbs;
+	pthread_mutex_unlock(&rt_symbol_db_lock);
+
+	return db;
+}
+
+static struct rt_symbol_db mark_db = {
+	.filename	= "rt_marks",
+};
+
+const struct symbol_table *mark_table(struct symbol_tables *tbl)
+{
+	return rt_symbol_db_get(&mark_db, &tbl->mark);
 }
 
 static void mark_type_print(const struct expr *expr, struct output_ctx *octx)
 {
-	return symbolic_constant_print(octx->tbl.mark, expr, true, octx);
+	return symbolic_constant_print(mark_table(&octx->tbl), expr, true, octx);
 }
 
 static struct error_record *mark_type_parse(struct parse_ctx *ctx,
 					    const struct expr *sym,
 					    struct expr **res)
 {
-	return symbolic_constant_parse(ctx, sym, ctx->tbl->mark, res);
+	return symbolic_constant_parse(ctx, sym, mark_table(ctx->tbl), res);
 }
 
 static void mark_type_describe(struct output_ctx *octx)
 {
 	rt_symbol_table_describe(octx, "rt_marks",
-				 octx->tbl.mark, &mark_type);
+				 mark_table(&octx->tbl), &mark_type);
 }
 
 const struct datatype mark_type = {
@@ -1362,7 +1634,8 @@ const struct datatype *datatype_get(const struct datatype *ptr)
 	if (!dtype->alloc)
 		return dtype;
 
-	dtype->refcnt++;
+	/* set key and data types are shared by rules parsed concurrently. */
+	__atomic_add_fetch(&dtype->refcnt, 1, __ATOMIC_RELAXED);
 	return dtype;
 }
 
@@ -1406,7 +1679,7 @@ void datatype_free(const struct datatype *ptr)
 
 	assert(dtype->refcnt != 0);
 
-	if (--dtype->refcnt > 0)
+	if (__atomic_sub_fetch(&dtype->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
 		return;
 
 	free_const(dtype->name);
@@ -1414,7 +1687,7 @@ void datatype_free(const struct datatype *ptr)
 	free(dtype);
 }
 
-const struct datatype *concat_type_alloc(uint32_t type)
+static struct datatype *concat_type_build(uint32_t type)
 {
 	const struct datatype *i;
 	struct datatype *dtype;
@@ -1451,19 +1724,80 @@ const struct datatype *concat_type_alloc(uint32_t type)
 	return dtype;
 }
 
+/*
+ * Concatenation and set datatypes only depend on their type id and byteorder,
+ * so they are built once and shared for the lifetime of the process like the
+ * rt symbol databases above. Each cached instance holds a reference of its
+ * own, callers get an additional one.
+ */
+#define CONCAT_TYPE_HBITS	6
+#define CONCAT_TYPE_HSIZE	(1 << CONCAT_TYPE_HBITS)
+
+struct concat_type_entry {
+	struct concat_type_entry	*next;
+	const struct datatype		*dtype;
+};
+
+static pthread_mutex_t datatype_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct concat_type_entry *concat_types[CONCAT_TYPE_HSIZE];
+static const struct datatype *set_integer_types[BYTEORDER_BIG_ENDIAN + 1];
+
+static unsigned int concat_type_hash(uint32_t type)
+{
+	return (type * 2654435761U) >> (32 - CONCAT_TYPE_HBITS);
+}
+
+const struct datatype *concat_type_alloc(uint32_t type)
+{
+	struct concat_type_entry **head, *entry;
+	const struct datatype *dtype = NULL;
+
+	head = &concat_types[concat_type_hash(type)];
+
+	pthread_mutex_lock(&datatype_cache_lock);
+	for (entry = *head; entry; entry = entry->next) {
+		if (entry->dtype->type == type) {
+			dtype = entry->dtype;
+			break;
+		}
+	}
+	if (!dtype) {
+		dtype = concat_type_build(type);
+		if (dtype) {
+			entry = xmalloc(sizeof(*entry));
+			entry->dtype = dtype;
+			entry->next = *head;
+			*head = entry;
+		}
+	}
+	dtype = datatype_get(dtype);
+	pthread_mutex_unlock(&datatype_cache_lock);
+
+	return dtype;
+}
+
 const struct datatype *set_datatype_alloc(const struct datatype *orig_dtype,
 					  enum byteorder byteorder)
 {
 	struct datatype *dtype;
+	const struct datatype *ret;
 
 	/* Restrict dynamic datatype allocation to generic integer datatype. */
 	if (orig_dtype != &integer_type)
 		return datatype_get(orig_dtype);
 
-	dtype = datatype_clone(orig_dtype);
-	dtype->byteorder = byteorder;
+	assert(byteorder <= BYTEORDER_BIG_ENDIAN);
 
-	return dtype;
+	pthread_mutex_lock(&datatype_cache_lock);
+	if (!set_integer_types[byteorder]) {
+		dtype = datatype_clone(orig_dtype);
+		dtype->byteorder = byteorder;
+		set_integer_types[byteorder] = dtype;
+	}
+	ret = datatype_get(set_integer_types[byteorder]);
+	pthread_mutex_unlock(&datatype_cache_lock);
+
+	return ret;
 }
 
 static struct error_record *time_unit_parse(const struct location *loc,
@@ -1612,59 +1946,16 @@ const struct datatype policy_type = {
 	.parse		= policy_type_parse,
 };
 
-#define SYSFS_CGROUPSV2_PATH	"/sys/fs/cgroup"
-
-static char *cgroupv2_get_path(const char *path, uint64_t id)
-{
-	char dent_name[PATH_MAX + 1];
-	char *cgroup_path = NULL;
-	struct dirent *dent;
-	struct stat st;
-	DIR *d;
-
-	d = opendir(path);
-	if (!d)
-		return NULL;
-
-	while ((dent = readdir(d)) != NULL) {
-		if (!strcmp(dent->d_name, ".") ||
-		    !strcmp(dent->d_name, ".."))
-			continue;
-
-		snprintf(dent_name, sizeof(dent_name), "%s/%s",
-			 path, dent->d_name);
-		dent_name[sizeof(dent_name) - 1] = '\0';
-
-		if (dent->d_ino == id) {
-			cgroup_path = xstrdup(dent_name);
-			break;
-		}
-
-		if (stat(dent_name, &st) >= 0 && S_ISDIR(st.st_mode)) {
-			cgroup_path = cgroupv2_get_path(dent_name, id);
-			if (cgroup_path)
-				break;
-		}
-	}
-	closedir(d);
-
-	return cgroup_path;
-}
-
 static void cgroupv2_type_print(const struct expr *expr,
 				struct output_ctx *octx)
 {
 	uint64_t id = mpz_get_uint64(expr->value);
-	char *cgroup_path;
+	char path[PATH_MAX + 1];
 
-	cgroup_path = cgroupv2_get_path(SYSFS_CGROUPSV2_PATH, id);
-	if (cgroup_path)
-		nft_print(octx, "\"%s\"",
-			  &cgroup_path[strlen(SYSFS_CGROUPSV2_PATH) + 1]);
+	if (nft_resolver_cgroup(octx->resolver, id, path, sizeof(path)))
+		nft_print(octx, "\"%s\"", path);
 	else
 		nft_print(octx, "%" PRIu64, id);
-
-	free(cgroup_path);
 }
 
 static struct error_record *cgroupv2_type_parse(struct parse_ctx *ctx,
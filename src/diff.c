@@ -0,0 +1,951 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Differential reloads, enabled by --diff. The evaluated commands are
+ * compared with what the kernel already has, the batch only carries what
+ * changed and the outcome is the same as without --diff:
+ *
+ * - Elements that are already in a set with the same data are not added
+ *   again.
+ * - If the file starts with flush ruleset, the flush is dropped and the
+ *   rules of each chain and the elements of each set in the file are their
+ *   complete contents instead. The rules that a chain starts and ends with
+ *   stay, the ones in between are replaced, elements that are only in the
+ *   kernel are deleted. Tables, chains, sets, stateful objects and
+ *   flowtables of the flushed families that the file does not declare are
+ *   deleted too.
+ * - The elements generated for a maglev map are its complete contents, with
+ *   or without flush ruleset, so only the slots that moved are updated.
+ *
+ * Rules are compared by their listing, both sides are delinearized from
+ * netlink so that the same rule reads the same way. Rules that refer to
+ * anonymous sets or chains never compare equal, these are named by the
+ * batch that adds them. Elements are compared by key and, in maps, by
+ * data, but not by timeout, expiration, comment or counters.
+ */
+
+#include <nft.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <linux/netfilter.h>
+
+#include <libnftnl/expr.h>
+#include <libnftnl/rule.h>
+
+#include <cache.h>
+#include <diff.h>
+#include <erec.h>
+#include <mnl.h>
+#include <netlink.h>
+#include <rule.h>
+#include <timing.h>
+#include <utils.h>
+
+#define DIFF_HSIZE	1024
+
+/* Table, chain, set, stateful object or flowtable the file refers to. */
+struct diff_obj {
+	struct hlist_node	hnode;
+	struct list_head	list;
+	enum cmd_obj		kind;
+	uint32_t		family;
+	char			*table;
+	char			*name;
+	/* first command that refers to the object */
+	struct cmd		*anchor;
+	/* rules of a chain, element commands of a set */
+	struct cmd		**cmds;
+	unsigned int		num_cmds;
+	unsigned int		size;
+	/* the rules or elements in the file are the complete contents */
+	bool			replace;
+	/* rules or elements that cannot be compared */
+	bool			skip;
+};
+
+struct diff_stats {
+	unsigned int		rules_kept;
+	unsigned int		rules_added;
+	unsigned int		rules_deleted;
+	unsigned int		elems_kept;
+	unsigned int		elems_added;
+	unsigned int		elems_deleted;
+	unsigned int		objs_deleted;
+};
+
+struct diff_ctx {
+	struct nft_ctx		*nft;
+	struct netlink_ctx	nl_ctx;
+	struct list_head	*cmds;
+	struct hlist_head	*ht;
+	struct list_head	objs;
+	struct output_ctx	octx;
+	/* deletions, appended to the batch in this order */
+	struct list_head	del_rules;
+	struct list_head	del_chains;
+	struct list_head	del_sets;
+	struct list_head	del_objs;
+	struct list_head	del_tables;
+	struct diff_stats	stats;
+};
+
+static bool diff_flushed(const struct diff_ctx *dctx, uint32_t family)
+{
+	return family < 32 && dctx->nft->diff_flushed & (1U << family);
+}
+
+static uint32_t diff_obj_hash(enum cmd_obj kind, const struct handle *h,
+			      const char *name)
+{
+	return (djb_hash(h->table.name) ^ djb_hash(name) ^
+		(kind << 8 | h->family)) % DIFF_HSIZE;
+}
+
+static struct diff_obj *diff_obj_find(const struct diff_ctx *dctx,
+				      enum cmd_obj kind,
+				      const struct handle *h,
+				      const char *name)
+{
+	struct diff_obj *obj;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(obj, pos, &dctx->ht[diff_obj_hash(kind, h, name)],
+			     hnode) {
+		if (obj->kind == kind &&
+		    obj->family == h->family &&
+		    !strcmp(obj->table, h->table.name) &&
+		    !strcmp(obj->name, name))
+			return obj;
+	}
+
+	return NULL;
+}
+
+/* Commands that are dropped are released, objects keep their own names. */
+static struct diff_obj *diff_obj_get(struct diff_ctx *dctx, enum cmd_obj kind,
+				     struct cmd *cmd, const char *name)
+{
+	struct diff_obj *obj;
+
+	obj = diff_obj_find(dctx, kind, &cmd->handle, name);
+	if (obj)
+		return obj;
+
+	obj = xzalloc(sizeof(*obj));
+	obj->kind = kind;
+	obj->family = cmd->handle.family;
+	obj->table = xstrdup(cmd->handle.table.name);
+	obj->name = xstrdup(name);
+	obj->anchor = cmd;
+	obj->replace = diff_flushed(dctx, cmd->handle.family);
+	hlist_add_head(&obj->hnode,
+		       &dctx->ht[diff_obj_hash(kind, &cmd->handle, name)]);
+	list_add_tail(&obj->list, &dctx->objs);
+
+	return obj;
+}
+
+static void diff_obj_add_cmd(struct diff_obj *obj, struct cmd *cmd)
+{
+	if (obj->num_cmds == obj->size) {
+		obj->size = obj->size ? obj->size * 2 : 16;
+		obj->cmds = xrealloc(obj->cmds, obj->size * sizeof(*obj->cmds));
+	}
+	obj->cmds[obj->num_cmds++] = cmd;
+}
+
+static void diff_obj_free(struct diff_obj *obj)
+{
+	free(obj->table);
+	free(obj->name);
+	free(obj->cmds);
+	free(obj);
+}
+
+/* Index the objects that the commands refer to, see nft_diff_prepare(). */
+static void diff_collect(struct diff_ctx *dctx)
+{
+	struct diff_obj *obj;
+	struct cmd *cmd;
+
+	list_for_each_entry(cmd, dctx->cmds, list) {
+		const struct handle *h = &cmd->handle;
+
+		if (!h->table.name)
+			continue;
+
+		diff_obj_get(dctx, CMD_OBJ_TABLE, cmd, h->table.name);
+
+		switch (cmd->obj) {
+		case CMD_OBJ_CHAIN:
+			diff_obj_get(dctx, CMD_OBJ_CHAIN, cmd, h->chain.name);
+			break;
+		case CMD_OBJ_RULE:
+			if (!h->chain.name)
+				break;
+
+			obj = diff_obj_get(dctx, CMD_OBJ_CHAIN, cmd,
+					   h->chain.name);
+			if (cmd->op != CMD_ADD ||
+			    h->position.id || h->index.id)
+				obj->skip = true;
+			else
+				diff_obj_add_cmd(obj, cmd);
+			break;
+		case CMD_OBJ_SET:
+		case CMD_OBJ_MAP:
+			if (!cmd->set || set_is_anonymous(cmd->set->flags))
+				break;
+
+			diff_obj_get(dctx, CMD_OBJ_SET, cmd, h->set.name);
+			break;
+		case CMD_OBJ_SETELEMS:
+			if (set_is_anonymous(cmd->set->flags))
+				break;
+
+			obj = diff_obj_get(dctx, CMD_OBJ_SET, cmd, h->set.name);
+			/* a maglev table is always the complete contents */
+			if (cmd->set->maglev.backends)
+				obj->replace = true;
+			diff_obj_add_cmd(obj, cmd);
+			break;
+		case CMD_OBJ_ELEMENTS:
+			obj = diff_obj_get(dctx, CMD_OBJ_SET, cmd, h->set.name);
+			if (cmd->op != CMD_ADD)
+				obj->skip = true;
+			else
+				diff_obj_add_cmd(obj, cmd);
+			break;
+		case CMD_OBJ_COUNTER:
+		case CMD_OBJ_QUOTA:
+		case CMD_OBJ_CT_HELPER:
+		case CMD_OBJ_CT_TIMEOUT:
+		case CMD_OBJ_CT_EXPECT:
+		case CMD_OBJ_LIMIT:
+		case CMD_OBJ_SECMARK:
+		case CMD_OBJ_SYNPROXY:
+			diff_obj_get(dctx, cmd->obj, cmd, h->obj.name);
+			break;
+		case CMD_OBJ_FLOWTABLE:
+			diff_obj_get(dctx, CMD_OBJ_FLOWTABLE, cmd,
+				     h->flowtable.name);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* New command on the kernel object with handle @src, by name. */
+static struct cmd *diff_cmd_alloc(enum cmd_ops op, enum cmd_obj obj,
+				  const struct handle *src, void *data)
+{
+	struct handle h = {};
+
+	handle_merge(&h, src);
+	memset(&h.handle, 0, sizeof(h.handle));
+	memset(&h.position, 0, sizeof(h.position));
+	memset(&h.index, 0, sizeof(h.index));
+
+	return cmd_alloc(op, obj, &h, &internal_location, data);
+}
+
+static void diff_cmd_queue(struct list_head *list, enum cmd_ops op,
+			   enum cmd_obj obj, const struct handle *src)
+{
+	struct cmd *cmd = diff_cmd_alloc(op, obj, src, NULL);
+
+	list_add_tail(&cmd->list, list);
+}
+
+/* Anonymous sets and chains only get their name in the batch that adds them. */
+static int diff_anon_cb(struct nftnl_expr *nle, void *data)
+{
+	const char *name = nftnl_expr_get_str(nle, NFTNL_EXPR_NAME);
+	uint16_t attr;
+
+	if (!strcmp(name, "lookup")) {
+		attr = NFTNL_EXPR_LOOKUP_SET;
+	} else if (!strcmp(name, "dynset")) {
+		attr = NFTNL_EXPR_DYNSET_SET_NAME;
+	} else if (!strcmp(name, "objref")) {
+		attr = NFTNL_EXPR_OBJREF_SET_NAME;
+	} else if (!strcmp(name, "immediate")) {
+		if (nftnl_expr_is_set(nle, NFTNL_EXPR_IMM_CHAIN_ID))
+			return -1;
+		attr = NFTNL_EXPR_IMM_CHAIN;
+	} else {
+		return 0;
+	}
+
+	if (nftnl_expr_is_set(nle, attr) &&
+	    !strncmp(nftnl_expr_get_str(nle, attr), "__", 2))
+		return -1;
+
+	return 0;
+}
+
+/* Listing of a rule without its state, NULL if it is never equal to another. */
+static char *diff_rule_text(struct diff_ctx *dctx, struct nftnl_rule *nlr)
+{
+	struct list_head *msgs = dctx->nl_ctx.msgs;
+	struct error_record *erec, *next;
+	struct rule *rule;
+	char *text = NULL;
+	LIST_HEAD(errs);
+	size_t len;
+
+	if (nftnl_expr_foreach(nlr, diff_anon_cb, NULL) < 0)
+		return NULL;
+
+	dctx->nl_ctx.msgs = &errs;
+	rule = netlink_delinearize_rule(&dctx->nl_ctx, nlr);
+	dctx->nl_ctx.msgs = msgs;
+
+	if (rule && list_empty(&errs)) {
+		dctx->octx.output_fp = open_memstream(&text, &len);
+		if (!dctx->octx.output_fp)
+			memory_allocation_error();
+
+		rule_print(rule, &dctx->octx);
+		fclose(dctx->octx.output_fp);
+		dctx->octx.output_fp = NULL;
+	}
+
+	list_for_each_entry_safe(erec, next, &errs, list) {
+		list_del(&erec->list);
+		erec_destroy(erec);
+	}
+	if (rule)
+		rule_free(rule);
+
+	return text;
+}
+
+static char *diff_cmd_rule_text(struct diff_ctx *dctx, const struct cmd *cmd)
+{
+	struct netlink_linearize_ctx lctx;
+	struct nftnl_rule *nlr;
+	char *text;
+
+	nlr = nftnl_rule_alloc();
+	if (!nlr)
+		memory_allocation_error();
+
+	netlink_linearize_init(&lctx, nlr);
+	netlink_linearize_rule(&dctx->nl_ctx, cmd->rule, &lctx);
+	netlink_linearize_fini(&lctx);
+
+	nftnl_rule_set_u32(nlr, NFTNL_RULE_FAMILY, cmd->handle.family);
+	nftnl_rule_set_str(nlr, NFTNL_RULE_TABLE, cmd->handle.table.name);
+	nftnl_rule_set_str(nlr, NFTNL_RULE_CHAIN, cmd->handle.chain.name);
+
+	text = diff_rule_text(dctx, nlr);
+	nftnl_rule_free(nlr);
+
+	return text;
+}
+
+static bool diff_text_equal(const char *a, const char *b)
+{
+	return a && b && !strcmp(a, b);
+}
+
+struct diff_rules {
+	struct diff_ctx		*dctx;
+	uint64_t		*handles;
+	char			**text;
+	unsigned int		num;
+	unsigned int		size;
+};
+
+static int diff_kernel_rule_cb(struct nftnl_rule *nlr, void *data)
+{
+	struct diff_rules *rules = data;
+
+	if (rules->num == rules->size) {
+		rules->size = rules->size ? rules->size * 2 : 64;
+		rules->handles = xrealloc(rules->handles,
+					  rules->size * sizeof(*rules->handles));
+		rules->text = xrealloc(rules->text,
+				       rules->size * sizeof(*rules->text));
+	}
+
+	rules->handles[rules->num] = nftnl_rule_get_u64(nlr, NFTNL_RULE_HANDLE);
+	rules->text[rules->num++] = diff_rule_text(rules->dctx, nlr);
+
+	return 0;
+}
+
+/*
+ * Keep the rules that the chain starts and ends with, delete the kernel
+ * rules in between and insert the new ones in their place.
+ */
+static int diff_chain_rules(struct diff_ctx *dctx, struct diff_obj *obj,
+			    const struct chain *chain)
+{
+	struct diff_rules old = { .dctx = dctx };
+	unsigned int i, n = obj->num_cmds;
+	unsigned int prefix = 0, suffix = 0;
+	struct nftnl_rule_list *list;
+	struct cmd *cmd, *del;
+	char **text;
+
+	list = mnl_nft_rule_dump(&dctx->nl_ctx, obj->family, obj->table,
+				 obj->name, 0, true, false);
+	if (!list) {
+		if (errno == EINTR)
+			return netlink_io_error(&dctx->nl_ctx,
+						&obj->anchor->location,
+						"Could not list chain %s: %s",
+						obj->name, strerror(errno));
+	} else {
+		nftnl_rule_list_foreach(list, diff_kernel_rule_cb, &old);
+		nftnl_rule_list_free(list);
+	}
+
+	text = xmalloc_array(n, sizeof(*text));
+	for (i = 0; i < n; i++)
+		text[i] = diff_cmd_rule_text(dctx, obj->cmds[i]);
+
+	while (prefix < old.num && prefix < n &&
+	       diff_text_equal(old.text[prefix], text[prefix]))
+		prefix++;
+	while (suffix < old.num - prefix && suffix < n - prefix &&
+	       diff_text_equal(old.text[old.num - suffix - 1],
+			       text[n - suffix - 1]))
+		suffix++;
+
+	for (i = prefix; i < old.num - suffix; i++) {
+		del = diff_cmd_alloc(CMD_DELETE, CMD_OBJ_RULE,
+				     &chain->handle, NULL);
+		del->handle.handle.id = old.handles[i];
+		list_add_tail(&del->list, &dctx->del_rules);
+	}
+	dctx->stats.rules_deleted += old.num - suffix - prefix;
+
+	for (i = 0; i < n; i++) {
+		cmd = obj->cmds[i];
+		if (i >= prefix && i < n - suffix) {
+			/* appending would place them after the rules kept */
+			if (suffix) {
+				cmd->op = CMD_INSERT;
+				cmd->rule->handle.position.id =
+					old.handles[old.num - suffix];
+			}
+			dctx->stats.rules_added++;
+		} else {
+			list_del(&cmd->list);
+			cmd_free(cmd);
+			dctx->stats.rules_kept++;
+		}
+		free(text[i]);
+	}
+	obj->num_cmds = 0;
+
+	for (i = 0; i < old.num; i++)
+		free(old.text[i]);
+	free(old.text);
+	free(old.handles);
+	free(text);
+
+	return 0;
+}
+
+static int diff_chain(struct diff_ctx *dctx, struct diff_obj *obj)
+{
+	const struct table *table;
+	const struct chain *chain;
+	struct cmd *cmd;
+
+	if (!obj->replace)
+		return 0;
+
+	table = table_cache_find(&dctx->nft->cache->table_cache,
+				 obj->table, obj->family);
+	if (!table)
+		return 0;
+
+	/* new chains are only in the cache, without kernel handle */
+	chain = chain_cache_find(table, obj->name);
+	if (!chain || !chain->handle.handle.id)
+		return 0;
+
+	if (obj->skip || !obj->num_cmds) {
+		cmd = diff_cmd_alloc(CMD_FLUSH, CMD_OBJ_CHAIN, &chain->handle,
+				     NULL);
+		list_add_tail(&cmd->list, &obj->anchor->list);
+		dctx->stats.rules_added += obj->num_cmds;
+		return 0;
+	}
+
+	return diff_chain_rules(dctx, obj, chain);
+}
+
+struct diff_key {
+	unsigned int		len;
+	uint8_t			data[2 * NFT_REG32_COUNT * sizeof(uint32_t)];
+};
+
+struct diff_elem {
+	struct expr		*expr;
+	uint32_t		hash;
+	int			next;
+	bool			found;
+};
+
+/* Sets whose elements are compared, ranges by their first and last value. */
+static bool diff_set_keyed(const struct set *set)
+{
+	if (!set->key)
+		return false;
+	if (!(set->flags & NFT_SET_INTERVAL))
+		return true;
+
+	return set->desc.field_count <= 1 &&
+	       2 * div_round_up(set->key->len, BITS_PER_BYTE) <=
+	       sizeof(((struct diff_key *)NULL)->data);
+}
+
+static void diff_elem_key(const struct set *set, const struct expr *elem,
+			  struct diff_key *key)
+{
+	struct nft_data_linearize nld = {};
+	unsigned int len;
+	mpz_t value;
+
+	if (elem->etype == EXPR_MAPPING)
+		elem = elem->left;
+
+	if (!(set->flags & NFT_SET_INTERVAL)) {
+		netlink_gen_data(elem->key, &nld);
+		key->len = nld.len;
+		memcpy(key->data, nld.value, nld.len);
+		return;
+	}
+
+	len = div_round_up(set->key->len, BITS_PER_BYTE);
+	mpz_init(value);
+	range_expr_value_low(value, elem);
+	mpz_export_data(key->data, value, BYTEORDER_BIG_ENDIAN, len);
+	range_expr_value_high(value, elem);
+	mpz_export_data(key->data + len, value, BYTEORDER_BIG_ENDIAN, len);
+	mpz_clear(value);
+	key->len = 2 * len;
+}
+
+static uint32_t diff_key_hash(const struct diff_key *key)
+{
+	uint32_t hash = 5381;
+	unsigned int i;
+
+	for (i = 0; i < key->len; i++)
+		hash = ((hash << 5) + hash) ^ key->data[i];
+
+	return hash;
+}
+
+static bool diff_elem_data_equal(const struct expr *a, const struct expr *b)
+{
+	struct nft_data_linearize da = {}, db = {};
+
+	if (a->etype != EXPR_MAPPING || b->etype != EXPR_MAPPING)
+		return a->etype == b->etype;
+
+	netlink_gen_data(a->right, &da);
+	netlink_gen_data(b->right, &db);
+
+	return da.len == db.len &&
+	       da.verdict == db.verdict &&
+	       !memcmp(da.value, db.value, da.len) &&
+	       !strcmp(da.chain, db.chain);
+}
+
+static struct expr *diff_cmd_elems(struct cmd *cmd)
+{
+	if (cmd->obj == CMD_OBJ_SETELEMS)
+		return cmd->set->init;
+
+	return cmd->expr;
+}
+
+/*
+ * Drop the elements that the set already has from the commands, then
+ * delete the ones that are only in the kernel if the file has the complete
+ * contents of the set. Element deletions come before the additions, so that
+ * ranges that changed do not overlap.
+ */
+static void diff_set_elems(struct diff_ctx *dctx, struct diff_obj *obj,
+			   struct set *set, struct expr *kinit)
+{
+	struct diff_elem *elems;
+	struct diff_key key, kkey;
+	struct expr *init, *e, *next, *del;
+	unsigned int i, n = 0, hsize = 16;
+	struct cmd *cmd;
+	uint32_t hash;
+	int *buckets;
+	int idx;
+
+	list_for_each_entry(e, &kinit->expressions, list)
+		n++;
+	while (hsize < 2 * n)
+		hsize <<= 1;
+
+	buckets = xmalloc_array(hsize, sizeof(*buckets));
+	memset(buckets, 0xff, hsize * sizeof(*buckets));
+	elems = xmalloc_array(n ? n : 1, sizeof(*elems));
+
+	i = 0;
+	list_for_each_entry(e, &kinit->expressions, list) {
+		diff_elem_key(set, e, &key);
+		hash = diff_key_hash(&key);
+		elems[i].expr = e;
+		elems[i].hash = hash;
+		elems[i].next = buckets[hash & (hsize - 1)];
+		elems[i].found = false;
+		buckets[hash & (hsize - 1)] = i++;
+	}
+
+	for (i = 0; i < obj->num_cmds; i++) {
+		cmd = obj->cmds[i];
+		init = diff_cmd_elems(cmd);
+		if (!init)
+			continue;
+
+		list_for_each_entry_safe(e, next, &init->expressions, list) {
+			diff_elem_key(set, e, &key);
+			hash = diff_key_hash(&key);
+			for (idx = buckets[hash & (hsize - 1)]; idx >= 0;
+			     idx = elems[idx].next) {
+				if (elems[idx].hash != hash)
+					continue;
+
+				diff_elem_key(set, elems[idx].expr, &kkey);
+				if (kkey.len == key.len &&
+				    !memcmp(kkey.data, key.data, key.len))
+					break;
+			}
+
+			if (idx < 0 ||
+			    !diff_elem_data_equal(e, elems[idx].expr)) {
+				dctx->stats.elems_added++;
+				continue;
+			}
+
+			elems[idx].found = true;
+			compound_expr_remove(init, e);
+			expr_free(e);
+			dctx->stats.elems_kept++;
+		}
+	}
+
+	if (obj->replace) {
+		del = set_expr_alloc(&internal_location, set);
+		for (i = 0; i < n; i++) {
+			if (elems[i].found)
+				continue;
+
+			e = elems[i].expr;
+			compound_expr_remove(kinit, e);
+			/* the key is enough to delete a mapping */
+			if (e->etype == EXPR_MAPPING) {
+				struct expr *elem = expr_get(e->left);
+
+				expr_free(e);
+				e = elem;
+			}
+			compound_expr_add(del, e);
+		}
+
+		if (del->size) {
+			dctx->stats.elems_deleted += del->size;
+			cmd = diff_cmd_alloc(CMD_DELETE, CMD_OBJ_ELEMENTS,
+					     &set->handle, del);
+			cmd->elem.set = set_get(set);
+			list_add_tail(&cmd->list, &obj->anchor->list);
+		} else {
+			expr_free(del);
+		}
+	}
+
+	/* commands left without elements are dropped */
+	for (i = 0; i < obj->num_cmds; i++) {
+		cmd = obj->cmds[i];
+		init = diff_cmd_elems(cmd);
+		if (!init || init->size)
+			continue;
+
+		if (cmd->obj == CMD_OBJ_SETELEMS) {
+			expr_free(cmd->set->init);
+			cmd->set->init = NULL;
+		}
+		list_del(&cmd->list);
+		cmd_free(cmd);
+	}
+	obj->num_cmds = 0;
+
+	free(elems);
+	free(buckets);
+}
+
+static int diff_set(struct diff_ctx *dctx, struct diff_obj *obj)
+{
+	struct expr *init, *kinit;
+	const struct table *table;
+	struct set *set;
+	struct cmd *cmd;
+
+	table = table_cache_find(&dctx->nft->cache->table_cache,
+				 obj->table, obj->family);
+	if (!table)
+		return 0;
+
+	/* new sets are only in the cache, without kernel handle */
+	set = set_cache_find(table, obj->name);
+	if (!set || !set->handle.handle.id || set_is_anonymous(set->flags))
+		return 0;
+
+	/* without flush ruleset, ranges are merged with the kernel ones */
+	if (obj->skip || !obj->num_cmds || !diff_set_keyed(set) ||
+	    (!obj->replace && set->flags & NFT_SET_INTERVAL))
+		goto flush;
+
+	init = set->init;
+	set->init = NULL;
+	if (netlink_list_setelems(&dctx->nl_ctx, &set->handle, set,
+				  false) < 0) {
+		set->init = init;
+		return netlink_io_error(&dctx->nl_ctx, &obj->anchor->location,
+					"Could not list set %s: %s",
+					obj->name, strerror(errno));
+	}
+	kinit = set->init;
+	set->init = init;
+	if (!kinit)
+		goto flush;
+
+	diff_set_elems(dctx, obj, set, kinit);
+	expr_free(kinit);
+
+	return 0;
+flush:
+	if (!obj->replace)
+		return 0;
+
+	cmd = diff_cmd_alloc(CMD_FLUSH, CMD_OBJ_SET, &set->handle, NULL);
+	list_add_tail(&cmd->list, &obj->anchor->list);
+
+	return 0;
+}
+
+static bool diff_declared(const struct diff_ctx *dctx, enum cmd_obj kind,
+			  const struct handle *h, const char *name)
+{
+	return diff_obj_find(dctx, kind, h, name) != NULL;
+}
+
+/* Delete what flush ruleset would have removed and the file does not add. */
+static void diff_flushed_tables(struct diff_ctx *dctx)
+{
+	struct flowtable *ft;
+	struct table *table;
+	struct chain *chain;
+	struct set *set;
+	struct obj *obj;
+
+	list_for_each_entry(table, &dctx->nft->cache->table_cache.list,
+			    cache.list) {
+		if (!table->handle.handle.id ||
+		    table->flags & TABLE_F_OWNER ||
+		    !diff_flushed(dctx, table->handle.family))
+			continue;
+
+		if (!diff_declared(dctx, CMD_OBJ_TABLE, &table->handle,
+				   table->handle.table.name)) {
+			diff_cmd_queue(&dctx->del_tables, CMD_DELETE,
+				       CMD_OBJ_TABLE, &table->handle);
+			dctx->stats.objs_deleted++;
+			continue;
+		}
+
+		list_for_each_entry(chain, &table->chain_cache.list,
+				    cache.list) {
+			if (!chain->handle.handle.id ||
+			    chain->flags & CHAIN_F_BINDING ||
+			    diff_declared(dctx, CMD_OBJ_CHAIN, &chain->handle,
+					  chain->handle.chain.name))
+				continue;
+
+			/* chains must be empty to be deleted */
+			diff_cmd_queue(&dctx->del_rules, CMD_FLUSH,
+				       CMD_OBJ_CHAIN, &chain->handle);
+			diff_cmd_queue(&dctx->del_chains, CMD_DELETE,
+				       CMD_OBJ_CHAIN, &chain->handle);
+			dctx->stats.objs_deleted++;
+		}
+		list_for_each_entry(set, &table->set_cache.list, cache.list) {
+			if (!set->handle.handle.id ||
+			    set_is_anonymous(set->flags) ||
+			    diff_declared(dctx, CMD_OBJ_SET, &set->handle,
+					  set->handle.set.name))
+				continue;
+
+			diff_cmd_queue(&dctx->del_sets, CMD_DELETE,
+				       CMD_OBJ_SET, &set->handle);
+			dctx->stats.objs_deleted++;
+		}
+		list_for_each_entry(obj, &table->obj_cache.list, cache.list) {
+			if (!obj->handle.handle.id ||
+			    diff_declared(dctx, obj_type_to_cmd(obj->type),
+					  &obj->handle, obj->handle.obj.name))
+				continue;
+
+			diff_cmd_queue(&dctx->del_objs, CMD_DELETE,
+				       obj_type_to_cmd(obj->type), &obj->handle);
+			dctx->stats.objs_deleted++;
+		}
+		list_for_each_entry(ft, &table->ft_cache.list, cache.list) {
+			if (!ft->handle.handle.id ||
+			    diff_declared(dctx, CMD_OBJ_FLOWTABLE, &ft->handle,
+					  ft->handle.flowtable.name))
+				continue;
+
+			diff_cmd_queue(&dctx->del_objs, CMD_DELETE,
+				       CMD_OBJ_FLOWTABLE, &ft->handle);
+			dctx->stats.objs_deleted++;
+		}
+	}
+}
+
+/*
+ * Only commands that add objects are compared, after an optional flush
+ * ruleset, which is removed: other commands would change the kernel state
+ * that the file is compared against.
+ */
+int nft_diff_prepare(struct nft_ctx *nft, struct list_head *msgs,
+		     struct list_head *cmds)
+{
+	struct cmd *cmd, *next;
+	bool added = false;
+
+	nft->diff_flushed = 0;
+
+	list_for_each_entry_safe(cmd, next, cmds, list) {
+		switch (cmd->op) {
+		case CMD_ADD:
+		case CMD_CREATE:
+			added = true;
+			continue;
+		case CMD_FLUSH:
+			if (cmd->obj != CMD_OBJ_RULESET)
+				break;
+
+			if (added) {
+				erec_queue(error(&cmd->location,
+						 "flush ruleset must come first with --diff"),
+					   msgs);
+				return -1;
+			}
+
+			if (cmd->handle.family == NFPROTO_UNSPEC)
+				nft->diff_flushed = NFT_DIFF_ALL_FAMILIES;
+			else
+				nft->diff_flushed |= 1U << cmd->handle.family;
+
+			list_del(&cmd->list);
+			cmd_free(cmd);
+			continue;
+		default:
+			break;
+		}
+
+		erec_queue(error(&cmd->location,
+				 "--diff only supports commands that add objects, after flush ruleset"),
+			   msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+int nft_diff(struct nft_ctx *nft, struct list_head *msgs,
+	     struct list_head *cmds)
+{
+	struct diff_ctx dctx = {
+		.nft	= nft,
+		.cmds	= cmds,
+	};
+	struct nft_timing_span span;
+	struct diff_obj *obj, *next;
+	unsigned int num_objs = 0;
+	bool timing;
+	int ret = 0;
+
+	timing = nft_timing_start(nft, NFT_TIMING_DIFF, &span);
+
+	dctx.nl_ctx.nft = nft;
+	dctx.nl_ctx.msgs = msgs;
+	dctx.nl_ctx.seqnum = nft->cache->seqnum++;
+	init_list_head(&dctx.nl_ctx.list);
+
+	/* only what takes part in the comparison is printed */
+	dctx.octx = nft->output;
+	dctx.octx.flags = NFT_CTX_OUTPUT_STATELESS | NFT_CTX_OUTPUT_NUMERIC_ALL;
+
+	dctx.ht = xzalloc_array(DIFF_HSIZE, sizeof(*dctx.ht));
+	init_list_head(&dctx.objs);
+	init_list_head(&dctx.del_rules);
+	init_list_head(&dctx.del_chains);
+	init_list_head(&dctx.del_sets);
+	init_list_head(&dctx.del_objs);
+	init_list_head(&dctx.del_tables);
+
+	diff_collect(&dctx);
+
+	list_for_each_entry(obj, &dctx.objs, list) {
+		switch (obj->kind) {
+		case CMD_OBJ_CHAIN:
+			ret = diff_chain(&dctx, obj);
+			break;
+		case CMD_OBJ_SET:
+			ret = diff_set(&dctx, obj);
+			break;
+		default:
+			break;
+		}
+		if (ret < 0)
+			break;
+		num_objs++;
+	}
+
+	if (ret == 0 && nft->diff_flushed)
+		diff_flushed_tables(&dctx);
+
+	/* rules first, they may refer to the other objects */
+	list_splice_tail(&dctx.del_rules, cmds);
+	list_splice_tail(&dctx.del_chains, cmds);
+	list_splice_tail(&dctx.del_sets, cmds);
+	list_splice_tail(&dctx.del_objs, cmds);
+	list_splice_tail(&dctx.del_tables, cmds);
+
+	list_for_each_entry_safe(obj, next, &dctx.objs, list)
+		diff_obj_free(obj);
+	free(dctx.ht);
+
+	if (ret == 0 && nft->debug_mask & NFT_DEBUG_EVALUATION)
+		nft_print(&nft->output,
+			  "Diff: rules %u kept, %u added, %u deleted; "
+			  "elements %u kept, %u added, %u deleted; "
+			  "%u objects deleted\n\n",
+			  dctx.stats.rules_kept, dctx.stats.rules_added,
+			  dctx.stats.rules_deleted, dctx.stats.elems_kept,
+			  dctx.stats.elems_added, dctx.stats.elems_deleted,
+			  dctx.stats.objs_deleted);
+
+	if (timing)
+		nft_timing_stop(nft, &span, num_objs);
+
+	return ret;
+}
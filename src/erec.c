@@ -213,6 +213,10 @@ void erec_print_list(struct output_ctx *octx, struct list_head *list,
 {
 	struct error_record *erec, *next;
 
+	/* keep errors after the output they refer to */
+	if (!list_empty(list))
+		nft_print_flush(octx);
+
 	list_for_each_entry_safe(erec, next, list, list) {
 		list_del(&erec->list);
 		erec_print(octx, erec, debug_mask);
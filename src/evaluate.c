@@ -25,6 +25,7 @@
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <expression.h>
 #include <statement.h>
@@ -35,8 +36,12 @@
 #include <cache.h>
 #include <erec.h>
 #include <gmputil.h>
+#include <hash.h>
 #include <utils.h>
 #include <xt.h>
+#include <prepare.h>
+#include <timing.h>
+#include <parallel.h>
 
 struct proto_ctx *eval_proto_ctx(struct eval_ctx *ctx)
 {
@@ -112,6 +117,28 @@ static void key_fix_dtype_byteorder(struct expr *key)
 }
 
 static int set_evaluate(struct eval_ctx *ctx, struct set *set);
+
+static struct expr *implicit_set_add(struct eval_ctx *ctx, struct set *set,
+				     const struct expr *expr)
+{
+	struct cmd *cmd;
+	struct handle h;
+
+	if (ctx->table != NULL)
+		list_add_tail(&set->list, &ctx->table->sets);
+	else {
+		memset(&h, 0, sizeof(h));
+		handle_merge(&h, &set->handle);
+		h.set.location = expr->location;
+		cmd = cmd_alloc(CMD_ADD, CMD_OBJ_SET, &h, &expr->location, set);
+		cmd->location = set->location;
+		cmd->index = ctx->cmd->index;
+		list_add_tail(&cmd->list, &ctx->cmd->list);
+	}
+
+	return set_ref_expr_alloc(&expr->location, set);
+}
+
 static struct expr *implicit_set_declaration(struct eval_ctx *ctx,
 					     const char *name,
 					     struct expr *key,
@@ -119,9 +146,7 @@ static struct expr *implicit_set_declaration(struct eval_ctx *ctx,
 					     struct expr *expr,
 					     uint32_t flags)
 {
-	struct cmd *cmd;
 	struct set *set;
-	struct handle h;
 
 	if (set_is_datamap(expr->set_flags))
 		key_fix_dtype_byteorder(key);
@@ -143,18 +168,243 @@ static struct expr *implicit_set_declaration(struct eval_ctx *ctx,
 		return NULL;
 	}
 
-	if (ctx->table != NULL)
-		list_add_tail(&set->list, &ctx->table->sets);
-	else {
-		memset(&h, 0, sizeof(h));
-		handle_merge(&h, &set->handle);
-		h.set.location = expr->location;
-		cmd = cmd_alloc(CMD_ADD, CMD_OBJ_SET, &h, &expr->location, set);
-		cmd->location = set->location;
-		list_add_tail(&cmd->list, &ctx->cmd->list);
+	return implicit_set_add(ctx, set, expr);
+}
+
+/*
+ * Generated rulesets often repeat the same literal set in many rules. The
+ * kernel binds an anonymous set to a single rule, so each one still becomes
+ * a set of its own, but identical ones are evaluated only once per batch:
+ * later occurrences reuse the evaluated elements of the first one. Elements
+ * of sets without intervals are shared, those of interval sets are cloned
+ * since set_to_intervals() converts them in place when the set is added.
+ */
+#define ANON_SET_CACHE_SIZE	256
+
+struct anon_set_entry {
+	struct anon_set_entry	*next;
+	uint32_t		hash;
+	uint32_t		type;
+	enum byteorder		byteorder;
+	unsigned int		len;
+	uint32_t		set_flags;
+	/* elements as given, before evaluation of the set */
+	struct expr		*orig;
+	struct expr		*init;
+};
+
+struct anon_set_cache {
+	pthread_mutex_t		lock;
+	struct anon_set_entry	*table[ANON_SET_CACHE_SIZE];
+};
+
+struct anon_set_cache *anon_set_cache_alloc(void)
+{
+	struct anon_set_cache *cache = xzalloc(sizeof(*cache));
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void anon_set_cache_free(struct anon_set_cache *cache)
+{
+	struct anon_set_entry *entry, *next;
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < ANON_SET_CACHE_SIZE; i++) {
+		for (entry = cache->table[i]; entry; entry = next) {
+			next = entry->next;
+			expr_free(entry->orig);
+			expr_free(entry->init);
+			free(entry);
+		}
 	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
 
-	return set_ref_expr_alloc(&expr->location, set);
+/* Returns false for elements that cannot be compared. */
+static bool anon_set_expr_hash(const struct expr *expr, uint32_t *hash)
+{
+	const struct expr *i;
+
+	*hash = *hash * 31 + expr->etype;
+
+	switch (expr->etype) {
+	case EXPR_VALUE:
+		*hash = *hash * 31 + (uint32_t)mpz_get_ui(expr->value);
+		return true;
+	case EXPR_PREFIX:
+		*hash = *hash * 31 + expr->prefix_len;
+		return anon_set_expr_hash(expr->prefix, hash);
+	case EXPR_RANGE:
+		return anon_set_expr_hash(expr->left, hash) &&
+		       anon_set_expr_hash(expr->right, hash);
+	case EXPR_SET_ELEM:
+		if (expr->timeout || expr->expiration || expr->comment ||
+		    !list_empty(&expr->stmt_list))
+			return false;
+		return anon_set_expr_hash(expr->key, hash);
+	case EXPR_SET:
+		list_for_each_entry(i, &expr->expressions, list) {
+			if (!anon_set_expr_hash(i, hash))
+				return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool anon_set_expr_eq(const struct expr *a, const struct expr *b)
+{
+	const struct expr *i, *j;
+
+	if (a->etype != b->etype ||
+	    a->len != b->len ||
+	    a->byteorder != b->byteorder ||
+	    a->flags != b->flags ||
+	    a->dtype->type != b->dtype->type)
+		return false;
+
+	switch (a->etype) {
+	case EXPR_VALUE:
+		return !mpz_cmp(a->value, b->value);
+	case EXPR_PREFIX:
+		return a->prefix_len == b->prefix_len &&
+		       anon_set_expr_eq(a->prefix, b->prefix);
+	case EXPR_RANGE:
+		return anon_set_expr_eq(a->left, b->left) &&
+		       anon_set_expr_eq(a->right, b->right);
+	case EXPR_SET_ELEM:
+		return a->elem_flags == b->elem_flags &&
+		       anon_set_expr_eq(a->key, b->key);
+	case EXPR_SET:
+		if (a->size != b->size || a->set_flags != b->set_flags)
+			return false;
+
+		j = list_first_entry(&b->expressions, struct expr, list);
+		list_for_each_entry(i, &a->expressions, list) {
+			if (!anon_set_expr_eq(i, j))
+				return false;
+			j = list_next_entry(j, list);
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool anon_set_entry_match(const struct anon_set_entry *entry,
+				 uint32_t hash, const struct expr *key,
+				 const struct expr *expr)
+{
+	return entry->hash == hash &&
+	       entry->type == key->dtype->type &&
+	       entry->byteorder == key->byteorder &&
+	       entry->len == key->len &&
+	       entry->set_flags == expr->set_flags &&
+	       anon_set_expr_eq(entry->orig, expr);
+}
+
+/* Returns the evaluated elements of an identical set, or NULL. */
+static struct expr *anon_set_cache_get(struct anon_set_cache *cache,
+				       uint32_t hash, const struct expr *key,
+				       const struct expr *expr)
+{
+	struct anon_set_entry *entry;
+	struct expr *init = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	for (entry = cache->table[hash % ANON_SET_CACHE_SIZE];
+	     entry; entry = entry->next) {
+		if (!anon_set_entry_match(entry, hash, key, expr))
+			continue;
+
+		if (set_is_interval(expr->set_flags)) {
+			init = expr_clone(entry->init);
+			init->set_flags = entry->init->set_flags;
+		} else {
+			init = expr_get(entry->init);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return init;
+}
+
+static void anon_set_cache_add(struct anon_set_cache *cache, uint32_t hash,
+			       const struct expr *key, struct expr *orig,
+			       struct expr *init)
+{
+	struct anon_set_entry *entry = xzalloc(sizeof(*entry));
+	unsigned int i = hash % ANON_SET_CACHE_SIZE;
+
+	entry->hash = hash;
+	entry->type = key->dtype->type;
+	entry->byteorder = key->byteorder;
+	entry->len = key->len;
+	entry->set_flags = orig->set_flags;
+	entry->orig = orig;
+
+	pthread_mutex_lock(&cache->lock);
+	entry->init = expr_get(init);
+	entry->next = cache->table[i];
+	cache->table[i] = entry;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Declare the anonymous set of a lookup, @key is the expression looked up. */
+static struct expr *anon_set_declaration(struct eval_ctx *ctx,
+					 struct expr *key, struct expr *expr)
+{
+	struct anon_set_cache *cache = ctx->nft->anon_sets;
+	struct expr *init, *orig, *ref;
+	uint32_t hash = 0;
+	struct set *set;
+
+	if (!cache ||
+	    key->etype == EXPR_CONCAT || key->len == 0 ||
+	    !anon_set_expr_hash(expr, &hash))
+		return implicit_set_declaration(ctx, "__set%d", expr_get(key),
+						NULL, expr, NFT_SET_ANONYMOUS);
+
+	init = anon_set_cache_get(cache, hash, key, expr);
+	if (init) {
+		set = set_alloc(&expr->location);
+		set->flags	= expr->set_flags | NFT_SET_ANONYMOUS;
+		set->handle.set.name = xstrdup("__set%d");
+		set->key	= expr_get(key);
+		set->init	= init;
+		set->automerge	= set->flags & NFT_SET_INTERVAL;
+		handle_merge(&set->handle, &ctx->cmd->handle);
+
+		ref = implicit_set_add(ctx, set, expr);
+		expr_free(expr);
+		return ref;
+	}
+
+	/* interval sets are merged in place by set_evaluate() */
+	if (set_is_interval(expr->set_flags)) {
+		orig = expr_clone(expr);
+		orig->set_flags = expr->set_flags;
+	} else {
+		orig = expr_get(expr);
+	}
+
+	ref = implicit_set_declaration(ctx, "__set%d", expr_get(key), NULL,
+				       expr, NFT_SET_ANONYMOUS);
+	if (!ref) {
+		expr_free(orig);
+		return NULL;
+	}
+
+	anon_set_cache_add(cache, hash, key, orig, ref->set->init);
+	return ref;
 }
 
 static enum ops byteorder_conversion_op(struct expr *expr,
@@ -250,7 +500,7 @@ static int table_not_found(struct eval_ctx *ctx)
 {
 	struct table *table;
 
-	table = table_lookup_fuzzy(&ctx->cmd->handle, &ctx->nft->cache);
+	table = table_lookup_fuzzy(&ctx->cmd->handle, ctx->nft->cache);
 	if (table == NULL)
 		return cmd_error(ctx, &ctx->cmd->handle.table.location,
 				 "%s", strerror(ENOENT));
@@ -266,7 +516,7 @@ static int chain_not_found(struct eval_ctx *ctx)
 	const struct table *table;
 	struct chain *chain;
 
-	chain = chain_lookup_fuzzy(&ctx->cmd->handle, &ctx->nft->cache, &table);
+	chain = chain_lookup_fuzzy(&ctx->cmd->handle, ctx->nft->cache, &table);
 	if (chain == NULL)
 		return cmd_error(ctx, &ctx->cmd->handle.chain.location,
 				 "%s", strerror(ENOENT));
@@ -284,7 +534,7 @@ static int set_not_found(struct eval_ctx *ctx, const struct location *loc,
 	const struct table *table;
 	struct set *set;
 
-	set = set_lookup_fuzzy(set_name, &ctx->nft->cache, &table);
+	set = set_lookup_fuzzy(set_name, ctx->nft->cache, &table);
 	if (set == NULL)
 		return cmd_error(ctx, loc, "%s", strerror(ENOENT));
 
@@ -303,7 +553,7 @@ static int flowtable_not_found(struct eval_ctx *ctx, const struct location *loc,
 	const struct table *table;
 	struct flowtable *ft;
 
-	ft = flowtable_lookup_fuzzy(ft_name, &ctx->nft->cache, &table);
+	ft = flowtable_lookup_fuzzy(ft_name, ctx->nft->cache, &table);
 	if (!ft)
 		return cmd_error(ctx, loc, "%s", strerror(ENOENT));
 
@@ -317,11 +567,43 @@ static int flowtable_not_found(struct eval_ctx *ctx, const struct location *loc,
 /*
  * Symbol expression: parse symbol and evaluate resulting expression.
  */
+/* Placeholder of a prepared statement, see nft_prepare(). */
+static int expr_evaluate_param(struct eval_ctx *ctx, struct expr **exprp)
+{
+	const struct datatype *dtype = ctx->ectx.dtype;
+	struct expr *expr = *exprp, *value;
+	enum byteorder byteorder;
+
+	if (!ctx->nft->params)
+		return expr_error(ctx->msgs, expr, "unknown identifier '%s'",
+				  expr->identifier);
+
+	if (!dtype || dtype->type == TYPE_INVALID ||
+	    ctx->ectx.len == 0 || ctx->ectx.len % BITS_PER_BYTE)
+		return expr_error(ctx->msgs, expr,
+				  "placeholder $%s needs a value of fixed size here",
+				  expr->identifier);
+
+	byteorder = ctx->ectx.byteorder;
+	if (byteorder == BYTEORDER_INVALID)
+		byteorder = dtype->byteorder;
+
+	value = constant_expr_alloc(&expr->location, dtype, byteorder,
+				    ctx->ectx.len, NULL);
+	nft_param_add(ctx->nft->params, expr->identifier, value, ctx->cmd);
+
+	expr_free(expr);
+	*exprp = value;
+
+	return expr_evaluate(ctx, exprp);
+}
+
 static int expr_evaluate_symbol(struct eval_ctx *ctx, struct expr **expr)
 {
 	struct parse_ctx parse_ctx = {
-		.tbl	= &ctx->nft->output.tbl,
-		.input	= &ctx->nft->input,
+		.tbl		= &ctx->nft->output.tbl,
+		.input		= &ctx->nft->input,
+		.resolver	= ctx->nft->resolver,
 	};
 	struct error_record *erec;
 	struct table *table;
@@ -338,7 +620,7 @@ static int expr_evaluate_symbol(struct eval_ctx *ctx, struct expr **expr)
 		}
 		break;
 	case SYMBOL_SET:
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 ctx->cmd->handle.table.name,
 					 ctx->cmd->handle.family);
 		if (table == NULL)
@@ -351,6 +633,8 @@ static int expr_evaluate_symbol(struct eval_ctx *ctx, struct expr **expr)
 
 		new = set_ref_expr_alloc(&(*expr)->location, set);
 		break;
+	case SYMBOL_PARAM:
+		return expr_evaluate_param(ctx, expr);
 	}
 
 	expr_free(*expr);
@@ -1895,14 +2179,50 @@ static const struct expr *expr_set_elem(const struct expr *expr)
 	return expr;
 }
 
+/* Deleting elements does not dump the set, only the ranges that contain the
+ * elements to be deleted are fetched, unless the elements are cached already
+ * for other commands.
+ */
+static int interval_set_fetch(struct eval_ctx *ctx, struct set *set,
+			      const struct expr *init)
+{
+	struct netlink_ctx nl_ctx = {
+		.nft		= ctx->nft,
+		.msgs		= ctx->msgs,
+		.list		= LIST_HEAD_INIT(nl_ctx.list),
+		.seqnum		= ctx->nft->cache->seqnum++,
+	};
+
+	if (!set->existing_set ||
+	    ctx->nft->cache->flags & (NFT_CACHE_SETELEM_BIT |
+				      NFT_CACHE_SETELEM_MAYBE))
+		return 0;
+
+	if (netlink_get_setelem_ranges(&nl_ctx, set->existing_set, init) < 0)
+		return netlink_io_error(&nl_ctx, &init->location,
+					"Could not fetch elements of set %s: %s",
+					set->handle.set.name, strerror(errno));
+
+	/* the cached set now holds some of its elements only, further commands
+	 * of this batch do not need them, later ones must not take them for
+	 * the content of the set.
+	 */
+	ctx->nft->cache->flags |= NFT_CACHE_REFRESH;
+
+	return 0;
+}
+
 static int interval_set_eval(struct eval_ctx *ctx, struct set *set,
 			     struct expr *init)
 {
+	struct nft_timing_span span;
+	bool timing;
 	int ret;
 
 	if (!init)
 		return 0;
 
+	timing = nft_timing_start(ctx->nft, NFT_TIMING_INTERVALS, &span);
 	ret = 0;
 	switch (ctx->cmd->op) {
 	case CMD_CREATE:
@@ -1911,15 +2231,20 @@ static int interval_set_eval(struct eval_ctx *ctx, struct set *set,
 	case CMD_INSERT:
 		if (set->automerge) {
 			ret = set_automerge(ctx->msgs, ctx->cmd, set, init,
-					    ctx->nft->debug_mask);
+					    ctx->nft->debug_mask,
+					    ctx->nft->jobs);
 		} else {
-			ret = set_overlap(ctx->msgs, set, init);
+			ret = set_overlap(ctx->msgs, set, init, ctx->nft->jobs);
 		}
 		break;
 	case CMD_DELETE:
 	case CMD_DESTROY:
+		if (interval_set_fetch(ctx, set, init) < 0) {
+			ret = -1;
+			break;
+		}
 		ret = set_delete(ctx->msgs, ctx->cmd, set, init,
-				 ctx->nft->debug_mask);
+				 ctx->nft->debug_mask, ctx->nft->jobs);
 		break;
 	case CMD_GET:
 		break;
@@ -1927,6 +2252,8 @@ static int interval_set_eval(struct eval_ctx *ctx, struct set *set,
 		BUG("unhandled op %d\n", ctx->cmd->op);
 		break;
 	}
+	if (timing)
+		nft_timing_stop(ctx->nft, &span, init->size);
 
 	return ret;
 }
@@ -1939,13 +2266,143 @@ static void expr_evaluate_set_ref(struct eval_ctx *ctx, struct expr *expr)
 	ctx->ectx.key = set->key;
 }
 
+/* Elements evaluated by each thread, at least. */
+#define NFT_EVAL_ELEM_CHUNK_MIN	16384
+
+struct set_elem_chunk {
+	const struct eval_ctx	*ctx;
+	struct expr		**elems;
+	unsigned int		num;
+	struct list_head	msgs;
+	int			err;
+};
+
+static bool symbol_is_value(const struct expr *expr)
+{
+	return expr->etype == EXPR_SYMBOL && expr->symtype == SYMBOL_VALUE;
+}
+
+/* Elements made of literal values only depend on the set they belong to. */
+static bool set_elem_is_literal(const struct expr *i)
+{
+	const struct expr *key;
+
+	if (i->etype != EXPR_SET_ELEM || !list_empty(&i->stmt_list))
+		return false;
+
+	key = i->key;
+	switch (key->etype) {
+	case EXPR_SYMBOL:
+		return symbol_is_value(key);
+	case EXPR_PREFIX:
+		return symbol_is_value(key->prefix);
+	case EXPR_RANGE:
+		return symbol_is_value(key->left) &&
+		       symbol_is_value(key->right);
+	default:
+		return false;
+	}
+}
+
+static void set_elem_chunk_evaluate(void *data, unsigned int i)
+{
+	struct set_elem_chunk *chunk = (struct set_elem_chunk *)data + i;
+	struct eval_ctx ctx = *chunk->ctx;
+	unsigned int k;
+
+	ctx.msgs = &chunk->msgs;
+	for (k = 0; k < chunk->num; k++) {
+		if (expr_evaluate(&ctx, &chunk->elems[k]) < 0) {
+			chunk->err = -1;
+			break;
+		}
+	}
+}
+
+/*
+ * Evaluate the elements of a large set declaration from up to --jobs threads,
+ * if all of them are literal values. Each thread evaluates a chunk of
+ * consecutive elements, then errors are reported in element order, up to the
+ * first failing element, as if the elements had been evaluated one after
+ * another. Returns 1 if the elements have been evaluated.
+ */
+static int set_elems_evaluate_parallel(struct eval_ctx *ctx, struct expr *set)
+{
+	struct error_record *erec, *enext;
+	struct set_elem_chunk *chunk;
+	unsigned int num = 0, n, k;
+	struct expr *i, *next;
+	struct expr **elems;
+	int err = 1;
+
+	if (ctx->nft->jobs < 2 || !ctx->set || ctx->nft->debug_mask ||
+	    set->size < 2 * NFT_EVAL_ELEM_CHUNK_MIN)
+		return 0;
+
+	list_for_each_entry(i, &set->expressions, list) {
+		if (!set_elem_is_literal(i))
+			return 0;
+		num++;
+	}
+
+	n = min(ctx->nft->jobs, num / NFT_EVAL_ELEM_CHUNK_MIN);
+
+	elems = xmalloc_array(num, sizeof(*elems));
+	k = 0;
+	list_for_each_entry_safe(i, next, &set->expressions, list) {
+		list_del(&i->list);
+		elems[k++] = i;
+	}
+
+	chunk = xmalloc_array(n, sizeof(*chunk));
+
+	for (k = 0; k < n; k++) {
+		chunk[k].ctx = ctx;
+		chunk[k].elems = &elems[(uint64_t)num * k / n];
+		chunk[k].num = (uint64_t)num * (k + 1) / n -
+			       (uint64_t)num * k / n;
+		init_list_head(&chunk[k].msgs);
+		chunk[k].err = 0;
+	}
+
+	nft_parallel_for(n, n, set_elem_chunk_evaluate, chunk);
+
+	for (k = 0; k < num; k++)
+		list_add_tail(&elems[k]->list, &set->expressions);
+
+	for (k = 0; k < n; k++) {
+		if (err < 0) {
+			list_for_each_entry_safe(erec, enext, &chunk[k].msgs,
+						 list) {
+				list_del(&erec->list);
+				erec_destroy(erec);
+			}
+			continue;
+		}
+
+		list_splice_tail_init(&chunk[k].msgs, ctx->msgs);
+		if (chunk[k].err < 0)
+			err = -1;
+	}
+
+	free(chunk);
+	free(elems);
+
+	return err;
+}
+
 static int expr_evaluate_set(struct eval_ctx *ctx, struct expr **expr)
 {
 	struct expr *set = *expr, *i, *next;
 	const struct expr *elem;
+	int evaluated;
+
+	evaluated = set_elems_evaluate_parallel(ctx, set);
+	if (evaluated < 0)
+		return -1;
 
 	list_for_each_entry_safe(i, next, &set->expressions, list) {
-		if (list_member_evaluate(ctx, &i) < 0)
+		if (!evaluated && list_member_evaluate(ctx, &i) < 0)
 			return -1;
 
 		if (i->etype == EXPR_MAPPING &&
@@ -2723,10 +3180,7 @@ static int expr_evaluate_relational(struct eval_ctx *ctx, struct expr **expr)
 				return expr_error(ctx->msgs, right, "Set is empty");
 
 			right = rel->right =
-				implicit_set_declaration(ctx, "__set%d",
-							 expr_get(left), NULL,
-							 right,
-							 NFT_SET_ANONYMOUS);
+				anon_set_declaration(ctx, left, right);
 			if (!right)
 				return -1;
 
@@ -2847,11 +3301,67 @@ static int expr_evaluate_osf(struct eval_ctx *ctx, struct expr **expr)
 	return expr_evaluate_primary(ctx, expr);
 }
 
+/*
+ * Sets that are bound to a variable that is used several times are only
+ * evaluated once per expression context, later expansions clone the result
+ * instead of parsing and evaluating every element again. Contexts that
+ * refer to a key expression or to a set declaration are not cached.
+ */
+static bool variable_eval_cacheable(const struct eval_ctx *ctx,
+				    const struct symbol *sym)
+{
+	return sym->refcnt > 2 &&
+	       sym->expr->etype == EXPR_SET &&
+	       ctx->ectx.dtype &&
+	       !ctx->ectx.key &&
+	       !ctx->set;
+}
+
+static bool variable_eval_match(const struct eval_ctx *ctx,
+				const struct symbol *sym)
+{
+	const struct expr_ctx *ectx = sym->eval_ectx;
+
+	return sym->eval &&
+	       ectx->dtype == ctx->ectx.dtype &&
+	       ectx->byteorder == ctx->ectx.byteorder &&
+	       ectx->len == ctx->ectx.len &&
+	       ectx->maxval == ctx->ectx.maxval;
+}
+
+static struct expr *variable_eval_clone(const struct expr *set)
+{
+	struct expr *new = expr_clone(set);
+
+	new->set_flags = set->set_flags;
+
+	return new;
+}
+
+static void variable_eval_store(struct symbol *sym, const struct expr *set,
+				const struct expr_ctx *ectx)
+{
+	sym->eval = variable_eval_clone(set);
+	sym->eval_ectx = xmalloc(sizeof(*sym->eval_ectx));
+	*sym->eval_ectx = *ectx;
+	sym->eval_ectx->dtype = datatype_get(ectx->dtype);
+}
+
 static int expr_evaluate_variable(struct eval_ctx *ctx, struct expr **exprp)
 {
 	struct symbol *sym = (*exprp)->sym;
+	struct expr_ctx ectx = ctx->ectx;
+	bool cache = false;
 	struct expr *new;
 
+	if (variable_eval_cacheable(ctx, sym)) {
+		if (variable_eval_match(ctx, sym)) {
+			new = variable_eval_clone(sym->eval);
+			goto out;
+		}
+		cache = !sym->eval;
+	}
+
 	/* If variable is reused from different locations in the ruleset, then
 	 * clone expression.
 	 */
@@ -2865,6 +3375,9 @@ static int expr_evaluate_variable(struct eval_ctx *ctx, struct expr **exprp)
 		return -1;
 	}
 
+	if (cache && new->etype == EXPR_SET)
+		variable_eval_store(sym, new, &ectx);
+out:
 	expr_free(*exprp);
 	*exprp = new;
 
@@ -3342,7 +3855,7 @@ static int stmt_evaluate_meter(struct eval_ctx *ctx, struct stmt *stmt)
 	struct set *existing_set;
 	struct table *table;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 ctx->cmd->handle.table.name,
 				 ctx->cmd->handle.family);
 	if (table == NULL)
@@ -4289,6 +4802,7 @@ static int stmt_evaluate_chain(struct eval_ctx *ctx, struct stmt *stmt)
 		cmd = cmd_alloc(CMD_ADD, CMD_OBJ_CHAIN, &h, &stmt->location,
 				chain);
 		cmd->location = stmt->location;
+		cmd->index = ctx->cmd->index;
 		list_add_tail(&cmd->list, &ctx->cmd->list);
 		h.chain_id = chain->handle.chain_id;
 
@@ -4312,6 +4826,7 @@ static int stmt_evaluate_chain(struct eval_ctx *ctx, struct stmt *stmt)
 			handle_merge(&h2, &rule->handle);
 			cmd = cmd_alloc(CMD_ADD, CMD_OBJ_RULE, &h2,
 					&rule->location, rule);
+			cmd->index = ctx->cmd->index;
 			list_add_tail(&cmd->list, &ctx->cmd->list);
 			list_del(&rule->list);
 		}
@@ -4759,7 +5274,7 @@ static int setelem_evaluate(struct eval_ctx *ctx, struct cmd *cmd)
 	struct table *table;
 	struct set *set;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 ctx->cmd->handle.table.name,
 				 ctx->cmd->handle.family);
 	if (table == NULL)
@@ -4867,9 +5382,227 @@ static int set_expr_evaluate_concat(struct eval_ctx *ctx, struct expr **expr)
 	return 0;
 }
 
+/* The size of a set is also the maximum number of elements it can hold, so
+ * leave room for twice as many elements as the initializer has.
+ */
+#define NFT_SET_HINT_MIN_SIZE	16
+
+static void set_hints_evaluate(struct eval_ctx *ctx, struct set *set)
+{
+	unsigned int values = 0, prefixes = 0, ranges = 0;
+	uint64_t elements, size;
+	const char *shape;
+	struct expr *i, *key;
+
+	if (!nft_input_set_hints(&ctx->nft->input) ||
+	    set->existing_set || set_is_anonymous(set->flags) ||
+	    set->flags & (NFT_SET_EVAL | NFT_SET_TIMEOUT))
+		return;
+
+	list_for_each_entry(i, &set->init->expressions, list) {
+		key = i->etype == EXPR_MAPPING ? i->left : i;
+		if (key->etype == EXPR_SET_ELEM)
+			key = key->key;
+
+		switch (key->etype) {
+		case EXPR_PREFIX:
+			prefixes++;
+			break;
+		case EXPR_RANGE:
+			ranges++;
+			break;
+		default:
+			values++;
+			break;
+		}
+	}
+
+	if (prefixes > values + ranges)
+		shape = "prefix";
+	else if (ranges > values + prefixes)
+		shape = "range";
+	else
+		shape = "scalar";
+
+	/* the kernel stores both ends of a range as separate elements. */
+	elements = set->init->size;
+	if (set->flags & NFT_SET_INTERVAL && !(set->flags & NFT_SET_CONCAT))
+		elements *= 2;
+
+	if (set->desc.size == 0 && set->policy == NFT_SET_POL_PERFORMANCE) {
+		size = NFT_SET_HINT_MIN_SIZE;
+		while (size < elements * 2 && size < UINT32_MAX)
+			size <<= 1;
+		set->desc.size = size > UINT32_MAX ? UINT32_MAX : size;
+	}
+
+	/* field lengths are only required for concatenated ranges, but they
+	 * describe the key layout of any concatenation to the kernel.
+	 */
+	if (set->key->etype == EXPR_CONCAT && !set->desc.field_count) {
+		memcpy(&set->desc.field_len, &set->key->field_len,
+		       sizeof(set->desc.field_len));
+		set->desc.field_count = set->key->field_count;
+	}
+
+	if (ctx->nft->debug_mask & NFT_DEBUG_EVALUATION) {
+		struct error_record *erec;
+
+		erec = erec_create(EREC_INFORMATIONAL, &set->location,
+				   "Set %s: %u elements, %s keys (%u values, %u prefixes, %u ranges), %u key fields, size %u",
+				   set->handle.set.name, set->init->size, shape,
+				   values, prefixes, ranges,
+				   set->desc.field_count ? set->desc.field_count : 1,
+				   set->desc.size);
+		erec_print(&ctx->nft->output, erec, ctx->nft->debug_mask);
+		nft_print(&ctx->nft->output, "\n");
+		erec_destroy(erec);
+	}
+}
+
+/* Promote only if the interval set needs at most a quarter of the elements. */
+#define SET_INTERVAL_PROMOTE_RATIO	4
+
+/*
+ * With -o, a new set of plain integer keys, such as a list of addresses, is
+ * turned into an interval set if its elements merge into far fewer ranges.
+ * The kernel stores both ends of each range, so a range counts twice.
+ */
+static void set_interval_promote(struct eval_ctx *ctx, struct set *set)
+{
+	const struct datatype *dtype = set->key->dtype;
+	unsigned int intervals;
+	struct expr *i;
+
+	if (!(ctx->nft->optimize_flags & NFT_OPTIMIZE_ENABLED) ||
+	    set->existing_set || set_is_anonymous(set->flags) ||
+	    set_is_map(set->flags) || set_is_interval(set->flags) ||
+	    set->flags & (NFT_SET_EVAL | NFT_SET_TIMEOUT) ||
+	    !list_empty(&set->stmt_list) ||
+	    set->key->etype == EXPR_CONCAT ||
+	    set->key->byteorder != BYTEORDER_BIG_ENDIAN ||
+	    datatype_basetype(dtype)->type != TYPE_INTEGER)
+		return;
+
+	list_for_each_entry(i, &set->init->expressions, list) {
+		if (i->etype != EXPR_SET_ELEM ||
+		    i->key->etype != EXPR_VALUE ||
+		    i->timeout || i->expiration ||
+		    !list_empty(&i->stmt_list))
+			return;
+	}
+
+	intervals = set_count_intervals(set, set->init, ctx->nft->jobs);
+	if (2 * intervals * SET_INTERVAL_PROMOTE_RATIO > set->init->size)
+		return;
+
+	fprintf(ctx->nft->output.error_fp,
+		"Converting set %s to interval set: %u elements into %u intervals\n",
+		set->handle.set.name, set->init->size, intervals);
+
+	set->flags |= NFT_SET_INTERVAL;
+	set->automerge = true;
+}
+
+/*
+ * Expand the maglev declaration of a map into its elements, one per slot of
+ * the lookup table, each mapping to one of the backends.
+ */
+static int set_maglev_evaluate(struct eval_ctx *ctx, struct set *set)
+{
+	const struct expr *dup = NULL;
+	struct expr *backends, *i;
+	uint64_t weights = 0;
+	uint32_t weight;
+
+	if (!set_is_datamap(set->flags) ||
+	    set->data->dtype->type == TYPE_VERDICT ||
+	    set->data->flags & EXPR_F_INTERVAL ||
+	    set_is_interval(set->flags))
+		return set_error(ctx, set, "maglev needs a map of values without intervals");
+	if (set->init)
+		return set_error(ctx, set, "maglev map cannot also declare elements");
+	if (set->key->etype == EXPR_CONCAT ||
+	    datatype_basetype(set->key->dtype)->type != TYPE_INTEGER)
+		return set_error(ctx, set, "maglev map key must be an integer");
+	if (!maglev_size_valid(set->maglev.size))
+		return set_error(ctx, set, "maglev size must be a prime number up to %u",
+				 MAGLEV_SIZE_MAX);
+	if (set->key->len < 64 &&
+	    (set->maglev.size - 1) >> set->key->len)
+		return set_error(ctx, set, "maglev size %" PRIu64 " exceeds the %u bits key",
+				 set->maglev.size, set->key->len);
+
+	backends = set->maglev.backends;
+	if (backends->etype == EXPR_VARIABLE) {
+		set->maglev.backends = expr_clone(backends->sym->expr);
+		expr_free(backends);
+		backends = set->maglev.backends;
+	}
+	if (backends->etype != EXPR_SET)
+		return expr_error(ctx->msgs, backends,
+				  "maglev backends must be a list in { }");
+
+	list_for_each_entry(i, &backends->expressions, list) {
+		struct expr **value, **wexpr = NULL;
+
+		if (i->etype == EXPR_MAPPING) {
+			value = &i->left->key;
+			wexpr = &i->right;
+		} else {
+			value = &i->key;
+		}
+
+		__expr_set_context(&ctx->ectx, set->data->dtype,
+				   set->data->byteorder, set->data->len, 0);
+		if (expr_evaluate(ctx, value) < 0)
+			return -1;
+		if (!expr_is_constant(*value))
+			return expr_error(ctx->msgs, *value,
+					  "maglev backend must be a constant value");
+
+		if (!wexpr) {
+			weights++;
+			continue;
+		}
+
+		expr_set_context(&ctx->ectx, &integer_type,
+				 4 * BITS_PER_BYTE);
+		if (expr_evaluate(ctx, wexpr) < 0)
+			return -1;
+		if ((*wexpr)->etype != EXPR_VALUE)
+			return expr_error(ctx->msgs, *wexpr,
+					  "maglev backend weight must be a number");
+
+		weight = mpz_get_uint32((*wexpr)->value);
+		weights += weight;
+	}
+
+	if (!weights)
+		return expr_error(ctx->msgs, backends,
+				  "maglev needs a backend with a weight");
+	if (weights > set->maglev.size)
+		return expr_error(ctx->msgs, backends,
+				  "maglev backend weights add up to more than the size %" PRIu64,
+				  set->maglev.size);
+
+	set->init = maglev_table_alloc(set, backends, &dup);
+	if (!set->init)
+		return expr_error(ctx->msgs, dup, "maglev backend listed twice");
+
+	if (!set->desc.size)
+		set->desc.size = set->maglev.size;
+
+	return 0;
+}
+
 static int elems_evaluate(struct eval_ctx *ctx, struct set *set)
 {
 	ctx->set = set;
+	if (set->maglev.backends && set_maglev_evaluate(ctx, set) < 0) {
+		set->errors = true;
+		return -1;
+	}
 	if (set->init != NULL) {
 		if (set->key == NULL)
 			return set_error(ctx, set, "set definition does not specify key");
@@ -4883,6 +5616,9 @@ static int elems_evaluate(struct eval_ctx *ctx, struct set *set)
 		if (set->init->etype != EXPR_SET)
 			return expr_error(ctx->msgs, set->init, "Set %s: Unexpected initial type %s, missing { }?",
 					  set->handle.set.name, expr_name(set->init));
+
+		set_interval_promote(ctx, set);
+		set_hints_evaluate(ctx, set);
 	}
 
 	if (set_is_interval(ctx->set->flags) &&
@@ -4910,7 +5646,7 @@ static int set_evaluate(struct eval_ctx *ctx, struct set *set)
 				 type);
 
 	if (!set_is_anonymous(set->flags)) {
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 set->handle.table.name,
 					 set->handle.family);
 		if (table == NULL)
@@ -5134,7 +5870,7 @@ static int flowtable_evaluate(struct eval_ctx *ctx, struct flowtable *ft)
 {
 	struct table *table;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 ctx->cmd->handle.table.name,
 				 ctx->cmd->handle.family);
 	if (table == NULL)
@@ -5178,7 +5914,8 @@ static void link_rules(struct rule *src, struct rule *dst)
 
 	/* dst is not in kernel, make src reference it by per-transaction ID */
 	if (!dst->handle.rule_id)
-		dst->handle.rule_id = ++ref_id;
+		dst->handle.rule_id = __atomic_add_fetch(&ref_id, 1,
+							 __ATOMIC_RELAXED);
 	src->handle.position_id = dst->handle.rule_id;
 }
 
@@ -5188,7 +5925,7 @@ static int rule_cache_update(struct eval_ctx *ctx, enum cmd_ops op)
 	struct table *table;
 	struct chain *chain;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 rule->handle.table.name,
 				 rule->handle.family);
 	if (!table)
@@ -5282,12 +6019,98 @@ static int rule_evaluate(struct eval_ctx *ctx, struct rule *rule,
 		return -1;
 	}
 
-	if (nft_cache_needs_update(&ctx->nft->cache))
+	/* bulk replacements update the cache in rule_handles_evaluate() */
+	if (nft_cache_needs_update(ctx->nft->cache) && !ctx->cmd->handles)
 		return rule_cache_update(ctx, op);
 
 	return 0;
 }
 
+static int rule_handle_cmp(const void *p1, const void *p2)
+{
+	const struct expr *e1 = *(struct expr * const *)p1;
+	const struct expr *e2 = *(struct expr * const *)p2;
+
+	return mpz_cmp(e1->value, e2->value);
+}
+
+/*
+ * Check the handle list of a bulk delete, destroy or replace rule command
+ * against the rule index of the chain. Destroy drops the handles that do
+ * not exist instead.
+ */
+static int rule_handles_evaluate(struct eval_ctx *ctx, struct cmd *cmd)
+{
+	struct expr *i, *next, **sorted;
+	struct table *table;
+	struct chain *chain = NULL;
+	unsigned int n = 0, j;
+	struct rule *ref;
+	int err = 0;
+
+	table = table_cache_find(&ctx->nft->cache->table_cache,
+				 cmd->handle.table.name, cmd->handle.family);
+	if (table)
+		chain = chain_cache_find(table, cmd->handle.chain.name);
+
+	list_for_each_entry_safe(i, next, &cmd->handles->expressions, list) {
+		if (chain && rule_lookup(chain, mpz_get_uint64(i->value))) {
+			n++;
+			continue;
+		}
+
+		if (cmd->op != CMD_DESTROY) {
+			if (!table)
+				return table_not_found(ctx);
+			if (!chain)
+				return chain_not_found(ctx);
+
+			return expr_error(ctx->msgs, i,
+					  "Could not process rule: %s",
+					  strerror(ENOENT));
+		}
+
+		compound_expr_remove(cmd->handles, i);
+		expr_free(i);
+	}
+
+	if (!n)
+		return 0;
+
+	sorted = xmalloc_array(n, sizeof(*sorted));
+	j = 0;
+	list_for_each_entry(i, &cmd->handles->expressions, list)
+		sorted[j++] = i;
+
+	qsort(sorted, n, sizeof(*sorted), rule_handle_cmp);
+	for (j = 1; j < n; j++) {
+		if (!mpz_cmp(sorted[j - 1]->value, sorted[j]->value)) {
+			err = expr_error(ctx->msgs, sorted[j],
+					 "rule handle is listed twice");
+			break;
+		}
+	}
+	free(sorted);
+
+	if (err < 0 || !nft_cache_needs_update(ctx->nft->cache))
+		return err;
+
+	/* a rule is only linked once, in place of the first one it replaces */
+	list_for_each_entry(i, &cmd->handles->expressions, list) {
+		ref = rule_lookup(chain, mpz_get_uint64(i->value));
+		if (cmd->op == CMD_REPLACE &&
+		    i == list_first_entry(&cmd->handles->expressions,
+					  struct expr, list)) {
+			rule_get(cmd->rule);
+			list_add(&cmd->rule->list, &ref->list);
+		}
+		list_del(&ref->list);
+		rule_free(ref);
+	}
+
+	return 0;
+}
+
 static uint32_t str2hooknum(uint32_t family, const char *hook)
 {
 	if (!hook)
@@ -5338,7 +6161,7 @@ static int chain_evaluate(struct eval_ctx *ctx, struct chain *chain)
 {
 	struct table *table;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 ctx->cmd->handle.table.name,
 				 ctx->cmd->handle.family);
 	if (table == NULL)
@@ -5438,7 +6261,7 @@ static int obj_evaluate(struct eval_ctx *ctx, struct obj *obj)
 {
 	struct table *table;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 ctx->cmd->handle.table.name,
 				 ctx->cmd->handle.family);
 	if (!table)
@@ -5461,15 +6284,15 @@ static int obj_evaluate(struct eval_ctx *ctx, struct obj *obj)
 
 static int table_evaluate(struct eval_ctx *ctx, struct table *table)
 {
-	if (!table_cache_find(&ctx->nft->cache.table_cache,
+	if (!table_cache_find(&ctx->nft->cache->table_cache,
 			      ctx->cmd->handle.table.name,
 			      ctx->cmd->handle.family)) {
 		if (!table) {
 			table = table_alloc();
 			handle_merge(&table->handle, &ctx->cmd->handle);
-			table_cache_add(table, &ctx->nft->cache);
+			table_cache_add(table, ctx->nft->cache);
 		} else {
-			table_cache_add(table_get(table), &ctx->nft->cache);
+			table_cache_add(table_get(table), ctx->nft->cache);
 		}
 	}
 
@@ -5488,6 +6311,19 @@ static int cmd_evaluate_add(struct eval_ctx *ctx, struct cmd *cmd)
 		return elems_evaluate(ctx, cmd->set);
 	case CMD_OBJ_RULE:
 		handle_merge(&cmd->rule->handle, &cmd->handle);
+		if (cmd->handles) {
+			struct list_head *prev = cmd->list.prev;
+
+			if (rule_evaluate(ctx, cmd->rule, cmd->op) < 0)
+				return -1;
+			/* anonymous sets and chains can only be bound once */
+			if (cmd->list.prev != prev &&
+			    cmd->handles->size > 1)
+				return cmd_error(ctx, &cmd->location,
+						 "rule with anonymous sets or chains cannot replace several rules");
+
+			return rule_handles_evaluate(ctx, cmd);
+		}
 		return rule_evaluate(ctx, cmd->rule, cmd->op);
 	case CMD_OBJ_CHAIN:
 		return chain_evaluate(ctx, cmd->chain);
@@ -5518,7 +6354,7 @@ static void table_del_cache(struct eval_ctx *ctx, struct cmd *cmd)
 	if (!cmd->handle.table.name)
 		return;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 cmd->handle.table.name,
 				 cmd->handle.family);
 	if (!table)
@@ -5536,7 +6372,7 @@ static void chain_del_cache(struct eval_ctx *ctx, struct cmd *cmd)
 	if (!cmd->handle.chain.name)
 		return;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 cmd->handle.table.name,
 				 cmd->handle.family);
 	if (!table)
@@ -5558,7 +6394,7 @@ static void set_del_cache(struct eval_ctx *ctx, struct cmd *cmd)
 	if (!cmd->handle.set.name)
 		return;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 cmd->handle.table.name,
 				 cmd->handle.family);
 	if (!table)
@@ -5580,7 +6416,7 @@ static void ft_del_cache(struct eval_ctx *ctx, struct cmd *cmd)
 	if (!cmd->handle.flowtable.name)
 		return;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 cmd->handle.table.name,
 				 cmd->handle.family);
 	if (!table)
@@ -5602,7 +6438,7 @@ static void obj_del_cache(struct eval_ctx *ctx, struct cmd *cmd, int type)
 	if (!cmd->handle.obj.name)
 		return;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 cmd->handle.table.name,
 				 cmd->handle.family);
 	if (!table)
@@ -5625,6 +6461,8 @@ static int cmd_evaluate_delete(struct eval_ctx *ctx, struct cmd *cmd)
 		set_del_cache(ctx, cmd);
 		return 0;
 	case CMD_OBJ_RULE:
+		if (cmd->handles)
+			return rule_handles_evaluate(ctx, cmd);
 		return 0;
 	case CMD_OBJ_CHAIN:
 		chain_del_cache(ctx, cmd);
@@ -5680,7 +6518,7 @@ static int obj_not_found(struct eval_ctx *ctx, const struct location *loc,
 	const struct table *table;
 	struct obj *obj;
 
-	obj = obj_lookup_fuzzy(obj_name, &ctx->nft->cache, &table);
+	obj = obj_lookup_fuzzy(obj_name, ctx->nft->cache, &table);
 	if (obj == NULL)
 		return cmd_error(ctx, loc, "%s", strerror(ENOENT));
 
@@ -5699,7 +6537,7 @@ static int cmd_evaluate_list_obj(struct eval_ctx *ctx, const struct cmd *cmd,
 	if (obj_type == NFT_OBJECT_UNSPEC)
 		obj_type = NFT_OBJECT_COUNTER;
 
-	table = table_cache_find(&ctx->nft->cache.table_cache,
+	table = table_cache_find(&ctx->nft->cache->table_cache,
 				 cmd->handle.table.name,
 				 cmd->handle.family);
 	if (table == NULL)
@@ -5714,6 +6552,7 @@ static int cmd_evaluate_list_obj(struct eval_ctx *ctx, const struct cmd *cmd,
 
 static int cmd_evaluate_list(struct eval_ctx *ctx, struct cmd *cmd)
 {
+	const struct set_window *window;
 	struct flowtable *ft;
 	struct table *table;
 	struct set *set;
@@ -5723,7 +6562,7 @@ static int cmd_evaluate_list(struct eval_ctx *ctx, struct cmd *cmd)
 		if (cmd->handle.table.name == NULL)
 			return 0;
 
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 		if (!table)
@@ -5733,7 +6572,7 @@ static int cmd_evaluate_list(struct eval_ctx *ctx, struct cmd *cmd)
 	case CMD_OBJ_SET:
 	case CMD_OBJ_MAP:
 	case CMD_OBJ_METER:
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 		if (!table)
@@ -5749,10 +6588,16 @@ static int cmd_evaluate_list(struct eval_ctx *ctx, struct cmd *cmd)
 			return cmd_error(ctx, &ctx->cmd->handle.set.location,
 					 "%s", strerror(ENOENT));
 
+		window = cmd->arg;
+		/* ranges would lose their order once decomposed */
+		if (window && window->top && set->flags & NFT_SET_INTERVAL)
+			return cmd_error(ctx, &cmd->location,
+					 "top is not supported for interval sets");
+
 		cmd->set = set_get(set);
 		return 0;
 	case CMD_OBJ_CHAIN:
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 		if (!table)
@@ -5763,7 +6608,7 @@ static int cmd_evaluate_list(struct eval_ctx *ctx, struct cmd *cmd)
 
 		return 0;
 	case CMD_OBJ_FLOWTABLE:
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 		if (!table)
@@ -5803,14 +6648,19 @@ static int cmd_evaluate_list(struct eval_ctx *ctx, struct cmd *cmd)
 	case CMD_OBJ_CT_EXPECTATIONS:
 		if (cmd->handle.table.name == NULL)
 			return 0;
-		if (!table_cache_find(&ctx->nft->cache.table_cache,
+		if (!table_cache_find(&ctx->nft->cache->table_cache,
 				      cmd->handle.table.name,
 				      cmd->handle.family))
 			return table_not_found(ctx);
 
 		return 0;
-	case CMD_OBJ_CHAINS:
 	case CMD_OBJ_RULESET:
+		/* the journal holds commands, see nft_journal_add() */
+		if (cmd->arg && nft_output_json(&ctx->nft->output))
+			return cmd_error(ctx, &cmd->location,
+					 "since is only supported in native format");
+		return 0;
+	case CMD_OBJ_CHAINS:
 	case CMD_OBJ_METERS:
 	case CMD_OBJ_MAPS:
 		return 0;
@@ -5840,7 +6690,7 @@ static int cmd_evaluate_reset(struct eval_ctx *ctx, struct cmd *cmd)
 	case CMD_OBJ_RULE:
 		if (cmd->handle.table.name == NULL)
 			return 0;
-		if (!table_cache_find(&ctx->nft->cache.table_cache,
+		if (!table_cache_find(&ctx->nft->cache->table_cache,
 				      cmd->handle.table.name,
 				      cmd->handle.family))
 			return table_not_found(ctx);
@@ -5861,6 +6711,7 @@ static int cmd_evaluate_reset(struct eval_ctx *ctx, struct cmd *cmd)
 static void __flush_set_cache(struct set *set)
 {
 	if (set->init != NULL) {
+		interval_index_invalidate(set);
 		expr_free(set->init);
 		set->init = NULL;
 	}
@@ -5868,7 +6719,7 @@ static void __flush_set_cache(struct set *set)
 
 static int cmd_evaluate_flush(struct eval_ctx *ctx, struct cmd *cmd)
 {
-	struct cache *table_cache = &ctx->nft->cache.table_cache;
+	struct cache *table_cache = &ctx->nft->cache->table_cache;
 	struct table *table;
 	struct set *set;
 
@@ -5945,7 +6796,7 @@ static int cmd_evaluate_rename(struct eval_ctx *ctx, struct cmd *cmd)
 
 	switch (cmd->obj) {
 	case CMD_OBJ_CHAIN:
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 		if (!table)
@@ -5994,6 +6845,12 @@ static uint32_t monitor_flags[CMD_MONITOR_EVENT_MAX][CMD_MONITOR_OBJ_MAX] = {
 						  (1 << NFT_MSG_NEWOBJ)	  |
 						  (1 << NFT_MSG_DELOBJ),
 		[CMD_MONITOR_OBJ_TRACE]		= (1 << NFT_MSG_TRACE),
+		[CMD_MONITOR_OBJ_REPLICATE]	= (1 << NFT_MSG_NEWSET)   |
+						  (1 << NFT_MSG_DELSET)	  |
+						  (1 << NFT_MSG_NEWSETELEM) |
+						  (1 << NFT_MSG_DELSETELEM) |
+						  (1 << NFT_MSG_NEWOBJ)	  |
+						  (1 << NFT_MSG_DELOBJ),
 	},
 	[CMD_MONITOR_EVENT_NEW] = {
 		[CMD_MONITOR_OBJ_ANY]		= (1 << NFT_MSG_NEWTABLE) |
@@ -6050,10 +6907,48 @@ static int cmd_evaluate_monitor(struct eval_ctx *ctx, struct cmd *cmd)
 				     cmd->monitor->event);
 	}
 
+	if (cmd->monitor->type == CMD_MONITOR_OBJ_REPLICATE) {
+		if (event != CMD_MONITOR_EVENT_ANY)
+			return monitor_error(ctx, cmd->monitor,
+					     "replicate streams both new and destroyed objects");
+		if (cmd->monitor->format != NFTNL_OUTPUT_DEFAULT ||
+		    nft_output_json(&ctx->nft->output))
+			return monitor_error(ctx, cmd->monitor,
+					     "replicate is only supported in native format");
+	}
+
+	if (cmd->monitor->aggregate) {
+		if (cmd->monitor->type != CMD_MONITOR_OBJ_TRACE &&
+		    cmd->monitor->type != CMD_MONITOR_OBJ_ELEMS)
+			return monitor_error(ctx, cmd->monitor,
+					     "aggregate is only supported for trace and elements");
+		if (cmd->monitor->aggregate < 1000)
+			return monitor_error(ctx, cmd->monitor,
+					     "aggregate interval must be at least one second");
+	}
+
 	cmd->monitor->flags = monitor_flags[event][cmd->monitor->type];
 	return 0;
 }
 
+static int cmd_evaluate_profile(struct eval_ctx *ctx, struct cmd *cmd)
+{
+	const struct table *table;
+
+	if (cmd->handle.table.name == NULL)
+		return 0;
+
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list,
+			    cache.list) {
+		if ((cmd->handle.family == NFPROTO_UNSPEC ||
+		     cmd->handle.family == table->handle.family) &&
+		    !strcmp(cmd->handle.table.name, table->handle.table.name))
+			return 0;
+	}
+
+	return table_not_found(ctx);
+}
+
 static int cmd_evaluate_export(struct eval_ctx *ctx, struct cmd *cmd)
 {
 	if (cmd->markup->format == __NFT_OUTPUT_NOTSUPP)
@@ -6090,6 +6985,7 @@ static const char * const cmd_op_name[] = {
 	[CMD_MONITOR]	= "monitor",
 	[CMD_DESCRIBE]	= "describe",
 	[CMD_DESTROY]   = "destroy",
+	[CMD_PROFILE]	= "profile",
 };
 
 static const char *cmd_op_to_name(enum cmd_ops op)
@@ -6142,6 +7038,8 @@ int cmd_evaluate(struct eval_ctx *ctx, struct cmd *cmd)
 		return cmd_evaluate_monitor(ctx, cmd);
 	case CMD_IMPORT:
 		return cmd_evaluate_import(ctx, cmd);
+	case CMD_PROFILE:
+		return cmd_evaluate_profile(ctx, cmd);
 	default:
 		BUG("invalid command operation %u\n", cmd->op);
 	};
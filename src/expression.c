@@ -37,13 +37,24 @@ extern const struct expr_ops rt_expr_ops;
 extern const struct expr_ops socket_expr_ops;
 extern const struct expr_ops xfrm_expr_ops;
 
+/* Expressions are allocated and released in large numbers while parsing,
+ * evaluating and listing, so released nodes are recycled. Per thread, a
+ * context may be used from any thread.
+ */
+static __thread struct node_cache expr_node_cache;
+
+void expr_node_cache_release(void)
+{
+	node_cache_release(&expr_node_cache);
+}
+
 struct expr *expr_alloc(const struct location *loc, enum expr_types etype,
 			const struct datatype *dtype, enum byteorder byteorder,
 			unsigned int len)
 {
 	struct expr *expr;
 
-	expr = xzalloc(sizeof(*expr));
+	expr = node_cache_zalloc(&expr_node_cache, sizeof(*expr));
 	expr->location  = *loc;
 	expr->dtype	= datatype_get(dtype);
 	expr->etype	= etype;
@@ -94,7 +105,7 @@ void expr_free(struct expr *expr)
 	 */
 	if (expr->etype != EXPR_INVALID)
 		expr_destroy(expr);
-	free(expr);
+	node_cache_free(&expr_node_cache, expr);
 }
 
 void expr_print(const struct expr *expr, struct output_ctx *octx)
@@ -110,6 +121,8 @@ bool expr_cmp(const struct expr *e1, const struct expr *e2)
 	assert(e1->flags & EXPR_F_SINGLETON);
 	assert(e2->flags & EXPR_F_SINGLETON);
 
+	if (e1 == e2)
+		return true;
 	if (e1->etype != e2->etype)
 		return false;
 
@@ -303,6 +316,8 @@ static void symbol_expr_clone(struct expr *new, const struct expr *expr)
 	new->symtype	= expr->symtype;
 	new->scope      = expr->scope;
 	new->identifier = xstrdup(expr->identifier);
+	new->littype	= expr->littype;
+	new->literal	= expr->literal;
 }
 
 static void symbol_expr_destroy(struct expr *expr)
@@ -332,6 +347,13 @@ struct expr *symbol_expr_alloc(const struct location *loc,
 	return expr;
 }
 
+void symbol_expr_set_literal(struct expr *expr, enum symbol_literal_types type,
+			     const union symbol_literal *literal)
+{
+	expr->littype = type;
+	expr->literal = *literal;
+}
+
 static void variable_expr_print(const struct expr *expr,
 				struct output_ctx *octx)
 {
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Skipping unchanged reloads, enabled by --if-changed. The file has to
+ * start with flush ruleset, so every table that it declares is created
+ * again by the batch. The batch is hashed and the hash is stored in the
+ * userdata of these tables. If a later batch hashes the same, and the
+ * tables of the flushed families are exactly the ones that the file
+ * declares, all of them with that hash, the batch is not sent.
+ *
+ * The hash covers the batch with zeroed fingerprints, which is the same
+ * for the same evaluated commands. Changes to the ruleset that do not go
+ * through --if-changed are only noticed if they add or delete tables.
+ */
+
+#include <nft.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/batch.h>
+#include <libnftnl/table.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+
+#include <erec.h>
+#include <fingerprint.h>
+#include <mnl.h>
+#include <netlink.h>
+#include <rule.h>
+#include <utils.h>
+
+#define FINGERPRINT_HASH_INIT	0xcbf29ce484222325ULL
+#define FINGERPRINT_HASH_PRIME	0x100000001b3ULL
+
+int nft_fingerprint_prepare(struct nft_ctx *nft, struct list_head *msgs,
+			    const struct list_head *cmds)
+{
+	const struct cmd *cmd;
+
+	nft->fingerprint_flushed = 0;
+
+	if (nft_input_diff(&nft->input)) {
+		erec_queue(error(&internal_location,
+				 "--if-changed cannot be combined with --diff"),
+			   msgs);
+		return -1;
+	}
+
+	list_for_each_entry(cmd, cmds, list) {
+		if (cmd->op != CMD_FLUSH || cmd->obj != CMD_OBJ_RULESET)
+			break;
+
+		if (cmd->handle.family == NFPROTO_UNSPEC)
+			nft->fingerprint_flushed = NFT_FINGERPRINT_ALL_FAMILIES;
+		else
+			nft->fingerprint_flushed |= 1U << cmd->handle.family;
+	}
+
+	if (!nft->fingerprint_flushed) {
+		erec_queue(error(&internal_location,
+				 "--if-changed needs a file that starts with flush ruleset"),
+			   msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool fingerprint_flushed(const struct nft_ctx *nft, uint32_t family)
+{
+	return family < 32 && nft->fingerprint_flushed & (1U << family);
+}
+
+static int fingerprint_udata_cb(const struct nftnl_udata *attr, void *data)
+{
+	const struct nftnl_udata **ud = data;
+
+	if (nftnl_udata_type(attr) == NFT_UDATA_TABLE_FINGERPRINT &&
+	    nftnl_udata_len(attr) == sizeof(uint64_t))
+		*ud = attr;
+
+	return 0;
+}
+
+/* Record where the placeholder ended up in the batch, to fill it in once
+ * the whole batch is built.
+ */
+void nft_fingerprint_add_table(struct nft_fingerprint *fp,
+			       struct nlmsghdr *nlh)
+{
+	const struct nftnl_udata *ud = NULL;
+	struct nlattr *attr;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		if (mnl_attr_get_type(attr) != NFTA_TABLE_USERDATA)
+			continue;
+
+		nftnl_udata_parse(mnl_attr_get_payload(attr),
+				  mnl_attr_get_payload_len(attr),
+				  fingerprint_udata_cb, &ud);
+	}
+	if (!ud)
+		return;
+
+	if (fp->num == fp->size) {
+		fp->size = fp->size ? fp->size * 2 : 8;
+		fp->values = xrealloc(fp->values,
+				      fp->size * sizeof(*fp->values));
+	}
+	fp->values[fp->num++] = nftnl_udata_get(ud);
+}
+
+void nft_fingerprint_free(struct nft_fingerprint *fp)
+{
+	free(fp->values);
+	fp->values = NULL;
+	fp->num = fp->size = 0;
+}
+
+static uint64_t fingerprint_hash(struct mnl_batch *batch)
+{
+	uint64_t hash = FINGERPRINT_HASH_INIT;
+	unsigned int iov_len, i;
+	struct iovec *iov;
+	const uint8_t *p;
+	size_t j;
+
+	iov_len = mnl_batch_iovec_len(batch);
+	iov = xmalloc(iov_len * sizeof(*iov));
+	mnl_batch_iovec(batch, iov, iov_len);
+
+	for (i = 0; i < iov_len; i++) {
+		p = iov[i].iov_base;
+		for (j = 0; j < iov[i].iov_len; j++) {
+			hash ^= p[j];
+			hash *= FINGERPRINT_HASH_PRIME;
+		}
+	}
+	free(iov);
+
+	return hash;
+}
+
+struct fingerprint_table {
+	uint32_t	family;
+	const char	*name;
+};
+
+struct fingerprint_match {
+	struct netlink_ctx		*ctx;
+	const struct fingerprint_table	*tables;
+	unsigned int			num_tables;
+	unsigned int			found;
+	uint64_t			hash;
+	bool				match;
+};
+
+static int fingerprint_table_cb(struct nftnl_table *nlt, void *arg)
+{
+	struct fingerprint_match *m = arg;
+	struct table *table;
+	unsigned int i;
+
+	if (!m->match ||
+	    !fingerprint_flushed(m->ctx->nft,
+				 nftnl_table_get_u32(nlt, NFTNL_TABLE_FAMILY)))
+		return 0;
+
+	table = netlink_delinearize_table(m->ctx, nlt);
+	if (!table || table->fingerprint != m->hash) {
+		m->match = false;
+		goto out;
+	}
+
+	for (i = 0; i < m->num_tables; i++) {
+		if (m->tables[i].family == table->handle.family &&
+		    !strcmp(m->tables[i].name, table->handle.table.name))
+			break;
+	}
+	/* a table that the flush would delete */
+	if (i == m->num_tables)
+		m->match = false;
+	else
+		m->found++;
+out:
+	if (table)
+		table_free(table);
+
+	return 0;
+}
+
+static bool fingerprint_match(struct netlink_ctx *ctx,
+			      const struct list_head *cmds, uint64_t hash)
+{
+	struct fingerprint_match m = {
+		.ctx	= ctx,
+		.hash	= hash,
+		.match	= true,
+	};
+	struct fingerprint_table *tables = NULL;
+	struct nftnl_table_list *nlt_list;
+	unsigned int num = 0, size = 0, i;
+	const struct cmd *cmd;
+
+	list_for_each_entry(cmd, cmds, list) {
+		if ((cmd->op != CMD_ADD && cmd->op != CMD_CREATE) ||
+		    cmd->obj != CMD_OBJ_TABLE)
+			continue;
+
+		/* tables that are not flushed keep their userdata */
+		if (!fingerprint_flushed(ctx->nft, cmd->handle.family)) {
+			m.match = false;
+			goto out;
+		}
+
+		for (i = 0; i < num; i++) {
+			if (tables[i].family == cmd->handle.family &&
+			    !strcmp(tables[i].name, cmd->handle.table.name))
+				break;
+		}
+		if (i < num)
+			continue;
+
+		if (num == size) {
+			size = size ? size * 2 : 8;
+			tables = xrealloc(tables, size * sizeof(*tables));
+		}
+		tables[num].family = cmd->handle.family;
+		tables[num].name = cmd->handle.table.name;
+		num++;
+	}
+
+	/* nothing would record the fingerprint */
+	if (num == 0) {
+		m.match = false;
+		goto out;
+	}
+
+	nlt_list = mnl_nft_table_dump(ctx, NFPROTO_UNSPEC, NULL);
+	if (!nlt_list) {
+		m.match = false;
+		goto out;
+	}
+
+	m.tables = tables;
+	m.num_tables = num;
+	nftnl_table_list_foreach(nlt_list, fingerprint_table_cb, &m);
+	nftnl_table_list_free(nlt_list);
+
+	if (m.found != num)
+		m.match = false;
+out:
+	free(tables);
+
+	return m.match;
+}
+
+/* Returns true if the tables in the kernel were loaded from the same batch,
+ * otherwise fills in the fingerprint of the batch before it is sent.
+ */
+bool nft_fingerprint_check(struct netlink_ctx *ctx,
+			   const struct list_head *cmds)
+{
+	struct nft_fingerprint *fp = ctx->fingerprint;
+	uint64_t hash, value;
+	unsigned int i;
+	bool match;
+
+	hash = fingerprint_hash(ctx->batch);
+	match = fingerprint_match(ctx, cmds, hash);
+
+	if (ctx->nft->debug_mask & NFT_DEBUG_EVALUATION)
+		nft_print(&ctx->nft->output, "Fingerprint %016" PRIx64 ": %s\n",
+			  hash, match ? "unchanged, batch not sent" : "changed");
+
+	if (match)
+		return true;
+
+	value = htobe64(hash);
+	for (i = 0; i < fp->num; i++)
+		memcpy(fp->values[i], &value, sizeof(value));
+
+	return false;
+}
@@ -14,13 +14,35 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <arpa/inet.h>
 
 #include <nftables.h>
 #include <datatype.h>
 #include <utils.h>
 
+/*
+ * Most values are keys of up to 64 bits. When a value fits into an unsigned
+ * long, it is read and written through mpz_get_ui()/mpz_set_ui() rather than
+ * going through the generic mpz_export()/mpz_import() word conversion.
+ */
+#define MPZ_ULONG_BITS	(sizeof(unsigned long) * CHAR_BIT)
+
+/*
+ * Data import and export assemble values of up to two limbs, which covers
+ * IPv6 addresses and the 128-bit components of concatenated keys, byte by
+ * byte straight into the limb array.
+ */
+#define MPZ_SMALL_LIMBS	2
+#define MPZ_SMALL_BYTES	(MPZ_SMALL_LIMBS * sizeof(mp_limb_t))
+
 void mpz_bitmask(mpz_t rop, unsigned int width)
 {
+	if (width < MPZ_ULONG_BITS) {
+		mpz_set_ui(rop, (1UL << width) - 1);
+		return;
+	}
+
 	mpz_set_ui(rop, 0);
 	mpz_setbit(rop, width);
 	mpz_sub_ui(rop, rop, 1);
@@ -52,8 +74,16 @@ void mpz_rshift_ui(mpz_t rop, unsigned int n)
 ({									\
  	type ret = 0;							\
 	size_t cnt;							\
-	mpz_export(&ret, &cnt, MPZ_LSWF, sizeof(ret), endian, 0, op);	\
-	assert(cnt <= 1);						\
+	if (sizeof(type) <= sizeof(unsigned long) &&			\
+	    mpz_fits_ulong_p(op)) {					\
+		unsigned long val = mpz_get_ui(op);			\
+		ret = val;						\
+		assert(ret == val);					\
+	} else {							\
+		mpz_export(&ret, &cnt, MPZ_LSWF, sizeof(ret), endian,	\
+			   0, op);					\
+		assert(cnt <= 1);					\
+	}								\
  	ret;								\
  })
 
@@ -79,12 +109,63 @@ uint8_t mpz_get_uint8(const mpz_t op)
 
 uint32_t mpz_get_be32(const mpz_t op)
 {
-	return mpz_get_type(uint32_t, MPZ_BIG_ENDIAN, op);
+	return htonl(mpz_get_uint32(op));
 }
 
 uint16_t mpz_get_be16(const mpz_t op)
 {
-	return mpz_get_type(uint16_t, MPZ_BIG_ENDIAN, op);
+	return htons(mpz_get_uint16(op));
+}
+
+static bool byteorder_msb_first(enum byteorder byteorder)
+{
+	if (byteorder == BYTEORDER_HOST_ENDIAN)
+		return MPZ_HWO == MPZ_MSWF;
+
+	return true;
+}
+
+static bool mpz_export_small(uint8_t *data, const mpz_t op,
+			     enum byteorder byteorder, unsigned int len)
+{
+	bool msb_first = byteorder_msb_first(byteorder);
+	mp_limb_t limb = 0;
+	unsigned int i;
+
+	if (len == 0 || len > MPZ_SMALL_BYTES || mpz_sgn(op) < 0 ||
+	    mpz_sizeinbase(op, 2) > len * CHAR_BIT)
+		return false;
+
+	for (i = 0; i < len; i++) {
+		if (i % sizeof(limb) == 0)
+			limb = mpz_getlimbn(op, i / sizeof(limb));
+
+		data[msb_first ? len - 1 - i : i] = limb;
+		limb >>= CHAR_BIT;
+	}
+
+	return true;
+}
+
+static bool mpz_import_small(mpz_t rop, const uint8_t *data,
+			     enum byteorder byteorder, unsigned int len)
+{
+	bool msb_first = byteorder_msb_first(byteorder);
+	mp_limb_t limbs[MPZ_SMALL_LIMBS] = {};
+	unsigned int i, n;
+
+	if (len == 0 || len > MPZ_SMALL_BYTES)
+		return false;
+
+	for (i = 0; i < len; i++)
+		limbs[i / sizeof(mp_limb_t)] |=
+			(mp_limb_t)data[msb_first ? len - 1 - i : i] <<
+			(i % sizeof(mp_limb_t) * CHAR_BIT);
+
+	n = div_round_up(len, sizeof(mp_limb_t));
+	memcpy(mpz_limbs_write(rop, n), limbs, n * sizeof(mp_limb_t));
+	mpz_limbs_finish(rop, n);
+	return true;
 }
 
 void *__mpz_export_data(void *data, const mpz_t op, enum byteorder byteorder,
@@ -105,6 +186,9 @@ void *__mpz_export_data(void *data, const mpz_t op, enum byteorder byteorder,
 		break;
 	}
 
+	if (mpz_export_small(data, op, byteorder, len))
+		return data;
+
 	memset(data, 0, len);
 	mpz_export(data, NULL, order, len, endian, 0, op);
 	return data;
@@ -128,6 +212,9 @@ void __mpz_import_data(mpz_t rop, const void *data, enum byteorder byteorder,
 		break;
 	}
 
+	if (mpz_import_small(rop, data, byteorder, len))
+		return;
+
 	mpz_import(rop, len, order, 1, endian, 0, data);
 }
 
@@ -15,6 +15,8 @@
 #include <datatype.h>
 #include <gmputil.h>
 #include <hash.h>
+#include <netlink.h>
+#include <rule.h>
 #include <utils.h>
 
 static void hash_expr_print(const struct expr *expr, struct output_ctx *octx)
@@ -163,3 +165,160 @@ struct expr *hash_expr_alloc(const struct location *loc,
 
 	return expr;
 }
+
+/*
+ * Maglev lookup tables, see "Maglev: A Fast and Reliable Software Network
+ * Load Balancer" (NSDI '16). Each backend walks the slots of the table in
+ * its own order, derived from the hash of its value, and the backends take
+ * turns to claim their next free slot, as many per turn as their weight.
+ * Adding or removing a backend only moves a few slots of the others, so the
+ * table can be updated with a small element diff.
+ *
+ * The order of the backends in the input does not matter, they are sorted
+ * by value first. The table size must be prime so that every walk visits
+ * all the slots.
+ */
+struct maglev_backend {
+	const struct expr		*expr;
+	uint32_t			weight;
+	uint32_t			next;
+	uint32_t			skip;
+	struct nft_data_linearize	nld;
+};
+
+#define MAGLEV_SEED_OFFSET	0x811c9dc5
+#define MAGLEV_SEED_SKIP	0x9e3779b9
+
+static uint32_t maglev_hash(const struct nft_data_linearize *nld,
+			    uint32_t seed)
+{
+	const uint8_t *data = (const uint8_t *)nld->value;
+	uint32_t hash = seed;
+	unsigned int i;
+
+	for (i = 0; i < nld->len; i++) {
+		hash ^= data[i];
+		hash *= 0x01000193;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static int maglev_backend_cmp(const void *p1, const void *p2)
+{
+	const struct maglev_backend *b1 = p1, *b2 = p2;
+
+	if (b1->nld.len != b2->nld.len)
+		return b1->nld.len < b2->nld.len ? -1 : 1;
+
+	return memcmp(b1->nld.value, b2->nld.value, b1->nld.len);
+}
+
+bool maglev_size_valid(uint64_t size)
+{
+	uint64_t i;
+
+	if (size < 2 || size > MAGLEV_SIZE_MAX)
+		return false;
+
+	for (i = 2; i * i <= size; i++) {
+		if (size % i == 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the elements of @set, one per slot, that map to the backends
+ * listed in @backends: evaluated values or mappings from value to weight.
+ * If a backend is listed twice, *@dup is set to it and NULL is returned.
+ */
+struct expr *maglev_table_alloc(const struct set *set,
+				const struct expr *backends,
+				const struct expr **dup)
+{
+	const struct location *loc = &backends->location;
+	uint32_t size = set->maglev.size, filled = 0, slot, w;
+	struct expr *init, *key, *elem;
+	struct maglev_backend *b;
+	unsigned int i, num = 0;
+	const struct expr *e;
+	uint32_t *table;
+
+	list_for_each_entry(e, &backends->expressions, list)
+		num++;
+
+	b = xzalloc_array(num, sizeof(*b));
+
+	i = 0;
+	list_for_each_entry(e, &backends->expressions, list) {
+		if (e->etype == EXPR_MAPPING) {
+			b[i].expr = e->left->key;
+			b[i].weight = mpz_get_uint32(e->right->value);
+		} else {
+			b[i].expr = e->key;
+			b[i].weight = 1;
+		}
+		netlink_gen_data(b[i].expr, &b[i].nld);
+		i++;
+	}
+
+	qsort(b, num, sizeof(*b), maglev_backend_cmp);
+
+	for (i = 1; i < num; i++) {
+		if (!maglev_backend_cmp(&b[i - 1], &b[i])) {
+			*dup = b[i].expr;
+			free(b);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		b[i].next = maglev_hash(&b[i].nld, MAGLEV_SEED_OFFSET) % size;
+		b[i].skip = maglev_hash(&b[i].nld, MAGLEV_SEED_SKIP) %
+			    (size - 1) + 1;
+	}
+
+	table = xmalloc_array(size, sizeof(*table));
+	memset(table, 0xff, size * sizeof(*table));
+
+	/* the caller makes sure that at least one backend has a weight */
+	while (filled < size) {
+		for (i = 0; i < num && filled < size; i++) {
+			for (w = 0; w < b[i].weight && filled < size; w++) {
+				do {
+					slot = b[i].next;
+					b[i].next = (b[i].next + b[i].skip) %
+						    size;
+				} while (table[slot] != UINT32_MAX);
+
+				table[slot] = i;
+				filled++;
+			}
+		}
+	}
+
+	init = set_expr_alloc(loc, set);
+	for (slot = 0; slot < size; slot++) {
+		key = constant_expr_alloc(loc, set->key->dtype,
+					  set->key->byteorder, set->key->len,
+					  NULL);
+		mpz_set_ui(key->value, slot);
+		elem = set_elem_expr_alloc(loc, key);
+		compound_expr_add(init,
+				  mapping_expr_alloc(loc, elem,
+						     expr_clone(b[table[slot]].expr)));
+	}
+
+	free(table);
+	free(b);
+
+	return init;
+}
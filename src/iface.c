@@ -10,19 +10,148 @@
 
 #include <stdio.h>
 #include <net/if.h>
-#include <time.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
 
 #include <nftables.h>
 #include <list.h>
+#include <cache.h>
 #include <netlink.h>
 #include <iface.h>
 
-static LIST_HEAD(iface_list);
-static bool iface_cache_init;
+/* Single link replies and notifications, room for devices with many VFs. */
+#define IFACE_NLMSG_MAXSIZE	32768
+
+/*
+ * Interfaces are resolved one at a time, the first lookup of a name or an
+ * index requests that link from the kernel. Misses are cached too, as entries
+ * without index or without name. Only listing all interfaces dumps the
+ * complete list of links.
+ */
+static struct cache iface_name_cache;
+static struct cache iface_index_cache;
+static bool iface_cache_ready;
+/* all links are in the cache, a miss is final. */
+static bool iface_cache_complete;
+static struct mnl_socket *iface_nl;
+static uint32_t iface_seq;
+/* Contexts in persistent cache mode keep the cache across runs, link
+ * notifications keep it up to date.
+ */
+static struct mnl_socket *iface_ev_sock;
+static unsigned int iface_cache_users;
+/* Lookups from listing sessions that run in several threads. */
+static pthread_mutex_t iface_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t iface_index_hash(uint32_t ifindex)
+{
+	return ifindex * 2654435761U;
+}
+
+static void iface_cache_setup(void)
+{
+	if (iface_cache_ready)
+		return;
+
+	cache_init(&iface_name_cache);
+	cache_init(&iface_index_cache);
+	iface_cache_ready = true;
+}
+
+static struct iface *iface_lookup_name(const char *name)
+{
+	struct iface *iface;
+	uint32_t hash;
+
+	hash = djb_hash(name);
+	list_for_each_entry(iface, cache_bucket(&iface_name_cache, hash),
+			    name_cache.hlist) {
+		if (iface->name_cache.hash == hash &&
+		    !strcmp(iface->name, name))
+			return iface;
+	}
+
+	return NULL;
+}
+
+static struct iface *iface_lookup_index(uint32_t ifindex)
+{
+	struct iface *iface;
+	uint32_t hash;
+
+	hash = iface_index_hash(ifindex);
+	list_for_each_entry(iface, cache_bucket(&iface_index_cache, hash),
+			    index_cache.hlist) {
+		if (iface->ifindex == ifindex)
+			return iface;
+	}
+
+	return NULL;
+}
+
+static void iface_free(struct iface *iface)
+{
+	if (iface->name[0])
+		cache_del(&iface->name_cache);
+	if (iface->ifindex)
+		cache_del(&iface->index_cache);
+	free(iface);
+}
+
+/* Either argument may be unset to record a miss. */
+static struct iface *iface_add(const char *name, uint32_t ifindex)
+{
+	struct iface *iface;
+
+	iface = xzalloc(sizeof(struct iface));
+	snprintf(iface->name, IFNAMSIZ, "%s", name);
+	iface->ifindex = ifindex;
+
+	if (iface->name[0])
+		cache_add(&iface->name_cache, &iface_name_cache,
+			  djb_hash(iface->name));
+	if (iface->ifindex)
+		cache_add(&iface->index_cache, &iface_index_cache,
+			  iface_index_hash(iface->ifindex));
+
+	return iface;
+}
+
+/* Drop anything known about this name and index, including misses. */
+static void iface_forget(const char *name, uint32_t ifindex)
+{
+	struct iface *iface;
+
+	iface = iface_lookup_index(ifindex);
+	if (iface)
+		iface_free(iface);
+
+	iface = iface_lookup_name(name);
+	if (iface)
+		iface_free(iface);
+}
+
+static void iface_cache_flush(void)
+{
+	struct iface *iface, *next;
+
+	if (!iface_cache_ready)
+		return;
+
+	list_for_each_entry_safe(iface, next, &iface_name_cache.list,
+				 name_cache.list)
+		iface_free(iface);
+	/* misses by index are only in this one. */
+	list_for_each_entry_safe(iface, next, &iface_index_cache.list,
+				 index_cache.list)
+		iface_free(iface);
+
+	iface_cache_complete = false;
+}
 
 static int data_attr_cb(const struct nlattr *attr, void *data)
 {
@@ -44,43 +173,87 @@ static int data_attr_cb(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
-static int data_cb(const struct nlmsghdr *nlh, void *data)
+static const char *data_ifname(const struct nlmsghdr *nlh)
 {
 	struct nlattr *tb[IFLA_MAX + 1] = {};
 	struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
-	struct iface *iface;
 
-	iface = xmalloc(sizeof(struct iface));
-	iface->ifindex = ifm->ifi_index;
 	mnl_attr_parse(nlh, sizeof(*ifm), data_attr_cb, tb);
-	snprintf(iface->name, IFNAMSIZ, "%s", mnl_attr_get_str(tb[IFLA_IFNAME]));
-	list_add(&iface->list, &iface_list);
+	if (!tb[IFLA_IFNAME])
+		return NULL;
+
+	return mnl_attr_get_str(tb[IFLA_IFNAME]);
+}
+
+static int data_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	struct iface **iface = data;
+	const char *name;
+
+	name = data_ifname(nlh);
+	if (!name)
+		return MNL_CB_OK;
+
+	iface_forget(name, ifm->ifi_index);
+	*iface = iface_add(name, ifm->ifi_index);
 
 	return MNL_CB_OK;
 }
 
-static int iface_mnl_talk(struct mnl_socket *nl, uint32_t portid)
+static struct mnl_socket *iface_socket_open(unsigned int groups)
+{
+	struct mnl_socket *nl;
+
+	nl = mnl_socket_open(NETLINK_ROUTE);
+	if (nl == NULL)
+		netlink_init_error();
+
+	if (mnl_socket_bind(nl, groups, MNL_SOCKET_AUTOPID) < 0)
+		netlink_init_error();
+
+	return nl;
+}
+
+static struct mnl_socket *iface_socket(void)
+{
+	if (!iface_nl)
+		iface_nl = iface_socket_open(0);
+
+	return iface_nl;
+}
+
+static struct ifinfomsg *iface_request(struct nlmsghdr *nlh, uint16_t flags)
+{
+	struct ifinfomsg *ifm;
+
+	nlh->nlmsg_type	= RTM_GETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = ++iface_seq;
+	ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+	ifm->ifi_family = AF_PACKET;
+
+	return ifm;
+}
+
+static int iface_mnl_dump(struct mnl_socket *nl)
 {
+	uint32_t portid = mnl_socket_get_portid(nl);
 	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct iface *iface = NULL;
 	struct nlmsghdr *nlh;
-	struct rtgenmsg *rt;
 	bool eintr = false;
-	uint32_t seq;
 	int ret;
 
 	nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type	= RTM_GETLINK;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_seq = seq = time(NULL);
-	rt = mnl_nlmsg_put_extra_header(nlh, sizeof(struct rtgenmsg));
-	rt->rtgen_family = AF_PACKET;
+	iface_request(nlh, NLM_F_DUMP);
 
 	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
 		return -1;
 
 	ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
 	while (ret > 0) {
-		ret = mnl_cb_run(buf, ret, seq, portid, data_cb, NULL);
+		ret = mnl_cb_run(buf, ret, iface_seq, portid, data_cb, &iface);
 		if (ret == 0)
 			break;
 		if (ret < 0) {
@@ -101,90 +274,224 @@ static int iface_mnl_talk(struct mnl_socket *nl, uint32_t portid)
 	return ret;
 }
 
-void iface_cache_update(void)
+static void __iface_cache_update(void)
 {
-	struct mnl_socket *nl;
-	uint32_t portid;
+	struct mnl_socket *nl = iface_socket();
 	int ret;
 
-	nl = mnl_socket_open(NETLINK_ROUTE);
-	if (nl == NULL)
-		netlink_init_error();
+	iface_cache_flush();
 
-	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
+	do {
+		ret = iface_mnl_dump(nl);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == -1)
 		netlink_init_error();
 
-	portid = mnl_socket_get_portid(nl);
+	iface_cache_complete = true;
+}
+
+/* Request one link, by name or by index, a miss is cached as such. */
+static struct iface *iface_fetch(const char *name, uint32_t ifindex)
+{
+	struct mnl_socket *nl = iface_socket();
+	uint32_t portid = mnl_socket_get_portid(nl);
+	char buf[IFACE_NLMSG_MAXSIZE];
+	struct iface *iface = NULL;
+	struct ifinfomsg *ifm;
+	struct nlmsghdr *nlh;
+	int ret;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	ifm = iface_request(nlh, 0);
+	if (name)
+		mnl_attr_put_strz(nlh, IFLA_IFNAME, name);
+	else
+		ifm->ifi_index = ifindex;
+	mnl_attr_put_u32(nlh, IFLA_EXT_MASK, RTEXT_FILTER_SKIP_STATS);
+
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+		netlink_init_error();
 
 	do {
-		ret = iface_mnl_talk(nl, portid);
+		ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
 	} while (ret < 0 && errno == EINTR);
 
-	if (ret == -1)
+	if (ret > 0)
+		ret = mnl_cb_run(buf, ret, iface_seq, portid, data_cb, &iface);
+	if (ret < 0 && errno != ENODEV)
 		netlink_init_error();
 
-	mnl_socket_close(nl);
+	if (!iface)
+		iface = iface_add(name ? name : "", name ? 0 : ifindex);
 
-	iface_cache_init = true;
+	return iface;
 }
 
-void iface_cache_release(void)
+static int iface_event_cb(const struct nlmsghdr *nlh, void *data)
 {
-	struct iface *iface, *next;
+	struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	struct iface *iface;
+	const char *name;
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+		return data_cb(nlh, &iface);
+	case RTM_DELLINK:
+		name = data_ifname(nlh);
+		iface_forget(name ? name : "", ifm->ifi_index);
+		break;
+	}
 
-	if (!iface_cache_init)
+	return MNL_CB_OK;
+}
+
+/* Apply pending link notifications, start over if some were lost. */
+static void iface_cache_sync(void)
+{
+	char buf[IFACE_NLMSG_MAXSIZE];
+	int ret;
+
+	iface_cache_setup();
+	if (!iface_ev_sock)
 		return;
 
-	list_for_each_entry_safe(iface, next, &iface_list, list) {
-		list_del(&iface->list);
-		free(iface);
+	while (1) {
+		ret = mnl_socket_recvfrom(iface_ev_sock, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return;
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (mnl_cb_run(buf, ret, 0, 0, iface_event_cb, NULL) < 0)
+			break;
+	}
+
+	iface_cache_flush();
+}
+
+void iface_cache_update(void)
+{
+	pthread_mutex_lock(&iface_cache_lock);
+	iface_cache_sync();
+	__iface_cache_update();
+	pthread_mutex_unlock(&iface_cache_lock);
+}
+
+void iface_cache_release(void)
+{
+	pthread_mutex_lock(&iface_cache_lock);
+	if (iface_ev_sock)
+		goto out;
+
+	iface_cache_flush();
+	if (iface_nl) {
+		mnl_socket_close(iface_nl);
+		iface_nl = NULL;
+	}
+out:
+	pthread_mutex_unlock(&iface_cache_lock);
+}
+
+void iface_cache_hold(void)
+{
+	struct mnl_socket *nl;
+
+	pthread_mutex_lock(&iface_cache_lock);
+	if (iface_cache_users++ > 0)
+		goto out;
+
+	/* without notifications, the cache is released after each run. */
+	nl = iface_socket_open(RTMGRP_LINK);
+	if (fcntl(mnl_socket_get_fd(nl), F_SETFL, O_NONBLOCK)) {
+		mnl_socket_close(nl);
+		goto out;
+	}
+
+	/* entries from before the subscription might be stale. */
+	iface_cache_flush();
+	iface_ev_sock = nl;
+out:
+	pthread_mutex_unlock(&iface_cache_lock);
+}
+
+void iface_cache_put(void)
+{
+	pthread_mutex_lock(&iface_cache_lock);
+	if (--iface_cache_users == 0 && iface_ev_sock) {
+		mnl_socket_close(iface_ev_sock);
+		iface_ev_sock = NULL;
 	}
-	iface_cache_init = false;
+	pthread_mutex_unlock(&iface_cache_lock);
+
+	iface_cache_release();
 }
 
 unsigned int nft_if_nametoindex(const char *name)
 {
+	unsigned int ifindex = 0;
 	struct iface *iface;
 
-	if (!iface_cache_init)
-		iface_cache_update();
+	if (strlen(name) >= IFNAMSIZ)
+		return 0;
 
-	list_for_each_entry(iface, &iface_list, list) {
-		if (strncmp(name, iface->name, IFNAMSIZ) == 0)
-			return iface->ifindex;
-	}
-	return 0;
+	pthread_mutex_lock(&iface_cache_lock);
+	iface_cache_sync();
+
+	iface = iface_lookup_name(name);
+	if (!iface && !iface_cache_complete)
+		iface = iface_fetch(name, 0);
+	if (iface)
+		ifindex = iface->ifindex;
+	pthread_mutex_unlock(&iface_cache_lock);
+
+	return ifindex;
 }
 
 char *nft_if_indextoname(unsigned int ifindex, char *name)
 {
 	struct iface *iface;
+	char *ret = NULL;
 
-	if (!iface_cache_init)
-		iface_cache_update();
+	if (!ifindex)
+		return NULL;
 
-	list_for_each_entry(iface, &iface_list, list) {
-		if (iface->ifindex == ifindex) {
-			snprintf(name, IFNAMSIZ, "%s", iface->name);
-			return name;
-		}
+	pthread_mutex_lock(&iface_cache_lock);
+	iface_cache_sync();
+
+	iface = iface_lookup_index(ifindex);
+	if (!iface && !iface_cache_complete)
+		iface = iface_fetch(NULL, ifindex);
+	if (iface && iface->name[0]) {
+		snprintf(name, IFNAMSIZ, "%s", iface->name);
+		ret = name;
 	}
-	return NULL;
+	pthread_mutex_unlock(&iface_cache_lock);
+
+	return ret;
 }
 
+/* Walks the complete list of links, misses by name are skipped. */
 const struct iface *iface_cache_get_next_entry(const struct iface *prev)
 {
-	if (!iface_cache_init)
-		iface_cache_update();
+	const struct iface *iface = prev;
 
-	if (list_empty(&iface_list))
-		return NULL;
+	if (!iface_cache_complete)
+		iface_cache_update();
 
-	if (!prev)
-		return list_first_entry(&iface_list, struct iface, list);
+	do {
+		if (!iface)
+			iface = list_first_entry(&iface_name_cache.list,
+						 struct iface, name_cache.list);
+		else
+			iface = list_next_entry(iface, name_cache.list);
 
-	if (list_is_last(&prev->list, &iface_list))
-		return NULL;
+		if (&iface->name_cache.list == &iface_name_cache.list)
+			return NULL;
+	} while (!iface->ifindex);
 
-	return list_next_entry(prev, list);
+	return iface;
 }
@@ -69,6 +69,7 @@ struct set_automerge_ctx {
 	struct set	*set;
 	struct expr	*init;
 	struct expr	*purge;
+	unsigned int	keylen;
 	unsigned int	debug_mask;
 };
 
@@ -94,11 +95,297 @@ static void remove_overlapping_range(struct set_automerge_ctx *ctx,
 	ctx->init->size--;
 }
 
+static struct expr *interval_expr_key(struct expr *i)
+{
+	struct expr *elem;
+
+	switch (i->etype) {
+	case EXPR_MAPPING:
+		elem = i->left;
+		break;
+	case EXPR_SET_ELEM:
+		elem = i;
+		break;
+	default:
+		BUG("unhandled expression type %d\n", i->etype);
+		return NULL;
+	}
+
+	return elem;
+}
+
 struct range {
-	mpz_t	low;
-	mpz_t	high;
+	unsigned char	*low;
+	unsigned char	*high;
+};
+
+/*
+ * Interval boundaries are exported once per element into a flat array of
+ * big endian keys, so memcmp() follows the numeric order and the walks
+ * below do not need any GMP arithmetic.
+ */
+struct interval_key {
+	struct expr	*elem;
+	struct range	range;
+};
+
+struct interval_array {
+	struct interval_key	*key;
+	unsigned char		*data;
+	unsigned int		num;
+	unsigned int		len;
 };
 
+static void interval_array_init(struct interval_array *array,
+				const struct set *set,
+				const struct expr *init, bool catchall)
+{
+	struct interval_key *key;
+	struct expr *elem, *i;
+	unsigned int num = 0;
+	mpz_t low, high;
+
+	memset(array, 0, sizeof(*array));
+	array->len = div_round_up(set->key->len, BITS_PER_BYTE);
+
+	list_for_each_entry(elem, &init->expressions, list)
+		num++;
+	if (!num)
+		return;
+
+	array->key = xmalloc_array(num, sizeof(struct interval_key));
+	array->data = xmalloc_array(num, 2 * array->len);
+
+	mpz_init(low);
+	mpz_init(high);
+
+	list_for_each_entry(elem, &init->expressions, list) {
+		i = interval_expr_key(elem);
+
+		key = &array->key[array->num];
+		key->elem = elem;
+		key->range.low = array->data + array->num * 2 * array->len;
+		key->range.high = key->range.low + array->len;
+
+		if (i->key->etype == EXPR_SET_ELEM_CATCHALL) {
+			if (!catchall)
+				continue;
+
+			/* Assume max value to simplify handling. */
+			memset(key->range.low, 0xff, array->len);
+			memset(key->range.high, 0xff, array->len);
+		} else {
+			range_expr_value_low(low, i);
+			range_expr_value_high(high, i);
+			mpz_export_data(key->range.low, low,
+					BYTEORDER_BIG_ENDIAN, array->len);
+			mpz_export_data(key->range.high, high,
+					BYTEORDER_BIG_ENDIAN, array->len);
+		}
+		array->num++;
+	}
+
+	mpz_clear(low);
+	mpz_clear(high);
+}
+
+static void interval_array_free(struct interval_array *array)
+{
+	free(array->key);
+	free(array->data);
+}
+
+static int interval_key_cmp(const unsigned char *a, const unsigned char *b,
+			    unsigned int len)
+{
+	return memcmp(a, b, len);
+}
+
+/* Returns true if @low is @high + 1. */
+static bool interval_key_adjacent(const unsigned char *high,
+				  const unsigned char *low, unsigned int len)
+{
+	int i = len - 1;
+
+	while (i >= 0 && high[i] == 0xff && low[i] == 0)
+		i--;
+	if (i < 0 || low[i] != high[i] + 1)
+		return false;
+
+	return !memcmp(high, low, i);
+}
+
+static void interval_array_add(struct interval_array *array,
+			       struct expr *elem, const struct range *range)
+{
+	struct interval_key *key = &array->key[array->num];
+
+	key->elem = elem;
+	key->range.low = array->data + array->num * 2 * array->len;
+	key->range.high = key->range.low + array->len;
+	memcpy(key->range.low, range->low, array->len);
+	memcpy(key->range.high, range->high, array->len);
+	array->num++;
+}
+
+/*
+ * Sorted boundaries of the intervals in the cache of an existing set, so
+ * adding elements only needs to look up the neighbours of each new interval
+ * instead of sorting the whole set again. The index holds a reference on the
+ * set expression it was built from, it is rebuilt if set->init is replaced
+ * and dropped by any other update to the cached elements.
+ */
+struct interval_index {
+	struct expr		*init;
+	struct interval_array	array;
+};
+
+void interval_index_free(struct interval_index *index)
+{
+	if (!index)
+		return;
+
+	interval_array_free(&index->array);
+	expr_free(index->init);
+	free(index);
+}
+
+void interval_index_invalidate(struct set *set)
+{
+	interval_index_free(set->index);
+	set->index = NULL;
+}
+
+static bool interval_array_sorted(const struct interval_array *array)
+{
+	unsigned int k;
+
+	for (k = 1; k < array->num; k++) {
+		if (interval_key_cmp(array->key[k - 1].range.low,
+				     array->key[k].range.low, array->len) > 0)
+			return false;
+	}
+
+	return true;
+}
+
+static struct interval_index *interval_index_get(struct set *set)
+{
+	struct interval_index *index = set->index;
+
+	if (index && index->init == set->init)
+		return index;
+
+	interval_index_invalidate(set);
+
+	set_to_range(set->init);
+
+	index = xzalloc(sizeof(*index));
+	interval_array_init(&index->array, set, set->init, false);
+	if (!interval_array_sorted(&index->array)) {
+		interval_array_free(&index->array);
+		list_expr_sort(&set->init->expressions);
+		interval_array_init(&index->array, set, set->init, false);
+	}
+	index->init = expr_get(set->init);
+	set->index = index;
+
+	return index;
+}
+
+/* Returns the number of intervals in @array that start at or before @low. */
+static unsigned int interval_array_rank(const struct interval_array *array,
+					const unsigned char *low)
+{
+	unsigned int lo = 0, hi = array->num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (interval_key_cmp(array->key[mid].range.low, low,
+				     array->len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Returns 1 if @range is already in the index, -1 if it overlaps with an
+ * indexed interval, 0 otherwise. @rank is set to the insertion point.
+ */
+static int interval_index_lookup(const struct interval_index *index,
+				 const struct range *range, unsigned int *rank)
+{
+	const struct interval_array *array = &index->array;
+	const struct range *prev_range;
+	unsigned int k, len = array->len;
+
+	k = interval_array_rank(array, range->low);
+	*rank = k;
+
+	if (k > 0) {
+		prev_range = &array->key[k - 1].range;
+		if (interval_key_cmp(prev_range->low, range->low, len) == 0 &&
+		    interval_key_cmp(prev_range->high, range->high, len) == 0)
+			return 1;
+		if (interval_key_cmp(range->low, prev_range->high, len) <= 0)
+			return -1;
+	}
+	if (k < array->num &&
+	    interval_key_cmp(array->key[k].range.low, range->high, len) <= 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Add the elements of @array at offsets @pos to the cache of the existing
+ * set, right after their predecessor so the list stays sorted, and merge
+ * their boundaries into the index.
+ */
+static void interval_index_insert(struct interval_index *index,
+				  const struct interval_array *array,
+				  const unsigned int *pos,
+				  const unsigned int *rank, unsigned int num)
+{
+	struct interval_array *old = &index->array;
+	struct interval_array merged = {
+		.len	= old->len,
+	};
+	struct list_head *head;
+	struct interval_key *key;
+	struct expr *clone;
+	unsigned int j = 0, k;
+
+	merged.key = xmalloc_array(old->num + num, sizeof(struct interval_key));
+	merged.data = xmalloc_array(old->num + num, 2 * merged.len);
+
+	for (k = 0; k < num; k++) {
+		for (; j < rank[k]; j++)
+			interval_array_add(&merged, old->key[j].elem,
+					   &old->key[j].range);
+
+		key = &array->key[pos[k]];
+		if (merged.num > 0)
+			head = &merged.key[merged.num - 1].elem->list;
+		else
+			head = &index->init->expressions;
+
+		clone = expr_clone(key->elem);
+		clone->flags |= EXPR_F_KERNEL;
+		list_add(&clone->list, head);
+
+		interval_array_add(&merged, clone, &key->range);
+	}
+	for (; j < old->num; j++)
+		interval_array_add(&merged, old->key[j].elem, &old->key[j].range);
+
+	interval_array_free(old);
+	*old = merged;
+}
+
 static bool merge_ranges(struct set_automerge_ctx *ctx,
 			 struct expr *prev, struct expr *i,
 			 struct range *prev_range, struct range *range)
@@ -107,17 +394,17 @@ static bool merge_ranges(struct set_automerge_ctx *ctx,
 		purge_elem(ctx, prev);
 		expr_free(i->key->left);
 		i->key->left = expr_get(prev->key->left);
-		mpz_set(prev_range->high, range->high);
+		memcpy(prev_range->high, range->high, ctx->keylen);
 		return true;
 	} else if (i->flags & EXPR_F_KERNEL) {
 		purge_elem(ctx, i);
 		expr_free(prev->key->right);
 		prev->key->right = expr_get(i->key->right);
-		mpz_set(prev_range->high, range->high);
+		memcpy(prev_range->high, range->high, ctx->keylen);
 	} else {
 		expr_free(prev->key->right);
 		prev->key->right = expr_get(i->key->right);
-		mpz_set(prev_range->high, range->high);
+		memcpy(prev_range->high, range->high, ctx->keylen);
 		list_del(&i->list);
 		expr_free(i);
 		ctx->init->size--;
@@ -125,12 +412,13 @@ static bool merge_ranges(struct set_automerge_ctx *ctx,
 	return false;
 }
 
-static void set_sort_splice(struct expr *init, struct set *set)
+static void set_sort_splice(struct expr *init, struct set *set,
+			    unsigned int jobs)
 {
 	struct set *existing_set = set->existing_set;
 
 	set_to_range(init);
-	list_expr_sort(&init->expressions);
+	list_expr_sort_jobs(&init->expressions, jobs);
 
 	if (!existing_set || existing_set->errors)
 		return;
@@ -147,77 +435,52 @@ static void set_sort_splice(struct expr *init, struct set *set)
 
 static void setelem_automerge(struct set_automerge_ctx *ctx)
 {
-	struct expr *i, *next, *prev = NULL;
-	struct range range, prev_range;
-	mpz_t rop;
+	struct expr *i, *prev = NULL;
+	struct interval_array array;
+	struct range *range, prev_range;
+	unsigned int k, len;
 
-	mpz_init(prev_range.low);
-	mpz_init(prev_range.high);
-	mpz_init(range.low);
-	mpz_init(range.high);
-	mpz_init(rop);
+	interval_array_init(&array, ctx->set, ctx->init, false);
+	len = ctx->keylen = array.len;
 
-	list_for_each_entry_safe(i, next, &ctx->init->expressions, list) {
-		if (i->key->etype == EXPR_SET_ELEM_CATCHALL)
-			continue;
+	prev_range.low = xmalloc(2 * len);
+	prev_range.high = prev_range.low + len;
 
-		range_expr_value_low(range.low, i);
-		range_expr_value_high(range.high, i);
+	for (k = 0; k < array.num; k++) {
+		i = array.key[k].elem;
+		range = &array.key[k].range;
 
 		if (!prev) {
 			prev = i;
-			mpz_set(prev_range.low, range.low);
-			mpz_set(prev_range.high, range.high);
+			memcpy(prev_range.low, range->low, len);
+			memcpy(prev_range.high, range->high, len);
 			continue;
 		}
 
-		if (mpz_cmp(prev_range.low, range.low) <= 0 &&
-		    mpz_cmp(prev_range.high, range.high) >= 0) {
+		if (interval_key_cmp(prev_range.low, range->low, len) <= 0 &&
+		    interval_key_cmp(prev_range.high, range->high, len) >= 0) {
 			remove_overlapping_range(ctx, prev, i);
 			continue;
-		} else if (mpz_cmp(range.low, prev_range.high) <= 0) {
-			if (merge_ranges(ctx, prev, i, &prev_range, &range))
+		} else if (interval_key_cmp(range->low, prev_range.high, len) <= 0) {
+			if (merge_ranges(ctx, prev, i, &prev_range, range))
 				prev = i;
 			continue;
 		} else if (ctx->set->automerge) {
-			mpz_sub(rop, range.low, prev_range.high);
 			/* two contiguous ranges */
-			if (mpz_cmp_ui(rop, 1) == 0) {
-				if (merge_ranges(ctx, prev, i, &prev_range, &range))
+			if (interval_key_adjacent(prev_range.high, range->low, len)) {
+				if (merge_ranges(ctx, prev, i, &prev_range, range))
 					prev = i;
 				continue;
 			}
 		}
 
 		prev = i;
-		mpz_set(prev_range.low, range.low);
-		mpz_set(prev_range.high, range.high);
-	}
-
-	mpz_clear(prev_range.low);
-	mpz_clear(prev_range.high);
-	mpz_clear(range.low);
-	mpz_clear(range.high);
-	mpz_clear(rop);
-}
-
-static struct expr *interval_expr_key(struct expr *i)
-{
-	struct expr *elem;
-
-	switch (i->etype) {
-	case EXPR_MAPPING:
-		elem = i->left;
-		break;
-	case EXPR_SET_ELEM:
-		elem = i;
-		break;
-	default:
-		BUG("unhandled expression type %d\n", i->etype);
-		return NULL;
+		memcpy(prev_range.low, range->low, len);
+		memcpy(prev_range.high, range->high, len);
 	}
 
-	return elem;
+	free(prev_range.low);
+	interval_array_free(&array);
 }
 
 static void set_to_range(struct expr *init)
@@ -231,7 +494,7 @@ static void set_to_range(struct expr *init)
 }
 
 int set_automerge(struct list_head *msgs, struct cmd *cmd, struct set *set,
-		  struct expr *init, unsigned int debug_mask)
+		  struct expr *init, unsigned int debug_mask, unsigned int jobs)
 {
 	struct set *existing_set = set->existing_set;
 	struct set_automerge_ctx ctx = {
@@ -245,11 +508,14 @@ int set_automerge(struct list_head *msgs, struct cmd *cmd, struct set *set,
 
 	if (set->flags & NFT_SET_MAP) {
 		set_to_range(init);
-		list_expr_sort(&init->expressions);
+		list_expr_sort_jobs(&init->expressions, jobs);
 		return 0;
 	}
 
-	set_sort_splice(init, set);
+	if (existing_set)
+		interval_index_invalidate(existing_set);
+
+	set_sort_splice(init, set, jobs);
 
 	ctx.purge = set_expr_alloc(&internal_location, set);
 
@@ -282,6 +548,39 @@ int set_automerge(struct list_head *msgs, struct cmd *cmd, struct set *set,
 	return 0;
 }
 
+/*
+ * Number of disjoint intervals the elements in @init collapse into once
+ * overlapping and adjacent keys are merged, as set_automerge() would do.
+ */
+unsigned int set_count_intervals(const struct set *set, struct expr *init,
+				 unsigned int jobs)
+{
+	struct interval_array array;
+	unsigned char *high = NULL;
+	unsigned int k, num = 0;
+	struct range *range;
+
+	list_expr_sort_jobs(&init->expressions, jobs);
+	interval_array_init(&array, set, init, false);
+
+	for (k = 0; k < array.num; k++) {
+		range = &array.key[k].range;
+
+		if (!high ||
+		    (interval_key_cmp(range->low, high, array.len) > 0 &&
+		     !interval_key_adjacent(high, range->low, array.len))) {
+			high = range->high;
+			num++;
+		} else if (interval_key_cmp(range->high, high, array.len) > 0) {
+			high = range->high;
+		}
+	}
+
+	interval_array_free(&array);
+
+	return num;
+}
+
 static void remove_elem(struct expr *prev, struct set *set, struct expr *purge)
 {
 	struct expr *clone;
@@ -358,18 +657,18 @@ static void split_range(struct set *set, struct expr *prev, struct expr *i,
 
 static int setelem_adjust(struct set *set, struct expr *purge,
 			  struct range *prev_range, struct range *range,
-			  struct expr *prev, struct expr *i)
+			  struct expr *prev, struct expr *i, unsigned int len)
 {
-	if (mpz_cmp(prev_range->low, range->low) == 0 &&
-	    mpz_cmp(prev_range->high, range->high) > 0) {
+	int low = interval_key_cmp(prev_range->low, range->low, len);
+	int high = interval_key_cmp(prev_range->high, range->high, len);
+
+	if (low == 0 && high > 0) {
 		if (i->flags & EXPR_F_REMOVE)
 			adjust_elem_left(set, prev, i, purge);
-	} else if (mpz_cmp(prev_range->low, range->low) < 0 &&
-		   mpz_cmp(prev_range->high, range->high) == 0) {
+	} else if (low < 0 && high == 0) {
 		if (i->flags & EXPR_F_REMOVE)
 			adjust_elem_right(set, prev, i, purge);
-	} else if (mpz_cmp(prev_range->low, range->low) < 0 &&
-		   mpz_cmp(prev_range->high, range->high) > 0) {
+	} else if (low < 0 && high > 0) {
 		if (i->flags & EXPR_F_REMOVE)
 			split_range(set, prev, i, purge);
 	} else {
@@ -383,29 +682,20 @@ static int setelem_delete(struct list_head *msgs, struct set *set,
 			  struct expr *purge, struct expr *elems,
 			  unsigned int debug_mask)
 {
-	struct expr *i, *next, *elem, *prev = NULL;
-	struct range range, prev_range;
+	struct expr *i, *elem, *prev = NULL;
+	struct range *range, *prev_range = NULL;
+	struct interval_array array;
+	unsigned int k, len;
 	int err = 0;
-	mpz_t rop;
 
-	mpz_init(prev_range.low);
-	mpz_init(prev_range.high);
-	mpz_init(range.low);
-	mpz_init(range.high);
-	mpz_init(rop);
+	interval_array_init(&array, set, elems, true);
+	len = array.len;
 
-	list_for_each_entry_safe(elem, next, &elems->expressions, list) {
+	for (k = 0; k < array.num; k++) {
+		elem = array.key[k].elem;
+		range = &array.key[k].range;
 		i = interval_expr_key(elem);
 
-		if (i->key->etype == EXPR_SET_ELEM_CATCHALL) {
-			/* Assume max value to simplify handling. */
-			mpz_bitmask(range.low, i->len);
-			mpz_bitmask(range.high, i->len);
-		} else {
-			range_expr_value_low(range.low, i);
-			range_expr_value_high(range.high, i);
-		}
-
 		if (!prev && elem->flags & EXPR_F_REMOVE) {
 			expr_error(msgs, i, "element does not exist");
 			err = -1;
@@ -414,13 +704,12 @@ static int setelem_delete(struct list_head *msgs, struct set *set,
 
 		if (!(elem->flags & EXPR_F_REMOVE)) {
 			prev = elem;
-			mpz_set(prev_range.low, range.low);
-			mpz_set(prev_range.high, range.high);
+			prev_range = range;
 			continue;
 		}
 
-		if (mpz_cmp(prev_range.low, range.low) == 0 &&
-		    mpz_cmp(prev_range.high, range.high) == 0) {
+		if (interval_key_cmp(prev_range->low, range->low, len) == 0 &&
+		    interval_key_cmp(prev_range->high, range->high, len) == 0) {
 			if (elem->flags & EXPR_F_REMOVE) {
 				if (prev->flags & EXPR_F_KERNEL)
 					list_move_tail(&prev->list, &purge->expressions);
@@ -429,7 +718,8 @@ static int setelem_delete(struct list_head *msgs, struct set *set,
 				expr_free(elem);
 			}
 		} else if (set->automerge) {
-			if (setelem_adjust(set, purge, &prev_range, &range, prev, i) < 0) {
+			if (setelem_adjust(set, purge, prev_range, range,
+					   prev, i, len) < 0) {
 				expr_error(msgs, i, "element does not exist");
 				err = -1;
 				goto err;
@@ -442,17 +732,14 @@ static int setelem_delete(struct list_head *msgs, struct set *set,
 		prev = NULL;
 	}
 err:
-	mpz_clear(prev_range.low);
-	mpz_clear(prev_range.high);
-	mpz_clear(range.low);
-	mpz_clear(range.high);
-	mpz_clear(rop);
+	interval_array_free(&array);
 
 	return err;
 }
 
 static void automerge_delete(struct list_head *msgs, struct set *set,
-			     struct expr *init, unsigned int debug_mask)
+			     struct expr *init, unsigned int debug_mask,
+			     unsigned int jobs)
 {
 	struct set_automerge_ctx ctx = {
 		.set		= set,
@@ -461,7 +748,7 @@ static void automerge_delete(struct list_head *msgs, struct set *set,
 	};
 
 	ctx.purge = set_expr_alloc(&internal_location, set);
-	list_expr_sort(&init->expressions);
+	list_expr_sort_jobs(&init->expressions, jobs);
 	setelem_automerge(&ctx);
 	expr_free(ctx.purge);
 }
@@ -479,7 +766,7 @@ static int __set_delete(struct list_head *msgs, struct expr *i,	struct set *set,
 
 /* detection for unexisting intervals already exists in Linux kernels >= 5.7. */
 int set_delete(struct list_head *msgs, struct cmd *cmd, struct set *set,
-	       struct expr *init, unsigned int debug_mask)
+	       struct expr *init, unsigned int debug_mask, unsigned int jobs)
 {
 	struct set *existing_set = set->existing_set;
 	struct expr *i, *next, *add, *clone;
@@ -488,9 +775,11 @@ int set_delete(struct list_head *msgs, struct cmd *cmd, struct set *set,
 	LIST_HEAD(del_list);
 	int err;
 
+	interval_index_invalidate(existing_set);
+
 	set_to_range(init);
 	if (set->automerge)
-		automerge_delete(msgs, set, init, debug_mask);
+		automerge_delete(msgs, set, init, debug_mask, jobs);
 
 	if (existing_set->init) {
 		set_to_range(existing_set->init);
@@ -543,99 +832,99 @@ int set_delete(struct list_head *msgs, struct cmd *cmd, struct set *set,
 }
 
 static int setelem_overlap(struct list_head *msgs, struct set *set,
-			   struct expr *init)
+			   struct expr *init, struct interval_index *index)
 {
-	struct expr *i, *next, *elem, *prev = NULL;
-	struct range range, prev_range;
-	int err = 0;
-	mpz_t rop;
-
-	mpz_init(prev_range.low);
-	mpz_init(prev_range.high);
-	mpz_init(range.low);
-	mpz_init(range.high);
-	mpz_init(rop);
+	unsigned int k, len, num = 0, *pos = NULL, *rank = NULL;
+	struct range *range, *prev_range = NULL;
+	struct expr *i, *elem, *prev = NULL;
+	struct interval_array array;
+	int ret, err = 0;
+
+	interval_array_init(&array, set, init, false);
+	len = array.len;
+
+	if (index && array.num) {
+		pos = xmalloc_array(array.num, sizeof(*pos));
+		rank = xmalloc_array(array.num, sizeof(*rank));
+	}
 
-	list_for_each_entry_safe(elem, next, &init->expressions, list) {
+	for (k = 0; k < array.num; k++) {
+		elem = array.key[k].elem;
+		range = &array.key[k].range;
 		i = interval_expr_key(elem);
 
-		if (i->key->etype == EXPR_SET_ELEM_CATCHALL)
-			continue;
-
-		range_expr_value_low(range.low, i);
-		range_expr_value_high(range.high, i);
+		if (prev) {
+			if (interval_key_cmp(prev_range->low, range->low, len) == 0 &&
+			    interval_key_cmp(prev_range->high, range->high, len) == 0)
+				continue;
 
-		if (!prev) {
-			prev = elem;
-			mpz_set(prev_range.low, range.low);
-			mpz_set(prev_range.high, range.high);
-			continue;
+			if (interval_key_cmp(range->low, prev_range->high, len) <= 0) {
+				expr_binary_error(msgs, i, prev,
+						  "conflicting intervals specified");
+				err = -1;
+				goto err_out;
+			}
 		}
+		prev = elem;
+		prev_range = range;
 
-		if (mpz_cmp(prev_range.low, range.low) == 0 &&
-		    mpz_cmp(prev_range.high, range.high) == 0)
-			goto next;
+		if (!index)
+			continue;
 
-		if (mpz_cmp(prev_range.low, range.low) <= 0 &&
-		    mpz_cmp(prev_range.high, range.high) >= 0) {
-			if (prev->flags & EXPR_F_KERNEL)
-				expr_error(msgs, i, "interval overlaps with an existing one");
-			else if (elem->flags & EXPR_F_KERNEL)
-				expr_error(msgs, prev, "interval overlaps with an existing one");
-			else
-				expr_binary_error(msgs, i, prev,
-						  "conflicting intervals specified");
-			err = -1;
-			goto err_out;
-		} else if (mpz_cmp(range.low, prev_range.high) <= 0) {
-			if (prev->flags & EXPR_F_KERNEL)
-				expr_error(msgs, i, "interval overlaps with an existing one");
-			else if (elem->flags & EXPR_F_KERNEL)
-				expr_error(msgs, prev, "interval overlaps with an existing one");
-			else
-				expr_binary_error(msgs, i, prev,
-						  "conflicting intervals specified");
+		ret = interval_index_lookup(index, range, &rank[num]);
+		if (ret < 0) {
+			expr_error(msgs, i, "interval overlaps with an existing one");
 			err = -1;
 			goto err_out;
+		} else if (ret > 0) {
+			continue;
 		}
-next:
-		prev = elem;
-		mpz_set(prev_range.low, range.low);
-		mpz_set(prev_range.high, range.high);
+		pos[num++] = k;
 	}
 
+	if (num > 0)
+		interval_index_insert(index, &array, pos, rank, num);
 err_out:
-	mpz_clear(prev_range.low);
-	mpz_clear(prev_range.high);
-	mpz_clear(range.low);
-	mpz_clear(range.high);
-	mpz_clear(rop);
+	free(pos);
+	free(rank);
+	interval_array_free(&array);
 
 	return err;
 }
 
 /* overlap detection for intervals already exists in Linux kernels >= 5.7. */
-int set_overlap(struct list_head *msgs, struct set *set, struct expr *init)
+int set_overlap(struct list_head *msgs, struct set *set, struct expr *init,
+		unsigned int jobs)
 {
 	struct set *existing_set = set->existing_set;
-	struct expr *i, *n, *clone;
+	struct interval_index *index = NULL;
+	struct expr *i, *clone;
 	int err;
 
-	set_sort_splice(init, set);
+	set_to_range(init);
+	list_expr_sort_jobs(&init->expressions, jobs);
+
+	if (existing_set && !existing_set->errors) {
+		if (!existing_set->init)
+			existing_set->init = set_expr_alloc(&internal_location,
+							    set);
+		index = interval_index_get(existing_set);
+	}
 
-	err = setelem_overlap(msgs, set, init);
+	err = setelem_overlap(msgs, set, init, index);
+	if (err < 0 || !index)
+		return err;
 
-	list_for_each_entry_safe(i, n, &init->expressions, list) {
-		if (i->flags & EXPR_F_KERNEL)
-			list_move_tail(&i->list, &existing_set->init->expressions);
-		else if (existing_set) {
-			clone = expr_clone(i);
-			clone->flags |= EXPR_F_KERNEL;
-			list_add_tail(&clone->list, &existing_set->init->expressions);
-		}
+	list_for_each_entry(i, &init->expressions, list) {
+		if (interval_expr_key(i)->key->etype != EXPR_SET_ELEM_CATCHALL)
+			continue;
+
+		clone = expr_clone(i);
+		clone->flags |= EXPR_F_KERNEL;
+		list_add_tail(&clone->list, &existing_set->init->expressions);
 	}
 
-	return err;
+	return 0;
 }
 
 static bool segtree_needs_first_segment(const struct set *set,
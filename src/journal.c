@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Change journal of the persistent cache. Each transaction that the cache
+ * learns about through ruleset events is kept as the line that monitor
+ * replicate prints for it, so that "list ruleset since" can print what
+ * changed after a given generation instead of the whole ruleset. Only the
+ * last NFT_JOURNAL_MAX transactions are kept, and lost events clear the
+ * journal: older generations get the whole ruleset.
+ */
+
+#include <nft.h>
+
+#include <journal.h>
+#include <nftables.h>
+#include <utils.h>
+
+struct nft_journal *nft_journal_alloc(void)
+{
+	struct nft_journal *journal;
+
+	journal = xzalloc(sizeof(*journal));
+	init_list_head(&journal->entries);
+
+	return journal;
+}
+
+static void nft_journal_entry_free(struct nft_journal_entry *entry)
+{
+	list_del(&entry->list);
+	free(entry->cmds);
+	free(entry);
+}
+
+static void nft_journal_flush(struct nft_journal *journal)
+{
+	struct nft_journal_entry *entry, *next;
+
+	list_for_each_entry_safe(entry, next, &journal->entries, list)
+		nft_journal_entry_free(entry);
+	journal->num_entries = 0;
+}
+
+void nft_journal_free(struct nft_journal *journal)
+{
+	nft_journal_flush(journal);
+	free(journal);
+}
+
+/* The cache was fetched at @genid, start over unless the journal is already
+ * up to date with it.
+ */
+void nft_journal_sync(struct nft_journal *journal, uint32_t genid)
+{
+	if (journal->valid && journal->genid == genid)
+		return;
+
+	nft_journal_flush(journal);
+	journal->start = genid;
+	journal->genid = genid;
+	journal->valid = true;
+}
+
+/* Events were lost, the journal misses some transactions. */
+void nft_journal_invalidate(struct nft_journal *journal)
+{
+	nft_journal_flush(journal);
+	journal->valid = false;
+}
+
+/* Takes @cmds, NULL or empty if the transaction changed nothing that is
+ * printed, e.g. anonymous sets only.
+ */
+void nft_journal_add(struct nft_journal *journal, uint32_t genid,
+		     char *cmds, bool reload)
+{
+	struct nft_journal_entry *entry;
+
+	if (!journal->valid) {
+		free(cmds);
+		return;
+	}
+	journal->genid = genid;
+
+	if (!reload && (!cmds || *cmds == '\0')) {
+		free(cmds);
+		return;
+	}
+
+	if (journal->num_entries == NFT_JOURNAL_MAX) {
+		entry = list_first_entry(&journal->entries,
+					 struct nft_journal_entry, list);
+		journal->start = entry->genid;
+		nft_journal_entry_free(entry);
+		journal->num_entries--;
+	}
+
+	entry = xmalloc(sizeof(*entry));
+	entry->genid = genid;
+	entry->reload = reload;
+	entry->cmds = cmds;
+	list_add_tail(&entry->list, &journal->entries);
+	journal->num_entries++;
+}
+
+/* Whether the changes after @genid can be printed as commands. */
+bool nft_journal_covers(const struct nft_journal *journal, uint32_t genid)
+{
+	const struct nft_journal_entry *entry;
+
+	if (!journal || !journal->valid ||
+	    genid < journal->start || genid > journal->genid)
+		return false;
+
+	list_for_each_entry(entry, &journal->entries, list) {
+		if (entry->genid > genid && entry->reload)
+			return false;
+	}
+
+	return true;
+}
+
+void nft_journal_print(const struct nft_journal *journal, uint32_t genid,
+		       struct output_ctx *octx)
+{
+	const struct nft_journal_entry *entry;
+
+	nft_print(octx, "# changes from generation %u to %u\n",
+		  genid, journal->genid);
+
+	list_for_each_entry(entry, &journal->entries, list) {
+		if (entry->genid > genid)
+			nft_print(octx, "%s", entry->cmds);
+	}
+}
@@ -15,6 +15,8 @@
 #include <netlink.h>
 #include <rule.h>
 #include <rt.h>
+#include <optimize.h>
+#include <resolve.h>
 #include "nftutils.h"
 
 #include <netdb.h>
@@ -137,7 +139,9 @@ static json_t *set_stmt_list_json(const struct list_head *stmt_list,
 	return root;
 }
 
-static json_t *set_print_json(struct output_ctx *octx, const struct set *set)
+/* Set attributes, without elements and statements. */
+static json_t *set_print_json_attrs(struct output_ctx *octx,
+				    const struct set *set, const char **ptype)
 {
 	json_t *root, *tmp, *datatype_ext = NULL;
 	const char *type;
@@ -206,7 +210,35 @@ static json_t *set_print_json(struct output_ctx *octx, const struct set *set)
 	if (set->automerge)
 		json_object_set_new(root, "auto-merge", json_true());
 
-	if (!nft_output_terse(octx) && set->init && set->init->size > 0) {
+	*ptype = type;
+	return root;
+}
+
+static bool set_print_json_has_elems(struct output_ctx *octx,
+				     const struct set *set)
+{
+	return !nft_output_terse(octx) && set->init && set->init->size > 0;
+}
+
+static json_t *set_print_json(struct output_ctx *octx, const struct set *set)
+{
+	const char *type;
+	json_t *root;
+
+	root = set_print_json_attrs(octx, set, &type);
+
+	if (set->maglev.backends && !nft_output_terse(octx)) {
+		json_t *array = json_array();
+		const struct expr *i;
+
+		list_for_each_entry(i, &set->maglev.backends->expressions, list)
+			json_array_append_new(array, expr_print_json(i, octx));
+
+		json_object_set_new(root, "maglev",
+				    json_pack("{s:I, s:o}",
+					      "size", (json_int_t)set->maglev.size,
+					      "backends", array));
+	} else if (set_print_json_has_elems(octx, set)) {
 		json_t *array = json_array();
 		const struct expr *i;
 
@@ -1139,7 +1171,7 @@ json_t *inet_service_type_json(const struct expr *expr, struct output_ctx *octx)
 	char name[NFT_SERVNAME_MAXSIZE];
 
 	if (!nft_output_service(octx) ||
-	    !nft_getservbyport(port, NULL, name, sizeof(name)))
+	    !nft_resolver_service(octx->resolver, port, name, sizeof(name)))
 		return json_integer(ntohs(port));
 
 	return json_string(name);
@@ -1147,18 +1179,18 @@ json_t *inet_service_type_json(const struct expr *expr, struct output_ctx *octx)
 
 json_t *mark_type_json(const struct expr *expr, struct output_ctx *octx)
 {
-	return symbolic_constant_json(octx->tbl.mark, expr, octx);
+	return symbolic_constant_json(mark_table(&octx->tbl), expr, octx);
 }
 
 json_t *devgroup_type_json(const struct expr *expr, struct output_ctx *octx)
 {
-	return symbolic_constant_json(octx->tbl.devgroup, expr, octx);
+	return symbolic_constant_json(devgroup_table(&octx->tbl), expr, octx);
 }
 
 json_t *ct_label_type_json(const struct expr *expr, struct output_ctx *octx)
 {
 	unsigned long bit = mpz_scan1(expr->value, 0);
-	const char *labelstr = ct_label2str(octx->tbl.ct_label, bit);
+	const char *labelstr = ct_label2str(ct_label_table(&octx->tbl), bit);
 
 	if (labelstr)
 		return json_string(labelstr);
@@ -1712,94 +1744,376 @@ json_t *xt_stmt_json(const struct stmt *stmt, struct output_ctx *octx)
 			 "name", stmt->xt.name);
 }
 
-static json_t *table_print_json_full(struct netlink_ctx *ctx,
-				     struct table *table)
+/*
+ * Listings are written out while they are generated instead of being built
+ * into a single tree first. Objects are still turned into json_t one at a
+ * time, except for set elements which are written one by one. The output
+ * is the same as json_dumpf() of the whole tree.
+ *
+ * With NFT_CTX_OUTPUT_CBOR, the same structure is written as CBOR
+ * (RFC 8949): containers opened by the writer have indefinite length,
+ * objects converted to json_t are encoded with their definite length.
+ */
+#define JSON_WRITER_MAX_DEPTH	8
+
+struct json_writer {
+	FILE		*fp;
+	bool		cbor;
+	unsigned int	depth;
+	bool		key;
+	bool		sep[JSON_WRITER_MAX_DEPTH];
+};
+
+enum cbor_major {
+	CBOR_UINT	= 0,
+	CBOR_NINT	= 1,
+	CBOR_BYTES	= 2,
+	CBOR_TEXT	= 3,
+	CBOR_ARRAY	= 4,
+	CBOR_MAP	= 5,
+	CBOR_TAG	= 6,
+	CBOR_SIMPLE	= 7,
+};
+
+#define CBOR_FALSE		0xf4
+#define CBOR_TRUE		0xf5
+#define CBOR_NULL		0xf6
+#define CBOR_FLOAT64		0xfb
+#define CBOR_BREAK		0xff
+#define CBOR_INDEFINITE		31
+
+/* IANA CBOR tags for addresses, see RFC 9164 and RFC 9542. */
+#define CBOR_TAG_MAC		48
+#define CBOR_TAG_IPV4		52
+#define CBOR_TAG_IPV6		54
+
+static void cbor_head(FILE *fp, enum cbor_major major, uint64_t val)
+{
+	uint8_t buf[9];
+	unsigned int len, i;
+
+	if (val < 24) {
+		buf[0] = major << 5 | val;
+		len = 0;
+	} else if (val <= UINT8_MAX) {
+		buf[0] = major << 5 | 24;
+		len = 1;
+	} else if (val <= UINT16_MAX) {
+		buf[0] = major << 5 | 25;
+		len = 2;
+	} else if (val <= UINT32_MAX) {
+		buf[0] = major << 5 | 26;
+		len = 4;
+	} else {
+		buf[0] = major << 5 | 27;
+		len = 8;
+	}
+
+	for (i = 0; i < len; i++)
+		buf[1 + i] = val >> (8 * (len - 1 - i));
+
+	fwrite(buf, 1, len + 1, fp);
+}
+
+static void cbor_string(FILE *fp, enum cbor_major major,
+			const void *data, size_t len)
+{
+	cbor_head(fp, major, len);
+	fwrite(data, 1, len, fp);
+}
+
+static void cbor_dumpf(const json_t *value, FILE *fp)
+{
+	json_int_t num;
+	const char *key;
+	json_t *tmp;
+	uint64_t u;
+	size_t i;
+	double d;
+
+	switch (json_typeof(value)) {
+	case JSON_OBJECT:
+		cbor_head(fp, CBOR_MAP, json_object_size(value));
+		json_object_foreach((json_t *)value, key, tmp) {
+			cbor_string(fp, CBOR_TEXT, key, strlen(key));
+			cbor_dumpf(tmp, fp);
+		}
+		break;
+	case JSON_ARRAY:
+		cbor_head(fp, CBOR_ARRAY, json_array_size(value));
+		json_array_foreach(value, i, tmp)
+			cbor_dumpf(tmp, fp);
+		break;
+	case JSON_STRING:
+		cbor_string(fp, CBOR_TEXT, json_string_value(value),
+			    json_string_length(value));
+		break;
+	case JSON_INTEGER:
+		num = json_integer_value(value);
+		if (num >= 0)
+			cbor_head(fp, CBOR_UINT, num);
+		else
+			cbor_head(fp, CBOR_NINT, -(num + 1));
+		break;
+	case JSON_REAL:
+		d = json_real_value(value);
+		memcpy(&u, &d, sizeof(u));
+		fputc(CBOR_FLOAT64, fp);
+		for (i = 0; i < sizeof(u); i++)
+			fputc(u >> (8 * (sizeof(u) - 1 - i)), fp);
+		break;
+	case JSON_TRUE:
+		fputc(CBOR_TRUE, fp);
+		break;
+	case JSON_FALSE:
+		fputc(CBOR_FALSE, fp);
+		break;
+	case JSON_NULL:
+		fputc(CBOR_NULL, fp);
+		break;
+	}
+}
+
+static void json_writer_sep(struct json_writer *w)
+{
+	if (w->key) {
+		w->key = false;
+		return;
+	}
+	if (!w->depth || w->cbor)
+		return;
+
+	if (w->sep[w->depth - 1])
+		fputs(", ", w->fp);
+	w->sep[w->depth - 1] = true;
+}
+
+static void json_writer_open(struct json_writer *w, char c)
+{
+	json_writer_sep(w);
+	assert(w->depth < JSON_WRITER_MAX_DEPTH);
+	if (w->cbor)
+		cbor_head(w->fp, c == '{' ? CBOR_MAP : CBOR_ARRAY,
+			  CBOR_INDEFINITE);
+	else
+		fputc(c, w->fp);
+	w->sep[w->depth++] = false;
+}
+
+static void json_writer_close(struct json_writer *w, char c)
+{
+	assert(w->depth > 0);
+	w->depth--;
+	fputc(w->cbor ? CBOR_BREAK : c, w->fp);
+}
+
+static void json_writer_key(struct json_writer *w, const char *key)
+{
+	json_t *tmp;
+
+	json_writer_sep(w);
+	if (w->cbor) {
+		cbor_string(w->fp, CBOR_TEXT, key, strlen(key));
+	} else {
+		tmp = json_string(key);
+		json_dumpf(tmp, w->fp, JSON_ENCODE_ANY);
+		json_decref(tmp);
+		fputs(": ", w->fp);
+	}
+	w->key = true;
+}
+
+/* Write and release @value. */
+static void json_writer_value(struct json_writer *w, json_t *value)
+{
+	if (!value)
+		return;
+
+	json_writer_sep(w);
+	if (w->cbor)
+		cbor_dumpf(value, w->fp);
+	else
+		json_dumpf(value, w->fp, JSON_ENCODE_ANY);
+	json_decref(value);
+}
+
+/* In CBOR, a set element that is a bare address is written as a tagged
+ * byte string in network byte order instead of its text form.
+ */
+static bool json_writer_addr(struct json_writer *w, const struct expr *elem)
+{
+	const struct expr *key = elem->key;
+	uint8_t data[16];
+	unsigned int len;
+	uint64_t tag;
+
+	if (!w->cbor ||
+	    elem->etype != EXPR_SET_ELEM ||
+	    key->etype != EXPR_VALUE ||
+	    elem->timeout || elem->expiration || elem->comment ||
+	    !list_empty(&elem->stmt_list))
+		return false;
+
+	switch (key->dtype->type) {
+	case TYPE_IPADDR:
+		tag = CBOR_TAG_IPV4;
+		break;
+	case TYPE_IP6ADDR:
+		tag = CBOR_TAG_IPV6;
+		break;
+	case TYPE_ETHERADDR:
+		tag = CBOR_TAG_MAC;
+		break;
+	default:
+		return false;
+	}
+
+	len = div_round_up(key->len, BITS_PER_BYTE);
+	if (len > sizeof(data))
+		return false;
+
+	mpz_export_data(data, key->value, key->byteorder, len);
+
+	json_writer_sep(w);
+	cbor_head(w->fp, CBOR_TAG, tag);
+	cbor_string(w->fp, CBOR_BYTES, data, len);
+	return true;
+}
+
+/* @count is the number of elements in the set when only some of them, or
+ * none, were fetched.
+ */
+static void set_print_json_writer(struct json_writer *w,
+				  struct output_ctx *octx,
+				  const struct set *set,
+				  const struct set_stats *stats)
 {
-	json_t *root = json_array(), *rules = json_array(), *tmp;
+	const struct expr *i;
+	json_t *root, *tmp;
+	const char *type;
+	const char *key;
+
+	root = set_print_json_attrs(octx, set, &type);
+
+	json_writer_open(w, '{');
+	json_writer_key(w, type);
+	json_writer_open(w, '{');
+	json_object_foreach(root, key, tmp) {
+		json_writer_key(w, key);
+		json_writer_value(w, json_incref(tmp));
+	}
+	json_decref(root);
+
+	if (stats) {
+		json_writer_key(w, "count");
+		json_writer_value(w, json_integer(stats->elements));
+	}
+	if (stats && stats->memory) {
+		json_writer_key(w, "memory");
+		json_writer_value(w, json_integer(stats->memory));
+	}
+
+	if (set_print_json_has_elems(octx, set)) {
+		json_writer_key(w, "elem");
+		json_writer_open(w, '[');
+		list_for_each_entry(i, &set->init->expressions, list) {
+			if (!json_writer_addr(w, i))
+				json_writer_value(w, expr_print_json(i, octx));
+		}
+		json_writer_close(w, ']');
+	}
+
+	if (!list_empty(&set->stmt_list)) {
+		json_writer_key(w, "stmt");
+		json_writer_value(w, set_stmt_list_json(&set->stmt_list, octx));
+	}
+
+	json_writer_close(w, '}');
+	json_writer_close(w, '}');
+}
+
+/* With a streamed cache, rules and set elements are fetched as they are
+ * printed, see nft_cache_evaluate().
+ */
+static int table_print_json_full(struct netlink_ctx *ctx,
+				 struct json_writer *w, struct table *table)
+{
+	struct output_ctx *octx = &ctx->nft->output;
 	struct flowtable *flowtable;
 	struct chain *chain;
 	struct rule *rule;
 	struct obj *obj;
 	struct set *set;
 
-	tmp = table_print_json(table);
-	json_array_append_new(root, tmp);
+	json_writer_value(w, table_print_json(table));
 
 	/* both maps and rules may refer to chains, list them first */
-	list_for_each_entry(chain, &table->chain_cache.list, cache.list) {
-		tmp = chain_print_json(chain);
-		json_array_append_new(root, tmp);
-	}
-	list_for_each_entry(obj, &table->obj_cache.list, cache.list) {
-		tmp = obj_print_json(obj);
-		json_array_append_new(root, tmp);
-	}
+	list_for_each_entry(chain, &table->chain_cache.list, cache.list)
+		json_writer_value(w, chain_print_json(chain));
+	list_for_each_entry(obj, &table->obj_cache.list, cache.list)
+		json_writer_value(w, obj_print_json(obj));
 	list_for_each_entry(set, &table->set_cache.list, cache.list) {
 		if (set_is_anonymous(set->flags))
 			continue;
-		tmp = set_print_json(&ctx->nft->output, set);
-		json_array_append_new(root, tmp);
-	}
-	list_for_each_entry(flowtable, &table->ft_cache.list, cache.list) {
-		tmp = flowtable_print_json(flowtable);
-		json_array_append_new(root, tmp);
+		if (set_stream_fetch(ctx, set) < 0)
+			return -1;
+		set_print_json_writer(w, octx, set, NULL);
+		set_stream_release(ctx, set);
 	}
+	list_for_each_entry(flowtable, &table->ft_cache.list, cache.list)
+		json_writer_value(w, flowtable_print_json(flowtable));
+
+	if (table_stream_fetch(ctx, table) < 0)
+		return -1;
+
 	list_for_each_entry(chain, &table->chain_cache.list, cache.list) {
-		list_for_each_entry(rule, &chain->rules, list) {
-			tmp = rule_print_json(&ctx->nft->output, rule);
-			json_array_append_new(rules, tmp);
-		}
+		if (chain_stream_fetch(ctx, table, chain) < 0)
+			return -1;
+		list_for_each_entry(rule, &chain->rules, list)
+			json_writer_value(w, rule_print_json(octx, rule));
+		chain_stream_release(ctx, chain);
 	}
+	table_stream_release(ctx, table);
 
-	json_array_extend_new(root, rules);
-
-	return root;
+	return 0;
 }
 
-static json_t *do_list_ruleset_json(struct netlink_ctx *ctx, struct cmd *cmd)
+static int do_list_ruleset_json(struct netlink_ctx *ctx,
+				struct json_writer *w, struct cmd *cmd)
 {
 	unsigned int family = cmd->handle.family;
-	json_t *root = json_array();
 	struct table *table;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (family != NFPROTO_UNSPEC &&
 		    table->handle.family != family)
 			continue;
 
-		json_array_extend_new(root, table_print_json_full(ctx, table));
+		if (table_print_json_full(ctx, w, table) < 0)
+			return -1;
 	}
 
-	return root;
+	return 0;
 }
 
-static json_t *do_list_tables_json(struct netlink_ctx *ctx, struct cmd *cmd)
+static void do_list_tables_json(struct netlink_ctx *ctx,
+				struct json_writer *w, struct cmd *cmd)
 {
 	unsigned int family = cmd->handle.family;
-	json_t *root = json_array();
 	struct table *table;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (family != NFPROTO_UNSPEC &&
 		    table->handle.family != family)
 			continue;
 
-		json_array_append_new(root, table_print_json(table));
+		json_writer_value(w, table_print_json(table));
 	}
-
-	return root;
-}
-
-static json_t *do_list_table_json(struct netlink_ctx *ctx,
-				  struct cmd *cmd, struct table *table)
-{
-	return table_print_json_full(ctx, table);
 }
 
-static json_t *do_list_chain_json(struct netlink_ctx *ctx,
-				  struct cmd *cmd, struct table *table)
+static void do_list_chain_json(struct netlink_ctx *ctx, struct json_writer *w,
+			       struct cmd *cmd, struct table *table)
 {
-	json_t *root = json_array();
 	struct chain *chain;
 	struct rule *rule;
 
@@ -1808,61 +2122,74 @@ static json_t *do_list_chain_json(struct netlink_ctx *ctx,
 		    strcmp(cmd->handle.chain.name, chain->handle.chain.name))
 			continue;
 
-		json_array_append_new(root, chain_print_json(chain));
-
-		list_for_each_entry(rule, &chain->rules, list) {
-			json_t *tmp = rule_print_json(&ctx->nft->output, rule);
+		json_writer_value(w, chain_print_json(chain));
 
-			json_array_append_new(root, tmp);
-		}
+		list_for_each_entry(rule, &chain->rules, list)
+			json_writer_value(w, rule_print_json(&ctx->nft->output,
+							     rule));
 	}
-
-	return root;
 }
 
-static json_t *do_list_chains_json(struct netlink_ctx *ctx, struct cmd *cmd)
+static void do_list_chains_json(struct netlink_ctx *ctx,
+				struct json_writer *w, struct cmd *cmd)
 {
-	json_t *root = json_array();
 	struct table *table;
 	struct chain *chain;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
 
-		list_for_each_entry(chain, &table->chain_cache.list, cache.list) {
-			json_t *tmp = chain_print_json(chain);
-
-			json_array_append_new(root, tmp);
-		}
+		list_for_each_entry(chain, &table->chain_cache.list, cache.list)
+			json_writer_value(w, chain_print_json(chain));
 	}
-
-	return root;
 }
 
-static json_t *do_list_set_json(struct netlink_ctx *ctx,
-				struct cmd *cmd, struct table *table)
+static void do_list_set_json(struct netlink_ctx *ctx, struct json_writer *w,
+			     struct cmd *cmd, struct table *table)
 {
 	struct set *set = cmd->set;
 
 	if (!set) {
 		set = set_cache_find(table, cmd->handle.set.name);
-		if (set == NULL)
-			return json_null();
+		if (set == NULL) {
+			json_writer_value(w, json_null());
+			return;
+		}
 	}
 
-	return json_pack("[o]", set_print_json(&ctx->nft->output, set));
+	if (cmd->arg) {
+		struct expr *init = set->init;
+		struct set_stats stats = {};
+
+		set->init = NULL;
+		if (netlink_list_setelems_window(ctx, &set->handle, set,
+						 cmd->arg,
+						 &stats.elements) < 0) {
+			set->init = init;
+			json_writer_value(w, json_null());
+			return;
+		}
+		set_print_json_writer(w, &ctx->nft->output, set, &stats);
+		expr_free(set->init);
+		set->init = init;
+		return;
+	}
+
+	set_print_json_writer(w, &ctx->nft->output, set, NULL);
 }
 
-static json_t *do_list_sets_json(struct netlink_ctx *ctx, struct cmd *cmd)
+static int do_list_sets_json(struct netlink_ctx *ctx, struct json_writer *w,
+			     struct cmd *cmd)
 {
+	bool with_stats = ctx->nft->optimize_flags & NFT_OPTIMIZE_STATS;
 	struct output_ctx *octx = &ctx->nft->output;
-	json_t *root = json_array();
+	struct set_stats stats;
 	struct table *table;
 	struct set *set;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -1877,21 +2204,29 @@ static json_t *do_list_sets_json(struct netlink_ctx *ctx, struct cmd *cmd)
 			if (cmd->obj == CMD_OBJ_MAPS &&
 			    !map_is_literal(set->flags))
 				continue;
-			json_array_append_new(root, set_print_json(octx, set));
+			if (!with_stats) {
+				set_print_json_writer(w, octx, set, NULL);
+				continue;
+			}
+
+			if (netlink_count_setelems(ctx, &set->handle,
+						   &stats.elements) < 0)
+				return -1;
+			stats.memory = set_memory_estimate(set, stats.elements);
+			set_print_json_writer(w, octx, set, &stats);
 		}
 	}
 
-	return root;
+	return 0;
 }
 
-static json_t *do_list_obj_json(struct netlink_ctx *ctx,
-				struct cmd *cmd, uint32_t type)
+static void do_list_obj_json(struct netlink_ctx *ctx, struct json_writer *w,
+			     struct cmd *cmd, uint32_t type)
 {
-	json_t *root = json_array();
 	struct table *table;
 	struct obj *obj;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -1906,46 +2241,40 @@ static json_t *do_list_obj_json(struct netlink_ctx *ctx,
 			     strcmp(cmd->handle.obj.name, obj->handle.obj.name)))
 				continue;
 
-			json_array_append_new(root, obj_print_json(obj));
+			json_writer_value(w, obj_print_json(obj));
 		}
 	}
-
-	return root;
 }
 
-static json_t *do_list_flowtable_json(struct netlink_ctx *ctx,
-				      struct cmd *cmd, struct table *table)
+static void do_list_flowtable_json(struct netlink_ctx *ctx,
+				   struct json_writer *w, struct cmd *cmd,
+				   struct table *table)
 {
-	json_t *root = json_array();
 	struct flowtable *ft;
 
 	ft = ft_cache_find(table, cmd->handle.flowtable.name);
-	if (!ft)
-		return json_null();
-
-	json_array_append_new(root, flowtable_print_json(ft));
+	if (!ft) {
+		json_writer_value(w, json_null());
+		return;
+	}
 
-	return root;
+	json_writer_value(w, flowtable_print_json(ft));
 }
 
-static json_t *do_list_flowtables_json(struct netlink_ctx *ctx, struct cmd *cmd)
+static void do_list_flowtables_json(struct netlink_ctx *ctx,
+				    struct json_writer *w, struct cmd *cmd)
 {
-	json_t *root = json_array(), *tmp;
 	struct flowtable *flowtable;
 	struct table *table;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
 
-		list_for_each_entry(flowtable, &table->ft_cache.list, cache.list) {
-			tmp = flowtable_print_json(flowtable);
-			json_array_append_new(root, tmp);
-		}
+		list_for_each_entry(flowtable, &table->ft_cache.list, cache.list)
+			json_writer_value(w, flowtable_print_json(flowtable));
 	}
-
-	return root;
 }
 
 static json_t *generate_json_metainfo(void)
@@ -1958,95 +2287,87 @@ static json_t *generate_json_metainfo(void)
 
 int do_command_list_json(struct netlink_ctx *ctx, struct cmd *cmd)
 {
+	struct json_writer w = {
+		.fp	= ctx->nft->output.output_fp,
+		.cbor	= nft_output_cbor(&ctx->nft->output),
+	};
 	struct table *table = NULL;
-	json_t *root;
+	int ret = 0;
 
 	if (cmd->handle.table.name)
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 
+	json_writer_open(&w, '{');
+	json_writer_key(&w, "nftables");
+	json_writer_open(&w, '[');
+	json_writer_value(&w, generate_json_metainfo());
+
 	switch (cmd->obj) {
 	case CMD_OBJ_TABLE:
 		if (!cmd->handle.table.name) {
-			root = do_list_tables_json(ctx, cmd);
+			do_list_tables_json(ctx, &w, cmd);
 			break;
 		}
-		root = do_list_table_json(ctx, cmd, table);
+		ret = table_print_json_full(ctx, &w, table);
 		break;
 	case CMD_OBJ_CHAIN:
-		root = do_list_chain_json(ctx, cmd, table);
+		do_list_chain_json(ctx, &w, cmd, table);
 		break;
 	case CMD_OBJ_CHAINS:
-		root = do_list_chains_json(ctx, cmd);
+		do_list_chains_json(ctx, &w, cmd);
 		break;
 	case CMD_OBJ_SETS:
-		root = do_list_sets_json(ctx, cmd);
+	case CMD_OBJ_METERS:
+	case CMD_OBJ_MAPS:
+		ret = do_list_sets_json(ctx, &w, cmd);
 		break;
 	case CMD_OBJ_SET:
-		root = do_list_set_json(ctx, cmd, table);
+	case CMD_OBJ_METER:
+	case CMD_OBJ_MAP:
+		do_list_set_json(ctx, &w, cmd, table);
 		break;
 	case CMD_OBJ_RULES:
 	case CMD_OBJ_RULESET:
-		root = do_list_ruleset_json(ctx, cmd);
-		break;
-	case CMD_OBJ_METERS:
-		root = do_list_sets_json(ctx, cmd);
-		break;
-	case CMD_OBJ_METER:
-		root = do_list_set_json(ctx, cmd, table);
-		break;
-	case CMD_OBJ_MAPS:
-		root = do_list_sets_json(ctx, cmd);
-		break;
-	case CMD_OBJ_MAP:
-		root = do_list_set_json(ctx, cmd, table);
+		ret = do_list_ruleset_json(ctx, &w, cmd);
 		break;
 	case CMD_OBJ_COUNTER:
 	case CMD_OBJ_COUNTERS:
-		root = do_list_obj_json(ctx, cmd, NFT_OBJECT_COUNTER);
+		do_list_obj_json(ctx, &w, cmd, NFT_OBJECT_COUNTER);
 		break;
 	case CMD_OBJ_QUOTA:
 	case CMD_OBJ_QUOTAS:
-		root = do_list_obj_json(ctx, cmd, NFT_OBJECT_QUOTA);
+		do_list_obj_json(ctx, &w, cmd, NFT_OBJECT_QUOTA);
 		break;
 	case CMD_OBJ_CT_HELPER:
 	case CMD_OBJ_CT_HELPERS:
-		root = do_list_obj_json(ctx, cmd, NFT_OBJECT_CT_HELPER);
+		do_list_obj_json(ctx, &w, cmd, NFT_OBJECT_CT_HELPER);
 		break;
 	case CMD_OBJ_LIMIT:
 	case CMD_OBJ_LIMITS:
-		root = do_list_obj_json(ctx, cmd, NFT_OBJECT_LIMIT);
+		do_list_obj_json(ctx, &w, cmd, NFT_OBJECT_LIMIT);
 		break;
 	case CMD_OBJ_SECMARK:
 	case CMD_OBJ_SECMARKS:
-		root = do_list_obj_json(ctx, cmd, NFT_OBJECT_SECMARK);
+		do_list_obj_json(ctx, &w, cmd, NFT_OBJECT_SECMARK);
 		break;
 	case CMD_OBJ_FLOWTABLE:
-		root = do_list_flowtable_json(ctx, cmd, table);
+		do_list_flowtable_json(ctx, &w, cmd, table);
 		break;
 	case CMD_OBJ_FLOWTABLES:
-		root = do_list_flowtables_json(ctx, cmd);
+		do_list_flowtables_json(ctx, &w, cmd);
 		break;
 	default:
 		BUG("invalid command object type %u\n", cmd->obj);
 	}
 
-	if (!json_is_array(root)) {
-		json_t *tmp = json_array();
-
-		json_array_append_new(tmp, root);
-		root = tmp;
-	}
-
-	json_array_insert_new(root, 0, generate_json_metainfo());
-
-	root = json_pack("{s:o}", "nftables", root);
-	json_dumpf(root, ctx->nft->output.output_fp, 0);
-	json_decref(root);
-	fprintf(ctx->nft->output.output_fp, "\n");
-	fflush(ctx->nft->output.output_fp);
-	return 0;
+	json_writer_close(&w, ']');
+	json_writer_close(&w, '}');
+	if (!w.cbor)
+		fprintf(w.fp, "\n");
+	fflush(w.fp);
+	return ret;
 }
 
 static void monitor_print_json(struct netlink_mon_handler *monh,
@@ -2111,3 +2432,130 @@ void json_alloc_echo(struct nft_ctx *nft)
 	if (!nft->json_echo)
 		memory_allocation_error();
 }
+
+static json_t *chain_cost_json(const struct chain_cost *cost)
+{
+	return json_pack("{s:I, s:I, s:I, s:I, s:I}",
+			 "rules", (json_int_t)cost->rules,
+			 "expressions", (json_int_t)cost->exprs,
+			 "loads", (json_int_t)cost->loads,
+			 "lookups", (json_int_t)cost->lookups,
+			 "worst_rules", (json_int_t)cost->worst_rules);
+}
+
+void optimize_stats_print_json(struct output_ctx *octx,
+			       const struct list_head *stats)
+{
+	const struct optimize_stats *entry;
+	json_t *root, *tmp;
+
+	root = json_array();
+	list_for_each_entry(entry, stats, list) {
+		tmp = json_pack("{s:s, s:s, s:s, s:o, s:o}",
+				"family", entry->family,
+				"table", entry->table,
+				"name", entry->chain,
+				"before", chain_cost_json(&entry->before),
+				"after", chain_cost_json(&entry->after));
+		if (entry->hook)
+			json_object_set_new(tmp, "hook",
+					    json_string(entry->hook));
+
+		json_array_append_new(root, json_pack("{s:o}", "chain", tmp));
+	}
+
+	json_array_insert_new(root, 0, generate_json_metainfo());
+
+	root = json_pack("{s:o}", "optimize_stats", root);
+	json_dumpf(root, octx->output_fp, 0);
+	json_decref(root);
+	fprintf(octx->output_fp, "\n");
+	fflush(octx->output_fp);
+}
+
+static json_t *trace_aggr_entry_json(const struct trace_aggr_entry *entry)
+{
+	const char *verdict = trace_aggr_verdict(entry->verdict);
+	json_t *root;
+
+	root = json_pack("{s:s, s:s, s:s, s:I}",
+			 "family", family2str(entry->family),
+			 "table", entry->table,
+			 "chain", entry->chain,
+			 "hits", (json_int_t)entry->hits);
+
+	switch (entry->type) {
+	case NFT_TRACETYPE_RULE:
+		json_object_set_new(root, "handle",
+				    json_integer(entry->handle));
+		json_object_set_new(root, "verdict", json_string(verdict));
+		break;
+	case NFT_TRACETYPE_POLICY:
+		json_object_set_new(root, "policy", json_string(verdict));
+		break;
+	default:
+		json_object_set_new(root, "verdict", json_string(verdict));
+		break;
+	}
+
+	return root;
+}
+
+void trace_aggr_print_json(struct output_ctx *octx,
+			   const struct trace_aggr *aggr,
+			   struct trace_aggr_entry **entries)
+{
+	json_t *root, *rules, *verdicts, *tmp;
+	const char *verdict;
+	json_int_t hits;
+	unsigned int i;
+
+	rules = json_array();
+	verdicts = json_object();
+	for (i = 0; i < aggr->num_entries; i++) {
+		if (i < NFT_TRACE_AGGR_TOP)
+			json_array_append_new(rules,
+					      trace_aggr_entry_json(entries[i]));
+
+		verdict = trace_aggr_verdict(entries[i]->verdict);
+		tmp = json_object_get(verdicts, verdict);
+		hits = tmp ? json_integer_value(tmp) : 0;
+		json_object_set_new(verdicts, verdict,
+				    json_integer(hits + entries[i]->hits));
+	}
+
+	root = json_pack("{s:{s:I, s:I, s:i, s:o, s:o}}", "trace_aggregate",
+			 "interval", (json_int_t)(aggr->interval / 1000),
+			 "events", (json_int_t)aggr->events,
+			 "num_rules", aggr->num_entries,
+			 "rules", rules,
+			 "verdicts", verdicts);
+	json_dumpf(root, octx->output_fp, 0);
+	json_decref(root);
+	fprintf(octx->output_fp, "\n");
+}
+
+void elem_aggr_print_json(struct output_ctx *octx,
+			  const struct elem_aggr *aggr,
+			  struct elem_aggr_entry **entries)
+{
+	json_t *root, *sets;
+	unsigned int i;
+
+	sets = json_array();
+	for (i = 0; i < aggr->num_entries; i++)
+		json_array_append_new(sets,
+			json_pack("{s:s, s:s, s:s, s:I, s:I}",
+				  "family", family2str(entries[i]->family),
+				  "table", entries[i]->table,
+				  "name", entries[i]->set,
+				  "added", (json_int_t)entries[i]->added,
+				  "deleted", (json_int_t)entries[i]->deleted));
+
+	root = json_pack("{s:{s:I, s:o}}", "elements_aggregate",
+			 "interval", (json_int_t)(aggr->interval / 1000),
+			 "sets", sets);
+	json_dumpf(root, octx->output_fp, 0);
+	json_decref(root);
+	fprintf(octx->output_fp, "\n");
+}
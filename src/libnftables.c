@@ -15,28 +15,138 @@
 #include <utils.h>
 #include <iface.h>
 #include <cmd.h>
+#include <setelem_file.h>
+#include <resolve.h>
+#include <compile.h>
+#include <backup.h>
+#include <prepare.h>
+#include <async.h>
+#include <timing.h>
+#include <diff.h>
+#include <fingerprint.h>
+#include <uring.h>
+#include <xt.h>
+#include <journal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <libgen.h>
+#include <linux/netfilter.h>
+
+/* Element updates can be committed in several transactions, see
+ * NFT_CTX_INPUT_SPLIT_ELEMENTS.
+ */
+static bool nft_cmd_splittable(const struct cmd *cmd)
+{
+	switch (cmd->op) {
+	case CMD_ADD:
+	case CMD_CREATE:
+	case CMD_DELETE:
+	case CMD_DESTROY:
+		return cmd->obj == CMD_OBJ_ELEMENTS ||
+		       cmd->obj == CMD_OBJ_SETELEMS;
+	default:
+		return false;
+	}
+}
+
+static int nft_netlink_talk(struct netlink_ctx *ctx, struct list_head *err_list,
+			    uint32_t num_cmds, uint32_t atomic_seq)
+{
+	struct mnl_split_stats stats;
+	int ret;
+
+	if (!nft_input_split_elements(&ctx->nft->input))
+		return mnl_batch_talk(ctx, err_list, num_cmds);
+
+	ret = mnl_batch_talk_split(ctx, err_list, num_cmds, atomic_seq, &stats);
+	if (stats.total <= 1)
+		return ret;
+
+	if (ret < 0 || !list_empty(err_list)) {
+		int err = errno;
+
+		netlink_io_error(ctx, NULL,
+				 "Batch split into %u transactions, %u committed before this one failed",
+				 stats.total, stats.sent - 1);
+		errno = err;
+		return ret;
+	}
+
+	erec_queue(warning(&internal_location,
+			   "Batch split into %u transactions, it exceeds the socket send buffer",
+			   stats.total), ctx->msgs);
+	return 0;
+}
+
+/* Replace the sequence number recorded by netlink_echo_callback() by the
+ * position of the input command that sent the message.
+ */
+static void nft_echo_handles_resolve(struct nft_ctx *nft,
+				     struct list_head *cmds)
+{
+	struct cmd *cmd = list_first_entry(cmds, struct cmd, list);
+	struct nft_echo_handle echo;
+	unsigned int i, num = 0;
+
+	for (i = 0; i < nft->echo.num; i++) {
+		echo = nft->echo.handles[i];
+
+		/* echoed messages follow the batch order, rewind otherwise. */
+		if (&cmd->list == cmds || echo.cmd < cmd->seqnum_from)
+			cmd = list_first_entry(cmds, struct cmd, list);
+
+		list_for_each_entry_from(cmd, cmds, list) {
+			if (echo.cmd <= cmd->seqnum_to)
+				break;
+		}
+		if (&cmd->list == cmds || echo.cmd < cmd->seqnum_from)
+			continue;
+
+		echo.cmd = cmd->index;
+		nft->echo.handles[num++] = echo;
+	}
+	nft->echo.num = num;
+}
+
+#define NFT_NETLINK_ERRORS_MAX	100
 
 static int nft_netlink(struct nft_ctx *nft,
 		       struct list_head *cmds, struct list_head *msgs)
 {
 	uint32_t batch_seqnum, seqnum = 0, last_seqnum = UINT32_MAX, num_cmds = 0;
+	uint32_t num_errs = 0;
+	uint32_t atomic_seq = 0;
 	struct netlink_ctx ctx = {
 		.nft  = nft,
 		.msgs = msgs,
 		.list = LIST_HEAD_INIT(ctx.list),
-		.batch = mnl_batch_init(),
+		.batch = mnl_batch_init(nft),
 	};
+	struct nft_fingerprint fingerprint = {};
 	struct cmd *cmd;
 	struct mnl_err *err, *tmp;
 	LIST_HEAD(err_list);
+	struct nft_timing_span span;
+	bool timing;
 	int ret = 0;
 
+	nft->echo.num = 0;
 	if (list_empty(cmds))
 		goto out;
 
+	if (nft_input_if_changed(&nft->input) && nft->fingerprint_flushed &&
+	    !nft->check && !nft->compile.output)
+		ctx.fingerprint = &fingerprint;
+
+	if (nft->compile.output && nft_compile_check(nft, cmds, msgs) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	timing = nft_timing_start(nft, NFT_TIMING_BATCH, &span);
 	batch_seqnum = mnl_batch_begin(ctx.batch, mnl_seqnum_inc(&seqnum));
 	list_for_each_entry(cmd, cmds, list) {
 		ctx.seqnum = cmd->seqnum_from = mnl_seqnum_inc(&seqnum);
@@ -45,19 +155,38 @@ static int nft_netlink(struct nft_ctx *nft,
 			netlink_io_error(&ctx, &cmd->location,
 					 "Could not process rule: %s",
 					 strerror(errno));
+			if (timing)
+				nft_timing_stop(nft, &span, num_cmds);
 			goto out;
 		}
 		seqnum = cmd->seqnum_to = ctx.seqnum;
 		mnl_seqnum_inc(&seqnum);
 		num_cmds++;
+		if (!nft_cmd_splittable(cmd))
+			atomic_seq = cmd->seqnum_to;
 	}
 	if (!nft->check)
 		mnl_batch_end(ctx.batch, mnl_seqnum_inc(&seqnum));
+	if (timing)
+		nft_timing_stop(nft, &span, num_cmds);
 
 	if (!mnl_batch_ready(ctx.batch))
 		goto out;
 
-	ret = mnl_batch_talk(&ctx, &err_list, num_cmds);
+	if (nft->compile.output) {
+		if (!nft->check)
+			ret = nft_compile_write(nft, ctx.batch, cmds, msgs);
+		goto out;
+	}
+
+	if (ctx.fingerprint && nft_fingerprint_check(&ctx, cmds))
+		goto out;
+
+	/* the batch is only built, against the offline ruleset. */
+	if (nft->offline.file)
+		goto out;
+
+	ret = nft_netlink_talk(&ctx, &err_list, num_cmds, atomic_seq);
 	if (ret < 0) {
 		if (ctx.maybe_emsgsize && errno == EMSGSIZE) {
 			netlink_io_error(&ctx, NULL,
@@ -75,6 +204,16 @@ static int nft_netlink(struct nft_ctx *nft,
 		ret = -1;
 
 	list_for_each_entry_safe(err, tmp, &err_list, head) {
+		/* a large batch may fail on many of its elements, only report
+		 * the first errors and how many there were in total.
+		 */
+		if (num_errs++ >= NFT_NETLINK_ERRORS_MAX) {
+			errno = err->err;
+			if (err->seqnum != batch_seqnum)
+				mnl_err_list_free(err);
+			continue;
+		}
+
 		/* cmd seqnums are monotonic: only reset the starting position
 		 * if the error seqnum is lower than the previous one.
 		 */
@@ -101,6 +240,11 @@ static int nft_netlink(struct nft_ctx *nft,
 			last_seqnum = UINT32_MAX;
 		}
 	}
+	if (num_errs > NFT_NETLINK_ERRORS_MAX)
+		netlink_io_error(&ctx, NULL,
+				 "Only the first %u of %u errors are reported",
+				 NFT_NETLINK_ERRORS_MAX, num_errs);
+
 	/* nfnetlink uses the first netlink message header in the batch whose
 	 * sequence number is zero to report for EOPNOTSUPP and EPERM errors in
 	 * some scenarios. Now it is safe to release pending errors here.
@@ -108,25 +252,18 @@ static int nft_netlink(struct nft_ctx *nft,
 	list_for_each_entry_safe(err, tmp, &err_list, head)
 		mnl_err_list_free(err);
 out:
+	if (nft->echo.num)
+		nft_echo_handles_resolve(nft, cmds);
+	nft_fingerprint_free(&fingerprint);
+	nft->fingerprint_flushed = 0;
 	mnl_batch_reset(ctx.batch);
 	return ret;
 }
 
-static void nft_init(struct nft_ctx *ctx)
-{
-	mark_table_init(ctx);
-	realm_table_rt_init(ctx);
-	devgroup_table_init(ctx);
-	ct_label_table_init(ctx);
-}
-
 static void nft_exit(struct nft_ctx *ctx)
 {
-	cache_free(&ctx->cache.table_cache);
-	ct_label_table_exit(ctx);
-	realm_table_rt_exit(ctx);
-	devgroup_table_exit(ctx);
-	mark_table_exit(ctx);
+	netdb_table_exit(ctx);
+	xt_xlate_cache_free(&ctx->output);
 }
 
 EXPORT_SYMBOL(nft_ctx_add_var);
@@ -194,25 +331,23 @@ void nft_ctx_clear_include_paths(struct nft_ctx *ctx)
 	ctx->include_paths = NULL;
 }
 
-EXPORT_SYMBOL(nft_ctx_new);
-struct nft_ctx *nft_ctx_new(uint32_t flags)
+static struct nft_ctx *nft_ctx_alloc(uint32_t flags)
 {
 	struct nft_ctx *ctx;
 
-#ifdef HAVE_LIBXTABLES
-	xt_init();
-#endif
-
 	ctx = xzalloc(sizeof(struct nft_ctx));
-	nft_init(ctx);
 
 	ctx->state = xzalloc(sizeof(struct parser_state));
 	ctx->parser_max_errors	= 10;
-	cache_init(&ctx->cache.table_cache);
+	ctx->jobs		= 1;
 	ctx->top_scope = scope_alloc();
 	ctx->flags = flags;
 	ctx->output.output_fp = stdout;
 	ctx->output.error_fp = stderr;
+	ctx->resolver = nft_resolver_alloc();
+	ctx->output.resolver = ctx->resolver;
+	ctx->timing = xzalloc(sizeof(struct nft_timing));
+	ctx->dep_cache = payload_dep_cache_alloc();
 	init_list_head(&ctx->vars_ctx.indesc_list);
 
 	ctx->nf_sock = nft_mnl_socket_open();
@@ -220,6 +355,57 @@ struct nft_ctx *nft_ctx_new(uint32_t flags)
 	return ctx;
 }
 
+EXPORT_SYMBOL(nft_ctx_new);
+struct nft_ctx *nft_ctx_new(uint32_t flags)
+{
+	struct nft_ctx *ctx;
+
+#ifdef HAVE_LIBXTABLES
+	xt_init();
+#endif
+
+	ctx = nft_ctx_alloc(flags);
+	ctx->cache = nft_cache_alloc();
+	if (flags & NFT_CTX_PERSISTENT_CACHE) {
+		ctx->ev_sock = nft_mnl_event_socket_open();
+		ctx->journal = nft_journal_alloc();
+		iface_cache_hold();
+	}
+
+	return ctx;
+}
+
+/* Sessions share a read-only snapshot of the ruleset with the other sessions
+ * of @parent, everything else lives in the session: netlink socket, parser,
+ * output buffers and resolver. Streamed listings, persistent cache and echo
+ * modify the cache while printing, sessions do not support them.
+ */
+EXPORT_SYMBOL(nft_ctx_session_new);
+struct nft_ctx *nft_ctx_session_new(struct nft_ctx *parent)
+{
+	uint32_t flags = parent->flags & ~(NFT_CTX_STREAM_LIST |
+					   NFT_CTX_PERSISTENT_CACHE);
+	struct nft_ctx *ctx;
+
+	if (parent->parent)
+		return NULL;
+
+	if (!parent->shared)
+		parent->shared = nft_cache_shared_alloc();
+
+	ctx = nft_ctx_alloc(flags);
+	ctx->parent = parent;
+	ctx->shared = parent->shared;
+	ctx->parser_max_errors = parent->parser_max_errors;
+	ctx->debug_mask = parent->debug_mask;
+	ctx->input.flags = parent->input.flags;
+	ctx->output.flags = parent->output.flags & ~NFT_CTX_OUTPUT_ECHO;
+
+	return ctx;
+}
+
+#define NFT_OUTPUT_BUFSIZ	65536
+
 static ssize_t cookie_write(void *cptr, const char *buf, size_t buflen)
 {
 	struct cookie *cookie = cptr;
@@ -243,12 +429,48 @@ static ssize_t cookie_write(void *cptr, const char *buf, size_t buflen)
 	return buflen;
 }
 
+/* Pass buffered output to the callback, see nft_ctx_set_output_cb(). */
+static int cookie_cb_flush(struct cookie *cookie)
+{
+	int ret;
+
+	if (!cookie->pos)
+		return 0;
+
+	ret = cookie->cb(cookie->buf, cookie->pos, cookie->cb_data);
+	cookie->pos = 0;
+
+	return ret;
+}
+
+static ssize_t cookie_cb_write(void *cptr, const char *buf, size_t buflen)
+{
+	struct cookie *cookie = cptr;
+	size_t len, done = 0;
+
+	while (done < buflen) {
+		len = min(buflen - done, cookie->buflen - cookie->pos);
+		memcpy(cookie->buf + cookie->pos, buf + done, len);
+		cookie->pos += len;
+		done += len;
+
+		if (cookie->pos == cookie->buflen &&
+		    cookie_cb_flush(cookie) < 0)
+			return -1;
+	}
+
+	return buflen;
+}
+
 static int init_cookie(struct cookie *cookie)
 {
 	cookie_io_functions_t cookie_fops = {
 		.write = cookie_write,
 	};
 
+	if (cookie->cb)
+		return 1;
+
 	if (cookie->orig_fp) { /* just rewind buffer */
 		if (cookie->buflen) {
 			cookie->pos = 0;
@@ -265,6 +487,8 @@ static int init_cookie(struct cookie *cookie)
 		cookie->orig_fp = NULL;
 		return 1;
 	}
+	/* the buffer grows in cookie_write() only once this one is full */
+	setvbuf(cookie->fp, NULL, _IOFBF, NFT_OUTPUT_BUFSIZ);
 
 	return 0;
 }
@@ -275,6 +499,11 @@ static int exit_cookie(struct cookie *cookie)
 		return 1;
 
 	fclose(cookie->fp);
+	if (cookie->cb) {
+		cookie_cb_flush(cookie);
+		cookie->cb = NULL;
+		cookie->cb_data = NULL;
+	}
 	cookie->fp = cookie->orig_fp;
 	cookie->orig_fp = NULL;
 	free(cookie->buf);
@@ -310,6 +539,9 @@ int nft_ctx_unbuffer_error(struct nft_ctx *ctx)
 
 static const char *get_cookie_buffer(struct cookie *cookie)
 {
+	if (cookie->cb)
+		return "";
+
 	fflush(cookie->fp);
 
 	/* This is a bit tricky: Rewind the buffer for future use and return
@@ -324,33 +556,133 @@ static const char *get_cookie_buffer(struct cookie *cookie)
 	return cookie->buf;
 }
 
+#define NFT_OUTPUT_CB_CHUNK	65536
+
+EXPORT_SYMBOL(nft_ctx_set_output_cb);
+int nft_ctx_set_output_cb(struct nft_ctx *ctx, nft_output_cb_t cb, void *data)
+{
+	cookie_io_functions_t cookie_fops = {
+		.write = cookie_cb_write,
+	};
+	struct cookie *cookie = &ctx->output.output_cookie;
+
+	if (!cb) {
+		if (!cookie->cb)
+			return 1;
+		return exit_cookie(cookie);
+	}
+
+	if (cookie->cb) {
+		cookie_cb_flush(cookie);
+		cookie->cb = cb;
+		cookie->cb_data = data;
+		return 0;
+	}
+
+	/* buffered output, call nft_ctx_unbuffer_output() first */
+	if (cookie->orig_fp)
+		return 1;
+
+	cookie->orig_fp = cookie->fp;
+	cookie->fp = fopencookie(cookie, "w", cookie_fops);
+	if (!cookie->fp) {
+		cookie->fp = cookie->orig_fp;
+		cookie->orig_fp = NULL;
+		return 1;
+	}
+	/* output is collected in chunks below, no need for stdio buffering */
+	setvbuf(cookie->fp, NULL, _IONBF, 0);
+
+	cookie->buf = xmalloc(NFT_OUTPUT_CB_CHUNK);
+	cookie->buflen = NFT_OUTPUT_CB_CHUNK;
+	cookie->pos = 0;
+	cookie->cb = cb;
+	cookie->cb_data = data;
+
+	return 0;
+}
+
+/* Flush the output once a command run is done, and hand over the last
+ * partial chunk to the output callback.
+ */
+static void nft_ctx_flush_output(struct nft_ctx *ctx)
+{
+	struct cookie *cookie = &ctx->output.output_cookie;
+
+	nft_print_flush(&ctx->output);
+	if (cookie->cb)
+		cookie_cb_flush(cookie);
+}
+
 EXPORT_SYMBOL(nft_ctx_get_output_buffer);
 const char *nft_ctx_get_output_buffer(struct nft_ctx *ctx)
 {
 	return get_cookie_buffer(&ctx->output.output_cookie);
 }
 
+EXPORT_SYMBOL(nft_ctx_get_echo_handles);
+const struct nft_echo_handle *nft_ctx_get_echo_handles(struct nft_ctx *ctx,
+							unsigned int *num)
+{
+	*num = ctx->echo.num;
+	return ctx->echo.handles;
+}
+
 EXPORT_SYMBOL(nft_ctx_get_error_buffer);
 const char *nft_ctx_get_error_buffer(struct nft_ctx *ctx)
 {
 	return get_cookie_buffer(&ctx->output.error_cookie);
 }
 
+static void nft_offline_release(struct nft_ctx *nft)
+{
+	if (nft->offline.scanner)
+		scanner_free(nft->offline.scanner);
+	free(nft->offline.state);
+	nft->offline.scanner = NULL;
+	nft->offline.state = NULL;
+}
+
 EXPORT_SYMBOL(nft_ctx_free);
 void nft_ctx_free(struct nft_ctx *ctx)
 {
+	if (ctx->async)
+		nft_async_ctx_free(ctx->async);
+
 	mnl_socket_close(ctx->nf_sock);
+	if (ctx->ev_sock)
+		mnl_socket_close(ctx->ev_sock);
+	if (ctx->journal)
+		nft_journal_free(ctx->journal);
 
 	exit_cookie(&ctx->output.output_cookie);
 	exit_cookie(&ctx->output.error_cookie);
-	iface_cache_release();
-	nft_cache_release(&ctx->cache);
+	if (ctx->flags & NFT_CTX_PERSISTENT_CACHE && !ctx->parent)
+		iface_cache_put();
+	else
+		iface_cache_release();
+	if (ctx->cache)
+		nft_cache_free(ctx->cache);
+	if (ctx->shared && !ctx->parent)
+		nft_cache_shared_free(ctx->shared);
+	nft_offline_release(ctx);
+	free(ctx->offline.file);
+	scanner_include_cache_free(ctx);
+	nft_resolver_free(ctx->resolver);
+	payload_dep_cache_free(ctx->dep_cache);
+	mnl_batch_pool_free(ctx->batch_pool);
+	nft_uring_free(ctx->uring);
+	free(ctx->timing);
+	free(ctx->echo.handles);
+	free(ctx->compile.output);
 	nft_ctx_clear_vars(ctx);
 	nft_ctx_clear_include_paths(ctx);
 	scope_free(ctx->top_scope);
 	free(ctx->state);
 	nft_exit(ctx);
 	free(ctx);
+	stmt_node_cache_release();
+	expr_node_cache_release();
 }
 
 EXPORT_SYMBOL(nft_ctx_set_output);
@@ -403,6 +735,52 @@ void nft_ctx_set_optimize(struct nft_ctx *ctx, uint32_t flags)
 	ctx->optimize_flags = flags;
 }
 
+EXPORT_SYMBOL(nft_ctx_get_jobs);
+unsigned int nft_ctx_get_jobs(struct nft_ctx *ctx)
+{
+	return ctx->jobs;
+}
+
+EXPORT_SYMBOL(nft_ctx_set_jobs);
+void nft_ctx_set_jobs(struct nft_ctx *ctx, unsigned int jobs)
+{
+	ctx->jobs = jobs ? jobs : 1;
+}
+
+EXPORT_SYMBOL(nft_ctx_get_compile_output);
+const char *nft_ctx_get_compile_output(struct nft_ctx *ctx)
+{
+	return ctx->compile.output;
+}
+
+EXPORT_SYMBOL(nft_ctx_set_compile_output);
+int nft_ctx_set_compile_output(struct nft_ctx *ctx, const char *filename)
+{
+	free(ctx->compile.output);
+	ctx->compile.output = filename ? xstrdup(filename) : NULL;
+
+	return 0;
+}
+
+EXPORT_SYMBOL(nft_ctx_get_offline);
+const char *nft_ctx_get_offline(struct nft_ctx *ctx)
+{
+	return ctx->offline.file;
+}
+
+EXPORT_SYMBOL(nft_ctx_set_offline);
+int nft_ctx_set_offline(struct nft_ctx *ctx, const char *filename)
+{
+	if (ctx->parent)
+		return -1;
+
+	free(ctx->offline.file);
+	ctx->offline.file = filename ? xstrdup(filename) : NULL;
+	nft_cache_release(ctx->cache);
+
+	return 0;
+}
+
 EXPORT_SYMBOL(nft_ctx_input_get_flags);
 unsigned int nft_ctx_input_get_flags(struct nft_ctx *ctx)
 {
@@ -472,16 +850,19 @@ static char *stdin_to_buffer(void)
 
 	buf = xmalloc(bufsiz);
 
-	numbytes = read(STDIN_FILENO, buf, bufsiz);
+	/* two trailing NULs, see scanner_push_buffer(). */
+	numbytes = read(STDIN_FILENO, buf, bufsiz - 2);
 	while (numbytes > 0) {
 		consumed += numbytes;
-		if (consumed == bufsiz) {
+		if (consumed == bufsiz - 2) {
 			bufsiz *= 2;
 			buf = xrealloc(buf, bufsiz);
 		}
-		numbytes = read(STDIN_FILENO, buf + consumed, bufsiz - consumed);
+		numbytes = read(STDIN_FILENO, buf + consumed,
+				bufsiz - consumed - 2);
 	}
 	buf[consumed] = '\0';
+	buf[consumed + 1] = '\0';
 
 	return buf;
 }
@@ -512,25 +893,142 @@ static int nft_parse_bison_filename(struct nft_ctx *nft, const char *filename,
 	return 0;
 }
 
-static int nft_evaluate(struct nft_ctx *nft, struct list_head *msgs,
-			struct list_head *cmds)
+static int nft_session_cache_get(struct nft_ctx *nft, struct list_head *msgs,
+				 struct list_head *cmds)
 {
-	struct nft_cache_filter *filter;
-	struct cmd *cmd, *next;
-	unsigned int flags;
-	int err = 0;
+	struct cmd *cmd;
 
-	filter = nft_cache_filter_init();
-	if (nft_cache_evaluate(nft, cmds, msgs, filter, &flags) < 0) {
-		nft_cache_filter_fini(filter);
+	list_for_each_entry(cmd, cmds, list) {
+		if (cmd->op == CMD_LIST)
+			continue;
+
+		erec_queue(error(&cmd->location,
+				 "only list commands are supported in sessions"),
+			   msgs);
 		return -1;
 	}
-	if (nft_cache_update(nft, flags, msgs, filter) < 0) {
-		nft_cache_filter_fini(filter);
-		return -1;
+
+	return nft_cache_snapshot_get(nft, msgs);
+}
+
+/* Variables are shared by all the rules that refer to them. */
+static bool nft_cmds_have_symbols(const struct nft_ctx *nft,
+				  const struct list_head *cmds)
+{
+	const struct cmd *cmd;
+
+	if (!list_empty(&nft->state->scopes[0]->symbols))
+		return true;
+
+	list_for_each_entry(cmd, cmds, list) {
+		switch (cmd->obj) {
+		case CMD_OBJ_TABLE:
+			if (cmd->table &&
+			    !list_empty(&cmd->table->scope.symbols))
+				return true;
+			break;
+		case CMD_OBJ_CHAIN:
+			if (cmd->chain &&
+			    !list_empty(&cmd->chain->scope.symbols))
+				return true;
+			break;
+		default:
+			break;
+		}
 	}
 
-	nft_cache_filter_fini(filter);
+	return false;
+}
+
+/* Rules only refer to objects of their own table. */
+static bool nft_cmd_eval_parallel(const struct cmd *cmd)
+{
+	switch (cmd->op) {
+	case CMD_ADD:
+	case CMD_CREATE:
+	case CMD_INSERT:
+		break;
+	default:
+		return false;
+	}
+
+	return cmd->obj == CMD_OBJ_RULE && cmd->handle.table.name;
+}
+
+static void nft_erec_list_free(struct list_head *msgs)
+{
+	struct error_record *erec, *next;
+
+	list_for_each_entry_safe(erec, next, msgs, list) {
+		list_del(&erec->list);
+		erec_destroy(erec);
+	}
+}
+
+/*
+ * Evaluate the run of rule commands starting at @cmdp from several threads,
+ * then put commands and errors back in command order, as if the commands had
+ * been evaluated one after another. @cmdp is left at the command after the
+ * run.
+ */
+static int nft_evaluate_run(struct nft_ctx *nft, struct list_head *msgs,
+			    struct list_head *cmds, struct cmd **cmdp,
+			    unsigned int *num_cmds)
+{
+	struct cmd *cmd = *cmdp, *next;
+	struct nft_eval_slot *slots;
+	unsigned int num = 0, i;
+	int err = 0;
+
+	for (next = cmd; &next->list != cmds && nft_cmd_eval_parallel(next);
+	     next = list_next_entry(next, list))
+		num++;
+
+	slots = xmalloc_array(num, sizeof(*slots));
+	for (i = 0; i < num; i++, cmd = next) {
+		next = list_next_entry(cmd, list);
+		slots[i].cmd = cmd;
+		slots[i].err = 0;
+		init_list_head(&slots[i].cmds);
+		init_list_head(&slots[i].msgs);
+		list_move_tail(&cmd->list, &slots[i].cmds);
+	}
+
+	nft_eval_parallel(nft, slots, num);
+
+	for (i = 0; i < num; i++) {
+		list_splice_tail_init(&slots[i].cmds, &cmd->list);
+		if (err < 0) {
+			nft_erec_list_free(&slots[i].msgs);
+			continue;
+		}
+
+		(*num_cmds)++;
+		list_splice_tail_init(&slots[i].msgs, msgs);
+		if (slots[i].err < 0 &&
+		    ++nft->state->nerrs == nft->parser_max_errors)
+			err = -1;
+	}
+
+	free(slots);
+	*cmdp = cmd;
+
+	return err;
+}
+
+static int nft_evaluate_cmds(struct nft_ctx *nft, struct list_head *msgs,
+			     struct list_head *cmds)
+{
+	unsigned int num_cmds = 0, index = 0;
+	struct cmd *cmd, *next;
+	struct nft_timing_span span;
+	bool timing, parallel;
+	int err = 0;
+
+	timing = nft_timing_start(nft, NFT_TIMING_EVAL, &span);
+
+	list_for_each_entry(cmd, cmds, list)
+		cmd->index = index++;
 
 	list_for_each_entry(cmd, cmds, list) {
 		if (cmd->op != CMD_ADD &&
@@ -540,85 +1038,1358 @@ static int nft_evaluate(struct nft_ctx *nft, struct list_head *msgs,
 		nft_cmd_expand(cmd);
 	}
 
-	list_for_each_entry_safe(cmd, next, cmds, list) {
+	nft_resolver_prefetch(nft, cmds);
+
+	parallel = nft->jobs > 1 && !nft->debug_mask &&
+		   !nft_cmds_have_symbols(nft, cmds);
+
+	nft->anon_sets = anon_set_cache_alloc();
+
+	cmd = list_first_entry(cmds, struct cmd, list);
+	while (&cmd->list != cmds) {
 		struct eval_ctx ectx = {
 			.nft	= nft,
 			.msgs	= msgs,
 		};
 
+		if (parallel && nft_cmd_eval_parallel(cmd)) {
+			err = nft_evaluate_run(nft, msgs, cmds, &cmd, &num_cmds);
+			if (err < 0)
+				break;
+			continue;
+		}
+
+		next = list_next_entry(cmd, list);
+		num_cmds++;
 		if (cmd_evaluate(&ectx, cmd) < 0 &&
 		    ++nft->state->nerrs == nft->parser_max_errors) {
 			err = -1;
 			break;
 		}
+		cmd = next;
 	}
 
+	anon_set_cache_free(nft->anon_sets);
+	nft->anon_sets = NULL;
+
+	if (timing)
+		nft_timing_stop(nft, &span, num_cmds);
+
 	if (err < 0 || nft->state->nerrs)
 		return -1;
 
 	return 0;
 }
 
-EXPORT_SYMBOL(nft_run_cmd_from_buffer);
-int nft_run_cmd_from_buffer(struct nft_ctx *nft, const char *buf)
+static bool nft_offline_is_json(const char *filename)
 {
-	int rc = -EINVAL, parser_rc;
-	struct cmd *cmd, *next;
-	LIST_HEAD(msgs);
-	LIST_HEAD(cmds);
-	char *nlbuf;
+	FILE *fp;
+	int c;
 
-	nlbuf = xzalloc(strlen(buf) + 2);
-	sprintf(nlbuf, "%s\n", buf);
+	fp = fopen(filename, "r");
+	if (!fp)
+		return false;
 
-	if (nft_output_json(&nft->output) || nft_input_json(&nft->input))
-		rc = nft_parse_json_buffer(nft, nlbuf, &msgs, &cmds);
-	if (rc == -EINVAL)
-		rc = nft_parse_bison_buffer(nft, nlbuf, &msgs, &cmds,
-					    &indesc_cmdline);
+	do {
+		c = fgetc(fp);
+	} while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+	fclose(fp);
 
-	parser_rc = rc;
+	return c == '{';
+}
+
+/* Rules are moved out of their chains when table blocks are expanded, put
+ * them back as they would be after fetching the ruleset.
+ */
+static void nft_offline_rules_attach(struct nft_ctx *nft,
+				     struct list_head *cmds)
+{
+	struct table *table;
+	struct chain *chain;
+	struct cmd *cmd;
+
+	list_for_each_entry(cmd, cmds, list) {
+		if (cmd->op != CMD_ADD || cmd->obj != CMD_OBJ_RULE)
+			continue;
+
+		table = table_cache_find(&nft->cache->table_cache,
+					 cmd->handle.table.name,
+					 cmd->handle.family);
+		if (!table)
+			continue;
+
+		chain = chain_cache_find(table, cmd->handle.chain.name);
+		if (!chain)
+			continue;
+
+		list_add_tail(&rule_get(cmd->rule)->list, &chain->rules);
+	}
+}
+
+/* The cache is built from the ruleset listing in the offline file instead of
+ * the kernel: its commands are parsed and evaluated against an empty cache,
+ * which adds every object they declare. Objects keep locations in the file,
+ * its scanner lives as long as they do.
+ */
+static int nft_offline_cache_get(struct nft_ctx *nft, struct list_head *msgs)
+{
+	struct parser_state *state = nft->state;
+	const char *stdin_buf = nft->stdin_buf;
+	void *scanner = nft->scanner;
+	struct cmd *cmd, *next;
+	LIST_HEAD(cmds);
+	int ret = -EINVAL;
+
+	if (nft->cache->genid)
+		return 0;
+
+	nft_offline_release(nft);
+	nft->state = xzalloc(sizeof(struct parser_state));
+	nft->scanner = NULL;
+	nft->stdin_buf = NULL;
+
+	if (nft_offline_is_json(nft->offline.file))
+		ret = nft_parse_json_filename(nft, nft->offline.file, msgs,
+					      &cmds);
+	if (ret == -EINVAL) {
+		parser_init(nft, nft->state, msgs, &cmds, nft->top_scope);
+		nft->scanner = scanner_init(nft->state);
+		ret = scanner_read_file(nft, nft->offline.file,
+					&internal_location);
+		if (ret == 0)
+			ret = nft_parse(nft, nft->scanner, nft->state);
+		if (ret == 0 && nft->state->nerrs > 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		ret = nft_evaluate_cmds(nft, msgs, &cmds);
+	if (ret == 0)
+		nft_offline_rules_attach(nft, &cmds);
+
+	list_for_each_entry_safe(cmd, next, &cmds, list) {
+		list_del(&cmd->list);
+		cmd_free(cmd);
+	}
+
+	nft->offline.state = nft->state;
+	nft->offline.scanner = nft->scanner;
+	nft->state = state;
+	nft->scanner = scanner;
+	nft->stdin_buf = stdin_buf;
+
+	if (ret != 0) {
+		nft_cache_release(nft->cache);
+		return -1;
+	}
+
+	/* complete, nothing is fetched from the kernel. */
+	nft->cache->genid = 1;
+	nft->cache->flags = NFT_CACHE_FULL;
+
+	return 0;
+}
+
+static int nft_cache_get(struct nft_ctx *nft, struct list_head *msgs,
+			 struct list_head *cmds)
+{
+	struct nft_cache_filter *filter;
+	unsigned int flags;
+	int ret;
+
+	if (nft->parent)
+		return nft_session_cache_get(nft, msgs, cmds);
+	if (nft->offline.file)
+		return nft_offline_cache_get(nft, msgs);
+
+	filter = nft_cache_filter_init();
+	ret = nft_cache_evaluate(nft, cmds, msgs, filter, &flags);
+	if (ret == 0)
+		ret = nft_cache_update(nft, flags, msgs, filter);
+
+	nft_cache_filter_fini(filter);
+
+	return ret;
+}
+
+/* Sessions drop their reference on the shared snapshot after each run. */
+static void nft_cache_put(struct nft_ctx *nft, bool release)
+{
+	if (nft->parent)
+		nft_cache_snapshot_put(nft);
+	else if (release)
+		nft_cache_release(nft->cache);
+}
+
+static int nft_evaluate(struct nft_ctx *nft, struct list_head *msgs,
+			struct list_head *cmds)
+{
+	struct nft_timing_span span;
+	bool timing;
+	int ret;
+
+	if (nft_input_diff(&nft->input) &&
+	    nft_diff_prepare(nft, msgs, cmds) < 0)
+		return -1;
+	if (nft_input_if_changed(&nft->input) &&
+	    nft_fingerprint_prepare(nft, msgs, cmds) < 0)
+		return -1;
+
+	timing = nft_timing_start(nft, NFT_TIMING_CACHE, &span);
+	ret = nft_cache_get(nft, msgs, cmds);
+	if (timing)
+		nft_timing_stop(nft, &span, 1);
+	if (ret < 0)
+		return -1;
+
+	ret = nft_evaluate_cmds(nft, msgs, cmds);
+	if (ret < 0 || !nft_input_diff(&nft->input))
+		return ret;
+
+	return nft_diff(nft, msgs, cmds);
+}
+
+EXPORT_SYMBOL(nft_run_cmd_from_buffer);
+int nft_run_cmd_from_buffer(struct nft_ctx *nft, const char *buf)
+{
+	int rc = -EINVAL, parser_rc;
+	struct cmd *cmd, *next;
+	struct nft_timing_span span;
+	LIST_HEAD(msgs);
+	LIST_HEAD(cmds);
+	char *nlbuf;
+	bool timing;
+
+	nlbuf = xzalloc(strlen(buf) + 2);
+	sprintf(nlbuf, "%s\n", buf);
+
+	nft_timing_reset(nft);
+	nft->echo.num = 0;
+	timing = nft_timing_start(nft, NFT_TIMING_PARSE, &span);
+	if (nft_output_json(&nft->output) || nft_input_json(&nft->input))
+		rc = nft_parse_json_buffer(nft, nlbuf, &msgs, &cmds);
+	if (rc == -EINVAL)
+		rc = nft_parse_bison_buffer(nft, nlbuf, &msgs, &cmds,
+					    &indesc_cmdline);
+	if (timing)
+		nft_timing_stop(nft, &span, 1);
+
+	parser_rc = rc;
+
+	rc = nft_evaluate(nft, &msgs, &cmds);
+	if (rc < 0) {
+		if (errno == EPERM) {
+			fprintf(stderr, "%s (you must be root)\n",
+				strerror(errno));
+		}
+		goto err;
+	}
+
+	if (parser_rc) {
+		rc = parser_rc;
+		goto err;
+	}
+
+	if (nft_netlink(nft, &cmds, &msgs) != 0)
+		rc = -1;
+err:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	list_for_each_entry_safe(cmd, next, &cmds, list) {
+		list_del(&cmd->list);
+		cmd_free(cmd);
+	}
+	iface_cache_release();
+	if (nft->scanner) {
+		scanner_destroy(nft);
+		nft->scanner = NULL;
+	}
+	free(nlbuf);
+
+	if (!rc &&
+	    nft_output_json(&nft->output) &&
+	    nft_output_echo(&nft->output))
+		json_print_echo(nft);
+
+	nft_cache_put(nft, rc || nft->check);
+
+	nft_timing_print(nft);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+static int nft_str2family(const char *name, uint32_t *family)
+{
+	static const uint32_t families[] = {
+		NFPROTO_IPV4, NFPROTO_IPV6, NFPROTO_INET,
+		NFPROTO_ARP, NFPROTO_BRIDGE, NFPROTO_NETDEV,
+	};
+	unsigned int i;
+
+	for (i = 0; i < array_size(families); i++) {
+		if (!strcmp(family2str(families[i]), name)) {
+			*family = families[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+EXPORT_SYMBOL(nft_run_add_elements_from_filename);
+int nft_run_add_elements_from_filename(struct nft_ctx *nft, const char *family,
+				       const char *table, const char *set,
+				       const char *filename, const char *format,
+				       uint32_t flags)
+{
+	struct cmd *cmd, *next;
+	struct handle h = {};
+	struct expr *expr;
+	LIST_HEAD(msgs);
+	LIST_HEAD(cmds);
+	int rc = -1;
+
+	parser_init(nft, nft->state, &msgs, &cmds, nft->top_scope);
+
+	if (nft_str2family(family, &h.family) < 0) {
+		erec_queue(error(&internal_location, "unknown family `%s'",
+				 family), &msgs);
+		goto err;
+	}
+
+	expr = setelem_file_load(&internal_location, filename, format,
+				 flags & NFT_ELEMENTS_BINARY, &msgs);
+	if (!expr)
+		goto err;
+
+	h.table.name = xstrdup(table);
+	h.table.location = internal_location;
+	h.set.name = xstrdup(set);
+	h.set.location = internal_location;
+
+	cmd = cmd_alloc(CMD_ADD, CMD_OBJ_ELEMENTS, &h, &internal_location, expr);
+	list_add_tail(&cmd->list, &cmds);
+
+	rc = nft_evaluate(nft, &msgs, &cmds);
+	if (rc < 0)
+		goto err;
+
+	if (nft_netlink(nft, &cmds, &msgs) != 0)
+		rc = -1;
+err:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	list_for_each_entry_safe(cmd, next, &cmds, list) {
+		list_del(&cmd->list);
+		cmd_free(cmd);
+	}
+	iface_cache_release();
+
+	nft_cache_put(nft, rc || nft->check);
+
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+static int nft_set_elements_handle(const char *family, const char *table,
+				   const char *set, struct handle *h,
+				   struct list_head *msgs)
+{
+	if (nft_str2family(family, &h->family) < 0) {
+		erec_queue(error(&internal_location, "unknown family `%s'",
+				 family), msgs);
+		return -1;
+	}
+	h->table.name = table;
+	h->set.name = set;
+
+	return 0;
+}
+
+static void nft_set_elements_error(struct netlink_ctx *ctx,
+				   const struct mnl_setelem_raw *elems,
+				   const struct handle *h,
+				   const struct mnl_err *err)
+{
+	size_t i, found = elems->n;
+
+	/* the offending element is the last one before the attribute. */
+	for (i = 0; i < elems->n; i++) {
+		if (elems->seqnums[i] > err->seqnum)
+			break;
+		if (elems->seqnums[i] == err->seqnum &&
+		    elems->offsets[i] <= err->offset)
+			found = i;
+	}
+
+	if (found < elems->n)
+		netlink_io_error(ctx, NULL,
+				 "Could not process element %zu of set %s: %s",
+				 found, h->set.name, strerror(err->err));
+	else
+		netlink_io_error(ctx, NULL,
+				 "Could not process elements of set %s: %s",
+				 h->set.name, strerror(err->err));
+}
+
+static int nft_set_elements_batch(struct nft_ctx *nft, uint16_t msg_type,
+				  const struct handle *h,
+				  struct mnl_setelem_raw *elems,
+				  struct list_head *msgs)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.msgs	= msgs,
+		.list	= LIST_HEAD_INIT(ctx.list),
+		.batch	= mnl_batch_init(nft),
+	};
+	uint32_t seqnum = 0, first_seqnum;
+	struct mnl_err *err, *tmp;
+	LIST_HEAD(err_list);
+	int ret;
+
+	elems->seqnums = xmalloc_array(elems->n, sizeof(uint32_t));
+	elems->offsets = xmalloc_array(elems->n, sizeof(uint32_t));
+
+	mnl_batch_begin(ctx.batch, mnl_seqnum_inc(&seqnum));
+	first_seqnum = ctx.seqnum = mnl_seqnum_inc(&seqnum);
+	mnl_nft_setelem_raw(&ctx, msg_type, h, elems);
+	seqnum = ctx.seqnum;
+	mnl_seqnum_inc(&seqnum);
+	if (!nft->check)
+		mnl_batch_end(ctx.batch, mnl_seqnum_inc(&seqnum));
+
+	ret = mnl_batch_talk(&ctx, &err_list, ctx.seqnum - first_seqnum + 1);
+	if (ret < 0) {
+		netlink_io_error(&ctx, NULL, "Could not process elements: %s",
+				 strerror(errno));
+		goto out;
+	}
+
+	if (!list_empty(&err_list))
+		ret = -1;
+
+	list_for_each_entry_safe(err, tmp, &err_list, head) {
+		nft_set_elements_error(&ctx, elems, h, err);
+		errno = err->err;
+		mnl_err_list_free(err);
+	}
+out:
+	mnl_batch_reset(ctx.batch);
+	free(elems->seqnums);
+	free(elems->offsets);
+
+	return ret;
+}
+
+static int nft_set_elements_run(struct nft_ctx *nft, uint16_t msg_type,
+				const char *family, const char *table,
+				const char *set, struct mnl_setelem_raw *elems)
+{
+	struct handle h = {};
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	if (nft_set_elements_handle(family, table, set, &h, &msgs) < 0)
+		rc = -1;
+	else if (elems->n > 0)
+		rc = nft_set_elements_batch(nft, msg_type, &h, elems, &msgs);
+
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_set_elements_add);
+int nft_set_elements_add(struct nft_ctx *nft, const char *family,
+			 const char *table, const char *set,
+			 const void *keys, size_t key_len, size_t n,
+			 const struct nft_elements_opts *opts)
+{
+	struct mnl_setelem_raw elems = {
+		.keys		= keys,
+		.key_len	= key_len,
+		.n		= n,
+	};
+
+	if (opts) {
+		elems.data	= opts->data;
+		elems.data_len	= opts->data_len;
+		elems.timeouts	= opts->timeouts;
+		elems.packets	= opts->packets;
+		elems.bytes	= opts->bytes;
+	}
+
+	return nft_set_elements_run(nft, NFT_MSG_NEWSETELEM, family, table,
+				    set, &elems);
+}
+
+EXPORT_SYMBOL(nft_set_elements_delete);
+int nft_set_elements_delete(struct nft_ctx *nft, const char *family,
+			    const char *table, const char *set,
+			    const void *keys, size_t key_len, size_t n)
+{
+	struct mnl_setelem_raw elems = {
+		.keys		= keys,
+		.key_len	= key_len,
+		.n		= n,
+	};
+
+	return nft_set_elements_run(nft, NFT_MSG_DELSETELEM, family, table,
+				    set, &elems);
+}
+
+EXPORT_SYMBOL(nft_set_elements_query);
+int nft_set_elements_query(struct nft_ctx *nft, const char *family,
+			   const char *table, const char *set,
+			   const void *keys, size_t key_len, size_t n,
+			   uint8_t *bitmap)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.list	= LIST_HEAD_INIT(ctx.list),
+	};
+	struct handle h = {};
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	ctx.msgs = &msgs;
+	if (nft_set_elements_handle(family, table, set, &h, &msgs) < 0) {
+		rc = -1;
+		goto out;
+	}
+
+	if (mnl_nft_setelem_raw_query(&ctx, &h, keys, key_len, n,
+				      bitmap) < 0) {
+		netlink_io_error(&ctx, NULL,
+				 "Could not get elements of set %s: %s",
+				 set, strerror(errno));
+		rc = -1;
+	}
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_set_elements_get);
+int nft_set_elements_get(struct nft_ctx *nft, const char *family,
+			 const char *table, const char *set,
+			 const void *keys, size_t key_len, size_t n,
+			 bool *found)
+{
+	uint8_t *bitmap;
+	size_t i;
+	int rc;
+
+	bitmap = xmalloc(n / 8 + 1);
+	rc = nft_set_elements_query(nft, family, table, set, keys, key_len,
+				    n, bitmap);
+	if (rc == 0) {
+		for (i = 0; i < n; i++)
+			found[i] = bitmap[i / 8] & (1 << (i % 8));
+	}
+	free(bitmap);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_counters_dump);
+int nft_counters_dump(struct nft_ctx *nft, const char *family,
+		      const char *table, unsigned int flags,
+		      struct nft_counter **counters, size_t *n)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.list	= LIST_HEAD_INIT(ctx.list),
+	};
+	struct mnl_counter_array array = {};
+	uint32_t nfproto = NFPROTO_UNSPEC;
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	ctx.msgs = &msgs;
+	if (family && nft_str2family(family, &nfproto) < 0) {
+		erec_queue(error(&internal_location, "unknown family `%s'",
+				 family), &msgs);
+		rc = -1;
+		goto out;
+	}
+
+	if (mnl_nft_counters_dump(&ctx, nfproto, table,
+				  flags & NFT_COUNTERS_RULES,
+				  flags & NFT_COUNTERS_RESET, &array) < 0) {
+		netlink_io_error(&ctx, NULL, "Could not dump counters: %s",
+				 strerror(errno));
+		nft_counters_free(array.counters, array.num);
+		rc = -1;
+		goto out;
+	}
+
+	*counters = array.counters;
+	*n = array.num;
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_counters_free);
+void nft_counters_free(struct nft_counter *counters, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free(counters[i].table);
+		free(counters[i].name);
+	}
+	free(counters);
+}
+
+EXPORT_SYMBOL(nft_set_counters_dump);
+int nft_set_counters_dump(struct nft_ctx *nft, const char *family,
+			  const char *table, const char *set,
+			  unsigned int flags, nft_set_counter_cb_t cb,
+			  void *data)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.list	= LIST_HEAD_INIT(ctx.list),
+	};
+	struct mnl_set_counter_dump dump = {
+		.cb	= cb,
+		.data	= data,
+	};
+	struct handle h = {};
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	ctx.msgs = &msgs;
+	if (nft_set_elements_handle(family, table, set, &h, &msgs) < 0) {
+		rc = -1;
+		goto out;
+	}
+
+	if (mnl_nft_set_counters_dump(&ctx, &h, flags & NFT_COUNTERS_RESET,
+				      &dump) < 0) {
+		netlink_io_error(&ctx, NULL,
+				 "Could not dump counters of set %s: %s",
+				 set, strerror(errno));
+		rc = -1;
+	}
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+static void nft_set_stat_fill(struct nft_set_stat *stat,
+			      const struct set *set, uint64_t elements)
+{
+	stat->family	= set->handle.family;
+	stat->table	= xstrdup(set->handle.table.name);
+	stat->name	= xstrdup(set->handle.set.name);
+	stat->flags	= set->flags;
+	stat->key_len	= div_round_up(set->key->len, BITS_PER_BYTE);
+	if (set_is_datamap(set->flags))
+		stat->data_len = div_round_up(set->data->len, BITS_PER_BYTE);
+	stat->size	= set->desc.size;
+	stat->elements	= elements;
+	stat->memory	= set_memory_estimate(set, elements);
+}
+
+EXPORT_SYMBOL(nft_set_stats_dump);
+int nft_set_stats_dump(struct nft_ctx *nft, const char *family,
+		       const char *table, struct nft_set_stat **stats,
+		       size_t *n)
+{
+	struct netlink_ctx ctx = {
+		.nft	= nft,
+		.list	= LIST_HEAD_INIT(ctx.list),
+	};
+	struct nft_set_stat *array = NULL;
+	struct nftnl_set_list_iter *iter;
+	uint32_t nfproto = NFPROTO_UNSPEC;
+	struct nftnl_set_list *nls_list;
+	size_t num = 0, size = 0;
+	struct nftnl_set *nls;
+	uint64_t elements;
+	struct set *set;
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	ctx.msgs = &msgs;
+	if (family && nft_str2family(family, &nfproto) < 0) {
+		erec_queue(error(&internal_location, "unknown family `%s'",
+				 family), &msgs);
+		rc = -1;
+		goto out;
+	}
+
+	nls_list = mnl_nft_set_dump(&ctx, nfproto, table, NULL);
+	if (nls_list == NULL) {
+		netlink_io_error(&ctx, NULL, "Could not dump sets: %s",
+				 strerror(errno));
+		rc = -1;
+		goto out;
+	}
+
+	iter = nftnl_set_list_iter_create(nls_list);
+	if (iter == NULL)
+		memory_allocation_error();
+
+	while ((nls = nftnl_set_list_iter_next(iter)) != NULL) {
+		set = netlink_delinearize_set(&ctx, nls);
+		if (set == NULL) {
+			rc = -1;
+			break;
+		}
+		if (set_is_anonymous(set->flags)) {
+			set_free(set);
+			continue;
+		}
+
+		if (netlink_count_setelems(&ctx, &set->handle,
+					   &elements) < 0) {
+			netlink_io_error(&ctx, NULL,
+					 "Could not count elements of set %s: %s",
+					 set->handle.set.name, strerror(errno));
+			set_free(set);
+			rc = -1;
+			break;
+		}
+
+		if (num == size) {
+			size = size ? size * 2 : 16;
+			array = xrealloc(array, size * sizeof(*array));
+		}
+		memset(&array[num], 0, sizeof(array[num]));
+		nft_set_stat_fill(&array[num++], set, elements);
+		set_free(set);
+	}
+	nftnl_set_list_iter_destroy(iter);
+	nftnl_set_list_free(nls_list);
+
+	if (rc < 0) {
+		nft_set_stats_free(array, num);
+		goto out;
+	}
+
+	*stats = array;
+	*n = num;
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_set_stats_free);
+void nft_set_stats_free(struct nft_set_stat *stats, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free(stats[i].table);
+		free(stats[i].name);
+	}
+	free(stats);
+}
+
+EXPORT_SYMBOL(nft_prepare);
+struct nft_stmt *nft_prepare(struct nft_ctx *nft, const char *buf)
+{
+	struct nft_stmt *stmt;
+	LIST_HEAD(msgs);
+	int rc;
+
+	if (nft->parent)
+		return NULL;
+
+	stmt = xzalloc(sizeof(*stmt));
+	stmt->nft = nft;
+	init_list_head(&stmt->cmds);
+	init_list_head(&stmt->params);
+	stmt->buf = xzalloc(strlen(buf) + 2);
+	sprintf(stmt->buf, "%s\n", buf);
+
+	nft->params = &stmt->params;
+	rc = nft_parse_bison_buffer(nft, stmt->buf, &msgs, &stmt->cmds,
+				    &indesc_cmdline);
+	if (rc == 0)
+		rc = nft_evaluate(nft, &msgs, &stmt->cmds);
+	if (rc == 0)
+		rc = nft_stmt_check(stmt, &msgs);
+	nft->params = NULL;
+
+	/* Locations in the commands refer to the input descriptors of the
+	 * scanner, the statement keeps them until it is released.
+	 */
+	stmt->state = nft->state;
+	stmt->scanner = nft->scanner;
+	nft->state = xzalloc(sizeof(struct parser_state));
+	nft->scanner = NULL;
+
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	iface_cache_release();
+	if (rc < 0) {
+		nft_cache_release(nft->cache);
+		nft_stmt_free(stmt);
+		stmt = NULL;
+	}
+	nft_ctx_flush_output(nft);
+
+	return stmt;
+}
+
+static int nft_bind_done(struct nft_stmt *stmt, struct list_head *msgs,
+			 int rc)
+{
+	erec_print_list(&stmt->nft->output, msgs, stmt->nft->debug_mask);
+	nft_ctx_flush_output(stmt->nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_bind_str);
+int nft_bind_str(struct nft_stmt *stmt, const char *name, const char *value)
+{
+	LIST_HEAD(msgs);
+	int rc;
+
+	rc = nft_stmt_bind_str(stmt, name, value, &msgs);
+
+	return nft_bind_done(stmt, &msgs, rc);
+}
+
+EXPORT_SYMBOL(nft_bind_u64);
+int nft_bind_u64(struct nft_stmt *stmt, const char *name, uint64_t value)
+{
+	LIST_HEAD(msgs);
+	int rc;
+
+	rc = nft_stmt_bind_u64(stmt, name, value, &msgs);
+
+	return nft_bind_done(stmt, &msgs, rc);
+}
+
+EXPORT_SYMBOL(nft_bind_data);
+int nft_bind_data(struct nft_stmt *stmt, const char *name,
+		  const void *data, size_t len)
+{
+	LIST_HEAD(msgs);
+	int rc;
+
+	rc = nft_stmt_bind_data(stmt, name, data, len, &msgs);
+
+	return nft_bind_done(stmt, &msgs, rc);
+}
+
+EXPORT_SYMBOL(nft_bind_var);
+int nft_bind_var(struct nft_stmt *stmt, const char *var)
+{
+	LIST_HEAD(msgs);
+	int rc;
+
+	rc = nft_stmt_bind_var(stmt, var, &msgs);
 
-	rc = nft_evaluate(nft, &msgs, &cmds);
-	if (rc < 0) {
-		if (errno == EPERM) {
-			fprintf(stderr, "%s (you must be root)\n",
-				strerror(errno));
-		}
-		goto err;
-	}
+	return nft_bind_done(stmt, &msgs, rc);
+}
 
-	if (parser_rc) {
-		rc = parser_rc;
-		goto err;
-	}
+EXPORT_SYMBOL(nft_execute);
+int nft_execute(struct nft_stmt *stmt)
+{
+	return nft_execute_on(stmt, stmt->nft);
+}
 
-	if (nft_netlink(nft, &cmds, &msgs) != 0)
+/* The commands were evaluated against the ruleset of the context that
+ * prepared them, @nft only sends them, from its own network namespace.
+ */
+EXPORT_SYMBOL(nft_execute_on);
+int nft_execute_on(struct nft_stmt *stmt, struct nft_ctx *nft)
+{
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	if (nft->parent)
+		return -1;
+
+	if (nft_stmt_check_bound(stmt, &msgs) < 0 ||
+	    nft_netlink(nft, &stmt->cmds, &msgs) != 0)
 		rc = -1;
-err:
+
 	erec_print_list(&nft->output, &msgs, nft->debug_mask);
-	list_for_each_entry_safe(cmd, next, &cmds, list) {
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_stmt_free);
+void nft_stmt_free(struct nft_stmt *stmt)
+{
+	nft_stmt_release(stmt);
+	if (stmt->scanner)
+		scanner_free(stmt->scanner);
+	free(stmt->state);
+	free(stmt->buf);
+	free(stmt);
+}
+
+/* Each nft_txn_add_cmd() call keeps its buffer, parser state and scanner
+ * until the transaction is released, command locations refer to them.
+ */
+struct nft_txn_buf {
+	struct list_head	list;
+	char			*buf;
+	struct parser_state	*state;
+	void			*scanner;
+};
+
+struct nft_txn {
+	struct nft_ctx		*nft;
+	struct list_head	bufs;
+	struct list_head	cmds;
+	bool			stale;
+};
+
+static void nft_txn_cmds_free(struct list_head *cmds)
+{
+	struct cmd *cmd, *next;
+
+	list_for_each_entry_safe(cmd, next, cmds, list) {
 		list_del(&cmd->list);
 		cmd_free(cmd);
 	}
+}
+
+static void nft_txn_buf_reset(struct nft_txn_buf *tbuf)
+{
+	if (tbuf->scanner)
+		scanner_free(tbuf->scanner);
+	free(tbuf->state);
+	tbuf->scanner = NULL;
+	tbuf->state = NULL;
+}
+
+static void nft_txn_buf_free(struct nft_txn_buf *tbuf)
+{
+	nft_txn_buf_reset(tbuf);
+	free(tbuf->buf);
+	free(tbuf);
+}
+
+static int nft_txn_check(struct list_head *cmds, struct list_head *msgs)
+{
+	struct cmd *cmd;
+
+	list_for_each_entry(cmd, cmds, list) {
+		switch (cmd->op) {
+		case CMD_ADD:
+		case CMD_REPLACE:
+		case CMD_CREATE:
+		case CMD_INSERT:
+		case CMD_DELETE:
+		case CMD_FLUSH:
+		case CMD_RENAME:
+		case CMD_DESTROY:
+			continue;
+		default:
+			break;
+		}
+
+		erec_queue(error(&cmd->location,
+				 "only commands that update the ruleset are supported in transactions"),
+			   msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nft_txn_parse(struct nft_ctx *nft, struct nft_txn_buf *tbuf,
+			 struct list_head *msgs, struct list_head *cmds)
+{
+	int rc;
+
+	rc = nft_parse_bison_buffer(nft, tbuf->buf, msgs, cmds,
+				    &indesc_cmdline);
+
+	tbuf->state = nft->state;
+	tbuf->scanner = nft->scanner;
+	nft->state = xzalloc(sizeof(struct parser_state));
+	nft->scanner = NULL;
+
+	if (rc == 0)
+		rc = nft_txn_check(cmds, msgs);
+
+	return rc;
+}
+
+/* Commands from previous calls are already evaluated against the cache, which
+ * also holds the objects they add. Evaluating new commands against it is only
+ * possible if it does not need to be fetched again for them.
+ */
+static bool nft_txn_needs_rebuild(struct nft_txn *txn, struct list_head *cmds,
+				  struct list_head *msgs)
+{
+	struct nft_cache_filter *filter;
+	unsigned int flags;
+	int ret;
+
+	if (txn->stale)
+		return true;
+	if (list_empty(&txn->bufs))
+		return false;
+
+	filter = nft_cache_filter_init();
+	ret = nft_cache_evaluate(txn->nft, cmds, msgs, filter, &flags);
+	nft_cache_filter_fini(filter);
+
+	return ret < 0 || !nft_cache_covers(txn->nft->cache, flags);
+}
+
+/* Parse and evaluate all commands again against a fresh cache. */
+static int nft_txn_rebuild(struct nft_txn *txn, struct list_head *msgs)
+{
+	struct nft_ctx *nft = txn->nft;
+	struct nft_txn_buf *tbuf;
+	int rc = 0;
+
+	nft_txn_cmds_free(&txn->cmds);
+	nft_cache_release(nft->cache);
+
+	list_for_each_entry(tbuf, &txn->bufs, list) {
+		nft_txn_buf_reset(tbuf);
+		if (nft_txn_parse(nft, tbuf, msgs, &txn->cmds) < 0)
+			rc = -1;
+	}
+	if (rc == 0)
+		rc = nft_evaluate(nft, msgs, &txn->cmds);
+
+	txn->stale = rc < 0;
+
+	return rc;
+}
+
+static void nft_txn_free(struct nft_txn *txn)
+{
+	struct nft_txn_buf *tbuf, *next;
+
+	nft_txn_cmds_free(&txn->cmds);
+	list_for_each_entry_safe(tbuf, next, &txn->bufs, list) {
+		list_del(&tbuf->list);
+		nft_txn_buf_free(tbuf);
+	}
 	iface_cache_release();
-	if (nft->scanner) {
-		scanner_destroy(nft);
-		nft->scanner = NULL;
+	free(txn);
+}
+
+EXPORT_SYMBOL(nft_txn_begin);
+struct nft_txn *nft_txn_begin(struct nft_ctx *nft)
+{
+	struct nft_txn *txn;
+
+	if (nft->parent)
+		return NULL;
+
+	txn = xzalloc(sizeof(*txn));
+	txn->nft = nft;
+	init_list_head(&txn->bufs);
+	init_list_head(&txn->cmds);
+
+	return txn;
+}
+
+EXPORT_SYMBOL(nft_txn_add_cmd);
+int nft_txn_add_cmd(struct nft_txn *txn, const char *buf)
+{
+	struct nft_ctx *nft = txn->nft;
+	struct nft_txn_buf *tbuf;
+	LIST_HEAD(msgs);
+	LIST_HEAD(cmds);
+	int rc;
+
+	tbuf = xzalloc(sizeof(*tbuf));
+	tbuf->buf = xzalloc(strlen(buf) + 2);
+	sprintf(tbuf->buf, "%s\n", buf);
+
+	rc = nft_txn_parse(nft, tbuf, &msgs, &cmds);
+	if (rc < 0) {
+		nft_txn_cmds_free(&cmds);
+		nft_txn_buf_free(tbuf);
+		goto out;
 	}
-	free(nlbuf);
 
-	if (!rc &&
-	    nft_output_json(&nft->output) &&
-	    nft_output_echo(&nft->output))
-		json_print_echo(nft);
+	if (nft_txn_needs_rebuild(txn, &cmds, &msgs)) {
+		nft_txn_cmds_free(&cmds);
+		list_add_tail(&tbuf->list, &txn->bufs);
+		rc = nft_txn_rebuild(txn, &msgs);
+		if (rc < 0) {
+			list_del(&tbuf->list);
+			nft_txn_buf_free(tbuf);
+		}
+		goto out;
+	}
+
+	if (list_empty(&txn->bufs))
+		rc = nft_evaluate(nft, &msgs, &cmds);
+	else
+		rc = nft_evaluate_cmds(nft, &msgs, &cmds);
+
+	if (rc < 0) {
+		/* evaluation may have added some of the objects to the cache. */
+		txn->stale = true;
+		nft_txn_cmds_free(&cmds);
+		nft_txn_buf_free(tbuf);
+		goto out;
+	}
+
+	list_splice_tail(&cmds, &txn->cmds);
+	list_add_tail(&tbuf->list, &txn->bufs);
+out:
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_ctx_flush_output(nft);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_txn_commit);
+int nft_txn_commit(struct nft_txn *txn)
+{
+	struct nft_ctx *nft = txn->nft;
+	LIST_HEAD(msgs);
+	int rc = 0;
+
+	if (txn->stale && nft_txn_rebuild(txn, &msgs) < 0)
+		rc = -1;
+	else if (nft_netlink(nft, &txn->cmds, &msgs) != 0)
+		rc = -1;
+
+	erec_print_list(&nft->output, &msgs, nft->debug_mask);
+	nft_cache_put(nft, rc || nft->check);
+	nft_ctx_flush_output(nft);
+	nft_txn_free(txn);
+
+	return rc;
+}
+
+EXPORT_SYMBOL(nft_txn_abort);
+void nft_txn_abort(struct nft_txn *txn)
+{
+	/* the cache holds the objects of the commands that were not sent. */
+	if (!list_empty(&txn->bufs) || txn->stale)
+		nft_cache_release(txn->nft->cache);
+
+	nft_txn_free(txn);
+}
+
+static void nft_capture_start(struct cookie *cookie, struct cookie *saved)
+{
+	*saved = *cookie;
+	memset(cookie, 0, sizeof(*cookie));
+	cookie->fp = saved->fp;
+	init_cookie(cookie);
+}
+
+static char *nft_capture_stop(struct cookie *cookie,
+			      const struct cookie *saved)
+{
+	char *buf = xstrdup(get_cookie_buffer(cookie));
+
+	exit_cookie(cookie);
+	*cookie = *saved;
+
+	return buf;
+}
+
+/* Run @buf with its output and errors collected into new buffers, whatever
+ * the output settings of the context are. See async.c.
+ */
+int nft_run_cmd_capture(struct nft_ctx *nft, const char *buf,
+			char **output, char **error)
+{
+	struct cookie out, err;
+	int rc;
+
+	nft_capture_start(&nft->output.output_cookie, &out);
+	nft_capture_start(&nft->output.error_cookie, &err);
 
-	if (rc || nft->check)
-		nft_cache_release(&nft->cache);
+	rc = nft_run_cmd_from_buffer(nft, buf);
+
+	*output = nft_capture_stop(&nft->output.output_cookie, &out);
+	*error = nft_capture_stop(&nft->output.error_cookie, &err);
 
 	return rc;
 }
 
+EXPORT_SYMBOL(nft_ruleset_changes);
+int nft_ruleset_changes(struct nft_ctx *nft, uint32_t genid, char **changes)
+{
+	struct cookie out;
+	char buf[64];
+	int rc;
+
+	snprintf(buf, sizeof(buf), "list ruleset since %u", genid);
+
+	nft_capture_start(&nft->output.output_cookie, &out);
+	rc = nft_run_cmd_from_buffer(nft, buf);
+	*changes = nft_capture_stop(&nft->output.output_cookie, &out);
+
+	if (rc) {
+		free(*changes);
+		*changes = NULL;
+		return -1;
+	}
+
+	return nft_journal_covers(nft->journal, genid) ? 0 : 1;
+}
+
+static struct nft_async_ctx *nft_async_get(struct nft_ctx *nft)
+{
+	if (!nft->async)
+		nft->async = nft_async_ctx_alloc(nft);
+
+	return nft->async;
+}
+
+EXPORT_SYMBOL(nft_ctx_async_fd);
+int nft_ctx_async_fd(struct nft_ctx *nft)
+{
+	struct nft_async_ctx *actx = nft_async_get(nft);
+
+	if (!actx)
+		return -1;
+
+	return nft_async_ctx_fd(actx);
+}
+
+EXPORT_SYMBOL(nft_async_submit);
+struct nft_async *nft_async_submit(struct nft_ctx *nft, const char *buf,
+				   nft_async_cb_t cb, void *data)
+{
+	struct nft_async_ctx *actx = nft_async_get(nft);
+
+	if (!actx || !cb)
+		return NULL;
+
+	return nft_async_ctx_submit(actx, buf, cb, data);
+}
+
+EXPORT_SYMBOL(nft_async_cancel);
+int nft_async_cancel(struct nft_async *op)
+{
+	return nft_async_ctx_cancel(op);
+}
+
+EXPORT_SYMBOL(nft_async_process);
+int nft_async_process(struct nft_ctx *nft)
+{
+	if (!nft->async)
+		return 0;
+
+	return nft_async_ctx_process(nft->async);
+}
+
+/* Netlink sockets stay in the network namespace they were created in. The
+ * calling thread enters the namespace at @path only to open them, then it
+ * returns to its own.
+ */
+EXPORT_SYMBOL(nft_ctx_set_netns);
+int nft_ctx_set_netns(struct nft_ctx *ctx, const char *path)
+{
+	struct mnl_socket *nf_sock, *ev_sock = NULL;
+	int fd, self, ret = -1;
+
+	if (ctx->parent || ctx->shared) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx->async) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	self = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (self < 0)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto err_self;
+
+	if (setns(fd, CLONE_NEWNET) < 0)
+		goto err_fd;
+
+	nf_sock = nft_mnl_socket_open();
+	if (ctx->ev_sock)
+		ev_sock = nft_mnl_event_socket_open();
+
+	if (setns(self, CLONE_NEWNET) < 0)
+		netlink_init_error();
+
+	if (ctx->ev_sock && !ev_sock) {
+		mnl_socket_close(nf_sock);
+		goto err_fd;
+	}
+
+	mnl_socket_close(ctx->nf_sock);
+	ctx->nf_sock = nf_sock;
+	if (ev_sock) {
+		mnl_socket_close(ctx->ev_sock);
+		ctx->ev_sock = ev_sock;
+	}
+	/* the cache describes the ruleset of the former namespace. */
+	nft_cache_release(ctx->cache);
+	if (ctx->journal)
+		nft_journal_invalidate(ctx->journal);
+	ret = 0;
+err_fd:
+	close(fd);
+err_self:
+	close(self);
+
+	return ret;
+}
+
+EXPORT_SYMBOL(nft_run_cmd_parallel);
+int nft_run_cmd_parallel(struct nft_ctx **ctxs, unsigned int num,
+			 const char *buf, unsigned int jobs,
+			 struct nft_run_result **results)
+{
+	long cpus;
+
+	*results = NULL;
+	if (num == 0)
+		return 0;
+
+	if (jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+
+	*results = xzalloc_array(num, sizeof(struct nft_run_result));
+
+	return nft_parallel_run(ctxs, num, buf, jobs, *results);
+}
+
+EXPORT_SYMBOL(nft_run_results_free);
+void nft_run_results_free(struct nft_run_result *results, unsigned int num)
+{
+	unsigned int i;
+
+	if (!results)
+		return;
+
+	for (i = 0; i < num; i++) {
+		free(results[i].output);
+		free(results[i].error);
+	}
+	free(results);
+}
+
 static int load_cmdline_vars(struct nft_ctx *ctx, struct list_head *msgs)
 {
 	unsigned int bufsize, ret, i, offset = 0;
@@ -690,9 +2461,11 @@ static int __nft_run_cmd_from_filename(struct nft_ctx *nft, const char *filename
 {
 	struct error_record *erec;
 	struct cmd *cmd, *next;
+	struct nft_timing_span span;
 	int rc, parser_rc;
 	LIST_HEAD(msgs);
 	LIST_HEAD(cmds);
+	bool timing;
 
 	erec = filename_is_useable(nft, filename);
 	if (erec) {
@@ -705,11 +2478,16 @@ static int __nft_run_cmd_from_filename(struct nft_ctx *nft, const char *filename
 	if (rc < 0)
 		goto err;
 
+	nft_timing_reset(nft);
+	nft->echo.num = 0;
+	timing = nft_timing_start(nft, NFT_TIMING_PARSE, &span);
 	rc = -EINVAL;
 	if (nft_output_json(&nft->output) || nft_input_json(&nft->input))
 		rc = nft_parse_json_filename(nft, filename, &msgs, &cmds);
 	if (rc == -EINVAL)
 		rc = nft_parse_bison_filename(nft, filename, &msgs, &cmds);
+	if (timing)
+		nft_timing_stop(nft, &span, 1);
 
 	parser_rc = rc;
 
@@ -755,10 +2533,10 @@ err:
 	    nft_output_echo(&nft->output))
 		json_print_echo(nft);
 
-	if (rc || nft->check)
-		nft_cache_release(&nft->cache);
+	nft_cache_put(nft, rc || nft->check || nft->compile.output);
 
 	scope_release(nft->state->scopes[0]);
+	nft_timing_print(nft);
 
 	return rc;
 }
@@ -798,29 +2576,58 @@ static int nft_ctx_add_basedir_include_path(struct nft_ctx *nft,
 	return ret;
 }
 
+EXPORT_SYMBOL(nft_save_raw);
+int nft_save_raw(struct nft_ctx *nft, const char *filename)
+{
+	int ret;
+
+	if (nft->parent || nft->offline.file)
+		return -1;
+
+	ret = nft_backup_save(nft, filename);
+	nft_ctx_flush_output(nft);
+
+	return ret;
+}
+
 EXPORT_SYMBOL(nft_run_cmd_from_filename);
 int nft_run_cmd_from_filename(struct nft_ctx *nft, const char *filename)
 {
 	int ret;
 
+	/* sessions only list from buffers. */
+	if (nft->parent)
+		return -1;
+
 	if (!strcmp(filename, "-"))
 		filename = "/dev/stdin";
 
-	if (!strcmp(filename, "/dev/stdin"))
+	if (!strcmp(filename, "/dev/stdin")) {
 		nft->stdin_buf = stdin_to_buffer();
+	} else if (nft_compiled_file(filename)) {
+		ret = nft_compiled_run(nft, filename);
+		nft_ctx_flush_output(nft);
+		return ret;
+	} else if (nft_backup_file(filename)) {
+		ret = nft_backup_restore(nft, filename);
+		nft_ctx_flush_output(nft);
+		return ret;
+	}
 
 	if (!nft->stdin_buf &&
 	    nft_ctx_add_basedir_include_path(nft, filename) < 0)
 		return -1;
 
-	if (nft->optimize_flags) {
+	nft->compile.source = filename;
+
+	if (nft->optimize_flags)
 		ret = nft_run_optimized_file(nft, filename);
-		free_const(nft->stdin_buf);
-		return ret;
-	}
+	else
+		ret = __nft_run_cmd_from_filename(nft, filename);
 
-	ret = __nft_run_cmd_from_filename(nft, filename);
+	nft->compile.source = NULL;
 	free_const(nft->stdin_buf);
+	nft_ctx_flush_output(nft);
 
 	return ret;
 }
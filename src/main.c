@@ -15,12 +15,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
 
 #include <nftables/libnftables.h>
 #include <utils.h>
 #include <cli.h>
+#include <daemon.h>
 
 static struct nft_ctx *nft;
 
@@ -37,7 +41,20 @@ enum opt_indices {
         IDX_INCLUDEPATH,
 	IDX_CHECK,
 	IDX_OPTIMIZE,
-#define IDX_RULESET_INPUT_END	IDX_OPTIMIZE
+	IDX_OPTIMIZE_REORDER,
+	IDX_OPTIMIZE_SETS,
+	IDX_OPTIMIZE_PROFILE,
+	IDX_OPTIMIZE_STATS,
+	IDX_JOBS,
+	IDX_COMPILE,
+	IDX_DAEMON,
+	IDX_BATCH_WINDOW,
+	IDX_SPLIT_ELEMENTS,
+	IDX_DIFF,
+	IDX_IF_CHANGED,
+	IDX_SET_HINTS,
+	IDX_OFFLINE,
+#define IDX_RULESET_INPUT_END	IDX_OFFLINE
         /* Ruleset list formatting */
         IDX_HANDLE,
 #define IDX_RULESET_LIST_START	IDX_HANDLE
@@ -55,8 +72,11 @@ enum opt_indices {
         IDX_ECHO,
 #define IDX_CMD_OUTPUT_START	IDX_ECHO
         IDX_JSON,
+        IDX_CBOR,
         IDX_DEBUG,
-#define IDX_CMD_OUTPUT_END	IDX_DEBUG
+        IDX_RAW_COUNTERS,
+        IDX_SAVE_RAW,
+#define IDX_CMD_OUTPUT_END	IDX_SAVE_RAW
 };
 
 enum opt_vals {
@@ -82,6 +102,22 @@ enum opt_vals {
 	OPT_NUMERIC_TIME	= 'T',
 	OPT_TERSE		= 't',
 	OPT_OPTIMIZE		= 'o',
+	OPT_OPTIMIZE_REORDER	= 'O',
+	OPT_OPTIMIZE_SETS	= 'M',
+	OPT_OPTIMIZE_PROFILE	= 'P',
+	OPT_OPTIMIZE_STATS	= 'x',
+	OPT_JOBS		= 'J',
+	OPT_COMPILE		= 'C',
+	OPT_RAW_COUNTERS	= 'r',
+	OPT_DAEMON		= 'l',
+	OPT_BATCH_WINDOW	= 'w',
+	OPT_SPLIT_ELEMENTS	= 'E',
+	OPT_DIFF		= 'F',
+	OPT_IF_CHANGED		= 'U',
+	OPT_SET_HINTS		= 'H',
+	OPT_OFFLINE		= 'R',
+	OPT_SAVE_RAW		= 'W',
+	OPT_CBOR		= 'B',
 	OPT_INVALID		= '?',
 };
 
@@ -136,10 +172,42 @@ static const struct nft_opt nft_options[] = {
 				     "Echo what has been added, inserted or replaced."),
 	[IDX_JSON]	    = NFT_OPT("json",			OPT_JSON,		NULL,
 				     "Format output in JSON"),
+	[IDX_CBOR]	    = NFT_OPT("cbor",			OPT_CBOR,		NULL,
+				     "Format listings in CBOR, following the JSON schema"),
 	[IDX_DEBUG]	    = NFT_OPT("debug",			OPT_DEBUG,		"<level [,level...]>",
-				     "Specify debugging level (scanner, parser, eval, netlink, mnl, proto-ctx, segtree, all)"),
+				     "Specify debugging level (scanner, parser, eval, netlink, mnl, proto-ctx, segtree, timing, memory, all)"),
 	[IDX_OPTIMIZE]	    = NFT_OPT("optimize",		OPT_OPTIMIZE,		NULL,
 				     "Optimize ruleset"),
+	[IDX_OPTIMIZE_REORDER] = NFT_OPT("optimize-reorder",	OPT_OPTIMIZE_REORDER,	NULL,
+				     "Optimize ruleset, also merging rules that are not adjacent"),
+	[IDX_OPTIMIZE_SETS] = NFT_OPT("optimize-sets",	OPT_OPTIMIZE_SETS,	NULL,
+				     "Optimize ruleset, also folding rules into named sets and verdict maps"),
+	[IDX_OPTIMIZE_PROFILE] = NFT_OPT("profile-guided",	OPT_OPTIMIZE_PROFILE,	NULL,
+				     "Optimize ruleset, also moving rules with more counted packets first"),
+	[IDX_OPTIMIZE_STATS] = NFT_OPT("stats",			OPT_OPTIMIZE_STATS,	NULL,
+				     "Report the per-packet cost of the ruleset before and after optimizing"),
+	[IDX_JOBS]	    = NFT_OPT("jobs",			OPT_JOBS,		"<number>",
+				     "Sort large sets from up to <number> threads"),
+	[IDX_COMPILE]	    = NFT_OPT("compile-to",		OPT_COMPILE,		"<filename>",
+				     "Write the evaluated ruleset to <filename> instead of applying it"),
+	[IDX_DAEMON]	    = NFT_OPT("daemon",			OPT_DAEMON,		"<socket>",
+				     "Serve commands on the unix socket <socket>"),
+	[IDX_BATCH_WINDOW]  = NFT_OPT("batch-window",		OPT_BATCH_WINDOW,	"<ms>",
+				     "Commit updates that reach the daemon within <ms> together"),
+	[IDX_SPLIT_ELEMENTS] = NFT_OPT("split-elements",	OPT_SPLIT_ELEMENTS,	NULL,
+				     "Commit element updates too large for one batch in several transactions"),
+	[IDX_DIFF]	    = NFT_OPT("diff",			OPT_DIFF,		NULL,
+				     "Only send what differs from the current ruleset"),
+	[IDX_IF_CHANGED]    = NFT_OPT("if-changed",		OPT_IF_CHANGED,		NULL,
+				     "Skip loading a file that the current ruleset was loaded from"),
+	[IDX_SET_HINTS]     = NFT_OPT("set-hints",		OPT_SET_HINTS,		NULL,
+				     "Size new sets after the elements they are created with"),
+	[IDX_OFFLINE]	    = NFT_OPT("offline",		OPT_OFFLINE,		"<filename>",
+				     "Check commands against the ruleset listed in <filename>, without the kernel"),
+	[IDX_RAW_COUNTERS]  = NFT_OPT("raw-counters",		OPT_RAW_COUNTERS,	NULL,
+				     "Print counters and quotas of [family [table]], or element counters of [family table set], as plain numbers"),
+	[IDX_SAVE_RAW]	    = NFT_OPT("save-raw",		OPT_SAVE_RAW,		"<filename>",
+				     "Save the ruleset to <filename> as netlink messages, load it back with -f"),
 };
 
 #define NR_NFT_OPTIONS (sizeof(nft_options) / sizeof(nft_options[0]))
@@ -234,7 +302,7 @@ static void show_help(const char *name)
 
 static void show_version(void)
 {
-	const char *cli, *minigmp, *json, *xt;
+	const char *cli, *minigmp, *json, *xt, *uring;
 
 #if defined(HAVE_LIBREADLINE)
 	cli = "readline";
@@ -264,13 +332,20 @@ static void show_version(void)
 	xt = "no";
 #endif
 
+#if defined(HAVE_IO_URING)
+	uring = "yes";
+#else
+	uring = "no";
+#endif
+
 	printf("%s v%s (%s)\n"
 	       "  cli:		%s\n"
 	       "  json:		%s\n"
 	       "  minigmp:	%s\n"
-	       "  libxtables:	%s\n",
+	       "  libxtables:	%s\n"
+	       "  io_uring:	%s\n",
 	       PACKAGE_NAME, PACKAGE_VERSION, RELEASE_NAME,
-	       cli, json, minigmp, xt);
+	       cli, json, minigmp, xt, uring);
 }
 
 static const struct {
@@ -305,6 +380,14 @@ static const struct {
 		.name		= "segtree",
 		.level		= NFT_DEBUG_SEGTREE,
 	},
+	{
+		.name		= "timing",
+		.level		= NFT_DEBUG_TIMING,
+	},
+	{
+		.name		= "memory",
+		.level		= NFT_DEBUG_MEMORY,
+	},
 	{
 		.name		= "all",
 		.level		= ~0,
@@ -356,10 +439,140 @@ static bool nft_options_check(int argc, char * const argv[])
 	return true;
 }
 
+static const char *raw_family2str(uint32_t family)
+{
+	switch (family) {
+	case NFPROTO_IPV4:
+		return "ip";
+	case NFPROTO_IPV6:
+		return "ip6";
+	case NFPROTO_INET:
+		return "inet";
+	case NFPROTO_ARP:
+		return "arp";
+	case NFPROTO_BRIDGE:
+		return "bridge";
+	case NFPROTO_NETDEV:
+		return "netdev";
+	}
+	return "unknown";
+}
+
+struct raw_set_counters {
+	const char	*family;
+	const char	*table;
+	const char	*set;
+};
+
+static void print_raw_set_counter(const struct nft_set_counter *counter,
+				  void *data)
+{
+	const struct raw_set_counters *raw = data;
+	const uint8_t *key = counter->key;
+	size_t i;
+
+	printf("element %s %s %s 0x", raw->family, raw->table, raw->set);
+	for (i = 0; i < counter->key_len; i++)
+		printf("%02x", key[i]);
+	printf(" %" PRIu64 " %" PRIu64 "\n", counter->packets, counter->bytes);
+}
+
+/* One line per element with a counter: family, table, set, the key as
+ * hexadecimal bytes, packets and bytes. Lines are printed as the elements
+ * are dumped.
+ */
+static int print_raw_set_counters(const char *family, const char *table,
+				  const char *set)
+{
+	struct raw_set_counters raw = {
+		.family	= family,
+		.table	= table,
+		.set	= set,
+	};
+
+	if (nft_set_counters_dump(nft, family, table, set, 0,
+				  print_raw_set_counter, &raw) < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+/* One line per counter: type, family, table, name or chain and rule handle,
+ * then packets and bytes, or consumed and quota bytes for quotas.
+ */
+static int print_raw_counters(int argc, char * const *argv, bool rules)
+{
+	const char *family = NULL, *table = NULL;
+	struct nft_counter *counters, *c;
+	size_t i, n;
+
+	if (argc > 3) {
+		fprintf(stderr, "Error: -r/--raw-counters takes [family [table [set]]]\n");
+		return EXIT_FAILURE;
+	}
+	if (argc == 3)
+		return print_raw_set_counters(argv[0], argv[1], argv[2]);
+	if (argc > 0)
+		family = argv[0];
+	if (argc > 1)
+		table = argv[1];
+
+	if (nft_counters_dump(nft, family, table,
+			      rules ? NFT_COUNTERS_RULES : 0, &counters, &n) < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n; i++) {
+		c = &counters[i];
+
+		switch (c->type) {
+		case NFT_COUNTER_OBJ:
+			printf("counter %s %s %s %" PRIu64 " %" PRIu64 "\n",
+			       raw_family2str(c->family), c->table, c->name,
+			       c->packets, c->bytes);
+			break;
+		case NFT_COUNTER_QUOTA:
+			printf("quota %s %s %s %" PRIu64 " %" PRIu64 "\n",
+			       raw_family2str(c->family), c->table, c->name,
+			       c->bytes, c->quota);
+			break;
+		case NFT_COUNTER_RULE:
+			printf("rule %s %s %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+			       raw_family2str(c->family), c->table, c->name,
+			       c->handle, c->packets, c->bytes);
+			break;
+		}
+	}
+	nft_counters_free(counters, n);
+
+	return EXIT_SUCCESS;
+}
+
+/* The daemon and the interactive CLI keep their cache up to date through
+ * ruleset events, which has to be requested when the context is created,
+ * before options are parsed.
+ */
+static uint32_t nft_ctx_flags(int argc, char * const *argv)
+{
+	int i;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+		if (!strcmp(argv[i], "-l") ||
+		    !strncmp(argv[i], "--daemon", strlen("--daemon")) ||
+		    !strcmp(argv[i], "-i") ||
+		    !strcmp(argv[i], "--interactive"))
+			return NFT_CTX_PERSISTENT_CACHE;
+	}
+
+	return NFT_CTX_DEFAULT;
+}
+
 int main(int argc, char * const *argv)
 {
 	const struct option *options = get_options();
-	bool interactive = false, define = false;
+	bool interactive = false, define = false, compile = false;
+	unsigned int window_ms = NFT_DAEMON_WINDOW_DEFAULT;
+	bool raw_counters = false, window = false;
+	const char *daemon_path = NULL, *save_path = NULL;
 	const char *optstring = get_optstring();
 	unsigned int output_flags = 0;
 	int i, val, rc = EXIT_SUCCESS;
@@ -374,7 +587,7 @@ int main(int argc, char * const *argv)
 	if (!nft_options_check(argc, argv))
 		exit(EXIT_FAILURE);
 
-	nft = nft_ctx_new(NFT_CTX_DEFAULT);
+	nft = nft_ctx_new(nft_ctx_flags(argc, argv));
 
 	while (1) {
 		val = getopt_long(argc, argv, optstring, options, NULL);
@@ -481,6 +694,15 @@ int main(int argc, char * const *argv)
 #else
 			fprintf(stderr, "JSON support not compiled-in\n");
 			goto out_fail;
+#endif
+			break;
+		case OPT_CBOR:
+#ifdef HAVE_LIBJANSSON
+			output_flags |= NFT_CTX_OUTPUT_JSON |
+					NFT_CTX_OUTPUT_CBOR;
+#else
+			fprintf(stderr, "CBOR support not compiled-in\n");
+			goto out_fail;
 #endif
 			break;
 		case OPT_GUID:
@@ -499,7 +721,89 @@ int main(int argc, char * const *argv)
 			output_flags |= NFT_CTX_OUTPUT_TERSE;
 			break;
 		case OPT_OPTIMIZE:
-			nft_ctx_set_optimize(nft, 0x1);
+			nft_ctx_set_optimize(nft, nft_ctx_get_optimize(nft) |
+						  NFT_OPTIMIZE_ENABLED);
+			break;
+		case OPT_OPTIMIZE_REORDER:
+			nft_ctx_set_optimize(nft, nft_ctx_get_optimize(nft) |
+						  NFT_OPTIMIZE_ENABLED |
+						  NFT_OPTIMIZE_REORDER);
+			break;
+		case OPT_OPTIMIZE_SETS:
+			nft_ctx_set_optimize(nft, nft_ctx_get_optimize(nft) |
+						  NFT_OPTIMIZE_ENABLED |
+						  NFT_OPTIMIZE_SETS);
+			break;
+		case OPT_OPTIMIZE_PROFILE:
+			nft_ctx_set_optimize(nft, nft_ctx_get_optimize(nft) |
+						  NFT_OPTIMIZE_ENABLED |
+						  NFT_OPTIMIZE_PROFILE);
+			break;
+		case OPT_OPTIMIZE_STATS:
+			nft_ctx_set_optimize(nft, nft_ctx_get_optimize(nft) |
+						  NFT_OPTIMIZE_STATS);
+			break;
+		case OPT_JOBS: {
+			unsigned long jobs;
+			char *end;
+
+			errno = 0;
+			jobs = strtoul(optarg, &end, 10);
+			if (errno || *end || jobs == 0 || jobs > 1024) {
+				fprintf(stderr, "invalid number of jobs `%s'\n",
+					optarg);
+				goto out_fail;
+			}
+			nft_ctx_set_jobs(nft, jobs);
+			break;
+		}
+		case OPT_COMPILE:
+			nft_ctx_set_compile_output(nft, optarg);
+			compile = true;
+			break;
+		case OPT_RAW_COUNTERS:
+			raw_counters = true;
+			break;
+		case OPT_SAVE_RAW:
+			save_path = optarg;
+			break;
+		case OPT_DAEMON:
+			daemon_path = optarg;
+			break;
+		case OPT_BATCH_WINDOW: {
+			unsigned long ms;
+			char *end;
+
+			errno = 0;
+			ms = strtoul(optarg, &end, 10);
+			if (errno || *end || ms > 60000) {
+				fprintf(stderr, "invalid batch window `%s'\n",
+					optarg);
+				goto out_fail;
+			}
+			window_ms = ms;
+			window = true;
+			break;
+		}
+		case OPT_SPLIT_ELEMENTS:
+			nft_ctx_input_set_flags(nft, nft_ctx_input_get_flags(nft) |
+					       NFT_CTX_INPUT_SPLIT_ELEMENTS);
+			break;
+		case OPT_DIFF:
+			nft_ctx_input_set_flags(nft, nft_ctx_input_get_flags(nft) |
+					       NFT_CTX_INPUT_DIFF);
+			break;
+		case OPT_IF_CHANGED:
+			nft_ctx_input_set_flags(nft, nft_ctx_input_get_flags(nft) |
+					       NFT_CTX_INPUT_IF_CHANGED);
+			break;
+		case OPT_SET_HINTS:
+			nft_ctx_input_set_flags(nft, nft_ctx_input_get_flags(nft) |
+					       NFT_CTX_INPUT_SET_HINTS);
+			break;
+		case OPT_OFFLINE:
+			nft_ctx_set_offline(nft, optarg);
+			nft_ctx_set_dry_run(nft, true);
 			break;
 		case OPT_INVALID:
 			goto out_fail;
@@ -511,9 +815,44 @@ int main(int argc, char * const *argv)
 		goto out_fail;
 	}
 
+	if (!filename && compile) {
+		fprintf(stderr, "Error: -C/--compile-to can only be used with -f/--filename\n");
+		goto out_fail;
+	}
+
+	if (!daemon_path && window) {
+		fprintf(stderr, "Error: -w/--batch-window can only be used with -l/--daemon\n");
+		goto out_fail;
+	}
+
+	if (daemon_path &&
+	    (filename || interactive || raw_counters || optind != argc)) {
+		fprintf(stderr, "Error: -l/--daemon does not take commands\n");
+		goto out_fail;
+	}
+
+	if (raw_counters && (filename || interactive)) {
+		fprintf(stderr, "Error: -r/--raw-counters cannot be combined with -f/--file or -i/--interactive\n");
+		goto out_fail;
+	}
+
+	if (save_path &&
+	    (filename || interactive || raw_counters || daemon_path ||
+	     optind != argc)) {
+		fprintf(stderr, "Error: -W/--save-raw does not take commands\n");
+		goto out_fail;
+	}
+
 	nft_ctx_output_set_flags(nft, output_flags);
 
-	if (optind != argc) {
+	if (daemon_path) {
+		rc = daemon_run(nft, daemon_path, window_ms);
+	} else if (save_path) {
+		rc = !!nft_save_raw(nft, save_path);
+	} else if (raw_counters) {
+		rc = print_raw_counters(argc - optind, argv + optind,
+					output_flags & NFT_CTX_OUTPUT_HANDLE);
+	} else if (optind != argc) {
 		char *buf;
 
 		for (len = 0, i = optind; i < argc; i++)
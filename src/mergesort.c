@@ -10,6 +10,7 @@
 
 #include <expression.h>
 #include <gmputil.h>
+#include <parallel.h>
 #include <list.h>
 
 static void concat_expr_msort_value(const struct expr *expr, mpz_t value)
@@ -51,72 +52,278 @@ static mpz_srcptr expr_msort_value(const struct expr *expr, mpz_t value)
 	return value;
 }
 
-static int expr_msort_cmp(const struct expr *e1, const struct expr *e2)
+/*
+ * Each element is encoded once into a sort key: the big endian magnitude of
+ * its msort value without leading zeroes, so keys compare by length first
+ * and then by memcmp(). This follows the mpz_cmp() order of the values.
+ */
+struct expr_sort_key {
+	struct expr		*expr;
+	const unsigned char	*data;
+	size_t			len;
+};
+
+/*
+ * A shard encodes and sorts a slice of the key array, each shard owns the
+ * buffer that stores the encoded keys of its slice.
+ */
+struct expr_sort_shard {
+	struct expr_sort_key	*key;
+	struct expr_sort_key	*tmp;
+	unsigned int		num;
+	unsigned char		*data;
+	size_t			data_len;
+	size_t			data_size;
+	bool			sort;
+};
+
+/* Do not spawn a thread for less than this number of elements. */
+#define NFT_MSORT_SHARD_MIN	65536
+
+static void expr_sort_shard_encode(struct expr_sort_shard *shard)
 {
-	mpz_srcptr value1;
-	mpz_srcptr value2;
-	mpz_t value1_tmp;
-	mpz_t value2_tmp;
-	int ret;
-
-	mpz_init(value1_tmp);
-	mpz_init(value2_tmp);
-	value1 = expr_msort_value(e1, value1_tmp);
-	value2 = expr_msort_value(e2, value2_tmp);
-	ret = mpz_cmp(value1, value2);
-	mpz_clear(value1_tmp);
-	mpz_clear(value2_tmp);
-
-	return ret;
+	size_t *offset, len;
+	mpz_srcptr value;
+	unsigned int k;
+	mpz_t tmp;
+
+	offset = xmalloc_array(shard->num, sizeof(*offset));
+
+	mpz_init(tmp);
+	for (k = 0; k < shard->num; k++) {
+		value = expr_msort_value(shard->key[k].expr, tmp);
+		len = mpz_sgn(value) ?
+		      div_round_up(mpz_sizeinbase(value, 2), BITS_PER_BYTE) : 0;
+
+		if (shard->data_len + len > shard->data_size) {
+			shard->data_size = 2 * (shard->data_len + len);
+			shard->data = xrealloc(shard->data, shard->data_size);
+		}
+		if (len)
+			mpz_export_data(shard->data + shard->data_len, value,
+					BYTEORDER_BIG_ENDIAN, len);
+
+		offset[k] = shard->data_len;
+		shard->key[k].len = len;
+		shard->data_len += len;
+	}
+	mpz_clear(tmp);
+
+	/* the buffer does not move anymore. */
+	for (k = 0; k < shard->num; k++)
+		shard->key[k].data = shard->data + offset[k];
+
+	free(offset);
 }
 
-void list_splice_sorted(struct list_head *list, struct list_head *head)
+static int expr_sort_key_cmp(const struct expr_sort_key *k1,
+			     const struct expr_sort_key *k2)
 {
-	struct list_head *h = head->next;
-	struct list_head *l = list->next;
-
-	while (l != list) {
-		if (h == head ||
-		    expr_msort_cmp(list_entry(l, typeof(struct expr), list),
-				   list_entry(h, typeof(struct expr), list)) <= 0) {
-			l = l->next;
-			list_add_tail(l->prev, h);
-			continue;
-		}
+	if (k1->len != k2->len)
+		return k1->len < k2->len ? -1 : 1;
+
+	return memcmp(k1->data, k2->data, k1->len);
+}
+
+/* Stable merge of the sorted runs key[lo, mid) and key[mid, hi). */
+static void expr_sort_keys_merge(struct expr_sort_key *key,
+				 struct expr_sort_key *tmp,
+				 unsigned int lo, unsigned int mid,
+				 unsigned int hi)
+{
+	unsigned int i = lo, j = mid, k = lo;
+
+	if (lo == mid || mid == hi ||
+	    expr_sort_key_cmp(&key[mid - 1], &key[mid]) <= 0)
+		return;
 
-		h = h->next;
+	while (i < mid && j < hi) {
+		if (expr_sort_key_cmp(&key[i], &key[j]) <= 0)
+			tmp[k++] = key[i++];
+		else
+			tmp[k++] = key[j++];
 	}
+	while (i < mid)
+		tmp[k++] = key[i++];
+	while (j < hi)
+		tmp[k++] = key[j++];
+
+	memcpy(&key[lo], &tmp[lo], (hi - lo) * sizeof(*key));
+}
+
+static void expr_sort_keys_sort(struct expr_sort_key *key,
+				struct expr_sort_key *tmp,
+				unsigned int lo, unsigned int hi)
+{
+	unsigned int mid;
+
+	if (hi - lo < 2)
+		return;
+
+	mid = lo + (hi - lo) / 2;
+	expr_sort_keys_sort(key, tmp, lo, mid);
+	expr_sort_keys_sort(key, tmp, mid, hi);
+	expr_sort_keys_merge(key, tmp, lo, mid, hi);
 }
 
-static void list_cut_middle(struct list_head *list, struct list_head *head)
+static void expr_sort_shard_run(void *data, unsigned int k)
 {
-	struct list_head *s = head->next;
-	struct list_head *e = head->prev;
+	struct expr_sort_shard *shard = (struct expr_sort_shard *)data + k;
 
-	while (e != s) {
-		e = e->prev;
+	expr_sort_shard_encode(shard);
+	if (shard->sort)
+		expr_sort_keys_sort(shard->key, shard->tmp, 0, shard->num);
+}
+
+/*
+ * Split the keys in @n shards that are encoded, and sorted if @sort is set,
+ * from up to @n threads. Shards start at the offsets stored in @bound,
+ * @bound[@n] is the number of keys.
+ */
+static void expr_sort_shards_run(struct expr_sort_shard *shard,
+				 struct expr_sort_key *key,
+				 struct expr_sort_key *tmp,
+				 unsigned int num, unsigned int n,
+				 bool sort, unsigned int *bound)
+{
+	unsigned int k;
 
-		if (e != s)
-			s = s->next;
+	for (k = 0; k < n; k++) {
+		bound[k] = (uint64_t)num * k / n;
+		memset(&shard[k], 0, sizeof(shard[k]));
+		shard[k].key = &key[bound[k]];
+		shard[k].tmp = &tmp[bound[k]];
+		shard[k].num = (uint64_t)num * (k + 1) / n - bound[k];
+		shard[k].sort = sort;
 	}
+	bound[n] = num;
 
-	__list_cut_position(list, head, s);
+	nft_parallel_for(n, n, expr_sort_shard_run, shard);
 }
 
-void list_expr_sort(struct list_head *head)
+static void expr_sort_shards_free(struct expr_sort_shard *shard,
+				  unsigned int n)
+{
+	unsigned int k;
+
+	for (k = 0; k < n; k++)
+		free(shard[k].data);
+}
+
+static struct expr_sort_key *expr_sort_keys_alloc(struct list_head *list,
+						  struct list_head *head,
+						  unsigned int num)
 {
-	struct list_head *list;
-	LIST_HEAD(temp);
+	struct expr_sort_key *key;
+	unsigned int k = 0;
+	struct expr *i;
 
-	list = &temp;
+	key = xmalloc_array(num, sizeof(struct expr_sort_key));
+
+	list_for_each_entry(i, list, list)
+		key[k++].expr = i;
+	if (head) {
+		list_for_each_entry(i, head, list)
+			key[k++].expr = i;
+	}
+
+	return key;
+}
+
+static void expr_sort_keys_splice(const struct expr_sort_key *key,
+				  unsigned int num, struct list_head *head)
+{
+	unsigned int k;
+
+	init_list_head(head);
+	for (k = 0; k < num; k++)
+		list_add_tail(&key[k].expr->list, head);
+}
+
+static unsigned int list_count(const struct list_head *head)
+{
+	const struct expr *i;
+	unsigned int num = 0;
+
+	list_for_each_entry(i, head, list)
+		num++;
+
+	return num;
+}
+
+void list_splice_sorted(struct list_head *list, struct list_head *head)
+{
+	struct expr_sort_key *key, *tmp;
+	struct expr_sort_shard shard;
+	unsigned int mid, num, bound[2];
+
+	if (list_empty(list))
+		return;
+
+	/* elements in @list go first in case of equal keys. */
+	mid = list_count(list);
+	num = mid + list_count(head);
+
+	key = expr_sort_keys_alloc(list, head, num);
+	tmp = xmalloc_array(num, sizeof(*tmp));
+
+	expr_sort_shards_run(&shard, key, tmp, num, 1, false, bound);
+	expr_sort_keys_merge(key, tmp, 0, mid, num);
+
+	expr_sort_keys_splice(key, num, head);
+	init_list_head(list);
+
+	expr_sort_shards_free(&shard, 1);
+	free(tmp);
+	free(key);
+}
+
+/*
+ * Sort the list from up to @jobs threads. Each shard is sorted on its own,
+ * then the sorted runs are merged pairwise. Since the sort and the merges
+ * are stable, the result does not depend on the number of shards.
+ */
+void list_expr_sort_jobs(struct list_head *head, unsigned int jobs)
+{
+	struct expr_sort_key *key, *tmp;
+	unsigned int num, n, k, width;
+	struct expr_sort_shard *shard;
+	unsigned int *bound;
 
 	if (list_empty(head) || list_is_singular(head))
 		return;
 
-	list_cut_middle(list, head);
+	num = list_count(head);
+
+	n = min(jobs, num / NFT_MSORT_SHARD_MIN);
+	if (n == 0)
+		n = 1;
 
-	list_expr_sort(head);
-	list_expr_sort(list);
+	key = expr_sort_keys_alloc(head, NULL, num);
+	tmp = xmalloc_array(num, sizeof(*tmp));
+	shard = xmalloc_array(n, sizeof(*shard));
+	bound = xmalloc_array(n + 1, sizeof(*bound));
 
-	list_splice_sorted(list, head);
+	expr_sort_shards_run(shard, key, tmp, num, n, true, bound);
+
+	for (width = 1; width < n; width *= 2) {
+		for (k = 0; k + width < n; k += 2 * width) {
+			expr_sort_keys_merge(key, tmp, bound[k],
+					     bound[k + width],
+					     bound[min(k + 2 * width, n)]);
+		}
+	}
+
+	expr_sort_keys_splice(key, num, head);
+
+	expr_sort_shards_free(shard, n);
+	free(bound);
+	free(shard);
+	free(tmp);
+	free(key);
+}
+
+void list_expr_sort(struct list_head *head)
+{
+	list_expr_sort_jobs(head, 1);
 }
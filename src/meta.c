@@ -323,33 +323,33 @@ const struct datatype pkttype_type = {
 	.sym_tbl	= &pkttype_type_tbl,
 };
 
-void devgroup_table_init(struct nft_ctx *ctx)
-{
-	ctx->output.tbl.devgroup = rt_symbol_table_init("group");
-}
+static struct rt_symbol_db devgroup_db = {
+	.filename	= "group",
+};
 
-void devgroup_table_exit(struct nft_ctx *ctx)
+const struct symbol_table *devgroup_table(struct symbol_tables *tbl)
 {
-	rt_symbol_table_free(ctx->output.tbl.devgroup);
+	return rt_symbol_db_get(&devgroup_db, &tbl->devgroup);
 }
 
 static void devgroup_type_print(const struct expr *expr,
 				struct output_ctx *octx)
 {
-	return symbolic_constant_print(octx->tbl.devgroup, expr, true, octx);
+	return symbolic_constant_print(devgroup_table(&octx->tbl), expr, true,
+				       octx);
 }
 
 static struct error_record *devgroup_type_parse(struct parse_ctx *ctx,
 						const struct expr *sym,
 						struct expr **res)
 {
-	return symbolic_constant_parse(ctx, sym, ctx->tbl->devgroup, res);
+	return symbolic_constant_parse(ctx, sym, devgroup_table(ctx->tbl), res);
 }
 
 static void devgroup_type_describe(struct output_ctx *octx)
 {
 	rt_symbol_table_describe(octx, "group",
-				 octx->tbl.devgroup, &devgroup_type);
+				 devgroup_table(&octx->tbl), &devgroup_type);
 }
 
 const struct datatype devgroup_type = {
@@ -33,44 +33,60 @@ static unsigned int min_distance(unsigned int *cost)
 }
 
 /* A simple implementation of "The string-to-string correction problem (1974)"
- * by Robert A. Wagner.
+ * by Robert A. Wagner, extended with transpositions of adjacent characters.
+ *
+ * Only distances up to @bound are of interest: the matrix is computed one
+ * row at a time and the walk stops with @bound + 1 as soon as two
+ * consecutive rows are above @bound, since no later row can go below that.
  */
-static unsigned int string_distance(const char *a, const char *b)
+static unsigned int string_distance(const char *a, unsigned int len_a,
+				    const char *b, unsigned int len_b,
+				    unsigned int bound)
 {
-	unsigned int len_a = strlen(a);
-	unsigned int len_b = strlen(b);
-	unsigned int *distance;
-	unsigned int i, j, ret;
-
-	distance = xzalloc((len_a + 1) * (len_b + 1) * sizeof(unsigned int));
+	unsigned int *row, *prev, *prev2, *tmp, *distance;
+	unsigned int i, j, row_min, prev_min = 0, ret;
 
-#define DISTANCE(__i, __j)	distance[(__i) * len_b + (__j)]
+	distance = xmalloc_array(3 * (len_b + 1), sizeof(unsigned int));
+	prev2 = distance;
+	prev = prev2 + len_b + 1;
+	row = prev + len_b + 1;
 
-	for (i = 0; i <= len_a; i++)
-		DISTANCE(i, 0) = i;
 	for (j = 0; j <= len_b; j++)
-		DISTANCE(0, j) = j;
+		prev[j] = j;
 
 	for (i = 1; i <= len_a; i++) {
+		row[0] = row_min = i;
+
 		for (j = 1; j <= len_b; j++) {
-			unsigned int subcost = (a[i] == b[j]) ? 0 : 1;
-			unsigned int cost[3];
+			unsigned int subcost = (a[i - 1] == b[j - 1]) ? 0 : 1;
+			unsigned int cost[DISTANCE_MAX];
 
-			cost[DELETION] = DISTANCE(i - 1, j) + 1;
-			cost[INSERTION] = DISTANCE(i, j - 1) + 1;
-			cost[TRANSFORMATION] = DISTANCE(i - 1, j - 1) + subcost;
-			DISTANCE(i, j) = min_distance(cost);
+			cost[DELETION] = prev[j] + 1;
+			cost[INSERTION] = row[j - 1] + 1;
+			cost[TRANSFORMATION] = prev[j - 1] + subcost;
+			row[j] = min_distance(cost);
 
 			if (i > 1 && j > 1 &&
-			    a[i] == b[j - 1] &&
-			    a[i - 1] == b[j])
-				DISTANCE(i, j) =
-					min(DISTANCE(i, j),
-					    DISTANCE(i - 2, j - 2) + subcost);
+			    a[i - 1] == b[j - 2] &&
+			    a[i - 2] == b[j - 1])
+				row[j] = min(row[j], prev2[j - 2] + 1);
+
+			row_min = min(row_min, row[j]);
+		}
+
+		if (row_min > bound && prev_min > bound) {
+			free(distance);
+			return bound + 1;
 		}
+		prev_min = row_min;
+
+		tmp = prev2;
+		prev2 = prev;
+		prev = row;
+		row = tmp;
 	}
 
-	ret = DISTANCE(len_a, len_b);
+	ret = prev[len_b];
 
 	free(distance);
 
@@ -102,7 +118,17 @@ int string_misspell_update(const char *a, const char *b,
 	else
 		threshold = div_round_up(max_len + 2, 3);
 
-	distance = string_distance(a, b);
+	/* Only a closer candidate than the best one so far is of interest,
+	 * and the distance is at least the difference in length.
+	 */
+	if (st->min_distance == 0)
+		return 0;
+	if (st->min_distance <= threshold)
+		threshold = st->min_distance - 1;
+	if (max_len - min_len > threshold)
+		return 0;
+
+	distance = string_distance(a, len_a, b, len_b, threshold);
 	if (distance > threshold)
 		return 0;
 	else if (distance < st->min_distance) {
@@ -35,8 +35,15 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <utils.h>
 #include <nftables.h>
+#include <timing.h>
+#include <fingerprint.h>
+#include <optimize.h>
+#include <uring.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_arp.h>
 
@@ -66,10 +73,21 @@ struct mnl_socket *nft_mnl_socket_open(void)
 		netlink_init_error();
 
 	mnl_socket_setsockopt(nf_sock, NETLINK_EXT_ACK, &one, sizeof(one));
+	/* Batch messages do not request NLM_F_ACK, hence the kernel only
+	 * reports errors. Do not echo the original message in error reports,
+	 * the sequence number and the extended ack offset are sufficient to
+	 * map the error to the command.
+	 */
+	mnl_socket_setsockopt(nf_sock, NETLINK_CAP_ACK, &one, sizeof(one));
 
 	return nf_sock;
 }
 
+static struct mnl_socket *nft_mnl_sock(const struct netlink_ctx *ctx)
+{
+	return ctx->nf_sock ? ctx->nf_sock : ctx->nft->nf_sock;
+}
+
 uint32_t mnl_seqnum_inc(unsigned int *seqnum)
 {
 	return (*seqnum)++;
@@ -91,7 +109,7 @@ nft_mnl_recv(struct netlink_ctx *ctx, uint32_t portid,
 	bool eintr = false;
 	int ret;
 
-	ret = mnl_socket_recvfrom(ctx->nft->nf_sock, buf, sizeof(buf));
+	ret = mnl_socket_recvfrom(nft_mnl_sock(ctx), buf, sizeof(buf));
 	while (ret > 0) {
 		ret = mnl_cb_run(buf, ret, ctx->seqnum, portid, cb, cb_data);
 		if (ret == 0)
@@ -107,7 +125,7 @@ nft_mnl_recv(struct netlink_ctx *ctx, uint32_t portid,
 			/* process all pending messages before reporting EINTR */
 			eintr = true;
 		}
-		ret = mnl_socket_recvfrom(ctx->nft->nf_sock, buf, sizeof(buf));
+		ret = mnl_socket_recvfrom(nft_mnl_sock(ctx), buf, sizeof(buf));
 	}
 	if (eintr) {
 		ret = -1;
@@ -116,46 +134,184 @@ nft_mnl_recv(struct netlink_ctx *ctx, uint32_t portid,
 	return ret;
 }
 
+/* The io_uring backend, if available, is set up on first use. It is only
+ * used for the socket of the context: dumps from several threads come with
+ * sockets of their own.
+ */
+static struct nft_uring *nft_mnl_uring(const struct netlink_ctx *ctx)
+{
+	struct nft_ctx *nft = ctx->nft;
+
+	if (ctx->nf_sock)
+		return NULL;
+
+	if (!nft->uring)
+		nft->uring = nft_uring_open(NFT_NLMSG_MAXSIZE);
+
+	return nft->uring;
+}
+
+struct nft_mnl_uring_data {
+	const struct netlink_ctx *ctx;
+	uint32_t		portid;
+	int			(*cb)(const struct nlmsghdr *nlh, void *data);
+	void			*cb_data;
+	bool			eintr;
+};
+
+static int nft_mnl_uring_cb(const void *buf, size_t len, void *data)
+{
+	struct nft_mnl_uring_data *d = data;
+	int ret;
+
+	ret = mnl_cb_run(buf, len, d->ctx->seqnum, d->portid, d->cb,
+			 d->cb_data);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		if (errno == EINTR) {
+			d->eintr = true;
+			return 1;
+		}
+	}
+	return ret;
+}
+
+/* Same as nft_mnl_recv(), the request and the whole dump go through the
+ * ring.
+ */
+static int nft_mnl_uring_talk(struct netlink_ctx *ctx, struct nft_uring *ring,
+			      const void *data, unsigned int len,
+			      int (*cb)(const struct nlmsghdr *nlh, void *data),
+			      void *cb_data)
+{
+	struct mnl_socket *nf_sock = nft_mnl_sock(ctx);
+	int fd = mnl_socket_get_fd(nf_sock);
+	const struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK
+	};
+	struct iovec iov = {
+		.iov_base	= (void *)data,
+		.iov_len	= len,
+	};
+	struct msghdr msg = {
+		.msg_name	= (void *)&snl,
+		.msg_namelen	= sizeof(snl),
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	struct nft_mnl_uring_data d = {
+		.ctx		= ctx,
+		.portid		= mnl_socket_get_portid(nf_sock),
+		.cb		= cb,
+		.cb_data	= cb_data,
+	};
+	int ret;
+
+	if (nft_uring_sendmsg(ring, fd, &msg) < 0)
+		return -1;
+
+	ret = nft_uring_recv(ring, fd, nft_mnl_uring_cb, &d, NULL);
+	if (ret >= 0 && d.eintr) {
+		ret = -1;
+		errno = EINTR;
+	}
+	return ret;
+}
+
 int
 nft_mnl_talk(struct netlink_ctx *ctx, const void *data, unsigned int len,
 	     int (*cb)(const struct nlmsghdr *nlh, void *data), void *cb_data)
 {
-	uint32_t portid = mnl_socket_get_portid(ctx->nft->nf_sock);
+	struct mnl_socket *nf_sock = nft_mnl_sock(ctx);
+	uint32_t portid = mnl_socket_get_portid(nf_sock);
+	struct nft_uring *ring;
 
 	if (ctx->nft->debug_mask & NFT_DEBUG_MNL)
 		mnl_nlmsg_fprintf(ctx->nft->output.output_fp, data, len,
 				  sizeof(struct nfgenmsg));
 
-	if (mnl_socket_sendto(ctx->nft->nf_sock, data, len) < 0)
+	ring = nft_mnl_uring(ctx);
+	if (ring)
+		return nft_mnl_uring_talk(ctx, ring, data, len, cb, cb_data);
+
+	if (mnl_socket_sendto(nf_sock, data, len) < 0)
 		return -1;
 
 	return nft_mnl_recv(ctx, portid, cb, cb_data);
 }
 
+/* Send several requests at once, without acknowledgment. The kernel handles
+ * them from sendmsg(), so all errors are queued once it returns. Drain them
+ * and report the first one.
+ */
+int nft_mnl_send_requests(struct netlink_ctx *ctx, const void *data,
+			  unsigned int len)
+{
+	struct mnl_socket *nf_sock = nft_mnl_sock(ctx);
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int ret, err = 0;
+
+	if (ctx->nft->debug_mask & NFT_DEBUG_MNL)
+		mnl_nlmsg_fprintf(ctx->nft->output.output_fp, data, len,
+				  sizeof(struct nfgenmsg));
+
+	if (mnl_socket_sendto(nf_sock, data, len) < 0)
+		return -1;
+
+	for (;;) {
+		ret = mnl_socket_recvfrom(nf_sock, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		if (mnl_cb_run(buf, ret, 0, 0, NULL, NULL) < 0 && !err)
+			err = errno;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Rule-set consistency check across several netlink dumps
+ *
+ * Listing sessions update the last seen generation id from several threads,
+ * the caller compares the value that is returned to its own probe after the
+ * dumps, see nft_cache_update().
  */
 static uint32_t nft_genid;
 
 static int genid_cb(const struct nlmsghdr *nlh, void *data)
 {
 	struct nfgenmsg *nfh = mnl_nlmsg_get_payload(nlh);
+	uint32_t *genid = data;
 
-	nft_genid = ntohs(nfh->res_id);
+	*genid = ntohs(nfh->res_id);
+	__atomic_store_n(&nft_genid, *genid, __ATOMIC_RELAXED);
 
 	return MNL_CB_OK;
 }
 
 uint32_t mnl_genid_get(struct netlink_ctx *ctx)
 {
+	uint32_t genid = __atomic_load_n(&nft_genid, __ATOMIC_RELAXED);
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
 
 	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETGEN, AF_UNSPEC, 0, ctx->seqnum);
 	/* Skip error checking, old kernels sets res_id field to zero. */
-	nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, genid_cb, NULL);
+	nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, genid_cb, &genid);
 
-	return nft_genid;
+	return genid;
 }
 
 static uint16_t nft_genid_u16(uint32_t genid)
@@ -167,7 +323,8 @@ static int check_genid(const struct nlmsghdr *nlh)
 {
 	struct nfgenmsg *nfh = mnl_nlmsg_get_payload(nlh);
 
-	if (nft_genid_u16(nft_genid) != ntohs(nfh->res_id)) {
+	if (nft_genid_u16(__atomic_load_n(&nft_genid, __ATOMIC_RELAXED)) !=
+	    ntohs(nfh->res_id)) {
 		errno = EINTR;
 		return -1;
 	}
@@ -184,49 +341,184 @@ static int check_genid(const struct nlmsghdr *nlh)
  */
 #define BATCH_PAGE_SIZE 2 * 1024 * 1024
 
-struct nftnl_batch *mnl_batch_init(void)
+/*
+ * Batch pages come from a pool in the context and go back to it once the
+ * batch is done, so runs of small transactions do not allocate them again.
+ * The pool keeps at most BATCH_POOL_MAX pages, the rest is freed.
+ */
+#define BATCH_POOL_MAX	4
+
+struct mnl_batch_page {
+	struct list_head	list;
+	uint32_t		len;
+	char			buf[];
+};
+
+struct mnl_batch_pool {
+	struct list_head	pages;
+	unsigned int		num;
+	struct mnl_batch	*spare;
+};
+
+struct mnl_batch {
+	struct nft_ctx		*nft;
+	struct list_head	pages;
+	struct mnl_batch_page	*cur;
+	unsigned int		num_pages;
+};
+
+static struct mnl_batch_page *mnl_batch_page_get(struct mnl_batch *batch)
 {
-	struct nftnl_batch *batch;
+	struct mnl_batch_pool *pool = batch->nft->batch_pool;
+	struct mnl_batch_page *page;
+
+	if (pool && pool->num > 0) {
+		page = list_first_entry(&pool->pages, struct mnl_batch_page,
+					list);
+		list_del(&page->list);
+		pool->num--;
+	} else {
+		/* room for one message beyond the page size, which then moves
+		 * to the next page, see mnl_nft_batch_continue().
+		 */
+		page = xmalloc(sizeof(*page) + BATCH_PAGE_SIZE +
+			       NFT_NLMSG_MAXSIZE);
+	}
 
-	batch = nftnl_batch_alloc(BATCH_PAGE_SIZE, NFT_NLMSG_MAXSIZE);
-	if (batch == NULL)
-		memory_allocation_error();
+	page->len = 0;
+	list_add_tail(&page->list, &batch->pages);
+	batch->cur = page;
+	batch->num_pages++;
+
+	return page;
+}
+
+void mnl_batch_pool_free(struct mnl_batch_pool *pool)
+{
+	struct mnl_batch_page *page, *next;
+
+	if (!pool)
+		return;
+
+	list_for_each_entry_safe(page, next, &pool->pages, list)
+		free(page);
+	free(pool->spare);
+	free(pool);
+}
+
+struct mnl_batch *mnl_batch_init(struct nft_ctx *nft)
+{
+	struct mnl_batch_pool *pool = nft->batch_pool;
+	struct mnl_batch *batch;
+
+	if (pool && pool->spare) {
+		batch = pool->spare;
+		pool->spare = NULL;
+	} else {
+		batch = xmalloc(sizeof(*batch));
+	}
+	batch->nft = nft;
+	batch->num_pages = 0;
+	init_list_head(&batch->pages);
+	mnl_batch_page_get(batch);
 
 	return batch;
 }
 
-static void mnl_nft_batch_continue(struct nftnl_batch *batch)
+void *mnl_batch_buffer(struct mnl_batch *batch)
 {
-	if (nftnl_batch_update(batch) < 0)
-		memory_allocation_error();
+	return batch->cur->buf + batch->cur->len;
+}
+
+/* Account the message just built at the end of the batch. */
+void mnl_nft_batch_continue(struct mnl_batch *batch)
+{
+	struct mnl_batch_page *page = batch->cur;
+	struct nlmsghdr *nlh = mnl_batch_buffer(batch);
+
+	if (page->len + nlh->nlmsg_len <= BATCH_PAGE_SIZE) {
+		page->len += nlh->nlmsg_len;
+		return;
+	}
+
+	page = mnl_batch_page_get(batch);
+	memcpy(page->buf, nlh, nlh->nlmsg_len);
+	page->len = nlh->nlmsg_len;
+}
+
+static uint32_t mnl_batch_buffer_len(const struct mnl_batch *batch)
+{
+	return batch->cur->len;
+}
+
+uint32_t mnl_batch_iovec_len(const struct mnl_batch *batch)
+{
+	return batch->num_pages;
+}
+
+void mnl_batch_iovec(const struct mnl_batch *batch, struct iovec *iov,
+		     uint32_t iov_len)
+{
+	const struct mnl_batch_page *page;
+	uint32_t i = 0;
+
+	list_for_each_entry(page, &batch->pages, list) {
+		if (i >= iov_len)
+			break;
+
+		iov[i].iov_base = (void *)page->buf;
+		iov[i].iov_len = page->len;
+		i++;
+	}
 }
 
-uint32_t mnl_batch_begin(struct nftnl_batch *batch, uint32_t seqnum)
+uint32_t mnl_batch_begin(struct mnl_batch *batch, uint32_t seqnum)
 {
-	nftnl_batch_begin(nftnl_batch_buffer(batch), seqnum);
+	nftnl_batch_begin(mnl_batch_buffer(batch), seqnum);
 	mnl_nft_batch_continue(batch);
 
 	return seqnum;
 }
 
-void mnl_batch_end(struct nftnl_batch *batch, uint32_t seqnum)
+void mnl_batch_end(struct mnl_batch *batch, uint32_t seqnum)
 {
-	nftnl_batch_end(nftnl_batch_buffer(batch), seqnum);
+	nftnl_batch_end(mnl_batch_buffer(batch), seqnum);
 	mnl_nft_batch_continue(batch);
 }
 
-bool mnl_batch_ready(struct nftnl_batch *batch)
+bool mnl_batch_ready(struct mnl_batch *batch)
 {
 	/* Check if the batch only contains the initial and trailing batch
 	 * messages. In that case, the batch is empty.
 	 */
-	return nftnl_batch_buffer_len(batch) !=
+	return mnl_batch_buffer_len(batch) !=
 	       (NLMSG_HDRLEN + sizeof(struct nfgenmsg)) * 2;
 }
 
-void mnl_batch_reset(struct nftnl_batch *batch)
+void mnl_batch_reset(struct mnl_batch *batch)
 {
-	nftnl_batch_free(batch);
+	struct mnl_batch_pool *pool = batch->nft->batch_pool;
+	struct mnl_batch_page *page, *next;
+
+	if (!pool) {
+		pool = batch->nft->batch_pool = xzalloc(sizeof(*pool));
+		init_list_head(&pool->pages);
+	}
+
+	list_for_each_entry_safe(page, next, &batch->pages, list) {
+		list_del(&page->list);
+		if (pool->num < BATCH_POOL_MAX) {
+			list_add(&page->list, &pool->pages);
+			pool->num++;
+		} else {
+			free(page);
+		}
+	}
+
+	if (!pool->spare)
+		pool->spare = batch;
+	else
+		free(batch);
 }
 
 static void mnl_err_list_node_add(struct list_head *err_list, int error,
@@ -247,19 +539,23 @@ void mnl_err_list_free(struct mnl_err *err)
 	free(err);
 }
 
-static void mnl_set_sndbuffer(struct netlink_ctx *ctx)
+static int mnl_get_sndbuffer(struct netlink_ctx *ctx)
 {
 	struct mnl_socket *nl = ctx->nft->nf_sock;
-	struct nftnl_batch *batch = ctx->batch;
 	socklen_t len = sizeof(int);
 	int sndnlbuffsiz = 0;
-	int newbuffsiz;
 
 	getsockopt(mnl_socket_get_fd(nl), SOL_SOCKET, SO_SNDBUF,
 		   &sndnlbuffsiz, &len);
 
-	newbuffsiz = nftnl_batch_iovec_len(batch) * BATCH_PAGE_SIZE;
-	if (newbuffsiz <= sndnlbuffsiz)
+	return sndnlbuffsiz;
+}
+
+static void mnl_set_sndbuffer(struct netlink_ctx *ctx, int newbuffsiz)
+{
+	struct mnl_socket *nl = ctx->nft->nf_sock;
+
+	if (newbuffsiz <= mnl_get_sndbuffer(ctx))
 		return;
 
 	/* Rise sender buffer length to avoid hitting -EMSGSIZE */
@@ -311,12 +607,14 @@ static void mnl_nft_batch_to_msg(struct netlink_ctx *ctx, struct msghdr *msg,
 	msg->msg_iov		= iov;
 	msg->msg_iovlen		= iov_len;
 
-	nftnl_batch_iovec(ctx->batch, iov, iov_len);
+	mnl_batch_iovec(ctx->batch, iov, iov_len);
 }
 
 static ssize_t mnl_nft_socket_sendmsg(struct netlink_ctx *ctx,
+				      struct nft_uring *ring,
 				      const struct msghdr *msg)
 {
+	int fd = mnl_socket_get_fd(ctx->nft->nf_sock);
 	uint32_t iov_len = msg->msg_iovlen;
 	struct iovec *iov = msg->msg_iov;
 	unsigned int i;
@@ -329,7 +627,11 @@ static ssize_t mnl_nft_socket_sendmsg(struct netlink_ctx *ctx,
 		}
 	}
 
-	return sendmsg(mnl_socket_get_fd(ctx->nft->nf_sock), msg, 0);
+	/* acknowledgments are received from the ring too */
+	if (ring)
+		return nft_uring_sendmsg(ring, fd, msg);
+
+	return sendmsg(fd, msg, 0);
 }
 
 static int err_attr_cb(const struct nlattr *attr, void *data)
@@ -384,6 +686,7 @@ static int mnl_batch_extack_cb(const struct nlmsghdr *nlh, void *data)
 
 	mnl_err_list_node_add(cb_data->err_list, errval,
 			      nlh->nlmsg_seq, off, msg);
+	cb_data->nl_ctx->ack_stats.errors++;
 	return MNL_CB_ERROR;
 }
 
@@ -391,105 +694,491 @@ static int mnl_batch_extack_cb(const struct nlmsghdr *nlh, void *data)
 #define NFT_MNL_ACK_MAXSIZE		((sizeof(struct nlmsghdr) + \
 					  sizeof(struct nfgenmsg) + (1 << 16)) + \
 					  MNL_SOCKET_BUFFER_SIZE)
+#define NFT_MNL_ACK_RING_SIZE		8
+#define NFT_MNL_RCVBUFF_MAX		(1U << 28)
+
+/* Ring of receive buffers, filled in one go via recvmmsg(). */
+struct mnl_ack_ring {
+	struct mmsghdr	msg[NFT_MNL_ACK_RING_SIZE];
+	struct iovec	iov[NFT_MNL_ACK_RING_SIZE];
+	char		*buf;
+};
 
-int mnl_batch_talk(struct netlink_ctx *ctx, struct list_head *err_list,
-		   uint32_t num_cmds)
+static struct mnl_ack_ring *mnl_ack_ring_alloc(void)
+{
+	struct mnl_ack_ring *ring;
+	int i;
+
+	ring = xzalloc(sizeof(*ring));
+	ring->buf = xmalloc(NFT_MNL_ACK_RING_SIZE * NFT_MNL_ACK_MAXSIZE);
+
+	for (i = 0; i < NFT_MNL_ACK_RING_SIZE; i++) {
+		ring->iov[i].iov_base = ring->buf + i * NFT_MNL_ACK_MAXSIZE;
+		ring->iov[i].iov_len = NFT_MNL_ACK_MAXSIZE;
+		ring->msg[i].msg_hdr.msg_iov = &ring->iov[i];
+		ring->msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return ring;
+}
+
+static void mnl_ack_ring_free(struct mnl_ack_ring *ring)
+{
+	free(ring->buf);
+	free(ring);
+}
+
+static void mnl_ack_stats_dump(const struct netlink_ctx *ctx,
+			       unsigned int rcvbufsiz)
+{
+	if (!(ctx->nft->debug_mask & NFT_DEBUG_MNL))
+		return;
+
+	fprintf(ctx->nft->output.output_fp,
+		"# acks: %u messages, %u bytes, %u errors, %u recvmmsg calls, receive buffer %u bytes\n",
+		ctx->ack_stats.msgs, ctx->ack_stats.bytes,
+		ctx->ack_stats.errors, ctx->ack_stats.calls, rcvbufsiz);
+}
+
+static mnl_cb_t mnl_batch_cb_ctl_array[NLMSG_MIN_TYPE] = {
+	[NLMSG_ERROR] = mnl_batch_extack_cb,
+};
+
+static int mnl_batch_uring_ack_cb(const void *buf, size_t len, void *data)
+{
+	struct netlink_cb_data *cb_data = data;
+	struct netlink_ctx *ctx = cb_data->nl_ctx;
+
+	ctx->ack_stats.msgs++;
+	ctx->ack_stats.bytes += len;
+
+	/* Continue on error, make sure we get all acknowledgments */
+	mnl_cb_run2(buf, len, 0, mnl_socket_get_portid(ctx->nft->nf_sock),
+		    netlink_echo_callback, cb_data, mnl_batch_cb_ctl_array,
+		    MNL_ARRAY_SIZE(mnl_batch_cb_ctl_array));
+	return 1;
+}
+
+static int mnl_batch_uring_recv_acks(struct netlink_ctx *ctx,
+				     struct nft_uring *ring,
+				     struct netlink_cb_data *cb_data,
+				     unsigned int *rcvbufsiz)
 {
 	struct mnl_socket *nl = ctx->nft->nf_sock;
-	int ret, fd = mnl_socket_get_fd(nl), portid = mnl_socket_get_portid(nl);
-	uint32_t iov_len = nftnl_batch_iovec_len(ctx->batch);
-	char rcv_buf[NFT_MNL_ACK_MAXSIZE];
-	const struct sockaddr_nl snl = {
-		.nl_family = AF_NETLINK
-	};
-	struct timeval tv = {
-		.tv_sec		= 0,
-		.tv_usec	= 0
-	};
-	struct iovec iov[iov_len];
-	struct msghdr msg = {};
-	unsigned int rcvbufsiz;
-	fd_set readfds;
-	static mnl_cb_t cb_ctl_array[NLMSG_MIN_TYPE] = {
-	        [NLMSG_ERROR] = mnl_batch_extack_cb,
-	};
+	int ret;
+
+	ret = nft_uring_recv(ring, mnl_socket_get_fd(nl),
+			     mnl_batch_uring_ack_cb, cb_data,
+			     &ctx->ack_stats.calls);
+	if (ret < 0 && errno == ENOBUFS && *rcvbufsiz < NFT_MNL_RCVBUFF_MAX) {
+		*rcvbufsiz *= 2;
+		mnl_set_rcvbuffer(nl, *rcvbufsiz);
+		errno = ENOBUFS;
+	}
+
+	return ret;
+}
+
+static int mnl_batch_recv_acks(struct netlink_ctx *ctx,
+			       struct netlink_cb_data *cb_data,
+			       unsigned int *rcvbufsiz)
+{
+	struct mnl_socket *nl = ctx->nft->nf_sock;
+	int fd = mnl_socket_get_fd(nl), portid = mnl_socket_get_portid(nl);
+	struct mnl_ack_ring *ring;
+	int ret, i;
+
+	ring = mnl_ack_ring_alloc();
+
+	/* The kernel processes the batch from sendmsg(), so all the
+	 * acknowledgments are already queued on the socket at this stage.
+	 * Socket is non-blocking: keep reading until there is nothing left.
+	 */
+	while (true) {
+		ret = recvmmsg(fd, ring->msg, NFT_MNL_ACK_RING_SIZE,
+			       MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ret = 0;
+				break;
+			}
+			if (errno == ENOBUFS && *rcvbufsiz < NFT_MNL_RCVBUFF_MAX) {
+				/* Acknowledgments are lost, make room for
+				 * follow up batches on this socket.
+				 */
+				*rcvbufsiz *= 2;
+				mnl_set_rcvbuffer(nl, *rcvbufsiz);
+				errno = ENOBUFS;
+			}
+			break;
+		}
+		ctx->ack_stats.calls++;
+
+		for (i = 0; i < ret; i++) {
+			if (ring->msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				errno = ENOSPC;
+				ret = -1;
+				goto out;
+			}
+
+			ctx->ack_stats.msgs++;
+			ctx->ack_stats.bytes += ring->msg[i].msg_len;
+
+			/* Continue on error, make sure we get all acknowledgments */
+			mnl_cb_run2(ring->iov[i].iov_base, ring->msg[i].msg_len,
+				    0, portid, netlink_echo_callback, cb_data,
+				    mnl_batch_cb_ctl_array,
+				    MNL_ARRAY_SIZE(mnl_batch_cb_ctl_array));
+		}
+
+		/* Ring is full, there is a large backlog of messages
+		 * (typically, echo notifications). Grow the receive buffer as
+		 * we go to reduce the chances of hitting ENOBUFS.
+		 */
+		if (ret == NFT_MNL_ACK_RING_SIZE &&
+		    *rcvbufsiz < NFT_MNL_RCVBUFF_MAX) {
+			*rcvbufsiz *= 2;
+			mnl_set_rcvbuffer(nl, *rcvbufsiz);
+		}
+	}
+out:
+	mnl_ack_ring_free(ring);
+
+	return ret;
+}
+
+static int mnl_batch_sendmsg(struct netlink_ctx *ctx, struct msghdr *msg,
+			     struct list_head *err_list, uint32_t num_cmds)
+{
 	struct netlink_cb_data cb_data = {
 		.err_list = err_list,
 		.nl_ctx = ctx,
 	};
-
-	mnl_set_sndbuffer(ctx);
-
-	mnl_nft_batch_to_msg(ctx, &msg, &snl, iov, iov_len);
+	struct nft_uring *uring = nft_mnl_uring(ctx);
+	unsigned int rcvbufsiz;
+	struct nft_timing_span span;
+	bool timing;
+	int ret;
 
 	rcvbufsiz = num_cmds * 1024;
-	if (nft_output_echo(&ctx->nft->output)) {
+	if (nft_output_echo(&ctx->nft->output) ||
+	    nft_output_echo_handles(&ctx->nft->output)) {
 		if (rcvbufsiz < NFT_MNL_ECHO_RCVBUFF_DEFAULT)
 			rcvbufsiz = NFT_MNL_ECHO_RCVBUFF_DEFAULT;
 	}
 
 	mnl_set_rcvbuffer(ctx->nft->nf_sock, rcvbufsiz);
 
-	ret = mnl_nft_socket_sendmsg(ctx, &msg);
+	timing = nft_timing_start(ctx->nft, NFT_TIMING_SEND, &span);
+	ret = mnl_nft_socket_sendmsg(ctx, uring, msg);
+	if (timing)
+		nft_timing_stop(ctx->nft, &span, 1);
 	if (ret == -1)
 		return -1;
 
 	/* receive and digest all the acknowledgments from the kernel. */
-	while (true) {
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
+	timing = nft_timing_start(ctx->nft, NFT_TIMING_ACK, &span);
+	if (uring)
+		ret = mnl_batch_uring_recv_acks(ctx, uring, &cb_data,
+						&rcvbufsiz);
+	else
+		ret = mnl_batch_recv_acks(ctx, &cb_data, &rcvbufsiz);
+	if (timing)
+		nft_timing_stop(ctx->nft, &span, num_cmds);
+	mnl_ack_stats_dump(ctx, rcvbufsiz);
 
-		ret = select(fd + 1, &readfds, NULL, NULL, &tv);
-		if (ret == -1)
-			return -1;
+	return ret;
+}
 
-		if (!FD_ISSET(fd, &readfds))
-			break;
+int mnl_batch_talk(struct netlink_ctx *ctx, struct list_head *err_list,
+		   uint32_t num_cmds)
+{
+	uint32_t iov_len = mnl_batch_iovec_len(ctx->batch);
+	const struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK
+	};
+	struct msghdr msg = {};
+	struct iovec *iov;
+	int ret;
 
-		ret = mnl_socket_recvfrom(nl, rcv_buf, sizeof(rcv_buf));
-		if (ret == -1)
-			return -1;
+	mnl_set_sndbuffer(ctx, iov_len * BATCH_PAGE_SIZE);
 
-		/* Continue on error, make sure we get all acknowledgments */
-		ret = mnl_cb_run2(rcv_buf, ret, 0, portid,
-				  netlink_echo_callback, &cb_data,
-				  cb_ctl_array, MNL_ARRAY_SIZE(cb_ctl_array));
-	}
-	return 0;
+	/* One iovec per batch page: for large transactions, this does not
+	 * fit into the stack.
+	 */
+	iov = xmalloc(sizeof(struct iovec) * iov_len);
+	mnl_nft_batch_to_msg(ctx, &msg, &snl, iov, iov_len);
+
+	ret = mnl_batch_sendmsg(ctx, &msg, err_list, num_cmds);
+	free(iov);
+
+	return ret;
 }
 
-struct mnl_nft_rule_build_ctx {
-	struct netlink_linearize_ctx	*lctx;
-	struct nlmsghdr			*nlh;
-	struct cmd			*cmd;
+struct mnl_batch_cursor {
+	unsigned int	page;
+	size_t		offset;
 };
 
-static int mnl_nft_expr_build_cb(struct nftnl_expr *nle, void *data)
+/* Add as many messages from @cur on as fit into @limit bytes to @chunk, at
+ * least one, and all of them up to sequence number @atomic_seq. Messages are
+ * contiguous within a page, so this adds at most one iovec per page. Returns
+ * the number of iovecs added.
+ */
+static unsigned int mnl_batch_split_next(const struct iovec *iov,
+					 unsigned int iov_len,
+					 struct mnl_batch_cursor *cur,
+					 size_t limit, uint32_t atomic_seq,
+					 struct iovec *chunk)
 {
-	struct mnl_nft_rule_build_ctx *ctx = data;
-	struct nlmsghdr *nlh = ctx->nlh;
-	struct cmd *cmd = ctx->cmd;
-	struct nft_expr_loc *eloc;
-	struct nlattr *nest;
+	unsigned int n = 0;
+	size_t len = 0;
 
-	eloc = nft_expr_loc_find(nle, ctx->lctx);
-	if (eloc)
-		cmd_add_loc(cmd, nlh, eloc->loc);
+	while (cur->page < iov_len) {
+		const struct iovec *page = &iov[cur->page];
+		size_t start = cur->offset;
 
-	nest = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
-	nftnl_expr_build_payload(nlh, nle);
-	mnl_attr_nest_end(nlh, nest);
+		while (cur->offset < page->iov_len) {
+			const struct nlmsghdr *nlh = page->iov_base + cur->offset;
 
-	nftnl_rule_del_expr(nle);
-	nftnl_expr_free(nle);
+			if (len + nlh->nlmsg_len > limit && len > 0 &&
+			    nlh->nlmsg_seq > atomic_seq)
+				break;
 
-	return 0;
+			len += NLMSG_ALIGN(nlh->nlmsg_len);
+			cur->offset += NLMSG_ALIGN(nlh->nlmsg_len);
+		}
+
+		if (cur->offset > start) {
+			chunk[n].iov_base = page->iov_base + start;
+			chunk[n].iov_len = cur->offset - start;
+			n++;
+		}
+		if (cur->offset < page->iov_len)
+			break;
+
+		cur->page++;
+		cur->offset = 0;
+	}
+
+	return n;
 }
 
-static void mnl_nft_rule_build_ctx_init(struct mnl_nft_rule_build_ctx *rule_ctx,
-					struct nlmsghdr *nlh,
-					struct cmd *cmd,
-					struct netlink_linearize_ctx *lctx)
+/* Send a batch that does not fit into the socket send buffer as several
+ * transactions, each one wrapped in the begin and end messages of the batch.
+ * Messages up to sequence number @atomic_seq all go into the first one, the
+ * caller ensures that the rest are element updates, which can be committed
+ * apart. Stops at the first transaction that fails, @stats tells how many of
+ * them were sent.
+ */
+int mnl_batch_talk_split(struct netlink_ctx *ctx, struct list_head *err_list,
+			 uint32_t num_cmds, uint32_t atomic_seq,
+			 struct mnl_split_stats *stats)
+{
+	uint32_t iov_len = mnl_batch_iovec_len(ctx->batch);
+	const struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK
+	};
+	struct mnl_batch_cursor cur = {};
+	struct iovec *iov, *chunk, begin, end;
+	const struct nlmsghdr *nlh;
+	struct msghdr msg = {};
+	unsigned int n;
+	size_t limit;
+	int ret = 0;
+
+	mnl_set_sndbuffer(ctx, iov_len * BATCH_PAGE_SIZE);
+
+	iov = xmalloc(sizeof(struct iovec) * iov_len);
+	chunk = xmalloc(sizeof(struct iovec) * (iov_len + 2));
+	mnl_batch_iovec(ctx->batch, iov, iov_len);
+
+	/* Peel off the begin message at the start of the first page and the
+	 * end message at the end of the last page.
+	 */
+	nlh = iov[0].iov_base;
+	begin.iov_base = iov[0].iov_base;
+	begin.iov_len = NLMSG_ALIGN(nlh->nlmsg_len);
+	iov[0].iov_base += begin.iov_len;
+	iov[0].iov_len -= begin.iov_len;
+
+	end.iov_base = NULL;
+	for (n = 0; n < iov[iov_len - 1].iov_len;
+	     n += NLMSG_ALIGN(nlh->nlmsg_len)) {
+		nlh = iov[iov_len - 1].iov_base + n;
+		end.iov_base = (void *)nlh;
+	}
+	assert(end.iov_base);
+	end.iov_len = NLMSG_ALIGN(((struct nlmsghdr *)end.iov_base)->nlmsg_len);
+	iov[iov_len - 1].iov_len -= end.iov_len;
+
+	/* netlink_sendmsg() refuses messages larger than the send buffer
+	 * minus 32 bytes.
+	 */
+	limit = mnl_get_sndbuffer(ctx) - 32;
+	limit = limit > begin.iov_len + end.iov_len ?
+		limit - begin.iov_len - end.iov_len : 1;
+
+	stats->sent = 0;
+	stats->total = 0;
+	while (mnl_batch_split_next(iov, iov_len, &cur, limit, atomic_seq,
+				    chunk))
+		stats->total++;
+
+	msg.msg_name = (struct sockaddr_nl *)&snl;
+	msg.msg_namelen = sizeof(snl);
+	msg.msg_iov = chunk;
+
+	memset(&cur, 0, sizeof(cur));
+	while (stats->sent < stats->total) {
+		chunk[0] = begin;
+		n = mnl_batch_split_next(iov, iov_len, &cur, limit, atomic_seq,
+					 chunk + 1);
+		chunk[n + 1] = end;
+		msg.msg_iovlen = n + 2;
+
+		stats->sent++;
+		ret = mnl_batch_sendmsg(ctx, &msg, err_list, num_cmds);
+		if (ret < 0 || !list_empty(err_list))
+			break;
+	}
+
+	free(chunk);
+	free(iov);
+
+	return ret;
+}
+
+/* Send a batch that was serialized by a previous run, see compile.c. */
+int mnl_batch_replay(struct netlink_ctx *ctx, const void *buf, uint32_t len,
+		     struct list_head *err_list, uint32_t num_cmds)
+{
+	const struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK
+	};
+	struct iovec iov = {
+		.iov_base	= (void *)buf,
+		.iov_len	= len,
+	};
+	struct msghdr msg = {
+		.msg_name	= (struct sockaddr_nl *)&snl,
+		.msg_namelen	= sizeof(snl),
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+
+	mnl_set_sndbuffer(ctx, len);
+
+	return mnl_batch_sendmsg(ctx, &msg, err_list, num_cmds);
+}
+
+/* Attributes that only describe the object that was dumped, see
+ * mnl_nft_restore_msg().
+ */
+static bool mnl_nft_restore_attr_skip(uint16_t type, uint16_t attr)
+{
+	switch (type) {
+	case NFT_MSG_NEWTABLE:
+		return attr == NFTA_TABLE_HANDLE || attr == NFTA_TABLE_USE ||
+		       attr == NFTA_TABLE_OWNER || attr == NFTA_TABLE_FLAGS;
+	case NFT_MSG_NEWCHAIN:
+		return attr == NFTA_CHAIN_HANDLE || attr == NFTA_CHAIN_USE;
+	case NFT_MSG_NEWRULE:
+		return attr == NFTA_RULE_HANDLE || attr == NFTA_RULE_POSITION;
+	case NFT_MSG_NEWSET:
+		return attr == NFTA_SET_HANDLE;
+	case NFT_MSG_NEWOBJ:
+		return attr == NFTA_OBJ_HANDLE || attr == NFTA_OBJ_USE;
+	case NFT_MSG_NEWFLOWTABLE:
+		return attr == NFTA_FLOWTABLE_HANDLE ||
+		       attr == NFTA_FLOWTABLE_USE;
+	}
+
+	return false;
+}
+
+/* Turn an object that mnl_nft_dump_raw() received into a request that
+ * creates it again, copying its attributes as they are. Tables lose their
+ * owner, it is the process that created them.
+ */
+void mnl_nft_restore_msg(struct mnl_batch *batch,
+			 const struct nlmsghdr *nlh, uint32_t seqnum)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+	uint16_t flags = NLM_F_CREATE;
+	const struct nlattr *attr;
+	struct nlmsghdr *new;
+	uint32_t table_flags;
+
+	if (type == NFT_MSG_NEWRULE)
+		flags |= NLM_F_APPEND;
+
+	new = nftnl_nlmsg_build_hdr(mnl_batch_buffer(batch), type,
+				    nfg->nfgen_family, flags, seqnum);
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		if (type == NFT_MSG_NEWTABLE &&
+		    mnl_attr_get_type(attr) == NFTA_TABLE_FLAGS &&
+		    mnl_attr_validate(attr, MNL_TYPE_U32) == 0) {
+			table_flags = ntohl(mnl_attr_get_u32(attr));
+			mnl_attr_put_u32(new, NFTA_TABLE_FLAGS,
+					 htonl(table_flags & ~NFT_TABLE_F_OWNER));
+			continue;
+		}
+		if (mnl_nft_restore_attr_skip(type, mnl_attr_get_type(attr)))
+			continue;
+
+		memcpy(mnl_nlmsg_get_payload_tail(new), attr,
+		       MNL_ALIGN(attr->nla_len));
+		new->nlmsg_len += MNL_ALIGN(attr->nla_len);
+	}
+
+	mnl_nft_batch_continue(batch);
+}
+
+/* Remove all tables of all families, as "flush ruleset" does. */
+void mnl_nft_restore_flush(struct mnl_batch *batch, uint32_t seqnum)
+{
+	nftnl_nlmsg_build_hdr(mnl_batch_buffer(batch), NFT_MSG_DELTABLE,
+			      NFPROTO_UNSPEC, 0, seqnum);
+	mnl_nft_batch_continue(batch);
+}
+
+struct mnl_nft_rule_build_ctx {
+	struct netlink_linearize_ctx	*lctx;
+	struct nlmsghdr			*nlh;
+	struct cmd			*cmd;
+};
+
+static int mnl_nft_expr_build_cb(struct nftnl_expr *nle, void *data)
+{
+	struct mnl_nft_rule_build_ctx *ctx = data;
+	struct nlmsghdr *nlh = ctx->nlh;
+	struct cmd *cmd = ctx->cmd;
+	struct nft_expr_loc *eloc;
+	struct nlattr *nest;
+
+	eloc = nft_expr_loc_find(nle, ctx->lctx);
+	if (eloc)
+		cmd_add_loc(cmd, nlh, eloc->loc);
+
+	nest = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+	nftnl_expr_build_payload(nlh, nle);
+	mnl_attr_nest_end(nlh, nest);
+
+	nftnl_rule_del_expr(nle);
+	nftnl_expr_free(nle);
+
+	return 0;
+}
+
+static void mnl_nft_rule_build_ctx_init(struct mnl_nft_rule_build_ctx *rule_ctx,
+					struct nlmsghdr *nlh,
+					struct cmd *cmd,
+					struct netlink_linearize_ctx *lctx)
 {
 	memset(rule_ctx, 0, sizeof(*rule_ctx));
 	rule_ctx->nlh = nlh;
@@ -522,7 +1211,7 @@ int mnl_nft_rule_add(struct netlink_ctx *ctx, struct cmd *cmd,
 
 	netlink_linearize_init(&lctx, nlr);
 	netlink_linearize_rule(ctx, rule, &lctx);
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWRULE,
 				    cmd->handle.family,
 				    NLM_F_CREATE | flags, ctx->seqnum);
@@ -551,29 +1240,18 @@ int mnl_nft_rule_add(struct netlink_ctx *ctx, struct cmd *cmd,
 	return 0;
 }
 
-int mnl_nft_rule_replace(struct netlink_ctx *ctx, struct cmd *cmd)
+static void mnl_nft_rule_replace_msg(struct netlink_ctx *ctx,
+				     struct cmd *cmd, struct nftnl_rule *nlr,
+				     struct netlink_linearize_ctx *lctx,
+				     const struct location *loc, uint64_t id,
+				     unsigned int flags)
 {
 	struct mnl_nft_rule_build_ctx rule_ctx;
-	struct netlink_linearize_ctx lctx;
-	struct rule *rule = cmd->rule;
-	struct handle *h = &rule->handle;
-	unsigned int flags = 0;
-	struct nftnl_rule *nlr;
+	struct handle *h = &cmd->rule->handle;
 	struct nlmsghdr *nlh;
 	struct nlattr *nest;
 
-	if (nft_output_echo(&ctx->nft->output))
-		flags |= NLM_F_ECHO;
-
-	nlr = nftnl_rule_alloc();
-	if (!nlr)
-		memory_allocation_error();
-
-	nftnl_rule_set_u32(nlr, NFTNL_RULE_FAMILY, h->family);
-
-	netlink_linearize_init(&lctx, nlr);
-	netlink_linearize_rule(ctx, rule, &lctx);
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWRULE,
 				    cmd->handle.family,
 				    NLM_F_REPLACE | flags, ctx->seqnum);
@@ -582,24 +1260,88 @@ int mnl_nft_rule_replace(struct netlink_ctx *ctx, struct cmd *cmd)
 	mnl_attr_put_strz(nlh, NFTA_RULE_TABLE, h->table.name);
 	cmd_add_loc(cmd, nlh, &h->chain.location);
 	mnl_attr_put_strz(nlh, NFTA_RULE_CHAIN, h->chain.name);
-	cmd_add_loc(cmd, nlh, &h->handle.location);
-	mnl_attr_put_u64(nlh, NFTA_RULE_HANDLE, htobe64(h->handle.id));
+	cmd_add_loc(cmd, nlh, loc);
+	mnl_attr_put_u64(nlh, NFTA_RULE_HANDLE, htobe64(id));
 
-	mnl_nft_rule_build_ctx_init(&rule_ctx, nlh, cmd, &lctx);
+	mnl_nft_rule_build_ctx_init(&rule_ctx, nlh, cmd, lctx);
 
 	nest = mnl_attr_nest_start(nlh, NFTA_RULE_EXPRESSIONS);
 	nftnl_expr_foreach(nlr, mnl_nft_expr_build_cb, &rule_ctx);
 	mnl_attr_nest_end(nlh, nest);
 
 	nftnl_rule_nlmsg_build_payload(nlh, nlr);
-	nftnl_rule_free(nlr);
-	netlink_linearize_fini(&lctx);
 
 	mnl_nft_batch_continue(ctx->batch);
+}
+
+int mnl_nft_rule_replace(struct netlink_ctx *ctx, struct cmd *cmd)
+{
+	struct netlink_linearize_ctx lctx;
+	struct rule *rule = cmd->rule;
+	struct handle *h = &rule->handle;
+	unsigned int flags = 0;
+	struct nftnl_rule *nlr;
+	struct expr *handle;
+
+	if (nft_output_echo(&ctx->nft->output) ||
+	    nft_output_echo_handles(&ctx->nft->output))
+		flags |= NLM_F_ECHO;
+
+	nlr = nftnl_rule_alloc();
+	if (!nlr)
+		memory_allocation_error();
+
+	nftnl_rule_set_u32(nlr, NFTNL_RULE_FAMILY, h->family);
+
+	netlink_linearize_init(&lctx, nlr);
+	netlink_linearize_rule(ctx, rule, &lctx);
+
+	/* with a handle list, the rule is linearized once and sent in place
+	 * of each of the rules.
+	 */
+	if (cmd->handles) {
+		list_for_each_entry(handle, &cmd->handles->expressions, list)
+			mnl_nft_rule_replace_msg(ctx, cmd, nlr, &lctx,
+						 &handle->location,
+						 mpz_get_uint64(handle->value),
+						 flags);
+	} else {
+		mnl_nft_rule_replace_msg(ctx, cmd, nlr, &lctx,
+					 &h->handle.location, h->handle.id,
+					 flags);
+	}
+
+	nftnl_rule_free(nlr);
+	netlink_linearize_fini(&lctx);
 
 	return 0;
 }
 
+/* One message per handle of the list, these only carry attributes. */
+static void mnl_nft_rule_del_list(struct netlink_ctx *ctx, struct cmd *cmd,
+				  enum nf_tables_msg_types msg_type)
+{
+	struct handle *h = &cmd->handle;
+	struct nlmsghdr *nlh;
+	struct expr *handle;
+
+	list_for_each_entry(handle, &cmd->handles->expressions, list) {
+		nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
+					    msg_type, h->family, 0,
+					    ctx->seqnum);
+
+		cmd_add_loc(cmd, nlh, &h->table.location);
+		mnl_attr_put_strz(nlh, NFTA_RULE_TABLE, h->table.name);
+		cmd_add_loc(cmd, nlh, &h->chain.location);
+		mnl_attr_put_strz(nlh, NFTA_RULE_CHAIN, h->chain.name);
+		cmd_add_loc(cmd, nlh, &handle->location);
+		mnl_attr_put_u64(nlh, NFTA_RULE_HANDLE,
+				 htobe64(mpz_get_uint64(handle->value)));
+
+		mnl_nft_batch_continue(ctx->batch);
+	}
+}
+
 int mnl_nft_rule_del(struct netlink_ctx *ctx, struct cmd *cmd)
 {
 	enum nf_tables_msg_types msg_type = NFT_MSG_DELRULE;
@@ -607,16 +1349,21 @@ int mnl_nft_rule_del(struct netlink_ctx *ctx, struct cmd *cmd)
 	struct nftnl_rule *nlr;
 	struct nlmsghdr *nlh;
 
+	if (cmd->op == CMD_DESTROY)
+		msg_type = NFT_MSG_DESTROYRULE;
+
+	if (cmd->handles) {
+		mnl_nft_rule_del_list(ctx, cmd, msg_type);
+		return 0;
+	}
+
 	nlr = nftnl_rule_alloc();
 	if (!nlr)
 		memory_allocation_error();
 
 	nftnl_rule_set_u32(nlr, NFTNL_RULE_FAMILY, h->family);
 
-	if (cmd->op == CMD_DESTROY)
-		msg_type = NFT_MSG_DESTROYRULE;
-
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    msg_type,
 				    nftnl_rule_get_u32(nlr, NFTNL_RULE_FAMILY),
 				    0, ctx->seqnum);
@@ -717,6 +1464,52 @@ err:
 	return NULL;
 }
 
+static int rule_terse_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct list_head *rules = data;
+	struct rule *rule;
+
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
+
+	rule = netlink_delinearize_rule_nlmsg(nlh);
+	if (rule)
+		list_add_tail(&rule->list, rules);
+
+	return MNL_CB_OK;
+}
+
+/* Dump rules without their statements into @rules, only the handle, the
+ * position and the comment of each rule are parsed.
+ */
+int mnl_nft_rule_dump_terse(struct netlink_ctx *ctx, int family,
+			    const char *table, const char *chain,
+			    struct list_head *rules)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nftnl_rule *nlr = NULL;
+	struct nlmsghdr *nlh;
+
+	if (table) {
+		nlr = nftnl_rule_alloc();
+		if (!nlr)
+			memory_allocation_error();
+
+		nftnl_rule_set_str(nlr, NFTNL_RULE_TABLE, table);
+		if (chain)
+			nftnl_rule_set_str(nlr, NFTNL_RULE_CHAIN, chain);
+	}
+
+	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, family,
+				    NLM_F_DUMP, ctx->seqnum);
+	if (nlr) {
+		nftnl_rule_nlmsg_build_payload(nlh, nlr);
+		nftnl_rule_free(nlr);
+	}
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, rule_terse_cb, rules);
+}
+
 /*
  * Chain
  */
@@ -837,7 +1630,7 @@ int mnl_nft_chain_add(struct netlink_ctx *ctx, struct cmd *cmd,
 	}
 	netlink_dump_chain(nlc, ctx);
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWCHAIN,
 				    cmd->handle.family,
 				    NLM_F_CREATE | flags, ctx->seqnum);
@@ -917,7 +1710,7 @@ int mnl_nft_chain_rename(struct netlink_ctx *ctx, const struct cmd *cmd,
 
 	netlink_dump_chain(nlc, ctx);
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWCHAIN,
 				    cmd->handle.family,
 				    0, ctx->seqnum);
@@ -944,7 +1737,7 @@ int mnl_nft_chain_del(struct netlink_ctx *ctx, struct cmd *cmd)
 	if (cmd->op == CMD_DESTROY)
 		msg_type = NFT_MSG_DESTROYCHAIN;
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    msg_type,
 				    cmd->handle.family,
 				    0, ctx->seqnum);
@@ -1014,17 +1807,19 @@ struct nftnl_chain_list *mnl_nft_chain_dump(struct netlink_ctx *ctx,
 	if (nlc_list == NULL)
 		memory_allocation_error();
 
-	if (table && chain) {
+	/* without a chain, the dump is filtered by table. */
+	if (table) {
 		nlc = nftnl_chain_alloc();
 		if (!nlc)
 			memory_allocation_error();
 
 		nftnl_chain_set_str(nlc, NFTNL_CHAIN_TABLE, table);
-		nftnl_chain_set_str(nlc, NFTNL_CHAIN_NAME, chain);
+		if (chain)
+			nftnl_chain_set_str(nlc, NFTNL_CHAIN_NAME, chain);
 	}
 
 	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETCHAIN, family,
-				    nlc ? NLM_F_ACK : NLM_F_DUMP, ctx->seqnum);
+				    chain ? NLM_F_ACK : NLM_F_DUMP, ctx->seqnum);
 	if (nlc) {
 		nftnl_chain_nlmsg_build_payload(nlh, nlc);
 		nftnl_chain_free(nlc);
@@ -1046,7 +1841,9 @@ err:
 int mnl_nft_table_add(struct netlink_ctx *ctx, struct cmd *cmd,
 		      unsigned int flags)
 {
+	const char *comment = cmd->table ? cmd->table->comment : NULL;
 	struct nftnl_udata_buf *udbuf;
+	uint64_t fingerprint = 0;
 	struct nftnl_table *nlt;
 	struct nlmsghdr *nlh;
 
@@ -1055,24 +1852,29 @@ int mnl_nft_table_add(struct netlink_ctx *ctx, struct cmd *cmd,
 		memory_allocation_error();
 
 	nftnl_table_set_u32(nlt, NFTNL_TABLE_FAMILY, cmd->handle.family);
-	if (cmd->table) {
+	if (cmd->table)
 		nftnl_table_set_u32(nlt, NFTNL_TABLE_FLAGS, cmd->table->flags);
-
-		if (cmd->table->comment) {
-			udbuf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
-			if (!udbuf)
-				memory_allocation_error();
-			if (!nftnl_udata_put_strz(udbuf, NFTNL_UDATA_TABLE_COMMENT, cmd->table->comment))
-				memory_allocation_error();
-			nftnl_table_set_data(nlt, NFTNL_TABLE_USERDATA, nftnl_udata_buf_data(udbuf),
-					     nftnl_udata_buf_len(udbuf));
-			nftnl_udata_buf_free(udbuf);
-		}
-	} else {
+	else
 		nftnl_table_set_u32(nlt, NFTNL_TABLE_FLAGS, 0);
+
+	if (comment || ctx->fingerprint) {
+		udbuf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+		if (!udbuf)
+			memory_allocation_error();
+		if (comment &&
+		    !nftnl_udata_put_strz(udbuf, NFTNL_UDATA_TABLE_COMMENT, comment))
+			memory_allocation_error();
+		/* filled in by nft_fingerprint_check() */
+		if (ctx->fingerprint &&
+		    !nftnl_udata_put(udbuf, NFT_UDATA_TABLE_FINGERPRINT,
+				     sizeof(fingerprint), &fingerprint))
+			memory_allocation_error();
+		nftnl_table_set_data(nlt, NFTNL_TABLE_USERDATA, nftnl_udata_buf_data(udbuf),
+				     nftnl_udata_buf_len(udbuf));
+		nftnl_udata_buf_free(udbuf);
 	}
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWTABLE,
 				    cmd->handle.family,
 				    flags, ctx->seqnum);
@@ -1082,6 +1884,9 @@ int mnl_nft_table_add(struct netlink_ctx *ctx, struct cmd *cmd,
 	nftnl_table_nlmsg_build_payload(nlh, nlt);
 	nftnl_table_free(nlt);
 
+	if (ctx->fingerprint)
+		nft_fingerprint_add_table(ctx->fingerprint, nlh);
+
 	mnl_nft_batch_continue(ctx->batch);
 
 	return 0;
@@ -1102,7 +1907,7 @@ int mnl_nft_table_del(struct netlink_ctx *ctx, struct cmd *cmd)
 	if (cmd->op == CMD_DESTROY)
 		msg_type = NFT_MSG_DESTROYTABLE;
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch), msg_type,
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch), msg_type,
 			            cmd->handle.family, 0, ctx->seqnum);
 
 	if (cmd->handle.table.name) {
@@ -1144,6 +1949,83 @@ err_free:
 	return MNL_CB_OK;
 }
 
+struct mnl_raw_dump_ctx {
+	int	(*cb)(const struct nlmsghdr *nlh, void *data);
+	void	*data;
+};
+
+static int raw_dump_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct mnl_raw_dump_ctx *dump = data;
+
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
+
+	return dump->cb(nlh, dump->data);
+}
+
+/* Pass the objects of message type @type in all families to @cb without
+ * parsing them, see backup.c.
+ */
+int mnl_nft_dump_raw(struct netlink_ctx *ctx, uint16_t type,
+		     int (*cb)(const struct nlmsghdr *nlh, void *data),
+		     void *data)
+{
+	struct mnl_raw_dump_ctx dump = {
+		.cb	= cb,
+		.data	= data,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, type, NFPROTO_UNSPEC, NLM_F_DUMP,
+				    ctx->seqnum);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, raw_dump_cb, &dump);
+}
+
+/* Same for the rules of one table, or of all tables if @table is NULL. */
+int mnl_nft_rule_dump_raw(struct netlink_ctx *ctx, int family,
+			  const char *table,
+			  int (*cb)(const struct nlmsghdr *nlh, void *data),
+			  void *data)
+{
+	struct mnl_raw_dump_ctx dump = {
+		.cb	= cb,
+		.data	= data,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, family,
+				    NLM_F_DUMP, ctx->seqnum);
+	if (table)
+		mnl_attr_put_strz(nlh, NFTA_RULE_TABLE, table);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, raw_dump_cb, &dump);
+}
+
+/* Same for the elements of one set. */
+int mnl_nft_setelem_dump_raw(struct netlink_ctx *ctx, int family,
+			     const char *table, const char *set,
+			     int (*cb)(const struct nlmsghdr *nlh, void *data),
+			     void *data)
+{
+	struct mnl_raw_dump_ctx dump = {
+		.cb	= cb,
+		.data	= data,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETSETELEM, family,
+				    NLM_F_DUMP, ctx->seqnum);
+	mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, table);
+	mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, set);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, raw_dump_cb, &dump);
+}
+
 struct nftnl_table_list *mnl_nft_table_dump(struct netlink_ctx *ctx,
 					    int family, const char *table)
 {
@@ -1206,6 +2088,44 @@ static void set_key_expression(struct netlink_ctx *ctx,
 	nftnl_udata_nest_end(udbuf, nest1);
 }
 
+/*
+ * The backends of a maglev map, each followed by its weight unless that is 1.
+ * The declaration is left out if it does not fit into the userdata, the
+ * generated elements are listed then.
+ */
+static void set_maglev_udata(struct nftnl_udata_buf *udbuf,
+			     const struct set *set)
+{
+	struct nft_data_linearize nld;
+	struct nftnl_udata_buf *mbuf;
+	const struct expr *i, *value;
+	bool ok;
+
+	mbuf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+	if (!mbuf)
+		memory_allocation_error();
+
+	ok = nftnl_udata_put_u32(mbuf, NFT_UDATA_SET_MAGLEV_SIZE,
+				 set->maglev.size);
+	list_for_each_entry(i, &set->maglev.backends->expressions, list) {
+		value = i->etype == EXPR_MAPPING ? i->left->key : i->key;
+		netlink_gen_data(value, &nld);
+		ok = ok && nftnl_udata_put(mbuf, NFT_UDATA_SET_MAGLEV_BACKEND,
+					   nld.len, nld.value);
+		if (i->etype == EXPR_MAPPING &&
+		    mpz_cmp_ui(i->right->value, 1))
+			ok = ok && nftnl_udata_put_u32(mbuf,
+						       NFT_UDATA_SET_MAGLEV_WEIGHT,
+						       mpz_get_uint32(i->right->value));
+	}
+
+	if (ok)
+		nftnl_udata_put(udbuf, NFT_UDATA_SET_MAGLEV,
+				nftnl_udata_buf_len(mbuf),
+				nftnl_udata_buf_data(mbuf));
+	nftnl_udata_buf_free(mbuf);
+}
+
 /*
  * Set
  */
@@ -1297,6 +2217,9 @@ int mnl_nft_set_add(struct netlink_ctx *ctx, struct cmd *cmd,
 			memory_allocation_error();
 	}
 
+	if (set->maglev.backends)
+		set_maglev_udata(udbuf, set);
+
 	nftnl_set_set_data(nls, NFTNL_SET_USERDATA, nftnl_udata_buf_data(udbuf),
 			   nftnl_udata_buf_len(udbuf));
 	nftnl_udata_buf_free(udbuf);
@@ -1320,7 +2243,7 @@ int mnl_nft_set_add(struct netlink_ctx *ctx, struct cmd *cmd,
 	nftnl_set_unset(nls, NFTNL_SET_TABLE);
 	nftnl_set_unset(nls, NFTNL_SET_NAME);
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWSET,
 				    h->family,
 				    NLM_F_CREATE | flags, ctx->seqnum);
@@ -1354,7 +2277,7 @@ int mnl_nft_set_del(struct netlink_ctx *ctx, struct cmd *cmd)
 	if (cmd->op == CMD_DESTROY)
 		msg_type = NFT_MSG_DESTROYSET;
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    msg_type,
 				    h->family,
 				    0, ctx->seqnum);
@@ -1540,7 +2463,7 @@ int mnl_nft_obj_add(struct netlink_ctx *ctx, struct cmd *cmd,
 	}
 	netlink_dump_obj(nlo, ctx);
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWOBJ, cmd->handle.family,
 				    NLM_F_CREATE | flags, ctx->seqnum);
 
@@ -1573,7 +2496,7 @@ int mnl_nft_obj_del(struct netlink_ctx *ctx, struct cmd *cmd, int type)
 	if (cmd->op == CMD_DESTROY)
 		msg_type = NFT_MSG_DESTROYOBJ;
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    msg_type, cmd->handle.family,
 				    0, ctx->seqnum);
 
@@ -1668,11 +2591,274 @@ err:
 }
 
 /*
- * Set elements
+ * Counters
+ *
+ * Counters and quotas of stateful objects and of rules, read straight from
+ * the dump messages without building objects or expressions.
  */
-static int set_elem_cb(const struct nlmsghdr *nlh, void *data)
+static struct nft_counter *counter_array_add(struct mnl_counter_array *array,
+					     uint32_t type, uint32_t family,
+					     const char *table,
+					     const char *name)
 {
-	if (check_genid(nlh) < 0)
+	struct nft_counter *counter;
+
+	if (array->num == array->size) {
+		array->size = array->size ? array->size * 2 : 64;
+		array->counters = xrealloc(array->counters,
+					   array->size * sizeof(*counter));
+	}
+
+	counter = &array->counters[array->num++];
+	memset(counter, 0, sizeof(*counter));
+	counter->type = type;
+	counter->family = family;
+	counter->table = xstrdup(table);
+	counter->name = xstrdup(name);
+
+	return counter;
+}
+
+static void counter_data_parse(const struct nlattr *nest,
+			       struct nft_counter *counter)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, nest) {
+		if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+			continue;
+
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_COUNTER_PACKETS:
+			counter->packets = be64toh(mnl_attr_get_u64(attr));
+			break;
+		case NFTA_COUNTER_BYTES:
+			counter->bytes = be64toh(mnl_attr_get_u64(attr));
+			break;
+		}
+	}
+}
+
+static void quota_data_parse(const struct nlattr *nest,
+			     struct nft_counter *counter)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, nest) {
+		if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+			continue;
+
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_QUOTA_BYTES:
+			counter->quota = be64toh(mnl_attr_get_u64(attr));
+			break;
+		case NFTA_QUOTA_CONSUMED:
+			counter->bytes = be64toh(mnl_attr_get_u64(attr));
+			break;
+		}
+	}
+}
+
+static int counter_obj_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, NFTA_OBJ_MAX) < 0)
+		return MNL_CB_OK;
+
+	switch (type) {
+	case NFTA_OBJ_TABLE:
+	case NFTA_OBJ_NAME:
+		if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_OBJ_TYPE:
+		if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_OBJ_DATA:
+		if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0)
+			return MNL_CB_ERROR;
+		break;
+	default:
+		return MNL_CB_OK;
+	}
+
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+static int counter_obj_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[NFTA_OBJ_MAX + 1] = {};
+	struct mnl_counter_array *array = data;
+	struct nft_counter *counter;
+
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
+
+	if (mnl_attr_parse(nlh, sizeof(*nfg), counter_obj_attr_cb, tb) < 0)
+		return MNL_CB_OK;
+
+	if (!tb[NFTA_OBJ_TABLE] || !tb[NFTA_OBJ_NAME] ||
+	    !tb[NFTA_OBJ_TYPE] || !tb[NFTA_OBJ_DATA])
+		return MNL_CB_OK;
+
+	switch (ntohl(mnl_attr_get_u32(tb[NFTA_OBJ_TYPE]))) {
+	case NFT_OBJECT_COUNTER:
+		counter = counter_array_add(array, NFT_COUNTER_OBJ,
+					    nfg->nfgen_family,
+					    mnl_attr_get_str(tb[NFTA_OBJ_TABLE]),
+					    mnl_attr_get_str(tb[NFTA_OBJ_NAME]));
+		counter_data_parse(tb[NFTA_OBJ_DATA], counter);
+		break;
+	case NFT_OBJECT_QUOTA:
+		counter = counter_array_add(array, NFT_COUNTER_QUOTA,
+					    nfg->nfgen_family,
+					    mnl_attr_get_str(tb[NFTA_OBJ_TABLE]),
+					    mnl_attr_get_str(tb[NFTA_OBJ_NAME]));
+		quota_data_parse(tb[NFTA_OBJ_DATA], counter);
+		break;
+	}
+
+	return MNL_CB_OK;
+}
+
+static int counter_rule_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, NFTA_RULE_MAX) < 0)
+		return MNL_CB_OK;
+
+	switch (type) {
+	case NFTA_RULE_TABLE:
+	case NFTA_RULE_CHAIN:
+		if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_RULE_HANDLE:
+		if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_RULE_EXPRESSIONS:
+		if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0)
+			return MNL_CB_ERROR;
+		break;
+	default:
+		return MNL_CB_OK;
+	}
+
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+/* Returns the data of @expr if it is a counter expression. */
+static const struct nlattr *counter_expr_data(const struct nlattr *expr)
+{
+	const struct nlattr *attr, *data = NULL;
+	bool counter = false;
+
+	mnl_attr_for_each_nested(attr, expr) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_EXPR_NAME:
+			counter = mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0 &&
+				  !strcmp(mnl_attr_get_str(attr), "counter");
+			break;
+		case NFTA_EXPR_DATA:
+			data = attr;
+			break;
+		}
+	}
+
+	return counter ? data : NULL;
+}
+
+static int counter_rule_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[NFTA_RULE_MAX + 1] = {};
+	struct mnl_counter_array *array = data;
+	const struct nlattr *expr, *cdata;
+	struct nft_counter *counter;
+
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
+
+	if (mnl_attr_parse(nlh, sizeof(*nfg), counter_rule_attr_cb, tb) < 0)
+		return MNL_CB_OK;
+
+	if (!tb[NFTA_RULE_TABLE] || !tb[NFTA_RULE_CHAIN] ||
+	    !tb[NFTA_RULE_HANDLE] || !tb[NFTA_RULE_EXPRESSIONS])
+		return MNL_CB_OK;
+
+	mnl_attr_for_each_nested(expr, tb[NFTA_RULE_EXPRESSIONS]) {
+		cdata = counter_expr_data(expr);
+		if (!cdata)
+			continue;
+
+		counter = counter_array_add(array, NFT_COUNTER_RULE,
+					    nfg->nfgen_family,
+					    mnl_attr_get_str(tb[NFTA_RULE_TABLE]),
+					    mnl_attr_get_str(tb[NFTA_RULE_CHAIN]));
+		counter->handle = be64toh(mnl_attr_get_u64(tb[NFTA_RULE_HANDLE]));
+		counter_data_parse(cdata, counter);
+	}
+
+	return MNL_CB_OK;
+}
+
+static int mnl_nft_counter_obj_dump(struct netlink_ctx *ctx, int family,
+				    const char *table, uint32_t type,
+				    bool reset, struct mnl_counter_array *array)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, reset ? NFT_MSG_GETOBJ_RESET :
+						 NFT_MSG_GETOBJ,
+				    family, NLM_F_DUMP, ctx->seqnum);
+	if (table)
+		mnl_attr_put_strz(nlh, NFTA_OBJ_TABLE, table);
+	mnl_attr_put_u32(nlh, NFTA_OBJ_TYPE, htonl(type));
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, counter_obj_cb, array);
+}
+
+int mnl_nft_counters_dump(struct netlink_ctx *ctx, int family,
+			  const char *table, bool rules, bool reset,
+			  struct mnl_counter_array *array)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+
+	if (mnl_nft_counter_obj_dump(ctx, family, table, NFT_OBJECT_COUNTER,
+				     reset, array) < 0 ||
+	    mnl_nft_counter_obj_dump(ctx, family, table, NFT_OBJECT_QUOTA,
+				     reset, array) < 0)
+		return -1;
+
+	if (!rules)
+		return 0;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, reset ? NFT_MSG_GETRULE_RESET :
+						 NFT_MSG_GETRULE,
+				    family, NLM_F_DUMP, ctx->seqnum);
+	if (table)
+		mnl_attr_put_strz(nlh, NFTA_RULE_TABLE, table);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, counter_rule_cb, array);
+}
+
+/*
+ * Set elements
+ */
+static int set_elem_cb(const struct nlmsghdr *nlh, void *data)
+{
+	if (check_genid(nlh) < 0)
 		return MNL_CB_ERROR;
 
 	nftnl_set_elems_nlmsg_parse(nlh, data);
@@ -1720,14 +2906,17 @@ static void netlink_dump_setelem_done(struct netlink_ctx *ctx)
 }
 
 static int mnl_nft_setelem_batch(const struct nftnl_set *nls, struct cmd *cmd,
-				 struct nftnl_batch *batch,
+				 struct mnl_batch *batch,
 				 enum nf_tables_msg_types msg_type,
 				 unsigned int flags, uint32_t *seqnum,
 				 const struct expr *set,
 				 struct netlink_ctx *ctx)
 {
+	bool debug = ctx->nft->debug_mask & NFT_DEBUG_NETLINK;
+	struct netlink_concat_layout layout;
 	struct nlattr *nest1, *nest2;
 	struct nftnl_set_elem *nlse;
+	bool concat_range = false;
 	struct nlmsghdr *nlh;
 	struct expr *expr = NULL;
 	int i = 0;
@@ -1735,11 +2924,13 @@ static int mnl_nft_setelem_batch(const struct nftnl_set *nls, struct cmd *cmd,
 	if (msg_type == NFT_MSG_NEWSETELEM)
 		flags |= NLM_F_CREATE;
 
-	if (set)
+	if (set) {
 		expr = list_first_entry(&set->expressions, struct expr, list);
+		concat_range = netlink_concat_layout_init(&layout, set);
+	}
 
 next:
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(batch), msg_type,
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(batch), msg_type,
 				    nftnl_set_get_u32(nls, NFTNL_SET_FAMILY),
 				    flags, *seqnum);
 
@@ -1762,15 +2953,20 @@ next:
 	assert(expr);
 	nest1 = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
 	list_for_each_entry_from(expr, &set->expressions, list) {
-		nlse = alloc_nftnl_setelem(set, expr);
-
 		cmd_add_loc(cmd, nlh, &expr->location);
 		nest2 = mnl_attr_nest_start(nlh, ++i);
-		nftnl_set_elem_nlmsg_build_payload(nlh, nlse);
+
+		/* Netlink debugging needs the nftnl_set_elem object. */
+		if (debug ||
+		    !netlink_gen_setelem(nlh, set, expr,
+					 concat_range ? &layout : NULL)) {
+			nlse = alloc_nftnl_setelem(set, expr);
+			nftnl_set_elem_nlmsg_build_payload(nlh, nlse);
+			netlink_dump_setelem(nlse, ctx);
+			nftnl_set_elem_free(nlse);
+		}
 		mnl_attr_nest_end(nlh, nest2);
 
-		netlink_dump_setelem(nlse, ctx);
-		nftnl_set_elem_free(nlse);
 		if (mnl_nft_attr_nest_overflow(nlh, nest1, nest2)) {
 			mnl_attr_nest_end(nlh, nest1);
 			mnl_nft_batch_continue(batch);
@@ -1815,122 +3011,781 @@ int mnl_nft_setelem_add(struct netlink_ctx *ctx, struct cmd *cmd,
 	return err;
 }
 
-int mnl_nft_setelem_flush(struct netlink_ctx *ctx, const struct cmd *cmd)
+int mnl_nft_setelem_flush(struct netlink_ctx *ctx, const struct cmd *cmd)
+{
+	const struct handle *h = &cmd->handle;
+	struct nftnl_set *nls;
+	struct nlmsghdr *nlh;
+
+	nls = nftnl_set_alloc();
+	if (nls == NULL)
+		memory_allocation_error();
+
+	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
+	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
+	nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
+	if (h->handle.id)
+		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+
+	netlink_dump_set(nls, ctx);
+
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
+				    NFT_MSG_DELSETELEM,
+				    h->family,
+				    0, ctx->seqnum);
+	nftnl_set_elems_nlmsg_build_payload(nlh, nls);
+	nftnl_set_free(nls);
+
+	mnl_nft_batch_continue(ctx->batch);
+
+	return 0;
+}
+
+int mnl_nft_setelem_del(struct netlink_ctx *ctx, struct cmd *cmd,
+			const struct handle *h, const struct expr *init)
+{
+	enum nf_tables_msg_types msg_type = NFT_MSG_DELSETELEM;
+	struct nftnl_set *nls;
+	int err;
+
+	nls = nftnl_set_alloc();
+	if (nls == NULL)
+		memory_allocation_error();
+
+	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
+	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
+	if (h->set.name)
+		nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
+	else if (h->handle.id)
+		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+
+	netlink_dump_set(nls, ctx);
+
+	if (cmd->op == CMD_DESTROY)
+		msg_type = NFT_MSG_DESTROYSETELEM;
+
+	err = mnl_nft_setelem_batch(nls, cmd, ctx->batch, msg_type, 0,
+				    &ctx->seqnum, init, ctx);
+	nftnl_set_free(nls);
+
+	return err;
+}
+
+static void mnl_nft_setelem_raw_hdr(struct nlmsghdr *nlh,
+				    const struct handle *h)
+{
+	mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, h->table.name);
+	mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, h->set.name);
+}
+
+static void mnl_nft_setelem_raw_value(struct nlmsghdr *nlh, uint16_t type,
+				      const void *value, uint32_t len)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, type);
+	mnl_attr_put(nlh, NFTA_DATA_VALUE, len, value);
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void mnl_nft_setelem_raw_counter(struct nlmsghdr *nlh,
+					uint64_t packets, uint64_t bytes)
+{
+	struct nlattr *nest1, *nest2;
+
+	nest1 = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_EXPR);
+	mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "counter");
+	nest2 = mnl_attr_nest_start(nlh, NFTA_EXPR_DATA);
+	mnl_attr_put_u64(nlh, NFTA_COUNTER_BYTES, htobe64(bytes));
+	mnl_attr_put_u64(nlh, NFTA_COUNTER_PACKETS, htobe64(packets));
+	mnl_attr_nest_end(nlh, nest2);
+	mnl_attr_nest_end(nlh, nest1);
+}
+
+/* Unlike mnl_nft_setelem_batch(), there is no set to check the elements
+ * against, the kernel validates key and data length.
+ */
+void mnl_nft_setelem_raw(struct netlink_ctx *ctx, uint16_t msg_type,
+			 const struct handle *h, struct mnl_setelem_raw *elems)
+{
+	struct nlattr *nest1, *nest2;
+	unsigned int flags = 0;
+	struct nlmsghdr *nlh;
+	uint32_t idx;
+	size_t i = 0;
+
+	if (msg_type == NFT_MSG_NEWSETELEM)
+		flags |= NLM_F_CREATE;
+next:
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch), msg_type,
+				    h->family, flags, ctx->seqnum);
+	mnl_nft_setelem_raw_hdr(nlh, h);
+
+	nest1 = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+	for (idx = 0; i < elems->n; i++) {
+		elems->seqnums[i] = ctx->seqnum;
+		elems->offsets[i] = nlh->nlmsg_len;
+		nest2 = mnl_attr_nest_start(nlh, ++idx);
+
+		if (elems->timeouts && elems->timeouts[i])
+			mnl_attr_put_u64(nlh, NFTA_SET_ELEM_TIMEOUT,
+					 htobe64(elems->timeouts[i]));
+
+		mnl_nft_setelem_raw_value(nlh, NFTA_SET_ELEM_KEY,
+					  elems->keys + i * elems->key_len,
+					  elems->key_len);
+		if (elems->data)
+			mnl_nft_setelem_raw_value(nlh, NFTA_SET_ELEM_DATA,
+						  elems->data + i * elems->data_len,
+						  elems->data_len);
+		if (elems->packets || elems->bytes)
+			mnl_nft_setelem_raw_counter(nlh,
+				elems->packets ? elems->packets[i] : 0,
+				elems->bytes ? elems->bytes[i] : 0);
+
+		mnl_attr_nest_end(nlh, nest2);
+
+		if (mnl_nft_attr_nest_overflow(nlh, nest1, nest2)) {
+			mnl_attr_nest_end(nlh, nest1);
+			mnl_nft_batch_continue(ctx->batch);
+			mnl_seqnum_inc(&ctx->seqnum);
+			goto next;
+		}
+	}
+	mnl_attr_nest_end(nlh, nest1);
+	mnl_nft_batch_continue(ctx->batch);
+}
+
+/* Element queries are pipelined: up to NFT_SETELEM_QUERY_WINDOW requests
+ * go out with one sendmsg() call, then their replies are matched by sequence
+ * number. The window keeps the replies within the default receive buffer.
+ */
+#define NFT_SETELEM_QUERY_WINDOW	64
+
+struct setelem_query {
+	uint32_t	seq;		/* sequence number of the first request */
+	size_t		first;		/* index of its key */
+	size_t		count;
+	size_t		pending;
+	uint8_t		*bitmap;
+	int		err;
+};
+
+/* An existing element is answered with the element and an acknowledgment,
+ * a missing one with ENOENT.
+ */
+static void setelem_query_reply(struct setelem_query *q,
+				const struct nlmsghdr *nlh)
+{
+	uint32_t idx = nlh->nlmsg_seq - q->seq;
+	const struct nlmsgerr *nlerr;
+	size_t i;
+
+	if (idx >= q->count)
+		return;
+
+	if (nlh->nlmsg_type != NLMSG_ERROR) {
+		if (NFNL_MSG_TYPE(nlh->nlmsg_type) == NFT_MSG_NEWSETELEM) {
+			i = q->first + idx;
+			q->bitmap[i / 8] |= 1 << (i % 8);
+		}
+		return;
+	}
+
+	nlerr = mnl_nlmsg_get_payload(nlh);
+	if (nlerr->error && nlerr->error != -ENOENT && !q->err)
+		q->err = -nlerr->error;
+	q->pending--;
+}
+
+static int mnl_nft_setelem_query_window(struct netlink_ctx *ctx,
+					struct setelem_query *q,
+					const void *data, unsigned int len)
+{
+	struct mnl_socket *nf_sock = nft_mnl_sock(ctx);
+	char buf[NFT_NLMSG_MAXSIZE];
+	const struct nlmsghdr *nlh;
+	int ret;
+
+	if (ctx->nft->debug_mask & NFT_DEBUG_MNL)
+		mnl_nlmsg_fprintf(ctx->nft->output.output_fp, data, len,
+				  sizeof(struct nfgenmsg));
+
+	if (mnl_socket_sendto(nf_sock, data, len) < 0)
+		return -1;
+
+	/* unlike mnl_cb_run(), go on after an error to match all replies. */
+	q->pending = q->count;
+	while (q->pending > 0) {
+		ret = mnl_socket_recvfrom(nf_sock, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		nlh = (const struct nlmsghdr *)buf;
+		while (mnl_nlmsg_ok(nlh, ret)) {
+			setelem_query_reply(q, nlh);
+			nlh = mnl_nlmsg_next(nlh, &ret);
+		}
+	}
+
+	if (q->err) {
+		errno = q->err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sets bit i of @bitmap, least significant bit first, if key i is an element
+ * of the set. There is one request per key since the kernel stops at the
+ * first missing element of a request.
+ */
+int mnl_nft_setelem_raw_query(struct netlink_ctx *ctx, const struct handle *h,
+			      const void *keys, uint32_t key_len, size_t n,
+			      uint8_t *bitmap)
+{
+	struct setelem_query q = { .bitmap = bitmap };
+	struct nlattr *nest1, *nest2;
+	unsigned int len = 0;
+	struct nlmsghdr *nlh;
+	int ret = 0;
+	char *buf;
+	size_t i;
+
+	memset(bitmap, 0, (n + 7) / 8);
+	buf = xmalloc(NFT_NLMSG_MAXSIZE);
+
+	for (i = 0; i < n; i++) {
+		if (q.count == 0) {
+			q.first = i;
+			q.seq = ctx->seqnum;
+			len = 0;
+		}
+
+		nlh = nftnl_nlmsg_build_hdr(buf + len, NFT_MSG_GETSETELEM,
+					    h->family, NLM_F_ACK,
+					    mnl_seqnum_inc(&ctx->seqnum));
+		mnl_nft_setelem_raw_hdr(nlh, h);
+
+		nest1 = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+		nest2 = mnl_attr_nest_start(nlh, 1);
+		mnl_nft_setelem_raw_value(nlh, NFTA_SET_ELEM_KEY,
+					  (const uint8_t *)keys + i * key_len,
+					  key_len);
+		mnl_attr_nest_end(nlh, nest2);
+		mnl_attr_nest_end(nlh, nest1);
+		len += nlh->nlmsg_len;
+
+		/* all requests have the same size. */
+		if (++q.count < NFT_SETELEM_QUERY_WINDOW && i + 1 < n &&
+		    len + nlh->nlmsg_len <= NFT_NLMSG_MAXSIZE)
+			continue;
+
+		ret = mnl_nft_setelem_query_window(ctx, &q, buf, len);
+		if (ret < 0)
+			break;
+		q.count = 0;
+	}
+	free(buf);
+
+	return ret;
+}
+
+/* Reports the key and counter of @elem, elements without a counter and
+ * closing elements of intervals are skipped.
+ */
+static void set_counter_elem_parse(const struct nlattr *elem,
+				   struct mnl_set_counter_dump *dump)
+{
+	struct nft_set_counter set_counter = {};
+	const struct nlattr *attr, *nested;
+	const struct nlattr *cdata = NULL;
+	struct nft_counter counter = {};
+
+	mnl_attr_for_each_nested(attr, elem) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_SET_ELEM_KEY:
+			mnl_attr_for_each_nested(nested, attr) {
+				if (mnl_attr_get_type(nested) != NFTA_DATA_VALUE)
+					continue;
+
+				set_counter.key = mnl_attr_get_payload(nested);
+				set_counter.key_len = mnl_attr_get_payload_len(nested);
+			}
+			break;
+		case NFTA_SET_ELEM_FLAGS:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) == 0 &&
+			    ntohl(mnl_attr_get_u32(attr)) & NFT_SET_ELEM_INTERVAL_END)
+				return;
+			break;
+		case NFTA_SET_ELEM_EXPR:
+			if (!cdata)
+				cdata = counter_expr_data(attr);
+			break;
+		case NFTA_SET_ELEM_EXPRESSIONS:
+			mnl_attr_for_each_nested(nested, attr) {
+				if (!cdata)
+					cdata = counter_expr_data(nested);
+			}
+			break;
+		}
+	}
+
+	if (!set_counter.key || !cdata)
+		return;
+
+	counter_data_parse(cdata, &counter);
+	set_counter.packets = counter.packets;
+	set_counter.bytes = counter.bytes;
+
+	dump->cb(&set_counter, dump->data);
+}
+
+static int set_counter_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr, *elem;
+
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		if (mnl_attr_get_type(attr) != NFTA_SET_ELEM_LIST_ELEMENTS)
+			continue;
+
+		mnl_attr_for_each_nested(elem, attr)
+			set_counter_elem_parse(elem, data);
+	}
+
+	return MNL_CB_OK;
+}
+
+/* Each dump message is handed to @dump as it is received, nothing is kept. */
+int mnl_nft_set_counters_dump(struct netlink_ctx *ctx, const struct handle *h,
+			      bool reset, struct mnl_set_counter_dump *dump)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, reset ? NFT_MSG_GETSETELEM_RESET :
+						 NFT_MSG_GETSETELEM,
+				    h->family, NLM_F_DUMP, ctx->seqnum);
+	mnl_nft_setelem_raw_hdr(nlh, h);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_counter_cb, dump);
+}
+
+struct nftnl_set *mnl_nft_setelem_get_one(struct netlink_ctx *ctx,
+					  struct nftnl_set *nls_in,
+					  bool reset)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nftnl_set *nls_out;
+	struct nlmsghdr *nlh;
+	int msg_type;
+	int err;
+
+	if (reset)
+		msg_type = NFT_MSG_GETSETELEM_RESET;
+	else
+		msg_type = NFT_MSG_GETSETELEM;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, msg_type,
+				    nftnl_set_get_u32(nls_in, NFTNL_SET_FAMILY),
+				    NLM_F_ACK, ctx->seqnum);
+	nftnl_set_elems_nlmsg_build_payload(nlh, nls_in);
+
+	nls_out = nftnl_set_alloc();
+	if (!nls_out)
+		return NULL;
+
+	nftnl_set_set_str(nls_out, NFTNL_SET_TABLE,
+			  nftnl_set_get_str(nls_in, NFTNL_SET_TABLE));
+	nftnl_set_set_str(nls_out, NFTNL_SET_NAME,
+			  nftnl_set_get_str(nls_in, NFTNL_SET_NAME));
+
+	err = nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_elem_cb, nls_out);
+	if (err < 0) {
+		nftnl_set_free(nls_out);
+		return NULL;
+	}
+
+	return nls_out;
+}
+
+int mnl_nft_setelem_get(struct netlink_ctx *ctx, struct nftnl_set *nls,
+			bool reset)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	int msg_type;
+
+	if (reset)
+		msg_type = NFT_MSG_GETSETELEM_RESET;
+	else
+		msg_type = NFT_MSG_GETSETELEM;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, msg_type,
+				    nftnl_set_get_u32(nls, NFTNL_SET_FAMILY),
+				    NLM_F_DUMP, ctx->seqnum);
+	nftnl_set_elems_nlmsg_build_payload(nlh, nls);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_elem_cb, nls);
+}
+
+/* Copy of the headers of an element dump message, elements are then copied
+ * into its element list one by one.
+ */
+static struct nlmsghdr *setelem_msg_alloc(const struct nlmsghdr *nlh,
+					  struct nlattr **nest)
+{
+	unsigned int len = MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg));
+	struct nlmsghdr *copy;
+
+	copy = xmalloc(nlh->nlmsg_len);
+	memcpy(copy, nlh, len);
+	copy->nlmsg_len = len;
+	*nest = mnl_attr_nest_start(copy, NFTA_SET_ELEM_LIST_ELEMENTS);
+
+	return copy;
+}
+
+static void setelem_msg_add(struct nlmsghdr *copy, const struct nlattr *elem)
+{
+	memcpy(mnl_nlmsg_get_payload_tail(copy), elem,
+	       MNL_ALIGN(elem->nla_len));
+	copy->nlmsg_len += MNL_ALIGN(elem->nla_len);
+}
+
+/* Parse a single element of dump message @nlh into @nls. */
+void mnl_nft_setelem_parse(const struct nlmsghdr *nlh,
+			   const struct nlattr *elem, struct nftnl_set *nls)
+{
+	struct nlmsghdr *copy;
+	struct nlattr *nest;
+
+	copy = setelem_msg_alloc(nlh, &nest);
+	setelem_msg_add(copy, elem);
+	mnl_attr_nest_end(copy, nest);
+	nftnl_set_elems_nlmsg_parse(copy, nls);
+	free(copy);
+}
+
+struct setelem_dump {
+	int	(*cb)(const struct nlmsghdr *nlh, const struct nlattr *elem,
+		      void *data);
+	void	*data;
+};
+
+static int set_elem_dump_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct setelem_dump *dump = data;
+	const struct nlattr *attr;
+
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		const struct nlattr *elem;
+
+		if (mnl_attr_get_type(attr) != NFTA_SET_ELEM_LIST_ELEMENTS)
+			continue;
+
+		mnl_attr_for_each_nested(elem, attr) {
+			if (dump->cb(nlh, elem, dump->data) < 0)
+				return MNL_CB_ERROR;
+		}
+	}
+
+	return MNL_CB_OK;
+}
+
+/* Same as mnl_nft_setelem_get(), but @cb gets the element attributes of the
+ * dump messages, without libnftnl set element objects in between.
+ */
+int mnl_nft_setelem_dump(struct netlink_ctx *ctx, struct nftnl_set *nls,
+			 bool reset,
+			 int (*cb)(const struct nlmsghdr *nlh,
+				   const struct nlattr *elem, void *data),
+			 void *data)
+{
+	struct setelem_dump dump = {
+		.cb	= cb,
+		.data	= data,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	int msg_type;
+
+	if (reset)
+		msg_type = NFT_MSG_GETSETELEM_RESET;
+	else
+		msg_type = NFT_MSG_GETSETELEM;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, msg_type,
+				    nftnl_set_get_u32(nls, NFTNL_SET_FAMILY),
+				    NLM_F_DUMP, ctx->seqnum);
+	nftnl_set_elems_nlmsg_build_payload(nlh, nls);
+
+	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_elem_dump_cb, &dump);
+}
+
+static bool setelem_attr_interval_end(const struct nlattr *elem)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, elem) {
+		if (mnl_attr_get_type(attr) == NFTA_SET_ELEM_FLAGS &&
+		    mnl_attr_get_payload_len(attr) == sizeof(uint32_t))
+			return ntohl(mnl_attr_get_u32(attr)) &
+			       NFT_SET_ELEM_INTERVAL_END;
+	}
+
+	return false;
+}
+
+struct mnl_setelem_top {
+	uint64_t		value;
+	struct nlattr		*elem;
+};
+
+static uint64_t setelem_attr_counter(const struct nlattr *elem, bool bytes)
+{
+	const struct nlattr *attr, *nested, *cdata = NULL;
+	struct nft_counter counter = {};
+
+	mnl_attr_for_each_nested(attr, elem) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_SET_ELEM_EXPR:
+			if (!cdata)
+				cdata = counter_expr_data(attr);
+			break;
+		case NFTA_SET_ELEM_EXPRESSIONS:
+			mnl_attr_for_each_nested(nested, attr) {
+				if (!cdata)
+					cdata = counter_expr_data(nested);
+			}
+			break;
+		}
+	}
+
+	/* elements without a counter come last */
+	if (!cdata)
+		return 0;
+
+	counter_data_parse(cdata, &counter);
+
+	return bytes ? counter.bytes : counter.packets;
+}
+
+static void setelem_top_swap(struct mnl_setelem_top *heap, uint64_t i,
+			     uint64_t j)
+{
+	struct mnl_setelem_top tmp = heap[i];
+
+	heap[i] = heap[j];
+	heap[j] = tmp;
+}
+
+static void setelem_top_sift_down(struct mnl_setelem_top *heap, uint64_t len)
+{
+	uint64_t i = 0, l, min;
+
+	for (;;) {
+		min = i;
+		l = 2 * i + 1;
+		if (l < len && heap[l].value < heap[min].value)
+			min = l;
+		if (l + 1 < len && heap[l + 1].value < heap[min].value)
+			min = l + 1;
+		if (min == i)
+			break;
+
+		setelem_top_swap(heap, i, min);
+		i = min;
+	}
+}
+
+static void setelem_top_sift_up(struct mnl_setelem_top *heap, uint64_t i)
+{
+	uint64_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (heap[parent].value <= heap[i].value)
+			break;
+
+		setelem_top_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static struct nlattr *setelem_attr_dup(const struct nlattr *elem)
 {
-	const struct handle *h = &cmd->handle;
-	struct nftnl_set *nls;
-	struct nlmsghdr *nlh;
+	struct nlattr *copy = xmalloc(MNL_ALIGN(elem->nla_len));
 
-	nls = nftnl_set_alloc();
-	if (nls == NULL)
-		memory_allocation_error();
+	memcpy(copy, elem, MNL_ALIGN(elem->nla_len));
+	return copy;
+}
 
-	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
-	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
-	nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
-	if (h->handle.id)
-		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+/* Keeps @elem if it is among the @top highest so far, the heap root is the
+ * lowest of those.
+ */
+static void setelem_top_add(struct mnl_setelem_window *w,
+			    const struct nlattr *elem)
+{
+	uint64_t value = setelem_attr_counter(elem, w->top_bytes);
+	struct mnl_setelem_top *heap;
 
-	netlink_dump_set(nls, ctx);
+	if (w->heap_len == w->top) {
+		if (value <= w->heap[0].value)
+			return;
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
-				    NFT_MSG_DELSETELEM,
-				    h->family,
-				    0, ctx->seqnum);
-	nftnl_set_elems_nlmsg_build_payload(nlh, nls);
-	nftnl_set_free(nls);
+		free(w->heap[0].elem);
+		w->heap[0].value = value;
+		w->heap[0].elem = setelem_attr_dup(elem);
+		setelem_top_sift_down(w->heap, w->heap_len);
+		return;
+	}
 
-	mnl_nft_batch_continue(ctx->batch);
+	if (w->heap_len == w->heap_size) {
+		w->heap_size = w->heap_size ? w->heap_size * 2 : 64;
+		if (w->heap_size > w->top)
+			w->heap_size = w->top;
+		w->heap = xrealloc(w->heap, w->heap_size * sizeof(*w->heap));
+	}
 
-	return 0;
+	heap = &w->heap[w->heap_len];
+	heap->value = value;
+	heap->elem = setelem_attr_dup(elem);
+	setelem_top_sift_up(w->heap, w->heap_len++);
 }
 
-int mnl_nft_setelem_del(struct netlink_ctx *ctx, struct cmd *cmd,
-			const struct handle *h, const struct expr *init)
+static int setelem_top_cmp(const void *p1, const void *p2)
 {
-	enum nf_tables_msg_types msg_type = NFT_MSG_DELSETELEM;
-	struct nftnl_set *nls;
-	int err;
+	const struct mnl_setelem_top *e1 = p1, *e2 = p2;
 
-	nls = nftnl_set_alloc();
-	if (nls == NULL)
-		memory_allocation_error();
+	if (e1->value == e2->value)
+		return 0;
 
-	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
-	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
-	if (h->set.name)
-		nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
-	else if (h->handle.id)
-		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+	return e1->value < e2->value ? 1 : -1;
+}
 
-	netlink_dump_set(nls, ctx);
+/* Hands the elements that were kept to libnftnl, highest counter first. A
+ * message each, a nest of many of them might not fit the attribute length.
+ */
+static void setelem_top_parse(struct mnl_setelem_window *w)
+{
+	unsigned int hdrlen = MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg));
+	struct nlmsghdr *nlh;
+	struct nlattr *nest;
+	uint64_t i;
 
-	if (cmd->op == CMD_DESTROY)
-		msg_type = NFT_MSG_DESTROYSETELEM;
+	qsort(w->heap, w->heap_len, sizeof(*w->heap), setelem_top_cmp);
 
-	err = mnl_nft_setelem_batch(nls, cmd, ctx->batch, msg_type, 0,
-				    &ctx->seqnum, init, ctx);
-	nftnl_set_free(nls);
+	for (i = 0; i < w->heap_len; i++) {
+		nlh = xmalloc(hdrlen + MNL_ATTR_HDRLEN +
+			      MNL_ALIGN(w->heap[i].elem->nla_len));
+		memcpy(nlh, w->hdr, hdrlen);
+		nlh->nlmsg_len = hdrlen;
+		nest = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+		setelem_msg_add(nlh, w->heap[i].elem);
+		mnl_attr_nest_end(nlh, nest);
+		nftnl_set_elems_nlmsg_parse(nlh, w->nls);
+		free(nlh);
+	}
+}
 
-	return err;
+static void setelem_top_free(struct mnl_setelem_window *w)
+{
+	uint64_t i;
+
+	for (i = 0; i < w->heap_len; i++)
+		free(w->heap[i].elem);
+	free(w->heap);
+	free(w->hdr);
+	w->heap = NULL;
+	w->heap_len = w->heap_size = 0;
+	w->hdr = NULL;
 }
 
-struct nftnl_set *mnl_nft_setelem_get_one(struct netlink_ctx *ctx,
-					  struct nftnl_set *nls_in,
-					  bool reset)
+/* Elements outside the window are only counted. The ones inside are copied
+ * into a message of their own for libnftnl to parse.
+ */
+static int set_elem_window_cb(const struct nlmsghdr *nlh, void *data)
 {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	struct nftnl_set *nls_out;
-	struct nlmsghdr *nlh;
-	int msg_type;
-	int err;
+	const struct nlattr *attr, *elems = NULL;
+	struct mnl_setelem_window *w = data;
+	struct nlmsghdr *copy = NULL;
+	struct nlattr *nest = NULL;
+	uint64_t idx;
 
-	if (reset)
-		msg_type = NFT_MSG_GETSETELEM_RESET;
-	else
-		msg_type = NFT_MSG_GETSETELEM;
+	if (check_genid(nlh) < 0)
+		return MNL_CB_ERROR;
 
-	nlh = nftnl_nlmsg_build_hdr(buf, msg_type,
-				    nftnl_set_get_u32(nls_in, NFTNL_SET_FAMILY),
-				    NLM_F_ACK, ctx->seqnum);
-	nftnl_set_elems_nlmsg_build_payload(nlh, nls_in);
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		if (mnl_attr_get_type(attr) == NFTA_SET_ELEM_LIST_ELEMENTS)
+			elems = attr;
+	}
+	if (!elems)
+		return MNL_CB_OK;
 
-	nls_out = nftnl_set_alloc();
-	if (!nls_out)
-		return NULL;
+	mnl_attr_for_each_nested(attr, elems) {
+		/* the end of a range comes first, it goes with its start. */
+		idx = w->count;
+		if (!setelem_attr_interval_end(attr))
+			w->count++;
+
+		if (w->top) {
+			if (!w->hdr) {
+				w->hdr = xmalloc(MNL_NLMSG_HDRLEN +
+						 MNL_ALIGN(sizeof(struct nfgenmsg)));
+				memcpy(w->hdr, nlh, MNL_NLMSG_HDRLEN +
+						    MNL_ALIGN(sizeof(struct nfgenmsg)));
+			}
+			setelem_top_add(w, attr);
+			continue;
+		}
 
-	nftnl_set_set_str(nls_out, NFTNL_SET_TABLE,
-			  nftnl_set_get_str(nls_in, NFTNL_SET_TABLE));
-	nftnl_set_set_str(nls_out, NFTNL_SET_NAME,
-			  nftnl_set_get_str(nls_in, NFTNL_SET_NAME));
+		if (idx < w->offset || idx - w->offset >= w->limit)
+			continue;
 
-	err = nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_elem_cb, nls_out);
-	if (err < 0) {
-		nftnl_set_free(nls_out);
-		return NULL;
+		if (!copy)
+			copy = setelem_msg_alloc(nlh, &nest);
+		setelem_msg_add(copy, attr);
 	}
 
-	return nls_out;
+	if (copy) {
+		mnl_attr_nest_end(copy, nest);
+		nftnl_set_elems_nlmsg_parse(copy, w->nls);
+		free(copy);
+	}
+
+	return MNL_CB_OK;
 }
 
-int mnl_nft_setelem_get(struct netlink_ctx *ctx, struct nftnl_set *nls,
-			bool reset)
+int mnl_nft_setelem_get_window(struct netlink_ctx *ctx, struct nftnl_set *nls,
+			       struct mnl_setelem_window *w)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
-	int msg_type;
-
-	if (reset)
-		msg_type = NFT_MSG_GETSETELEM_RESET;
-	else
-		msg_type = NFT_MSG_GETSETELEM;
+	int ret;
 
-	nlh = nftnl_nlmsg_build_hdr(buf, msg_type,
+	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETSETELEM,
 				    nftnl_set_get_u32(nls, NFTNL_SET_FAMILY),
 				    NLM_F_DUMP, ctx->seqnum);
 	nftnl_set_elems_nlmsg_build_payload(nlh, nls);
 
-	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_elem_cb, nls);
+	w->nls = nls;
+	ret = nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, set_elem_window_cb, w);
+	if (ret >= 0 && w->top)
+		setelem_top_parse(w);
+	setelem_top_free(w);
+
+	return ret;
 }
 
 static int flowtable_cb(const struct nlmsghdr *nlh, void *data)
@@ -2034,7 +3889,7 @@ int mnl_nft_flowtable_add(struct netlink_ctx *ctx, struct cmd *cmd,
 
 	netlink_dump_flowtable(flo, ctx);
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    NFT_MSG_NEWFLOWTABLE, cmd->handle.family,
 				    NLM_F_CREATE | flags, ctx->seqnum);
 
@@ -2083,7 +3938,7 @@ int mnl_nft_flowtable_del(struct netlink_ctx *ctx, struct cmd *cmd)
 	if (cmd->op == CMD_DESTROY)
 		msg_type = NFT_MSG_DESTROYFLOWTABLE;
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(ctx->batch),
+	nlh = nftnl_nlmsg_build_hdr(mnl_batch_buffer(ctx->batch),
 				    msg_type, cmd->handle.family,
 				    0, ctx->seqnum);
 
@@ -2121,18 +3976,270 @@ int mnl_nft_flowtable_del(struct netlink_ctx *ctx, struct cmd *cmd)
  */
 #define NFTABLES_NLEVENT_BUFSIZ	(1 << 24)
 
+/* Socket subscribed to ruleset events, used to keep the cache up to date in
+ * the persistent cache mode. Returns NULL if events are not available.
+ */
+struct mnl_socket *nft_mnl_event_socket_open(void)
+{
+	int group = NFNLGRP_NFTABLES;
+	struct mnl_socket *nf_sock;
+
+	nf_sock = nft_mnl_socket_open();
+	if (mnl_socket_setsockopt(nf_sock, NETLINK_ADD_MEMBERSHIP,
+				  &group, sizeof(int)) < 0) {
+		mnl_socket_close(nf_sock);
+		return NULL;
+	}
+	mnl_set_rcvbuffer(nf_sock, NFTABLES_NLEVENT_BUFSIZ);
+
+	return nf_sock;
+}
+
+/* Process all pending events without blocking, ENOBUFS is reported if some
+ * events were lost.
+ */
+int mnl_nft_event_drain(struct mnl_socket *nf_sock,
+			int (*cb)(const struct nlmsghdr *nlh, void *data),
+			void *cb_data)
+{
+	char buf[NFT_NLMSG_MAXSIZE];
+	int ret;
+
+	while (1) {
+		ret = mnl_socket_recvfrom(nf_sock, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		ret = mnl_cb_run(buf, ret, 0, 0, cb, cb_data);
+		if (ret < 0)
+			return -1;
+	}
+}
+
+/*
+ * The event socket is drained from a separate thread into a ring of
+ * datagram buffers, with recvmmsg() to fetch several datagrams per call,
+ * while events are decoded by the listening thread. If decoding falls
+ * behind, the reader stops once the ring is full and the socket buffer
+ * absorbs the rest until the kernel drops events.
+ */
+#define NFT_EVENT_RING_SIZE	32
+#define NFT_EVENT_LOST		-2
+#define NFT_EVENT_TIMEOUT	-3
+
+struct event_ring {
+	int			fd;
+	int			stop_fd[2];
+	char			*buf;
+	size_t			slot_size;
+	int			len[NFT_EVENT_RING_SIZE];
+	unsigned int		head;
+	unsigned int		tail;
+	bool			stop;
+	bool			done;
+	int			err;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+static char *event_ring_slot(struct event_ring *ring, unsigned int i)
+{
+	return ring->buf + (i % NFT_EVENT_RING_SIZE) * ring->slot_size;
+}
+
+static int event_ring_wait(struct event_ring *ring)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = ring->fd,		.events = POLLIN, },
+		{ .fd = ring->stop_fd[0],	.events = POLLIN, },
+	};
+
+	while (poll(pfd, array_size(pfd), -1) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return pfd[1].revents ? 1 : 0;
+}
+
+static int event_ring_recv(struct event_ring *ring, unsigned int tail,
+			   unsigned int num)
+{
+	struct mmsghdr msg[NFT_EVENT_RING_SIZE] = {};
+	struct iovec iov[NFT_EVENT_RING_SIZE];
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = event_ring_slot(ring, tail + i);
+		iov[i].iov_len = ring->slot_size;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(ring->fd, msg, num, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		if (errno != ENOBUFS)
+			return -1;
+
+		ring->len[tail % NFT_EVENT_RING_SIZE] = NFT_EVENT_LOST;
+		return 1;
+	}
+
+	for (i = 0; i < (unsigned int)ret; i++)
+		ring->len[(tail + i) % NFT_EVENT_RING_SIZE] = msg[i].msg_len;
+
+	return ret;
+}
+
+static void *event_ring_reader(void *arg)
+{
+	struct event_ring *ring = arg;
+	unsigned int tail, num;
+	int ret = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ring->lock);
+		while (!ring->stop &&
+		       ring->tail - ring->head == NFT_EVENT_RING_SIZE)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		num = NFT_EVENT_RING_SIZE - (ring->tail - ring->head);
+		tail = ring->tail;
+		ret = ring->stop;
+		pthread_mutex_unlock(&ring->lock);
+
+		if (ret || (ret = event_ring_wait(ring)) != 0)
+			break;
+
+		ret = event_ring_recv(ring, tail, num);
+		if (ret < 0)
+			break;
+
+		pthread_mutex_lock(&ring->lock);
+		ring->tail += ret;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	if (ret < 0)
+		ring->err = errno;
+	ring->done = true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+static int event_ring_init(struct event_ring *ring, struct mnl_socket *nf_sock)
+{
+	pthread_condattr_t attr;
+
+	ring->fd = mnl_socket_get_fd(nf_sock);
+	if (pipe2(ring->stop_fd, O_CLOEXEC) < 0)
+		return -1;
+
+	ring->slot_size = NFT_NLMSG_MAXSIZE;
+	ring->buf = xmalloc(NFT_EVENT_RING_SIZE * ring->slot_size);
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ring->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return 0;
+}
+
+static void event_ring_exit(struct event_ring *ring, pthread_t reader)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->stop = true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+
+	if (write(ring->stop_fd[1], "", 1) < 0)
+		BUG("cannot stop event reader: %s\n", strerror(errno));
+	pthread_join(reader, NULL);
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	close(ring->stop_fd[0]);
+	close(ring->stop_fd[1]);
+	free(ring->buf);
+}
+
+/* Wait for the next datagram, returns its length, -1 if the reader is gone
+ * and NFT_EVENT_TIMEOUT if @deadline passed before anything arrived.
+ */
+static int event_ring_next(struct event_ring *ring, char **buf,
+			   const struct timespec *deadline)
+{
+	int len;
+
+	pthread_mutex_lock(&ring->lock);
+	while (ring->head == ring->tail && !ring->done) {
+		if (!deadline) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+			continue;
+		}
+		if (pthread_cond_timedwait(&ring->cond, &ring->lock,
+					   deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&ring->lock);
+			return NFT_EVENT_TIMEOUT;
+		}
+	}
+
+	if (ring->head == ring->tail) {
+		errno = ring->err;
+		pthread_mutex_unlock(&ring->lock);
+		return -1;
+	}
+
+	*buf = event_ring_slot(ring, ring->head);
+	len = ring->len[ring->head % NFT_EVENT_RING_SIZE];
+	pthread_mutex_unlock(&ring->lock);
+
+	return len;
+}
+
+static void event_ring_release(struct event_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->head++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void event_deadline_add(struct timespec *ts, uint64_t msecs)
+{
+	ts->tv_sec += msecs / 1000;
+	ts->tv_nsec += (msecs % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
 int mnl_nft_event_listener(struct mnl_socket *nf_sock, unsigned int debug_mask,
 			   struct output_ctx *octx,
-			   int (*cb)(const struct nlmsghdr *nlh, void *data),
-			   void *cb_data)
+			   const struct mnl_event_ops *ops, void *cb_data)
 {
 	/* Set netlink socket buffer size to 16 Mbytes to reduce chances of
 	 * message loss due to ENOBUFS.
 	 */
 	unsigned int bufsiz = NFTABLES_NLEVENT_BUFSIZ;
-	int fd = mnl_socket_get_fd(nf_sock);
-	char buf[NFT_NLMSG_MAXSIZE];
-	fd_set readfds;
+	struct event_ring ring = {};
+	struct timespec deadline;
+	pthread_t reader;
+	char *buf;
 	int ret;
 
 	ret = mnl_set_rcvbuffer(nf_sock, bufsiz);
@@ -2140,35 +4247,60 @@ int mnl_nft_event_listener(struct mnl_socket *nf_sock, unsigned int debug_mask,
 		nft_print(octx, "# Cannot set up netlink receive socket buffer size to %u bytes, falling back to %u bytes\n",
 			  NFTABLES_NLEVENT_BUFSIZ, bufsiz);
 
-	while (1) {
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
+	if (event_ring_init(&ring, nf_sock) < 0) {
+		nft_print(octx, "# ERROR: %s\n", strerror(errno));
+		return -1;
+	}
 
-		ret = select(fd + 1, &readfds, NULL, NULL, NULL);
-		if (ret < 0)
-			return -1;
+	ret = pthread_create(&reader, NULL, event_ring_reader, &ring);
+	if (ret != 0) {
+		nft_print(octx, "# ERROR: %s\n", strerror(ret));
+		close(ring.stop_fd[0]);
+		close(ring.stop_fd[1]);
+		free(ring.buf);
+		return -1;
+	}
 
-		if (FD_ISSET(fd, &readfds)) {
-			ret = mnl_socket_recvfrom(nf_sock, buf, sizeof(buf));
-			if (ret < 0) {
-				if (errno == ENOBUFS) {
-					nft_print(octx, "# ERROR: We lost some netlink events!\n");
-					continue;
-				}
-				nft_print(octx, "# ERROR: %s\n",
-					  strerror(errno));
+	if (ops->tick) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		event_deadline_add(&deadline, ops->interval);
+	}
+
+	while (1) {
+		ret = event_ring_next(&ring, &buf, ops->tick ? &deadline : NULL);
+		if (ret == NFT_EVENT_TIMEOUT) {
+			ret = ops->tick(cb_data);
+			if (ret < 0)
 				break;
-			}
+			event_deadline_add(&deadline, ops->interval);
+			continue;
+		}
+		if (ret == -1) {
+			nft_print(octx, "# ERROR: %s\n", strerror(errno));
+			break;
+		}
+		if (ret == NFT_EVENT_LOST) {
+			event_ring_release(&ring);
+
+			nft_print(octx, "# ERROR: We lost some netlink events!\n");
+			ret = ops->lost ? ops->lost(cb_data) : 0;
+			if (ret < 0)
+				break;
+			continue;
 		}
 
 		if (debug_mask & NFT_DEBUG_MNL) {
-			mnl_nlmsg_fprintf(octx->output_fp, buf, sizeof(buf),
+			mnl_nlmsg_fprintf(octx->output_fp, buf, ret,
 					  sizeof(struct nfgenmsg));
 		}
-		ret = mnl_cb_run(buf, ret, 0, 0, cb, cb_data);
+		ret = mnl_cb_run(buf, ret, 0, 0, ops->event, cb_data);
+		event_ring_release(&ring);
 		if (ret <= 0)
 			break;
 	}
+
+	event_ring_exit(&ring, reader);
+
 	return ret;
 }
 
@@ -2456,10 +4588,50 @@ static int __mnl_nft_dump_nf_hooks(struct netlink_ctx *ctx, uint8_t query_family
 	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, dump_nf_hooks, &data);
 }
 
+/*
+ * With --stats, nftables base chains are annotated with the static cost
+ * estimate of the optimizer, and each hook with the sum over its chains:
+ * a packet runs through all of them in turn.
+ */
+static bool hook_chain_cost(struct netlink_ctx *ctx,
+			    const struct basehook *hook,
+			    struct chain_cost *cost)
+{
+	const struct table *table;
+	const struct chain *chain;
+
+	if (!hook->table || !hook->chain)
+		return false;
+
+	table = table_cache_find(&ctx->nft->cache->table_cache, hook->table,
+				 hook->chain_family);
+	if (!table)
+		return false;
+
+	chain = chain_cache_find(table, hook->chain);
+	if (!chain)
+		return false;
+
+	chain_cost_estimate(table, chain, cost);
+
+	return true;
+}
+
+static void print_hook_cost(FILE *fp, const char *prefix,
+			    const struct chain_cost *cost)
+{
+	fprintf(fp, "%srules %u, worst case rules %u, lookups %u, jump depth %u",
+		prefix, cost->rules, cost->worst_rules, cost->lookups,
+		cost->depth);
+}
+
 static void print_hooks(struct netlink_ctx *ctx, int family, struct list_head *hook_list)
 {
+	bool with_cost = ctx->nft->optimize_flags & NFT_OPTIMIZE_STATS;
 	struct basehook *hook, *tmp, *prev = NULL;
 	bool same, family_in_use = false;
+	struct chain_cost cost, total = {};
+	bool total_valid = false;
 	int prio;
 	FILE *fp;
 
@@ -2487,6 +4659,8 @@ static void print_hooks(struct netlink_ctx *ctx, int family, struct list_head *h
 				same = true;
 			} else {
 				same = false;
+				if (total_valid)
+					print_hook_cost(fp, "\n\t\t# total: ", &total);
 				fprintf(fp, "\n\t}\n");
 			}
 		} else {
@@ -2495,6 +4669,9 @@ static void print_hooks(struct netlink_ctx *ctx, int family, struct list_head *h
 		prev = hook;
 
 		if (!same) {
+			memset(&total, 0, sizeof(total));
+			total_valid = false;
+
 			if (hook->devname)
 				fprintf(fp, "\thook %s device %s {\n",
 					hooknum2str(family, hook->num), hook->devname);
@@ -2520,8 +4697,19 @@ static void print_hooks(struct netlink_ctx *ctx, int family, struct list_head *h
 		}
 		if (hook->module_name)
 			fprintf(fp, " [%s]", hook->module_name);
+
+		if (with_cost && hook_chain_cost(ctx, hook, &cost)) {
+			print_hook_cost(fp, " # ", &cost);
+			total.rules += cost.rules;
+			total.worst_rules += cost.worst_rules;
+			total.lookups += cost.lookups;
+			total.depth = max(total.depth, cost.depth);
+			total_valid = true;
+		}
 	}
 
+	if (total_valid)
+		print_hook_cost(fp, "\n\t\t# total: ", &total);
 	fprintf(fp, "\n\t}\n");
 	fprintf(fp, "}\n");
 }
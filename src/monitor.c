@@ -10,6 +10,7 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <endian.h>
 #include <libmnl/libmnl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -39,6 +40,8 @@
 #include <erec.h>
 #include <iface.h>
 #include <json.h>
+#include <journal.h>
+#include <intervals.h>
 
 enum {
 	NFT_OF_EVENT_ADD,
@@ -423,7 +426,7 @@ static int netlink_events_setelem_cb(const struct nlmsghdr *nlh, int type,
 	family = nftnl_set_get_u32(nls, NFTNL_SET_FAMILY);
 	cmd = netlink_msg2cmd(type, nlh->nlmsg_flags);
 
-	set = set_lookup_global(family, table, setname, &monh->ctx->nft->cache);
+	set = set_lookup_global(family, table, setname, monh->ctx->nft->cache);
 	if (set == NULL) {
 		fprintf(stderr, "W: Received event for an unknown set.\n");
 		goto out;
@@ -457,7 +460,7 @@ static int netlink_events_setelem_cb(const struct nlmsghdr *nlh, int type,
 			goto out;
 		}
 		if (netlink_delinearize_setelem(nlse, dummyset,
-						&monh->ctx->nft->cache) < 0) {
+						monh->ctx->nft->cache) < 0) {
 			set_free(dummyset);
 			nftnl_set_elems_iter_destroy(nlsei);
 			goto out;
@@ -567,7 +570,7 @@ static int netlink_events_rule_cb(const struct nlmsghdr *nlh, int type,
 		goto out_free_nlr;
 	}
 	nlr_for_each_set(nlr, rule_map_decompose_cb, NULL,
-			 &monh->ctx->nft->cache);
+			 monh->ctx->nft->cache);
 	cmd = netlink_msg2cmd(type, nlh->nlmsg_flags);
 
 	switch (monh->format) {
@@ -617,7 +620,7 @@ static void netlink_events_cache_addtable(struct netlink_mon_handler *monh,
 	t = netlink_delinearize_table(monh->ctx, nlt);
 	nftnl_table_free(nlt);
 
-	table_cache_add(t, &monh->ctx->nft->cache);
+	table_cache_add(t, monh->ctx->nft->cache);
 }
 
 static void netlink_events_cache_deltable(struct netlink_mon_handler *monh,
@@ -631,7 +634,7 @@ static void netlink_events_cache_deltable(struct netlink_mon_handler *monh,
 	h.family = nftnl_table_get_u32(nlt, NFTNL_TABLE_FAMILY);
 	h.table.name  = nftnl_table_get_str(nlt, NFTNL_TABLE_NAME);
 
-	t = table_cache_find(&monh->ctx->nft->cache.table_cache,
+	t = table_cache_find(&monh->ctx->nft->cache->table_cache,
 			     h.table.name, h.family);
 	if (t == NULL)
 		goto out;
@@ -663,7 +666,7 @@ static void netlink_events_cache_addset(struct netlink_mon_handler *monh,
 		goto out;
 	s->init = set_expr_alloc(monh->loc, s);
 
-	t = table_cache_find(&monh->ctx->nft->cache.table_cache,
+	t = table_cache_find(&monh->ctx->nft->cache->table_cache,
 			     s->handle.table.name, s->handle.family);
 	if (t == NULL) {
 		fprintf(stderr, "W: Unable to cache set: table not found.\n");
@@ -691,13 +694,14 @@ static void netlink_events_cache_addsetelem(struct netlink_mon_handler *monh,
 	struct set *set;
 	const char *table, *setname;
 	uint32_t family;
+	int ret;
 
 	nls     = netlink_setelem_alloc(nlh);
 	family  = nftnl_set_get_u32(nls, NFTNL_SET_FAMILY);
 	table   = nftnl_set_get_str(nls, NFTNL_SET_TABLE);
 	setname = nftnl_set_get_str(nls, NFTNL_SET_NAME);
 
-	set = set_lookup_global(family, table, setname, &monh->ctx->nft->cache);
+	set = set_lookup_global(family, table, setname, monh->ctx->nft->cache);
 	if (set == NULL) {
 		fprintf(stderr,
 			"W: Unable to cache set_elem. Set not found.\n");
@@ -708,6 +712,17 @@ static void netlink_events_cache_addsetelem(struct netlink_mon_handler *monh,
 	    !set_is_anonymous(set->flags))
 		goto out;
 
+	if (!set_is_anonymous(set->flags)) {
+		ret = netlink_setelem_cache_event(set, nls, NFT_MSG_NEWSETELEM,
+						  monh->ctx->nft->cache);
+		if (ret < 0)
+			fprintf(stderr,
+				"W: Unable to cache set_elem. "
+				"Delinearize failed.\n");
+		if (ret <= 0)
+			goto out;
+	}
+
 	nlsei = nftnl_set_elems_iter_create(nls);
 	if (nlsei == NULL)
 		memory_allocation_error();
@@ -715,7 +730,7 @@ static void netlink_events_cache_addsetelem(struct netlink_mon_handler *monh,
 	nlse = nftnl_set_elems_iter_next(nlsei);
 	while (nlse != NULL) {
 		if (netlink_delinearize_setelem(nlse, set,
-						&monh->ctx->nft->cache) < 0) {
+						monh->ctx->nft->cache) < 0) {
 			fprintf(stderr,
 				"W: Unable to cache set_elem. "
 				"Delinearize failed.\n");
@@ -729,6 +744,26 @@ out:
 	nftnl_set_free(nls);
 }
 
+static void netlink_events_cache_delsetelem(struct netlink_mon_handler *monh,
+					    const struct nlmsghdr *nlh)
+{
+	struct nftnl_set *nls;
+	struct set *set;
+
+	if (nft_output_echo(&monh->ctx->nft->output))
+		return;
+
+	nls = netlink_setelem_alloc(nlh);
+	set = set_lookup_global(nftnl_set_get_u32(nls, NFTNL_SET_FAMILY),
+				nftnl_set_get_str(nls, NFTNL_SET_TABLE),
+				nftnl_set_get_str(nls, NFTNL_SET_NAME),
+				monh->ctx->nft->cache);
+	if (set && !set_is_anonymous(set->flags))
+		netlink_setelem_cache_event(set, nls, NFT_MSG_DELSETELEM,
+					    monh->ctx->nft->cache);
+	nftnl_set_free(nls);
+}
+
 static void netlink_events_cache_delset_cb(struct set *s,
 					   void *data)
 {
@@ -742,7 +777,7 @@ static void netlink_events_cache_delsets(struct netlink_mon_handler *monh,
 	struct nftnl_rule *nlr = netlink_rule_alloc(nlh);
 
 	nlr_for_each_set(nlr, netlink_events_cache_delset_cb, NULL,
-			 &monh->ctx->nft->cache);
+			 monh->ctx->nft->cache);
 	nftnl_rule_free(nlr);
 }
 
@@ -765,7 +800,7 @@ static void netlink_events_cache_addobj(struct netlink_mon_handler *monh,
 	if (obj == NULL)
 		goto out;
 
-	t = table_cache_find(&monh->ctx->nft->cache.table_cache,
+	t = table_cache_find(&monh->ctx->nft->cache->table_cache,
 			     obj->handle.table.name, obj->handle.family);
 	if (t == NULL) {
 		fprintf(stderr, "W: Unable to cache object: table not found.\n");
@@ -796,7 +831,7 @@ static void netlink_events_cache_delobj(struct netlink_mon_handler *monh,
 	type	 = nftnl_obj_get_u32(nlo, NFTNL_OBJ_TYPE);
 	h.handle.id	= nftnl_obj_get_u64(nlo, NFTNL_OBJ_HANDLE);
 
-	t = table_cache_find(&monh->ctx->nft->cache.table_cache,
+	t = table_cache_find(&monh->ctx->nft->cache->table_cache,
 			     h.table.name, h.family);
 	if (t == NULL) {
 		fprintf(stderr, "W: Unable to cache object: table not found.\n");
@@ -815,39 +850,473 @@ out:
 	nftnl_obj_free(nlo);
 }
 
-static void netlink_events_cache_update(struct netlink_mon_handler *monh,
-					const struct nlmsghdr *nlh, int type)
+/*
+ * Persistent cache: ruleset events are queued until the NFT_MSG_NEWGEN
+ * message that closes the transaction arrives, then they are applied to the
+ * cache unless this generation is already covered by the cache. Handlers are
+ * idempotent since the cache might already contain the objects that were
+ * added by this context.
+ */
+struct cache_event {
+	struct list_head	list;
+	char			buf[];
+};
+
+struct cache_set_refresh {
+	struct list_head	list;
+	uint32_t		family;
+	char			*table;
+	char			*set;
+};
+
+struct cache_events_ctx {
+	struct netlink_mon_handler	monh;
+	struct list_head		events;
+	struct list_head		refresh;
+	uint16_t			genid;
+	bool				resync;
+};
+
+static bool cache_has(const struct cache_events_ctx *cctx, unsigned int bit)
 {
-	if (nft_output_echo(&monh->ctx->nft->output) &&
-	    type != NFT_MSG_NEWSET && type != NFT_MSG_NEWSETELEM)
+	return cctx->monh.cache->flags & bit;
+}
+
+static struct table *cache_event_table(struct cache_events_ctx *cctx,
+				       const char *name, uint32_t family)
+{
+	return table_cache_find(&cctx->monh.cache->table_cache, name, family);
+}
+
+static void cache_event_newtable(struct cache_events_ctx *cctx,
+				 const struct nlmsghdr *nlh)
+{
+	struct nftnl_table *nlt;
+	struct table *t;
+
+	nlt = netlink_table_alloc(nlh);
+	t = cache_event_table(cctx, nftnl_table_get_str(nlt, NFTNL_TABLE_NAME),
+			      nftnl_table_get_u32(nlt, NFTNL_TABLE_FAMILY));
+	if (t) {
+		t->handle.handle.id = nftnl_table_get_u64(nlt, NFTNL_TABLE_HANDLE);
+		t->flags = nftnl_table_get_u32(nlt, NFTNL_TABLE_FLAGS);
+		nftnl_table_free(nlt);
+		return;
+	}
+	nftnl_table_free(nlt);
+
+	netlink_events_cache_addtable(&cctx->monh, nlh);
+}
+
+static struct chain *cache_chain_lookup(const struct table *t, const char *name)
+{
+	struct chain *chain;
+
+	chain = chain_cache_find(t, name);
+	if (!chain)
+		chain = chain_binding_lookup(t, name);
+
+	return chain;
+}
+
+static void cache_event_chain(struct cache_events_ctx *cctx,
+			      const struct nlmsghdr *nlh, int type)
+{
+	struct chain *chain, *old;
+	struct nftnl_chain *nlc;
+	struct table *t;
+
+	nlc = netlink_chain_alloc(nlh);
+	t = cache_event_table(cctx, nftnl_chain_get_str(nlc, NFTNL_CHAIN_TABLE),
+			      nftnl_chain_get_u32(nlc, NFTNL_CHAIN_FAMILY));
+	if (!t)
+		goto out;
+
+	old = cache_chain_lookup(t, nftnl_chain_get_str(nlc, NFTNL_CHAIN_NAME));
+	if (type == NFT_MSG_NEWCHAIN) {
+		chain = netlink_delinearize_chain(cctx->monh.ctx, nlc);
+		if (old)
+			list_splice_init(&old->rules, &chain->rules);
+
+		if (chain->flags & CHAIN_F_BINDING)
+			list_add_tail(&chain->cache.list, &t->chain_bindings);
+		else
+			chain_cache_add(chain, t);
+	}
+	if (old) {
+		if (old->flags & CHAIN_F_BINDING)
+			list_del(&old->cache.list);
+		else
+			chain_cache_del(old);
+		chain_free(old);
+	}
+out:
+	nftnl_chain_free(nlc);
+}
+
+static void cache_event_rule(struct cache_events_ctx *cctx,
+			     const struct nlmsghdr *nlh, int type)
+{
+	struct rule *rule, *next, *ref = NULL;
+	struct nftnl_rule *nlr;
+	struct chain *chain;
+	struct table *t;
+
+	nlr = netlink_rule_alloc(nlh);
+	t = cache_event_table(cctx, nftnl_rule_get_str(nlr, NFTNL_RULE_TABLE),
+			      nftnl_rule_get_u32(nlr, NFTNL_RULE_FAMILY));
+	if (!t)
+		goto out;
+
+	chain = cache_chain_lookup(t, nftnl_rule_get_str(nlr, NFTNL_RULE_CHAIN));
+	if (!chain)
+		goto out;
+
+	rule = rule_lookup(chain, nftnl_rule_get_u64(nlr, NFTNL_RULE_HANDLE));
+	if (type == NFT_MSG_DELRULE) {
+		if (rule) {
+			list_del(&rule->list);
+			rule_free(rule);
+		}
+		goto out;
+	}
+	if (rule)
+		goto out;
+
+	/* rules added by this context have no handle, the kernel one
+	 * replaces them.
+	 */
+	list_for_each_entry_safe(rule, next, &chain->rules, list) {
+		if (rule->handle.handle.id)
+			continue;
+		list_del(&rule->list);
+		rule_free(rule);
+	}
+
+	if (nftnl_rule_is_set(nlr, NFTNL_RULE_POSITION)) {
+		ref = rule_lookup(chain,
+				  nftnl_rule_get_u64(nlr, NFTNL_RULE_POSITION));
+		if (!ref) {
+			cctx->resync = true;
+			goto out;
+		}
+	}
+
+	rule = netlink_delinearize_rule(cctx->monh.ctx, nlr);
+	if (!rule) {
+		cctx->resync = true;
+		goto out;
+	}
+
+	if (ref)
+		list_add(&rule->list, &ref->list);
+	else
+		list_add(&rule->list, &chain->rules);
+out:
+	nftnl_rule_free(nlr);
+}
+
+static void cache_event_set(struct cache_events_ctx *cctx,
+			    const struct nlmsghdr *nlh, int type)
+{
+	struct nftnl_set *nls;
+	struct set *set;
+	struct table *t;
+
+	nls = netlink_set_alloc(nlh);
+	t = cache_event_table(cctx, nftnl_set_get_str(nls, NFTNL_SET_TABLE),
+			      nftnl_set_get_u32(nls, NFTNL_SET_FAMILY));
+	if (!t)
+		goto out;
+
+	set = set_cache_find(t, nftnl_set_get_str(nls, NFTNL_SET_NAME));
+	if (type == NFT_MSG_DELSET) {
+		if (set) {
+			set_cache_del(set);
+			set_free(set);
+		}
+		goto out;
+	}
+	if (set) {
+		set->handle.handle.id = nftnl_set_get_u64(nls, NFTNL_SET_HANDLE);
+		goto out;
+	}
+
+	set = netlink_delinearize_set(cctx->monh.ctx, nls);
+	if (!set) {
+		cctx->resync = true;
+		goto out;
+	}
+	if (set_is_anonymous(set->flags))
+		set->init = set_expr_alloc(cctx->monh.loc, set);
+
+	set_cache_add(set, t);
+out:
+	nftnl_set_free(nls);
+}
+
+static void cache_event_setelem(struct cache_events_ctx *cctx,
+				const struct nlmsghdr *nlh, int type)
+{
+	struct cache_set_refresh *refresh;
+	const char *table, *setname;
+	struct nftnl_set *nls;
+	struct set *set;
+	uint32_t family;
+
+	nls     = netlink_setelem_alloc(nlh);
+	family  = nftnl_set_get_u32(nls, NFTNL_SET_FAMILY);
+	table   = nftnl_set_get_str(nls, NFTNL_SET_TABLE);
+	setname = nftnl_set_get_str(nls, NFTNL_SET_NAME);
+
+	set = set_lookup_global(family, table, setname, cctx->monh.cache);
+	if (!set || !set->init)
+		goto out;
+
+	/* anonymous sets are only populated once, from the same transaction. */
+	if (set_is_anonymous(set->flags) && type == NFT_MSG_NEWSETELEM) {
+		nftnl_set_free(nls);
+		netlink_events_cache_addsetelem(&cctx->monh, nlh);
 		return;
+	}
+
+	if (!set_is_anonymous(set->flags) &&
+	    netlink_setelem_cache_event(set, nls, type, cctx->monh.cache) == 0)
+		goto out;
+
+	/* fetch the elements of this set once the transaction is applied. */
+	list_for_each_entry(refresh, &cctx->refresh, list) {
+		if (refresh->family == family &&
+		    !strcmp(refresh->table, table) &&
+		    !strcmp(refresh->set, setname))
+			goto out;
+	}
+	refresh = xmalloc(sizeof(*refresh));
+	refresh->family = family;
+	refresh->table = xstrdup(table);
+	refresh->set = xstrdup(setname);
+	list_add_tail(&refresh->list, &cctx->refresh);
+out:
+	nftnl_set_free(nls);
+}
+
+static void cache_event_obj(struct cache_events_ctx *cctx,
+			    const struct nlmsghdr *nlh, int type)
+{
+	struct nftnl_obj *nlo;
+	struct table *t;
+	struct obj *obj;
+
+	nlo = netlink_obj_alloc(nlh);
+	t = cache_event_table(cctx, nftnl_obj_get_str(nlo, NFTNL_OBJ_TABLE),
+			      nftnl_obj_get_u32(nlo, NFTNL_OBJ_FAMILY));
+	if (!t)
+		goto out;
+
+	obj = obj_cache_find(t, nftnl_obj_get_str(nlo, NFTNL_OBJ_NAME),
+			     nftnl_obj_get_u32(nlo, NFTNL_OBJ_TYPE));
+	if (obj) {
+		obj_cache_del(obj);
+		obj_free(obj);
+	}
+	if (type == NFT_MSG_NEWOBJ)
+		netlink_events_cache_addobj(&cctx->monh, nlh);
+out:
+	nftnl_obj_free(nlo);
+}
+
+static void cache_event_flowtable(struct cache_events_ctx *cctx,
+				  const struct nlmsghdr *nlh, int type)
+{
+	struct nftnl_flowtable *nlf;
+	struct flowtable *ft;
+	struct table *t;
+
+	nlf = nftnl_flowtable_alloc();
+	if (!nlf)
+		memory_allocation_error();
+	if (nftnl_flowtable_nlmsg_parse(nlh, nlf) < 0)
+		netlink_abi_error();
+
+	t = cache_event_table(cctx,
+			      nftnl_flowtable_get_str(nlf, NFTNL_FLOWTABLE_TABLE),
+			      nftnl_flowtable_get_u32(nlf, NFTNL_FLOWTABLE_FAMILY));
+	if (!t)
+		goto out;
+
+	ft = ft_cache_find(t, nftnl_flowtable_get_str(nlf, NFTNL_FLOWTABLE_NAME));
+	if (ft) {
+		ft_cache_del(ft);
+		flowtable_free(ft);
+	}
+	if (type == NFT_MSG_NEWFLOWTABLE) {
+		ft = netlink_delinearize_flowtable(cctx->monh.ctx, nlf);
+		if (ft)
+			ft_cache_add(ft, t);
+		else
+			cctx->resync = true;
+	}
+out:
+	nftnl_flowtable_free(nlf);
+}
+
+static void cache_event_apply(struct cache_events_ctx *cctx,
+			      const struct nlmsghdr *nlh)
+{
+	int type = NFNL_MSG_TYPE(nlh->nlmsg_type);
 
 	switch (type) {
 	case NFT_MSG_NEWTABLE:
-		netlink_events_cache_addtable(monh, nlh);
+		cache_event_newtable(cctx, nlh);
 		break;
 	case NFT_MSG_DELTABLE:
-		netlink_events_cache_deltable(monh, nlh);
+		netlink_events_cache_deltable(&cctx->monh, nlh);
+		break;
+	case NFT_MSG_NEWCHAIN:
+	case NFT_MSG_DELCHAIN:
+		if (cache_has(cctx, NFT_CACHE_CHAIN_BIT))
+			cache_event_chain(cctx, nlh, type);
+		break;
+	case NFT_MSG_NEWRULE:
+	case NFT_MSG_DELRULE:
+		if (cache_has(cctx, NFT_CACHE_RULE_BIT))
+			cache_event_rule(cctx, nlh, type);
+		if (type == NFT_MSG_DELRULE && cache_has(cctx, NFT_CACHE_SET_BIT))
+			netlink_events_cache_delsets(&cctx->monh, nlh);
 		break;
 	case NFT_MSG_NEWSET:
-		netlink_events_cache_addset(monh, nlh);
+	case NFT_MSG_DELSET:
+		if (cache_has(cctx, NFT_CACHE_SET_BIT))
+			cache_event_set(cctx, nlh, type);
 		break;
 	case NFT_MSG_NEWSETELEM:
-		netlink_events_cache_addsetelem(monh, nlh);
-		break;
-	case NFT_MSG_DELRULE:
-		/* there are no notification for anon-set deletion */
-		netlink_events_cache_delsets(monh, nlh);
+	case NFT_MSG_DELSETELEM:
+		if (cache_has(cctx, NFT_CACHE_SET_BIT))
+			cache_event_setelem(cctx, nlh, type);
 		break;
 	case NFT_MSG_NEWOBJ:
-		netlink_events_cache_addobj(monh, nlh);
-		break;
 	case NFT_MSG_DELOBJ:
-		netlink_events_cache_delobj(monh, nlh);
+		if (cache_has(cctx, NFT_CACHE_OBJECT_BIT))
+			cache_event_obj(cctx, nlh, type);
+		break;
+	case NFT_MSG_NEWFLOWTABLE:
+	case NFT_MSG_DELFLOWTABLE:
+		if (cache_has(cctx, NFT_CACHE_FLOWTABLE_BIT))
+			cache_event_flowtable(cctx, nlh, type);
 		break;
 	}
 }
 
+static void cache_events_refresh(struct cache_events_ctx *cctx)
+{
+	struct cache_set_refresh *refresh, *next;
+	struct set *set;
+
+	list_for_each_entry_safe(refresh, next, &cctx->refresh, list) {
+		set = set_lookup_global(refresh->family, refresh->table,
+					refresh->set, cctx->monh.cache);
+		if (set && set->init) {
+			interval_index_invalidate(set);
+			expr_free(set->init);
+			set->init = NULL;
+			if (netlink_list_setelems(cctx->monh.ctx, &set->handle,
+						  set, false) < 0)
+				cctx->resync = true;
+		}
+		list_del(&refresh->list);
+		free(refresh->table);
+		free(refresh->set);
+		free(refresh);
+	}
+}
+
+static void cache_event_journal(struct cache_events_ctx *cctx,
+				const struct nlmsghdr *nlh);
+static void cache_events_journal_commit(struct cache_events_ctx *cctx,
+					const struct nlmsghdr *nlh);
+
+static void cache_events_flush(struct cache_events_ctx *cctx, bool apply)
+{
+	struct cache_event *ev, *next;
+
+	list_for_each_entry_safe(ev, next, &cctx->events, list) {
+		if (apply && !cctx->resync) {
+			/* elements are printed against their set before the
+			 * event changes it.
+			 */
+			cache_event_journal(cctx, (struct nlmsghdr *)ev->buf);
+			cache_event_apply(cctx, (struct nlmsghdr *)ev->buf);
+		}
+		list_del(&ev->list);
+		free(ev);
+	}
+	if (apply && !cctx->resync)
+		cache_events_refresh(cctx);
+}
+
+static int cache_events_cb(const struct nlmsghdr *nlh, void *data)
+{
+	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+	struct cache_events_ctx *cctx = data;
+	struct cache_event *ev;
+	struct nfgenmsg *nfh;
+	uint16_t genid;
+
+	if (type != NFT_MSG_NEWGEN) {
+		ev = xmalloc(sizeof(*ev) + nlh->nlmsg_len);
+		memcpy(ev->buf, nlh, nlh->nlmsg_len);
+		list_add_tail(&ev->list, &cctx->events);
+		return MNL_CB_OK;
+	}
+
+	nfh = mnl_nlmsg_get_payload(nlh);
+	genid = ntohs(nfh->res_id);
+
+	/* skip transactions that are already covered by the cache. */
+	if ((int16_t)(genid - cctx->genid) <= 0) {
+		cache_events_flush(cctx, false);
+		return MNL_CB_OK;
+	}
+
+	cache_events_flush(cctx, true);
+	cache_events_journal_commit(cctx, nlh);
+	cctx->genid = genid;
+
+	return MNL_CB_OK;
+}
+
+/* Apply pending events to the cache, returns 0 if the cache is up to date
+ * with @genid, otherwise the cache needs to be populated from scratch.
+ */
+int netlink_cache_events(struct netlink_ctx *ctx, struct mnl_socket *ev_sock,
+			 uint32_t genid)
+{
+	struct cache_events_ctx cctx = {
+		.monh = {
+			.ctx	= ctx,
+			.loc	= &netlink_location,
+			.cache	= ctx->nft->cache,
+		},
+		.events		= LIST_HEAD_INIT(cctx.events),
+		.refresh	= LIST_HEAD_INIT(cctx.refresh),
+		.genid		= ctx->nft->cache->genid,
+	};
+	int ret;
+
+	ret = mnl_nft_event_drain(ev_sock, cache_events_cb, &cctx);
+	cache_events_flush(&cctx, false);
+
+	if (ret < 0 || cctx.resync) {
+		if (ctx->nft->journal)
+			nft_journal_invalidate(ctx->nft->journal);
+		return -1;
+	}
+	if (cctx.genid != (uint16_t)genid)
+		return -1;
+
+	return 0;
+}
+
 /* only those which could be useful listening to events */
 static const char *const nftnl_msg_types[NFT_MSG_MAX] = {
 	[NFT_MSG_NEWTABLE]	= "NFT_MSG_NEWTABLE",
@@ -922,26 +1391,83 @@ static int netlink_events_newgen_cb(const struct nlmsghdr *nlh, int type,
 	return MNL_CB_OK;
 }
 
-static int netlink_events_cb(const struct nlmsghdr *nlh, void *data)
+/* Trace events are printed along with their rule, keep chains and rules in
+ * the cache up to date for them.
+ */
+static void netlink_events_cache_trace(struct netlink_mon_handler *monh,
+				       const struct nlmsghdr *nlh, int type)
 {
-	int ret = MNL_CB_OK;
-	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
-	struct netlink_mon_handler *monh = (struct netlink_mon_handler *)data;
+	struct cache_events_ctx cctx = {
+		.monh		= *monh,
+		.events		= LIST_HEAD_INIT(cctx.events),
+		.refresh	= LIST_HEAD_INIT(cctx.refresh),
+	};
 
-	netlink_events_debug(type, monh->ctx->nft->debug_mask);
-	netlink_events_cache_update(monh, nlh, type);
+	if (!(monh->monitor_flags & (1 << NFT_MSG_TRACE)) ||
+	    !cache_has(&cctx, NFT_CACHE_RULE_BIT))
+		return;
 
-	if (!(monh->monitor_flags & (1 << type)))
-		return ret;
+	if (type == NFT_MSG_NEWCHAIN || type == NFT_MSG_DELCHAIN)
+		cache_event_chain(&cctx, nlh, type);
+	else
+		cache_event_rule(&cctx, nlh, type);
+}
+
+static void netlink_events_cache_update(struct netlink_mon_handler *monh,
+					const struct nlmsghdr *nlh, int type)
+{
+	if (nft_output_echo(&monh->ctx->nft->output) &&
+	    type != NFT_MSG_NEWSET && type != NFT_MSG_NEWSETELEM)
+		return;
 
 	switch (type) {
 	case NFT_MSG_NEWTABLE:
-	case NFT_MSG_DELTABLE:
-		ret = netlink_events_table_cb(nlh, type, monh);
+		netlink_events_cache_addtable(monh, nlh);
 		break;
-	case NFT_MSG_NEWCHAIN:
-	case NFT_MSG_DELCHAIN:
-		ret = netlink_events_chain_cb(nlh, type, monh);
+	case NFT_MSG_DELTABLE:
+		netlink_events_cache_deltable(monh, nlh);
+		break;
+	case NFT_MSG_NEWSET:
+		netlink_events_cache_addset(monh, nlh);
+		break;
+	case NFT_MSG_NEWSETELEM:
+		netlink_events_cache_addsetelem(monh, nlh);
+		break;
+	case NFT_MSG_DELSETELEM:
+		netlink_events_cache_delsetelem(monh, nlh);
+		break;
+	case NFT_MSG_NEWCHAIN:
+	case NFT_MSG_DELCHAIN:
+	case NFT_MSG_NEWRULE:
+		netlink_events_cache_trace(monh, nlh, type);
+		break;
+	case NFT_MSG_DELRULE:
+		netlink_events_cache_trace(monh, nlh, type);
+		/* there are no notification for anon-set deletion */
+		netlink_events_cache_delsets(monh, nlh);
+		break;
+	case NFT_MSG_NEWOBJ:
+		netlink_events_cache_addobj(monh, nlh);
+		break;
+	case NFT_MSG_DELOBJ:
+		netlink_events_cache_delobj(monh, nlh);
+		break;
+	}
+}
+
+static int netlink_events_print(const struct nlmsghdr *nlh, uint16_t type,
+				struct netlink_mon_handler *monh)
+{
+	int ret = MNL_CB_OK;
+
+	switch (type) {
+	case NFT_MSG_NEWTABLE:
+	case NFT_MSG_DELTABLE:
+		ret = netlink_events_table_cb(nlh, type, monh);
+		break;
+	case NFT_MSG_NEWCHAIN:
+	case NFT_MSG_DELCHAIN:
+		ret = netlink_events_chain_cb(nlh, type, monh);
 		break;
 	case NFT_MSG_NEWSET:
 	case NFT_MSG_DELSET:		/* nft {add|delete} set */
@@ -949,14 +1475,20 @@ static int netlink_events_cb(const struct nlmsghdr *nlh, void *data)
 		break;
 	case NFT_MSG_NEWSETELEM:
 	case NFT_MSG_DELSETELEM:	/* nft {add|delete} element */
-		ret = netlink_events_setelem_cb(nlh, type, monh);
+		if (monh->elem_aggr)
+			ret = netlink_events_elem_aggr_cb(nlh, type, monh);
+		else
+			ret = netlink_events_setelem_cb(nlh, type, monh);
 		break;
 	case NFT_MSG_NEWRULE:
 	case NFT_MSG_DELRULE:
 		ret = netlink_events_rule_cb(nlh, type, monh);
 		break;
 	case NFT_MSG_TRACE:
-		ret = netlink_events_trace_cb(nlh, type, monh);
+		if (monh->trace_aggr)
+			ret = netlink_events_trace_aggr_cb(nlh, monh);
+		else
+			ret = netlink_events_trace_cb(nlh, type, monh);
 		break;
 	case NFT_MSG_NEWOBJ:
 	case NFT_MSG_DELOBJ:
@@ -970,6 +1502,537 @@ static int netlink_events_cb(const struct nlmsghdr *nlh, void *data)
 	return ret;
 }
 
+static int __netlink_events_cb(const struct nlmsghdr *nlh,
+			       struct netlink_mon_handler *monh)
+{
+	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+
+	netlink_events_debug(type, monh->ctx->nft->debug_mask);
+	netlink_events_cache_update(monh, nlh, type);
+
+	if (!(monh->monitor_flags & (1 << type)))
+		return MNL_CB_OK;
+
+	return netlink_events_print(nlh, type, monh);
+}
+
+/*
+ * Replication stream: the changes of a transaction to named sets and maps,
+ * their elements and stateful objects are printed on one line, separated by
+ * semicolons, so that "nft -i" or the command server applies them as one
+ * transaction too. The line ends with the generation of the transaction.
+ * Deletions are printed as destroy commands, a replica that is already past
+ * a change does not fail on it. Handles of rules differ between nodes, a
+ * transaction that changes tables, chains or rules is printed as a comment
+ * that asks to reload the replica instead.
+ */
+#define NFT_REPLICA_RELOAD_EVENTS					\
+	((1U << NFT_MSG_NEWTABLE) | (1U << NFT_MSG_DELTABLE) |		\
+	 (1U << NFT_MSG_NEWCHAIN) | (1U << NFT_MSG_DELCHAIN) |		\
+	 (1U << NFT_MSG_NEWRULE) | (1U << NFT_MSG_DELRULE) |		\
+	 (1U << NFT_MSG_NEWFLOWTABLE) | (1U << NFT_MSG_DELFLOWTABLE))
+
+static void netlink_replica_reset(struct netlink_replica *r)
+{
+	if (r->fp)
+		fclose(r->fp);
+	free(r->buf);
+	memset(r, 0, sizeof(*r));
+}
+
+static uint32_t netlink_events_genid(const struct nlmsghdr *nlh)
+{
+	const struct nfgenmsg *nfh = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		if (mnl_attr_get_type(attr) == NFTA_GEN_ID &&
+		    mnl_attr_validate(attr, MNL_TYPE_U32) == 0)
+			return ntohl(mnl_attr_get_u32(attr));
+	}
+
+	return ntohs(nfh->res_id);
+}
+
+/* A replica applies additions and deletions whether or not it has them. */
+static int netlink_replica_verb(struct netlink_mon_handler *monh,
+				const char *sep, const char *line)
+{
+	static const char *const verbs[][2] = {
+		{ "create ",	"add " },
+		{ "delete ",	"destroy " },
+	};
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < array_size(verbs); i++) {
+		len = strlen(verbs[i][0]);
+		if (!strncmp(line, verbs[i][0], len)) {
+			nft_mon_print(monh, "%s%s", sep, verbs[i][1]);
+			return len;
+		}
+	}
+
+	nft_mon_print(monh, "%s", sep);
+	return 0;
+}
+
+/* Where the elements start in an element command, NULL for other ones. */
+static const char *netlink_replica_elems(const char *line)
+{
+	const char *p = strchr(line, ' ');
+
+	if (!p || strncmp(p, " element ", strlen(" element ")))
+		return NULL;
+
+	return strstr(p, " { ");
+}
+
+static void netlink_replica_commit(struct netlink_mon_handler *monh,
+				   uint32_t genid)
+{
+	struct netlink_replica *r = &monh->replica;
+	const char *sep = "", *prefix = NULL;
+	const char *line, *nl, *elems;
+	size_t prefix_len = 0;
+	int skip;
+
+	if (r->fp) {
+		fclose(r->fp);
+		r->fp = NULL;
+	}
+
+	if (r->reload) {
+		nft_mon_print(monh, "# generation %u changes tables, chains or rules, reload\n",
+			      genid);
+		goto out;
+	}
+	if (r->len == 0)
+		goto out;
+
+	for (line = r->buf; (nl = strchr(line, '\n')); line = nl + 1) {
+		elems = netlink_replica_elems(line);
+
+		/* elements of the same set in a row go into one command */
+		if (elems && prefix && elems - line == prefix_len &&
+		    !strncmp(line, prefix, prefix_len)) {
+			nft_mon_print(monh, ", %.*s",
+				      (int)(nl - elems - strlen(" {  }")),
+				      elems + strlen(" { "));
+			continue;
+		}
+		if (prefix)
+			nft_mon_print(monh, " }");
+
+		skip = netlink_replica_verb(monh, sep, line);
+		if (elems) {
+			/* the closing brace waits for further elements */
+			nft_mon_print(monh, "%.*s",
+				      (int)(nl - line - skip - strlen(" }")),
+				      line + skip);
+			prefix = line;
+			prefix_len = elems - line;
+		} else {
+			nft_mon_print(monh, "%.*s", (int)(nl - line - skip),
+				      line + skip);
+			prefix = NULL;
+		}
+		sep = "; ";
+	}
+	if (prefix)
+		nft_mon_print(monh, " }");
+
+	nft_mon_print(monh, " # generation %u\n", genid);
+out:
+	netlink_replica_reset(r);
+}
+
+static int netlink_events_replica_cb(const struct nlmsghdr *nlh,
+				     struct netlink_mon_handler *monh)
+{
+	struct output_ctx *octx = &monh->ctx->nft->output;
+	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+	struct netlink_replica *r = &monh->replica;
+	FILE *fp;
+	int ret;
+
+	if (type == NFT_MSG_NEWGEN) {
+		netlink_replica_commit(monh, netlink_events_genid(nlh));
+		return MNL_CB_OK;
+	}
+
+	if (NFT_REPLICA_RELOAD_EVENTS & (1U << type))
+		r->reload = true;
+
+	if (!r->fp) {
+		r->fp = open_memstream(&r->buf, &r->len);
+		if (!r->fp)
+			memory_allocation_error();
+	}
+
+	/* the commands are joined when the transaction is complete */
+	fp = octx->output_fp;
+	octx->output_fp = r->fp;
+	ret = __netlink_events_cb(nlh, monh);
+	octx->output_fp = fp;
+
+	return ret;
+}
+
+static struct nft_journal *
+cache_events_journal(const struct cache_events_ctx *cctx)
+{
+	struct nft_journal *journal = cctx->monh.ctx->nft->journal;
+
+	return journal && journal->valid ? journal : NULL;
+}
+
+static bool cache_event_journal_set(const struct cache_events_ctx *cctx,
+				    const struct nlmsghdr *nlh)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const char *table = NULL, *setname = NULL;
+	const struct nlattr *attr;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+			continue;
+
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_SET_ELEM_LIST_TABLE:
+			table = mnl_attr_get_str(attr);
+			break;
+		case NFTA_SET_ELEM_LIST_SET:
+			setname = mnl_attr_get_str(attr);
+			break;
+		}
+	}
+
+	return table && setname &&
+	       set_lookup_global(nfg->nfgen_family, table, setname,
+				 cctx->monh.cache);
+}
+
+/*
+ * The journal keeps each transaction as monitor replicate prints it, see
+ * netlink_events_replica_cb(). Elements of a set that the cache does not
+ * hold cannot be printed, the transaction asks for a reload then.
+ */
+static void cache_event_journal(struct cache_events_ctx *cctx,
+				const struct nlmsghdr *nlh)
+{
+	struct netlink_mon_handler *monh = &cctx->monh;
+	struct output_ctx *octx = &monh->ctx->nft->output;
+	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+	struct netlink_replica *r = &monh->replica;
+	FILE *fp;
+
+	if (!cache_events_journal(cctx) || r->reload || type >= 32)
+		return;
+
+	if (NFT_REPLICA_RELOAD_EVENTS & (1U << type)) {
+		r->reload = true;
+		return;
+	}
+
+	switch (type) {
+	case NFT_MSG_NEWSETELEM:
+	case NFT_MSG_DELSETELEM:
+		if (!cache_event_journal_set(cctx, nlh)) {
+			r->reload = true;
+			return;
+		}
+		break;
+	case NFT_MSG_NEWSET:
+	case NFT_MSG_DELSET:
+	case NFT_MSG_NEWOBJ:
+	case NFT_MSG_DELOBJ:
+		break;
+	default:
+		return;
+	}
+
+	if (!r->fp) {
+		r->fp = open_memstream(&r->buf, &r->len);
+		if (!r->fp)
+			memory_allocation_error();
+	}
+
+	fp = octx->output_fp;
+	octx->output_fp = r->fp;
+	if (netlink_events_print(nlh, type, monh) != MNL_CB_OK)
+		r->reload = true;
+	octx->output_fp = fp;
+}
+
+static void cache_events_journal_commit(struct cache_events_ctx *cctx,
+					const struct nlmsghdr *nlh)
+{
+	struct output_ctx *octx = &cctx->monh.ctx->nft->output;
+	struct nft_journal *journal = cache_events_journal(cctx);
+	struct netlink_replica *r = &cctx->monh.replica;
+	bool reload = r->reload;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (!journal) {
+		netlink_replica_reset(r);
+		return;
+	}
+
+	fp = octx->output_fp;
+	octx->output_fp = open_memstream(&buf, &len);
+	if (!octx->output_fp)
+		memory_allocation_error();
+	netlink_replica_commit(&cctx->monh, netlink_events_genid(nlh));
+	fclose(octx->output_fp);
+	octx->output_fp = fp;
+
+	nft_journal_add(journal, netlink_events_genid(nlh), buf, reload);
+}
+
+static int netlink_events_dispatch(const struct nlmsghdr *nlh,
+				   struct netlink_mon_handler *monh)
+{
+	if (monh->replicate)
+		return netlink_events_replica_cb(nlh, monh);
+
+	return __netlink_events_cb(nlh, monh);
+}
+
+/*
+ * After a resync, hold back the events of each transaction until its
+ * NEWGEN message tells whether the dump already covers it.
+ */
+static int netlink_events_resync_cb(const struct nlmsghdr *nlh,
+				    struct netlink_mon_handler *monh)
+{
+	struct cache_event *ev, *next;
+	int ret = MNL_CB_OK;
+	struct nfgenmsg *nfh;
+	bool covered;
+
+	if (NFNL_MSG_TYPE(nlh->nlmsg_type) != NFT_MSG_NEWGEN) {
+		ev = xmalloc(sizeof(*ev) + nlh->nlmsg_len);
+		memcpy(ev->buf, nlh, nlh->nlmsg_len);
+		list_add_tail(&ev->list, &monh->resync_events);
+		return MNL_CB_OK;
+	}
+
+	nfh = mnl_nlmsg_get_payload(nlh);
+	covered = (int16_t)(ntohs(nfh->res_id) - monh->resync_genid) <= 0;
+	if (!covered)
+		monh->resync = false;
+
+	list_for_each_entry_safe(ev, next, &monh->resync_events, list) {
+		if (!covered && ret > 0)
+			ret = netlink_events_dispatch((struct nlmsghdr *)ev->buf,
+						      monh);
+		list_del(&ev->list);
+		free(ev);
+	}
+
+	if (covered || ret <= 0)
+		return ret;
+
+	return netlink_events_dispatch(nlh, monh);
+}
+
+/* Event types that are printed or keep the cache consistent for them. */
+static uint32_t netlink_events_mask(uint32_t flags)
+{
+	uint32_t mask = flags;
+
+	mask |= (1 << NFT_MSG_NEWTABLE) | (1 << NFT_MSG_DELTABLE) |
+		(1 << NFT_MSG_NEWSET) |
+		(1 << NFT_MSG_NEWOBJ) | (1 << NFT_MSG_DELOBJ);
+
+	/* rules refer to anonymous sets, traces are printed with their rule */
+	if (flags & ((1 << NFT_MSG_NEWRULE) | (1 << NFT_MSG_DELRULE) |
+		     (1 << NFT_MSG_TRACE)))
+		mask |= (1 << NFT_MSG_NEWSETELEM) | (1 << NFT_MSG_DELSETELEM) |
+			(1 << NFT_MSG_DELRULE);
+	if (flags & (1 << NFT_MSG_TRACE))
+		mask |= (1 << NFT_MSG_NEWCHAIN) | (1 << NFT_MSG_DELCHAIN) |
+			(1 << NFT_MSG_NEWRULE);
+
+	return mask;
+}
+
+/*
+ * Drop events on the raw message, before any object is allocated for them:
+ * types that are neither printed nor needed by the cache and, if a table
+ * was given, objects and traces of other tables.
+ */
+static bool netlink_events_wanted(const struct nlmsghdr *nlh,
+				  const struct netlink_mon_handler *monh)
+{
+	uint16_t type = NFNL_MSG_TYPE(nlh->nlmsg_type);
+	const struct nfgenmsg *nfg;
+	const struct nlattr *attr;
+	uint32_t mask;
+
+	/* generations are needed to resynchronize the cache */
+	if (type == NFT_MSG_NEWGEN)
+		return true;
+
+	mask = netlink_events_mask(monh->monitor_flags);
+	if (monh->replicate)
+		mask |= NFT_REPLICA_RELOAD_EVENTS;
+
+	if (type >= 32 || !(mask & (1U << type)))
+		return false;
+
+	if (!monh->filter_table)
+		return true;
+
+	nfg = mnl_nlmsg_get_payload(nlh);
+	if (monh->filter_family != NFPROTO_UNSPEC &&
+	    nfg->nfgen_family != monh->filter_family)
+		return false;
+
+	/* the table name is the first attribute of all objects and traces */
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		if (mnl_attr_get_type(attr) != NFTA_TABLE_NAME)
+			continue;
+
+		return mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0 &&
+		       !strcmp(mnl_attr_get_str(attr), monh->filter_table);
+	}
+
+	return false;
+}
+
+static int netlink_events_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct netlink_mon_handler *monh = (struct netlink_mon_handler *)data;
+	int ret;
+
+	if (!netlink_events_wanted(nlh, monh))
+		return MNL_CB_OK;
+
+	/* traces are not part of transactions */
+	if (monh->resync && NFNL_MSG_TYPE(nlh->nlmsg_type) != NFT_MSG_TRACE)
+		ret = netlink_events_resync_cb(nlh, monh);
+	else
+		ret = netlink_events_dispatch(nlh, monh);
+
+	/* events are read as they happen */
+	nft_print_flush(&monh->ctx->nft->output);
+
+	return ret;
+}
+
+/*
+ * Events were lost, the cache is stale. Dump it again through a separate
+ * socket, the event socket is busy, and skip the events of those
+ * transactions that the new dump already reflects.
+ */
+static int netlink_events_lost_cb(void *data)
+{
+	struct netlink_mon_handler *monh = data;
+	struct nft_ctx *nft = monh->ctx->nft;
+	unsigned int flags = nft->cache->flags;
+	struct cache_event *ev, *next;
+	struct mnl_socket *nf_sock;
+	int ret;
+
+	if (!monh->resync)
+		init_list_head(&monh->resync_events);
+
+	/* the replica misses the lost transactions anyway */
+	if (monh->replicate)
+		netlink_replica_reset(&monh->replica);
+
+	list_for_each_entry_safe(ev, next, &monh->resync_events, list) {
+		list_del(&ev->list);
+		free(ev);
+	}
+
+	nf_sock = nft->nf_sock;
+	nft->nf_sock = nft_mnl_socket_open();
+
+	nft_cache_release(nft->cache);
+	ret = nft_cache_update(nft, flags, monh->ctx->msgs, NULL);
+
+	mnl_socket_close(nft->nf_sock);
+	nft->nf_sock = nf_sock;
+
+	if (ret < 0)
+		return -1;
+
+	monh->resync = true;
+	monh->resync_genid = nft->cache->genid;
+	nft_print(&nft->output,
+		  "# Ruleset cache resynchronized at generation %u%s\n",
+		  nft->cache->genid, monh->replicate ? ", reload" : "");
+
+	return 0;
+}
+
+/* Record the handle of the new object, nothing else of the echoed message is
+ * parsed. The sequence number is stored in place of the command position
+ * until nft_netlink() resolves it.
+ */
+static int netlink_echo_handle_cb(const struct nlmsghdr *nlh,
+				  struct nft_ctx *nft)
+{
+	struct nft_echo_handle *echo;
+	enum nft_echo_type type;
+	struct nlattr *attr;
+	uint16_t attr_type;
+
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case NFT_MSG_NEWTABLE:
+		type = NFT_ECHO_TABLE;
+		attr_type = NFTA_TABLE_HANDLE;
+		break;
+	case NFT_MSG_NEWCHAIN:
+		type = NFT_ECHO_CHAIN;
+		attr_type = NFTA_CHAIN_HANDLE;
+		break;
+	case NFT_MSG_NEWRULE:
+		type = NFT_ECHO_RULE;
+		attr_type = NFTA_RULE_HANDLE;
+		break;
+	case NFT_MSG_NEWSET:
+		type = NFT_ECHO_SET;
+		attr_type = NFTA_SET_HANDLE;
+		break;
+	case NFT_MSG_NEWOBJ:
+		type = NFT_ECHO_OBJ;
+		attr_type = NFTA_OBJ_HANDLE;
+		break;
+	case NFT_MSG_NEWFLOWTABLE:
+		type = NFT_ECHO_FLOWTABLE;
+		attr_type = NFTA_FLOWTABLE_HANDLE;
+		break;
+	default:
+		return MNL_CB_OK;
+	}
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		if (mnl_attr_get_type(attr) != attr_type ||
+		    mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+			continue;
+
+		if (nft->echo.num == nft->echo.size) {
+			nft->echo.size = nft->echo.size ? nft->echo.size * 2 : 16;
+			nft->echo.handles = xrealloc(nft->echo.handles,
+						     nft->echo.size *
+						     sizeof(*nft->echo.handles));
+		}
+		echo = &nft->echo.handles[nft->echo.num++];
+		echo->cmd = nlh->nlmsg_seq;
+		echo->type = type;
+		echo->handle = be64toh(mnl_attr_get_u64(attr));
+		break;
+	}
+
+	return MNL_CB_OK;
+}
+
 int netlink_echo_callback(const struct nlmsghdr *nlh, void *data)
 {
 	struct netlink_cb_data *nl_cb_data = data;
@@ -983,6 +2046,8 @@ int netlink_echo_callback(const struct nlmsghdr *nlh, void *data)
 		.monitor_flags = 0xffffffff,
 	};
 
+	if (nft_output_echo_handles(&nft->output))
+		return netlink_echo_handle_cb(nlh, nft);
 	if (!nft_output_echo(&echo_monh.ctx->nft->output))
 		return MNL_CB_OK;
 
@@ -997,10 +2062,25 @@ int netlink_echo_callback(const struct nlmsghdr *nlh, void *data)
 	return netlink_events_cb(nlh, &echo_monh);
 }
 
+static int netlink_events_tick_cb(void *data)
+{
+	struct netlink_mon_handler *monh = data;
+
+	if (monh->elem_aggr)
+		return netlink_elem_aggr_flush(monh);
+
+	return netlink_trace_aggr_flush(monh);
+}
+
 int netlink_monitor(struct netlink_mon_handler *monhandler,
 		    struct mnl_socket *nf_sock)
 {
-	int group;
+	struct mnl_event_ops ops = {
+		.event	= netlink_events_cb,
+		.lost	= netlink_events_lost_cb,
+	};
+	struct cache_event *ev, *next;
+	int group, ret;
 
 	if (monhandler->monitor_flags & (1 << NFT_MSG_TRACE)) {
 		group = NFNLGRP_NFTRACE;
@@ -1015,7 +2095,35 @@ int netlink_monitor(struct netlink_mon_handler *monhandler,
 			return -1;
 	}
 
-	return mnl_nft_event_listener(nf_sock, monhandler->ctx->nft->debug_mask,
-				      &monhandler->ctx->nft->output,
-				      netlink_events_cb, monhandler);
+	if (monhandler->trace_aggr) {
+		ops.tick = netlink_events_tick_cb;
+		ops.interval = monhandler->trace_aggr->interval;
+	} else if (monhandler->elem_aggr) {
+		ops.tick = netlink_events_tick_cb;
+		ops.interval = monhandler->elem_aggr->interval;
+	}
+
+	if (monhandler->replicate) {
+		nft_print(&monhandler->ctx->nft->output,
+			  "# replicating from generation %u\n",
+			  monhandler->ctx->nft->cache->genid);
+		nft_print_flush(&monhandler->ctx->nft->output);
+	}
+
+	ret = mnl_nft_event_listener(nf_sock, monhandler->ctx->nft->debug_mask,
+				     &monhandler->ctx->nft->output, &ops,
+				     monhandler);
+
+	if (monhandler->resync) {
+		list_for_each_entry_safe(ev, next, &monhandler->resync_events,
+					 list) {
+			list_del(&ev->list);
+			free(ev);
+		}
+	}
+
+	if (monhandler->replicate)
+		netlink_replica_reset(&monhandler->replica);
+
+	return ret;
 }
@@ -12,10 +12,12 @@
 #include <nft.h>
 
 #include <errno.h>
+#include <endian.h>
 #include <libmnl/libmnl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <inttypes.h>
+#include <search.h>
 
 #include <libnftnl/table.h>
 #include <libnftnl/trace.h>
@@ -42,6 +44,9 @@
 #include <utils.h>
 #include <erec.h>
 #include <iface.h>
+#include <json.h>
+#include <fingerprint.h>
+#include <intervals.h>
 
 #define nft_mon_print(monh, ...) nft_print(&monh->ctx->nft->output, __VA_ARGS__)
 
@@ -242,6 +247,295 @@ struct nftnl_set_elem *alloc_nftnl_setelem(const struct expr *set,
 	return nlse;
 }
 
+static void netlink_put_data(struct nlmsghdr *nlh, uint16_t type,
+			     const struct nft_data_linearize *nld)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, type);
+	mnl_attr_put(nlh, NFTA_DATA_VALUE, nld->len, nld->value);
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static const struct expr *concat_field_value(const struct expr *i)
+{
+	switch (i->etype) {
+	case EXPR_RANGE:
+		return i->left;
+	case EXPR_PREFIX:
+		return i->prefix;
+	default:
+		return i;
+	}
+}
+
+/* The layout is taken from the first element of a set with concatenated
+ * ranges. Elements that do not match it are generated the slow way.
+ */
+bool netlink_concat_layout_init(struct netlink_concat_layout *layout,
+				const struct expr *set)
+{
+	const struct expr *elem, *key, *i, *value;
+
+	if (!(set->set_flags & NFT_SET_INTERVAL))
+		return false;
+
+	list_for_each_entry(elem, &set->expressions, list) {
+		if (elem->etype == EXPR_MAPPING)
+			elem = elem->left;
+		if (elem->etype != EXPR_SET_ELEM)
+			return false;
+		if (elem->key->etype == EXPR_SET_ELEM_CATCHALL)
+			continue;
+
+		key = elem->key;
+		if (key->etype != EXPR_CONCAT || key->field_count <= 1)
+			return false;
+
+		memset(layout, 0, sizeof(*layout));
+		list_for_each_entry(i, &key->expressions, list) {
+			if (layout->count == NFT_REG32_COUNT)
+				return false;
+
+			value = concat_field_value(i);
+			layout->field[layout->count].len =
+				div_round_up(i->len, BITS_PER_BYTE);
+			layout->field[layout->count].padded =
+				netlink_padded_len(i->len) / BITS_PER_BYTE;
+			layout->field[layout->count].byteorder =
+				value->byteorder;
+			/* ranges on integers are compared in network byte order */
+			if (expr_basetype(value)->type == TYPE_INTEGER &&
+			    value->byteorder == BYTEORDER_HOST_ENDIAN)
+				layout->field[layout->count].key_byteorder =
+					BYTEORDER_BIG_ENDIAN;
+			else
+				layout->field[layout->count].key_byteorder =
+					value->byteorder;
+
+			layout->len += layout->field[layout->count].padded;
+			layout->count++;
+		}
+
+		return layout->len <= NFT_MAX_EXPR_LEN_BYTES;
+	}
+
+	return false;
+}
+
+/* Set the host bits of a prefix in the end key, the key is big endian. */
+static void concat_prefix_end(unsigned char *data, unsigned int len,
+			      unsigned int host_bits)
+{
+	unsigned int i;
+
+	for (i = len; i > 0 && host_bits >= BITS_PER_BYTE; i--) {
+		data[i - 1] = 0xff;
+		host_bits -= BITS_PER_BYTE;
+	}
+	if (i > 0 && host_bits)
+		data[i - 1] |= (1 << host_bits) - 1;
+}
+
+/* Pack the start and end keys of an element with concatenated ranges, in a
+ * single pass over the fields. Returns false if the element does not match
+ * the layout, it must then go through netlink_gen_key().
+ */
+static bool netlink_gen_concat_range(const struct netlink_concat_layout *layout,
+				     const struct expr *key,
+				     struct nft_data_linearize *start,
+				     struct nft_data_linearize *end)
+{
+	unsigned char *s = (unsigned char *)start->value;
+	unsigned char *e = (unsigned char *)end->value;
+	unsigned int n = 0, offset = 0, len;
+	const struct expr *i;
+
+	if (key->etype != EXPR_CONCAT)
+		return false;
+
+	memset(s, 0, layout->len);
+	memset(e, 0, layout->len);
+
+	list_for_each_entry(i, &key->expressions, list) {
+		if (n == layout->count ||
+		    concat_field_value(i)->byteorder != layout->field[n].byteorder ||
+		    div_round_up(i->len, BITS_PER_BYTE) != layout->field[n].len)
+			return false;
+
+		len = layout->field[n].len;
+		switch (i->etype) {
+		case EXPR_VALUE:
+			mpz_export_data(s + offset, i->value,
+					layout->field[n].key_byteorder, len);
+			memcpy(e + offset, s + offset, len);
+			break;
+		case EXPR_RANGE:
+			mpz_export_data(s + offset, i->left->value,
+					layout->field[n].key_byteorder, len);
+			mpz_export_data(e + offset, i->right->value,
+					layout->field[n].key_byteorder, len);
+			break;
+		case EXPR_PREFIX:
+			if (i->byteorder != BYTEORDER_BIG_ENDIAN ||
+			    i->len % BITS_PER_BYTE)
+				return false;
+
+			mpz_export_data(s + offset, i->prefix->value,
+					BYTEORDER_BIG_ENDIAN, len);
+			memcpy(e + offset, s + offset, len);
+			concat_prefix_end(e + offset, len,
+					  i->len - i->prefix_len);
+			break;
+		default:
+			return false;
+		}
+
+		offset += layout->field[n].padded;
+		n++;
+	}
+
+	if (n != layout->count)
+		return false;
+
+	start->len = end->len = layout->len;
+	return true;
+}
+
+/*
+ * Serialize the set element straight into the netlink message, this skips
+ * the intermediate nftnl_set_elem object that alloc_nftnl_setelem() provides.
+ * Attributes are placed in the same order as in libnftnl. Elements with
+ * stateful expressions are not supported, returns false in such case.
+ */
+bool netlink_gen_setelem(struct nlmsghdr *nlh, const struct expr *set,
+			 const struct expr *expr,
+			 const struct netlink_concat_layout *layout)
+{
+	const struct expr *elem, *data = NULL;
+	struct nft_data_linearize nld, nld_end;
+	struct nlattr *nest1, *nest2;
+	uint32_t flags = 0;
+	struct expr *key;
+
+	if (expr->etype == EXPR_MAPPING) {
+		elem = expr->left;
+		if (!(expr->flags & EXPR_F_INTERVAL_END))
+			data = expr->right;
+	} else {
+		elem = expr;
+	}
+	if (elem->etype != EXPR_SET_ELEM)
+		BUG("Unexpected expression type: got %d\n", elem->etype);
+
+	if (!list_empty(&elem->stmt_list))
+		return false;
+
+	key = elem->key;
+
+	if (expr->flags & EXPR_F_INTERVAL_END)
+		flags |= NFT_SET_ELEM_INTERVAL_END;
+	if (key->etype == EXPR_SET_ELEM_CATCHALL)
+		flags |= NFT_SET_ELEM_CATCHALL;
+
+	if (flags)
+		mnl_attr_put_u32(nlh, NFTA_SET_ELEM_FLAGS, htonl(flags));
+
+	if (elem->timeout) {
+		uint64_t timeout = elem->timeout;
+
+		if (elem->timeout == NFT_NEVER_TIMEOUT)
+			timeout = 0;
+
+		mnl_attr_put_u64(nlh, NFTA_SET_ELEM_TIMEOUT, htobe64(timeout));
+	}
+	if (elem->expiration)
+		mnl_attr_put_u64(nlh, NFTA_SET_ELEM_EXPIRATION,
+				 htobe64(elem->expiration));
+
+	if (key->etype != EXPR_SET_ELEM_CATCHALL) {
+		if (layout && netlink_gen_concat_range(layout, key, &nld,
+						       &nld_end)) {
+			netlink_put_data(nlh, NFTA_SET_ELEM_KEY, &nld);
+			netlink_put_data(nlh, NFTA_SET_ELEM_KEY_END, &nld_end);
+		} else if (set->set_flags & NFT_SET_INTERVAL &&
+			   key->etype == EXPR_CONCAT && key->field_count > 1) {
+			key->flags |= EXPR_F_INTERVAL;
+			netlink_gen_key(key, &nld);
+			key->flags &= ~EXPR_F_INTERVAL;
+			netlink_put_data(nlh, NFTA_SET_ELEM_KEY, &nld);
+
+			key->flags |= EXPR_F_INTERVAL_END;
+			netlink_gen_key(key, &nld);
+			key->flags &= ~EXPR_F_INTERVAL_END;
+			netlink_put_data(nlh, NFTA_SET_ELEM_KEY_END, &nld);
+		} else {
+			netlink_gen_key(key, &nld);
+			netlink_put_data(nlh, NFTA_SET_ELEM_KEY, &nld);
+		}
+	}
+
+	if (set_is_datamap(set->set_flags) && data != NULL) {
+		__netlink_gen_data(data, &nld, !(data->flags & EXPR_F_SINGLETON));
+		switch (data->etype) {
+		case EXPR_VERDICT:
+			nest1 = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_DATA);
+			nest2 = mnl_attr_nest_start(nlh, NFTA_DATA_VERDICT);
+			mnl_attr_put_u32(nlh, NFTA_VERDICT_CODE,
+					 htonl(data->verdict));
+			if (data->chain != NULL)
+				mnl_attr_put_strz(nlh, NFTA_VERDICT_CHAIN,
+						  nld.chain);
+			mnl_attr_nest_end(nlh, nest2);
+			mnl_attr_nest_end(nlh, nest1);
+			break;
+		case EXPR_CONCAT:
+			assert(nld.len > 0);
+			/* fallthrough */
+		case EXPR_VALUE:
+		case EXPR_RANGE:
+		case EXPR_PREFIX:
+			netlink_put_data(nlh, NFTA_SET_ELEM_DATA, &nld);
+			break;
+		default:
+			BUG("unexpected set element expression\n");
+			break;
+		}
+	}
+
+	if (elem->comment || expr->elem_flags) {
+		struct nftnl_udata_buf *udbuf;
+
+		udbuf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+		if (!udbuf)
+			memory_allocation_error();
+		if (elem->comment &&
+		    !nftnl_udata_put_strz(udbuf, NFTNL_UDATA_SET_ELEM_COMMENT,
+					  elem->comment))
+			memory_allocation_error();
+		if (expr->elem_flags &&
+		    !nftnl_udata_put_u32(udbuf, NFTNL_UDATA_SET_ELEM_FLAGS,
+					 expr->elem_flags))
+			memory_allocation_error();
+
+		mnl_attr_put(nlh, NFTA_SET_ELEM_USERDATA,
+			     nftnl_udata_buf_len(udbuf),
+			     nftnl_udata_buf_data(udbuf));
+		nftnl_udata_buf_free(udbuf);
+	}
+
+	if (set_is_objmap(set->set_flags) && data != NULL) {
+		char objref[NFT_OBJ_MAXNAMELEN] = {};
+
+		netlink_gen_data(data, &nld);
+		memcpy(objref, nld.value,
+		       min(nld.len, (uint32_t)sizeof(objref) - 1));
+		mnl_attr_put_strz(nlh, NFTA_SET_ELEM_OBJREF, objref);
+	}
+
+	return true;
+}
+
 void netlink_gen_raw_data(const mpz_t value, enum byteorder byteorder,
 			  unsigned int len, struct nft_data_linearize *data)
 {
@@ -730,6 +1024,10 @@ static int table_parse_udata_cb(const struct nftnl_udata *attr, void *data)
 			if (value[len - 1] != '\0')
 				return -1;
 			break;
+		case NFT_UDATA_TABLE_FINGERPRINT:
+			if (len != sizeof(uint64_t))
+				return -1;
+			break;
 		default:
 			return 0;
 	}
@@ -740,8 +1038,9 @@ static int table_parse_udata_cb(const struct nftnl_udata *attr, void *data)
 struct table *netlink_delinearize_table(struct netlink_ctx *ctx,
 					const struct nftnl_table *nlt)
 {
-	const struct nftnl_udata *ud[NFTNL_UDATA_TABLE_MAX + 1] = {};
+	const struct nftnl_udata *ud[NFT_UDATA_TABLE_FINGERPRINT + 1] = {};
 	struct table *table;
+	uint64_t fingerprint;
 	const char *udata;
 	uint32_t ulen;
 
@@ -761,6 +1060,12 @@ struct table *netlink_delinearize_table(struct netlink_ctx *ctx,
 		}
 		if (ud[NFTNL_UDATA_TABLE_COMMENT])
 			table->comment = xstrdup(nftnl_udata_get(ud[NFTNL_UDATA_TABLE_COMMENT]));
+		if (ud[NFT_UDATA_TABLE_FINGERPRINT]) {
+			memcpy(&fingerprint,
+			       nftnl_udata_get(ud[NFT_UDATA_TABLE_FINGERPRINT]),
+			       sizeof(fingerprint));
+			table->fingerprint = be64toh(fingerprint);
+		}
 	}
 
 	return table;
@@ -864,6 +1169,8 @@ static int set_parse_udata_cb(const struct nftnl_udata *attr, void *data)
 		if (value[len - 1] != '\0')
 			return -1;
 		break;
+	case NFT_UDATA_SET_MAGLEV:
+		break;
 	default:
 		return 0;
 	}
@@ -871,6 +1178,83 @@ static int set_parse_udata_cb(const struct nftnl_udata *attr, void *data)
 	return 0;
 }
 
+struct set_maglev_parse_ctx {
+	struct set	*set;
+	struct expr	*backends;
+	struct expr	*last;
+	uint32_t	size;
+};
+
+static int set_maglev_parse_udata(const struct nftnl_udata *attr, void *data)
+{
+	struct set_maglev_parse_ctx *m = data;
+	uint8_t len = nftnl_udata_len(attr);
+	struct nft_data_delinearize nld;
+	struct expr *value, *weight;
+	uint32_t w;
+
+	switch (nftnl_udata_type(attr)) {
+	case NFT_UDATA_SET_MAGLEV_SIZE:
+		if (len != sizeof(uint32_t))
+			return -1;
+		m->size = nftnl_udata_get_u32(attr);
+		break;
+	case NFT_UDATA_SET_MAGLEV_BACKEND:
+		if (len != div_round_up(m->set->data->len, BITS_PER_BYTE))
+			return -1;
+		nld.value = nftnl_udata_get(attr);
+		nld.len = len;
+		value = netlink_alloc_value(&netlink_location, &nld);
+		datatype_set(value, m->set->data->dtype);
+		value->byteorder = m->set->data->byteorder;
+		if (value->byteorder == BYTEORDER_HOST_ENDIAN)
+			mpz_switch_byteorder(value->value, len);
+
+		m->last = set_elem_expr_alloc(&netlink_location, value);
+		compound_expr_add(m->backends, m->last);
+		break;
+	case NFT_UDATA_SET_MAGLEV_WEIGHT:
+		if (len != sizeof(uint32_t) || !m->last)
+			return -1;
+		w = nftnl_udata_get_u32(attr);
+		weight = constant_expr_alloc(&netlink_location, &integer_type,
+					     BYTEORDER_HOST_ENDIAN,
+					     sizeof(w) * BITS_PER_BYTE, &w);
+		compound_expr_remove(m->backends, m->last);
+		compound_expr_add(m->backends,
+				  mapping_expr_alloc(&netlink_location,
+						     m->last, weight));
+		m->last = NULL;
+		break;
+	}
+	return 0;
+}
+
+/* A maglev declaration that cannot be parsed is ignored, the elements are
+ * listed instead.
+ */
+static void set_make_maglev(struct set *set, const struct nftnl_udata *attr)
+{
+	struct set_maglev_parse_ctx m = {
+		.set	= set,
+	};
+
+	if (!set->data || set->data->dtype->type == TYPE_VERDICT)
+		return;
+
+	m.backends = set_expr_alloc(&netlink_location, NULL);
+	datatype_set(m.backends, set->data->dtype);
+	if (nftnl_udata_parse(nftnl_udata_get(attr), nftnl_udata_len(attr),
+			      set_maglev_parse_udata, &m) < 0 ||
+	    !m.size || !m.backends->size) {
+		expr_free(m.backends);
+		return;
+	}
+
+	set->maglev.size = m.size;
+	set->maglev.backends = m.backends;
+}
+
 static int set_key_parse_udata(const struct nftnl_udata *attr, void *data)
 {
 	const struct nftnl_udata **tb = data;
@@ -953,7 +1337,7 @@ static int set_elem_parse_expressions(struct nftnl_expr *e, void *data)
 struct set *netlink_delinearize_set(struct netlink_ctx *ctx,
 				    const struct nftnl_set *nls)
 {
-	const struct nftnl_udata *ud[NFTNL_UDATA_SET_MAX + 1] = {};
+	const struct nftnl_udata *ud[NFT_UDATA_SET_MAGLEV + 1] = {};
 	enum byteorder keybyteorder = BYTEORDER_INVALID;
 	enum byteorder databyteorder = BYTEORDER_INVALID;
 	struct setelem_parse_ctx set_parse_ctx;
@@ -1039,10 +1423,10 @@ struct set *netlink_delinearize_set(struct netlink_ctx *ctx,
 		struct stmt *stmt;
 
 		nle = nftnl_set_get(nls, NFTNL_SET_EXPR);
-		stmt = netlink_parse_set_expr(set, &ctx->nft->cache, nle);
+		stmt = netlink_parse_set_expr(set, ctx->nft->cache, nle);
 		list_add_tail(&stmt->list, &set_parse_ctx.stmt_list);
 	} else if (nftnl_set_is_set(nls, NFTNL_SET_EXPRESSIONS)) {
-		set_parse_ctx.cache = &ctx->nft->cache;
+		set_parse_ctx.cache = ctx->nft->cache;
 		set_parse_ctx.set = set;
 		nftnl_set_expr_foreach(nls, set_elem_parse_expressions,
 				       &set_parse_ctx);
@@ -1122,6 +1506,9 @@ struct set *netlink_delinearize_set(struct netlink_ctx *ctx,
 		}
 	}
 
+	if (ud[NFT_UDATA_SET_MAGLEV])
+		set_make_maglev(set, ud[NFT_UDATA_SET_MAGLEV]);
+
 out:
 	expr_free(typeof_expr_data);
 	expr_free(typeof_expr_key);
@@ -1358,14 +1745,11 @@ static int set_elem_parse_udata_cb(const struct nftnl_udata *attr, void *data)
 	return 0;
 }
 
-static void set_elem_parse_udata(struct nftnl_set_elem *nlse,
+static void set_elem_parse_udata(const void *data, uint32_t len,
 				 struct expr *expr)
 {
 	const struct nftnl_udata *ud[NFTNL_UDATA_SET_ELEM_MAX + 1] = {};
-	const void *data;
-	uint32_t len;
 
-	data = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_USERDATA, &len);
 	if (nftnl_udata_parse(data, len, set_elem_parse_udata_cb, ud))
 		return;
 
@@ -1377,8 +1761,208 @@ static void set_elem_parse_udata(struct nftnl_set_elem *nlse,
 			nftnl_udata_get_u32(ud[NFTNL_UDATA_SET_ELEM_FLAGS]);
 }
 
-int netlink_delinearize_setelem(struct nftnl_set_elem *nlse,
-				struct set *set, struct nft_cache *cache)
+/*
+ * Map elements often share a handful of distinct data values, such as
+ * verdicts in a verdict map. Cached elements reuse one reference counted
+ * expression per distinct value, up to SETELEM_DATA_MAX of them, instead
+ * of allocating an expression for each element.
+ */
+#define SETELEM_DATA_HSIZE	64
+#define SETELEM_DATA_MAX	256
+
+struct setelem_data {
+	struct setelem_data	*next;
+	struct expr		*expr;
+	int			verdict;
+	char			*chain;
+	uint32_t		len;
+	unsigned char		value[];
+};
+
+struct setelem_data_index {
+	struct setelem_data	*table[SETELEM_DATA_HSIZE];
+	unsigned int		count;
+};
+
+static uint32_t setelem_data_hash(const struct nft_data_delinearize *nld)
+{
+	const unsigned char *value = (const unsigned char *)nld->value;
+	uint32_t hash = 5381 + nld->verdict;
+	uint32_t i;
+
+	for (i = 0; i < nld->len; i++)
+		hash = ((hash << 5) + hash) + value[i];
+	if (nld->chain)
+		hash ^= djb_hash(nld->chain);
+
+	return hash % SETELEM_DATA_HSIZE;
+}
+
+static bool setelem_data_cmp(const struct setelem_data *data,
+			     const struct nft_data_delinearize *nld)
+{
+	if (nld->chain || data->chain)
+		return nld->chain && data->chain &&
+		       data->verdict == nld->verdict &&
+		       !strcmp(data->chain, nld->chain);
+
+	if (data->len != nld->len)
+		return false;
+	if (!nld->len)
+		return data->verdict == nld->verdict;
+
+	return !memcmp(data->value, nld->value, nld->len);
+}
+
+static bool setelem_data_shareable(const struct set *set)
+{
+	return set_is_datamap(set->flags) &&
+	       !set->data->dtype->subtypes &&
+	       !(set->data->flags & EXPR_F_INTERVAL);
+}
+
+static struct expr *setelem_data_lookup(const struct set *set,
+					const struct nft_data_delinearize *nld)
+{
+	struct setelem_data *data;
+
+	if (!set->data_index)
+		return NULL;
+
+	for (data = set->data_index->table[setelem_data_hash(nld)];
+	     data; data = data->next) {
+		if (setelem_data_cmp(data, nld))
+			return expr_get(data->expr);
+	}
+
+	return NULL;
+}
+
+static void setelem_data_add(struct set *set,
+			     const struct nft_data_delinearize *nld,
+			     struct expr *expr)
+{
+	struct setelem_data_index *index = set->data_index;
+	struct setelem_data *data;
+	uint32_t hash;
+
+	if (!index)
+		index = set->data_index = xzalloc(sizeof(*index));
+	if (index->count >= SETELEM_DATA_MAX)
+		return;
+
+	data = xzalloc(sizeof(*data) + nld->len);
+	data->expr = expr_get(expr);
+	data->verdict = nld->verdict;
+	if (nld->chain)
+		data->chain = xstrdup(nld->chain);
+	data->len = nld->len;
+	if (nld->len)
+		memcpy(data->value, nld->value, nld->len);
+
+	hash = setelem_data_hash(nld);
+	data->next = index->table[hash];
+	index->table[hash] = data;
+	index->count++;
+}
+
+void setelem_data_index_free(struct setelem_data_index *index)
+{
+	struct setelem_data *data, *next;
+	unsigned int i;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < SETELEM_DATA_HSIZE; i++) {
+		for (data = index->table[i]; data; data = next) {
+			next = data->next;
+			expr_free(data->expr);
+			free(data->chain);
+			free(data);
+		}
+	}
+	free(index);
+}
+
+/*
+ * Attributes of a set element, either from a libnftnl set element or
+ * straight from the element attributes of a dump message. Statements are
+ * only parsed from libnftnl set elements.
+ */
+struct setelem_attrs {
+	uint32_t			flags;
+	bool				has_key;
+	bool				has_key_end;
+	bool				has_data;
+	bool				has_objref;
+	bool				has_timeout;
+	bool				has_expiration;
+	struct nft_data_delinearize	key;
+	struct nft_data_delinearize	key_end;
+	struct nft_data_delinearize	data;
+	struct nft_data_delinearize	objref;
+	uint64_t			timeout;
+	uint64_t			expiration;
+	const void			*udata;
+	uint32_t			udata_len;
+	struct nftnl_set_elem		*nlse;
+};
+
+static void setelem_attrs_from_nftnl(struct setelem_attrs *a,
+				     struct nftnl_set_elem *nlse)
+{
+	memset(a, 0, sizeof(*a));
+	a->nlse = nlse;
+
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_FLAGS))
+		a->flags = nftnl_set_elem_get_u32(nlse, NFTNL_SET_ELEM_FLAGS);
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_KEY)) {
+		a->key.value = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_KEY,
+						  &a->key.len);
+		a->has_key = true;
+	}
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_KEY_END)) {
+		a->key_end.value = nftnl_set_elem_get(nlse,
+						      NFTNL_SET_ELEM_KEY_END,
+						      &a->key_end.len);
+		a->has_key_end = true;
+	}
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_TIMEOUT)) {
+		a->timeout = nftnl_set_elem_get_u64(nlse, NFTNL_SET_ELEM_TIMEOUT);
+		a->has_timeout = true;
+	}
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_EXPIRATION)) {
+		a->expiration = nftnl_set_elem_get_u64(nlse,
+						       NFTNL_SET_ELEM_EXPIRATION);
+		a->has_expiration = true;
+	}
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_USERDATA))
+		a->udata = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_USERDATA,
+					      &a->udata_len);
+
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_DATA)) {
+		a->data.value = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_DATA,
+						   &a->data.len);
+		a->has_data = true;
+	} else if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_CHAIN)) {
+		a->data.chain = nftnl_set_elem_get_str(nlse, NFTNL_SET_ELEM_CHAIN);
+		a->data.verdict = nftnl_set_elem_get_u32(nlse, NFTNL_SET_ELEM_VERDICT);
+		a->has_data = true;
+	} else if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_VERDICT)) {
+		a->data.verdict = nftnl_set_elem_get_u32(nlse, NFTNL_SET_ELEM_VERDICT);
+		a->has_data = true;
+	}
+	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_OBJREF)) {
+		a->objref.value = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_OBJREF,
+						     &a->objref.len);
+		a->has_objref = true;
+	}
+}
+
+static int __netlink_delinearize_setelem(const struct setelem_attrs *a,
+					 struct set *set,
+					 struct nft_cache *cache)
 {
 	struct setelem_parse_ctx setelem_parse_ctx = {
 		.set	= set,
@@ -1386,17 +1970,14 @@ int netlink_delinearize_setelem(struct nftnl_set_elem *nlse,
 	};
 	struct nft_data_delinearize nld;
 	struct expr *expr, *key, *data;
-	uint32_t flags = 0;
+	uint32_t flags = a->flags;
 
 	init_list_head(&setelem_parse_ctx.stmt_list);
 
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_KEY))
-		nld.value = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_KEY, &nld.len);
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_FLAGS))
-		flags = nftnl_set_elem_get_u32(nlse, NFTNL_SET_ELEM_FLAGS);
+	nld = a->key;
 
 key_end:
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_KEY)) {
+	if (a->has_key) {
 		key = netlink_alloc_value(&netlink_location, &nld);
 		datatype_set(key, set->key->dtype);
 		key->byteorder	= set->key->byteorder;
@@ -1422,25 +2003,26 @@ key_end:
 	expr = set_elem_expr_alloc(&netlink_location, key);
 	expr->flags |= EXPR_F_KERNEL;
 
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_TIMEOUT)) {
-		expr->timeout	 = nftnl_set_elem_get_u64(nlse, NFTNL_SET_ELEM_TIMEOUT);
+	if (a->has_timeout) {
+		expr->timeout	 = a->timeout;
 		if (expr->timeout == 0)
 			expr->timeout	 = NFT_NEVER_TIMEOUT;
 	}
 
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_EXPIRATION))
-		expr->expiration = nftnl_set_elem_get_u64(nlse, NFTNL_SET_ELEM_EXPIRATION);
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_USERDATA))
-		set_elem_parse_udata(nlse, expr);
-	if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_EXPR)) {
+	if (a->has_expiration)
+		expr->expiration = a->expiration;
+	if (a->udata)
+		set_elem_parse_udata(a->udata, a->udata_len, expr);
+	if (a->nlse && nftnl_set_elem_is_set(a->nlse, NFTNL_SET_ELEM_EXPR)) {
 		const struct nftnl_expr *nle;
 		struct stmt *stmt;
 
-		nle = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_EXPR, NULL);
+		nle = nftnl_set_elem_get(a->nlse, NFTNL_SET_ELEM_EXPR, NULL);
 		stmt = netlink_parse_set_expr(set, cache, nle);
 		list_add_tail(&stmt->list, &setelem_parse_ctx.stmt_list);
-	} else if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_EXPRESSIONS)) {
-		nftnl_set_elem_expr_foreach(nlse, set_elem_parse_expressions,
+	} else if (a->nlse &&
+		   nftnl_set_elem_is_set(a->nlse, NFTNL_SET_ELEM_EXPRESSIONS)) {
+		nftnl_set_elem_expr_foreach(a->nlse, set_elem_parse_expressions,
 					    &setelem_parse_ctx);
 	}
 	list_splice_tail_init(&setelem_parse_ctx.stmt_list, &expr->stmt_list);
@@ -1452,18 +2034,21 @@ key_end:
 	}
 
 	if (set_is_datamap(set->flags)) {
-		if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_DATA)) {
-			nld.value = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_DATA,
-						       &nld.len);
-		} else if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_CHAIN)) {
-			nld.chain = nftnl_set_elem_get_str(nlse, NFTNL_SET_ELEM_CHAIN);
-			nld.verdict = nftnl_set_elem_get_u32(nlse, NFTNL_SET_ELEM_VERDICT);
-		} else if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_VERDICT)) {
-			nld.verdict = nftnl_set_elem_get_u32(nlse, NFTNL_SET_ELEM_VERDICT);
-		} else
+		struct nft_data_delinearize dld = a->data;
+
+		if (!a->has_data)
 			goto out;
 
-		data = netlink_alloc_data(&netlink_location, &nld,
+		if (setelem_data_shareable(set)) {
+			data = setelem_data_lookup(set, &dld);
+			if (data) {
+				expr = mapping_expr_alloc(&netlink_location,
+							  expr, data);
+				goto out;
+			}
+		}
+
+		data = netlink_alloc_data(&netlink_location, &dld,
 					  set->data->dtype->type == TYPE_VERDICT ?
 					  NFT_REG_VERDICT : NFT_REG_1);
 		datatype_set(data, set->data->dtype);
@@ -1477,17 +2062,16 @@ key_end:
 		if (data->byteorder == BYTEORDER_HOST_ENDIAN)
 			mpz_switch_byteorder(data->value, data->len / BITS_PER_BYTE);
 
+		if (setelem_data_shareable(set))
+			setelem_data_add(set, &dld, data);
+
 		expr = mapping_expr_alloc(&netlink_location, expr, data);
 	}
 	if (set_is_objmap(set->flags)) {
-		if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_OBJREF)) {
-			nld.value = nftnl_set_elem_get(nlse,
-						       NFTNL_SET_ELEM_OBJREF,
-						       &nld.len);
-		} else
+		if (!a->has_objref)
 			goto out;
 
-		data = netlink_alloc_value(&netlink_location, &nld);
+		data = netlink_alloc_value(&netlink_location, &a->objref);
 		data->dtype = &string_type;
 		data->byteorder = BYTEORDER_HOST_ENDIAN;
 		mpz_switch_byteorder(data->value, data->len / BITS_PER_BYTE);
@@ -1496,22 +2080,225 @@ key_end:
 out:
 	compound_expr_add(set->init, expr);
 
-	if (!(flags & NFT_SET_ELEM_INTERVAL_END) &&
-	    nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_KEY_END)) {
+	if (!(flags & NFT_SET_ELEM_INTERVAL_END) && a->has_key_end) {
 		flags |= NFT_SET_ELEM_INTERVAL_END;
-		nld.value = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_KEY_END,
-					       &nld.len);
+		nld = a->key_end;
 		goto key_end;
 	}
 
 	return 0;
 }
 
-static int list_setelem_cb(struct nftnl_set_elem *nlse, void *arg)
+int netlink_delinearize_setelem(struct nftnl_set_elem *nlse,
+				struct set *set, struct nft_cache *cache)
 {
-	struct netlink_ctx *ctx = arg;
-	return netlink_delinearize_setelem(nlse, ctx->set, &ctx->nft->cache);
-}
+	struct setelem_attrs a;
+
+	setelem_attrs_from_nftnl(&a, nlse);
+
+	return __netlink_delinearize_setelem(&a, set, cache);
+}
+
+/*
+ * Cached elements of a set that is not an interval set, sorted by their key
+ * as the kernel sees it, so element events are applied to the cache instead
+ * of fetching all elements again. As with the interval index, it holds a
+ * reference on the set expression it was built from and it is rebuilt if
+ * set->init is replaced.
+ */
+struct setelem_index {
+	struct expr		*init;
+	void			*root;
+};
+
+struct setelem_node {
+	struct expr		*expr;
+	uint32_t		len;
+	unsigned char		key[];
+};
+
+static int setelem_node_cmp(const void *a, const void *b)
+{
+	const struct setelem_node *n1 = a, *n2 = b;
+
+	if (n1->len != n2->len)
+		return n1->len < n2->len ? -1 : 1;
+
+	return memcmp(n1->key, n2->key, n1->len);
+}
+
+/* catch-all elements have no key, there is at most one of them. */
+static struct setelem_node *setelem_node_alloc(const void *key, uint32_t len)
+{
+	struct setelem_node *node;
+
+	node = xmalloc(sizeof(*node) + len);
+	node->expr = NULL;
+	node->len = len;
+	if (len)
+		memcpy(node->key, key, len);
+
+	return node;
+}
+
+static void setelem_index_add(struct setelem_index *index,
+			      struct setelem_node *node)
+{
+	struct setelem_node **slot;
+
+	slot = tsearch(node, &index->root, setelem_node_cmp);
+	if (!slot)
+		memory_allocation_error();
+	if (*slot != node)
+		free(node);
+}
+
+void setelem_index_free(struct setelem_index *index)
+{
+	if (!index)
+		return;
+
+	tdestroy(index->root, free);
+	expr_free(index->init);
+	free(index);
+}
+
+/* keys that were turned into expressions for printing, e.g. bitmasks. */
+static bool setelem_key_indexable(const struct expr *key)
+{
+	const struct expr *i;
+
+	switch (key->etype) {
+	case EXPR_SET_ELEM_CATCHALL:
+	case EXPR_VALUE:
+		return true;
+	case EXPR_CONCAT:
+		list_for_each_entry(i, &key->expressions, list) {
+			if (i->etype != EXPR_VALUE)
+				return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct setelem_index *setelem_index_get(struct set *set)
+{
+	struct setelem_index *index = set->elem_index;
+	struct nft_data_linearize nld;
+	struct setelem_node *node;
+	const struct expr *elem;
+	struct expr *i;
+
+	if (index && index->init == set->init)
+		return index;
+
+	setelem_index_free(index);
+	set->elem_index = NULL;
+
+	list_for_each_entry(i, &set->init->expressions, list) {
+		elem = i->etype == EXPR_MAPPING ? i->left : i;
+		if (!setelem_key_indexable(elem->key))
+			return NULL;
+	}
+
+	index = xzalloc(sizeof(*index));
+	list_for_each_entry(i, &set->init->expressions, list) {
+		elem = i->etype == EXPR_MAPPING ? i->left : i;
+		if (elem->key->etype == EXPR_SET_ELEM_CATCHALL) {
+			node = setelem_node_alloc(NULL, 0);
+		} else {
+			netlink_gen_key(elem->key, &nld);
+			node = setelem_node_alloc(nld.value, nld.len);
+		}
+		node->expr = i;
+		setelem_index_add(index, node);
+	}
+	index->init = expr_get(set->init);
+	set->elem_index = index;
+
+	return index;
+}
+
+/*
+ * Apply an element event to the cached elements of @set in O(log n) per
+ * element. Returns 1 if the event does not map to the cache: interval sets
+ * store ranges while events carry single boundaries, bitmask keys are
+ * stored as expressions.
+ */
+int netlink_setelem_cache_event(struct set *set, struct nftnl_set *nls,
+				int type, struct nft_cache *cache)
+{
+	struct setelem_node *node, *old, **slot;
+	struct nftnl_set_elems_iter *nlsei;
+	struct setelem_index *index;
+	struct nftnl_set_elem *nlse;
+	const void *key;
+	uint32_t len;
+	int ret = 0;
+
+	if (!set->init || set->flags & NFT_SET_INTERVAL)
+		return 1;
+
+	index = setelem_index_get(set);
+	if (!index)
+		return 1;
+
+	nlsei = nftnl_set_elems_iter_create(nls);
+	if (nlsei == NULL)
+		memory_allocation_error();
+
+	while ((nlse = nftnl_set_elems_iter_next(nlsei)) != NULL) {
+		key = NULL;
+		len = 0;
+		if (nftnl_set_elem_is_set(nlse, NFTNL_SET_ELEM_KEY))
+			key = nftnl_set_elem_get(nlse, NFTNL_SET_ELEM_KEY, &len);
+		node = setelem_node_alloc(key, len);
+
+		/* updates replace the element, e.g. to refresh its timeout. */
+		slot = tfind(node, &index->root, setelem_node_cmp);
+		if (slot) {
+			old = *slot;
+			tdelete(node, &index->root, setelem_node_cmp);
+			compound_expr_remove(set->init, old->expr);
+			expr_free(old->expr);
+			free(old);
+		}
+
+		if (type == NFT_MSG_DELSETELEM) {
+			free(node);
+			continue;
+		}
+
+		if (netlink_delinearize_setelem(nlse, set, cache) < 0) {
+			free(node);
+			ret = -1;
+			break;
+		}
+		node->expr = list_entry(set->init->expressions.prev,
+					struct expr, list);
+		if (!setelem_key_indexable(node->expr->etype == EXPR_MAPPING ?
+					   node->expr->left->key :
+					   node->expr->key)) {
+			/* rebuilt by the next event, which gives up then */
+			free(node);
+			setelem_index_free(index);
+			set->elem_index = NULL;
+			break;
+		}
+		setelem_index_add(index, node);
+	}
+	nftnl_set_elems_iter_destroy(nlsei);
+
+	return ret;
+}
+
+static int list_setelem_cb(struct nftnl_set_elem *nlse, void *arg)
+{
+	struct netlink_ctx *ctx = arg;
+	return netlink_delinearize_setelem(nlse, ctx->set, ctx->nft->cache);
+}
 
 static int list_setelem_debug_cb(struct nftnl_set_elem *nlse, void *arg)
 {
@@ -1549,9 +2336,193 @@ static int list_setelements(struct nftnl_set *s, struct netlink_ctx *ctx)
 	return nftnl_set_elem_foreach(s, list_setelem_cb, ctx);
 }
 
+static void list_setelems_done(struct netlink_ctx *ctx, struct set *set)
+{
+	if (set->flags & NFT_SET_INTERVAL && set->desc.field_count > 1)
+		concat_range_aggregate(set->init);
+	else if (set->flags & NFT_SET_INTERVAL)
+		interval_map_decompose(set->init);
+	else
+		list_expr_sort_jobs(&set->init->expressions, ctx->nft->jobs);
+
+	ctx->set = NULL;
+}
+
+static void list_setelems_init(struct netlink_ctx *ctx, struct nftnl_set *nls,
+			       struct set *set)
+{
+	ctx->set = set;
+	set->init = set_expr_alloc(&internal_location, set);
+	list_setelements(nls, ctx);
+	list_setelems_done(ctx, set);
+}
+
+static int setelem_verdict_attr(const struct nlattr *nest,
+				struct nft_data_delinearize *nld)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, nest) {
+		if (mnl_attr_type_valid(attr, NFTA_VERDICT_MAX) < 0)
+			continue;
+
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_VERDICT_CODE:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+				return -1;
+			nld->verdict = ntohl(mnl_attr_get_u32(attr));
+			break;
+		case NFTA_VERDICT_CHAIN:
+			if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+				return -1;
+			nld->chain = mnl_attr_get_str(attr);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int setelem_data_attr(const struct nlattr *nest,
+			     struct nft_data_delinearize *nld)
+{
+	const struct nlattr *attr;
+
+	if (mnl_attr_validate(nest, MNL_TYPE_NESTED) < 0)
+		return -1;
+
+	mnl_attr_for_each_nested(attr, nest) {
+		if (mnl_attr_type_valid(attr, NFTA_DATA_MAX) < 0)
+			continue;
+
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_DATA_VALUE:
+			if (mnl_attr_validate(attr, MNL_TYPE_BINARY) < 0)
+				return -1;
+			if (mnl_attr_get_payload_len(attr) > NFT_DATA_VALUE_MAXLEN) {
+				errno = ERANGE;
+				return -1;
+			}
+			nld->value = mnl_attr_get_payload(attr);
+			nld->len = mnl_attr_get_payload_len(attr);
+			break;
+		case NFTA_DATA_VERDICT:
+			if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0 ||
+			    setelem_verdict_attr(attr, nld) < 0)
+				return -1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Attributes are validated as libnftnl does, attributes unknown to this
+ * version are skipped. Returns 1 for elements with statements, which need
+ * libnftnl, and -1 on malformed attributes.
+ */
+static int setelem_attrs_from_nlattr(struct setelem_attrs *a,
+				     const struct nlattr *elem)
+{
+	const struct nlattr *attr;
+
+	memset(a, 0, sizeof(*a));
+
+	mnl_attr_for_each_nested(attr, elem) {
+		if (mnl_attr_type_valid(attr, NFTA_SET_ELEM_MAX) < 0)
+			continue;
+
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_SET_ELEM_KEY:
+			if (setelem_data_attr(attr, &a->key) < 0)
+				return -1;
+			a->has_key = true;
+			break;
+		case NFTA_SET_ELEM_KEY_END:
+			if (setelem_data_attr(attr, &a->key_end) < 0)
+				return -1;
+			a->has_key_end = true;
+			break;
+		case NFTA_SET_ELEM_DATA:
+			if (setelem_data_attr(attr, &a->data) < 0)
+				return -1;
+			a->has_data = true;
+			break;
+		case NFTA_SET_ELEM_FLAGS:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+				return -1;
+			a->flags = ntohl(mnl_attr_get_u32(attr));
+			break;
+		case NFTA_SET_ELEM_TIMEOUT:
+			if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+				return -1;
+			a->timeout = be64toh(mnl_attr_get_u64(attr));
+			a->has_timeout = true;
+			break;
+		case NFTA_SET_ELEM_EXPIRATION:
+			if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+				return -1;
+			a->expiration = be64toh(mnl_attr_get_u64(attr));
+			a->has_expiration = true;
+			break;
+		case NFTA_SET_ELEM_USERDATA:
+			if (mnl_attr_validate(attr, MNL_TYPE_BINARY) < 0)
+				return -1;
+			a->udata = mnl_attr_get_payload(attr);
+			a->udata_len = mnl_attr_get_payload_len(attr);
+			break;
+		case NFTA_SET_ELEM_OBJREF:
+			if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+				return -1;
+			a->objref.value = mnl_attr_get_payload(attr);
+			a->objref.len = mnl_attr_get_payload_len(attr);
+			a->has_objref = true;
+			break;
+		case NFTA_SET_ELEM_EXPR:
+		case NFTA_SET_ELEM_EXPRESSIONS:
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Elements are delinearized straight from the attributes of the dump
+ * messages, as they arrive, instead of being parsed into libnftnl set
+ * elements that are only walked once the whole dump is in.
+ */
+static int list_setelem_attr_cb(const struct nlmsghdr *nlh,
+				const struct nlattr *elem, void *data)
+{
+	struct netlink_ctx *ctx = data;
+	struct setelem_attrs a;
+	struct nftnl_set *nls;
+	int ret;
+
+	ret = setelem_attrs_from_nlattr(&a, elem);
+	if (ret < 0)
+		return -1;
+	if (ret == 0)
+		return __netlink_delinearize_setelem(&a, ctx->set,
+						     ctx->nft->cache);
+
+	nls = nftnl_set_alloc();
+	if (nls == NULL)
+		memory_allocation_error();
+
+	mnl_nft_setelem_parse(nlh, elem, nls);
+	ret = nftnl_set_elem_foreach(nls, list_setelem_cb, ctx);
+	nftnl_set_free(nls);
+
+	return ret;
+}
+
 int netlink_list_setelems(struct netlink_ctx *ctx, const struct handle *h,
 			  struct set *set, bool reset)
 {
+	struct expr *init = set->init;
 	struct nftnl_set *nls;
 	int err;
 
@@ -1565,28 +2536,114 @@ int netlink_list_setelems(struct netlink_ctx *ctx, const struct handle *h,
 	if (h->handle.id)
 		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
 
-	err = mnl_nft_setelem_get(ctx, nls, reset);
-	if (err < 0) {
+	/* netlink debugging prints the libnftnl set elements. */
+	if (ctx->nft->debug_mask & NFT_DEBUG_NETLINK) {
+		err = mnl_nft_setelem_get(ctx, nls, reset);
+		if (err < 0) {
+			nftnl_set_free(nls);
+			if (errno == EINTR)
+				return -1;
+
+			return 0;
+		}
+
+		list_setelems_init(ctx, nls, set);
 		nftnl_set_free(nls);
-		if (errno == EINTR)
-			return -1;
 
 		return 0;
 	}
 
 	ctx->set = set;
 	set->init = set_expr_alloc(&internal_location, set);
-	list_setelements(nls, ctx);
+	err = mnl_nft_setelem_dump(ctx, nls, reset, list_setelem_attr_cb, ctx);
+	nftnl_set_free(nls);
+	if (err < 0) {
+		expr_free(set->init);
+		set->init = init;
+		ctx->set = NULL;
+		if (errno == EINTR)
+			return -1;
 
-	if (set->flags & NFT_SET_INTERVAL && set->desc.field_count > 1)
-		concat_range_aggregate(set->init);
-	else if (set->flags & NFT_SET_INTERVAL)
-		interval_map_decompose(set->init);
-	else
-		list_expr_sort(&ctx->set->init->expressions);
+		return 0;
+	}
+
+	list_setelems_done(ctx, set);
+
+	return 0;
+}
 
+/* Same as above, but only the elements in @window end up in set->init, the
+ * others are counted from the dump without being delinearized.
+ */
+int netlink_list_setelems_window(struct netlink_ctx *ctx,
+				 const struct handle *h, struct set *set,
+				 const struct set_window *window,
+				 uint64_t *count)
+{
+	struct mnl_setelem_window w = {
+		.offset		= window->offset,
+		.limit		= window->count ? 0 : window->limit,
+		.top		= window->count ? 0 : window->top,
+		.top_bytes	= window->by == SET_WINDOW_BY_BYTES,
+	};
+	struct nftnl_set *nls;
+	int err;
+
+	nls = nftnl_set_alloc();
+	if (nls == NULL)
+		memory_allocation_error();
+
+	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
+	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
+	nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
+	if (h->handle.id)
+		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+
+	err = mnl_nft_setelem_get_window(ctx, nls, &w);
+	if (err < 0) {
+		nftnl_set_free(nls);
+		return -1;
+	}
+
+	if (w.top) {
+		/* the elements stay ranked by their counters */
+		ctx->set = set;
+		set->init = set_expr_alloc(&internal_location, set);
+		list_setelements(nls, ctx);
+		ctx->set = NULL;
+	} else {
+		list_setelems_init(ctx, nls, set);
+	}
 	nftnl_set_free(nls);
-	ctx->set = NULL;
+	*count = w.count;
+
+	return 0;
+}
+
+/* Number of elements of a set, none of them is parsed. */
+int netlink_count_setelems(struct netlink_ctx *ctx, const struct handle *h,
+			   uint64_t *count)
+{
+	struct mnl_setelem_window w = {};
+	struct nftnl_set *nls;
+	int err;
+
+	nls = nftnl_set_alloc();
+	if (nls == NULL)
+		memory_allocation_error();
+
+	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
+	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
+	nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
+	if (h->handle.id)
+		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+
+	err = mnl_nft_setelem_get_window(ctx, nls, &w);
+	nftnl_set_free(nls);
+	if (err < 0)
+		return -1;
+
+	*count = w.count;
 
 	return 0;
 }
@@ -1627,7 +2684,8 @@ int netlink_get_setelem(struct netlink_ctx *ctx, const struct handle *h,
 	else if (set->flags & NFT_SET_INTERVAL)
 		err = get_set_decompose(cache_set, set);
 	else
-		list_expr_sort(&ctx->set->init->expressions);
+		list_expr_sort_jobs(&ctx->set->init->expressions,
+				    ctx->nft->jobs);
 
 	nftnl_set_free(nls);
 	nftnl_set_free(nls_out);
@@ -1636,6 +2694,152 @@ int netlink_get_setelem(struct netlink_ctx *ctx, const struct handle *h,
 	return err;
 }
 
+/* Fetch the element of interval set @set that starts the range containing
+ * @value, or that ends it if @end is set, into @init.
+ */
+static int netlink_get_setelem_key(struct netlink_ctx *ctx, struct set *set,
+				   struct expr *init, const mpz_t value,
+				   bool end)
+{
+	const struct handle *h = &set->handle;
+	struct nftnl_set *nls, *nls_out;
+	struct expr *req, *key, *elem;
+	struct expr *saved;
+
+	key = constant_expr_alloc(&internal_location, set->key->dtype,
+				  set->key->byteorder, set->key->len, NULL);
+	mpz_set(key->value, value);
+	elem = set_elem_expr_alloc(&internal_location, key);
+	if (end)
+		elem->flags |= EXPR_F_INTERVAL_END;
+	req = set_expr_alloc(&internal_location, set);
+	compound_expr_add(req, elem);
+
+	nls = nftnl_set_alloc();
+	if (nls == NULL)
+		memory_allocation_error();
+
+	nftnl_set_set_u32(nls, NFTNL_SET_FAMILY, h->family);
+	nftnl_set_set_str(nls, NFTNL_SET_TABLE, h->table.name);
+	nftnl_set_set_str(nls, NFTNL_SET_NAME, h->set.name);
+	if (h->handle.id)
+		nftnl_set_set_u64(nls, NFTNL_SET_HANDLE, h->handle.id);
+
+	alloc_setelem_cache(req, nls);
+	expr_free(req);
+
+	netlink_dump_set(nls, ctx);
+
+	nls_out = mnl_nft_setelem_get_one(ctx, nls, false);
+	nftnl_set_free(nls);
+	if (!nls_out)
+		return -1;
+
+	/* list_setelements() adds to the set elements in the cache. */
+	saved = set->init;
+	set->init = init;
+	ctx->set = set;
+	list_setelements(nls_out, ctx);
+	ctx->set = NULL;
+	set->init = saved;
+
+	nftnl_set_free(nls_out);
+
+	return 0;
+}
+
+static bool setelem_range_covers(const struct expr *init, const mpz_t value)
+{
+	const struct expr *i;
+	bool found = false;
+	mpz_t low, high;
+
+	mpz_init(low);
+	mpz_init(high);
+	list_for_each_entry(i, &init->expressions, list) {
+		range_expr_value_low(low, i);
+		range_expr_value_high(high, i);
+		if (mpz_cmp(low, value) <= 0 && mpz_cmp(value, high) <= 0) {
+			found = true;
+			break;
+		}
+	}
+	mpz_clear(high);
+	mpz_clear(low);
+
+	return found;
+}
+
+/* Fetch the ranges of interval set @set that contain the start of the
+ * elements in @init into @set->init, so elements can be deleted without
+ * dumping the whole set, see set_delete(). That is two requests per range,
+ * ranges that are already known are not fetched again. Elements that are
+ * not in the set are left to set_delete() to report.
+ */
+int netlink_get_setelem_ranges(struct netlink_ctx *ctx, struct set *set,
+			       const struct expr *init)
+{
+	const struct expr *i, *elem;
+	struct expr *range, *r, *next;
+	int err = 0;
+	mpz_t low;
+
+	/* ranges are added to set->init in place. */
+	interval_index_invalidate(set);
+	if (!set->init)
+		set->init = set_expr_alloc(&internal_location, set);
+
+	mpz_init(low);
+	list_for_each_entry(i, &init->expressions, list) {
+		elem = i->etype == EXPR_MAPPING ? i->left : i;
+		if (elem->etype != EXPR_SET_ELEM ||
+		    elem->key->etype == EXPR_SET_ELEM_CATCHALL)
+			continue;
+
+		range_expr_value_low(low, elem);
+		if (setelem_range_covers(set->init, low))
+			continue;
+
+		range = set_expr_alloc(&internal_location, set);
+		err = netlink_get_setelem_key(ctx, set, range, low, false);
+		/* no end element: the range goes up to the largest key. */
+		if (err == 0 &&
+		    netlink_get_setelem_key(ctx, set, range, low, true) < 0 &&
+		    errno != ENOENT)
+			err = -1;
+
+		if (err == 0) {
+			interval_map_decompose(range);
+			list_for_each_entry_safe(r, next, &range->expressions, list) {
+				list_del(&r->list);
+				compound_expr_add(set->init, r);
+			}
+		}
+		expr_free(range);
+
+		if (err < 0) {
+			if (errno != ENOENT)
+				break;
+			err = 0;
+		}
+	}
+	mpz_clear(low);
+
+	if (err < 0) {
+		int saved_errno = errno;
+
+		/* the ranges fetched so far are not the content of the set. */
+		expr_free(set->init);
+		set->init = NULL;
+		errno = saved_errno;
+		return err;
+	}
+
+	list_expr_sort(&set->init->expressions);
+
+	return 0;
+}
+
 void netlink_dump_obj(struct nftnl_obj *nln, struct netlink_ctx *ctx)
 {
 	FILE *fp = ctx->nft->output.output_fp;
@@ -2152,7 +3356,7 @@ int netlink_events_trace_cb(const struct nlmsghdr *nlh, int type,
 	case NFT_TRACETYPE_RULE:
 		if (nftnl_trace_is_set(nlt, NFTNL_TRACE_RULE_HANDLE))
 			trace_print_rule(nlt, &monh->ctx->nft->output,
-					 &monh->ctx->nft->cache);
+					 monh->ctx->nft->cache);
 		break;
 	case NFT_TRACETYPE_POLICY:
 		trace_print_hdr(nlt, &monh->ctx->nft->output);
@@ -2189,3 +3393,473 @@ int netlink_events_trace_cb(const struct nlmsghdr *nlh, int type,
 	nftnl_trace_free(nlt);
 	return MNL_CB_OK;
 }
+
+struct trace_aggr *trace_aggr_alloc(uint64_t interval)
+{
+	struct trace_aggr *aggr;
+	unsigned int i;
+
+	aggr = xzalloc(sizeof(*aggr));
+	aggr->interval = interval;
+	for (i = 0; i < NFT_TRACE_AGGR_HSIZE; i++)
+		init_list_head(&aggr->ht[i]);
+
+	return aggr;
+}
+
+static void trace_aggr_reset(struct trace_aggr *aggr)
+{
+	struct trace_aggr_entry *entry, *next;
+	unsigned int i;
+
+	for (i = 0; i < NFT_TRACE_AGGR_HSIZE; i++) {
+		list_for_each_entry_safe(entry, next, &aggr->ht[i], hlist) {
+			list_del(&entry->hlist);
+			free_const(entry->table);
+			free_const(entry->chain);
+			free(entry);
+		}
+	}
+	aggr->num_entries = 0;
+	aggr->events = 0;
+}
+
+void trace_aggr_free(struct trace_aggr *aggr)
+{
+	trace_aggr_reset(aggr);
+	free(aggr);
+}
+
+const char *trace_aggr_verdict(int verdict)
+{
+	switch (verdict) {
+	case NFT_CONTINUE:
+		return "continue";
+	case NFT_BREAK:
+		return "break";
+	case NFT_JUMP:
+		return "jump";
+	case NFT_GOTO:
+		return "goto";
+	case NFT_RETURN:
+		return "return";
+	case NF_ACCEPT:
+		return "accept";
+	case NF_DROP:
+		return "drop";
+	case NF_QUEUE:
+		return "queue";
+	case NF_STOLEN:
+		return "stolen";
+	case NF_REPEAT:
+		return "repeat";
+	}
+	return "unknown";
+}
+
+static int trace_aggr_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, NFTA_TRACE_MAX) < 0)
+		return MNL_CB_OK;
+
+	switch (type) {
+	case NFTA_TRACE_TABLE:
+	case NFTA_TRACE_CHAIN:
+		if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_TRACE_RULE_HANDLE:
+		if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_TRACE_TYPE:
+	case NFTA_TRACE_POLICY:
+		if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case NFTA_TRACE_VERDICT:
+		if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0)
+			return MNL_CB_ERROR;
+		break;
+	default:
+		/* packet headers and interfaces are not needed here */
+		return MNL_CB_OK;
+	}
+
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+static int trace_aggr_verdict_code(const struct nlattr *nest)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, nest) {
+		if (mnl_attr_get_type(attr) == NFTA_VERDICT_CODE &&
+		    mnl_attr_get_payload_len(attr) == sizeof(uint32_t))
+			return ntohl(mnl_attr_get_u32(attr));
+	}
+	return NFT_CONTINUE;
+}
+
+static struct trace_aggr_entry *
+trace_aggr_lookup(struct trace_aggr *aggr, const struct trace_aggr_entry *key)
+{
+	struct trace_aggr_entry *entry;
+	uint32_t hash;
+
+	hash = djb_hash(key->table) ^ djb_hash(key->chain) ^
+	       key->handle ^ (key->type << 8) ^ key->verdict;
+	hash %= NFT_TRACE_AGGR_HSIZE;
+
+	list_for_each_entry(entry, &aggr->ht[hash], hlist) {
+		if (entry->family == key->family &&
+		    entry->handle == key->handle &&
+		    entry->type == key->type &&
+		    entry->verdict == key->verdict &&
+		    !strcmp(entry->table, key->table) &&
+		    !strcmp(entry->chain, key->chain))
+			return entry;
+	}
+
+	entry = xmalloc(sizeof(*entry));
+	*entry = *key;
+	entry->table = xstrdup(key->table);
+	entry->chain = xstrdup(key->chain);
+	entry->hits = 0;
+	list_add_tail(&entry->hlist, &aggr->ht[hash]);
+	aggr->num_entries++;
+
+	return entry;
+}
+
+/* Count a trace event, decoding only what identifies the rule it hit. */
+int netlink_events_trace_aggr_cb(const struct nlmsghdr *nlh,
+				 struct netlink_mon_handler *monh)
+{
+	const struct nlattr *tb[NFTA_TRACE_MAX + 1] = {};
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	struct trace_aggr *aggr = monh->trace_aggr;
+	struct trace_aggr_entry key = {};
+
+	if (mnl_attr_parse(nlh, sizeof(*nfg), trace_aggr_attr_cb, tb) < 0)
+		netlink_abi_error();
+
+	if (!tb[NFTA_TRACE_TYPE] || !tb[NFTA_TRACE_TABLE] ||
+	    !tb[NFTA_TRACE_CHAIN])
+		return MNL_CB_OK;
+
+	key.family = nfg->nfgen_family;
+	key.table = mnl_attr_get_str(tb[NFTA_TRACE_TABLE]);
+	key.chain = mnl_attr_get_str(tb[NFTA_TRACE_CHAIN]);
+	key.type = ntohl(mnl_attr_get_u32(tb[NFTA_TRACE_TYPE]));
+
+	switch (key.type) {
+	case NFT_TRACETYPE_RULE:
+		if (!tb[NFTA_TRACE_RULE_HANDLE])
+			return MNL_CB_OK;
+		key.handle = be64toh(mnl_attr_get_u64(tb[NFTA_TRACE_RULE_HANDLE]));
+		/* fall through */
+	case NFT_TRACETYPE_RETURN:
+		if (tb[NFTA_TRACE_VERDICT])
+			key.verdict = trace_aggr_verdict_code(tb[NFTA_TRACE_VERDICT]);
+		else
+			key.verdict = NFT_CONTINUE;
+		break;
+	case NFT_TRACETYPE_POLICY:
+		if (!tb[NFTA_TRACE_POLICY])
+			return MNL_CB_OK;
+		key.verdict = ntohl(mnl_attr_get_u32(tb[NFTA_TRACE_POLICY]));
+		break;
+	default:
+		return MNL_CB_OK;
+	}
+
+	/* queue number and errno live in the upper bits */
+	if (key.verdict >= 0)
+		key.verdict &= NF_VERDICT_MASK;
+
+	trace_aggr_lookup(aggr, &key)->hits++;
+	aggr->events++;
+
+	return MNL_CB_OK;
+}
+
+static int trace_aggr_entry_cmp(const void *a, const void *b)
+{
+	const struct trace_aggr_entry *e1 = *(struct trace_aggr_entry * const *)a;
+	const struct trace_aggr_entry *e2 = *(struct trace_aggr_entry * const *)b;
+
+	if (e1->hits != e2->hits)
+		return e1->hits < e2->hits ? 1 : -1;
+
+	return strcmp(e1->chain, e2->chain);
+}
+
+static void trace_aggr_entry_print(const struct trace_aggr_entry *entry,
+				   struct output_ctx *octx)
+{
+	nft_print(octx, "%10" PRIu64 "  %s %s %s ", entry->hits,
+		  family2str(entry->family), entry->table, entry->chain);
+
+	switch (entry->type) {
+	case NFT_TRACETYPE_RULE:
+		nft_print(octx, "handle %" PRIu64 " verdict %s\n",
+			  entry->handle, trace_aggr_verdict(entry->verdict));
+		break;
+	case NFT_TRACETYPE_POLICY:
+		nft_print(octx, "policy %s\n",
+			  trace_aggr_verdict(entry->verdict));
+		break;
+	default:
+		nft_print(octx, "verdict %s\n",
+			  trace_aggr_verdict(entry->verdict));
+		break;
+	}
+}
+
+static void trace_aggr_print(const struct trace_aggr *aggr,
+			     struct trace_aggr_entry **entries,
+			     struct output_ctx *octx)
+{
+	struct {
+		int		verdict;
+		uint64_t	hits;
+	} verdicts[NFT_TRACE_AGGR_VERDICTS] = {};
+	unsigned int i, j, num_verdicts = 0;
+	uint64_t others = 0;
+
+	nft_print(octx, "# trace aggregate over ");
+	time_print(aggr->interval, octx);
+	nft_print(octx, ": %" PRIu64 " events, %u rules\n",
+		  aggr->events, aggr->num_entries);
+
+	for (i = 0; i < aggr->num_entries; i++) {
+		if (i < NFT_TRACE_AGGR_TOP)
+			trace_aggr_entry_print(entries[i], octx);
+		else
+			others += entries[i]->hits;
+
+		for (j = 0; j < num_verdicts; j++) {
+			if (verdicts[j].verdict == entries[i]->verdict)
+				break;
+		}
+		if (j == num_verdicts) {
+			if (num_verdicts == NFT_TRACE_AGGR_VERDICTS)
+				continue;
+			verdicts[num_verdicts++].verdict = entries[i]->verdict;
+		}
+		verdicts[j].hits += entries[i]->hits;
+	}
+
+	if (others)
+		nft_print(octx, "%10" PRIu64 "  (%u more)\n", others,
+			  aggr->num_entries - NFT_TRACE_AGGR_TOP);
+
+	if (num_verdicts) {
+		nft_print(octx, "# verdicts:");
+		for (j = 0; j < num_verdicts; j++)
+			nft_print(octx, " %s %" PRIu64,
+				  trace_aggr_verdict(verdicts[j].verdict),
+				  verdicts[j].hits);
+		nft_print(octx, "\n");
+	}
+}
+
+/* Print the hits counted over the last interval, then start over. */
+int netlink_trace_aggr_flush(struct netlink_mon_handler *monh)
+{
+	struct output_ctx *octx = &monh->ctx->nft->output;
+	struct trace_aggr *aggr = monh->trace_aggr;
+	struct trace_aggr_entry **entries, *entry;
+	unsigned int i, n = 0;
+
+	entries = xmalloc_array(aggr->num_entries + 1, sizeof(*entries));
+	for (i = 0; i < NFT_TRACE_AGGR_HSIZE; i++) {
+		list_for_each_entry(entry, &aggr->ht[i], hlist)
+			entries[n++] = entry;
+	}
+	qsort(entries, n, sizeof(*entries), trace_aggr_entry_cmp);
+
+	if (monh->format == NFTNL_OUTPUT_JSON)
+		trace_aggr_print_json(octx, aggr, entries);
+	else
+		trace_aggr_print(aggr, entries, octx);
+	fflush(octx->output_fp);
+
+	free(entries);
+	trace_aggr_reset(aggr);
+
+	return 0;
+}
+
+struct elem_aggr *elem_aggr_alloc(uint64_t interval)
+{
+	struct elem_aggr *aggr;
+
+	aggr = xzalloc(sizeof(*aggr));
+	aggr->interval = interval;
+	init_list_head(&aggr->entries);
+
+	return aggr;
+}
+
+static void elem_aggr_reset(struct elem_aggr *aggr)
+{
+	struct elem_aggr_entry *entry, *next;
+
+	list_for_each_entry_safe(entry, next, &aggr->entries, list) {
+		list_del(&entry->list);
+		free_const(entry->table);
+		free_const(entry->set);
+		free(entry);
+	}
+	aggr->num_entries = 0;
+}
+
+void elem_aggr_free(struct elem_aggr *aggr)
+{
+	elem_aggr_reset(aggr);
+	free(aggr);
+}
+
+static struct elem_aggr_entry *
+elem_aggr_lookup(struct elem_aggr *aggr, uint32_t family,
+		 const char *table, const char *set)
+{
+	struct elem_aggr_entry *entry;
+
+	list_for_each_entry(entry, &aggr->entries, list) {
+		if (entry->family == family &&
+		    !strcmp(entry->table, table) &&
+		    !strcmp(entry->set, set))
+			return entry;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->family = family;
+	entry->table = xstrdup(table);
+	entry->set = xstrdup(set);
+	list_add_tail(&entry->list, &aggr->entries);
+	aggr->num_entries++;
+
+	return entry;
+}
+
+/* The end of an interval is not an element of its own. */
+static bool elem_aggr_is_elem(const struct nlattr *elem)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, elem) {
+		if (mnl_attr_get_type(attr) == NFTA_SET_ELEM_FLAGS &&
+		    mnl_attr_validate(attr, MNL_TYPE_U32) == 0 &&
+		    ntohl(mnl_attr_get_u32(attr)) & NFT_SET_ELEM_INTERVAL_END)
+			return false;
+	}
+	return true;
+}
+
+/* Count the elements of an event without decoding them. */
+int netlink_events_elem_aggr_cb(const struct nlmsghdr *nlh, int type,
+				struct netlink_mon_handler *monh)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr, *elems = NULL, *elem;
+	const char *table = NULL, *set = NULL;
+	struct elem_aggr_entry *entry;
+	uint64_t n = 0;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_SET_ELEM_LIST_TABLE:
+			if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0)
+				table = mnl_attr_get_str(attr);
+			break;
+		case NFTA_SET_ELEM_LIST_SET:
+			if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0)
+				set = mnl_attr_get_str(attr);
+			break;
+		case NFTA_SET_ELEM_LIST_ELEMENTS:
+			elems = attr;
+			break;
+		}
+	}
+	if (!table || !set || !elems)
+		return MNL_CB_OK;
+
+	mnl_attr_for_each_nested(elem, elems) {
+		if (elem_aggr_is_elem(elem))
+			n++;
+	}
+
+	entry = elem_aggr_lookup(monh->elem_aggr, nfg->nfgen_family,
+				 table, set);
+	if (type == NFT_MSG_NEWSETELEM)
+		entry->added += n;
+	else
+		entry->deleted += n;
+
+	return MNL_CB_OK;
+}
+
+static int elem_aggr_entry_cmp(const void *a, const void *b)
+{
+	const struct elem_aggr_entry *e1 = *(struct elem_aggr_entry * const *)a;
+	const struct elem_aggr_entry *e2 = *(struct elem_aggr_entry * const *)b;
+	uint64_t c1 = e1->added + e1->deleted;
+	uint64_t c2 = e2->added + e2->deleted;
+
+	if (c1 != c2)
+		return c1 < c2 ? 1 : -1;
+
+	return strcmp(e1->set, e2->set);
+}
+
+static void elem_aggr_print(const struct elem_aggr *aggr,
+			    struct elem_aggr_entry **entries,
+			    struct output_ctx *octx)
+{
+	double secs = aggr->interval / 1000.0;
+	unsigned int i;
+
+	nft_print(octx, "# elements over ");
+	time_print(aggr->interval, octx);
+	nft_print(octx, ": %u sets\n", aggr->num_entries);
+
+	for (i = 0; i < aggr->num_entries; i++)
+		nft_print(octx, "%s %s %s added %" PRIu64 " (%.1f/s) "
+			  "deleted %" PRIu64 " (%.1f/s)\n",
+			  family2str(entries[i]->family), entries[i]->table,
+			  entries[i]->set,
+			  entries[i]->added, entries[i]->added / secs,
+			  entries[i]->deleted, entries[i]->deleted / secs);
+}
+
+/* Print the changes counted per set over the last interval. */
+int netlink_elem_aggr_flush(struct netlink_mon_handler *monh)
+{
+	struct output_ctx *octx = &monh->ctx->nft->output;
+	struct elem_aggr *aggr = monh->elem_aggr;
+	struct elem_aggr_entry **entries, *entry;
+	unsigned int n = 0;
+
+	entries = xmalloc_array(aggr->num_entries + 1, sizeof(*entries));
+	list_for_each_entry(entry, &aggr->entries, list)
+		entries[n++] = entry;
+	qsort(entries, n, sizeof(*entries), elem_aggr_entry_cmp);
+
+	if (monh->format == NFTNL_OUTPUT_JSON)
+		elem_aggr_print_json(octx, aggr, entries);
+	else
+		elem_aggr_print(aggr, entries, octx);
+	fflush(octx->output_fp);
+
+	free(entries);
+	elem_aggr_reset(aggr);
+
+	return 0;
+}
@@ -12,8 +12,11 @@
 #include <nft.h>
 
 #include <limits.h>
+#include <endian.h>
+#include <libmnl/libmnl.h>
 #include <linux/netfilter/nf_tables.h>
 #include <arpa/inet.h>
+#include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nf_nat.h>
 #include <linux/netfilter.h>
 #include <net/ethernet.h>
@@ -112,6 +115,17 @@ static void netlink_release_registers(struct netlink_parse_ctx *ctx)
 		expr_free(ctx->registers[i]);
 }
 
+/*
+ * A concatenated set key may be held by fewer registers than it has
+ * components, adjacent header fields are fetched with a single payload load.
+ */
+static bool netlink_parse_is_concat(const struct expr *expr,
+				    const struct expr *key)
+{
+	return expr->len < key->len ||
+	       (expr->etype == EXPR_PAYLOAD && key->dtype->subtypes > 1);
+}
+
 static struct expr *netlink_parse_concat_expr(struct netlink_parse_ctx *ctx,
 					      const struct location *loc,
 					      unsigned int reg,
@@ -428,7 +442,7 @@ static void netlink_parse_lookup(struct netlink_parse_ctx *ctx,
 		return netlink_error(ctx, loc,
 				     "Lookup expression has no left hand side");
 
-	if (left->len < set->key->len) {
+	if (netlink_parse_is_concat(left, set->key)) {
 		expr_free(left);
 		left = netlink_parse_concat_expr(ctx, loc, sreg, set->key->len);
 		if (left == NULL)
@@ -1723,7 +1737,7 @@ static void netlink_parse_dynset(struct netlink_parse_ctx *ctx,
 		return netlink_error(ctx, loc,
 				     "Dynset statement has no key expression");
 
-	if (expr->len < set->key->len) {
+	if (netlink_parse_is_concat(expr, set->key)) {
 		expr_free(expr);
 		expr = netlink_parse_concat_key(ctx, loc, sreg, set->key);
 		if (expr == NULL)
@@ -1842,7 +1856,7 @@ static void netlink_parse_objref(struct netlink_parse_ctx *ctx,
 			return netlink_error(ctx, loc,
 					     "objref expression has no left hand side");
 
-		if (left->len < set->key->len) {
+		if (netlink_parse_is_concat(left, set->key)) {
 			expr_free(left);
 			left = netlink_parse_concat_expr(ctx, loc, sreg, set->key->len);
 			if (left == NULL)
@@ -2707,6 +2721,51 @@ static void expr_postprocess_value(struct rule_pp_ctx *ctx, struct expr **exprp)
 		*exprp = bitmask_expr_to_binops(expr);
 }
 
+/* Split a payload load of adjacent header fields, see netlink_gen_key(). */
+static void concat_payload_expand(struct rule_pp_ctx *ctx, struct expr *concat)
+{
+	struct dl_proto_ctx *dl = dl_proto_ctx(ctx);
+	struct expr *i, *n, *e, *en, *tmp;
+	unsigned int num;
+	LIST_HEAD(list);
+	bool ok;
+
+	list_for_each_entry_safe(i, n, &concat->expressions, list) {
+		if (i->etype != EXPR_PAYLOAD || i->payload.inner_desc ||
+		    i->len <= NFT_REG32_SIZE * BITS_PER_BYTE)
+			continue;
+
+		tmp = expr_clone(i);
+		payload_expr_expand(&list, tmp, &dl->pctx);
+		expr_free(tmp);
+
+		num = 0;
+		ok = true;
+		list_for_each_entry(e, &list, list) {
+			if (e->payload.desc == &proto_unknown ||
+			    e->len != e->payload.tmpl->len ||
+			    (!list_is_last(&e->list, &list) &&
+			     e->len % (NFT_REG32_SIZE * BITS_PER_BYTE)))
+				ok = false;
+			num++;
+		}
+
+		list_for_each_entry_safe(e, en, &list, list) {
+			list_del(&e->list);
+			if (ok && num > 1)
+				list_add_tail(&e->list, &i->list);
+			else
+				expr_free(e);
+		}
+
+		if (ok && num > 1) {
+			compound_expr_remove(concat, i);
+			expr_free(i);
+			concat->size += num;
+		}
+	}
+}
+
 static void expr_postprocess_concat(struct rule_pp_ctx *ctx, struct expr **exprp)
 {
 	struct expr *i, *n, *expr = *exprp;
@@ -2717,6 +2776,8 @@ static void expr_postprocess_concat(struct rule_pp_ctx *ctx, struct expr **exprp
 
 	assert(expr->etype == EXPR_CONCAT);
 
+	concat_payload_expand(ctx, expr);
+
 	ctx->flags |= RULE_PP_IN_CONCATENATION;
 	list_for_each_entry_safe(i, n, &expr->expressions, list) {
 		if (type) {
@@ -3456,9 +3517,21 @@ static int parse_rule_udata_cb(const struct nftnl_udata *attr, void *data)
 	return 0;
 }
 
-static char *nftnl_rule_get_comment(const struct nftnl_rule *nlr)
+static char *rule_udata_comment(const void *data, uint32_t len)
 {
 	const struct nftnl_udata *tb[NFTNL_UDATA_RULE_MAX + 1] = {};
+
+	if (nftnl_udata_parse(data, len, parse_rule_udata_cb, tb) < 0)
+		return NULL;
+
+	if (!tb[NFTNL_UDATA_RULE_COMMENT])
+		return NULL;
+
+	return xstrdup(nftnl_udata_get(tb[NFTNL_UDATA_RULE_COMMENT]));
+}
+
+static char *nftnl_rule_get_comment(const struct nftnl_rule *nlr)
+{
 	const void *data;
 	uint32_t len;
 
@@ -3467,13 +3540,83 @@ static char *nftnl_rule_get_comment(const struct nftnl_rule *nlr)
 
 	data = nftnl_rule_get_data(nlr, NFTNL_RULE_USERDATA, &len);
 
-	if (nftnl_udata_parse(data, len, parse_rule_udata_cb, tb) < 0)
-		return NULL;
+	return rule_udata_comment(data, len);
+}
 
-	if (!tb[NFTNL_UDATA_RULE_COMMENT])
+static void netlink_rule_handle(const struct nftnl_rule *nlr, struct handle *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->family = nftnl_rule_get_u32(nlr, NFTNL_RULE_FAMILY);
+	h->table.name = xstrdup(nftnl_rule_get_str(nlr, NFTNL_RULE_TABLE));
+	h->chain.name = xstrdup(nftnl_rule_get_str(nlr, NFTNL_RULE_CHAIN));
+	h->handle.id = nftnl_rule_get_u64(nlr, NFTNL_RULE_HANDLE);
+
+	if (nftnl_rule_is_set(nlr, NFTNL_RULE_POSITION))
+		h->position.id = nftnl_rule_get_u64(nlr, NFTNL_RULE_POSITION);
+}
+
+/* Rule without statements, for caches that only need handles and the
+ * position of the rules in their chain.
+ */
+struct rule *netlink_delinearize_rule_handle(struct nftnl_rule *nlr)
+{
+	struct handle h;
+	struct rule *rule;
+
+	netlink_rule_handle(nlr, &h);
+	rule = rule_alloc(&netlink_location, &h);
+	rule->comment = nftnl_rule_get_comment(nlr);
+
+	return rule;
+}
+
+/* Same as above, straight from a rule message. The expressions are not even
+ * parsed by libnftnl, their attribute is skipped.
+ */
+struct rule *netlink_delinearize_rule_nlmsg(const struct nlmsghdr *nlh)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const char *table = NULL, *chain = NULL;
+	const struct nlattr *attr;
+	const void *udata = NULL;
+	uint32_t udata_len = 0;
+	struct rule *rule;
+	struct handle h;
+
+	memset(&h, 0, sizeof(h));
+	h.family = nfg->nfgen_family;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_RULE_TABLE:
+			table = mnl_attr_get_str(attr);
+			break;
+		case NFTA_RULE_CHAIN:
+			chain = mnl_attr_get_str(attr);
+			break;
+		case NFTA_RULE_HANDLE:
+			h.handle.id = be64toh(mnl_attr_get_u64(attr));
+			break;
+		case NFTA_RULE_POSITION:
+			h.position.id = be64toh(mnl_attr_get_u64(attr));
+			break;
+		case NFTA_RULE_USERDATA:
+			udata = mnl_attr_get_payload(attr);
+			udata_len = mnl_attr_get_payload_len(attr);
+			break;
+		}
+	}
+
+	if (!table || !chain)
 		return NULL;
 
-	return xstrdup(nftnl_udata_get(tb[NFTNL_UDATA_RULE_COMMENT]));
+	h.table.name = xstrdup(table);
+	h.chain.name = xstrdup(chain);
+	rule = rule_alloc(&netlink_location, &h);
+	if (udata)
+		rule->comment = rule_udata_comment(udata, udata_len);
+
+	return rule;
 }
 
 struct rule *netlink_delinearize_rule(struct netlink_ctx *ctx,
@@ -3487,17 +3630,10 @@ struct rule *netlink_delinearize_rule(struct netlink_ctx *ctx,
 	_ctx.debug_mask = ctx->nft->debug_mask;
 	_ctx.nlctx = ctx;
 
-	memset(&h, 0, sizeof(h));
-	h.family = nftnl_rule_get_u32(nlr, NFTNL_RULE_FAMILY);
-	h.table.name = xstrdup(nftnl_rule_get_str(nlr, NFTNL_RULE_TABLE));
-	h.chain.name = xstrdup(nftnl_rule_get_str(nlr, NFTNL_RULE_CHAIN));
-	h.handle.id = nftnl_rule_get_u64(nlr, NFTNL_RULE_HANDLE);
-
-	if (nftnl_rule_is_set(nlr, NFTNL_RULE_POSITION))
-		h.position.id = nftnl_rule_get_u64(nlr, NFTNL_RULE_POSITION);
+	netlink_rule_handle(nlr, &h);
 
 	pctx->rule = rule_alloc(&netlink_location, &h);
-	pctx->table = table_cache_find(&ctx->nft->cache.table_cache,
+	pctx->table = table_cache_find(&ctx->nft->cache->table_cache,
 				       h.table.name, h.family);
 	if (!pctx->table) {
 		errno = ENOENT;
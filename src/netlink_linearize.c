@@ -25,16 +25,26 @@
 #include <linux/netfilter.h>
 #include <libnftnl/udata.h>
 
+/*
+ * Expressions are looked up in the order they were added to the rule, so
+ * the next entry is the one we are looking for unless the caller skipped
+ * some.
+ */
 struct nft_expr_loc *nft_expr_loc_find(const struct nftnl_expr *nle,
 				       struct netlink_linearize_ctx *ctx)
 {
-	struct nft_expr_loc *eloc;
-	uint32_t hash;
+	unsigned int i = ctx->expr_loc_next;
 
-	hash = (uint64_t)nle % NFT_EXPR_LOC_HSIZE;
-	list_for_each_entry(eloc, &ctx->expr_loc_htable[hash], hlist) {
-		if (eloc->nle == nle)
-			return eloc;
+	if (i < ctx->num_expr_loc && ctx->expr_loc[i].nle == nle) {
+		ctx->expr_loc_next++;
+		return &ctx->expr_loc[i];
+	}
+
+	for (i = 0; i < ctx->num_expr_loc; i++) {
+		if (ctx->expr_loc[i].nle == nle) {
+			ctx->expr_loc_next = i + 1;
+			return &ctx->expr_loc[i];
+		}
 	}
 
 	return NULL;
@@ -45,13 +55,17 @@ static void nft_expr_loc_add(const struct nftnl_expr *nle,
 			     struct netlink_linearize_ctx *ctx)
 {
 	struct nft_expr_loc *eloc;
-	uint32_t hash;
 
-	eloc = xmalloc(sizeof(*eloc));
+	if (ctx->num_expr_loc == ctx->expr_loc_size) {
+		ctx->expr_loc_size = ctx->expr_loc_size ?
+				     ctx->expr_loc_size * 2 : 16;
+		ctx->expr_loc = xrealloc(ctx->expr_loc, ctx->expr_loc_size *
+						       sizeof(*ctx->expr_loc));
+	}
+
+	eloc = &ctx->expr_loc[ctx->num_expr_loc++];
 	eloc->nle = nle;
 	eloc->loc = loc;
-	hash = (uint64_t)nle % NFT_EXPR_LOC_HSIZE;
-	list_add_tail(&eloc->hlist, &ctx->expr_loc_htable[hash]);
 }
 
 static void netlink_put_register(struct nftnl_expr *nle,
@@ -117,6 +131,87 @@ static void netlink_gen_expr(struct netlink_linearize_ctx *ctx,
 			     const struct expr *expr,
 			     enum nft_registers dreg);
 
+static bool netlink_load_eq(const struct expr *a, const struct expr *b)
+{
+	if (a->etype != b->etype || a->len != b->len)
+		return false;
+
+	switch (a->etype) {
+	case EXPR_PAYLOAD:
+		return a->payload.base == b->payload.base &&
+		       a->payload.offset == b->payload.offset &&
+		       a->payload.inner_desc == b->payload.inner_desc;
+	case EXPR_META:
+		return a->meta.key == b->meta.key &&
+		       a->meta.inner_desc == b->meta.inner_desc;
+	case EXPR_CT:
+		return a->ct.key == b->ct.key &&
+		       a->ct.direction == b->ct.direction;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+static struct netlink_pinned_load *
+netlink_pinned_find(struct netlink_linearize_ctx *ctx, const struct expr *expr)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->num_pinned; i++) {
+		if (netlink_load_eq(ctx->pinned[i].expr, expr))
+			return &ctx->pinned[i];
+	}
+
+	return NULL;
+}
+
+/* Only the first use of a pinned load emits it. */
+static enum nft_registers
+netlink_gen_pinned_load(struct netlink_linearize_ctx *ctx,
+			struct netlink_pinned_load *load,
+			const struct expr *expr)
+{
+	if (load->loaded) {
+		ctx->loads_saved++;
+	} else {
+		netlink_gen_expr(ctx, expr, load->reg);
+		load->loaded = true;
+	}
+
+	return load->reg;
+}
+
+/*
+ * Load @expr into a register for reading: the register of a pinned load,
+ * otherwise a new one that the caller has to release.
+ */
+static enum nft_registers netlink_gen_load(struct netlink_linearize_ctx *ctx,
+					   const struct expr *expr,
+					   bool *pinned)
+{
+	struct netlink_pinned_load *load;
+	enum nft_registers reg;
+
+	load = netlink_pinned_find(ctx, expr);
+	*pinned = load != NULL;
+	if (load)
+		return netlink_gen_pinned_load(ctx, load, expr);
+
+	reg = get_register(ctx, expr);
+	netlink_gen_expr(ctx, expr, reg);
+
+	return reg;
+}
+
+static void netlink_unpin_loads(struct netlink_linearize_ctx *ctx)
+{
+	ctx->reg_low -= ctx->pinned_space;
+	ctx->pinned_space = 0;
+	ctx->num_pinned = 0;
+}
+
 static void netlink_gen_concat(struct netlink_linearize_ctx *ctx,
 			       const struct expr *expr,
 			       enum nft_registers dreg)
@@ -262,6 +357,58 @@ static void netlink_gen_payload(struct netlink_linearize_ctx *ctx,
 	nft_rule_add_expr(ctx, nle, &expr->location);
 }
 
+/*
+ * Two adjacent header fields of a concatenation can be fetched with a single
+ * payload load if the first one fills whole registers, so the register
+ * layout is the same as with one load per field.
+ */
+static bool netlink_payload_coalesce(const struct expr *a, const struct expr *b)
+{
+	return a->etype == EXPR_PAYLOAD && b->etype == EXPR_PAYLOAD &&
+	       !a->payload.inner_desc && !b->payload.inner_desc &&
+	       a->payload.base == b->payload.base &&
+	       a->payload.offset % BITS_PER_BYTE == 0 &&
+	       a->len % (NFT_REG32_SIZE * BITS_PER_BYTE) == 0 &&
+	       b->len % BITS_PER_BYTE == 0 &&
+	       a->payload.offset + a->len == b->payload.offset;
+}
+
+/* Generate a set key, see netlink_payload_coalesce(). */
+static void netlink_gen_key(struct netlink_linearize_ctx *ctx,
+			    const struct expr *expr,
+			    enum nft_registers dreg)
+{
+	const struct expr *i, *first, *next;
+	struct nftnl_expr *nle;
+	unsigned int len;
+
+	if (expr->etype != EXPR_CONCAT)
+		return netlink_gen_expr(ctx, expr, dreg);
+
+	list_for_each_entry(i, &expr->expressions, list) {
+		first = i;
+		len = i->len;
+		while (!list_is_last(&i->list, &expr->expressions)) {
+			next = list_next_entry(i, list);
+			if (!netlink_payload_coalesce(i, next))
+				break;
+
+			len += next->len;
+			i = next;
+		}
+
+		if (i == first) {
+			netlink_gen_expr(ctx, i, dreg);
+		} else {
+			nle = __netlink_gen_payload(first, dreg);
+			nftnl_expr_set_u32(nle, NFTNL_EXPR_PAYLOAD_LEN,
+					   len / BITS_PER_BYTE);
+			nft_rule_add_expr(ctx, nle, &first->location);
+		}
+		dreg += netlink_register_space(len);
+	}
+}
+
 static void netlink_gen_exthdr(struct netlink_linearize_ctx *ctx,
 			       const struct expr *expr,
 			       enum nft_registers dreg)
@@ -385,7 +532,7 @@ static void netlink_gen_map(struct netlink_linearize_ctx *ctx,
 		ctx->reg_low += regspace;
 	}
 
-	netlink_gen_expr(ctx, expr->map, sreg);
+	netlink_gen_key(ctx, expr->map, sreg);
 	ctx->reg_low -= regspace;
 
 	nle = alloc_nft_expr("lookup");
@@ -408,12 +555,18 @@ static void netlink_gen_lookup(struct netlink_linearize_ctx *ctx,
 {
 	struct nftnl_expr *nle;
 	enum nft_registers sreg;
+	bool pinned;
 
 	assert(expr->right->etype == EXPR_SET_REF);
 	assert(dreg == NFT_REG_VERDICT);
 
-	sreg = get_register(ctx, expr->left);
-	netlink_gen_expr(ctx, expr->left, sreg);
+	if (expr->left->etype == EXPR_CONCAT) {
+		sreg = get_register(ctx, expr->left);
+		netlink_gen_key(ctx, expr->left, sreg);
+		pinned = false;
+	} else {
+		sreg = netlink_gen_load(ctx, expr->left, &pinned);
+	}
 
 	nle = alloc_nft_expr("lookup");
 	netlink_put_register(nle, NFTNL_EXPR_LOOKUP_SREG, sreg);
@@ -424,7 +577,8 @@ static void netlink_gen_lookup(struct netlink_linearize_ctx *ctx,
 	if (expr->op == OP_NEQ)
 		nftnl_expr_set_u32(nle, NFTNL_EXPR_LOOKUP_FLAGS, NFT_LOOKUP_F_INV);
 
-	release_register(ctx, expr->left);
+	if (!pinned)
+		release_register(ctx, expr->left);
 	nft_rule_add_expr(ctx, nle, &expr->location);
 }
 
@@ -485,11 +639,11 @@ static void netlink_gen_range(struct netlink_linearize_ctx *ctx,
 	struct nftnl_expr *nle;
 	enum nft_registers sreg;
 	struct nft_data_linearize nld;
+	bool pinned;
 
 	assert(dreg == NFT_REG_VERDICT);
 
-	sreg = get_register(ctx, expr->left);
-	netlink_gen_expr(ctx, expr->left, sreg);
+	sreg = netlink_gen_load(ctx, expr->left, &pinned);
 
 	switch (expr->op) {
 	case OP_NEQ:
@@ -527,7 +681,8 @@ static void netlink_gen_range(struct netlink_linearize_ctx *ctx,
 
 	}
 
-	release_register(ctx, expr->left);
+	if (!pinned)
+		release_register(ctx, expr->left);
 }
 
 static void netlink_gen_flagcmp(struct netlink_linearize_ctx *ctx,
@@ -581,11 +736,27 @@ static void netlink_gen_flagcmp(struct netlink_linearize_ctx *ctx,
 	release_register(ctx, expr->left);
 }
 
+static bool netlink_prefix_needs_mask(const struct expr *expr)
+{
+	return expr_basetype(expr->left)->type != TYPE_STRING &&
+	       (expr->right->byteorder != BYTEORDER_BIG_ENDIAN ||
+		!expr->right->prefix_len ||
+		expr->right->prefix_len % BITS_PER_BYTE);
+}
+
+static bool netlink_needs_flagcmp(const struct expr *expr)
+{
+	return (expr->op == OP_IMPLICIT || expr->op == OP_NEG) &&
+	       expr->right->dtype->basetype != NULL &&
+	       expr->right->dtype->basetype->type == TYPE_BITMASK;
+}
+
 static void netlink_gen_relational(struct netlink_linearize_ctx *ctx,
 				   const struct expr *expr,
 				   enum nft_registers dreg)
 {
 	struct nft_data_linearize nld;
+	bool pinned = false;
 	struct nftnl_expr *nle;
 	enum nft_registers sreg;
 	struct expr *right;
@@ -616,31 +787,27 @@ static void netlink_gen_relational(struct netlink_linearize_ctx *ctx,
 	case EXPR_LIST:
 		return netlink_gen_flagcmp(ctx, expr, dreg);
 	case EXPR_PREFIX:
-		sreg = get_register(ctx, expr->left);
-		if (expr_basetype(expr->left)->type != TYPE_STRING &&
-		    (expr->right->byteorder != BYTEORDER_BIG_ENDIAN ||
-		     !expr->right->prefix_len ||
-		     expr->right->prefix_len % BITS_PER_BYTE)) {
+		if (netlink_prefix_needs_mask(expr)) {
+			sreg = get_register(ctx, expr->left);
 			len = div_round_up(expr->right->len, BITS_PER_BYTE);
 			netlink_gen_expr(ctx, expr->left, sreg);
 			right = netlink_gen_prefix(ctx, expr, sreg);
 		} else {
 			len = div_round_up(expr->right->prefix_len, BITS_PER_BYTE);
 			right = expr->right->prefix;
-			expr->left->len = expr->right->prefix_len;
-			netlink_gen_expr(ctx, expr->left, sreg);
+			/* a pinned load is compared on its first bytes only. */
+			if (!netlink_pinned_find(ctx, expr->left))
+				expr->left->len = expr->right->prefix_len;
+			sreg = netlink_gen_load(ctx, expr->left, &pinned);
 		}
 		break;
 	default:
-		if ((expr->op == OP_IMPLICIT || expr->op == OP_NEG) &&
-		    expr->right->dtype->basetype != NULL &&
-		    expr->right->dtype->basetype->type == TYPE_BITMASK)
+		if (netlink_needs_flagcmp(expr))
 			return netlink_gen_flagcmp(ctx, expr, dreg);
 
-		sreg = get_register(ctx, expr->left);
 		len = div_round_up(expr->right->len, BITS_PER_BYTE);
 		right = expr->right;
-		netlink_gen_expr(ctx, expr->left, sreg);
+		sreg = netlink_gen_load(ctx, expr->left, &pinned);
 		break;
 	}
 
@@ -650,7 +817,8 @@ static void netlink_gen_relational(struct netlink_linearize_ctx *ctx,
 			   netlink_gen_cmp_op(expr->op));
 	netlink_gen_data(right, &nld);
 	nftnl_expr_set(nle, NFTNL_EXPR_CMP_DATA, nld.value, len);
-	release_register(ctx, expr->left);
+	if (!pinned)
+		release_register(ctx, expr->left);
 
 	nft_rule_add_expr(ctx, nle, &expr->location);
 }
@@ -696,6 +864,8 @@ static void netlink_gen_bitwise(struct netlink_linearize_ctx *ctx,
 				enum nft_registers dreg)
 {
 	struct expr *binops[NFT_MAX_EXPR_RECURSION];
+	struct netlink_pinned_load *load;
+	enum nft_registers sreg = dreg;
 	struct nftnl_expr *nle;
 	struct nft_data_linearize nld;
 	struct expr *left, *i;
@@ -716,7 +886,13 @@ static void netlink_gen_bitwise(struct netlink_linearize_ctx *ctx,
 		binops[n++] = left = left->left;
 	}
 
-	netlink_gen_expr(ctx, binops[--n], dreg);
+	/* a pinned load is left as is, the result goes to @dreg. */
+	i = binops[--n];
+	load = netlink_pinned_find(ctx, i);
+	if (load)
+		sreg = netlink_gen_pinned_load(ctx, load, i);
+	else
+		netlink_gen_expr(ctx, i, dreg);
 
 	mpz_bitmask(mask, expr->len);
 	mpz_set_ui(xor, 0);
@@ -745,7 +921,7 @@ static void netlink_gen_bitwise(struct netlink_linearize_ctx *ctx,
 	len = div_round_up(expr->len, BITS_PER_BYTE);
 
 	nle = alloc_nft_expr("bitwise");
-	netlink_put_register(nle, NFTNL_EXPR_BITWISE_SREG, dreg);
+	netlink_put_register(nle, NFTNL_EXPR_BITWISE_SREG, sreg);
 	netlink_put_register(nle, NFTNL_EXPR_BITWISE_DREG, dreg);
 	nftnl_expr_set_u32(nle, NFTNL_EXPR_BITWISE_OP, NFT_BITWISE_BOOL);
 	nftnl_expr_set_u32(nle, NFTNL_EXPR_BITWISE_LEN, len);
@@ -927,7 +1103,7 @@ static void netlink_gen_objref_stmt(struct netlink_linearize_ctx *ctx,
 	switch (expr->etype) {
 	case EXPR_MAP:
 		sreg_key = get_register(ctx, expr->map);
-		netlink_gen_expr(ctx, expr->map, sreg_key);
+		netlink_gen_key(ctx, expr->map, sreg_key);
 		release_register(ctx, expr->map);
 
 		nftnl_expr_set_u32(nle, NFTNL_EXPR_OBJREF_SET_SREG, sreg_key);
@@ -1547,7 +1723,7 @@ static void netlink_gen_set_stmt(struct netlink_linearize_ctx *ctx,
 	struct stmt *this;
 
 	sreg_key = get_register(ctx, stmt->set.key->key);
-	netlink_gen_expr(ctx, stmt->set.key->key, sreg_key);
+	netlink_gen_key(ctx, stmt->set.key->key, sreg_key);
 	release_register(ctx, stmt->set.key->key);
 
 	nle = alloc_nft_expr("dynset");
@@ -1589,7 +1765,7 @@ static void netlink_gen_map_stmt(struct netlink_linearize_ctx *ctx,
 	struct stmt *this;
 
 	sreg_key = get_register(ctx, stmt->map.key->key);
-	netlink_gen_expr(ctx, stmt->map.key->key, sreg_key);
+	netlink_gen_key(ctx, stmt->map.key->key, sreg_key);
 
 	sreg_data = get_register(ctx, stmt->map.data->key);
 	netlink_gen_expr(ctx, stmt->map.data->key, sreg_data);
@@ -1635,7 +1811,7 @@ static void netlink_gen_meter_stmt(struct netlink_linearize_ctx *ctx,
 	struct set *set;
 
 	sreg_key = get_register(ctx, stmt->meter.key->key);
-	netlink_gen_expr(ctx, stmt->meter.key->key, sreg_key);
+	netlink_gen_key(ctx, stmt->meter.key->key, sreg_key);
 	release_register(ctx, stmt->meter.key->key);
 
 	set = stmt->meter.set->set;
@@ -1729,27 +1905,129 @@ static void netlink_gen_stmt(struct netlink_linearize_ctx *ctx,
 void netlink_linearize_init(struct netlink_linearize_ctx *lctx,
 			    struct nftnl_rule *nlr)
 {
-	int i;
-
 	memset(lctx, 0, sizeof(*lctx));
 	lctx->reg_low = NFT_REG_1;
 	lctx->nlr = nlr;
-	lctx->expr_loc_htable =
-		xmalloc(sizeof(struct list_head) * NFT_EXPR_LOC_HSIZE);
-	for (i = 0; i < NFT_EXPR_LOC_HSIZE; i++)
-		init_list_head(&lctx->expr_loc_htable[i]);
 }
 
 void netlink_linearize_fini(struct netlink_linearize_ctx *lctx)
 {
-	struct nft_expr_loc *eloc, *next;
-	int i;
+	free(lctx->expr_loc);
+}
+
+/* Load done by the match @expr, if the match only reads its register. */
+static const struct expr *netlink_match_load(const struct expr *expr)
+{
+	const struct expr *left;
+	bool binop = false;
+
+	if (expr->etype != EXPR_RELATIONAL)
+		return NULL;
+
+	/* masks are applied into another register, see netlink_gen_bitwise() */
+	for (left = expr->left;
+	     left->etype == EXPR_BINOP && left->left;
+	     left = left->left)
+		binop = true;
+
+	switch (left->etype) {
+	case EXPR_PAYLOAD:
+		if (left->payload.inner_desc)
+			return NULL;
+		break;
+	case EXPR_META:
+		if (left->meta.inner_desc)
+			return NULL;
+		break;
+	case EXPR_CT:
+		break;
+	default:
+		return NULL;
+	}
 
-	for (i = 0; i < NFT_EXPR_LOC_HSIZE; i++) {
-		list_for_each_entry_safe(eloc, next, &lctx->expr_loc_htable[i], hlist)
-			free(eloc);
+	if (binop)
+		return left;
+
+	switch (expr->right->etype) {
+	case EXPR_RANGE:
+	case EXPR_SET:
+	case EXPR_SET_REF:
+		return left;
+	case EXPR_LIST:
+		return NULL;
+	case EXPR_PREFIX:
+		return netlink_prefix_needs_mask(expr) ? NULL : left;
+	default:
+		return netlink_needs_flagcmp(expr) ? NULL : left;
+	}
+}
+
+static unsigned int netlink_match_regspace(const struct expr *expr)
+{
+	if (expr->etype == EXPR_RELATIONAL &&
+	    expr->left->etype == EXPR_CONCAT)
+		return netlink_register_space(expr->left->len);
+
+	return netlink_register_space(NFT_REG_SIZE * BITS_PER_BYTE);
+}
+
+/*
+ * Matches never modify the packet, so a run of them that loads the same
+ * field more than once can load it once and keep it in a register. Such
+ * loads are pinned at the bottom of the register stack for the run, as
+ * long as the remaining registers are enough for any match in the run.
+ */
+static void netlink_pin_loads(struct netlink_linearize_ctx *ctx,
+			      const struct stmt *first,
+			      const struct list_head *stmts)
+{
+	struct {
+		const struct expr	*expr;
+		unsigned int		uses;
+	} cand[NFT_PINNED_LOADS_MAX * 4];
+	unsigned int num_cand = 0, need = 0, space, i;
+	const struct stmt *stmt = first;
+	const struct expr *load;
+
+	list_for_each_entry_from(stmt, stmts, list) {
+		if (stmt->ops->type != STMT_EXPRESSION)
+			break;
+
+		need = max(need, netlink_match_regspace(stmt->expr));
+
+		load = netlink_match_load(stmt->expr);
+		if (!load)
+			continue;
+
+		for (i = 0; i < num_cand; i++) {
+			if (netlink_load_eq(cand[i].expr, load)) {
+				cand[i].uses++;
+				break;
+			}
+		}
+		if (i == num_cand && num_cand < array_size(cand)) {
+			cand[num_cand].expr = load;
+			cand[num_cand].uses = 1;
+			num_cand++;
+		}
+	}
+
+	for (i = 0; i < num_cand; i++) {
+		if (cand[i].uses < 2 ||
+		    ctx->num_pinned == NFT_PINNED_LOADS_MAX)
+			continue;
+
+		space = netlink_register_space(cand[i].expr->len);
+		if (ctx->pinned_space + space + need > MAX_REGS)
+			continue;
+
+		ctx->pinned[ctx->num_pinned].expr = cand[i].expr;
+		ctx->pinned[ctx->num_pinned].reg =
+			__get_register(ctx, cand[i].expr->len);
+		ctx->pinned[ctx->num_pinned].loaded = false;
+		ctx->pinned_space += space;
+		ctx->num_pinned++;
 	}
-	free(lctx->expr_loc_htable);
 }
 
 void netlink_linearize_rule(struct netlink_ctx *ctx,
@@ -1757,9 +2035,20 @@ void netlink_linearize_rule(struct netlink_ctx *ctx,
 			    struct netlink_linearize_ctx *lctx)
 {
 	const struct stmt *stmt;
+	bool matching = false;
+
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (stmt->ops->type != STMT_EXPRESSION) {
+			netlink_unpin_loads(lctx);
+			matching = false;
+		} else if (!matching) {
+			netlink_pin_loads(lctx, stmt, &rule->stmts);
+			matching = true;
+		}
 
-	list_for_each_entry(stmt, &rule->stmts, list)
 		netlink_gen_stmt(lctx, stmt);
+	}
+	netlink_unpin_loads(lctx);
 
 	if (rule->comment) {
 		struct nftnl_udata_buf *udata;
@@ -1786,6 +2075,10 @@ void netlink_linearize_rule(struct netlink_ctx *ctx,
 					   rule->handle.chain.name);
 
 		netlink_dump_rule(lctx->nlr, ctx);
+		if (lctx->loads_saved && ctx->nft->output.output_fp)
+			fprintf(ctx->nft->output.output_fp,
+				"# %u load(s) reused from registers\n",
+				lctx->loads_saved);
 
 		nftnl_rule_unset(lctx->nlr, NFTNL_RULE_CHAIN);
 		nftnl_rule_unset(lctx->nlr, NFTNL_RULE_TABLE);
@@ -26,6 +26,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
@@ -207,18 +209,15 @@ static void nf_osf_parse_opt(struct nf_osf_opt *opt, __u16 *optnum, char *obuf,
 	}
 }
 
-static int osf_load_line(char *buffer, int len, int del,
-			 struct netlink_ctx *ctx)
+static int osf_parse_line(char *buffer, int len,
+			  struct nf_osf_user_finger *f,
+			  struct netlink_ctx *ctx)
 {
 	int i, cnt = 0;
 	char obuf[MAXOPTSTRLEN];
-	struct nf_osf_user_finger f;
 	char *pbeg, *pend;
-	struct nlmsghdr *nlh;
-	struct nfgenmsg *nfg;
-	char buf[MNL_SOCKET_BUFFER_SIZE];
 
-	memset(&f, 0, sizeof(struct nf_osf_user_finger));
+	memset(f, 0, sizeof(struct nf_osf_user_finger));
 
 	if (ctx->nft->debug_mask & NFT_DEBUG_MNL)
 		nft_print(&ctx->nft->output, "Loading '%s'.\n", buffer);
@@ -241,27 +240,27 @@ static int osf_load_line(char *buffer, int len, int del,
 	if (pend) {
 		*pend = '\0';
 		if (pbeg[0] == 'S') {
-			f.wss.wc = OSF_WSS_MSS;
+			f->wss.wc = OSF_WSS_MSS;
 			if (pbeg[1] == '%')
-				f.wss.val = strtoul(&pbeg[2], NULL, 10);
+				f->wss.val = strtoul(&pbeg[2], NULL, 10);
 			else if (pbeg[1] == '*')
-				f.wss.val = 0;
+				f->wss.val = 0;
 			else
-				f.wss.val = strtoul(&pbeg[1], NULL, 10);
+				f->wss.val = strtoul(&pbeg[1], NULL, 10);
 		} else if (pbeg[0] == 'T') {
-			f.wss.wc = OSF_WSS_MTU;
+			f->wss.wc = OSF_WSS_MTU;
 			if (pbeg[1] == '%')
-				f.wss.val = strtoul(&pbeg[2], NULL, 10);
+				f->wss.val = strtoul(&pbeg[2], NULL, 10);
 			else if (pbeg[1] == '*')
-				f.wss.val = 0;
+				f->wss.val = 0;
 			else
-				f.wss.val = strtoul(&pbeg[1], NULL, 10);
+				f->wss.val = strtoul(&pbeg[1], NULL, 10);
 		} else if (pbeg[0] == '%') {
-			f.wss.wc = OSF_WSS_MODULO;
-			f.wss.val = strtoul(&pbeg[1], NULL, 10);
+			f->wss.wc = OSF_WSS_MODULO;
+			f->wss.val = strtoul(&pbeg[1], NULL, 10);
 		} else if (isdigit(pbeg[0])) {
-			f.wss.wc = OSF_WSS_PLAIN;
-			f.wss.val = strtoul(&pbeg[0], NULL, 10);
+			f->wss.wc = OSF_WSS_PLAIN;
+			f->wss.val = strtoul(&pbeg[0], NULL, 10);
 		}
 
 		pbeg = pend + 1;
@@ -269,19 +268,19 @@ static int osf_load_line(char *buffer, int len, int del,
 	pend = nf_osf_strchr(pbeg, OSFPDEL);
 	if (pend) {
 		*pend = '\0';
-		f.ttl = strtoul(pbeg, NULL, 10);
+		f->ttl = strtoul(pbeg, NULL, 10);
 		pbeg = pend + 1;
 	}
 	pend = nf_osf_strchr(pbeg, OSFPDEL);
 	if (pend) {
 		*pend = '\0';
-		f.df = strtoul(pbeg, NULL, 10);
+		f->df = strtoul(pbeg, NULL, 10);
 		pbeg = pend + 1;
 	}
 	pend = nf_osf_strchr(pbeg, OSFPDEL);
 	if (pend) {
 		*pend = '\0';
-		f.ss = strtoul(pbeg, NULL, 10);
+		f->ss = strtoul(pbeg, NULL, 10);
 		pbeg = pend + 1;
 	}
 
@@ -296,101 +295,202 @@ static int osf_load_line(char *buffer, int len, int del,
 	pend = nf_osf_strchr(pbeg, OSFPDEL);
 	if (pend) {
 		*pend = '\0';
-		i = sizeof(f.genre);
+		i = sizeof(f->genre);
 		if (pbeg[0] == '@' || pbeg[0] == '*')
 			pbeg++;
-		snprintf(f.genre, i, "%.*s", i - 1, pbeg);
+		snprintf(f->genre, i, "%.*s", i - 1, pbeg);
 		pbeg = pend + 1;
 	}
 
 	pend = nf_osf_strchr(pbeg, OSFPDEL);
 	if (pend) {
 		*pend = '\0';
-		i = sizeof(f.version);
-		snprintf(f.version, i, "%.*s", i - 1, pbeg);
+		i = sizeof(f->version);
+		snprintf(f->version, i, "%.*s", i - 1, pbeg);
 		pbeg = pend + 1;
 	}
 
 	pend = nf_osf_strchr(pbeg, OSFPDEL);
 	if (pend) {
 		*pend = '\0';
-		i = sizeof(f.subtype);
-		snprintf(f.subtype, i, "%.*s", i - 1, pbeg);
+		i = sizeof(f->subtype);
+		snprintf(f->subtype, i, "%.*s", i - 1, pbeg);
 		pbeg = pend + 1;
 	}
 
-	nf_osf_parse_opt(f.opt, &f.opt_num, obuf, sizeof(obuf));
+	nf_osf_parse_opt(f->opt, &f->opt_num, obuf, sizeof(obuf));
 
-	memset(buf, 0, sizeof(buf));
+	return 0;
+}
 
-	if (del) {
-		nlh = mnl_nlmsg_put_header(buf);
-		nlh->nlmsg_type = (NFNL_SUBSYS_OSF << 8) | OSF_MSG_REMOVE;
-		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-		nlh->nlmsg_seq = ctx->seqnum;
+#define OS_SIGNATURES DEFAULT_INCLUDE_PATH "/nftables/osf/pf.os"
 
-		nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
-		nfg->nfgen_family = AF_UNSPEC;
-		nfg->version = NFNETLINK_V0;
-		nfg->res_id = 0;
-	} else {
-		nlh = mnl_nlmsg_put_header(buf);
-		nlh->nlmsg_type = (NFNL_SUBSYS_OSF << 8) | OSF_MSG_ADD;
-		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
+/* Requests per sendmsg(), each carries one fingerprint. */
+#define OSF_REQ_BATCH		64
+#define OSF_REQ_SIZE		(MNL_NLMSG_HDRLEN + \
+				 MNL_ALIGN(sizeof(struct nfgenmsg)) + \
+				 MNL_ATTR_HDRLEN + \
+				 MNL_ALIGN(sizeof(struct nf_osf_user_finger)))
+
+/*
+ * The kernel provides no way to list the fingerprints it holds, and adding
+ * one that it already has is a no-op. Signatures are parsed once per process
+ * and file version, and sent to the kernel only if they were not loaded from
+ * that version yet, in a few sendmsg() calls instead of one round trip each.
+ */
+static struct {
+	struct nf_osf_user_finger	*f;
+	unsigned int			num;
+	unsigned int			size;
+	/* version of the signature file these were parsed from. */
+	dev_t				dev;
+	ino_t				ino;
+	off_t				st_size;
+	struct timespec			mtime;
+	int				err;
+	bool				parsed;
+	bool				loaded;
+} osf_db;
+
+static pthread_mutex_t osf_db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool osf_db_is_current(const struct stat *st)
+{
+	return osf_db.parsed &&
+	       osf_db.dev == st->st_dev &&
+	       osf_db.ino == st->st_ino &&
+	       osf_db.st_size == st->st_size &&
+	       osf_db.mtime.tv_sec == st->st_mtim.tv_sec &&
+	       osf_db.mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct nf_osf_user_finger *osf_db_add(void)
+{
+	if (osf_db.num == osf_db.size) {
+		osf_db.size = osf_db.size ? osf_db.size * 2 : 256;
+		osf_db.f = xrealloc(osf_db.f, osf_db.size * sizeof(*osf_db.f));
+	}
+
+	return &osf_db.f[osf_db.num];
+}
+
+/* Lines after the first malformed one are ignored. */
+static void osf_db_parse(FILE *inf, const struct stat *st,
+			 struct netlink_ctx *ctx)
+{
+	char buf[1024];
+
+	osf_db.num = 0;
+	osf_db.err = 0;
+
+	while (fgets(buf, sizeof(buf), inf)) {
+		int len;
+
+		if (buf[0] == '#' || buf[0] == '\n' || buf[0] == '\r')
+			continue;
+
+		len = strlen(buf) - 1;
+
+		if (len <= 0)
+			continue;
+
+		buf[len] = '\0';
+
+		osf_db.err = osf_parse_line(buf, len, osf_db_add(), ctx);
+		if (osf_db.err)
+			break;
+
+		osf_db.num++;
+		memset(buf, 0, sizeof(buf));
+	}
+
+	osf_db.dev = st->st_dev;
+	osf_db.ino = st->st_ino;
+	osf_db.st_size = st->st_size;
+	osf_db.mtime = st->st_mtim;
+	osf_db.parsed = true;
+	osf_db.loaded = false;
+}
+
+static int osf_db_send(struct netlink_ctx *ctx, int del)
+{
+	char *buf = xmalloc(OSF_REQ_BATCH * OSF_REQ_SIZE);
+	unsigned int i, n = 0;
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfg;
+	size_t len = 0;
+	int err = 0;
+
+	for (i = 0; i < osf_db.num; i++) {
+		nlh = mnl_nlmsg_put_header(buf + len);
 		nlh->nlmsg_seq = ctx->seqnum;
+		if (del) {
+			nlh->nlmsg_type = (NFNL_SUBSYS_OSF << 8) | OSF_MSG_REMOVE;
+			nlh->nlmsg_flags = NLM_F_REQUEST;
+		} else {
+			nlh->nlmsg_type = (NFNL_SUBSYS_OSF << 8) | OSF_MSG_ADD;
+			nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
+		}
 
 		nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
 		nfg->nfgen_family = AF_UNSPEC;
 		nfg->version = NFNETLINK_V0;
 		nfg->res_id = 0;
 
-		mnl_attr_put(nlh, OSF_ATTR_FINGER, sizeof(struct nf_osf_user_finger), &f);
+		mnl_attr_put(nlh, OSF_ATTR_FINGER,
+			     sizeof(struct nf_osf_user_finger), &osf_db.f[i]);
+		len += nlh->nlmsg_len;
+
+		if (++n < OSF_REQ_BATCH && i + 1 < osf_db.num)
+			continue;
+
+		err = nft_mnl_send_requests(ctx, buf, len);
+		if (err)
+			break;
+		len = 0;
+		n = 0;
 	}
 
-	return nft_mnl_talk(ctx, nlh, nlh->nlmsg_len, 0, NULL);
+	free(buf);
+	return err;
 }
 
-#define OS_SIGNATURES DEFAULT_INCLUDE_PATH "/nftables/osf/pf.os"
-
 int nfnl_osf_load_fingerprints(struct netlink_ctx *ctx, int del)
 {
+	struct stat st;
 	FILE *inf;
-	int err = 0;
-	char buf[1024];
+	int err;
 
 	if (ctx->nft->debug_mask & NFT_DEBUG_MNL)
 		nft_print(&ctx->nft->output, "Opening OS signature file '%s'\n",
 			  OS_SIGNATURES);
 
 	inf = fopen(OS_SIGNATURES, "r");
-	if (!inf) {
+	if (!inf || fstat(fileno(inf), &st) < 0) {
 		if (ctx->nft->debug_mask & NFT_DEBUG_MNL)
 			nft_print(&ctx->nft->output, "Failed to open file '%s'\n",
 				  OS_SIGNATURES);
+		if (inf)
+			fclose(inf);
 
 		return -1;
 	}
 
-	while (fgets(buf, sizeof(buf), inf)) {
-		int len;
-
-		if (buf[0] == '#' || buf[0] == '\n' || buf[0] == '\r')
-			continue;
-
-		len = strlen(buf) - 1;
-
-		if (len <= 0)
-			continue;
-
-		buf[len] = '\0';
-
-		err = osf_load_line(buf, len, del, ctx);
-		if (err)
-			break;
+	pthread_mutex_lock(&osf_db_lock);
+	if (!osf_db_is_current(&st))
+		osf_db_parse(inf, &st, ctx);
+	fclose(inf);
 
-		memset(buf, 0, sizeof(buf));
+	if (!del && osf_db.loaded) {
+		err = osf_db.err;
+		goto out;
 	}
 
-	fclose(inf);
+	err = osf_db_send(ctx, del);
+	if (!err)
+		err = osf_db.err;
+	osf_db.loaded = !del && !err;
+out:
+	pthread_mutex_unlock(&osf_db_lock);
 	return err;
 }
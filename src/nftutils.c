@@ -5,6 +5,7 @@
 #include "nftutils.h"
 
 #include <netdb.h>
+#include <pthread.h>
 
 /* Buffer size used for getprotobynumber_r() and similar. The manual comments
  * that a buffer of 1024 should be sufficient "for most applications"(??), so
@@ -57,9 +58,6 @@ int nft_getprotobyname(const char *name)
 	                     (struct protoent **) &result);
 	if (r != 0 || result != &result_buf)
 		result = NULL;
-#else
-	result = getprotobyname(name);
-#endif
 
 	if (!result)
 		return -1;
@@ -67,6 +65,20 @@ int nft_getprotobyname(const char *name)
 	if (result->p_proto < 0 || result->p_proto > UINT8_MAX)
 		return -1;
 	return (uint8_t) result->p_proto;
+#else
+	/* Set elements are parsed from several threads, and the result of
+	 * getprotobyname() is static. */
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int proto = -1;
+
+	pthread_mutex_lock(&lock);
+	result = getprotobyname(name);
+	if (result && result->p_proto >= 0 && result->p_proto <= UINT8_MAX)
+		proto = result->p_proto;
+	pthread_mutex_unlock(&lock);
+
+	return proto;
+#endif
 }
 
 bool nft_getservbyport(int port, const char *proto, char *out_name, size_t name_len)
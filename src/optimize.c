@@ -13,14 +13,18 @@
 
 #include <nft.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <arpa/inet.h>
 #include <nftables.h>
 #include <parser.h>
 #include <expression.h>
 #include <statement.h>
 #include <utils.h>
 #include <erec.h>
+#include <json.h>
+#include <optimize.h>
 #include <linux/netfilter.h>
 
 #define MAX_STMTS	32
@@ -36,6 +40,8 @@ struct optimize_ctx {
 
 static bool __expr_cmp(const struct expr *expr_a, const struct expr *expr_b)
 {
+	if (expr_a == expr_b)
+		return true;
 	if (expr_a->etype != expr_b->etype)
 		return false;
 
@@ -1278,141 +1284,1752 @@ static bool rules_eq(const struct optimize_ctx *ctx, int i, int j)
 	return true;
 }
 
-static int chain_optimize(struct nft_ctx *nft, struct list_head *rules)
-{
-	struct optimize_ctx *ctx;
-	uint32_t num_merges = 0;
-	struct merge *merge;
-	uint32_t i, j, m, k;
-	struct rule *rule;
-	int ret;
+/*
+ * Reorder mode: merge rules that are not adjacent. Rules with the same
+ * selectors are grouped through a hashtable on the set of statement
+ * matrix columns they use, and a candidate joins a group only if it can
+ * be moved up to the first rule of that group without changing what any
+ * packet runs into. Moving rule j above rule k is fine if the two are
+ * independent:
+ *
+ * - both consist of side effect free matches followed by the same accept
+ *   or drop verdict, so whichever comes first gives the same result, or
+ * - both consist of side effect free matches, then counters or logging,
+ *   then at most a terminal action, and they are disjoint: they compare
+ *   the same selector against literal values, prefixes or ranges that do
+ *   not overlap.
+ *
+ * Jump and goto are terminal actions too, this turns linear dispatch
+ * chains such as one "ip saddr 10.0.N.0/24 jump tenant_N" rule per tenant
+ * into a single verdict map even if other rules are interleaved. As for
+ * vmaps built from adjacent rules, the called chains are assumed not to
+ * rewrite the selectors that are matched after returning.
+ *
+ * A rule is only ever moved above the rules whose own group starts after
+ * the target group, so checking each rule against those it jumps over
+ * covers every pair whose relative order changes.
+ */
+#define REORDER_HSIZE		4096
+#define REORDER_PROBE_MAX	8
+#define REORDER_SCAN_MAX	1024
+
+enum reorder_class {
+	REORDER_ACCEPT,
+	REORDER_DROP,
+	REORDER_SIMPLE,
+	REORDER_FIXED,
+	__REORDER_MAX
+};
 
-	ctx = xzalloc(sizeof(*ctx));
+struct reorder_group {
+	uint32_t	first;
+	uint32_t	last;
+	uint32_t	num;
+	uint32_t	mask;
+	int32_t		next;
+};
 
-	/* Step 1: collect statements in rules */
-	list_for_each_entry(rule, rules, list) {
-		ret = rule_collect_stmts(ctx, rule);
-		if (ret < 0)
-			goto err;
+struct reorder_ctx {
+	enum reorder_class	*class;
+	uint32_t		*group_of;
+	uint32_t		*member_next;
+	struct reorder_group	*group;
+	uint32_t		num_groups;
+	int32_t			bucket[REORDER_HSIZE];
+	uint32_t		*pos[__REORDER_MAX];
+	uint32_t		num_pos[__REORDER_MAX];
+};
 
-		ctx->num_rules++;
+static bool expr_has_side_effects(const struct expr *expr)
+{
+	const struct expr *i;
+
+	switch (expr->etype) {
+	case EXPR_NUMGEN:
+		return expr->numgen.type == NFT_NG_INCREMENTAL;
+	case EXPR_RELATIONAL:
+	case EXPR_BINOP:
+		return expr_has_side_effects(expr->left) ||
+		       expr_has_side_effects(expr->right);
+	case EXPR_CONCAT:
+		list_for_each_entry(i, &expr->expressions, list) {
+			if (expr_has_side_effects(i))
+				return true;
+		}
+		break;
+	default:
+		break;
 	}
 
-	ctx->rule = xzalloc(sizeof(*ctx->rule) * ctx->num_rules);
-	ctx->stmt_matrix = xzalloc(sizeof(*ctx->stmt_matrix) * ctx->num_rules);
-	for (i = 0; i < ctx->num_rules; i++)
-		ctx->stmt_matrix[i] = xzalloc_array(MAX_STMTS,
-						    sizeof(**ctx->stmt_matrix));
+	return false;
+}
 
-	merge = xzalloc(sizeof(*merge) * ctx->num_rules);
+static enum reorder_class rule_reorder_class(const struct rule *rule)
+{
+	enum reorder_class class = REORDER_SIMPLE;
+	bool matching = true, meter = false;
+	const struct stmt *stmt;
+	bool terminal = false;
 
-	/* Step 2: Build matrix of statements */
-	i = 0;
-	list_for_each_entry(rule, rules, list)
-		rule_build_stmt_matrix_stmts(ctx, rule, &i);
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (terminal)
+			return REORDER_FIXED;
 
-	/* Step 3: Look for common selectors for possible rule mergers */
-	for (i = 0; i < ctx->num_rules; i++) {
-		for (j = i + 1; j < ctx->num_rules; j++) {
-			if (!rules_eq(ctx, i, j)) {
-				if (merge[num_merges].num_rules > 0)
-					num_merges++;
+		switch (stmt->ops->type) {
+		case STMT_EXPRESSION:
+			if (!matching || expr_has_side_effects(stmt->expr))
+				return REORDER_FIXED;
+			break;
+		case STMT_COUNTER:
+		case STMT_LOG:
+			matching = false;
+			meter = true;
+			break;
+		case STMT_VERDICT:
+			if (stmt->expr->etype != EXPR_VERDICT)
+				return REORDER_FIXED;
 
-				i = j - 1;
+			switch (stmt->expr->verdict) {
+			case NF_ACCEPT:
+				class = meter ? REORDER_SIMPLE : REORDER_ACCEPT;
 				break;
+			case NF_DROP:
+				class = meter ? REORDER_SIMPLE : REORDER_DROP;
+				break;
+			case NFT_JUMP:
+			case NFT_GOTO:
+				/* dispatch to another chain, disjoint rules only. */
+				break;
+			default:
+				return REORDER_FIXED;
 			}
-			if (merge[num_merges].num_rules > 0) {
-				merge[num_merges].num_rules++;
-			} else {
-				merge[num_merges].rule_from = i;
-				merge[num_merges].num_rules = 2;
-			}
-		}
-		if (j == ctx->num_rules && merge[num_merges].num_rules > 0) {
-			num_merges++;
+
+			terminal = true;
+			break;
+		case STMT_REJECT:
+		case STMT_NAT:
+			terminal = true;
 			break;
+		default:
+			return REORDER_FIXED;
 		}
 	}
 
-	/* Step 4: Infer how to merge the candidate rules */
-	for (k = 0; k < num_merges; k++) {
-		i = merge[k].rule_from;
+	return class;
+}
 
-		for (m = 0; m < ctx->num_stmts; m++) {
-			if (!ctx->stmt_matrix[i][m])
-				continue;
-			switch (ctx->stmt_matrix[i][m]->ops->type) {
-			case STMT_EXPRESSION:
-				merge[k].stmt[merge[k].num_stmts++] = m;
-				break;
-			case STMT_VERDICT:
-				if (ctx->stmt_matrix[i][m]->expr->etype == EXPR_MAP)
-					merge[k].stmt[merge[k].num_stmts++] = m;
-				break;
-			default:
-				break;
+/* Bitmask selectors match on any of the bits, distinct values may overlap. */
+static bool expr_selects_value(const struct expr *expr)
+{
+	const struct datatype *dtype;
+
+	if (expr->etype != EXPR_RELATIONAL ||
+	    (expr->op != OP_IMPLICIT && expr->op != OP_EQ))
+		return false;
+
+	dtype = expr->left->dtype;
+	if (!dtype || dtype == &invalid_type)
+		return false;
+
+	for (; dtype; dtype = dtype->basetype) {
+		if (dtype->type == TYPE_BITMASK)
+			return false;
+	}
+
+	return true;
+}
+
+/* Closed interval of a literal value, in network byte order. */
+struct literal_range {
+	uint8_t		lo[sizeof(struct in6_addr)];
+	uint8_t		hi[sizeof(struct in6_addr)];
+	unsigned int	len;
+};
+
+#define LITERAL_SET_MAX	64
+
+static bool symbol_literal(const struct expr *expr, uint8_t *val,
+			   unsigned int *len)
+{
+	const char *identifier;
+	uint64_t num;
+	char *end;
+	int i;
+
+	if (expr->etype != EXPR_SYMBOL || expr->symtype != SYMBOL_VALUE)
+		return false;
+
+	identifier = expr->identifier;
+	errno = 0;
+	num = strtoull(identifier, &end, 0);
+	if (end != identifier && *end == '\0' && errno == 0 &&
+	    isdigit((unsigned char)identifier[0])) {
+		for (i = sizeof(num) - 1; i >= 0; i--) {
+			val[i] = num & 0xff;
+			num >>= 8;
+		}
+		*len = sizeof(num);
+		return true;
+	}
+
+	if (inet_pton(AF_INET, identifier, val) == 1) {
+		*len = sizeof(struct in_addr);
+		return true;
+	}
+	if (inet_pton(AF_INET6, identifier, val) == 1) {
+		*len = sizeof(struct in6_addr);
+		return true;
+	}
+
+	return false;
+}
+
+static bool expr_literal_range(const struct expr *expr,
+			       struct literal_range *range)
+{
+	unsigned int len, i, bits;
+
+	switch (expr->etype) {
+	case EXPR_SYMBOL:
+		if (!symbol_literal(expr, range->lo, &range->len))
+			return false;
+		memcpy(range->hi, range->lo, range->len);
+		return true;
+	case EXPR_PREFIX:
+		/* address prefixes only, numbers have no fixed width yet. */
+		if (!symbol_literal(expr->prefix, range->lo, &range->len) ||
+		    range->len == sizeof(uint64_t) ||
+		    expr->prefix_len > range->len * BITS_PER_BYTE)
+			return false;
+
+		for (i = 0; i < range->len; i++) {
+			bits = expr->prefix_len > i * BITS_PER_BYTE ?
+			       expr->prefix_len - i * BITS_PER_BYTE : 0;
+			if (bits >= BITS_PER_BYTE)
+				range->hi[i] = range->lo[i];
+			else {
+				range->lo[i] &= ~(0xff >> bits);
+				range->hi[i] = range->lo[i] | (0xff >> bits);
 			}
 		}
+		return true;
+	case EXPR_RANGE:
+		if (!symbol_literal(expr->left, range->lo, &range->len) ||
+		    !symbol_literal(expr->right, range->hi, &len) ||
+		    len != range->len)
+			return false;
+		return true;
+	default:
+		break;
+	}
 
-		j = merge[k].num_rules - 1;
-		merge_rules(ctx, i, i + j, &merge[k], &nft->output);
+	return false;
+}
+
+static bool literal_ranges_disjoint(const struct literal_range *a,
+				    const struct literal_range *b)
+{
+	if (a->len != b->len)
+		return false;
+
+	return memcmp(a->hi, b->lo, a->len) < 0 ||
+	       memcmp(b->hi, a->lo, a->len) < 0;
+}
+
+/* Collect the literal intervals of @expr, a single value or a set. */
+static int expr_literal_ranges(const struct expr *expr,
+			       struct literal_range *range)
+{
+	const struct expr *i;
+	int n = 0;
+
+	if (expr->etype != EXPR_SET)
+		return expr_literal_range(expr, range) ? 1 : -1;
+
+	list_for_each_entry(i, &expr->expressions, list) {
+		if (n == LITERAL_SET_MAX ||
+		    i->etype != EXPR_SET_ELEM ||
+		    !expr_literal_range(i->key, &range[n]))
+			return -1;
+		n++;
 	}
-	ret = 0;
-	for (i = 0; i < ctx->num_rules; i++)
-		free(ctx->stmt_matrix[i]);
 
-	free(ctx->stmt_matrix);
-	free(merge);
-err:
-	for (i = 0; i < ctx->num_stmts; i++)
-		stmt_free(ctx->stmt[i]);
+	return n;
+}
 
-	free(ctx->rule);
-	free(ctx);
+/*
+ * Values are not evaluated yet, so only literals can be told apart:
+ * numbers, addresses, address prefixes and ranges, and sets of those.
+ */
+static bool expr_value_distinct(const struct expr *a, const struct expr *b)
+{
+	struct literal_range range_a[LITERAL_SET_MAX], range_b[LITERAL_SET_MAX];
+	int num_a, num_b, i, j;
 
-	return ret;
+	if (a->etype == EXPR_VALUE && b->etype == EXPR_VALUE)
+		return a->dtype == b->dtype && a->len == b->len &&
+		       mpz_cmp(a->value, b->value) != 0;
+
+	num_a = expr_literal_ranges(a, range_a);
+	if (num_a <= 0)
+		return false;
+	num_b = expr_literal_ranges(b, range_b);
+	if (num_b <= 0)
+		return false;
+
+	for (i = 0; i < num_a; i++) {
+		for (j = 0; j < num_b; j++) {
+			if (!literal_ranges_disjoint(&range_a[i], &range_b[j]))
+				return false;
+		}
+	}
+
+	return true;
 }
 
-static int cmd_optimize(struct nft_ctx *nft, struct cmd *cmd)
+static bool rules_disjoint(const struct rule *rule_a, const struct rule *rule_b)
 {
-	struct table *table;
-	struct chain *chain;
-	int ret = 0;
+	const struct stmt *stmt_a, *stmt_b;
 
-	switch (cmd->obj) {
-	case CMD_OBJ_TABLE:
-		table = cmd->table;
-		if (!table)
+	list_for_each_entry(stmt_a, &rule_a->stmts, list) {
+		if (stmt_a->ops->type != STMT_EXPRESSION)
 			break;
+		if (!expr_selects_value(stmt_a->expr))
+			continue;
 
-		list_for_each_entry(chain, &table->chains, list) {
-			if (chain->flags & CHAIN_F_HW_OFFLOAD)
+		list_for_each_entry(stmt_b, &rule_b->stmts, list) {
+			if (stmt_b->ops->type != STMT_EXPRESSION)
+				break;
+			if (!expr_selects_value(stmt_b->expr))
 				continue;
 
-			chain_optimize(nft, &chain->rules);
+			if (__expr_cmp(stmt_a->expr->left, stmt_b->expr->left) &&
+			    expr_value_distinct(stmt_a->expr->right,
+						stmt_b->expr->right))
+				return true;
 		}
-		break;
-	default:
-		break;
 	}
 
-	return ret;
+	return false;
 }
 
-int nft_optimize(struct nft_ctx *nft, struct list_head *cmds)
+static bool rules_independent(const struct optimize_ctx *ctx,
+			      const struct reorder_ctx *rctx,
+			      uint32_t k, uint32_t j)
 {
-	struct cmd *cmd;
-	int ret = 0;
+	if (rctx->class[k] == REORDER_FIXED ||
+	    rctx->class[j] == REORDER_FIXED)
+		return false;
 
-	list_for_each_entry(cmd, cmds, list) {
-		switch (cmd->op) {
-		case CMD_ADD:
-			ret = cmd_optimize(nft, cmd);
+	if (rctx->class[k] == rctx->class[j] &&
+	    rctx->class[j] != REORDER_SIMPLE)
+		return true;
+
+	return rules_disjoint(ctx->rule[k], ctx->rule[j]);
+}
+
+/* Can rule @j be moved up to @first, the first rule of its target group? */
+static bool rule_can_move(const struct optimize_ctx *ctx,
+			  const struct reorder_ctx *rctx,
+			  uint32_t first, uint32_t j)
+{
+	uint32_t c, k, lo, hi, mid, scanned = 0;
+
+	for (c = 0; c < __REORDER_MAX; c++) {
+		/* same verdict, no need to look at these. */
+		if (c == rctx->class[j] && c != REORDER_SIMPLE &&
+		    c != REORDER_FIXED)
+			continue;
+
+		lo = 0;
+		hi = rctx->num_pos[c];
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (rctx->pos[c][mid] <= first)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (; lo < rctx->num_pos[c]; lo++) {
+			k = rctx->pos[c][lo];
+			if (k >= j)
+				break;
+			if (++scanned > REORDER_SCAN_MAX)
+				return false;
+
+			/* rule @k stays above the target group. */
+			if (rctx->group[rctx->group_of[k]].first <= first)
+				continue;
+
+			if (!rules_independent(ctx, rctx, k, j))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static uint32_t rule_stmt_mask(const struct optimize_ctx *ctx, uint32_t i)
+{
+	uint32_t k, mask = 0;
+
+	for (k = 0; k < ctx->num_stmts; k++) {
+		if (ctx->stmt_matrix[i][k])
+			mask |= 1U << k;
+	}
+
+	return mask;
+}
+
+/*
+ * Members of a group end up as elements of the same set or map, which has
+ * no notion of order. That is fine as long as they share the verdict,
+ * otherwise @j must not overlap with any rule already in the group.
+ */
+static bool rule_group_disjoint(const struct optimize_ctx *ctx,
+				const struct reorder_ctx *rctx,
+				const struct reorder_group *group, uint32_t j)
+{
+	uint32_t k, n;
+
+	if (rctx->class[group->first] == rctx->class[j] &&
+	    rctx->class[j] != REORDER_SIMPLE)
+		return true;
+
+	for (k = group->first, n = 0; ; k = rctx->member_next[k]) {
+		if (++n > REORDER_SCAN_MAX ||
+		    !rules_disjoint(ctx->rule[k], ctx->rule[j]))
+			return false;
+		if (k == group->last)
+			break;
+	}
+
+	return true;
+}
+
+static void reorder_group_rule(const struct optimize_ctx *ctx,
+			       struct reorder_ctx *rctx, uint32_t j)
+{
+	uint32_t mask = rule_stmt_mask(ctx, j), hash, probes = 0;
+	struct reorder_group *group;
+	enum reorder_class class;
+	int32_t g;
+
+	hash = (mask * 2654435761U) % REORDER_HSIZE;
+
+	for (g = rctx->bucket[hash]; g >= 0; g = rctx->group[g].next) {
+		group = &rctx->group[g];
+		if (group->mask != mask)
+			continue;
+		if (++probes > REORDER_PROBE_MAX)
+			break;
+
+		if (!rules_eq(ctx, group->first, j) ||
+		    !rule_can_move(ctx, rctx, group->first, j) ||
+		    !rule_group_disjoint(ctx, rctx, group, j))
+			continue;
+
+		rctx->member_next[group->last] = j;
+		group->last = j;
+		group->num++;
+		goto out;
+	}
+
+	g = rctx->num_groups++;
+	group = &rctx->group[g];
+	group->first = j;
+	group->last = j;
+	group->num = 1;
+	group->mask = mask;
+	group->next = rctx->bucket[hash];
+	rctx->bucket[hash] = g;
+out:
+	rctx->group_of[j] = g;
+	class = rctx->class[j];
+	rctx->pos[class][rctx->num_pos[class]++] = j;
+}
+
+static void merge_stmts_infer(const struct optimize_ctx *ctx, uint32_t i,
+			      struct merge *merge)
+{
+	uint32_t m;
+
+	for (m = 0; m < ctx->num_stmts; m++) {
+		if (!ctx->stmt_matrix[i][m])
+			continue;
+		switch (ctx->stmt_matrix[i][m]->ops->type) {
+		case STMT_EXPRESSION:
+			merge->stmt[merge->num_stmts++] = m;
+			break;
+		case STMT_VERDICT:
+			if (ctx->stmt_matrix[i][m]->expr->etype == EXPR_MAP)
+				merge->stmt[merge->num_stmts++] = m;
 			break;
 		default:
 			break;
 		}
 	}
+}
+
+static void chain_reorder_merge(struct nft_ctx *nft, struct optimize_ctx *ctx)
+{
+	struct optimize_ctx *gctx;
+	struct reorder_ctx *rctx;
+	struct reorder_group *group;
+	struct merge merge;
+	uint32_t g, i, r;
+
+	if (ctx->num_rules < 2)
+		return;
+
+	rctx = xzalloc(sizeof(*rctx));
+	rctx->class = xmalloc_array(ctx->num_rules, sizeof(*rctx->class));
+	rctx->group_of = xmalloc_array(ctx->num_rules, sizeof(*rctx->group_of));
+	rctx->member_next = xmalloc_array(ctx->num_rules,
+					  sizeof(*rctx->member_next));
+	rctx->group = xmalloc_array(ctx->num_rules, sizeof(*rctx->group));
+	for (i = 0; i < __REORDER_MAX; i++)
+		rctx->pos[i] = xmalloc_array(ctx->num_rules,
+					     sizeof(*rctx->pos[i]));
+	for (i = 0; i < REORDER_HSIZE; i++)
+		rctx->bucket[i] = -1;
+
+	for (i = 0; i < ctx->num_rules; i++)
+		rctx->class[i] = rule_reorder_class(ctx->rule[i]);
+
+	for (i = 0; i < ctx->num_rules; i++)
+		reorder_group_rule(ctx, rctx, i);
+
+	/* Groups are numbered by their first rule, merge in chain order. */
+	gctx = xzalloc(sizeof(*gctx));
+	memcpy(gctx->stmt, ctx->stmt, sizeof(ctx->stmt));
+	gctx->num_stmts = ctx->num_stmts;
+	gctx->rule = xmalloc_array(ctx->num_rules, sizeof(*gctx->rule));
+	gctx->stmt_matrix = xmalloc_array(ctx->num_rules,
+					  sizeof(*gctx->stmt_matrix));
+
+	for (g = 0; g < rctx->num_groups; g++) {
+		group = &rctx->group[g];
+		if (group->num < 2)
+			continue;
+
+		for (i = 0, r = group->first; i < group->num; i++) {
+			gctx->rule[i] = ctx->rule[r];
+			gctx->stmt_matrix[i] = ctx->stmt_matrix[r];
+			r = rctx->member_next[r];
+		}
+		gctx->num_rules = group->num;
+
+		memset(&merge, 0, sizeof(merge));
+		merge.num_rules = group->num;
+		merge_stmts_infer(gctx, 0, &merge);
+		merge_rules(gctx, 0, group->num - 1, &merge, &nft->output);
+	}
+
+	free(gctx->stmt_matrix);
+	free(gctx->rule);
+	free(gctx);
+
+	for (i = 0; i < __REORDER_MAX; i++)
+		free(rctx->pos[i]);
+	free(rctx->group);
+	free(rctx->member_next);
+	free(rctx->group_of);
+	free(rctx->class);
+	free(rctx);
+}
+
+/*
+ * Shadowed rules: a rule is never reached if an earlier rule ends in a
+ * terminal verdict and matches every packet the later rule matches, that
+ * is, each of its matches is implied by a match in the later rule. Such
+ * rules, duplicates included, are removed before merging. As in reorder
+ * mode, any rule that may modify the packet in between cuts the search,
+ * and called chains are assumed not to rewrite the selectors.
+ */
+#define SHADOW_SCAN_MAX		1024
+
+static bool rule_is_terminal(const struct rule *rule)
+{
+	const struct stmt *stmt;
+
+	if (list_empty(&rule->stmts) ||
+	    rule_reorder_class(rule) == REORDER_FIXED)
+		return false;
+
+	stmt = list_last_entry(&rule->stmts, struct stmt, list);
+	switch (stmt->ops->type) {
+	case STMT_REJECT:
+	case STMT_NAT:
+		return true;
+	case STMT_VERDICT:
+		if (stmt->expr->etype != EXPR_VERDICT)
+			return false;
+
+		switch (stmt->expr->verdict) {
+		case NF_ACCEPT:
+		case NF_DROP:
+		case NFT_GOTO:
+			return true;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/* Does the single value @a match every packet that @b matches? */
+static bool expr_elem_covers(const struct expr *a, const struct expr *b)
+{
+	struct literal_range range_a, range_b;
+
+	if (a == b)
+		return true;
+
+	if (a->etype == EXPR_SYMBOL && b->etype == EXPR_SYMBOL &&
+	    a->symtype == b->symtype && !strcmp(a->identifier, b->identifier))
+		return true;
+
+	if (a->etype == EXPR_VALUE && b->etype == EXPR_VALUE)
+		return a->dtype == b->dtype && a->len == b->len &&
+		       !mpz_cmp(a->value, b->value);
+
+	if (!expr_literal_range(a, &range_a) ||
+	    !expr_literal_range(b, &range_b) ||
+	    range_a.len != range_b.len)
+		return false;
+
+	return memcmp(range_a.lo, range_b.lo, range_a.len) <= 0 &&
+	       memcmp(range_b.hi, range_a.hi, range_a.len) <= 0;
+}
+
+static const struct expr *expr_elem_key(const struct expr *expr)
+{
+	return expr->etype == EXPR_SET_ELEM ? expr->key : expr;
+}
+
+static bool expr_value_covers(const struct expr *a, const struct expr *b)
+{
+	const struct expr *elem_a, *elem_b;
+	bool covered;
+
+	if (b->etype != EXPR_SET) {
+		if (a->etype != EXPR_SET)
+			return expr_elem_covers(a, b);
+
+		list_for_each_entry(elem_a, &a->expressions, list) {
+			if (expr_elem_covers(expr_elem_key(elem_a), b))
+				return true;
+		}
+		return false;
+	}
+
+	list_for_each_entry(elem_b, &b->expressions, list) {
+		covered = false;
+		if (a->etype != EXPR_SET) {
+			covered = expr_elem_covers(a, expr_elem_key(elem_b));
+		} else {
+			list_for_each_entry(elem_a, &a->expressions, list) {
+				if (expr_elem_covers(expr_elem_key(elem_a),
+						     expr_elem_key(elem_b))) {
+					covered = true;
+					break;
+				}
+			}
+		}
+		if (!covered)
+			return false;
+	}
+
+	return true;
+}
+
+static bool expr_match_covers(const struct expr *a, const struct expr *b)
+{
+	if (a->etype != EXPR_RELATIONAL || b->etype != EXPR_RELATIONAL)
+		return false;
+
+	/* __expr_cmp() does not look at the mask of binary operations. */
+	if (a->left->etype == EXPR_BINOP || !__expr_cmp(a->left, b->left))
+		return false;
+
+	if (expr_selects_value(a) && expr_selects_value(b))
+		return expr_value_covers(a->right, b->right);
+
+	return a->op == b->op &&
+	       a->right->etype != EXPR_SET && b->right->etype != EXPR_SET &&
+	       expr_elem_covers(a->right, b->right) &&
+	       expr_elem_covers(b->right, a->right);
+}
+
+static bool rule_covers(const struct rule *rule_a, const struct rule *rule_b)
+{
+	const struct stmt *stmt_a, *stmt_b;
+	bool covered;
+
+	list_for_each_entry(stmt_a, &rule_a->stmts, list) {
+		if (stmt_a->ops->type != STMT_EXPRESSION)
+			break;
+
+		covered = false;
+		list_for_each_entry(stmt_b, &rule_b->stmts, list) {
+			if (stmt_b->ops->type != STMT_EXPRESSION)
+				break;
+
+			if (expr_match_covers(stmt_a->expr, stmt_b->expr)) {
+				covered = true;
+				break;
+			}
+		}
+		if (!covered)
+			return false;
+	}
+
+	return true;
+}
+
+static void chain_remove_shadowed(struct nft_ctx *nft, struct list_head *rules)
+{
+	struct output_ctx *octx = &nft->output;
+	struct rule *rule, *next, **terminal;
+	uint32_t num_terminal = 0, i;
+
+	terminal = xmalloc_array(SHADOW_SCAN_MAX, sizeof(*terminal));
+
+	list_for_each_entry_safe(rule, next, rules, list) {
+		for (i = 0; i < num_terminal; i++) {
+			if (!rule_covers(terminal[i], rule))
+				continue;
+
+			fprintf(octx->error_fp, "Removing:\n");
+			rule_optimize_print(octx, rule);
+			fprintf(octx->error_fp, "shadowed by:\n");
+			rule_optimize_print(octx, terminal[i]);
+
+			list_del(&rule->list);
+			rule_free(rule);
+			break;
+		}
+		if (i < num_terminal)
+			continue;
+
+		if (rule_reorder_class(rule) == REORDER_FIXED)
+			num_terminal = 0;
+		else if (rule_is_terminal(rule) && num_terminal < SHADOW_SCAN_MAX)
+			terminal[num_terminal++] = rule;
+	}
+
+	free(terminal);
+}
+
+/*
+ * With --optimize-sets, rules are folded into the named set or verdict map
+ * of an earlier rule in the same chain:
+ *
+ *	ip saddr @blocklist drop
+ *	...
+ *	ip saddr 10.0.0.1 drop
+ *
+ * the latter becomes an element of @blocklist. The set must be declared in
+ * the same table block, with a key of the same type as the selector, and
+ * not be used by any other rule of the table. As in reorder mode, the rules
+ * in between must not tell the packets of the folded rule apart.
+ */
+struct fold_target {
+	struct set		*set;
+	const struct expr	*key;
+	/* NULL for verdict maps */
+	const struct expr	*verdict;
+	uint32_t		pos;
+};
+
+static bool expr_may_ref_set(const struct expr *expr, const char *name)
+{
+	const struct expr *i;
+
+	if (!expr)
+		return false;
+
+	switch (expr->etype) {
+	case EXPR_SYMBOL:
+		return expr->symtype == SYMBOL_SET &&
+		       !strcmp(expr->identifier, name);
+	case EXPR_VARIABLE:
+		return true;
+	case EXPR_VERDICT:
+		return expr_may_ref_set(expr->chain, name);
+	case EXPR_PREFIX:
+		return expr_may_ref_set(expr->prefix, name);
+	case EXPR_UNARY:
+		return expr_may_ref_set(expr->arg, name);
+	case EXPR_SET_ELEM:
+		return expr_may_ref_set(expr->key, name);
+	case EXPR_HASH:
+		return expr_may_ref_set(expr->hash.expr, name);
+	case EXPR_RANGE:
+	case EXPR_BINOP:
+	case EXPR_MAPPING:
+	case EXPR_RELATIONAL:
+		return expr_may_ref_set(expr->left, name) ||
+		       expr_may_ref_set(expr->right, name);
+	case EXPR_MAP:
+		return expr_may_ref_set(expr->map, name) ||
+		       expr_may_ref_set(expr->mappings, name);
+	case EXPR_CONCAT:
+	case EXPR_LIST:
+	case EXPR_SET:
+		list_for_each_entry(i, &expr->expressions, list) {
+			if (expr_may_ref_set(i, name))
+				return true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/* Statements that are not looked into are assumed to use the set. */
+static bool stmt_may_ref_set(const struct stmt *stmt, const char *name)
+{
+	switch (stmt->ops->type) {
+	case STMT_EXPRESSION:
+	case STMT_VERDICT:
+		return expr_may_ref_set(stmt->expr, name);
+	case STMT_PAYLOAD:
+		return expr_may_ref_set(stmt->payload.val, name);
+	case STMT_META:
+		return expr_may_ref_set(stmt->meta.expr, name);
+	case STMT_CT:
+		return expr_may_ref_set(stmt->ct.expr, name);
+	case STMT_NAT:
+		return expr_may_ref_set(stmt->nat.addr, name) ||
+		       expr_may_ref_set(stmt->nat.proto, name);
+	case STMT_OBJREF:
+		return expr_may_ref_set(stmt->objref.expr, name);
+	case STMT_SET:
+		return expr_may_ref_set(stmt->set.set, name) ||
+		       expr_may_ref_set(stmt->set.key, name);
+	case STMT_MAP:
+		return expr_may_ref_set(stmt->map.set, name) ||
+		       expr_may_ref_set(stmt->map.key, name) ||
+		       expr_may_ref_set(stmt->map.data, name);
+	case STMT_COUNTER:
+	case STMT_LIMIT:
+	case STMT_LOG:
+	case STMT_REJECT:
+	case STMT_QUOTA:
+	case STMT_NOTRACK:
+	case STMT_CONNLIMIT:
+	case STMT_FLOW_OFFLOAD:
+	case STMT_SYNPROXY:
+	case STMT_OPTSTRIP:
+	case STMT_LAST:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/* Is @set used by any rule of @table other than @user? */
+static bool set_has_other_users(const struct table *table,
+				const struct set *set,
+				const struct rule *user)
+{
+	const struct chain *chain;
+	const struct rule *rule;
+	const struct stmt *stmt;
+
+	list_for_each_entry(chain, &table->chains, list) {
+		list_for_each_entry(rule, &chain->rules, list) {
+			if (rule == user)
+				continue;
+
+			list_for_each_entry(stmt, &rule->stmts, list) {
+				if (stmt_may_ref_set(stmt, set->handle.set.name))
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static struct set *fold_set_lookup(const struct table *table,
+				   const struct expr *ref)
+{
+	struct set *set;
+
+	if (ref->etype != EXPR_SYMBOL || ref->symtype != SYMBOL_SET)
+		return NULL;
+
+	list_for_each_entry(set, &table->sets, list) {
+		if (!strcmp(set->handle.set.name, ref->identifier))
+			return set;
+	}
+
+	return NULL;
+}
+
+static bool fold_key_eq(const struct expr *key, const struct expr *selector)
+{
+	if (key->etype == EXPR_VALUE)
+		return selector->dtype && selector->dtype == key->dtype;
+
+	return __expr_cmp(key, selector);
+}
+
+/* "selector value verdict", returns the match statement. */
+static struct stmt *rule_fold_source(const struct rule *rule)
+{
+	struct stmt *match, *verdict;
+
+	if (rule->num_stmts != 2)
+		return NULL;
+
+	match = list_first_entry(&rule->stmts, struct stmt, list);
+	verdict = list_last_entry(&rule->stmts, struct stmt, list);
+	if (match->ops->type != STMT_EXPRESSION ||
+	    verdict->ops->type != STMT_VERDICT ||
+	    verdict->expr->etype != EXPR_VERDICT ||
+	    match->expr->etype != EXPR_RELATIONAL ||
+	    (match->expr->op != OP_IMPLICIT && match->expr->op != OP_EQ) ||
+	    !stmt_expr_supported(match->expr->left))
+		return NULL;
+
+	return match;
+}
+
+/* "selector @set verdict" or "selector vmap @map". */
+static bool rule_fold_target(const struct table *table, struct rule *rule,
+			     struct fold_target *target)
+{
+	const struct stmt *stmt;
+	struct set *set;
+
+	stmt = list_first_entry(&rule->stmts, struct stmt, list);
+	if (rule->num_stmts == 1 && stmt->ops->type == STMT_VERDICT &&
+	    stmt->expr->etype == EXPR_MAP) {
+		set = fold_set_lookup(table, stmt->expr->mappings);
+		if (!set || !(set->flags & NFT_SET_MAP) ||
+		    !set->data || set->data->dtype != &verdict_type)
+			return false;
+
+		target->key = stmt->expr->map;
+		target->verdict = NULL;
+	} else if (rule_fold_source(rule)) {
+		set = fold_set_lookup(table, stmt->expr->right);
+		if (!set || set->flags & (NFT_SET_MAP | NFT_SET_OBJECT))
+			return false;
+
+		target->key = stmt->expr->left;
+		target->verdict = list_last_entry(&rule->stmts, struct stmt,
+						  list)->expr;
+	} else {
+		return false;
+	}
+
+	if (!set->key || !fold_key_eq(set->key, target->key) ||
+	    set_has_other_users(table, set, rule))
+		return false;
+
+	target->set = set;
+	return true;
+}
+
+static bool fold_value_ok(const struct expr *expr, bool interval)
+{
+	const struct expr *i;
+
+	switch (expr->etype) {
+	case EXPR_SYMBOL:
+		return expr->symtype == SYMBOL_VALUE;
+	case EXPR_VALUE:
+		return true;
+	case EXPR_PREFIX:
+	case EXPR_RANGE:
+		return interval;
+	case EXPR_SET_ELEM:
+		return fold_value_ok(expr->key, interval);
+	case EXPR_SET:
+		list_for_each_entry(i, &expr->expressions, list) {
+			if (i->etype != EXPR_SET_ELEM ||
+			    !fold_value_ok(i, interval))
+				return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Keys that may already be in a map or an interval set are left alone,
+ * they would clash with the existing element.
+ */
+static bool fold_value_new(const struct set *set, const struct expr *value)
+{
+	const struct expr *i, *key;
+
+	if (!set->init ||
+	    (!(set->flags & (NFT_SET_MAP | NFT_SET_INTERVAL))))
+		return true;
+
+	list_for_each_entry(i, &set->init->expressions, list) {
+		key = i->etype == EXPR_MAPPING ? i->left : i;
+		if (key->etype == EXPR_SET_ELEM)
+			key = key->key;
+
+		if (!expr_value_distinct(key, value))
+			return false;
+	}
+
+	return true;
+}
+
+static void fold_elem_add(struct set *set, struct expr *elem,
+			  struct expr *verdict)
+{
+	if (set->flags & NFT_SET_MAP)
+		elem = mapping_expr_alloc(&elem->location, elem,
+					  expr_get(verdict));
+
+	compound_expr_add(set->init, elem);
+}
+
+static void fold_rule(struct fold_target *target, struct rule *rule,
+		      struct stmt *match)
+{
+	struct expr *value = match->expr->right, *elem, *next, *verdict;
+	struct set *set = target->set;
+
+	verdict = list_last_entry(&rule->stmts, struct stmt, list)->expr;
+	if (!set->init)
+		set->init = set_expr_alloc(&rule->location, NULL);
+
+	if (value->etype == EXPR_SET) {
+		list_for_each_entry_safe(elem, next, &value->expressions, list) {
+			compound_expr_remove(value, elem);
+			fold_elem_add(set, elem, verdict);
+		}
+		return;
+	}
+
+	elem = set_elem_expr_alloc(&value->location, expr_get(value));
+	if (rule->comment)
+		elem->comment = xstrdup(rule->comment);
+
+	fold_elem_add(set, elem, verdict);
+}
+
+static void chain_fold_sets(struct nft_ctx *nft, const struct table *table,
+			    struct list_head *rules)
+{
+	struct output_ctx *octx = &nft->output;
+	struct fold_target *target = NULL;
+	uint32_t num_rules = 0, num_targets = 0, i, j, k;
+	enum reorder_class *class;
+	struct optimize_ctx ctx = {};
+	struct reorder_ctx rctx = {};
+	struct rule *rule, **folded;
+	const struct expr *value;
+	struct stmt *match;
+	bool interval;
+
+	list_for_each_entry(rule, rules, list)
+		num_rules++;
+	if (num_rules < 2)
+		return;
+
+	ctx.rule = xmalloc_array(num_rules, sizeof(*ctx.rule));
+	class = xmalloc_array(num_rules, sizeof(*class));
+	folded = xzalloc_array(num_rules, sizeof(*folded));
+	target = xmalloc_array(num_rules, sizeof(*target));
+	rctx.class = class;
+
+	i = 0;
+	list_for_each_entry(rule, rules, list) {
+		ctx.rule[i] = rule;
+		class[i] = rule_reorder_class(rule);
+		i++;
+	}
+
+	for (j = 0; j < num_rules; j++) {
+		rule = ctx.rule[j];
+		if (rule_fold_target(table, rule, &target[num_targets])) {
+			target[num_targets++].pos = j;
+			continue;
+		}
+
+		match = rule_fold_source(rule);
+		if (!match || class[j] == REORDER_FIXED)
+			continue;
+
+		/* the closest earlier rule on the same selector */
+		for (i = num_targets; i-- > 0; ) {
+			if (__expr_cmp(target[i].key, match->expr->left))
+				break;
+		}
+		if (i == UINT32_MAX || j - target[i].pos > REORDER_SCAN_MAX)
+			continue;
+
+		if (target[i].verdict &&
+		    !expr_verdict_eq(target[i].verdict,
+				     list_last_entry(&rule->stmts, struct stmt,
+						     list)->expr))
+			continue;
+
+		value = match->expr->right;
+		interval = target[i].set->flags & NFT_SET_INTERVAL;
+		if (!fold_value_ok(value, interval) ||
+		    !fold_value_new(target[i].set, value))
+			continue;
+
+		for (k = target[i].pos + 1; k < j; k++) {
+			if (!folded[k] && !rules_independent(&ctx, &rctx, k, j))
+				break;
+		}
+		if (k < j)
+			continue;
+
+		fprintf(octx->error_fp, "Merging:\n");
+		rule_optimize_print(octx, rule);
+		fprintf(octx->error_fp, "into @%s of:\n",
+			target[i].set->handle.set.name);
+		rule_optimize_print(octx, ctx.rule[target[i].pos]);
+
+		fold_rule(&target[i], rule, match);
+		folded[j] = rule;
+	}
+
+	for (j = 0; j < num_rules; j++) {
+		if (!folded[j])
+			continue;
+
+		list_del(&folded[j]->list);
+		rule_free(folded[j]);
+	}
+
+	free(target);
+	free(folded);
+	free(class);
+	free(ctx.rule);
+}
+
+/*
+ * With --profile-guided, the counters in the input, as printed by "nft list
+ * ruleset", tell how often each rule matched. Runs of rules that may be
+ * swapped as in reorder mode are sorted by packet count, hottest first.
+ * Rules with counters are never in the same accept or drop class, so each
+ * pair in a run must be disjoint. Rules without a counter stay in place and
+ * end the run.
+ */
+#define PROFILE_RUN_MAX		64
+
+static bool rule_packets(const struct rule *rule, uint64_t *packets)
+{
+	const struct stmt *stmt;
+
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (stmt->ops->type == STMT_COUNTER) {
+			*packets = stmt->counter.packets;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void profile_sort_run(struct output_ctx *octx, struct rule **rule,
+			     uint64_t *packets, uint32_t from, uint32_t to)
+{
+	bool moved = false;
+	struct rule *tmp;
+	uint64_t count;
+	uint32_t i, k;
+
+	/* insertion sort, runs are short and equal counts keep their order. */
+	for (i = from + 1; i < to; i++) {
+		tmp = rule[i];
+		count = packets[i];
+		for (k = i; k > from && packets[k - 1] < count; k--) {
+			rule[k] = rule[k - 1];
+			packets[k] = packets[k - 1];
+		}
+		if (k == i)
+			continue;
+
+		rule[k] = tmp;
+		packets[k] = count;
+		moved = true;
+	}
+
+	if (!moved)
+		return;
+
+	fprintf(octx->error_fp, "Reordering by packet count:\n");
+	for (i = from; i < to; i++)
+		rule_optimize_print(octx, rule[i]);
+}
+
+static void chain_profile_reorder(struct nft_ctx *nft, struct list_head *rules)
+{
+	struct optimize_ctx ctx = {};
+	struct reorder_ctx rctx = {};
+	enum reorder_class *class;
+	uint32_t num_rules = 0, from, i, k;
+	struct rule *rule, *next;
+	uint64_t *packets;
+	bool counted;
+
+	list_for_each_entry(rule, rules, list)
+		num_rules++;
+	if (num_rules < 2)
+		return;
+
+	ctx.rule = xmalloc_array(num_rules, sizeof(*ctx.rule));
+	class = xmalloc_array(num_rules, sizeof(*class));
+	packets = xmalloc_array(num_rules, sizeof(*packets));
+	rctx.class = class;
+
+	i = 0;
+	list_for_each_entry(rule, rules, list) {
+		ctx.rule[i] = rule;
+		class[i] = rule_reorder_class(rule);
+		i++;
+	}
+
+	for (i = 0, from = 0; i < num_rules; i++) {
+		counted = rule_packets(ctx.rule[i], &packets[i]);
+		if (!counted || class[i] == REORDER_FIXED) {
+			profile_sort_run(&nft->output, ctx.rule, packets,
+					 from, i);
+			from = i + 1;
+			continue;
+		}
+
+		for (k = from; k < i; k++) {
+			if (!rules_independent(&ctx, &rctx, k, i))
+				break;
+		}
+		if (k < i || i - from == PROFILE_RUN_MAX) {
+			profile_sort_run(&nft->output, ctx.rule, packets,
+					 from, i);
+			from = i;
+		}
+	}
+	profile_sort_run(&nft->output, ctx.rule, packets, from, num_rules);
+
+	list_for_each_entry_safe(rule, next, rules, list)
+		list_del(&rule->list);
+	for (i = 0; i < num_rules; i++)
+		list_add_tail(&ctx.rule[i]->list, rules);
+
+	free(packets);
+	free(class);
+	free(ctx.rule);
+}
+
+static int chain_optimize(struct nft_ctx *nft, const struct table *table,
+			  struct list_head *rules)
+{
+	struct optimize_ctx *ctx;
+	uint32_t num_merges = 0;
+	struct merge *merge;
+	uint32_t i, j, k;
+	struct rule *rule;
+	int ret;
+
+	chain_remove_shadowed(nft, rules);
+
+	if (nft->optimize_flags & NFT_OPTIMIZE_SETS)
+		chain_fold_sets(nft, table, rules);
+
+	if (nft->optimize_flags & NFT_OPTIMIZE_PROFILE)
+		chain_profile_reorder(nft, rules);
+
+	ctx = xzalloc(sizeof(*ctx));
+
+	/* Step 1: collect statements in rules */
+	list_for_each_entry(rule, rules, list) {
+		ret = rule_collect_stmts(ctx, rule);
+		if (ret < 0)
+			goto err;
+
+		ctx->num_rules++;
+	}
+
+	ctx->rule = xzalloc(sizeof(*ctx->rule) * ctx->num_rules);
+	ctx->stmt_matrix = xzalloc(sizeof(*ctx->stmt_matrix) * ctx->num_rules);
+	for (i = 0; i < ctx->num_rules; i++)
+		ctx->stmt_matrix[i] = xzalloc_array(ctx->num_stmts,
+						    sizeof(**ctx->stmt_matrix));
+
+	merge = xzalloc(sizeof(*merge) * ctx->num_rules);
+
+	/* Step 2: Build matrix of statements */
+	i = 0;
+	list_for_each_entry(rule, rules, list)
+		rule_build_stmt_matrix_stmts(ctx, rule, &i);
+
+	if (nft->optimize_flags & NFT_OPTIMIZE_REORDER) {
+		chain_reorder_merge(nft, ctx);
+		goto out;
+	}
+
+	/* Step 3: Look for common selectors for possible rule mergers */
+	for (i = 0; i < ctx->num_rules; i++) {
+		for (j = i + 1; j < ctx->num_rules; j++) {
+			if (!rules_eq(ctx, i, j)) {
+				if (merge[num_merges].num_rules > 0)
+					num_merges++;
+
+				i = j - 1;
+				break;
+			}
+			if (merge[num_merges].num_rules > 0) {
+				merge[num_merges].num_rules++;
+			} else {
+				merge[num_merges].rule_from = i;
+				merge[num_merges].num_rules = 2;
+			}
+		}
+		if (j == ctx->num_rules && merge[num_merges].num_rules > 0) {
+			num_merges++;
+			break;
+		}
+	}
+
+	/* Step 4: Infer how to merge the candidate rules */
+	for (k = 0; k < num_merges; k++) {
+		i = merge[k].rule_from;
+		merge_stmts_infer(ctx, i, &merge[k]);
+
+		j = merge[k].num_rules - 1;
+		merge_rules(ctx, i, i + j, &merge[k], &nft->output);
+	}
+out:
+	ret = 0;
+	for (i = 0; i < ctx->num_rules; i++)
+		free(ctx->stmt_matrix[i]);
+
+	free(ctx->stmt_matrix);
+	free(merge);
+err:
+	for (i = 0; i < ctx->num_stmts; i++)
+		stmt_free(ctx->stmt[i]);
+
+	free(ctx->rule);
+	free(ctx);
+
+	return ret;
+}
+
+/*
+ * Cost model for --stats: every load from the packet or its metadata,
+ * every comparison or lookup on it and every other statement is one
+ * expression, roughly what netlink_linearize.c emits for the rule.
+ */
+static void expr_load_cost(const struct expr *expr, struct chain_cost *cost)
+{
+	const struct expr *i;
+
+	switch (expr->etype) {
+	case EXPR_PAYLOAD:
+	case EXPR_EXTHDR:
+	case EXPR_META:
+	case EXPR_CT:
+	case EXPR_SOCKET:
+	case EXPR_OSF:
+	case EXPR_RT:
+	case EXPR_FIB:
+	case EXPR_XFRM:
+		cost->loads++;
+		cost->exprs++;
+		break;
+	case EXPR_CONCAT:
+		list_for_each_entry(i, &expr->expressions, list)
+			expr_load_cost(i, cost);
+		break;
+	case EXPR_BINOP:
+		expr_load_cost(expr->left, cost);
+		cost->exprs++;
+		break;
+	default:
+		cost->exprs++;
+		break;
+	}
+}
+
+static void expr_match_cost(const struct expr *expr, struct chain_cost *cost)
+{
+	switch (expr->etype) {
+	case EXPR_SET:
+	case EXPR_SET_REF:
+		cost->lookups++;
+		break;
+	default:
+		break;
+	}
+	cost->exprs++;
+}
+
+static void rule_cost(const struct rule *rule, struct chain_cost *cost)
+{
+	const struct stmt *stmt;
+
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		switch (stmt->ops->type) {
+		case STMT_EXPRESSION:
+			if (stmt->expr->etype != EXPR_RELATIONAL) {
+				cost->exprs++;
+				break;
+			}
+			expr_load_cost(stmt->expr->left, cost);
+			expr_match_cost(stmt->expr->right, cost);
+			break;
+		case STMT_VERDICT:
+			if (stmt->expr->etype == EXPR_MAP) {
+				expr_load_cost(stmt->expr->map, cost);
+				expr_match_cost(stmt->expr->mappings, cost);
+				break;
+			}
+			cost->exprs++;
+			break;
+		default:
+			cost->exprs++;
+			break;
+		}
+	}
+	cost->rules++;
+}
+
+#define CHAIN_COST_UNKNOWN	UINT_MAX
+#define CHAIN_COST_WALKING	(UINT_MAX - 1)
+
+struct chain_walk {
+	struct chain		**chain;
+	struct chain_cost	*cost;
+	uint32_t		num_chains;
+};
+
+static int chain_walk_find(const struct chain_walk *walk,
+			   const struct expr *expr)
+{
+	char name[NFT_CHAIN_MAXNAMELEN] = {};
+	uint32_t i;
+
+	if (expr->etype != EXPR_VALUE ||
+	    expr->len / BITS_PER_BYTE >= NFT_CHAIN_MAXNAMELEN)
+		return -1;
+
+	expr_chain_export(expr, name);
+	for (i = 0; i < walk->num_chains; i++) {
+		if (!strcmp(walk->chain[i]->handle.chain.name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+static unsigned int verdict_target(struct chain_walk *walk,
+				   const struct expr *expr,
+				   unsigned int (*fn)(struct chain_walk *walk,
+						      uint32_t i))
+{
+	int i;
+
+	if (expr->etype != EXPR_VERDICT || !expr->chain)
+		return 0;
+
+	i = chain_walk_find(walk, expr->chain);
+	if (i < 0)
+		return 0;
+
+	return fn(walk, i);
+}
+
+/*
+ * Only one of the chains called from a rule is entered per packet, return
+ * the largest @fn of them.
+ */
+static unsigned int rule_max_target(struct chain_walk *walk,
+				    const struct rule *rule,
+				    unsigned int (*fn)(struct chain_walk *walk,
+						       uint32_t i))
+{
+	const struct expr *mappings, *elem;
+	unsigned int worst = 0;
+	const struct stmt *stmt;
+
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (stmt->ops->type != STMT_VERDICT)
+			continue;
+
+		if (stmt->expr->etype != EXPR_MAP) {
+			worst = max(worst, verdict_target(walk, stmt->expr, fn));
+			continue;
+		}
+
+		mappings = stmt->expr->mappings;
+		if (mappings->etype != EXPR_SET)
+			continue;
+
+		list_for_each_entry(elem, &mappings->expressions, list) {
+			if (elem->etype != EXPR_MAPPING)
+				continue;
+
+			worst = max(worst, verdict_target(walk, elem->right, fn));
+		}
+	}
+
+	return worst;
+}
+
+/* Worst case number of rules a packet runs through from chain @i. */
+static unsigned int chain_worst_rules(struct chain_walk *walk, uint32_t i)
+{
+	struct chain_cost *cost = &walk->cost[i];
+	const struct rule *rule;
+	unsigned int worst = 0;
+
+	/* loops are rejected by the kernel anyway. */
+	if (cost->worst_rules == CHAIN_COST_WALKING)
+		return 0;
+	if (cost->worst_rules != CHAIN_COST_UNKNOWN)
+		return cost->worst_rules;
+
+	cost->worst_rules = CHAIN_COST_WALKING;
+	list_for_each_entry(rule, &walk->chain[i]->rules, list)
+		worst += 1 + rule_max_target(walk, rule, chain_worst_rules);
+
+	cost->worst_rules = worst;
+
+	return worst;
+}
+
+static unsigned int chain_depth(struct chain_walk *walk, uint32_t i);
+
+static unsigned int chain_target_depth(struct chain_walk *walk, uint32_t i)
+{
+	return 1 + chain_depth(walk, i);
+}
+
+/* Deepest chain a packet reaches from chain @i through jumps and gotos. */
+static unsigned int chain_depth(struct chain_walk *walk, uint32_t i)
+{
+	struct chain_cost *cost = &walk->cost[i];
+	const struct rule *rule;
+	unsigned int depth = 0;
+
+	if (cost->depth == CHAIN_COST_WALKING)
+		return 0;
+	if (cost->depth != CHAIN_COST_UNKNOWN)
+		return cost->depth;
+
+	cost->depth = CHAIN_COST_WALKING;
+	list_for_each_entry(rule, &walk->chain[i]->rules, list)
+		depth = max(depth, rule_max_target(walk, rule,
+						   chain_target_depth));
+
+	cost->depth = depth;
+
+	return depth;
+}
+
+static void table_cost(const struct table *table, struct chain_cost *cost,
+		       uint32_t num_chains)
+{
+	struct chain_walk walk = {
+		.cost		= cost,
+		.num_chains	= num_chains,
+	};
+	const struct rule *rule;
+	struct chain *chain;
+	uint32_t i = 0;
+
+	walk.chain = xmalloc_array(num_chains, sizeof(*walk.chain));
+	list_for_each_entry(chain, &table->chains, list) {
+		memset(&cost[i], 0, sizeof(cost[i]));
+		cost[i].worst_rules = CHAIN_COST_UNKNOWN;
+		cost[i].depth = CHAIN_COST_UNKNOWN;
+		list_for_each_entry(rule, &chain->rules, list)
+			rule_cost(rule, &cost[i]);
+
+		walk.chain[i++] = chain;
+	}
+
+	for (i = 0; i < num_chains; i++) {
+		chain_worst_rules(&walk, i);
+		chain_depth(&walk, i);
+	}
+
+	free(walk.chain);
+}
+
+void chain_cost_estimate(const struct table *table, const struct chain *chain,
+			 struct chain_cost *cost)
+{
+	struct chain_cost *table_costs;
+	uint32_t num_chains = 0, i = 0;
+	const struct chain *c;
+
+	list_for_each_entry(c, &table->chains, list)
+		num_chains++;
+
+	table_costs = xmalloc_array(num_chains, sizeof(*table_costs));
+	table_cost(table, table_costs, num_chains);
+
+	memset(cost, 0, sizeof(*cost));
+	list_for_each_entry(c, &table->chains, list) {
+		if (c == chain) {
+			*cost = table_costs[i];
+			break;
+		}
+		i++;
+	}
+	free(table_costs);
+}
+
+static void table_optimize(struct nft_ctx *nft, const struct cmd *cmd,
+			   struct table *table, struct list_head *stats)
+{
+	struct chain_cost *before = NULL, *after;
+	struct optimize_stats *entry;
+	uint32_t num_chains = 0, i;
+	struct chain *chain;
+
+	if (stats) {
+		list_for_each_entry(chain, &table->chains, list)
+			num_chains++;
+
+		if (num_chains > 0) {
+			before = xmalloc_array(num_chains, sizeof(*before));
+			table_cost(table, before, num_chains);
+		}
+	}
+
+	list_for_each_entry(chain, &table->chains, list) {
+		if (chain->flags & CHAIN_F_HW_OFFLOAD ||
+		    !(nft->optimize_flags & NFT_OPTIMIZE_ENABLED))
+			continue;
+
+		chain_optimize(nft, table, &chain->rules);
+	}
+
+	if (!before)
+		return;
+
+	after = xmalloc_array(num_chains, sizeof(*after));
+	table_cost(table, after, num_chains);
+
+	i = 0;
+	list_for_each_entry(chain, &table->chains, list) {
+		entry = xzalloc(sizeof(*entry));
+		entry->family = family2str(cmd->handle.family);
+		entry->table = cmd->handle.table.name;
+		entry->chain = chain->handle.chain.name;
+		if (chain->flags & CHAIN_F_BASECHAIN)
+			entry->hook = chain->hook.name;
+		entry->before = before[i];
+		entry->after = after[i];
+		list_add_tail(&entry->list, stats);
+		i++;
+	}
+
+	free(before);
+	free(after);
+}
+
+static void cost_print(struct output_ctx *octx, unsigned int before,
+		       unsigned int after)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%u -> %u", before, after);
+	nft_print(octx, " %14s", buf);
+}
+
+static void optimize_stats_print(struct output_ctx *octx,
+				 const struct list_head *stats)
+{
+	const struct optimize_stats *entry;
+	char name[256];
+
+	if (nft_output_json(octx)) {
+		optimize_stats_print_json(octx, stats);
+		return;
+	}
+
+	nft_print(octx, "%-32s %14s %14s %14s %14s %14s\n", "chain", "rules",
+		  "expressions", "loads", "lookups", "worst rules");
+
+	list_for_each_entry(entry, stats, list) {
+		snprintf(name, sizeof(name), "%s %s %s", entry->family,
+			 entry->table, entry->chain);
+		nft_print(octx, "%-32s", name);
+		cost_print(octx, entry->before.rules, entry->after.rules);
+		cost_print(octx, entry->before.exprs, entry->after.exprs);
+		cost_print(octx, entry->before.loads, entry->after.loads);
+		cost_print(octx, entry->before.lookups, entry->after.lookups);
+		cost_print(octx, entry->before.worst_rules,
+			   entry->after.worst_rules);
+		nft_print(octx, "\n");
+	}
+}
+
+static int cmd_optimize(struct nft_ctx *nft, struct cmd *cmd,
+			struct list_head *stats)
+{
+	int ret = 0;
+
+	switch (cmd->obj) {
+	case CMD_OBJ_TABLE:
+		if (!cmd->table)
+			break;
+
+		table_optimize(nft, cmd, cmd->table, stats);
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+int nft_optimize(struct nft_ctx *nft, struct list_head *cmds)
+{
+	bool print_stats = nft->optimize_flags & NFT_OPTIMIZE_STATS;
+	struct optimize_stats *entry, *next;
+	LIST_HEAD(stats);
+	struct cmd *cmd;
+	int ret = 0;
+
+	list_for_each_entry(cmd, cmds, list) {
+		switch (cmd->op) {
+		case CMD_ADD:
+			ret = cmd_optimize(nft, cmd,
+					   print_stats ? &stats : NULL);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (!print_stats)
+		return ret;
+
+	optimize_stats_print(&nft->output, &stats);
+
+	list_for_each_entry_safe(entry, next, &stats, list) {
+		list_del(&entry->list);
+		free(entry);
+	}
 
 	return ret;
 }
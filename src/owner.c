@@ -14,10 +14,45 @@
 #include <time.h>
 #include <inttypes.h>
 #include <dirent.h>
+#include <pthread.h>
 
+#include <list.h>
 #include <netlink.h>
 #include <owner.h>
 
+/*
+ * Owners are resolved in two steps: /proc/net/netlink maps the port id to
+ * the inode of the netfilter socket, then the process that holds a file
+ * descriptor for that inode is searched in /proc. Socket inodes are cached
+ * along with the process that holds them, a port id that is reused by a new
+ * socket comes with a new inode, so it is never mistaken for the previous
+ * owner. The list of sockets is read at most once per second, processes are
+ * only searched again for sockets that are not in the cache yet.
+ */
+#define OWNER_HSIZE	256
+
+struct owner_sock {
+	struct hlist_node	port_node;
+	struct hlist_node	inode_node;
+	uint32_t		portid;
+	unsigned long		inode;
+};
+
+struct owner_proc {
+	struct hlist_node	hnode;
+	unsigned long		inode;
+	/* NULL if no process was found. */
+	char			*comm;
+};
+
+static struct hlist_head owner_port_ht[OWNER_HSIZE];
+static struct hlist_head owner_inode_ht[OWNER_HSIZE];
+static struct hlist_head owner_proc_ht[OWNER_HSIZE];
+static time_t owner_sock_time;
+static bool owner_sock_valid;
+/* Listings from sessions that run in several threads. */
+static pthread_mutex_t owner_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static char *pid2name(pid_t pid)
 {
 	char procname[256], *prog;
@@ -42,20 +77,157 @@ static char *pid2name(pid_t pid)
 	return NULL;
 }
 
-static char *portid2name(pid_t pid, uint32_t portid, unsigned long inode)
+static struct owner_sock *owner_sock_find(uint32_t portid)
+{
+	struct owner_sock *sock;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(sock, pos, &owner_port_ht[portid % OWNER_HSIZE],
+			     port_node) {
+		if (sock->portid == portid)
+			return sock;
+	}
+
+	return NULL;
+}
+
+static bool owner_sock_inode(unsigned long inode)
+{
+	struct owner_sock *sock;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(sock, pos, &owner_inode_ht[inode % OWNER_HSIZE],
+			     inode_node) {
+		if (sock->inode == inode)
+			return true;
+	}
+
+	return false;
+}
+
+static struct owner_proc *owner_proc_find(unsigned long inode)
+{
+	struct owner_proc *proc;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(proc, pos, &owner_proc_ht[inode % OWNER_HSIZE],
+			     hnode) {
+		if (proc->inode == inode)
+			return proc;
+	}
+
+	return NULL;
+}
+
+static struct owner_proc *owner_proc_add(unsigned long inode, char *comm)
+{
+	struct owner_proc *proc;
+
+	proc = xmalloc(sizeof(*proc));
+	proc->inode = inode;
+	proc->comm = comm;
+	hlist_add_head(&proc->hnode, &owner_proc_ht[inode % OWNER_HSIZE]);
+
+	return proc;
+}
+
+static void owner_sock_flush(void)
+{
+	struct owner_sock *sock;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	for (i = 0; i < OWNER_HSIZE; i++) {
+		hlist_for_each_entry_safe(sock, pos, n, &owner_port_ht[i],
+					  port_node) {
+			hlist_del(&sock->port_node);
+			hlist_del(&sock->inode_node);
+			free(sock);
+		}
+	}
+	owner_sock_valid = false;
+}
+
+/* Forget about processes of sockets that are gone. */
+static void owner_proc_expire(void)
+{
+	struct owner_proc *proc;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	for (i = 0; i < OWNER_HSIZE; i++) {
+		hlist_for_each_entry_safe(proc, pos, n, &owner_proc_ht[i],
+					  hnode) {
+			if (owner_sock_inode(proc->inode))
+				continue;
+
+			hlist_del(&proc->hnode);
+			free(proc->comm);
+			free(proc);
+		}
+	}
+}
+
+static void owner_sock_load(time_t now)
+{
+	FILE *fp = fopen("/proc/net/netlink", "r");
+	struct owner_sock *sock;
+	uint32_t portid;
+	unsigned long inode;
+	int ret, prot;
+
+	owner_sock_flush();
+	if (!fp)
+		return;
+
+	for (;;) {
+		char line[256];
+
+		if (!fgets(line, sizeof(line), fp))
+			break;
+
+		ret = sscanf(line, "%*x %d %u %*x %*d %*d %*x %*d %*u %lu\n",
+			     &prot, &portid, &inode);
+
+		if (ret == EOF)
+			break;
+
+		if (ret != 3 || prot != NETLINK_NETFILTER)
+			continue;
+
+		sock = xmalloc(sizeof(*sock));
+		sock->portid = portid;
+		sock->inode = inode;
+		hlist_add_head(&sock->port_node,
+			       &owner_port_ht[portid % OWNER_HSIZE]);
+		hlist_add_head(&sock->inode_node,
+			       &owner_inode_ht[inode % OWNER_HSIZE]);
+	}
+
+	fclose(fp);
+
+	owner_proc_expire();
+	owner_sock_time = now;
+	owner_sock_valid = true;
+}
+
+/* Record this process for all netfilter sockets it holds. */
+static void owner_scan_pid(pid_t pid)
 {
 	const struct dirent *ent;
+	struct owner_proc *proc;
 	char procname[256];
+	char *comm = NULL;
 	DIR *dir;
 	int ret;
 
 	ret = snprintf(procname, sizeof(procname), "/proc/%lu/fd/", (unsigned long)pid);
 	if (ret < 0 || ret >= (int)sizeof(procname))
-		return NULL;
+		return;
 
 	dir = opendir(procname);
 	if (!dir)
-		return NULL;
+		return;
 
 	for (;;) {
 		unsigned long ino;
@@ -81,31 +253,37 @@ static char *portid2name(pid_t pid, uint32_t portid, unsigned long inode)
 		tmp[rl] = 0;
 
 		ret = sscanf(tmp, "socket:[%lu]", &ino);
-		if (ret == 1 && ino == inode) {
-			closedir(dir);
-			return pid2name(pid);
+		if (ret != 1 || !owner_sock_inode(ino))
+			continue;
+
+		proc = owner_proc_find(ino);
+		if (proc && proc->comm)
+			continue;
+
+		if (!comm) {
+			comm = pid2name(pid);
+			if (!comm)
+				break;
 		}
+
+		if (proc)
+			proc->comm = xstrdup(comm);
+		else
+			owner_proc_add(ino, xstrdup(comm));
 	}
 
 	closedir(dir);
-	return NULL;
+	free(comm);
 }
 
-static char *name_by_portid(uint32_t portid, unsigned long inode)
+static void owner_scan_all(void)
 {
 	const struct dirent *ent;
-	char *prog;
 	DIR *dir;
 
-	/* Many netlink users use their process ID to allocate the first port id. */
-	prog = portid2name(portid, portid, inode);
-	if (prog)
-		return prog;
-
-	/* no luck, search harder. */
 	dir = opendir("/proc");
 	if (!dir)
-		return NULL;
+		return;
 
 	for (;;) {
 		unsigned long pid;
@@ -122,61 +300,59 @@ static char *name_by_portid(uint32_t portid, unsigned long inode)
 		if (pid <= 1 || *end)
 			continue;
 
-		if (pid == portid) /* already tried */
-			continue;
-
-		prog = portid2name(pid, portid, inode);
-		if (prog)
-			break;
+		owner_scan_pid(pid);
 	}
 
 	closedir(dir);
-	return prog;
 }
 
-char *get_progname(uint32_t portid)
+static struct owner_proc *owner_proc_get(uint32_t portid, unsigned long inode)
 {
-	FILE *fp = fopen("/proc/net/netlink", "r");
-	uint32_t portid_check;
-	unsigned long inode;
-	int ret, prot;
-
-	if (!fp)
-		return NULL;
-
-	for (;;) {
-		char line[256];
+	struct owner_proc *proc;
 
-		if (!fgets(line, sizeof(line), fp))
-			break;
-
-		ret = sscanf(line, "%*x %d %u %*x %*d %*d %*x %*d %*u %lu\n",
-			     &prot, &portid_check, &inode);
+	/* Many netlink users use their process ID to allocate the first port id. */
+	owner_scan_pid(portid);
+	proc = owner_proc_find(inode);
+	if (proc)
+		return proc;
+
+	/* no luck, search harder, that fills in the other sockets too. */
+	owner_scan_all();
+	proc = owner_proc_find(inode);
+	if (proc)
+		return proc;
+
+	/* not visible from here, do not search again for this socket. */
+	return owner_proc_add(inode, NULL);
+}
 
-		if (ret == EOF)
-			break;
+char *get_progname(uint32_t portid, char *buf, size_t len)
+{
+	struct owner_proc *proc;
+	struct owner_sock *sock;
+	struct timespec ts;
+	char *ret = NULL;
 
-		if (ret == 3 && portid_check == portid && prot == NETLINK_NETFILTER) {
-			static uint32_t last_portid;
-			static uint32_t last_inode;
-			static char *last_program;
-			char *prog;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-			fclose(fp);
+	pthread_mutex_lock(&owner_lock);
+	if (!owner_sock_valid || owner_sock_time != ts.tv_sec)
+		owner_sock_load(ts.tv_sec);
 
-			if (last_portid == portid && last_inode == inode)
-				return last_program;
+	sock = owner_sock_find(portid);
+	if (!sock)
+		goto out;
 
-			prog = name_by_portid(portid, inode);
+	proc = owner_proc_find(sock->inode);
+	if (!proc)
+		proc = owner_proc_get(portid, sock->inode);
 
-			free(last_program);
-			last_program = prog;
-			last_portid = portid;
-			last_inode = inode;
-			return prog;
-		}
+	if (proc->comm && strlen(proc->comm) < len) {
+		strcpy(buf, proc->comm);
+		ret = buf;
 	}
+out:
+	pthread_mutex_unlock(&owner_lock);
 
-	fclose(fp);
-	return NULL;
+	return ret;
 }
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Fork-join helper for the parallel paths of the library: sorting the
+ * elements of large sets, evaluating set elements and rules, and running
+ * commands on many contexts. All of them split their work in independent
+ * tasks, numbered from zero, that are run from up to --jobs threads.
+ *
+ * Tasks are handed out one at a time from a shared counter, so a worker that
+ * is done with a cheap task picks the next one, while another one is still
+ * busy with an expensive task. The calling thread is one of the workers.
+ * Workers are started for each call and joined before returning: the library
+ * does not keep threads of its own behind the back of the application.
+ */
+
+#include <nft.h>
+
+#include <pthread.h>
+
+#include <parallel.h>
+#include <expression.h>
+#include <statement.h>
+#include <utils.h>
+
+struct nft_parallel_for {
+	void			(*fn)(void *data, unsigned int i);
+	void			*data;
+	unsigned int		num;
+	unsigned int		next;
+};
+
+static void nft_parallel_for_work(struct nft_parallel_for *pf)
+{
+	unsigned int i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED);
+		if (i >= pf->num)
+			break;
+
+		pf->fn(pf->data, i);
+	}
+}
+
+static void *nft_parallel_for_worker(void *arg)
+{
+	nft_parallel_for_work(arg);
+
+	/* expressions and statements freed by tasks land in per-thread caches. */
+	stmt_node_cache_release();
+	expr_node_cache_release();
+
+	return NULL;
+}
+
+/* Run @fn on @data for each of the @num tasks, from up to @jobs threads. */
+void nft_parallel_for(unsigned int jobs, unsigned int num,
+		      void (*fn)(void *data, unsigned int i), void *data)
+{
+	struct nft_parallel_for pf = {
+		.fn	= fn,
+		.data	= data,
+		.num	= num,
+	};
+	unsigned int i, started = 0;
+	pthread_t *threads;
+
+	if (jobs > num)
+		jobs = num;
+
+	if (jobs <= 1) {
+		for (i = 0; i < num; i++)
+			fn(data, i);
+		return;
+	}
+
+	threads = xmalloc_array(jobs - 1, sizeof(pthread_t));
+	/* fewer workers if threads are not available, never none. */
+	for (i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[started], NULL,
+				   nft_parallel_for_worker, &pf) != 0)
+			break;
+		started++;
+	}
+
+	nft_parallel_for_work(&pf);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
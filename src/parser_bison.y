@@ -43,6 +43,7 @@
 #include <parser.h>
 #include <erec.h>
 #include <sctp_chunk.h>
+#include <setelem_file.h>
 
 #include "parser_bison.h"
 
@@ -102,7 +103,6 @@ static void location_update(struct location *loc, struct location *rhs, int n)
 {
 	if (n) {
 		loc->indesc       = rhs[n].indesc;
-		loc->token_offset = rhs[1].token_offset;
 		loc->line_offset  = rhs[1].line_offset;
 		loc->first_line   = rhs[1].first_line;
 		loc->first_column = rhs[1].first_column;
@@ -110,7 +110,6 @@ static void location_update(struct location *loc, struct location *rhs, int n)
 		loc->last_column  = rhs[n].last_column;
 	} else {
 		loc->indesc       = rhs[0].indesc;
-		loc->token_offset = rhs[0].token_offset;
 		loc->line_offset  = rhs[0].line_offset;
 		loc->first_line   = loc->last_line   = rhs[0].last_line;
 		loc->first_column = loc->last_column = rhs[0].last_column;
@@ -250,6 +249,7 @@ int nft_lex(void *, void *, void *);
 		uint8_t field;
 	} tcp_kind_field;
 	struct timeout_state	*timeout_state;
+	struct set_window	*set_window;
 }
 
 %token TOKEN_EOF 0		"end of file"
@@ -315,6 +315,9 @@ int nft_lex(void *, void *, void *);
 %token SETS			"sets"
 %token SET			"set"
 %token ELEMENT			"element"
+%token FROM			"from"
+%token FORMAT			"format"
+%token BINARY			"binary"
 %token MAP			"map"
 %token MAPS			"maps"
 %token FLOWTABLE		"flowtable"
@@ -342,6 +345,12 @@ int nft_lex(void *, void *, void *);
 %token DESTROY			"destroy"
 
 %token MONITOR			"monitor"
+%token AGGREGATE		"aggregate"
+%token REPLICATE		"replicate"
+%token PROFILE			"profile"
+%token START			"start"
+%token STOP			"stop"
+%token REPORT			"report"
 
 %token ALL			"all"
 
@@ -360,6 +369,7 @@ int nft_lex(void *, void *, void *);
 %token TIMEOUT			"timeout"
 %token GC_INTERVAL		"gc-interval"
 %token ELEMENTS			"elements"
+%token MAGLEV			"maglev"
 %token EXPIRES			"expires"
 
 %token POLICY			"policy"
@@ -609,6 +619,9 @@ int nft_lex(void *, void *, void *);
 %token COUNTERS			"counters"
 %token QUOTAS			"quotas"
 %token LIMITS			"limits"
+%token TOP			"top"
+%token BY			"by"
+%token SINCE			"since"
 %token SYNPROXYS		"synproxys"
 %token HELPERS			"helpers"
 
@@ -690,6 +703,12 @@ int nft_lex(void *, void *, void *);
 
 %token XT		"xt"
 
+/* "profile" at the start of a line is the profile command, not the table of
+ * a rule that is added without "add".
+ */
+%precedence FAMILY_IMPLICIT
+%precedence PROFILE
+
 %type <limit_rate>		limit_rate_pkts
 %type <limit_rate>		limit_rate_bytes
 
@@ -704,8 +723,8 @@ int nft_lex(void *, void *, void *);
 %type <cmd>			line
 %destructor { cmd_free($$); }	line
 
-%type <cmd>			base_cmd add_cmd replace_cmd create_cmd insert_cmd delete_cmd get_cmd list_cmd reset_cmd flush_cmd rename_cmd export_cmd monitor_cmd describe_cmd import_cmd destroy_cmd
-%destructor { cmd_free($$); }	base_cmd add_cmd replace_cmd create_cmd insert_cmd delete_cmd get_cmd list_cmd reset_cmd flush_cmd rename_cmd export_cmd monitor_cmd describe_cmd import_cmd destroy_cmd
+%type <cmd>			base_cmd add_cmd replace_cmd create_cmd insert_cmd delete_cmd get_cmd list_cmd reset_cmd flush_cmd rename_cmd export_cmd monitor_cmd describe_cmd import_cmd destroy_cmd profile_cmd
+%destructor { cmd_free($$); }	base_cmd add_cmd replace_cmd create_cmd insert_cmd delete_cmd get_cmd list_cmd reset_cmd flush_cmd rename_cmd export_cmd monitor_cmd describe_cmd import_cmd destroy_cmd profile_cmd
 
 %type <handle>			table_spec tableid_spec table_or_id_spec
 %destructor { handle_free(&$$); } table_spec tableid_spec table_or_id_spec
@@ -716,6 +735,9 @@ int nft_lex(void *, void *, void *);
 %destructor { handle_free(&$$); } flowtable_spec chain_identifier ruleid_spec handle_spec position_spec rule_position ruleset_spec index_spec
 %type <handle>			set_spec setid_spec set_or_id_spec
 %destructor { handle_free(&$$); } set_spec setid_spec set_or_id_spec
+%type <set_window>		set_window
+%destructor { free($$); }	set_window
+%type <val>			set_window_by
 %type <handle>			obj_spec objid_spec obj_or_id_spec
 %destructor { handle_free(&$$); } obj_spec objid_spec obj_or_id_spec
 
@@ -856,8 +878,11 @@ int nft_lex(void *, void *, void *);
 %type <expr>			verdict_map_expr verdict_map_list_expr verdict_map_list_member_expr
 %destructor { expr_free($$); }	verdict_map_expr verdict_map_list_expr verdict_map_list_member_expr
 
+%type <val>			setelem_file_binary
 %type <expr>			set_expr set_block_expr set_list_expr set_list_member_expr flowtable_expr flowtable_list_expr flowtable_expr_member
 %destructor { expr_free($$); }	set_expr set_block_expr set_list_expr set_list_member_expr flowtable_expr flowtable_list_expr flowtable_expr_member
+%type <expr>			rule_handle_list
+%destructor { expr_free($$); }	rule_handle_list
 %type <expr>			set_elem_expr set_elem_expr_alloc set_lhs_expr set_rhs_expr
 %destructor { expr_free($$); }	set_elem_expr set_elem_expr_alloc set_lhs_expr set_rhs_expr
 %type <expr>			set_elem_expr_stmt set_elem_expr_stmt_alloc
@@ -959,6 +984,10 @@ int nft_lex(void *, void *, void *);
 %type <string>			monitor_event
 %destructor { free_const($$); }	monitor_event
 %type <val>			monitor_object	monitor_format
+%type <val>			monitor_aggregate
+%type <handle>			monitor_table
+%destructor { handle_free(&$$); } monitor_table
+%type <val>			profile_action
 
 %type <val>			synproxy_ts	synproxy_sack
 
@@ -1032,6 +1061,7 @@ close_scope_at		: { scanner_pop_start_cond(nft->scanner, PARSER_SC_AT); };
 close_scope_comp	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_EXPR_COMP); };
 close_scope_ct		: { scanner_pop_start_cond(nft->scanner, PARSER_SC_CT); };
 close_scope_counter	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_COUNTER); };
+close_scope_element	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_ELEMENT); };
 close_scope_last	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_LAST); };
 close_scope_dccp	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_EXPR_DCCP); };
 close_scope_destroy	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_CMD_DESTROY); };
@@ -1058,6 +1088,7 @@ close_scope_limit	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_LIMIT); };
 close_scope_meta	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_META); };
 close_scope_mh		: { scanner_pop_start_cond(nft->scanner, PARSER_SC_EXPR_MH); };
 close_scope_monitor	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_CMD_MONITOR); };
+close_scope_profile	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_CMD_PROFILE); };
 close_scope_nat		: { scanner_pop_start_cond(nft->scanner, PARSER_SC_STMT_NAT); };
 close_scope_numgen	: { scanner_pop_start_cond(nft->scanner, PARSER_SC_EXPR_NUMGEN); };
 close_scope_osf		: { scanner_pop_start_cond(nft->scanner, PARSER_SC_EXPR_OSF); };
@@ -1169,6 +1200,7 @@ base_cmd		:	/* empty */	add_cmd		{ $$ = $1; }
 			|       IMPORT          import_cmd	close_scope_import	{ $$ = $2; }
 			|	EXPORT		export_cmd	close_scope_export	{ $$ = $2; }
 			|	MONITOR		monitor_cmd	close_scope_monitor	{ $$ = $2; }
+			|	PROFILE		profile_cmd	close_scope_profile	{ $$ = $2; }
 			|	DESCRIBE	describe_cmd	{ $$ = $2; }
 			|	DESTROY		destroy_cmd	close_scope_destroy	{ $$ = $2; }
 			;
@@ -1218,15 +1250,29 @@ add_cmd			:	TABLE		table_spec
 				handle_merge(&$3->handle, &$2);
 				$$ = cmd_alloc(CMD_ADD, CMD_OBJ_SET, &$2, &@$, $5);
 			}
-			|	ELEMENT		set_spec	set_block_expr
+			|	ELEMENT		set_spec	close_scope_element	set_block_expr
 			{
-				if (nft_cmd_collapse_elems(CMD_ADD, state->cmds, &$2, $3)) {
+				if (nft_cmd_collapse_elems(CMD_ADD, state->cmds, &$2, $4)) {
 					handle_free(&$2);
-					expr_free($3);
+					expr_free($4);
 					$$ = NULL;
 					break;
 				}
-				$$ = cmd_alloc(CMD_ADD, CMD_OBJ_ELEMENTS, &$2, &@$, $3);
+				$$ = cmd_alloc(CMD_ADD, CMD_OBJ_ELEMENTS, &$2, &@$, $4);
+			}
+			|	ELEMENT		set_spec	FROM	QUOTED_STRING
+				FORMAT	string	setelem_file_binary	close_scope_element
+			{
+				struct expr *expr;
+
+				expr = setelem_file_load(&@4, $4, $6, $7, state->msgs);
+				free_const($4);
+				free_const($6);
+				if (!expr) {
+					handle_free(&$2);
+					YYERROR;
+				}
+				$$ = cmd_alloc(CMD_ADD, CMD_OBJ_ELEMENTS, &$2, &@$, expr);
 			}
 			|	FLOWTABLE	flowtable_spec	flowtable_block_alloc
 						'{'	flowtable_block	'}'
@@ -1302,6 +1348,11 @@ replace_cmd		:	RULE		ruleid_spec	rule
 			{
 				$$ = cmd_alloc(CMD_REPLACE, CMD_OBJ_RULE, &$2, &@$, $3);
 			}
+			|	RULE		chain_spec	HANDLE	'{'	rule_handle_list	'}'	rule
+			{
+				$$ = cmd_alloc(CMD_REPLACE, CMD_OBJ_RULE, &$2, &@$, $7);
+				$$->handles = $5;
+			}
 			;
 
 create_cmd		:	TABLE		table_spec
@@ -1341,15 +1392,15 @@ create_cmd		:	TABLE		table_spec
 				handle_merge(&$3->handle, &$2);
 				$$ = cmd_alloc(CMD_CREATE, CMD_OBJ_SET, &$2, &@$, $5);
 			}
-			|	ELEMENT		set_spec	set_block_expr
+			|	ELEMENT		set_spec	close_scope_element	set_block_expr
 			{
-				if (nft_cmd_collapse_elems(CMD_CREATE, state->cmds, &$2, $3)) {
+				if (nft_cmd_collapse_elems(CMD_CREATE, state->cmds, &$2, $4)) {
 					handle_free(&$2);
-					expr_free($3);
+					expr_free($4);
 					$$ = NULL;
 					break;
 				}
-				$$ = cmd_alloc(CMD_CREATE, CMD_OBJ_ELEMENTS, &$2, &@$, $3);
+				$$ = cmd_alloc(CMD_CREATE, CMD_OBJ_ELEMENTS, &$2, &@$, $4);
 			}
 			|	FLOWTABLE	flowtable_spec	flowtable_block_alloc
 						'{'	flowtable_block	'}'
@@ -1443,6 +1494,11 @@ delete_cmd		:	TABLE		table_or_id_spec
 			{
 				$$ = cmd_alloc(CMD_DELETE, CMD_OBJ_RULE, &$2, &@$, NULL);
 			}
+			|	RULE		chain_spec	HANDLE	'{'	rule_handle_list	'}'
+			{
+				$$ = cmd_alloc(CMD_DELETE, CMD_OBJ_RULE, &$2, &@$, NULL);
+				$$->handles = $5;
+			}
 			|	SET		set_or_id_spec
 			{
 				$$ = cmd_alloc(CMD_DELETE, CMD_OBJ_SET, &$2, &@$, NULL);
@@ -1451,9 +1507,9 @@ delete_cmd		:	TABLE		table_or_id_spec
 			{
 				$$ = cmd_alloc(CMD_DELETE, CMD_OBJ_SET, &$2, &@$, NULL);
 			}
-			|	ELEMENT		set_spec	set_block_expr
+			|	ELEMENT		set_spec	close_scope_element	set_block_expr
 			{
-				$$ = cmd_alloc(CMD_DELETE, CMD_OBJ_ELEMENTS, &$2, &@$, $3);
+				$$ = cmd_alloc(CMD_DELETE, CMD_OBJ_ELEMENTS, &$2, &@$, $4);
 			}
 			|	FLOWTABLE	flowtable_spec
 			{
@@ -1510,6 +1566,11 @@ destroy_cmd		:	TABLE		table_or_id_spec
 			{
 				$$ = cmd_alloc(CMD_DESTROY, CMD_OBJ_RULE, &$2, &@$, NULL);
 			}
+			|	RULE		chain_spec	HANDLE	'{'	rule_handle_list	'}'
+			{
+				$$ = cmd_alloc(CMD_DESTROY, CMD_OBJ_RULE, &$2, &@$, NULL);
+				$$->handles = $5;
+			}
 			|	SET		set_or_id_spec
 			{
 				$$ = cmd_alloc(CMD_DESTROY, CMD_OBJ_SET, &$2, &@$, NULL);
@@ -1518,9 +1579,9 @@ destroy_cmd		:	TABLE		table_or_id_spec
 			{
 				$$ = cmd_alloc(CMD_DESTROY, CMD_OBJ_SET, &$2, &@$, NULL);
 			}
-			|	ELEMENT		set_spec	set_block_expr
+			|	ELEMENT		set_spec	close_scope_element	set_block_expr
 			{
-				$$ = cmd_alloc(CMD_DESTROY, CMD_OBJ_ELEMENTS, &$2, &@$, $3);
+				$$ = cmd_alloc(CMD_DESTROY, CMD_OBJ_ELEMENTS, &$2, &@$, $4);
 			}
 			|	FLOWTABLE	flowtable_spec
 			{
@@ -1566,9 +1627,9 @@ destroy_cmd		:	TABLE		table_or_id_spec
 			;
 
 
-get_cmd			:	ELEMENT		set_spec	set_block_expr
+get_cmd			:	ELEMENT		set_spec	close_scope_element	set_block_expr
 			{
-				$$ = cmd_alloc(CMD_GET, CMD_OBJ_ELEMENTS, &$2, &@$, $3);
+				$$ = cmd_alloc(CMD_GET, CMD_OBJ_ELEMENTS, &$2, &@$, $4);
 			}
 			;
 
@@ -1596,9 +1657,10 @@ list_cmd		:	TABLE		table_spec
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_SETS, &$3, &@$, NULL);
 			}
-			|	SET		set_spec
+			|	SET		set_spec	set_window
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_SET, &$2, &@$, NULL);
+				$$->arg = $3;
 			}
 			|	COUNTERS	ruleset_spec
 			{
@@ -1664,6 +1726,16 @@ list_cmd		:	TABLE		table_spec
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_RULESET, &$2, &@$, NULL);
 			}
+			|	RULESET		SINCE	NUM
+			{
+				struct handle h = { .family = NFPROTO_UNSPEC };
+				uint32_t *genid;
+
+				genid = xmalloc(sizeof(*genid));
+				*genid = $3;
+				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_RULESET, &h, &@$, NULL);
+				$$->arg = genid;
+			}
 			|	FLOW TABLES	ruleset_spec
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_METERS, &$3, &@$, NULL);
@@ -1676,9 +1748,10 @@ list_cmd		:	TABLE		table_spec
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_METERS, &$2, &@$, NULL);
 			}
-			|	METER		set_spec
+			|	METER		set_spec	set_window
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_METER, &$2, &@$, NULL);
+				$$->arg = $3;
 			}
 			|       FLOWTABLES      ruleset_spec
 			{
@@ -1692,9 +1765,10 @@ list_cmd		:	TABLE		table_spec
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_MAPS, &$2, &@$, NULL);
 			}
-			|	MAP		set_spec
+			|	MAP		set_spec	set_window
 			{
 				$$ = cmd_alloc(CMD_LIST, CMD_OBJ_MAP, &$2, &@$, NULL);
+				$$->arg = $3;
 			}
 			|	CT		ct_obj_type	obj_spec	close_scope_ct
 			{
@@ -1730,6 +1804,35 @@ basehook_spec		:	ruleset_spec
 			}
 			;
 
+set_window		:	/* empty */	{ $$ = NULL; }
+			|	COUNT
+			{
+				$$ = xzalloc(sizeof(struct set_window));
+				$$->count = true;
+			}
+			|	LIMIT	NUM	close_scope_limit
+			{
+				$$ = xzalloc(sizeof(struct set_window));
+				$$->limit = $2;
+			}
+			|	LIMIT	NUM	OFFSET	NUM	close_scope_limit
+			{
+				$$ = xzalloc(sizeof(struct set_window));
+				$$->limit = $2;
+				$$->offset = $4;
+			}
+			|	TOP	NUM	BY	set_window_by
+			{
+				$$ = xzalloc(sizeof(struct set_window));
+				$$->top = $2;
+				$$->by = $4;
+			}
+			;
+
+set_window_by		:	PACKETS		{ $$ = SET_WINDOW_BY_PACKETS; }
+			|	BYTES		{ $$ = SET_WINDOW_BY_BYTES; }
+			;
+
 reset_cmd		:	COUNTERS	ruleset_spec
 			{
 				$$ = cmd_alloc(CMD_RESET, CMD_OBJ_COUNTERS, &$2, &@$, NULL);
@@ -1790,9 +1893,9 @@ reset_cmd		:	COUNTERS	ruleset_spec
 			{
 				$$ = cmd_alloc(CMD_RESET, CMD_OBJ_RULE, &$2, &@$, NULL);
 			}
-			|	ELEMENT		set_spec	set_block_expr
+			|	ELEMENT		set_spec	close_scope_element	set_block_expr
 			{
-				$$ = cmd_alloc(CMD_RESET, CMD_OBJ_ELEMENTS, &$2, &@$, $3);
+				$$ = cmd_alloc(CMD_RESET, CMD_OBJ_ELEMENTS, &$2, &@$, $4);
 			}
 			|	SET		set_or_id_spec
 			{
@@ -1869,15 +1972,27 @@ export_cmd		:	RULESET		markup_format
 			}
 			;
 
-monitor_cmd		:	monitor_event	monitor_object	monitor_format
+monitor_cmd		:	monitor_event	monitor_object	monitor_table	monitor_aggregate	monitor_format
 			{
-				struct handle h = { .family = NFPROTO_UNSPEC };
-				struct monitor *m = monitor_alloc($3, $2, $1);
+				struct monitor *m = monitor_alloc($5, $2, $1);
 				m->location = @1;
-				$$ = cmd_alloc(CMD_MONITOR, CMD_OBJ_MONITOR, &h, &@$, m);
+				m->aggregate = $4;
+				$$ = cmd_alloc(CMD_MONITOR, CMD_OBJ_MONITOR, &$3, &@$, m);
 			}
 			;
 
+profile_cmd		:	profile_action	monitor_table
+			{
+				struct profile *p = profile_alloc($1);
+				$$ = cmd_alloc(CMD_PROFILE, CMD_OBJ_PROFILE, &$2, &@$, p);
+			}
+			;
+
+profile_action		:	START		{ $$ = CMD_PROFILE_START; }
+			|	STOP		{ $$ = CMD_PROFILE_STOP; }
+			|	REPORT		{ $$ = CMD_PROFILE_REPORT; }
+			;
+
 monitor_event		:	/* empty */	{ $$ = NULL; }
 			|       STRING		{ $$ = $1; }
 			;
@@ -1890,6 +2005,32 @@ monitor_object		:	/* empty */	{ $$ = CMD_MONITOR_OBJ_ANY; }
 			|	ELEMENTS	{ $$ = CMD_MONITOR_OBJ_ELEMS; }
 			|	RULESET		{ $$ = CMD_MONITOR_OBJ_RULESET; }
 			|	TRACE		{ $$ = CMD_MONITOR_OBJ_TRACE; }
+			|	REPLICATE	{ $$ = CMD_MONITOR_OBJ_REPLICATE; }
+			;
+
+monitor_table		:	/* empty */
+			{
+				memset(&$$, 0, sizeof($$));
+				$$.family	= NFPROTO_UNSPEC;
+			}
+			|	TABLE	identifier
+			{
+				memset(&$$, 0, sizeof($$));
+				$$.family	= NFPROTO_UNSPEC;
+				$$.table.location = @2;
+				$$.table.name	= $2;
+			}
+			|	TABLE	family_spec_explicit	identifier
+			{
+				memset(&$$, 0, sizeof($$));
+				$$.family	= $2;
+				$$.table.location = @3;
+				$$.table.name	= $3;
+			}
+			;
+
+monitor_aggregate	:	/* empty */		{ $$ = 0; }
+			|	AGGREGATE	time_spec	{ $$ = $2; }
 			;
 
 monitor_format		:	/* empty */	{ $$ = NFTNL_OUTPUT_DEFAULT; }
@@ -2268,6 +2409,10 @@ set_block		:	/* empty */	{ $$ = $<set>-1; }
 			}
 			;
 
+setelem_file_binary	:	/* empty */	{ $$ = false; }
+			|	BINARY		{ $$ = true; }
+			;
+
 set_block_expr		:	set_expr
 			|	variable_expr
 			;
@@ -2402,6 +2547,16 @@ map_block		:	/* empty */	{ $$ = $<set>-1; }
 				$1->init = $4;
 				$$ = $1;
 			}
+			|	map_block	MAGLEV	SIZE	NUM	'='	set_block_expr
+			{
+				if (already_set($1->maglev.backends, &@2, state)) {
+					expr_free($6);
+					YYERROR;
+				}
+				$1->maglev.size = $4;
+				$1->maglev.backends = $6;
+				$$ = $1;
+			}
 			|	map_block	comment_spec	stmt_separator
 			{
 				if (already_set($1->comment, &@2, state)) {
@@ -2874,6 +3029,17 @@ chain_policy		:	ACCEPT		{ $$ = NF_ACCEPT; }
 
 identifier		:	STRING
 			|	LAST		{ $$ = xstrdup("last"); }
+			|	MAGLEV		{ $$ = xstrdup("maglev"); }
+			|	PROFILE	close_scope_profile	{ $$ = xstrdup("profile"); }
+			|	COUNT		{ $$ = xstrdup("count"); }
+			|	TOP		{ $$ = xstrdup("top"); }
+			|	BY		{ $$ = xstrdup("by"); }
+			|	PACKETS		{ $$ = xstrdup("packets"); }
+			|	BYTES		{ $$ = xstrdup("bytes"); }
+			|	SINCE		{ $$ = xstrdup("since"); }
+			|	FROM		{ $$ = xstrdup("from"); }
+			|	FORMAT		{ $$ = xstrdup("format"); }
+			|	BINARY		{ $$ = xstrdup("binary"); }
 			;
 
 string			:	STRING
@@ -2901,7 +3067,7 @@ time_spec_or_num_s	:	NUM
 			|	time_spec { $$ = $1 / 1000u; }
 			;
 
-family_spec		:	/* empty */		{ $$ = NFPROTO_IPV4; }
+family_spec		:	/* empty */	%prec FAMILY_IMPLICIT	{ $$ = NFPROTO_IPV4; }
 			|	family_spec_explicit
 			;
 
@@ -3082,6 +3248,22 @@ ruleid_spec		:	chain_spec	handle_spec
 			}
 			;
 
+rule_handle_list	:	opt_newline	NUM	opt_newline
+			{
+				$$ = set_expr_alloc(&@$, NULL);
+				compound_expr_add($$, constant_expr_alloc(&@2, &integer_type,
+									  BYTEORDER_HOST_ENDIAN,
+									  64, &$2));
+			}
+			|	rule_handle_list	COMMA	opt_newline	NUM	opt_newline
+			{
+				compound_expr_add($1, constant_expr_alloc(&@4, &integer_type,
+									  BYTEORDER_HOST_ENDIAN,
+									  64, &$4));
+				$$ = $1;
+			}
+			;
+
 comment_spec		:	COMMENT		string
 			{
 				if (strlen($2) > NFTNL_UDATA_COMMENT_MAXLEN) {
@@ -4260,7 +4442,12 @@ variable_expr		:	'$'	identifier
 				struct symbol *sym;
 
 				sym = symbol_get(scope, $2);
-				if (!sym) {
+				if (!sym && nft->params) {
+					/* placeholder, see nft_prepare(). */
+					$$ = symbol_expr_alloc(&@$, SYMBOL_PARAM,
+							       scope, $2);
+					free_const($2);
+				} else if (!sym) {
 					sym = symbol_lookup_fuzzy(scope, $2);
 					if (sym) {
 						erec_queue(error(&@2, "unknown identifier '%s'; "
@@ -4273,10 +4460,10 @@ variable_expr		:	'$'	identifier
 					}
 					free_const($2);
 					YYERROR;
+				} else {
+					$$ = variable_expr_alloc(&@$, scope, sym);
+					free_const($2);
 				}
-
-				$$ = variable_expr_alloc(&@$, scope, sym);
-				free_const($2);
 			}
 			;
 
@@ -4286,6 +4473,10 @@ symbol_expr		:	variable_expr
 				$$ = symbol_expr_alloc(&@$, SYMBOL_VALUE,
 						       current_scope(state),
 						       $1);
+				if (state->literal_type != SYMBOL_LITERAL_NONE &&
+				    !strcmp($1, state->literal_text))
+					symbol_expr_set_literal($$, state->literal_type,
+								&state->literal);
 				free_const($1);
 			}
 			;
@@ -4305,12 +4496,15 @@ set_ref_symbol_expr	:	AT	identifier	close_scope_at
 
 integer_expr		:	NUM
 			{
+				union symbol_literal literal = { .num = $1 };
 				char str[64];
 
 				snprintf(str, sizeof(str), "%" PRIu64, $1);
 				$$ = symbol_expr_alloc(&@$, SYMBOL_VALUE,
 						       current_scope(state),
 						       str);
+				symbol_expr_set_literal($$, SYMBOL_LITERAL_INTEGER,
+							&literal);
 			}
 			;
 
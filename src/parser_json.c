@@ -9,7 +9,11 @@
 #include <nft.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <erec.h>
 #include <expression.h>
@@ -113,7 +117,8 @@ static struct stmt *json_parse_stmt(struct json_ctx *ctx, json_t *root);
 /* parsing helpers */
 
 const struct location *int_loc = &internal_location;
-static struct input_descriptor json_indesc;
+/* per thread, listing sessions parse their commands concurrently. */
+static __thread struct input_descriptor json_indesc;
 
 static void json_lib_error(struct json_ctx *ctx, json_error_t *err)
 {
@@ -1356,6 +1361,42 @@ static struct expr *json_parse_verdict_expr(struct json_ctx *ctx,
 	return NULL;
 }
 
+static struct expr *json_parse_set_elem(struct json_ctx *ctx, json_t *value,
+				       size_t index)
+{
+	struct expr *expr, *expr2;
+	json_t *jleft, *jright;
+
+	if (!json_unpack(value, "[o, o!]", &jleft, &jright)) {
+		expr = json_parse_rhs_expr(ctx, jleft);
+		if (!expr) {
+			json_error(ctx, "Invalid set elem at index %zu.", index);
+			return NULL;
+		}
+		if (expr->etype != EXPR_SET_ELEM)
+			expr = set_elem_expr_alloc(int_loc, expr);
+
+		expr2 = json_parse_set_rhs_expr(ctx, jright);
+		if (!expr2) {
+			json_error(ctx, "Invalid set elem at index %zu.", index);
+			expr_free(expr);
+			return NULL;
+		}
+		return mapping_expr_alloc(int_loc, expr, expr2);
+	}
+
+	expr = json_parse_rhs_expr(ctx, value);
+	if (!expr) {
+		json_error(ctx, "Invalid set elem at index %zu.", index);
+		return NULL;
+	}
+
+	if (expr->etype != EXPR_SET_ELEM)
+		expr = set_elem_expr_alloc(int_loc, expr);
+
+	return expr;
+}
+
 static struct expr *json_parse_set_expr(struct json_ctx *ctx,
 					const char *type, json_t *root)
 {
@@ -1379,41 +1420,10 @@ static struct expr *json_parse_set_expr(struct json_ctx *ctx,
 	}
 
 	json_array_foreach(root, index, value) {
-		struct expr *expr;
-		json_t *jleft, *jright;
-
-		if (!json_unpack(value, "[o, o!]", &jleft, &jright)) {
-			struct expr *expr2;
-
-			expr = json_parse_rhs_expr(ctx, jleft);
-			if (!expr) {
-				json_error(ctx, "Invalid set elem at index %zu.", index);
-				expr_free(set_expr);
-				return NULL;
-			}
-			if (expr->etype != EXPR_SET_ELEM)
-				expr = set_elem_expr_alloc(int_loc, expr);
-
-			expr2 = json_parse_set_rhs_expr(ctx, jright);
-			if (!expr2) {
-				json_error(ctx, "Invalid set elem at index %zu.", index);
-				expr_free(expr);
-				expr_free(set_expr);
-				return NULL;
-			}
-			expr2 = mapping_expr_alloc(int_loc, expr, expr2);
-			expr = expr2;
-		} else {
-			expr = json_parse_rhs_expr(ctx, value);
-
-			if (!expr) {
-				json_error(ctx, "Invalid set elem at index %zu.", index);
-				expr_free(set_expr);
-				return NULL;
-			}
-
-			if (expr->etype != EXPR_SET_ELEM)
-				expr = set_elem_expr_alloc(int_loc, expr);
+		expr = json_parse_set_elem(ctx, value, index);
+		if (!expr) {
+			expr_free(set_expr);
+			return NULL;
 		}
 
 		if (!set_expr)
@@ -3206,6 +3216,47 @@ err_free_chain:
 	return NULL;
 }
 
+/* "handle" of a rule, either a number or an array of numbers. */
+static int json_parse_rule_handle(struct json_ctx *ctx, json_t *root,
+				  struct handle *h, struct expr **handles)
+{
+	json_t *tmp, *value;
+	uint64_t id;
+	size_t index;
+
+	if (json_unpack(root, "{s:o}", "handle", &tmp))
+		return 0;
+
+	if (json_is_integer(tmp)) {
+		h->handle.id = json_integer_value(tmp);
+		return 0;
+	}
+
+	if (!json_is_array(tmp) || !json_array_size(tmp)) {
+		json_error(ctx, "Value of property \"handle\" must be a number or a non-empty array of numbers.");
+		return 1;
+	}
+
+	*handles = set_expr_alloc(int_loc, NULL);
+	json_array_foreach(tmp, index, value) {
+		if (!json_is_integer(value)) {
+			json_error(ctx, "Unexpected handle array element of type %s, expected number.",
+				   json_typename(value));
+			expr_free(*handles);
+			*handles = NULL;
+			return 1;
+		}
+
+		id = json_integer_value(value);
+		compound_expr_add(*handles,
+				  constant_expr_alloc(int_loc, &integer_type,
+						      BYTEORDER_HOST_ENDIAN,
+						      64, &id));
+	}
+
+	return 0;
+}
+
 static struct cmd *json_parse_cmd_add_rule(struct json_ctx *ctx, json_t *root,
 					   enum cmd_ops op, enum cmd_obj obj)
 {
@@ -3215,7 +3266,9 @@ static struct cmd *json_parse_cmd_add_rule(struct json_ctx *ctx, json_t *root,
 		.index.location = *int_loc,
 	};
 	const char *family = "", *comment = NULL;
+	struct expr *handles = NULL;
 	struct rule *rule;
+	struct cmd *cmd;
 	size_t index;
 	json_t *tmp, *value;
 
@@ -3224,22 +3277,27 @@ static struct cmd *json_parse_cmd_add_rule(struct json_ctx *ctx, json_t *root,
 			    "table", &h.table.name,
 			    "chain", &h.chain.name))
 		return NULL;
-	if (op != CMD_DELETE &&
+	if (op != CMD_DELETE && op != CMD_DESTROY &&
 	    json_unpack_err(ctx, root, "{s:o}", "expr", &tmp))
 		return NULL;
 	else if ((op == CMD_DELETE || op == CMD_DESTROY) &&
-		 json_unpack_err(ctx, root, "{s:I}", "handle", &h.handle.id))
+		 (json_unpack_err(ctx, root, "{s:o}", "handle", &tmp) ||
+		  json_parse_rule_handle(ctx, root, &h, &handles)))
 		return NULL;
 
 	if (parse_family(family, &h.family)) {
 		json_error(ctx, "Unknown family '%s'.", family);
+		expr_free(handles);
 		return NULL;
 	}
 	h.table.name = xstrdup(h.table.name);
 	h.chain.name = xstrdup(h.chain.name);
 
-	if (op == CMD_DELETE || op == CMD_DESTROY)
-		return cmd_alloc(op, obj, &h, int_loc, NULL);
+	if (op == CMD_DELETE || op == CMD_DESTROY) {
+		cmd = cmd_alloc(op, obj, &h, int_loc, NULL);
+		cmd->handles = handles;
+		return cmd;
+	}
 
 	if (!json_is_array(tmp)) {
 		json_error(ctx, "Value of property \"expr\" must be an array.");
@@ -3443,6 +3501,21 @@ static struct cmd *json_parse_cmd_add_set(struct json_ctx *ctx, json_t *root,
 			return NULL;
 		}
 	}
+	if (!json_unpack(root, "{s:o}", "maglev", &tmp)) {
+		json_int_t size;
+		json_t *backends;
+
+		if (json_unpack_err(ctx, tmp, "{s:I, s:o}", "size", &size,
+				    "backends", &backends) ||
+		    !(set->maglev.backends = json_parse_set_expr(ctx, "maglev",
+								 backends))) {
+			json_error(ctx, "Invalid maglev declaration.");
+			set_free(set);
+			handle_free(&h);
+			return NULL;
+		}
+		set->maglev.size = size;
+	}
 	if (!json_unpack(root, "{s:I}", "timeout", &set->timeout))
 		set->timeout *= 1000;
 	if (!json_unpack(root, "{s:i}", "gc-interval", &set->gc_int))
@@ -3866,9 +3939,11 @@ static struct cmd *json_parse_cmd_replace(struct json_ctx *ctx,
 		.chain.location = *int_loc,
 		.index.location = *int_loc,
 	};
+	struct expr *handles = NULL;
 	json_t *tmp, *value;
 	const char *family;
 	struct rule *rule;
+	struct cmd *cmd;
 	size_t index;
 
 	if (json_unpack_err(ctx, root, "{s:o}", "rule", &tmp))
@@ -3881,12 +3956,17 @@ static struct cmd *json_parse_cmd_replace(struct json_ctx *ctx,
 			    "chain", &h.chain.name,
 			    "expr", &tmp))
 		return NULL;
-	json_unpack(root, "{s:I}", "handle", &h.handle.id);
+	if (op == CMD_REPLACE) {
+		if (json_parse_rule_handle(ctx, root, &h, &handles))
+			return NULL;
+	} else {
+		json_unpack(root, "{s:I}", "handle", &h.handle.id);
+	}
 	if (!json_unpack(root, "{s:I}", "index", &h.index.id)) {
 		h.index.id++;
 	}
 
-	if (op == CMD_REPLACE && !h.handle.id) {
+	if (op == CMD_REPLACE && !h.handle.id && !handles) {
 		json_error(ctx, "Handle is required when replacing a rule.");
 		return NULL;
 	}
@@ -3898,11 +3978,13 @@ static struct cmd *json_parse_cmd_replace(struct json_ctx *ctx,
 
 	if (parse_family(family, &h.family)) {
 		json_error(ctx, "Unknown family '%s'.", family);
+		expr_free(handles);
 		return NULL;
 	}
 
 	if (!json_is_array(tmp)) {
 		json_error(ctx, "Value of property \"expr\" must be an array.");
+		expr_free(handles);
 		return NULL;
 	}
 
@@ -3937,11 +4019,15 @@ static struct cmd *json_parse_cmd_replace(struct json_ctx *ctx,
 	if (op == CMD_REPLACE)
 		json_object_del(root, "handle");
 
-	return cmd_alloc(op, CMD_OBJ_RULE, &h, int_loc, rule);
+	cmd = cmd_alloc(op, CMD_OBJ_RULE, &h, int_loc, rule);
+	cmd->handles = handles;
+
+	return cmd;
 
 err_free_replace:
 	rule_free(rule);
 	handle_free(&h);
+	expr_free(handles);
 	return NULL;
 }
 
@@ -4282,6 +4368,42 @@ static json_t *seqnum_to_json(const uint32_t seqnum)
 	return NULL;
 }
 
+static int json_parse_cmd_value(struct json_ctx *ctx, json_t *value,
+				size_t index, struct list_head *cmds)
+{
+	struct cmd *cmd;
+	json_t *tmp;
+
+	/* this is more or less from parser_bison.y:716 */
+	if (!json_is_object(value)) {
+		json_error(ctx, "Unexpected command array element of type %s, expected object.", json_typename(value));
+		return -1;
+	}
+
+	tmp = json_object_get(value, "metainfo");
+	if (tmp) {
+		if (json_verify_metainfo(ctx, tmp)) {
+			json_error(ctx, "Metainfo verification failed.");
+			return -1;
+		}
+		return 0;
+	}
+
+	cmd = json_parse_cmd(ctx, value);
+
+	if (!cmd) {
+		json_error(ctx, "Parsing command array at index %zd failed.", index);
+		return -1;
+	}
+
+	list_add_tail(&cmd->list, cmds);
+
+	if (nft_output_echo(&ctx->nft->output))
+		json_cmd_assoc_add(value, cmd);
+
+	return 0;
+}
+
 static int __json_parse(struct json_ctx *ctx)
 {
 	json_t *tmp, *value;
@@ -4297,41 +4419,385 @@ static int __json_parse(struct json_ctx *ctx)
 	}
 
 	json_array_foreach(tmp, index, value) {
-		/* this is more or less from parser_bison.y:716 */
-		LIST_HEAD(list);
-		struct cmd *cmd;
-		json_t *tmp2;
-
-		if (!json_is_object(value)) {
-			json_error(ctx, "Unexpected command array element of type %s, expected object.", json_typename(value));
+		if (json_parse_cmd_value(ctx, value, index, ctx->cmds) < 0)
 			return -1;
-		}
+	}
+
+	return 0;
+}
+
+/*
+ * Streaming input. The document is split into the elements of the
+ * "nftables" array, and each of them is loaded and turned into a command
+ * before the next one is looked at, so there is never more than one
+ * command worth of json_t nodes around. The elements of "add element"
+ * style commands are loaded one by one too. Anything that does not look
+ * like the usual document, including most syntax errors, returns
+ * JSON_STREAM_FALLBACK and drops the commands built so far, so the whole
+ * document is loaded again the usual way and jansson reports the error.
+ * Malformed set elements are reported against their command instead.
+ */
+#define JSON_STREAM_FALLBACK	1
+
+struct json_stream {
+	const char	*buf;
+	size_t		len;
+	size_t		off;
+};
+
+static char json_stream_peek(struct json_stream *s)
+{
+	while (s->off < s->len && strchr(" \t\r\n", s->buf[s->off]))
+		s->off++;
+
+	return s->off < s->len ? s->buf[s->off] : '\0';
+}
+
+static bool json_stream_expect(struct json_stream *s, char c)
+{
+	if (json_stream_peek(s) != c)
+		return false;
+
+	s->off++;
+	return true;
+}
+
+/* Offset right after the value that starts at @off, 0 if it is malformed. */
+static size_t json_stream_value_end(const struct json_stream *s, size_t off)
+{
+	unsigned int depth = 0;
+	bool str = false;
+
+	if (off < s->len && !strchr("\"{[", s->buf[off])) {
+		while (off < s->len && !strchr(",]} \t\r\n", s->buf[off]))
+			off++;
+		return off;
+	}
 
-		tmp2 = json_object_get(value, "metainfo");
-		if (tmp2) {
-			if (json_verify_metainfo(ctx, tmp2)) {
-				json_error(ctx, "Metainfo verification failed.");
-				return -1;
+	for (; off < s->len; off++) {
+		if (str) {
+			if (s->buf[off] == '\\') {
+				off++;
+			} else if (s->buf[off] == '"') {
+				str = false;
+				if (depth == 0)
+					return off + 1;
 			}
 			continue;
 		}
 
-		cmd = json_parse_cmd(ctx, value);
+		switch (s->buf[off]) {
+		case '"':
+			str = true;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (depth == 0)
+				return 0;
+			if (--depth == 0)
+				return off + 1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static bool json_stream_skip(struct json_stream *s)
+{
+	size_t end;
+
+	json_stream_peek(s);
+	end = json_stream_value_end(s, s->off);
+	if (end <= s->off)
+		return false;
+
+	s->off = end;
+	return true;
+}
+
+static json_t *json_stream_load(struct json_stream *s)
+{
+	size_t start;
+	json_t *value;
+
+	json_stream_peek(s);
+	start = s->off;
+	if (!json_stream_skip(s))
+		return NULL;
+
+	value = json_loadb(s->buf + start, s->off - start, JSON_DECODE_ANY,
+			   NULL);
+	if (!value)
+		s->off = start;
+
+	return value;
+}
+
+/* Load the next object key, the stream is left after the colon. */
+static json_t *json_stream_load_key(struct json_stream *s)
+{
+	json_t *value;
+
+	value = json_stream_load(s);
+	if (!value)
+		return NULL;
+
+	if (!json_is_string(value) || !json_stream_expect(s, ':')) {
+		json_decref(value);
+		return NULL;
+	}
+
+	return value;
+}
+
+static bool json_stream_key(struct json_stream *s, const char *key)
+{
+	json_t *value;
+	bool ret;
+
+	value = json_stream_load_key(s);
+	if (!value)
+		return false;
+
+	ret = !strcmp(json_string_value(value), key);
+	json_decref(value);
+
+	return ret;
+}
+
+static int json_stream_parse_set_elems(struct json_ctx *ctx,
+				       struct json_stream *s, struct expr *set)
+{
+	struct expr *expr;
+	json_t *value;
+	size_t index;
 
-		if (!cmd) {
-			json_error(ctx, "Parsing command array at index %zd failed.", index);
+	for (index = 1; !json_stream_expect(s, ']'); index++) {
+		value = NULL;
+		if (json_stream_expect(s, ','))
+			value = json_stream_load(s);
+		if (!value) {
+			json_error(ctx, "Invalid set elem at index %zu.", index);
 			return -1;
 		}
 
-		list_add_tail(&cmd->list, &list);
+		expr = json_parse_set_elem(ctx, value, index);
+		json_decref(value);
+		if (!expr)
+			return -1;
+
+		compound_expr_add(set, expr);
+	}
+
+	return 0;
+}
+
+/*
+ * Build an element command from {"<op>": {"element": {...}}} with only the
+ * first set element loaded, then add the others as they are loaded. Returns
+ * JSON_STREAM_FALLBACK and leaves the stream untouched if the command does
+ * not have that shape.
+ */
+static int json_stream_parse_elements(struct json_ctx *ctx,
+				      struct json_stream *s, size_t index,
+				      struct list_head *cmds)
+{
+	static const char * const ops[] = { "add", "create", "delete", "destroy" };
+	struct json_stream elems = {}, t = *s;
+	json_t *op, *name, *value, *obj;
+	unsigned int i;
+	struct cmd *cmd;
+	bool ok;
 
-		list_splice_tail(&list, ctx->cmds);
+	if (!json_stream_expect(&t, '{'))
+		return JSON_STREAM_FALLBACK;
 
-		if (nft_output_echo(&ctx->nft->output))
-			json_cmd_assoc_add(value, cmd);
+	op = json_stream_load_key(&t);
+	if (!op)
+		return JSON_STREAM_FALLBACK;
+
+	for (i = 0; i < array_size(ops); i++) {
+		if (!strcmp(json_string_value(op), ops[i]))
+			break;
+	}
+
+	if (i == array_size(ops) ||
+	    !json_stream_expect(&t, '{') ||
+	    !json_stream_key(&t, "element") ||
+	    !json_stream_expect(&t, '{')) {
+		json_decref(op);
+		return JSON_STREAM_FALLBACK;
 	}
 
+	obj = json_object();
+	do {
+		name = json_stream_load_key(&t);
+		if (!name)
+			goto fallback;
+
+		if (!strcmp(json_string_value(name), "elem") &&
+		    json_stream_peek(&t) == '[') {
+			elems = t;
+			ok = json_stream_skip(&t);
+		} else {
+			value = json_stream_load(&t);
+			ok = value != NULL;
+			if (ok)
+				json_object_set_new(obj, json_string_value(name),
+						    value);
+		}
+		json_decref(name);
+		if (!ok)
+			goto fallback;
+	} while (json_stream_expect(&t, ','));
+
+	if (!elems.buf ||
+	    !json_stream_expect(&t, '}') ||
+	    !json_stream_expect(&t, '}') ||
+	    !json_stream_expect(&t, '}'))
+		goto fallback;
+
+	/* The other elements are checked as they are loaded. */
+	json_stream_expect(&elems, '[');
+	value = json_stream_load(&elems);
+	if (!value)
+		goto fallback;
+
+	json_object_set_new(obj, "elem", json_pack("[o]", value));
+	value = json_pack("{s:{s:o}}", json_string_value(op), "element", obj);
+	json_decref(op);
+
+	cmd = json_parse_cmd(ctx, value);
+	json_decref(value);
+	if (!cmd) {
+		json_error(ctx, "Parsing command array at index %zd failed.", index);
+		return -1;
+	}
+	list_add_tail(&cmd->list, cmds);
+
+	if (cmd->expr->etype != EXPR_SET ||
+	    json_stream_parse_set_elems(ctx, &elems, cmd->expr) < 0) {
+		json_error(ctx, "Parsing command array at index %zd failed.", index);
+		return -1;
+	}
+
+	*s = t;
 	return 0;
+fallback:
+	json_decref(op);
+	json_decref(obj);
+	return JSON_STREAM_FALLBACK;
+}
+
+static int json_stream_parse_cmds(struct json_ctx *ctx, struct json_stream *s,
+				  struct list_head *cmds)
+{
+	json_t *value;
+	size_t index;
+	int ret;
+
+	if (!json_stream_expect(s, '['))
+		return JSON_STREAM_FALLBACK;
+
+	if (json_stream_expect(s, ']'))
+		return 0;
+
+	for (index = 0; ; index++) {
+		ret = json_stream_parse_elements(ctx, s, index, cmds);
+		if (ret < 0)
+			return ret;
+
+		if (ret == JSON_STREAM_FALLBACK) {
+			value = json_stream_load(s);
+			if (!value)
+				return JSON_STREAM_FALLBACK;
+
+			ret = json_parse_cmd_value(ctx, value, index, cmds);
+			json_decref(value);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (json_stream_expect(s, ']'))
+			return 0;
+		if (!json_stream_expect(s, ','))
+			return JSON_STREAM_FALLBACK;
+	}
+}
+
+static int json_parse_stream(struct json_ctx *ctx, const char *buf, size_t len)
+{
+	struct json_stream s = { .buf = buf, .len = len };
+	struct cmd *cmd, *next;
+	bool found = false;
+	LIST_HEAD(cmds);
+	json_t *name;
+	int ret = 0;
+
+	if (!json_stream_expect(&s, '{'))
+		return JSON_STREAM_FALLBACK;
+
+	do {
+		name = json_stream_load_key(&s);
+		if (!name) {
+			ret = JSON_STREAM_FALLBACK;
+			break;
+		}
+
+		if (!strcmp(json_string_value(name), "nftables") && !found) {
+			ret = json_stream_parse_cmds(ctx, &s, &cmds);
+			found = true;
+		} else if (!json_stream_skip(&s)) {
+			ret = JSON_STREAM_FALLBACK;
+		}
+		json_decref(name);
+	} while (ret == 0 && json_stream_expect(&s, ','));
+
+	if (ret == 0 &&
+	    (!found || !json_stream_expect(&s, '}') || json_stream_peek(&s)))
+		ret = JSON_STREAM_FALLBACK;
+
+	if (ret == JSON_STREAM_FALLBACK) {
+		list_for_each_entry_safe(cmd, next, &cmds, list) {
+			list_del(&cmd->list);
+			cmd_free(cmd);
+		}
+		return ret;
+	}
+
+	list_splice_tail(&cmds, ctx->cmds);
+
+	return ret;
+}
+
+static int json_parse_stream_file(struct json_ctx *ctx, const char *filename)
+{
+	int ret = JSON_STREAM_FALLBACK;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return JSON_STREAM_FALLBACK;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		goto out;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+
+	ret = json_parse_stream(ctx, map, st.st_size);
+	munmap(map, st.st_size);
+out:
+	close(fd);
+	return ret;
 }
 
 int nft_parse_json_buffer(struct nft_ctx *nft, const char *buf,
@@ -4348,6 +4814,12 @@ int nft_parse_json_buffer(struct nft_ctx *nft, const char *buf,
 	json_indesc.data = buf;
 
 	parser_init(nft, nft->state, msgs, cmds, nft->top_scope);
+	if (!nft_output_echo(&nft->output)) {
+		ret = json_parse_stream(&ctx, buf, strlen(buf));
+		if (ret != JSON_STREAM_FALLBACK)
+			return ret;
+	}
+
 	nft->json_root = json_loads(buf, 0, NULL);
 	if (!nft->json_root)
 		return -EINVAL;
@@ -4383,6 +4855,12 @@ int nft_parse_json_filename(struct nft_ctx *nft, const char *filename,
 	json_indesc.name = filename;
 
 	parser_init(nft, nft->state, msgs, cmds, nft->top_scope);
+	if (!nft_output_echo(&nft->output)) {
+		ret = json_parse_stream_file(&ctx, filename);
+		if (ret != JSON_STREAM_FALLBACK)
+			return ret;
+	}
+
 	nft->json_root = json_load_file(filename, 0, &err);
 	if (!nft->json_root)
 		return -EINVAL;
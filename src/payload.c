@@ -14,6 +14,7 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <net/if_arp.h>
 #include <arpa/inet.h>
 #include <linux/netfilter.h>
@@ -397,6 +398,131 @@ struct stmt *payload_stmt_alloc(const struct location *loc,
 	return stmt;
 }
 
+/*
+ * Evaluated dependencies on meta keys, such as meta l4proto in inet tables,
+ * only depend on the family and the protocols they link. Rules usually need
+ * the same few ones, so they are evaluated once per context and cloned.
+ * Rules of different tables are evaluated from several threads with --jobs,
+ * hence the lock.
+ */
+#define PAYLOAD_DEP_CACHE_SIZE	16
+
+struct payload_dep_cache {
+	pthread_mutex_t			lock;
+	unsigned int			num;
+	struct {
+		uint32_t		family;
+		const struct proto_desc	*desc;
+		const struct proto_desc	*upper;
+		struct expr		*dep;
+	}				entry[PAYLOAD_DEP_CACHE_SIZE];
+};
+
+struct payload_dep_cache *payload_dep_cache_alloc(void)
+{
+	struct payload_dep_cache *cache = xzalloc(sizeof(*cache));
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+static int payload_dep_cache_find(const struct payload_dep_cache *cache,
+				  uint32_t family,
+				  const struct proto_desc *desc,
+				  const struct proto_desc *upper)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->num; i++) {
+		if (cache->entry[i].family == family &&
+		    cache->entry[i].desc == desc &&
+		    cache->entry[i].upper == upper)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Returns a copy of the cached dependency, or NULL. */
+static struct expr *payload_dep_cache_lookup(struct nft_ctx *nft,
+					     uint32_t family,
+					     const struct proto_desc *desc,
+					     const struct proto_desc *upper)
+{
+	struct payload_dep_cache *cache = nft->dep_cache;
+	struct expr *dep = NULL;
+	int i;
+
+	pthread_mutex_lock(&cache->lock);
+	i = payload_dep_cache_find(cache, family, desc, upper);
+	if (i >= 0)
+		dep = expr_clone(cache->entry[i].dep);
+	pthread_mutex_unlock(&cache->lock);
+
+	return dep;
+}
+
+static void payload_dep_cache_add(struct nft_ctx *nft, uint32_t family,
+				  const struct proto_desc *desc,
+				  const struct proto_desc *upper,
+				  const struct expr *dep)
+{
+	struct payload_dep_cache *cache = nft->dep_cache;
+	unsigned int i;
+
+	pthread_mutex_lock(&cache->lock);
+	/* another thread may have added it meanwhile. */
+	if (cache->num < PAYLOAD_DEP_CACHE_SIZE &&
+	    payload_dep_cache_find(cache, family, desc, upper) < 0) {
+		i = cache->num++;
+		cache->entry[i].family = family;
+		cache->entry[i].desc = desc;
+		cache->entry[i].upper = upper;
+		cache->entry[i].dep = expr_clone(dep);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void payload_dep_cache_free(struct payload_dep_cache *cache)
+{
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < cache->num; i++)
+		expr_free(cache->entry[i].dep);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static bool payload_dep_cacheable(const struct eval_ctx *ctx,
+				  const struct proto_hdr_template *tmpl)
+{
+	/* evaluation of meta keys does not add further dependencies. */
+	return tmpl->meta_key && !ctx->inner_desc && !ctx->nft->debug_mask;
+}
+
+static struct stmt *payload_dep_cache_get(struct eval_ctx *ctx,
+					  const struct proto_desc *desc,
+					  const struct proto_desc *upper,
+					  const struct expr *expr)
+{
+	struct proto_ctx *pctx = eval_proto_ctx(ctx);
+	struct expr *dep;
+
+	dep = payload_dep_cache_lookup(ctx->nft, pctx->family, desc, upper);
+	if (!dep)
+		return NULL;
+
+	dep->location = expr->location;
+	dep->left->location = expr->location;
+	dep->right->location = expr->location;
+	relational_expr_pctx_update(pctx, dep);
+
+	return expr_stmt_alloc(&dep->location, dep);
+}
+
 static int payload_add_dependency(struct eval_ctx *ctx,
 				  const struct proto_desc *desc,
 				  const struct proto_desc *upper,
@@ -416,6 +542,14 @@ static int payload_add_dependency(struct eval_ctx *ctx,
 				  desc->name, upper->name);
 
 	tmpl = &desc->templates[desc->protocol_key];
+	if (payload_dep_cacheable(ctx, tmpl)) {
+		stmt = payload_dep_cache_get(ctx, desc, upper, expr);
+		if (stmt) {
+			*res = stmt;
+			return 0;
+		}
+	}
+
 	if (tmpl->meta_key)
 		left = meta_expr_alloc(&expr->location, tmpl->meta_key);
 	else
@@ -440,6 +574,10 @@ static int payload_add_dependency(struct eval_ctx *ctx,
 
 	pctx = eval_proto_ctx(ctx);
 	relational_expr_pctx_update(pctx, dep);
+
+	if (payload_dep_cacheable(ctx, tmpl) && stmt->expr == dep)
+		payload_dep_cache_add(ctx->nft, pctx->family, desc, upper, dep);
+
 	*res = stmt;
 	return 0;
 }
@@ -992,7 +1130,8 @@ void payload_expr_complete(struct expr *expr, const struct proto_ctx *ctx)
 	unsigned int payload_offset = expr->payload.offset;
 	const struct proto_desc *desc;
 	const struct proto_hdr_template *tmpl;
-	unsigned int i, total;
+	unsigned int total;
+	int i;
 
 	assert(expr->etype == EXPR_PAYLOAD);
 
@@ -1004,11 +1143,9 @@ void payload_expr_complete(struct expr *expr, const struct proto_ctx *ctx)
 	desc = get_stacked_desc(ctx, desc, expr, &total);
 	payload_offset -= total;
 
-	for (i = 0; i < array_size(desc->templates); i++) {
+	for (i = proto_find_tmpl(desc, payload_offset, expr->len, -1); i >= 0;
+	     i = proto_find_tmpl(desc, payload_offset, expr->len, i)) {
 		tmpl = &desc->templates[i];
-		if (tmpl->offset != payload_offset ||
-		    tmpl->len    != expr->len)
-			continue;
 
 		if (tmpl->meta_key && i == 0)
 			continue;
@@ -0,0 +1,354 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Prepared statements. nft_prepare() parses and evaluates a command template
+ * once. Each $name in it that is not a defined variable is a placeholder,
+ * which evaluates to a zeroed constant of the datatype and length expected
+ * where it is used. Binding checks a value against that datatype and writes
+ * it into the constant, nft_execute() then builds a new batch from the
+ * evaluated commands without scanning, parsing or evaluating them again.
+ *
+ * Since evaluation is not repeated, placeholders are only allowed in commands
+ * that are sent the same way for any value: rules, and elements of sets that
+ * have no intervals. Placeholders that evaluation folds into another
+ * expression are rejected when the statement is prepared.
+ *
+ * A statement can also declare tables, chains, sets, stateful objects and
+ * flowtables, so that a whole ruleset is a template which is instantiated
+ * once per interface or network namespace, see nft_execute_on().
+ */
+
+#include <nft.h>
+
+#include <nftables.h>
+#include <rule.h>
+#include <expression.h>
+#include <datatype.h>
+#include <erec.h>
+#include <gmputil.h>
+#include <parser.h>
+#include <prepare.h>
+
+void nft_param_add(struct list_head *params, const char *name,
+		   struct expr *expr, const struct cmd *cmd)
+{
+	struct nft_param *param;
+
+	param = xzalloc(sizeof(*param));
+	param->name = xstrdup(name);
+	param->expr = expr_get(expr);
+	param->cmd = cmd;
+	list_add_tail(&param->list, params);
+}
+
+static void nft_param_free(struct nft_param *param)
+{
+	list_del(&param->list);
+	expr_free(param->expr);
+	free_const(param->name);
+	free(param);
+}
+
+static bool nft_stmt_cmd_supported(const struct cmd *cmd)
+{
+	switch (cmd->obj) {
+	case CMD_OBJ_RULE:
+		return cmd->op == CMD_ADD || cmd->op == CMD_CREATE ||
+		       cmd->op == CMD_INSERT || cmd->op == CMD_REPLACE ||
+		       cmd->op == CMD_DELETE || cmd->op == CMD_DESTROY;
+	case CMD_OBJ_ELEMENTS:
+		if (cmd->op != CMD_ADD && cmd->op != CMD_CREATE &&
+		    cmd->op != CMD_DELETE && cmd->op != CMD_DESTROY)
+			return false;
+
+		return !set_is_interval(cmd->elem.set->flags);
+	case CMD_OBJ_SET:
+	case CMD_OBJ_MAP:
+		/* anonymous sets of the rules in the statement. */
+		if (set_is_anonymous(cmd->set->flags))
+			return cmd->op == CMD_ADD &&
+			       !set_is_interval(cmd->set->flags);
+
+		return cmd->op == CMD_ADD || cmd->op == CMD_CREATE;
+	case CMD_OBJ_SETELEMS:
+		return cmd->op == CMD_ADD;
+	case CMD_OBJ_TABLE:
+	case CMD_OBJ_CHAIN:
+	case CMD_OBJ_FLOWTABLE:
+	case CMD_OBJ_COUNTER:
+	case CMD_OBJ_QUOTA:
+	case CMD_OBJ_LIMIT:
+	case CMD_OBJ_SECMARK:
+	case CMD_OBJ_CT_HELPER:
+	case CMD_OBJ_CT_TIMEOUT:
+	case CMD_OBJ_CT_EXPECT:
+	case CMD_OBJ_SYNPROXY:
+		return cmd->op == CMD_ADD || cmd->op == CMD_CREATE;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/* Declarations are sent as they were evaluated, values are only patched in
+ * rules and elements.
+ */
+static bool nft_param_cmd_supported(const struct cmd *cmd)
+{
+	switch (cmd->obj) {
+	case CMD_OBJ_RULE:
+		return true;
+	case CMD_OBJ_ELEMENTS:
+		return !set_is_interval(cmd->elem.set->flags);
+	case CMD_OBJ_SET:
+	case CMD_OBJ_MAP:
+	case CMD_OBJ_SETELEMS:
+		return !set_is_interval(cmd->set->flags);
+	default:
+		break;
+	}
+
+	return false;
+}
+
+int nft_stmt_check(struct nft_stmt *stmt, struct list_head *msgs)
+{
+	struct nft_param *param;
+	struct cmd *cmd;
+
+	list_for_each_entry(cmd, &stmt->cmds, list) {
+		if (nft_stmt_cmd_supported(cmd))
+			continue;
+
+		erec_queue(error(&cmd->location,
+				 "this command cannot be prepared"), msgs);
+		return -1;
+	}
+
+	/* The placeholder is only referenced from here once evaluation
+	 * replaced it.
+	 */
+	list_for_each_entry(param, &stmt->params, list) {
+		if (param->expr->refcnt > 1 &&
+		    (!param->cmd || nft_param_cmd_supported(param->cmd)))
+			continue;
+
+		erec_queue(error(&param->expr->location,
+				 "placeholder $%s cannot be bound here",
+				 param->name), msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+int nft_stmt_check_bound(struct nft_stmt *stmt, struct list_head *msgs)
+{
+	struct nft_param *param;
+
+	list_for_each_entry(param, &stmt->params, list) {
+		if (param->bound)
+			continue;
+
+		erec_queue(error(&param->expr->location,
+				 "placeholder $%s is not bound", param->name),
+			   msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+void nft_stmt_release(struct nft_stmt *stmt)
+{
+	struct nft_param *param, *next;
+	struct cmd *cmd, *cnext;
+
+	list_for_each_entry_safe(param, next, &stmt->params, list)
+		nft_param_free(param);
+
+	list_for_each_entry_safe(cmd, cnext, &stmt->cmds, list) {
+		list_del(&cmd->list);
+		cmd_free(cmd);
+	}
+}
+
+static int nft_param_set(struct nft_param *param, const mpz_t value,
+			 unsigned int len, const struct location *loc,
+			 struct list_head *msgs)
+{
+	struct expr *expr = param->expr;
+
+	if (len > expr->len) {
+		erec_queue(error(loc, "value of $%s exceeds %u bits for %s",
+				 param->name, expr->len, expr->dtype->desc),
+			   msgs);
+		return -1;
+	}
+
+	mpz_set(expr->value, value);
+	param->bound = true;
+
+	return 0;
+}
+
+typedef int (*nft_param_bind_fn)(struct nft_stmt *stmt,
+				 struct nft_param *param, const void *data,
+				 size_t len, struct list_head *msgs);
+
+static int nft_stmt_bind(struct nft_stmt *stmt, const char *name,
+			 nft_param_bind_fn bind, const void *data, size_t len,
+			 struct list_head *msgs)
+{
+	struct nft_param *param;
+	bool found = false;
+
+	list_for_each_entry(param, &stmt->params, list) {
+		if (strcmp(param->name, name))
+			continue;
+
+		if (bind(stmt, param, data, len, msgs) < 0)
+			return -1;
+
+		found = true;
+	}
+
+	if (!found) {
+		erec_queue(error(&internal_location, "unknown placeholder $%s",
+				 name), msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nft_param_bind_str(struct nft_stmt *stmt, struct nft_param *param,
+			      const void *data, size_t len,
+			      struct list_head *msgs)
+{
+	struct nft_ctx *nft = stmt->nft;
+	struct parse_ctx parse_ctx = {
+		.tbl		= &nft->output.tbl,
+		.input		= &nft->input,
+		.resolver	= nft->resolver,
+	};
+	struct error_record *erec;
+	struct expr *sym, *value;
+	int ret;
+
+	sym = symbol_expr_alloc(&param->expr->location, SYMBOL_VALUE, NULL,
+				data);
+	datatype_set(sym, param->expr->dtype);
+	erec = symbol_parse(&parse_ctx, sym, &value);
+	expr_free(sym);
+	if (erec) {
+		erec_queue(erec, msgs);
+		return -1;
+	}
+
+	if (value->etype != EXPR_VALUE) {
+		erec_queue(error(&value->location,
+				 "$%s only takes a single %s value",
+				 param->name, param->expr->dtype->desc), msgs);
+		expr_free(value);
+		return -1;
+	}
+
+	ret = nft_param_set(param, value->value, value->len, &value->location,
+			    msgs);
+	expr_free(value);
+
+	return ret;
+}
+
+int nft_stmt_bind_str(struct nft_stmt *stmt, const char *name,
+		      const char *value, struct list_head *msgs)
+{
+	return nft_stmt_bind(stmt, name, nft_param_bind_str, value, 0, msgs);
+}
+
+static int nft_param_bind_u64(struct nft_stmt *stmt, struct nft_param *param,
+			      const void *data, size_t len,
+			      struct list_head *msgs)
+{
+	mpz_t value;
+	int ret;
+
+	if (expr_basetype(param->expr)->type != TYPE_INTEGER) {
+		erec_queue(error(&param->expr->location,
+				 "$%s is of type %s, not an integer",
+				 param->name, param->expr->dtype->desc), msgs);
+		return -1;
+	}
+
+	mpz_init(value);
+	mpz_import_data(value, data, BYTEORDER_HOST_ENDIAN, sizeof(uint64_t));
+	ret = nft_param_set(param, value, mpz_sizeinbase(value, 2),
+			    &param->expr->location, msgs);
+	mpz_clear(value);
+
+	return ret;
+}
+
+/* @var is in the name=value format of nft_ctx_add_var(). */
+int nft_stmt_bind_var(struct nft_stmt *stmt, const char *var,
+		      struct list_head *msgs)
+{
+	char *name, *sep;
+	int ret;
+
+	name = xstrdup(var);
+	sep = strchr(name, '=');
+	if (!sep || sep == name) {
+		erec_queue(error(&internal_location,
+				 "`%s' is not in name=value format", var),
+			   msgs);
+		free(name);
+		return -1;
+	}
+	*sep = '\0';
+
+	ret = nft_stmt_bind_str(stmt, name, sep + 1, msgs);
+	free(name);
+
+	return ret;
+}
+
+int nft_stmt_bind_u64(struct nft_stmt *stmt, const char *name,
+		      uint64_t value, struct list_head *msgs)
+{
+	return nft_stmt_bind(stmt, name, nft_param_bind_u64, &value,
+			     sizeof(value), msgs);
+}
+
+/* @data is in the byteorder of the datatype, as it is sent to the kernel. */
+static int nft_param_bind_data(struct nft_stmt *stmt, struct nft_param *param,
+			       const void *data, size_t len,
+			       struct list_head *msgs)
+{
+	struct expr *expr = param->expr;
+	mpz_t value;
+	int ret;
+
+	if (len * BITS_PER_BYTE != expr->len) {
+		erec_queue(error(&expr->location,
+				 "$%s takes %u bytes of %s data, not %zu",
+				 param->name, expr->len / BITS_PER_BYTE,
+				 expr->dtype->desc, len), msgs);
+		return -1;
+	}
+
+	mpz_init(value);
+	mpz_import_data(value, data, expr->byteorder, len);
+	ret = nft_param_set(param, value, expr->len, &expr->location, msgs);
+	mpz_clear(value);
+
+	return ret;
+}
+
+int nft_stmt_bind_data(struct nft_stmt *stmt, const char *name,
+		       const void *data, size_t len, struct list_head *msgs)
+{
+	return nft_stmt_bind(stmt, name, nft_param_bind_data, data, len, msgs);
+}
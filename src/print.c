@@ -9,9 +9,16 @@
 #include <nft.h>
 
 #include <stdarg.h>
+#include <arpa/inet.h>
 #include <nftables.h>
 #include <utils.h>
 
+/*
+ * Output goes through the stdio buffer of the output stream, it is flushed
+ * once an object is complete: at the end of a command run, after each
+ * monitor event and before error messages are printed, see
+ * nft_print_flush().
+ */
 int nft_print(struct output_ctx *octx, const char *fmt, ...)
 {
 	int ret;
@@ -20,7 +27,6 @@ int nft_print(struct output_ctx *octx, const char *fmt, ...)
 	va_start(arg, fmt);
 	ret = vfprintf(octx->output_fp, fmt, arg);
 	va_end(arg);
-	fflush(octx->output_fp);
 
 	return ret;
 }
@@ -33,7 +39,125 @@ int nft_gmp_print(struct output_ctx *octx, const char *fmt, ...)
 	va_start(arg, fmt);
 	ret = gmp_vfprintf(octx->output_fp, fmt, arg);
 	va_end(arg);
-	fflush(octx->output_fp);
 
 	return ret;
 }
+
+void nft_print_flush(struct output_ctx *octx)
+{
+	fflush(octx->output_fp);
+}
+
+/*
+ * Formatters for the values that make up most of large listings, without
+ * going through the printf format parser.
+ */
+int nft_print_str(struct output_ctx *octx, const char *str)
+{
+	size_t len = strlen(str);
+
+	return fwrite(str, 1, len, octx->output_fp);
+}
+
+static char *fmt_u64(char *end, uint64_t val)
+{
+	do {
+		*--end = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	return end;
+}
+
+int nft_print_u64(struct output_ctx *octx, uint64_t val)
+{
+	char buf[20], *p;
+
+	p = fmt_u64(buf + sizeof(buf), val);
+	return fwrite(p, 1, buf + sizeof(buf) - p, octx->output_fp);
+}
+
+static char *fmt_ipv4(char *p, const uint8_t *addr)
+{
+	char buf[3], *q;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		if (i)
+			*p++ = '.';
+		q = fmt_u64(buf + sizeof(buf), addr[i]);
+		while (q < buf + sizeof(buf))
+			*p++ = *q++;
+	}
+
+	return p;
+}
+
+/* @addr is in network byte order. */
+int nft_print_ipv4(struct output_ctx *octx, const void *addr)
+{
+	char buf[INET_ADDRSTRLEN], *p;
+
+	p = fmt_ipv4(buf, addr);
+	return fwrite(buf, 1, p - buf, octx->output_fp);
+}
+
+/* Same text as inet_ntop(): the first longest run of at least two zero
+ * groups is compressed, IPv4-compatible and IPv4-mapped addresses end in
+ * dotted decimal.
+ */
+int nft_print_ipv6(struct output_ctx *octx, const void *addr)
+{
+	static const char hex[] = "0123456789abcdef";
+	int best = -1, best_len = 0, cur = -1, cur_len = 0;
+	char buf[INET6_ADDRSTRLEN], *p = buf;
+	const uint8_t *a = addr;
+	uint16_t words[8];
+	bool lead;
+	int i, k;
+
+	for (i = 0; i < 8; i++) {
+		words[i] = a[2 * i] << 8 | a[2 * i + 1];
+
+		if (words[i] == 0) {
+			if (cur < 0)
+				cur = i;
+			if (++cur_len > best_len) {
+				best = cur;
+				best_len = cur_len;
+			}
+		} else {
+			cur = -1;
+			cur_len = 0;
+		}
+	}
+	if (best_len < 2)
+		best = -1;
+
+	for (i = 0; i < 8; i++) {
+		if (best >= 0 && i >= best && i < best + best_len) {
+			if (i == best)
+				*p++ = ':';
+			continue;
+		}
+		if (i)
+			*p++ = ':';
+		if (i == 6 && best == 0 &&
+		    (best_len == 6 || (best_len == 5 && words[5] == 0xffff))) {
+			p = fmt_ipv4(p, a + 12);
+			break;
+		}
+
+		lead = true;
+		for (k = 12; k >= 0; k -= 4) {
+			if (lead && k && !(words[i] >> k & 0xf))
+				continue;
+			lead = false;
+			*p++ = hex[words[i] >> k & 0xf];
+		}
+	}
+	if (best >= 0 && best + best_len == 8)
+		*p++ = ':';
+
+	return fwrite(buf, 1, p - buf, octx->output_fp);
+}
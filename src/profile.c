@@ -0,0 +1,622 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Rule profiling. "profile start" replaces each rule with a copy that has a
+ * counter right after its matches, all in one transaction. The copies are
+ * made from the dump as the kernel sent it, only the counter and a mark in
+ * the rule userdata are added, so that "profile stop" takes the counter out
+ * again and leaves the rule exactly as it was, handle and position
+ * included. "profile report" lists the packets that each rule matched and,
+ * per chain, how many packets the jumps and gotos to it sent there, how many
+ * got a verdict in it and how many returned.
+ *
+ * Rules that already have a counter are reported with it and not changed.
+ * Rules that refer to anonymous sets or chains, and the rules of anonymous
+ * chains, are not changed either: these are bound to one rule, the kernel
+ * does not let a replacement refer to them.
+ */
+
+#include <nft.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/udata.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include <nftables.h>
+#include <cache.h>
+#include <mnl.h>
+#include <netlink.h>
+#include <rule.h>
+#include <statement.h>
+#include <profile.h>
+
+/* Position of the counter that "profile start" added. Unknown to libnftnl,
+ * which skips it when it parses the userdata of a rule.
+ */
+#define NFT_UDATA_RULE_PROFILE	0xf0
+
+enum profile_expr {
+	PROFILE_EXPR_MATCH,
+	PROFILE_EXPR_ACTION,
+	PROFILE_EXPR_COUNTER,
+	PROFILE_EXPR_BOUND,
+};
+
+/* Expressions that only load or compare, the counter goes after these. */
+static const char * const profile_match_exprs[] = {
+	"bitwise", "byteorder", "cmp", "fib", "hash", "inner", "numgen",
+	"osf", "range", "rt", "socket", "tunnel", "xfrm",
+};
+
+static const struct nlattr *nest_attr(const struct nlattr *nest,
+				      uint16_t type)
+{
+	const struct nlattr *attr;
+
+	if (!nest)
+		return NULL;
+
+	mnl_attr_for_each_nested(attr, nest) {
+		if (mnl_attr_get_type(attr) == type)
+			return attr;
+	}
+
+	return NULL;
+}
+
+static bool attr_anonymous(const struct nlattr *attr, const char *prefix)
+{
+	return attr && mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0 &&
+	       !strncmp(mnl_attr_get_str(attr), prefix, strlen(prefix));
+}
+
+static bool attr_reg_is_verdict(const struct nlattr *attr)
+{
+	return attr && mnl_attr_validate(attr, MNL_TYPE_U32) == 0 &&
+	       ntohl(mnl_attr_get_u32(attr)) == NFT_REG_VERDICT;
+}
+
+static enum profile_expr profile_expr_type(const struct nlattr *elem)
+{
+	const struct nlattr *name, *data, *attr;
+	const char *str;
+	unsigned int i;
+
+	name = nest_attr(elem, NFTA_EXPR_NAME);
+	data = nest_attr(elem, NFTA_EXPR_DATA);
+	if (!name || mnl_attr_validate(name, MNL_TYPE_NUL_STRING) < 0)
+		return PROFILE_EXPR_ACTION;
+
+	str = mnl_attr_get_str(name);
+	if (!strcmp(str, "counter"))
+		return PROFILE_EXPR_COUNTER;
+
+	if (!strcmp(str, "lookup")) {
+		if (attr_anonymous(nest_attr(data, NFTA_LOOKUP_SET), "__set"))
+			return PROFILE_EXPR_BOUND;
+		if (attr_reg_is_verdict(nest_attr(data, NFTA_LOOKUP_DREG)))
+			return PROFILE_EXPR_ACTION;
+		return PROFILE_EXPR_MATCH;
+	}
+	if (!strcmp(str, "dynset")) {
+		if (attr_anonymous(nest_attr(data, NFTA_DYNSET_SET_NAME), "__set"))
+			return PROFILE_EXPR_BOUND;
+		return PROFILE_EXPR_ACTION;
+	}
+	if (!strcmp(str, "objref")) {
+		if (attr_anonymous(nest_attr(data, NFTA_OBJREF_SET_NAME), "__set"))
+			return PROFILE_EXPR_BOUND;
+		return PROFILE_EXPR_ACTION;
+	}
+	if (!strcmp(str, "immediate")) {
+		attr = nest_attr(data, NFTA_IMMEDIATE_DREG);
+		if (!attr_reg_is_verdict(attr))
+			return PROFILE_EXPR_MATCH;
+
+		attr = nest_attr(nest_attr(nest_attr(data, NFTA_IMMEDIATE_DATA),
+					   NFTA_DATA_VERDICT),
+				 NFTA_VERDICT_CHAIN);
+		if (attr_anonymous(attr, "__chain"))
+			return PROFILE_EXPR_BOUND;
+		return PROFILE_EXPR_ACTION;
+	}
+
+	/* the same expressions set fields when they have a source register. */
+	if (!strcmp(str, "payload"))
+		return nest_attr(data, NFTA_PAYLOAD_SREG) ?
+		       PROFILE_EXPR_ACTION : PROFILE_EXPR_MATCH;
+	if (!strcmp(str, "meta"))
+		return nest_attr(data, NFTA_META_SREG) ?
+		       PROFILE_EXPR_ACTION : PROFILE_EXPR_MATCH;
+	if (!strcmp(str, "ct"))
+		return nest_attr(data, NFTA_CT_SREG) ?
+		       PROFILE_EXPR_ACTION : PROFILE_EXPR_MATCH;
+	if (!strcmp(str, "exthdr"))
+		return nest_attr(data, NFTA_EXTHDR_SREG) ?
+		       PROFILE_EXPR_ACTION : PROFILE_EXPR_MATCH;
+
+	for (i = 0; i < array_size(profile_match_exprs); i++) {
+		if (!strcmp(str, profile_match_exprs[i]))
+			return PROFILE_EXPR_MATCH;
+	}
+
+	return PROFILE_EXPR_ACTION;
+}
+
+/* Where the counter goes, false if the rule is not to be changed. */
+static bool profile_counter_pos(const struct nlattr *exprs, uint32_t *pos)
+{
+	const struct nlattr *elem;
+	bool matching = true;
+	uint32_t i = 0;
+
+	*pos = 0;
+	mnl_attr_for_each_nested(elem, exprs) {
+		switch (profile_expr_type(elem)) {
+		case PROFILE_EXPR_MATCH:
+			break;
+		case PROFILE_EXPR_ACTION:
+			matching = false;
+			break;
+		case PROFILE_EXPR_COUNTER:
+		case PROFILE_EXPR_BOUND:
+			return false;
+		}
+		if (matching)
+			*pos = ++i;
+	}
+
+	return true;
+}
+
+static bool profile_counter_at(const struct nlattr *exprs, uint32_t pos)
+{
+	const struct nlattr *elem;
+	uint32_t i = 0;
+
+	mnl_attr_for_each_nested(elem, exprs) {
+		if (i++ == pos)
+			return profile_expr_type(elem) == PROFILE_EXPR_COUNTER;
+	}
+
+	return false;
+}
+
+struct profile_udata {
+	struct nftnl_udata_buf	*buf;
+	bool			marked;
+	uint32_t		pos;
+	bool			overflow;
+};
+
+static int profile_udata_cb(const struct nftnl_udata *attr, void *data)
+{
+	struct profile_udata *pu = data;
+
+	if (nftnl_udata_type(attr) == NFT_UDATA_RULE_PROFILE) {
+		if (nftnl_udata_len(attr) == sizeof(uint32_t)) {
+			pu->marked = true;
+			pu->pos = nftnl_udata_get_u32(attr);
+		}
+		return 0;
+	}
+
+	/* everything else is copied as it is. */
+	if (pu->buf &&
+	    !nftnl_udata_put(pu->buf, nftnl_udata_type(attr),
+			     nftnl_udata_len(attr), nftnl_udata_get(attr)))
+		pu->overflow = true;
+
+	return 0;
+}
+
+static void profile_udata_parse(const struct nlattr *udata,
+				struct profile_udata *pu)
+{
+	if (!udata)
+		return;
+
+	nftnl_udata_parse(mnl_attr_get_payload(udata),
+			  mnl_attr_get_payload_len(udata),
+			  profile_udata_cb, pu);
+}
+
+static void profile_counter_put(struct nlmsghdr *nlh)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+	mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "counter");
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void attr_copy(struct nlmsghdr *nlh, const struct nlattr *attr)
+{
+	memcpy(mnl_nlmsg_get_payload_tail(nlh), attr, MNL_ALIGN(attr->nla_len));
+	nlh->nlmsg_len += MNL_ALIGN(attr->nla_len);
+}
+
+struct profile_ctx {
+	struct netlink_ctx	*ctx;
+	bool			start;
+	unsigned int		num_rules;
+};
+
+/* Replace the rule in @nlh by handle, with a counter added at or removed
+ * from @pos and @udata as userdata.
+ */
+static void profile_rule_msg(struct profile_ctx *pctx,
+			     const struct nlmsghdr *nlh,
+			     const struct nlattr *exprs,
+			     const struct nftnl_udata_buf *udata, uint32_t pos)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	struct mnl_batch *batch = pctx->ctx->batch;
+	const struct nlattr *attr;
+	struct nlmsghdr *new;
+	struct nlattr *nest;
+	uint32_t i = 0;
+
+	new = nftnl_nlmsg_build_hdr(mnl_batch_buffer(batch), NFT_MSG_NEWRULE,
+				    nfg->nfgen_family, NLM_F_REPLACE,
+				    pctx->ctx->seqnum);
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_RULE_POSITION:
+		case NFTA_RULE_EXPRESSIONS:
+		case NFTA_RULE_USERDATA:
+			break;
+		default:
+			attr_copy(new, attr);
+			break;
+		}
+	}
+
+	nest = mnl_attr_nest_start(new, NFTA_RULE_EXPRESSIONS);
+	mnl_attr_for_each_nested(attr, exprs) {
+		if (i++ == pos) {
+			if (!pctx->start)
+				continue;
+			profile_counter_put(new);
+		}
+		attr_copy(new, attr);
+	}
+	if (pctx->start && i == pos)
+		profile_counter_put(new);
+	mnl_attr_nest_end(new, nest);
+
+	if (nftnl_udata_buf_len(udata))
+		mnl_attr_put(new, NFTA_RULE_USERDATA, nftnl_udata_buf_len(udata),
+			     nftnl_udata_buf_data(udata));
+
+	mnl_nft_batch_continue(batch);
+}
+
+static int profile_rule_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr, *exprs = NULL, *udata = NULL;
+	struct profile_ctx *pctx = data;
+	struct profile_udata pu = {};
+	bool bound = false;
+	uint32_t pos;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case NFTA_RULE_CHAIN:
+			bound = attr_anonymous(attr, "__chain");
+			break;
+		case NFTA_RULE_EXPRESSIONS:
+			exprs = attr;
+			break;
+		case NFTA_RULE_USERDATA:
+			udata = attr;
+			break;
+		}
+	}
+	if (!exprs)
+		return MNL_CB_OK;
+
+	profile_udata_parse(udata, &pu);
+	if (pctx->start) {
+		if (pu.marked || bound || !profile_counter_pos(exprs, &pos))
+			return MNL_CB_OK;
+	} else {
+		if (!pu.marked || !profile_counter_at(exprs, pu.pos))
+			return MNL_CB_OK;
+		pos = pu.pos;
+	}
+
+	pu.buf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+	if (!pu.buf)
+		memory_allocation_error();
+
+	profile_udata_parse(udata, &pu);
+	if (pctx->start &&
+	    !nftnl_udata_put_u32(pu.buf, NFT_UDATA_RULE_PROFILE, pos))
+		pu.overflow = true;
+
+	/* no room left in the userdata of the rule, leave it alone. */
+	if (!pu.overflow) {
+		profile_rule_msg(pctx, nlh, exprs, pu.buf, pos);
+		pctx->num_rules++;
+	}
+
+	nftnl_udata_buf_free(pu.buf);
+
+	return MNL_CB_OK;
+}
+
+int profile_rules(struct netlink_ctx *ctx, const struct cmd *cmd, bool start)
+{
+	struct profile_ctx pctx = {
+		.ctx	= ctx,
+		.start	= start,
+	};
+
+	return mnl_nft_rule_dump_raw(ctx, cmd->handle.family,
+				     cmd->handle.table.name,
+				     profile_rule_cb, &pctx);
+}
+
+struct profile_chain {
+	const struct chain	*chain;
+	uint64_t		entered;
+	uint64_t		ended;
+	/* some of the rules that lead here have no counter */
+	bool			unknown;
+};
+
+struct profile_table {
+	struct profile_chain	*chains;
+	unsigned int		num_chains;
+};
+
+static int profile_chain_cmp(const void *a, const void *b)
+{
+	const struct profile_chain *pa = a, *pb = b;
+
+	if (pa->chain == pb->chain)
+		return 0;
+
+	return pa->chain < pb->chain ? -1 : 1;
+}
+
+static struct profile_chain *profile_chain_find(struct profile_table *pt,
+						const struct table *table,
+						const struct expr *verdict)
+{
+	struct profile_chain key = {};
+	char name[NFT_CHAIN_MAXNAMELEN];
+
+	if (verdict->etype != EXPR_VERDICT || !verdict->chain)
+		return NULL;
+
+	expr_chain_export(verdict->chain, name);
+	key.chain = chain_cache_find(table, name);
+	if (!key.chain)
+		return NULL;
+
+	return bsearch(&key, pt->chains, pt->num_chains, sizeof(key),
+		       profile_chain_cmp);
+}
+
+/* Packets that reach the chains of a verdict map can not be told apart. */
+static void profile_vmap_targets(struct profile_table *pt,
+				 const struct table *table,
+				 const struct expr *map)
+{
+	const struct expr *set = map->mappings, *i;
+	struct profile_chain *target;
+
+	if (set->etype == EXPR_SET_REF)
+		set = set->set->init;
+	if (!set || set->etype != EXPR_SET)
+		return;
+
+	list_for_each_entry(i, &set->expressions, list) {
+		if (i->etype != EXPR_MAPPING)
+			continue;
+
+		target = profile_chain_find(pt, table, i->right);
+		if (target)
+			target->unknown = true;
+	}
+}
+
+static const struct stmt *rule_counter(const struct rule *rule)
+{
+	const struct stmt *stmt;
+
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (stmt->ops->type == STMT_COUNTER)
+			return stmt;
+	}
+
+	return NULL;
+}
+
+/* Does the rule end the walk through the ruleset, or leave the chain? */
+static bool rule_ends(const struct rule *rule)
+{
+	const struct stmt *stmt;
+
+	if (list_empty(&rule->stmts))
+		return false;
+
+	stmt = list_last_entry(&rule->stmts, struct stmt, list);
+	switch (stmt->ops->type) {
+	case STMT_REJECT:
+	case STMT_QUEUE:
+		return true;
+	case STMT_VERDICT:
+		if (stmt->expr->etype != EXPR_VERDICT)
+			return false;
+
+		switch (stmt->expr->verdict) {
+		case NF_ACCEPT:
+		case NF_DROP:
+		case NF_QUEUE:
+		case NFT_GOTO:
+			return true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+static void profile_table_walk(struct profile_table *pt,
+			       const struct table *table)
+{
+	struct profile_chain *pc, *target;
+	const struct stmt *counter, *stmt;
+	const struct rule *rule;
+	unsigned int i;
+	uint64_t packets;
+
+	for (i = 0; i < pt->num_chains; i++) {
+		pc = &pt->chains[i];
+		list_for_each_entry(rule, &pc->chain->rules, list) {
+			counter = rule_counter(rule);
+			packets = counter ? counter->counter.packets : 0;
+
+			if (rule_ends(rule))
+				pc->ended += packets;
+
+			if (list_empty(&rule->stmts))
+				continue;
+
+			stmt = list_last_entry(&rule->stmts, struct stmt, list);
+			if (stmt->ops->type != STMT_VERDICT)
+				continue;
+
+			if (stmt->expr->etype == EXPR_MAP) {
+				profile_vmap_targets(pt, table, stmt->expr);
+				continue;
+			}
+
+			target = profile_chain_find(pt, table, stmt->expr);
+			if (!target)
+				continue;
+
+			if (counter)
+				target->entered += packets;
+			else
+				target->unknown = true;
+		}
+	}
+}
+
+static void profile_rule_print(const struct rule *rule,
+			       struct output_ctx *octx)
+{
+	const struct stmt *counter = rule_counter(rule), *stmt;
+	const char *sep = "";
+
+	if (counter)
+		nft_print(octx, "\t\t%12" PRIu64 "  ", counter->counter.packets);
+	else
+		nft_print(octx, "\t\t%12s  ", "-");
+
+	/* the count is the first column, not repeated in the rule. */
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (stmt == counter)
+			continue;
+
+		nft_print(octx, "%s", sep);
+		stmt->ops->print(stmt, octx);
+		sep = " ";
+	}
+
+	if (rule->comment)
+		nft_print(octx, " comment \"%s\"", rule->comment);
+
+	nft_print(octx, " # handle %" PRIu64 "\n", rule->handle.handle.id);
+}
+
+static void profile_chain_print(const struct profile_chain *pc,
+				struct output_ctx *octx)
+{
+	const struct chain *chain = pc->chain;
+	const struct rule *rule;
+
+	nft_print(octx, "\tchain %s", chain->handle.chain.name);
+	if (chain->flags & CHAIN_F_BASECHAIN)
+		nft_print(octx, ": hook %s, verdicts %" PRIu64,
+			  chain->hook.name, pc->ended);
+	else if (pc->unknown)
+		nft_print(octx, ": verdicts %" PRIu64, pc->ended);
+	else
+		nft_print(octx, ": entered %" PRIu64 ", verdicts %" PRIu64
+			  ", returned %" PRIu64, pc->entered, pc->ended,
+			  pc->entered > pc->ended ? pc->entered - pc->ended : 0);
+	nft_print(octx, "\n");
+
+	list_for_each_entry(rule, &chain->rules, list)
+		profile_rule_print(rule, octx);
+}
+
+static void profile_table_report(const struct table *table,
+				 struct output_ctx *octx)
+{
+	struct profile_table pt = {};
+	const struct chain *chain;
+	unsigned int i = 0;
+
+	list_for_each_entry(chain, &table->chain_cache.list, cache.list)
+		pt.num_chains++;
+
+	nft_print(octx, "table %s %s\n", family2str(table->handle.family),
+		  table->handle.table.name);
+	if (!pt.num_chains)
+		return;
+
+	pt.chains = xzalloc_array(pt.num_chains, sizeof(*pt.chains));
+	list_for_each_entry(chain, &table->chain_cache.list, cache.list)
+		pt.chains[i++].chain = chain;
+
+	/* sorted by address to find the targets of jumps, printed in the
+	 * order of the listing.
+	 */
+	qsort(pt.chains, pt.num_chains, sizeof(*pt.chains), profile_chain_cmp);
+	profile_table_walk(&pt, table);
+
+	list_for_each_entry(chain, &table->chain_cache.list, cache.list) {
+		struct profile_chain key = { .chain = chain };
+
+		profile_chain_print(bsearch(&key, pt.chains, pt.num_chains,
+					    sizeof(key), profile_chain_cmp),
+				    octx);
+	}
+
+	free(pt.chains);
+}
+
+void profile_report(struct netlink_ctx *ctx, const struct cmd *cmd)
+{
+	const struct handle *h = &cmd->handle;
+	const struct table *table;
+
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list,
+			    cache.list) {
+		if (h->family != NFPROTO_UNSPEC &&
+		    h->family != table->handle.family)
+			continue;
+		if (h->table.name &&
+		    strcmp(h->table.name, table->handle.table.name))
+			continue;
+
+		profile_table_report(table, &ctx->nft->output);
+	}
+}
@@ -12,6 +12,7 @@
 #include <nft.h>
 
 #include <stddef.h>
+#include <pthread.h>
 #include <net/if_arp.h>
 #include <arpa/inet.h>
 #include <linux/netfilter.h>
@@ -1316,3 +1317,118 @@ const struct proto_desc *proto_find_desc(enum proto_desc_id desc_id)
 
 	return NULL;
 }
+
+/*
+ * Templates of the protocols in proto_definitions[], sorted by offset and
+ * length, so the template of a payload access is found with a binary
+ * search. Built once, the descriptions do not change.
+ */
+struct proto_tmpl_index {
+	unsigned int	num;
+	struct {
+		unsigned int	offset;
+		unsigned int	len;
+		unsigned int	idx;
+	} tmpl[PROTO_HDRS_MAX];
+};
+
+static struct proto_tmpl_index proto_tmpl_index[PROTO_DESC_MAX + 1];
+static pthread_once_t proto_tmpl_index_once = PTHREAD_ONCE_INIT;
+
+static int proto_tmpl_key_cmp(unsigned int offset1, unsigned int len1,
+			      unsigned int offset2, unsigned int len2)
+{
+	if (offset1 != offset2)
+		return offset1 < offset2 ? -1 : 1;
+	if (len1 != len2)
+		return len1 < len2 ? -1 : 1;
+
+	return 0;
+}
+
+static void proto_tmpl_index_build(void)
+{
+	const struct proto_hdr_template *tmpl;
+	struct proto_tmpl_index *index;
+	const struct proto_desc *desc;
+	unsigned int id, i, j;
+
+	for (id = 0; id <= PROTO_DESC_MAX; id++) {
+		desc = proto_definitions[id];
+		if (!desc)
+			continue;
+
+		index = &proto_tmpl_index[id];
+		for (i = 0; i < array_size(desc->templates); i++) {
+			tmpl = &desc->templates[i];
+			if (tmpl->len == 0)
+				continue;
+
+			/* insertion sort, equal keys stay in template order. */
+			for (j = index->num; j > 0; j--) {
+				if (proto_tmpl_key_cmp(index->tmpl[j - 1].offset,
+						       index->tmpl[j - 1].len,
+						       tmpl->offset, tmpl->len) <= 0)
+					break;
+				index->tmpl[j] = index->tmpl[j - 1];
+			}
+			index->tmpl[j].offset = tmpl->offset;
+			index->tmpl[j].len = tmpl->len;
+			index->tmpl[j].idx = i;
+			index->num++;
+		}
+	}
+}
+
+/**
+ * proto_find_tmpl - find the next template at a given offset and length
+ *
+ * @desc:	protocol description
+ * @offset:	offset of the template, in bits
+ * @len:	length of the template, in bits
+ * @prev:	index of the previous match, or -1 to start
+ *
+ * Returns the index of the next template of @desc after @prev, in template
+ * order, at @offset with length @len, or -1 if there is none.
+ */
+int proto_find_tmpl(const struct proto_desc *desc, unsigned int offset,
+		    unsigned int len, int prev)
+{
+	const struct proto_tmpl_index *index;
+	unsigned int lo, hi, mid;
+	int i;
+
+	if (desc->id > PROTO_DESC_MAX || proto_definitions[desc->id] != desc ||
+	    len == 0) {
+		for (i = prev + 1; i < (int)array_size(desc->templates); i++) {
+			if (desc->templates[i].offset == offset &&
+			    desc->templates[i].len == len)
+				return i;
+		}
+		return -1;
+	}
+
+	pthread_once(&proto_tmpl_index_once, proto_tmpl_index_build);
+	index = &proto_tmpl_index[desc->id];
+
+	lo = 0;
+	hi = index->num;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (proto_tmpl_key_cmp(index->tmpl[mid].offset,
+				       index->tmpl[mid].len, offset, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < index->num; lo++) {
+		if (index->tmpl[lo].offset != offset ||
+		    index->tmpl[lo].len != len)
+			break;
+		if ((int)index->tmpl[lo].idx > prev)
+			return index->tmpl[lo].idx;
+	}
+
+	return -1;
+}
@@ -0,0 +1,1018 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Hostname resolution for address symbols. Hostnames that show up in the
+ * command list where an IPv4 or IPv6 address is expected are resolved in
+ * one go from a few threads before evaluation starts. Results are kept in
+ * a per-context cache, so names used by many rules are queried only once.
+ *
+ * Listings with reverse DNS enabled work the other way around: addresses
+ * in the objects to be printed are looked up from a few threads within a
+ * time budget before printing starts, see nft_resolver_prefetch_names().
+ *
+ * The same cache maps service ports to names and cgroupv2 ids to paths, the
+ * latter from an index of the whole cgroup tree, see nft_resolver_cgroup().
+ */
+
+#include <nft.h>
+
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/netfilter.h>
+
+#include <nftables.h>
+#include <rule.h>
+#include <statement.h>
+#include <expression.h>
+#include <datatype.h>
+#include <resolve.h>
+#include "nftutils.h"
+
+#define NFT_RESOLVER_HSIZE	512
+#define NFT_RESOLVER_THREADS	16
+
+/* getaddrinfo() does not report record lifetimes, use fixed ones. */
+#define NFT_RESOLVER_TTL	60
+#define NFT_RESOLVER_NEG_TTL	5
+
+/* Time allowed for reverse lookups before a listing is printed, in ms. */
+#define NFT_RESOLVER_NAME_BUDGET	2000
+
+struct resolver_entry {
+	struct hlist_node	hnode;
+	char			*name;
+	int			family;
+	int			err;
+	unsigned int		naddrs;
+	union nft_resolve_addr	addr;
+	time_t			expires;
+	bool			queued;
+};
+
+struct name_entry {
+	struct hlist_node	hnode;
+	int			family;
+	union nft_resolve_addr	addr;
+	char			*name;
+	time_t			expires;
+	bool			queued;
+};
+
+struct service_entry {
+	struct hlist_node	hnode;
+	uint16_t		port;
+	char			*name;
+};
+
+struct cgroup_entry {
+	struct hlist_node	hnode;
+	uint64_t		id;
+	char			*path;
+};
+
+struct nft_resolver {
+	struct hlist_head	ht[NFT_RESOLVER_HSIZE];
+	struct hlist_head	name_ht[NFT_RESOLVER_HSIZE];
+	struct hlist_head	service_ht[NFT_RESOLVER_HSIZE];
+	struct hlist_head	cgroup_ht[NFT_RESOLVER_HSIZE];
+	time_t			cgroup_built;
+	bool			cgroup_index;
+	/* rules of different tables may be evaluated in parallel. */
+	pthread_mutex_t		lock;
+};
+
+struct resolver_batch {
+	struct resolver_entry	**entry;
+	unsigned int		num;
+	unsigned int		size;
+	unsigned int		next;
+	pthread_mutex_t		lock;
+};
+
+static time_t resolver_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void cgroup_index_flush(struct nft_resolver *resolver)
+{
+	struct cgroup_entry *entry;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	for (i = 0; i < NFT_RESOLVER_HSIZE; i++) {
+		hlist_for_each_entry_safe(entry, pos, n,
+					  &resolver->cgroup_ht[i], hnode) {
+			hlist_del(&entry->hnode);
+			free(entry->path);
+			free(entry);
+		}
+	}
+	resolver->cgroup_index = false;
+}
+
+struct nft_resolver *nft_resolver_alloc(void)
+{
+	struct nft_resolver *resolver;
+
+	resolver = xzalloc(sizeof(struct nft_resolver));
+	pthread_mutex_init(&resolver->lock, NULL);
+
+	return resolver;
+}
+
+void nft_resolver_free(struct nft_resolver *resolver)
+{
+	struct service_entry *service;
+	struct resolver_entry *entry;
+	struct name_entry *name;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	if (!resolver)
+		return;
+
+	for (i = 0; i < NFT_RESOLVER_HSIZE; i++) {
+		hlist_for_each_entry_safe(entry, pos, n, &resolver->ht[i],
+					  hnode) {
+			free(entry->name);
+			free(entry);
+		}
+		hlist_for_each_entry_safe(name, pos, n, &resolver->name_ht[i],
+					  hnode) {
+			free(name->name);
+			free(name);
+		}
+		hlist_for_each_entry_safe(service, pos, n,
+					  &resolver->service_ht[i], hnode) {
+			free(service->name);
+			free(service);
+		}
+	}
+	cgroup_index_flush(resolver);
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver);
+}
+
+static struct resolver_entry *resolver_entry_get(struct nft_resolver *resolver,
+						 const char *name, int family)
+{
+	uint32_t hash = djb_hash(name) % NFT_RESOLVER_HSIZE;
+	struct resolver_entry *entry;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(entry, pos, &resolver->ht[hash], hnode) {
+		if (entry->family == family && !strcmp(entry->name, name))
+			return entry;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->name = xstrdup(name);
+	entry->family = family;
+	hlist_add_head(&entry->hnode, &resolver->ht[hash]);
+
+	return entry;
+}
+
+static void resolver_entry_resolve(struct resolver_entry *entry)
+{
+	struct addrinfo *ai, hints = { .ai_family = entry->family,
+				       .ai_socktype = SOCK_DGRAM };
+
+	entry->naddrs = 0;
+	entry->err = getaddrinfo(entry->name, NULL, &hints, &ai);
+	if (entry->err != 0) {
+		entry->expires = resolver_now() + NFT_RESOLVER_NEG_TTL;
+		return;
+	}
+
+	assert(ai->ai_addr->sa_family == entry->family);
+	if (entry->family == AF_INET)
+		entry->addr.in =
+			((struct sockaddr_in *)(void *)ai->ai_addr)->sin_addr;
+	else
+		entry->addr.in6 =
+			((struct sockaddr_in6 *)(void *)ai->ai_addr)->sin6_addr;
+
+	entry->naddrs = ai->ai_next ? 2 : 1;
+	freeaddrinfo(ai);
+	entry->expires = resolver_now() + NFT_RESOLVER_TTL;
+}
+
+int nft_resolve(struct nft_resolver *resolver, const char *name, int family,
+		union nft_resolve_addr *addr, unsigned int *naddrs)
+{
+	struct resolver_entry *entry;
+	int err;
+
+	if (inet_pton(family, name, addr) == 1) {
+		*naddrs = 1;
+		return 0;
+	}
+
+	pthread_mutex_lock(&resolver->lock);
+	entry = resolver_entry_get(resolver, name, family);
+	if (entry->expires <= resolver_now())
+		resolver_entry_resolve(entry);
+
+	err = entry->err;
+	if (err == 0) {
+		*addr = entry->addr;
+		*naddrs = entry->naddrs;
+	}
+	pthread_mutex_unlock(&resolver->lock);
+
+	return err;
+}
+
+static void resolver_batch_add(struct nft_resolver *resolver,
+			       struct resolver_batch *batch,
+			       const char *name, int family, time_t now)
+{
+	union nft_resolve_addr addr;
+	struct resolver_entry *entry;
+
+	if (inet_pton(family, name, &addr) == 1)
+		return;
+
+	entry = resolver_entry_get(resolver, name, family);
+	if (entry->queued || entry->expires > now)
+		return;
+
+	if (batch->num == batch->size) {
+		batch->size = batch->size ? batch->size * 2 : 64;
+		batch->entry = xrealloc(batch->entry,
+					batch->size * sizeof(*batch->entry));
+	}
+	entry->queued = true;
+	batch->entry[batch->num++] = entry;
+}
+
+static void resolver_collect_expr(struct nft_resolver *resolver,
+				  struct resolver_batch *batch,
+				  const struct expr *expr, int family,
+				  time_t now)
+{
+	const struct expr *i;
+
+	switch (expr->etype) {
+	case EXPR_SYMBOL:
+		if (expr->symtype == SYMBOL_VALUE)
+			resolver_batch_add(resolver, batch, expr->identifier,
+					   family, now);
+		break;
+	case EXPR_VARIABLE:
+		if (expr->sym->expr)
+			resolver_collect_expr(resolver, batch, expr->sym->expr,
+					      family, now);
+		break;
+	case EXPR_SET:
+	case EXPR_LIST:
+		list_for_each_entry(i, &expr->expressions, list)
+			resolver_collect_expr(resolver, batch, i, family, now);
+		break;
+	case EXPR_SET_ELEM:
+		resolver_collect_expr(resolver, batch, expr->key, family, now);
+		break;
+	case EXPR_MAPPING:
+		resolver_collect_expr(resolver, batch, expr->left, family, now);
+		break;
+	case EXPR_RANGE:
+		resolver_collect_expr(resolver, batch, expr->left, family, now);
+		resolver_collect_expr(resolver, batch, expr->right, family, now);
+		break;
+	case EXPR_PREFIX:
+		resolver_collect_expr(resolver, batch, expr->prefix, family,
+				      now);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Address family of the keys matched against @expr, 0 if not an address. */
+static int resolver_expr_family(const struct expr *expr)
+{
+	if (!expr || !expr->dtype)
+		return 0;
+	if (expr->dtype == &ipaddr_type)
+		return AF_INET;
+	if (expr->dtype == &ip6addr_type)
+		return AF_INET6;
+
+	return 0;
+}
+
+static void resolver_collect_rule(struct nft_resolver *resolver,
+				  struct resolver_batch *batch,
+				  const struct rule *rule, time_t now)
+{
+	const struct stmt *stmt;
+	const struct expr *rel;
+	int family;
+
+	list_for_each_entry(stmt, &rule->stmts, list) {
+		if (stmt->ops->type != STMT_EXPRESSION)
+			continue;
+
+		rel = stmt->expr;
+		if (rel->etype != EXPR_RELATIONAL)
+			continue;
+
+		family = resolver_expr_family(rel->left);
+		if (family)
+			resolver_collect_expr(resolver, batch, rel->right,
+					      family, now);
+	}
+}
+
+static void resolver_collect_set(struct nft_resolver *resolver,
+				 struct resolver_batch *batch,
+				 const struct set *set, const struct expr *init,
+				 time_t now)
+{
+	int family;
+
+	if (!set || !set->key || !init)
+		return;
+
+	family = resolver_expr_family(set->key);
+	if (family)
+		resolver_collect_expr(resolver, batch, init, family, now);
+}
+
+static void *resolver_batch_run(void *arg)
+{
+	struct resolver_batch *batch = arg;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (i >= batch->num)
+			break;
+
+		resolver_entry_resolve(batch->entry[i]);
+	}
+
+	return NULL;
+}
+
+static void resolver_batch_resolve(struct resolver_batch *batch)
+{
+	unsigned int k, n = min(batch->num, (unsigned int)NFT_RESOLVER_THREADS);
+	pthread_t thread[NFT_RESOLVER_THREADS];
+	bool started[NFT_RESOLVER_THREADS];
+
+	pthread_mutex_init(&batch->lock, NULL);
+
+	for (k = 1; k < n; k++)
+		started[k] = pthread_create(&thread[k], NULL,
+					    resolver_batch_run, batch) == 0;
+
+	resolver_batch_run(batch);
+
+	for (k = 1; k < n; k++) {
+		if (started[k])
+			pthread_join(thread[k], NULL);
+	}
+
+	pthread_mutex_destroy(&batch->lock);
+
+	for (k = 0; k < batch->num; k++)
+		batch->entry[k]->queued = false;
+}
+
+/*
+ * Resolve hostnames used as addresses before evaluating @cmds. Symbols are
+ * not typed until evaluation, so only look at those whose type is already
+ * known from the parser: the right hand side of address matches and the
+ * elements of sets with an address key. Anything missed here is resolved
+ * on demand by nft_resolve().
+ */
+void nft_resolver_prefetch(struct nft_ctx *nft, struct list_head *cmds)
+{
+	struct resolver_batch batch = {};
+	time_t now = resolver_now();
+	const struct table *table;
+	const struct cmd *cmd;
+
+	if (nft_input_no_dns(&nft->input))
+		return;
+
+	list_for_each_entry(cmd, cmds, list) {
+		switch (cmd->obj) {
+		case CMD_OBJ_RULE:
+			if (cmd->op != CMD_ADD &&
+			    cmd->op != CMD_INSERT &&
+			    cmd->op != CMD_REPLACE)
+				break;
+
+			resolver_collect_rule(nft->resolver, &batch, cmd->rule,
+					      now);
+			break;
+		case CMD_OBJ_SETELEMS:
+			resolver_collect_set(nft->resolver, &batch, cmd->set,
+					     cmd->set->init, now);
+			break;
+		case CMD_OBJ_ELEMENTS:
+			table = table_cache_find(&nft->cache->table_cache,
+						 cmd->handle.table.name,
+						 cmd->handle.family);
+			if (!table)
+				break;
+
+			resolver_collect_set(nft->resolver, &batch,
+					     set_cache_find(table,
+							    cmd->handle.set.name),
+					     cmd->expr, now);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (batch.num > 0)
+		resolver_batch_resolve(&batch);
+
+	free(batch.entry);
+}
+
+static uint32_t name_entry_hash(int family, const union nft_resolve_addr *addr)
+{
+	const uint32_t *word = (const uint32_t *)addr;
+	unsigned int i, n = family == AF_INET ? 1 : 4;
+	uint32_t hash = family;
+
+	for (i = 0; i < n; i++)
+		hash = hash * 33 ^ word[i];
+
+	return hash % NFT_RESOLVER_HSIZE;
+}
+
+static size_t resolve_addr_len(int family)
+{
+	return family == AF_INET ? sizeof(struct in_addr) :
+				   sizeof(struct in6_addr);
+}
+
+static struct name_entry *name_entry_get(struct nft_resolver *resolver,
+					 int family,
+					 const union nft_resolve_addr *addr)
+{
+	uint32_t hash = name_entry_hash(family, addr);
+	struct name_entry *entry;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(entry, pos, &resolver->name_ht[hash], hnode) {
+		if (entry->family == family &&
+		    !memcmp(&entry->addr, addr, resolve_addr_len(family)))
+			return entry;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->family = family;
+	memcpy(&entry->addr, addr, resolve_addr_len(family));
+	hlist_add_head(&entry->hnode, &resolver->name_ht[hash]);
+
+	return entry;
+}
+
+static socklen_t name_sockaddr(struct sockaddr_storage *ss, int family,
+			       const union nft_resolve_addr *addr)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET) {
+		sin->sin_family = AF_INET;
+		sin->sin_addr = addr->in;
+		return sizeof(*sin);
+	}
+
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_addr = addr->in6;
+	return sizeof(*sin6);
+}
+
+/* Name of @addr, NULL if it has none. */
+static char *name_lookup(int family, const union nft_resolve_addr *addr)
+{
+	struct sockaddr_storage ss;
+	char buf[NI_MAXHOST];
+	socklen_t len;
+
+	len = name_sockaddr(&ss, family, addr);
+	if (getnameinfo((struct sockaddr *)&ss, len, buf, sizeof(buf),
+			NULL, 0, NI_NAMEREQD) != 0)
+		return NULL;
+
+	return xstrdup(buf);
+}
+
+static void name_entry_set(struct name_entry *entry, char *name, time_t now)
+{
+	free(entry->name);
+	entry->name = name;
+	entry->expires = now + (name ? NFT_RESOLVER_TTL : NFT_RESOLVER_NEG_TTL);
+}
+
+/*
+ * Copy the name of @addr to @buf, false if it should be printed as a
+ * number. Addresses that were not prefetched are looked up right away.
+ */
+bool nft_resolver_name(struct nft_resolver *resolver, int family,
+		       const void *addr, char *buf, size_t len)
+{
+	time_t now = resolver_now();
+	struct name_entry *entry;
+	char *name;
+
+	if (!resolver) {
+		name = name_lookup(family, addr);
+	} else {
+		entry = name_entry_get(resolver, family, addr);
+		if (entry->expires <= now)
+			name_entry_set(entry, name_lookup(family, addr), now);
+		name = entry->name;
+	}
+
+	if (!name || strlen(name) >= len) {
+		if (!resolver)
+			free(name);
+		return false;
+	}
+
+	strcpy(buf, name);
+	if (!resolver)
+		free(name);
+
+	return true;
+}
+
+/* Service name of @port, in network byte order, just like nft_getservbyport(). */
+bool nft_resolver_service(struct nft_resolver *resolver, uint16_t port,
+			  char *buf, size_t len)
+{
+	uint32_t hash = port % NFT_RESOLVER_HSIZE;
+	char name[NFT_SERVNAME_MAXSIZE];
+	struct service_entry *entry;
+	struct hlist_node *pos;
+
+	if (!resolver)
+		return nft_getservbyport(port, NULL, buf, len);
+
+	hlist_for_each_entry(entry, pos, &resolver->service_ht[hash], hnode) {
+		if (entry->port == port)
+			goto found;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->port = port;
+	if (nft_getservbyport(port, NULL, name, sizeof(name)))
+		entry->name = xstrdup(name);
+	hlist_add_head(&entry->hnode, &resolver->service_ht[hash]);
+found:
+	if (!entry->name || strlen(entry->name) >= len)
+		return false;
+
+	strcpy(buf, entry->name);
+	return true;
+}
+
+/* Calls @cb for each cgroup below @root with its path relative to @root,
+ * until it returns true.
+ */
+static bool cgroup_walk(const char *root, const char *path,
+			bool (*cb)(uint64_t id, const char *path, void *data),
+			void *data)
+{
+	char dir_path[PATH_MAX + 1], dent_path[PATH_MAX + 1];
+	struct dirent *dent;
+	bool done = false;
+	struct stat st;
+	DIR *d;
+
+	snprintf(dir_path, sizeof(dir_path), "%s%s%s", root,
+		 path[0] ? "/" : "", path);
+	d = opendir(dir_path);
+	if (!d)
+		return false;
+
+	while (!done && (dent = readdir(d)) != NULL) {
+		if (!strcmp(dent->d_name, ".") ||
+		    !strcmp(dent->d_name, ".."))
+			continue;
+
+		/* cgroups are directories, the rest are control files. */
+		if (dent->d_type == DT_UNKNOWN) {
+			snprintf(dent_path, sizeof(dent_path), "%s/%s",
+				 dir_path, dent->d_name);
+			if (stat(dent_path, &st) < 0 || !S_ISDIR(st.st_mode))
+				continue;
+		} else if (dent->d_type != DT_DIR) {
+			continue;
+		}
+
+		snprintf(dent_path, sizeof(dent_path), "%s%s%s", path,
+			 path[0] ? "/" : "", dent->d_name);
+
+		done = cb(dent->d_ino, dent_path, data) ||
+		       cgroup_walk(root, dent_path, cb, data);
+	}
+	closedir(d);
+
+	return done;
+}
+
+struct cgroup_find {
+	uint64_t	id;
+	char		*buf;
+	size_t		len;
+	bool		found;
+};
+
+static bool cgroup_find_cb(uint64_t id, const char *path, void *data)
+{
+	struct cgroup_find *find = data;
+
+	if (id != find->id)
+		return false;
+
+	find->found = strlen(path) < find->len;
+	if (find->found)
+		strcpy(find->buf, path);
+
+	return true;
+}
+
+static bool cgroup_index_cb(uint64_t id, const char *path, void *data)
+{
+	struct nft_resolver *resolver = data;
+	struct cgroup_entry *entry;
+
+	entry = xmalloc(sizeof(*entry));
+	entry->id = id;
+	entry->path = xstrdup(path);
+	hlist_add_head(&entry->hnode,
+		       &resolver->cgroup_ht[id % NFT_RESOLVER_HSIZE]);
+
+	return false;
+}
+
+static void cgroup_index_build(struct nft_resolver *resolver, time_t now)
+{
+	cgroup_index_flush(resolver);
+	cgroup_walk(SYSFS_CGROUPSV2_PATH, "", cgroup_index_cb, resolver);
+	resolver->cgroup_built = now;
+	resolver->cgroup_index = true;
+}
+
+static const struct cgroup_entry *
+cgroup_index_find(const struct nft_resolver *resolver, uint64_t id)
+{
+	struct cgroup_entry *entry;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(entry, pos,
+			     &resolver->cgroup_ht[id % NFT_RESOLVER_HSIZE],
+			     hnode) {
+		if (entry->id == id)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Path of the cgroup with inode @id, relative to the cgroupv2 root. The
+ * first lookup indexes the whole tree in one walk, which is done again once
+ * it expires, or on a miss if it is a few seconds old, to pick up cgroups
+ * created in the meantime.
+ */
+bool nft_resolver_cgroup(struct nft_resolver *resolver, uint64_t id,
+			 char *buf, size_t len)
+{
+	struct cgroup_find find = {
+		.id	= id,
+		.buf	= buf,
+		.len	= len,
+	};
+	const struct cgroup_entry *entry;
+	time_t now = resolver_now();
+
+	if (!resolver) {
+		cgroup_walk(SYSFS_CGROUPSV2_PATH, "", cgroup_find_cb, &find);
+		return find.found;
+	}
+
+	if (!resolver->cgroup_index ||
+	    resolver->cgroup_built + NFT_RESOLVER_TTL <= now)
+		cgroup_index_build(resolver, now);
+
+	entry = cgroup_index_find(resolver, id);
+	if (!entry && resolver->cgroup_built + NFT_RESOLVER_NEG_TTL <= now) {
+		cgroup_index_build(resolver, now);
+		entry = cgroup_index_find(resolver, id);
+	}
+
+	if (!entry || strlen(entry->path) >= len)
+		return false;
+
+	strcpy(buf, entry->path);
+	return true;
+}
+
+/*
+ * Reverse lookups may outlive the listing they were started for, so the
+ * worker threads only touch the batch, which is released by whoever is
+ * done with it last. Results are moved to the cache by the listing thread.
+ */
+struct name_query {
+	struct sockaddr_storage	ss;
+	socklen_t		len;
+	struct name_entry	*entry;
+	char			name[NI_MAXHOST];
+	int			err;
+	bool			done;
+};
+
+struct name_batch {
+	struct name_query	*query;
+	unsigned int		num;
+	unsigned int		size;
+	unsigned int		next;
+	unsigned int		done;
+	unsigned int		refcnt;
+	bool			expired;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+static void name_batch_put(struct name_batch *batch)
+{
+	bool last;
+
+	pthread_mutex_lock(&batch->lock);
+	last = --batch->refcnt == 0;
+	pthread_mutex_unlock(&batch->lock);
+
+	if (!last)
+		return;
+
+	pthread_cond_destroy(&batch->cond);
+	pthread_mutex_destroy(&batch->lock);
+	free(batch->query);
+	free(batch);
+}
+
+static void *name_batch_run(void *arg)
+{
+	struct name_batch *batch = arg;
+	struct name_query *query;
+	unsigned int i;
+	bool expired;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		expired = batch->expired;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (i >= batch->num || expired)
+			break;
+
+		query = &batch->query[i];
+		query->err = getnameinfo((struct sockaddr *)&query->ss,
+					 query->len, query->name,
+					 sizeof(query->name), NULL, 0,
+					 NI_NAMEREQD);
+
+		pthread_mutex_lock(&batch->lock);
+		query->done = true;
+		if (++batch->done == batch->num)
+			pthread_cond_signal(&batch->cond);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	name_batch_put(batch);
+	return NULL;
+}
+
+static void name_batch_add(struct nft_resolver *resolver,
+			   struct name_batch *batch, int family,
+			   const union nft_resolve_addr *addr, time_t now)
+{
+	struct name_entry *entry;
+	struct name_query *query;
+
+	entry = name_entry_get(resolver, family, addr);
+	if (entry->queued || entry->expires > now)
+		return;
+
+	if (batch->num == batch->size) {
+		batch->size = batch->size ? batch->size * 2 : 64;
+		batch->query = xrealloc(batch->query,
+					batch->size * sizeof(*batch->query));
+	}
+	query = &batch->query[batch->num++];
+	memset(query, 0, sizeof(*query));
+	query->len = name_sockaddr(&query->ss, family, addr);
+	query->entry = entry;
+	entry->queued = true;
+}
+
+static void name_collect_expr(struct nft_resolver *resolver,
+			      struct name_batch *batch,
+			      const struct expr *expr, time_t now);
+
+static void name_collect_value(struct nft_resolver *resolver,
+			       struct name_batch *batch,
+			       const struct expr *expr, time_t now)
+{
+	union nft_resolve_addr addr;
+
+	if (expr->dtype == &ipaddr_type &&
+	    expr->len == sizeof(addr.in) * BITS_PER_BYTE) {
+		addr.in.s_addr = mpz_get_be32(expr->value);
+		name_batch_add(resolver, batch, AF_INET, &addr, now);
+	} else if (expr->dtype == &ip6addr_type &&
+		   expr->len == sizeof(addr.in6) * BITS_PER_BYTE) {
+		mpz_export_data(&addr.in6, expr->value, BYTEORDER_BIG_ENDIAN,
+				sizeof(addr.in6));
+		name_batch_add(resolver, batch, AF_INET6, &addr, now);
+	}
+}
+
+static void name_collect_expr(struct nft_resolver *resolver,
+			      struct name_batch *batch,
+			      const struct expr *expr, time_t now)
+{
+	const struct expr *i;
+
+	if (!expr)
+		return;
+
+	switch (expr->etype) {
+	case EXPR_VALUE:
+		name_collect_value(resolver, batch, expr, now);
+		break;
+	case EXPR_SET:
+	case EXPR_LIST:
+	case EXPR_CONCAT:
+		list_for_each_entry(i, &expr->expressions, list)
+			name_collect_expr(resolver, batch, i, now);
+		break;
+	case EXPR_SET_ELEM:
+		name_collect_expr(resolver, batch, expr->key, now);
+		break;
+	case EXPR_SET_REF:
+		if (set_is_anonymous(expr->set->flags))
+			name_collect_expr(resolver, batch, expr->set->init, now);
+		break;
+	case EXPR_MAPPING:
+	case EXPR_RANGE:
+	case EXPR_RELATIONAL:
+		name_collect_expr(resolver, batch, expr->left, now);
+		name_collect_expr(resolver, batch, expr->right, now);
+		break;
+	case EXPR_MAP:
+		name_collect_expr(resolver, batch, expr->mappings, now);
+		break;
+	case EXPR_PREFIX:
+		name_collect_expr(resolver, batch, expr->prefix, now);
+		break;
+	default:
+		break;
+	}
+}
+
+static void name_collect_table(struct nft_resolver *resolver,
+			       struct name_batch *batch,
+			       const struct table *table, time_t now)
+{
+	const struct chain *chain;
+	const struct stmt *stmt;
+	const struct rule *rule;
+	const struct set *set;
+
+	list_for_each_entry(set, &table->set_cache.list, cache.list)
+		name_collect_expr(resolver, batch, set->init, now);
+
+	list_for_each_entry(chain, &table->chain_cache.list, cache.list) {
+		list_for_each_entry(rule, &chain->rules, list) {
+			list_for_each_entry(stmt, &rule->stmts, list) {
+				switch (stmt->ops->type) {
+				case STMT_EXPRESSION:
+					name_collect_expr(resolver, batch,
+							  stmt->expr, now);
+					break;
+				case STMT_NAT:
+					name_collect_expr(resolver, batch,
+							  stmt->nat.addr, now);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void name_batch_resolve(struct name_batch *batch)
+{
+	unsigned int k, n = min(batch->num, (unsigned int)NFT_RESOLVER_THREADS);
+	time_t now = resolver_now();
+	struct name_query *query;
+	struct timespec deadline;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+	batch->refcnt = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (k = 0; k < n; k++) {
+		pthread_mutex_lock(&batch->lock);
+		batch->refcnt++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (pthread_create(&thread, &attr, name_batch_run, batch) != 0)
+			name_batch_put(batch);
+	}
+	pthread_attr_destroy(&attr);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += NFT_RESOLVER_NAME_BUDGET / 1000;
+	deadline.tv_nsec += (NFT_RESOLVER_NAME_BUDGET % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	while (batch->done < batch->num && batch->refcnt > 1) {
+		if (pthread_cond_timedwait(&batch->cond, &batch->lock,
+					   &deadline) != 0)
+			break;
+	}
+	batch->expired = true;
+
+	/* stragglers are printed as numbers until they are looked up again */
+	for (k = 0; k < batch->num; k++) {
+		query = &batch->query[k];
+		query->entry->queued = false;
+		name_entry_set(query->entry,
+			       query->done && !query->err ?
+			       xstrdup(query->name) : NULL, now);
+	}
+	pthread_mutex_unlock(&batch->lock);
+
+	name_batch_put(batch);
+}
+
+/*
+ * Look up the names of the addresses that @cmd is about to list. Anything
+ * missed here, e.g. rules that are only fetched while printing, is looked
+ * up on demand by nft_resolver_name().
+ */
+void nft_resolver_prefetch_names(struct nft_ctx *nft, const struct cmd *cmd)
+{
+	struct name_batch *batch;
+	time_t now = resolver_now();
+	const struct table *table;
+
+	batch = xzalloc(sizeof(*batch));
+
+	list_for_each_entry(table, &nft->cache->table_cache.list, cache.list) {
+		if (cmd->handle.family != NFPROTO_UNSPEC &&
+		    cmd->handle.family != table->handle.family)
+			continue;
+		if (cmd->handle.table.name &&
+		    strcmp(cmd->handle.table.name, table->handle.table.name))
+			continue;
+
+		name_collect_table(nft->resolver, batch, table, now);
+	}
+
+	if (batch->num == 0) {
+		free(batch->query);
+		free(batch);
+		return;
+	}
+
+	name_batch_resolve(batch);
+}
@@ -23,32 +23,32 @@
 #include <rule.h>
 #include <json.h>
 
-void realm_table_rt_init(struct nft_ctx *ctx)
-{
-	ctx->output.tbl.realm = rt_symbol_table_init("rt_realms");
-}
+static struct rt_symbol_db realm_db = {
+	.filename	= "rt_realms",
+};
 
-void realm_table_rt_exit(struct nft_ctx *ctx)
+static const struct symbol_table *realm_table(struct symbol_tables *tbl)
 {
-	rt_symbol_table_free(ctx->output.tbl.realm);
+	return rt_symbol_db_get(&realm_db, &tbl->realm);
 }
 
 static void realm_type_print(const struct expr *expr, struct output_ctx *octx)
 {
-	return symbolic_constant_print(octx->tbl.realm, expr, true, octx);
+	return symbolic_constant_print(realm_table(&octx->tbl), expr, true,
+				       octx);
 }
 
 static struct error_record *realm_type_parse(struct parse_ctx *ctx,
 					     const struct expr *sym,
 					     struct expr **res)
 {
-	return symbolic_constant_parse(ctx, sym, ctx->tbl->realm, res);
+	return symbolic_constant_parse(ctx, sym, realm_table(ctx->tbl), res);
 }
 
 static void realm_type_describe(struct output_ctx *octx)
 {
 	rt_symbol_table_describe(octx, "rt_realms",
-				 octx->tbl.realm, &realm_type);
+				 realm_table(&octx->tbl), &realm_type);
 }
 
 const struct datatype realm_type = {
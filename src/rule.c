@@ -26,6 +26,9 @@
 #include <cache.h>
 #include <owner.h>
 #include <intervals.h>
+#include <resolve.h>
+#include <profile.h>
+#include <journal.h>
 #include "nftutils.h"
 
 #include <libnftnl/common.h>
@@ -150,7 +153,7 @@ struct set *set_alloc(const struct location *loc)
 
 	set = xzalloc(sizeof(*set));
 	set->refcnt = 1;
-	set->handle.set_id = ++set_id;
+	set->handle.set_id = __atomic_add_fetch(&set_id, 1, __ATOMIC_RELAXED);
 	set->location = *loc;
 
 	init_list_head(&set->stmt_list);
@@ -181,7 +184,8 @@ struct set *set_clone(const struct set *set)
 
 struct set *set_get(struct set *set)
 {
-	set->refcnt++;
+	/* see rule_cache_parse_parallel(). */
+	__atomic_add_fetch(&set->refcnt, 1, __ATOMIC_RELAXED);
 	return set;
 }
 
@@ -189,10 +193,14 @@ void set_free(struct set *set)
 {
 	struct stmt *stmt, *next;
 
-	if (--set->refcnt > 0)
+	if (__atomic_sub_fetch(&set->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
 		return;
 
+	interval_index_free(set->index);
+	setelem_index_free(set->elem_index);
+	setelem_data_index_free(set->data_index);
 	expr_free(set->init);
+	expr_free(set->maglev.backends);
 	if (set->comment)
 		free_const(set->comment);
 	handle_free(&set->handle);
@@ -243,6 +251,9 @@ struct print_fmt_options {
 	const char	*table;
 	const char	*family;
 	const char	*stmt_separator;
+	const struct set_window *window;
+	uint64_t	count;
+	const struct set_stats *stats;
 };
 
 const char *set_policy2str(uint32_t policy)
@@ -412,13 +423,49 @@ static void do_set_print(const struct set *set, struct print_fmt_options *opts,
 {
 	set_print_declaration(set, opts, octx);
 
+	if (opts->stats) {
+		nft_print(octx, "%s%s# elements %" PRIu64, opts->tab, opts->tab,
+			  opts->stats->elements);
+		if (set->desc.size)
+			nft_print(octx, " of %u (%" PRIu64 "%%)", set->desc.size,
+				  opts->stats->elements * 100 / set->desc.size);
+		nft_print(octx, ", key %u bytes",
+			  div_round_up(set->key->len, BITS_PER_BYTE));
+		if (set_is_datamap(set->flags))
+			nft_print(octx, ", data %u bytes",
+				  div_round_up(set->data->len, BITS_PER_BYTE));
+		nft_print(octx, ", memory %" PRIu64 " bytes%s",
+			  opts->stats->memory, opts->nl);
+	}
+
 	if ((set_is_meter(set->flags) && nft_output_stateless(octx)) ||
 	    nft_output_terse(octx)) {
 		nft_print(octx, "%s}%s", opts->tab, opts->nl);
 		return;
 	}
 
-	if (set->init != NULL && set->init->size > 0) {
+	if (opts->window && opts->window->count) {
+		nft_print(octx, "%s%s# %" PRIu64 " elements%s", opts->tab,
+			  opts->tab, opts->count, opts->nl);
+	} else if (opts->window && opts->window->top) {
+		nft_print(octx, "%s%s# top %u of %" PRIu64 " elements by %s%s",
+			  opts->tab, opts->tab, set->init ? set->init->size : 0,
+			  opts->count,
+			  opts->window->by == SET_WINDOW_BY_BYTES ?
+			  "bytes" : "packets", opts->nl);
+	} else if (opts->window) {
+		nft_print(octx, "%s%s# %u of %" PRIu64 " elements, from offset %" PRIu64 "%s",
+			  opts->tab, opts->tab, set->init ? set->init->size : 0,
+			  opts->count, opts->window->offset, opts->nl);
+	}
+
+	/* the elements are generated from the maglev declaration. */
+	if (set->maglev.backends && !opts->window) {
+		nft_print(octx, "%s%smaglev size %" PRIu64 " = ",
+			  opts->tab, opts->tab, set->maglev.size);
+		expr_print(set->maglev.backends, octx);
+		nft_print(octx, "%s", opts->nl);
+	} else if (set->init != NULL && set->init->size > 0) {
 		nft_print(octx, "%s%selements = ", opts->tab, opts->tab);
 		expr_print(set->init, octx);
 		nft_print(octx, "%s", opts->nl);
@@ -437,6 +484,86 @@ void set_print(const struct set *s, struct output_ctx *octx)
 	do_set_print(s, &opts, octx);
 }
 
+void set_print_window(const struct set *set, const struct set_window *window,
+		      uint64_t count, struct output_ctx *octx)
+{
+	struct print_fmt_options opts = {
+		.tab		= "\t",
+		.nl		= "\n",
+		.stmt_separator	= "\n",
+		.window		= window,
+		.count		= count,
+	};
+
+	do_set_print(set, &opts, octx);
+}
+
+void set_print_stats(const struct set *set, const struct set_stats *stats,
+		     struct output_ctx *octx)
+{
+	struct print_fmt_options opts = {
+		.tab		= "\t",
+		.nl		= "\n",
+		.stmt_separator	= "\n",
+		.stats		= stats,
+	};
+
+	do_set_print(set, &opts, octx);
+}
+
+/*
+ * Rough estimate of the kernel memory taken by the elements of a set: the
+ * extensions of each element, that is key, data, timeout and expressions,
+ * plus the node of the backend, rounded up to the slab the kernel allocates
+ * them from.
+ */
+#define NFT_SET_ELEM_EXT_HDR	8
+#define NFT_SET_ELEM_NODE	24
+#define NFT_SET_ELEM_RBNODE	40
+#define NFT_SET_ELEM_TIMEOUT	16
+#define NFT_SET_ELEM_EXPR	24
+
+static uint64_t set_elem_slab_size(uint64_t size)
+{
+	uint64_t slab = 8;
+
+	while (slab < size) {
+		if (slab == 64 && size <= 96)
+			return 96;
+		if (slab == 128 && size <= 192)
+			return 192;
+		slab <<= 1;
+	}
+	return slab;
+}
+
+uint64_t set_memory_estimate(const struct set *set, uint64_t elements)
+{
+	uint64_t size = NFT_SET_ELEM_EXT_HDR;
+	struct stmt *stmt;
+
+	size += round_up(div_round_up(set->key->len, BITS_PER_BYTE), 8);
+	if (set_is_datamap(set->flags))
+		size += round_up(div_round_up(set->data->len, BITS_PER_BYTE), 8);
+	else if (set_is_objmap(set->flags))
+		size += sizeof(void *);
+
+	if (set->flags & NFT_SET_TIMEOUT)
+		size += NFT_SET_ELEM_TIMEOUT;
+	list_for_each_entry(stmt, &set->stmt_list, list)
+		size += NFT_SET_ELEM_EXPR;
+
+	/* without concatenations, each end of an interval is an element. */
+	if (set->flags & NFT_SET_INTERVAL && !(set->flags & NFT_SET_CONCAT)) {
+		size += NFT_SET_ELEM_RBNODE;
+		elements *= 2;
+	} else {
+		size += NFT_SET_ELEM_NODE;
+	}
+
+	return set_elem_slab_size(size) * elements;
+}
+
 void set_print_plain(const struct set *s, struct output_ctx *octx)
 {
 	struct print_fmt_options opts = {
@@ -475,6 +602,9 @@ struct rule *rule_get(struct rule *rule)
 
 void rule_free(struct rule *rule)
 {
+	/* lookups fall back to walking the chain until it is indexed again */
+	hlist_del_init(&rule->hnode);
+
 	if (--rule->refcnt > 0)
 		return;
 	stmt_list_free(&rule->stmts);
@@ -500,13 +630,98 @@ void rule_print(const struct rule *rule, struct output_ctx *octx)
 		nft_print(octx, " # handle %" PRIu64, rule->handle.handle.id);
 }
 
-struct rule *rule_lookup(const struct chain *chain, uint64_t handle)
+/*
+ * Handle index of the rules in a chain, built on the first lookup in chains
+ * with many rules. Rules drop out of it when they are released, rules that
+ * are added later on are indexed when a lookup finds them by walking the
+ * chain.
+ */
+#define RULE_INDEX_MIN_RULES	16
+
+struct rule_index {
+	unsigned int		size;
+	unsigned int		count;
+	struct hlist_head	ht[];
+};
+
+static struct hlist_head *rule_index_bucket(struct rule_index *index,
+					    uint64_t handle)
+{
+	return &index->ht[(handle ^ (handle >> 32)) & (index->size - 1)];
+}
+
+static void rule_index_add(struct rule_index *index, struct rule *rule)
+{
+	hlist_del_init(&rule->hnode);
+	hlist_add_head(&rule->hnode,
+		       rule_index_bucket(index, rule->handle.handle.id));
+	index->count++;
+}
+
+static void rule_index_free(struct chain *chain)
+{
+	struct rule_index *index = chain->rule_index;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->size; i++) {
+		hlist_for_each_safe(pos, n, &index->ht[i])
+			hlist_del_init(pos);
+	}
+	free(index);
+	chain->rule_index = NULL;
+}
+
+static void rule_index_build(struct chain *chain)
+{
+	struct rule_index *index;
+	unsigned int num = 0;
+	struct rule *rule;
+
+	list_for_each_entry(rule, &chain->rules, list)
+		num++;
+
+	rule_index_free(chain);
+	if (num < RULE_INDEX_MIN_RULES)
+		return;
+
+	index = xzalloc(sizeof(*index) +
+			sizeof(struct hlist_head) * (1 << fls(num)));
+	index->size = 1 << fls(num);
+
+	list_for_each_entry(rule, &chain->rules, list)
+		rule_index_add(index, rule);
+
+	chain->rule_index = index;
+}
+
+struct rule *rule_lookup(struct chain *chain, uint64_t handle)
 {
+	struct rule_index *index = chain->rule_index;
+	struct hlist_node *pos;
 	struct rule *rule;
 
+	if (index) {
+		hlist_for_each_entry(rule, pos,
+				     rule_index_bucket(index, handle), hnode) {
+			if (rule->handle.handle.id == handle)
+				return rule;
+		}
+	}
+
 	list_for_each_entry(rule, &chain->rules, list) {
-		if (rule->handle.handle.id == handle)
-			return rule;
+		if (rule->handle.handle.id != handle)
+			continue;
+
+		if (!index || index->count > 2 * index->size)
+			rule_index_build(chain);
+		else
+			rule_index_add(index, rule);
+
+		return rule;
 	}
 	return NULL;
 }
@@ -550,17 +765,35 @@ struct scope *scope_init(struct scope *scope, const struct scope *parent)
 	return scope;
 }
 
-void scope_release(const struct scope *scope)
+static void symbol_free(struct symbol *sym)
+{
+	free_const(sym->identifier);
+	expr_free(sym->expr);
+	expr_free(sym->eval);
+	if (sym->eval_ectx)
+		datatype_free(sym->eval_ectx->dtype);
+	free(sym->eval_ectx);
+	free(sym);
+}
+
+/* Scopes with few symbols are searched linearly, larger ones get a hash
+ * index that is doubled whenever it holds more symbols than buckets.
+ */
+#define SCOPE_HASH_MIN	16
+
+void scope_release(struct scope *scope)
 {
 	struct symbol *sym, *next;
 
 	list_for_each_entry_safe(sym, next, &scope->symbols, list) {
 		assert(sym->refcnt == 1);
 		list_del(&sym->list);
-		free_const(sym->identifier);
-		expr_free(sym->expr);
-		free(sym);
+		symbol_free(sym);
 	}
+	free(scope->hash);
+	scope->hash = NULL;
+	scope->hash_size = 0;
+	scope->num_symbols = 0;
 }
 
 void scope_free(struct scope *scope)
@@ -569,6 +802,30 @@ void scope_free(struct scope *scope)
 	free(scope);
 }
 
+static struct hlist_head *scope_bucket(const struct scope *scope,
+				       const char *identifier)
+{
+	return &scope->hash[djb_hash(identifier) % scope->hash_size];
+}
+
+static void scope_rehash(struct scope *scope, unsigned int size)
+{
+	struct symbol *sym;
+	unsigned int i;
+
+	free(scope->hash);
+	scope->hash = xmalloc(size * sizeof(*scope->hash));
+	scope->hash_size = size;
+	for (i = 0; i < size; i++)
+		init_hlist_head(&scope->hash[i]);
+
+	/* Oldest first, so the most recent binding of an identifier heads
+	 * its bucket and keeps shadowing earlier ones.
+	 */
+	list_for_each_entry_reverse(sym, &scope->symbols, list)
+		hlist_add_head(&sym->hnode, scope_bucket(scope, sym->identifier));
+}
+
 void symbol_bind(struct scope *scope, const char *identifier, struct expr *expr)
 {
 	struct symbol *sym;
@@ -579,6 +836,15 @@ void symbol_bind(struct scope *scope, const char *identifier, struct expr *expr)
 	sym->refcnt = 1;
 
 	list_add(&sym->list, &scope->symbols);
+	scope->num_symbols++;
+
+	if (scope->hash) {
+		hlist_add_head(&sym->hnode, scope_bucket(scope, identifier));
+		if (scope->num_symbols > scope->hash_size)
+			scope_rehash(scope, scope->hash_size * 2);
+	} else if (scope->num_symbols >= SCOPE_HASH_MIN) {
+		scope_rehash(scope, SCOPE_HASH_MIN * 2);
+	}
 }
 
 struct symbol *symbol_get(const struct scope *scope, const char *identifier)
@@ -596,40 +862,60 @@ struct symbol *symbol_get(const struct scope *scope, const char *identifier)
 
 static void symbol_put(struct symbol *sym)
 {
-	if (--sym->refcnt == 0) {
-		free_const(sym->identifier);
-		expr_free(sym->expr);
-		free(sym);
-	}
+	if (--sym->refcnt == 0)
+		symbol_free(sym);
 }
 
-static void symbol_remove(struct symbol *sym)
+static void symbol_remove(struct scope *scope, struct symbol *sym)
 {
 	list_del(&sym->list);
+	hlist_del_init(&sym->hnode);
+	scope->num_symbols--;
 	symbol_put(sym);
 }
 
-int symbol_unbind(const struct scope *scope, const char *identifier)
+int symbol_unbind(struct scope *scope, const char *identifier)
 {
 	struct symbol *sym, *next;
 
 	list_for_each_entry_safe(sym, next, &scope->symbols, list) {
 		if (!strcmp(sym->identifier, identifier))
-			symbol_remove(sym);
+			symbol_remove(scope, sym);
 	}
 
 	return 0;
 }
 
-struct symbol *symbol_lookup(const struct scope *scope, const char *identifier)
+static struct symbol *scope_lookup(const struct scope *scope,
+				   const char *identifier)
 {
+	struct hlist_node *n;
 	struct symbol *sym;
 
-	while (scope != NULL) {
-		list_for_each_entry(sym, &scope->symbols, list) {
+	if (scope->hash) {
+		hlist_for_each_entry(sym, n, scope_bucket(scope, identifier),
+				     hnode) {
 			if (!strcmp(sym->identifier, identifier))
 				return sym;
 		}
+		return NULL;
+	}
+
+	list_for_each_entry(sym, &scope->symbols, list) {
+		if (!strcmp(sym->identifier, identifier))
+			return sym;
+	}
+	return NULL;
+}
+
+struct symbol *symbol_lookup(const struct scope *scope, const char *identifier)
+{
+	struct symbol *sym;
+
+	while (scope != NULL) {
+		sym = scope_lookup(scope, identifier);
+		if (sym)
+			return sym;
 		scope = scope->parent;
 	}
 	return NULL;
@@ -705,7 +991,8 @@ struct chain *chain_alloc(void)
 	chain = xzalloc(sizeof(*chain));
 	chain->location = internal_location;
 	chain->refcnt = 1;
-	chain->handle.chain_id = ++chain_id;
+	chain->handle.chain_id = __atomic_add_fetch(&chain_id, 1,
+						    __ATOMIC_RELAXED);
 	init_list_head(&chain->rules);
 	init_list_head(&chain->scope.symbols);
 
@@ -726,6 +1013,7 @@ void chain_free(struct chain *chain)
 
 	if (--chain->refcnt > 0)
 		return;
+	rule_index_free(chain);
 	list_for_each_entry_safe(rule, next, &chain->rules, list)
 		rule_free(rule);
 	handle_free(&chain->handle);
@@ -1261,14 +1549,16 @@ static void table_print_flags(const struct table *table, const char **delim,
 	*delim = "\n";
 }
 
-static void table_print(const struct table *table, struct output_ctx *octx)
+static int table_print(struct netlink_ctx *ctx, struct table *table)
 {
+	struct output_ctx *octx = &ctx->nft->output;
 	struct flowtable *flowtable;
 	struct chain *chain;
 	struct obj *obj;
 	struct set *set;
 	const char *delim = "";
 	const char *family = family2str(table->handle.family);
+	char progname[NFT_PROGNAME_MAXLEN];
 
 	if (table->has_xt_stmts)
 		fprintf(octx->error_fp,
@@ -1281,7 +1571,8 @@ static void table_print(const struct table *table, struct output_ctx *octx)
 	if (nft_output_handle(octx))
 		nft_print(octx, " handle %" PRIu64, table->handle.handle.id);
 	if (table->flags & TABLE_F_OWNER)
-		nft_print(octx, " progname %s", get_progname(table->owner));
+		nft_print(octx, " progname %s",
+			  get_progname(table->owner, progname, sizeof(progname)));
 
 	nft_print(octx, "\n");
 	table_print_flags(table, &delim, octx);
@@ -1297,8 +1588,11 @@ static void table_print(const struct table *table, struct output_ctx *octx)
 	list_for_each_entry(set, &table->set_cache.list, cache.list) {
 		if (set_is_anonymous(set->flags))
 			continue;
+		if (set_stream_fetch(ctx, set) < 0)
+			return -1;
 		nft_print(octx, "%s", delim);
 		set_print(set, octx);
+		set_stream_release(ctx, set);
 		delim = "\n";
 	}
 	list_for_each_entry(flowtable, &table->ft_cache.list, cache.list) {
@@ -1306,12 +1600,23 @@ static void table_print(const struct table *table, struct output_ctx *octx)
 		flowtable_print(flowtable, octx);
 		delim = "\n";
 	}
+
+	/* anything left on errors is released along with the cache. */
+	if (table_stream_fetch(ctx, table) < 0)
+		return -1;
+
 	list_for_each_entry(chain, &table->chain_cache.list, cache.list) {
+		if (chain_stream_fetch(ctx, table, chain) < 0)
+			return -1;
 		nft_print(octx, "%s", delim);
 		chain_print(chain, octx);
+		chain_stream_release(ctx, chain);
 		delim = "\n";
 	}
+	table_stream_release(ctx, table);
+
 	nft_print(octx, "}\n");
+	return 0;
 }
 
 struct cmd *cmd_alloc(enum cmd_ops op, enum cmd_obj obj,
@@ -1351,6 +1656,21 @@ void markup_free(struct markup *m)
 	free(m);
 }
 
+struct profile *profile_alloc(uint32_t action)
+{
+	struct profile *profile;
+
+	profile = xmalloc(sizeof(struct profile));
+	profile->action = action;
+
+	return profile;
+}
+
+void profile_free(struct profile *p)
+{
+	free(p);
+}
+
 struct monitor *monitor_alloc(uint32_t format, uint32_t type, const char *event)
 {
 	struct monitor *mon;
@@ -1360,6 +1680,7 @@ struct monitor *monitor_alloc(uint32_t format, uint32_t type, const char *event)
 	mon->type = type;
 	mon->event = event;
 	mon->flags = 0;
+	mon->aggregate = 0;
 
 	return mon;
 }
@@ -1404,6 +1725,9 @@ void cmd_free(struct cmd *cmd)
 		case CMD_OBJ_MARKUP:
 			markup_free(cmd->markup);
 			break;
+		case CMD_OBJ_PROFILE:
+			profile_free(cmd->profile);
+			break;
 		case CMD_OBJ_COUNTER:
 		case CMD_OBJ_QUOTA:
 		case CMD_OBJ_CT_HELPER:
@@ -1421,6 +1745,7 @@ void cmd_free(struct cmd *cmd)
 			BUG("invalid command object type %u\n", cmd->obj);
 		}
 	}
+	expr_free(cmd->handles);
 	free(cmd->attr);
 	free_const(cmd->arg);
 	free(cmd);
@@ -1488,7 +1813,8 @@ static int do_command_add(struct netlink_ctx *ctx, struct cmd *cmd, bool excl)
 {
 	uint32_t flags = excl ? NLM_F_EXCL : 0;
 
-	if (nft_output_echo(&ctx->nft->output))
+	if (nft_output_echo(&ctx->nft->output) ||
+	    nft_output_echo_handles(&ctx->nft->output))
 		flags |= NLM_F_ECHO;
 
 	switch (cmd->obj) {
@@ -1536,7 +1862,8 @@ static int do_command_insert(struct netlink_ctx *ctx, struct cmd *cmd)
 {
 	uint32_t flags = 0;
 
-	if (nft_output_echo(&ctx->nft->output))
+	if (nft_output_echo(&ctx->nft->output) ||
+	    nft_output_echo_handles(&ctx->nft->output))
 		flags |= NLM_F_ECHO;
 
 	switch (cmd->obj) {
@@ -1601,16 +1928,17 @@ static int do_command_delete(struct netlink_ctx *ctx, struct cmd *cmd)
 
 static int do_list_table(struct netlink_ctx *ctx, struct table *table)
 {
-	table_print(table, &ctx->nft->output);
-	return 0;
+	return table_print(ctx, table);
 }
 
 static int do_list_sets(struct netlink_ctx *ctx, struct cmd *cmd)
 {
+	bool with_stats = ctx->nft->optimize_flags & NFT_OPTIMIZE_STATS;
+	struct set_stats stats;
 	struct table *table;
 	struct set *set;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -1629,7 +1957,16 @@ static int do_list_sets(struct netlink_ctx *ctx, struct cmd *cmd)
 			if (cmd->obj == CMD_OBJ_MAPS &&
 			    !map_is_literal(set->flags))
 				continue;
-			set_print(set, &ctx->nft->output);
+			if (!with_stats) {
+				set_print(set, &ctx->nft->output);
+				continue;
+			}
+
+			if (netlink_count_setelems(ctx, &set->handle,
+						   &stats.elements) < 0)
+				return -1;
+			stats.memory = set_memory_estimate(set, stats.elements);
+			set_print_stats(set, &stats, &ctx->nft->output);
 		}
 
 		nft_print(&ctx->nft->output, "}\n");
@@ -2019,7 +2356,7 @@ static int do_list_obj(struct netlink_ctx *ctx, struct cmd *cmd, uint32_t type)
 	struct table *table;
 	struct obj *obj;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -2203,7 +2540,7 @@ static int do_list_flowtables(struct netlink_ctx *ctx, struct cmd *cmd)
 	struct flowtable *flowtable;
 	struct table *table;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -2227,7 +2564,7 @@ static int do_list_ruleset(struct netlink_ctx *ctx, struct cmd *cmd)
 	unsigned int family = cmd->handle.family;
 	struct table *table;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (family != NFPROTO_UNSPEC &&
 		    table->handle.family != family)
 			continue;
@@ -2239,11 +2576,31 @@ static int do_list_ruleset(struct netlink_ctx *ctx, struct cmd *cmd)
 	return 0;
 }
 
+/* Changes after a generation from the journal, or the whole ruleset if the
+ * journal does not reach back that far.
+ */
+static int do_list_ruleset_since(struct netlink_ctx *ctx, struct cmd *cmd)
+{
+	struct output_ctx *octx = &ctx->nft->output;
+	uint32_t genid = *(const uint32_t *)cmd->arg;
+
+	if (nft_journal_covers(ctx->nft->journal, genid)) {
+		nft_journal_print(ctx->nft->journal, genid, octx);
+		return 0;
+	}
+
+	nft_print(octx, "# generation %u is not in the journal, ruleset at generation %u\n",
+		  genid, ctx->nft->cache->genid);
+	nft_print(octx, "flush ruleset\n");
+
+	return do_list_ruleset(ctx, cmd);
+}
+
 static int do_list_tables(struct netlink_ctx *ctx, struct cmd *cmd)
 {
 	struct table *table;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -2290,7 +2647,7 @@ static int do_list_chains(struct netlink_ctx *ctx, struct cmd *cmd)
 	struct table *table;
 	struct chain *chain;
 
-	list_for_each_entry(table, &ctx->nft->cache.table_cache.list, cache.list) {
+	list_for_each_entry(table, &ctx->nft->cache->table_cache.list, cache.list) {
 		if (cmd->handle.family != NFPROTO_UNSPEC &&
 		    cmd->handle.family != table->handle.family)
 			continue;
@@ -2321,6 +2678,39 @@ static void __do_list_set(struct netlink_ctx *ctx, struct cmd *cmd,
 	nft_print(&ctx->nft->output, "}\n");
 }
 
+/* list set ... count, list set ... limit: set->init is not in the cache, only
+ * the elements in the window are fetched for this listing.
+ */
+static int do_list_set_window(struct netlink_ctx *ctx, struct cmd *cmd,
+			      struct set *set)
+{
+	struct output_ctx *octx = &ctx->nft->output;
+	struct expr *init = set->init;
+	struct table *table;
+	uint64_t count;
+
+	set->init = NULL;
+	if (netlink_list_setelems_window(ctx, &set->handle, set, cmd->arg,
+					 &count) < 0) {
+		set->init = init;
+		return -1;
+	}
+
+	table = table_alloc();
+	table->handle.table.name = xstrdup(cmd->handle.table.name);
+	table->handle.family = cmd->handle.family;
+	table_print_declaration(table, octx);
+	table_free(table);
+
+	set_print_window(set, cmd->arg, count, octx);
+	nft_print(octx, "}\n");
+
+	expr_free(set->init);
+	set->init = init;
+
+	return 0;
+}
+
 static int do_list_set(struct netlink_ctx *ctx, struct cmd *cmd,
 		       struct table *table)
 {
@@ -2332,6 +2722,9 @@ static int do_list_set(struct netlink_ctx *ctx, struct cmd *cmd,
 			return -1;
 	}
 
+	if (cmd->arg)
+		return do_list_set_window(ctx, cmd, set);
+
 	__do_list_set(ctx, cmd, set);
 
 	return 0;
@@ -2348,11 +2741,17 @@ static int do_command_list(struct netlink_ctx *ctx, struct cmd *cmd)
 {
 	struct table *table = NULL;
 
+	if (nft_output_reversedns(&ctx->nft->output))
+		nft_resolver_prefetch_names(ctx->nft, cmd);
+
+	if (nft_cache_list_refresh(ctx, cmd) < 0)
+		return -1;
+
 	if (nft_output_json(&ctx->nft->output))
 		return do_command_list_json(ctx, cmd);
 
 	if (cmd->handle.table.name != NULL)
-		table = table_cache_find(&ctx->nft->cache.table_cache,
+		table = table_cache_find(&ctx->nft->cache->table_cache,
 					 cmd->handle.table.name,
 					 cmd->handle.family);
 	switch (cmd->obj) {
@@ -2369,6 +2768,9 @@ static int do_command_list(struct netlink_ctx *ctx, struct cmd *cmd)
 	case CMD_OBJ_SET:
 		return do_list_set(ctx, cmd, table);
 	case CMD_OBJ_RULESET:
+		if (cmd->arg)
+			return do_list_ruleset_since(ctx, cmd);
+		/* fall through */
 	case CMD_OBJ_RULES:
 	case CMD_OBJ_RULE:
 		return do_list_ruleset(ctx, cmd);
@@ -2491,7 +2893,7 @@ static int do_command_flush(struct netlink_ctx *ctx, struct cmd *cmd)
 
 static int do_command_rename(struct netlink_ctx *ctx, struct cmd *cmd)
 {
-	struct table *table = table_cache_find(&ctx->nft->cache.table_cache,
+	struct table *table = table_cache_find(&ctx->nft->cache->table_cache,
 					       cmd->handle.table.name,
 					       cmd->handle.family);
 	const struct chain *chain;
@@ -2514,14 +2916,31 @@ static int do_command_monitor(struct netlink_ctx *ctx, struct cmd *cmd)
 		.format		= cmd->monitor->format,
 		.ctx		= ctx,
 		.loc		= &cmd->location,
-		.cache		= &ctx->nft->cache,
+		.cache		= ctx->nft->cache,
 		.debug_mask	= ctx->nft->debug_mask,
+		.filter_family	= cmd->handle.family,
+		.filter_table	= cmd->handle.table.name,
+		.replicate	= cmd->monitor->type == CMD_MONITOR_OBJ_REPLICATE,
 	};
+	int ret;
 
 	if (nft_output_json(&ctx->nft->output))
 		monhandler.format = NFTNL_OUTPUT_JSON;
 
-	return netlink_monitor(&monhandler, ctx->nft->nf_sock);
+	if (cmd->monitor->aggregate &&
+	    cmd->monitor->type == CMD_MONITOR_OBJ_ELEMS)
+		monhandler.elem_aggr = elem_aggr_alloc(cmd->monitor->aggregate);
+	else if (cmd->monitor->aggregate)
+		monhandler.trace_aggr = trace_aggr_alloc(cmd->monitor->aggregate);
+
+	ret = netlink_monitor(&monhandler, ctx->nft->nf_sock);
+
+	if (monhandler.trace_aggr)
+		trace_aggr_free(monhandler.trace_aggr);
+	if (monhandler.elem_aggr)
+		elem_aggr_free(monhandler.elem_aggr);
+
+	return ret;
 }
 
 static int do_command_describe(struct netlink_ctx *ctx, struct cmd *cmd,
@@ -2531,6 +2950,21 @@ static int do_command_describe(struct netlink_ctx *ctx, struct cmd *cmd,
 	return 0;
 }
 
+static int do_command_profile(struct netlink_ctx *ctx, struct cmd *cmd)
+{
+	switch (cmd->profile->action) {
+	case CMD_PROFILE_START:
+		return profile_rules(ctx, cmd, true);
+	case CMD_PROFILE_STOP:
+		return profile_rules(ctx, cmd, false);
+	case CMD_PROFILE_REPORT:
+		profile_report(ctx, cmd);
+		return 0;
+	}
+
+	BUG("invalid profile action %u\n", cmd->profile->action);
+}
+
 struct cmd *cmd_alloc_obj_ct(enum cmd_ops op, int type, const struct handle *h,
 			     const struct location *loc, struct obj *obj)
 {
@@ -2588,6 +3022,8 @@ int do_command(struct netlink_ctx *ctx, struct cmd *cmd)
 		return do_command_monitor(ctx, cmd);
 	case CMD_DESCRIBE:
 		return do_command_describe(ctx, cmd, &ctx->nft->output);
+	case CMD_PROFILE:
+		return do_command_profile(ctx, cmd);
 	default:
 		BUG("invalid command object type %u\n", cmd->obj);
 	}
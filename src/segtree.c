@@ -110,16 +110,50 @@ struct expr *get_set_intervals(const struct set *set, const struct expr *init)
 	return new_init;
 }
 
-static struct expr *get_set_interval_find(const struct set *cache_set,
-					  struct expr *left,
-					  struct expr *right)
+/*
+ * Sorted copy of the interval boundaries of the cached set, so the intervals
+ * that are returned by the kernel can be looked up through binary search.
+ * Entries with the same low boundary keep their list order.
+ */
+struct interval_find_key {
+	mpz_t		low;
+	mpz_t		high;
+	struct expr	*elem;
+	unsigned int	pos;
+};
+
+struct interval_find_index {
+	struct interval_find_key	*key;
+	unsigned int			num;
+};
+
+static int interval_find_key_cmp(const void *p1, const void *p2)
+{
+	const struct interval_find_key *k1 = p1, *k2 = p2;
+	int ret;
+
+	ret = mpz_cmp(k1->low, k2->low);
+	if (ret)
+		return ret;
+
+	return k1->pos < k2->pos ? -1 : k1->pos > k2->pos;
+}
+
+static void interval_find_index_init(struct interval_find_index *index,
+				     const struct set *set)
 {
-	const struct set *set = cache_set;
-	struct expr *range = NULL;
+	struct interval_find_key *key;
+	unsigned int num = 0;
 	struct expr *i;
-	mpz_t val;
 
-	mpz_init2(val, set->key->len);
+	memset(index, 0, sizeof(*index));
+
+	list_for_each_entry(i, &set->init->expressions, list)
+		num++;
+	if (!num)
+		return;
+
+	index->key = xmalloc_array(num, sizeof(struct interval_find_key));
 
 	list_for_each_entry(i, &set->init->expressions, list) {
 		switch (i->key->etype) {
@@ -130,24 +164,62 @@ static struct expr *get_set_interval_find(const struct set *cache_set,
 			/* fall-through */
 		case EXPR_PREFIX:
 		case EXPR_RANGE:
-			range_expr_value_low(val, i);
-			if (left && mpz_cmp(left->key->value, val))
-				break;
-
-			range_expr_value_high(val, i);
-			if (right && mpz_cmp(right->key->value, val))
-				break;
-
-			range = expr_clone(i->key);
-			goto out;
+			key = &index->key[index->num];
+			mpz_init2(key->low, set->key->len);
+			mpz_init2(key->high, set->key->len);
+			range_expr_value_low(key->low, i);
+			range_expr_value_high(key->high, i);
+			key->elem = i;
+			key->pos = index->num++;
+			break;
 		default:
 			break;
 		}
 	}
-out:
-	mpz_clear(val);
 
-	return range;
+	qsort(index->key, index->num, sizeof(struct interval_find_key),
+	      interval_find_key_cmp);
+}
+
+static void interval_find_index_free(struct interval_find_index *index)
+{
+	unsigned int k;
+
+	for (k = 0; k < index->num; k++) {
+		mpz_clear(index->key[k].low);
+		mpz_clear(index->key[k].high);
+	}
+	free(index->key);
+}
+
+static struct expr *get_set_interval_find(const struct interval_find_index *index,
+					  struct expr *left,
+					  struct expr *right)
+{
+	unsigned int lo = 0, hi = index->num, mid;
+	const struct interval_find_key *key;
+
+	/* lower bound of the intervals that start at @left. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mpz_cmp(index->key[mid].low, left->key->value) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < index->num; lo++) {
+		key = &index->key[lo];
+		if (mpz_cmp(key->low, left->key->value))
+			break;
+
+		if (right && mpz_cmp(right->key->value, key->high))
+			continue;
+
+		return expr_clone(key->elem->key);
+	}
+
+	return NULL;
 }
 
 static struct expr *expr_value(struct expr *expr)
@@ -208,10 +280,12 @@ static struct expr *expr_to_set_elem(struct expr *e)
 
 int get_set_decompose(struct set *cache_set, struct set *set)
 {
+	struct interval_find_index index;
 	struct expr *i, *next, *range;
 	struct expr *left = NULL;
 	struct expr *new_init;
 
+	interval_find_index_init(&index, cache_set);
 	new_init = set_expr_alloc(&internal_location, set);
 
 	list_for_each_entry_safe(i, next, &set->init->expressions, list) {
@@ -219,11 +293,12 @@ int get_set_decompose(struct set *cache_set, struct set *set)
 			list_del(&left->list);
 			list_del(&i->list);
 			mpz_sub_ui(i->key->value, i->key->value, 1);
-			range = get_set_interval_find(cache_set, left, i);
+			range = get_set_interval_find(&index, left, i);
 			if (!range) {
 				expr_free(left);
 				expr_free(i);
 				expr_free(new_init);
+				interval_find_index_free(&index);
 				errno = ENOENT;
 				return -1;
 			}
@@ -234,7 +309,7 @@ int get_set_decompose(struct set *cache_set, struct set *set)
 			left = NULL;
 		} else {
 			if (left) {
-				range = get_set_interval_find(cache_set,
+				range = get_set_interval_find(&index,
 							      left, NULL);
 				if (range)
 					compound_expr_add(new_init, range);
@@ -246,24 +321,82 @@ int get_set_decompose(struct set *cache_set, struct set *set)
 		}
 	}
 	if (left) {
-		range = get_set_interval_find(cache_set, left, NULL);
+		range = get_set_interval_find(&index, left, NULL);
 		if (range)
 			compound_expr_add(new_init, range);
 		else
 			compound_expr_add(new_init, expr_to_set_elem(left));
 	}
 
+	interval_find_index_free(&index);
+
 	expr_free(set->init);
 	set->init = new_init;
 
 	return 0;
 }
 
+/*
+ * Native integer used to check ranges with keys up to 128 bits (64 bits if
+ * the compiler does not provide 128-bit integers) without GMP arithmetic.
+ */
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 range_uint_t;
+#else
+typedef uint64_t range_uint_t;
+#endif
+
+#define RANGE_UINT_BITS		(sizeof(range_uint_t) * BITS_PER_BYTE)
+
+static bool range_uint_get(const mpz_t op, range_uint_t *val)
+{
+	uint64_t word[sizeof(range_uint_t) / sizeof(uint64_t)] = {};
+	unsigned int i;
+
+	if (mpz_sgn(op) < 0 || mpz_sizeinbase(op, 2) > RANGE_UINT_BITS)
+		return false;
+
+	mpz_export(word, NULL, MPZ_LSWF, sizeof(uint64_t), MPZ_HOST_ENDIAN, 0,
+		   op);
+
+	*val = 0;
+	for (i = array_size(word); i > 0; i--) {
+		*val <<= sizeof(uint64_t) * BITS_PER_BYTE - 1;
+		*val <<= 1;
+		*val |= word[i - 1];
+	}
+
+	return true;
+}
+
+/* Number of trailing zero bits, RANGE_UINT_BITS if @val is zero. */
+static unsigned int range_uint_ctz(range_uint_t val)
+{
+	unsigned int ctz = 0;
+	uint64_t word;
+
+	while (ctz < RANGE_UINT_BITS) {
+		word = (uint64_t)val;
+		if (word)
+			return ctz + __builtin_ctzll(word);
+
+		val >>= sizeof(uint64_t) * BITS_PER_BYTE - 1;
+		val >>= 1;
+		ctz += sizeof(uint64_t) * BITS_PER_BYTE;
+	}
+
+	return RANGE_UINT_BITS;
+}
+
 static bool range_is_prefix(const mpz_t range)
 {
+	range_uint_t val;
 	mpz_t tmp;
 	bool ret;
 
+	if (range_uint_get(range, &val))
+		return !(val & (val + 1));
+
 	mpz_init_set(tmp, range);
 	mpz_add_ui(tmp, tmp, 1);
 	mpz_and(tmp, range, tmp);
@@ -292,14 +425,58 @@ static int expr_value_cmp(const void *p1, const void *p2)
 	return ret;
 }
 
+static bool expr_value_sorted(struct expr **elements, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 1; i < n; i++) {
+		if (expr_value_cmp(&elements[i - 1], &elements[i]) > 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void expr_value_reverse(struct expr **elements, unsigned int n)
+{
+	struct expr *tmp;
+	unsigned int i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = elements[i];
+		elements[i] = elements[n - i - 1];
+		elements[n - i - 1] = tmp;
+	}
+}
+
 /* Given start and end elements of a range, check if it can be represented as
  * a single netmask, and if so, how long, by returning zero or a positive value.
  */
 static int range_mask_len(const mpz_t start, const mpz_t end, unsigned int len)
 {
+	range_uint_t start_val, end_val;
 	mpz_t tmp_start, tmp_end;
+	unsigned int shift;
 	int ret;
 
+	if (range_uint_get(start, &start_val) &&
+	    range_uint_get(end, &end_val)) {
+		if (start_val > end_val)
+			return -1;
+
+		/* trailing zeroes in start that are ones in end. */
+		shift = min(range_uint_ctz(start_val), range_uint_ctz(~end_val));
+		if (shift > len)
+			return -1;
+		if (shift == RANGE_UINT_BITS)
+			return len - shift;
+
+		start_val >>= shift;
+		end_val >>= shift;
+
+		return start_val == end_val ? (int)(len - shift) : -1;
+	}
+
 	mpz_init_set(tmp_start, start);
 	mpz_init_set(tmp_end, end);
 
@@ -545,7 +722,7 @@ void interval_map_decompose(struct expr *set)
 	elements = xmalloc_array(set->size, sizeof(struct expr *));
 	ranges = xmalloc_array(set->size * 2, sizeof(struct expr *));
 
-	/* Sort elements */
+	/* Collect elements, catch-all goes last */
 	n = 0;
 	list_for_each_entry_safe(i, next, &set->expressions, list) {
 		key = NULL;
@@ -562,7 +739,15 @@ void interval_map_decompose(struct expr *set)
 		compound_expr_remove(set, i);
 		elements[n++] = i;
 	}
-	qsort(elements, n, sizeof(elements[0]), expr_value_cmp);
+
+	/* The kernel usually dumps the elements in order, either ascending or
+	 * descending, only sort them if they are not.
+	 */
+	if (!expr_value_sorted(elements, n)) {
+		expr_value_reverse(elements, n);
+		if (!expr_value_sorted(elements, n))
+			qsort(elements, n, sizeof(elements[0]), expr_value_cmp);
+	}
 	size = n;
 
 	/* Transform points (single values) into half-closed intervals */
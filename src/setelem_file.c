@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Load set elements from a file of keys, one per line, or from a file of
+ * fixed size keys in network byte order. Keys are parsed through a loop
+ * that is specific to the key format, instead of going through the scanner
+ * and the symbol parsers of the datatype.
+ */
+
+#include <nft.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include <expression.h>
+#include <datatype.h>
+#include <erec.h>
+#include <list.h>
+#include <utils.h>
+#include <setelem_file.h>
+
+struct setelem_file_format {
+	const char		*name;
+	const struct datatype	*dtype;
+	unsigned int		len;
+	bool			prefix;
+	bool			(*parse)(const char *str, unsigned char *data);
+};
+
+static bool setelem_parse_ipv4(const char *str, unsigned char *data)
+{
+	return inet_pton(AF_INET, str, data) == 1;
+}
+
+static bool setelem_parse_ipv6(const char *str, unsigned char *data)
+{
+	return inet_pton(AF_INET6, str, data) == 1;
+}
+
+static bool setelem_parse_ether(const char *str, unsigned char *data)
+{
+	int n;
+
+	return sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n",
+		      &data[0], &data[1], &data[2], &data[3], &data[4],
+		      &data[5], &n) == 6 && str[n] == '\0';
+}
+
+static bool setelem_parse_service(const char *str, unsigned char *data)
+{
+	unsigned long port;
+	char *end;
+
+	errno = 0;
+	port = strtoul(str, &end, 10);
+	if (errno || end == str || *end || port > UINT16_MAX)
+		return false;
+
+	data[0] = port >> 8;
+	data[1] = port & 0xff;
+
+	return true;
+}
+
+static const struct setelem_file_format setelem_file_formats[] = {
+	{
+		.name	= "ipv4_addr",
+		.dtype	= &ipaddr_type,
+		.len	= sizeof(struct in_addr),
+		.prefix	= true,
+		.parse	= setelem_parse_ipv4,
+	},
+	{
+		.name	= "ipv6_addr",
+		.dtype	= &ip6addr_type,
+		.len	= sizeof(struct in6_addr),
+		.prefix	= true,
+		.parse	= setelem_parse_ipv6,
+	},
+	{
+		.name	= "ether_addr",
+		.dtype	= &etheraddr_type,
+		.len	= 6,
+		.parse	= setelem_parse_ether,
+	},
+	{
+		.name	= "inet_service",
+		.dtype	= &inet_service_type,
+		.len	= sizeof(uint16_t),
+		.parse	= setelem_parse_service,
+	},
+};
+
+static const struct setelem_file_format *setelem_file_format_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < array_size(setelem_file_formats); i++) {
+		if (!strcmp(setelem_file_formats[i].name, name))
+			return &setelem_file_formats[i];
+	}
+
+	return NULL;
+}
+
+static struct expr *setelem_key_alloc(const struct location *loc,
+				      const struct setelem_file_format *fmt,
+				      const unsigned char *data)
+{
+	return constant_expr_alloc(loc, fmt->dtype, BYTEORDER_BIG_ENDIAN,
+				   fmt->len * BITS_PER_BYTE, data);
+}
+
+static void setelem_file_add(struct expr *set, const struct location *loc,
+			     struct expr *key)
+{
+	compound_expr_add(set, set_elem_expr_alloc(loc, key));
+}
+
+/* Parse "key", "key/prefix" or "key-key" into a set element. */
+static int setelem_file_parse_line(struct expr *set,
+				   const struct location *loc,
+				   const struct setelem_file_format *fmt,
+				   char *line)
+{
+	unsigned char data[sizeof(struct in6_addr)];
+	unsigned long prefix_len;
+	char *sep, *end;
+	struct expr *key;
+	int op = 0;
+
+	sep = strpbrk(line, "/-");
+	if (sep) {
+		op = *sep;
+		*sep++ = '\0';
+	}
+
+	if (!fmt->parse(line, data))
+		return -1;
+
+	key = setelem_key_alloc(loc, fmt, data);
+
+	switch (op) {
+	case '/':
+		if (!fmt->prefix)
+			goto err;
+
+		errno = 0;
+		prefix_len = strtoul(sep, &end, 10);
+		if (errno || end == sep || *end ||
+		    prefix_len > fmt->len * BITS_PER_BYTE)
+			goto err;
+
+		key = prefix_expr_alloc(loc, key, prefix_len);
+		break;
+	case '-':
+		if (!fmt->parse(sep, data))
+			goto err;
+
+		key = range_expr_alloc(loc, key,
+				       setelem_key_alloc(loc, fmt, data));
+		break;
+	}
+
+	setelem_file_add(set, loc, key);
+
+	return 0;
+err:
+	expr_free(key);
+	return -1;
+}
+
+static char *setelem_file_strip(char *line)
+{
+	char *end;
+
+	end = strchr(line, '#');
+	if (end)
+		*end = '\0';
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+
+	end = line + strlen(line);
+	while (end > line && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+
+	return line;
+}
+
+static int setelem_file_load_text(struct expr *set,
+				  const struct location *loc,
+				  const struct setelem_file_format *fmt,
+				  const char *filename, FILE *fp,
+				  struct list_head *msgs)
+{
+	unsigned int lineno = 0;
+	size_t size = 0;
+	char *buf = NULL;
+	char *line;
+	int ret = 0;
+
+	while (getline(&buf, &size, fp) >= 0) {
+		lineno++;
+
+		line = setelem_file_strip(buf);
+		if (*line == '\0')
+			continue;
+
+		if (setelem_file_parse_line(set, loc, fmt, line) < 0) {
+			erec_queue(error(loc, "%s:%u: invalid %s `%s'",
+					 filename, lineno, fmt->name, line),
+				   msgs);
+			ret = -1;
+			break;
+		}
+	}
+	free(buf);
+
+	return ret;
+}
+
+static int setelem_file_load_binary(struct expr *set,
+				    const struct location *loc,
+				    const struct setelem_file_format *fmt,
+				    const char *filename, FILE *fp,
+				    struct list_head *msgs)
+{
+	unsigned char data[sizeof(struct in6_addr)];
+	size_t len;
+
+	while ((len = fread(data, 1, fmt->len, fp)) == fmt->len)
+		setelem_file_add(set, loc, setelem_key_alloc(loc, fmt, data));
+
+	if (len != 0) {
+		erec_queue(error(loc, "%s: size is not a multiple of %u bytes",
+				 filename, fmt->len), msgs);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct expr *setelem_file_load(const struct location *loc,
+			       const char *filename, const char *format,
+			       bool binary, struct list_head *msgs)
+{
+	const struct setelem_file_format *fmt;
+	struct expr *set;
+	FILE *fp;
+	int ret;
+
+	fmt = setelem_file_format_lookup(format);
+	if (!fmt) {
+		erec_queue(error(loc, "unknown element file format `%s'",
+				 format), msgs);
+		return NULL;
+	}
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		erec_queue(error(loc, "Could not open file \"%s\": %s",
+				 filename, strerror(errno)), msgs);
+		return NULL;
+	}
+
+	set = set_expr_alloc(loc, NULL);
+	if (binary)
+		ret = setelem_file_load_binary(set, loc, fmt, filename, fp,
+					       msgs);
+	else
+		ret = setelem_file_load_text(set, loc, fmt, filename, fp, msgs);
+
+	if (ret == 0 && ferror(fp)) {
+		erec_queue(error(loc, "Could not read file \"%s\": %s",
+				 filename, strerror(errno)), msgs);
+		ret = -1;
+	}
+	fclose(fp);
+
+	if (ret < 0) {
+		expr_free(set);
+		return NULL;
+	}
+
+	return set;
+}
@@ -33,12 +33,20 @@
 #include <linux/netfilter/nf_log.h>
 #include <linux/netfilter/nf_synproxy.h>
 
+/* Recycled like expressions, see expr_alloc(). */
+static __thread struct node_cache stmt_node_cache;
+
+void stmt_node_cache_release(void)
+{
+	node_cache_release(&stmt_node_cache);
+}
+
 struct stmt *stmt_alloc(const struct location *loc,
 			const struct stmt_ops *ops)
 {
 	struct stmt *stmt;
 
-	stmt = xzalloc(sizeof(*stmt));
+	stmt = node_cache_zalloc(&stmt_node_cache, sizeof(*stmt));
 	init_list_head(&stmt->list);
 	stmt->location = *loc;
 	stmt->ops      = ops;
@@ -51,7 +59,7 @@ void stmt_free(struct stmt *stmt)
 		return;
 	if (stmt->ops->destroy)
 		stmt->ops->destroy(stmt);
-	free(stmt);
+	node_cache_free(&stmt_node_cache, stmt);
 }
 
 void stmt_list_free(struct list_head *list)
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Per-phase timing and memory accounting of a run, enabled by
+ * --debug=timing and --debug=memory. The caller reads the totals of the
+ * last run with nft_ctx_get_timing().
+ */
+
+#include <nft.h>
+
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include <nftables/libnftables.h>
+#include <timing.h>
+#include <utils.h>
+
+static const char *const nft_timing_names[__NFT_TIMING_MAX] = {
+	[NFT_TIMING_PARSE]	= "parse",
+	[NFT_TIMING_CACHE]	= "cache",
+	[NFT_TIMING_EVAL]	= "eval",
+	[NFT_TIMING_INTERVALS]	= "intervals",
+	[NFT_TIMING_DIFF]	= "diff",
+	[NFT_TIMING_BATCH]	= "batch",
+	[NFT_TIMING_SEND]	= "send",
+	[NFT_TIMING_ACK]	= "ack",
+};
+
+void __nft_timing_start(struct nft_ctx *nft, enum nft_timing_phase phase,
+			struct nft_timing_span *span)
+{
+	span->phase = phase;
+	span->prev = mem_stats;
+	if (nft->debug_mask & NFT_DEBUG_MEMORY)
+		mem_stats = &nft->timing->mem[phase];
+
+	clock_gettime(CLOCK_MONOTONIC, &span->start);
+}
+
+void nft_timing_stop(struct nft_ctx *nft, const struct nft_timing_span *span,
+		     uint32_t count)
+{
+	struct nft_timing *timing = nft->timing;
+	enum nft_timing_phase phase = span->phase;
+	struct rusage usage;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	timing->nsec[phase] += (now.tv_sec - span->start.tv_sec) * 1000000000ULL +
+			       now.tv_nsec - span->start.tv_nsec;
+	timing->count[phase] += count;
+
+	if (!(nft->debug_mask & NFT_DEBUG_MEMORY))
+		return;
+
+	mem_stats = span->prev;
+	if (getrusage(RUSAGE_SELF, &usage) == 0 &&
+	    (uint64_t)usage.ru_maxrss > timing->max_rss[phase])
+		timing->max_rss[phase] = usage.ru_maxrss;
+}
+
+void nft_timing_reset(struct nft_ctx *nft)
+{
+	memset(nft->timing, 0, sizeof(*nft->timing));
+}
+
+static void nft_timing_print_json(struct nft_ctx *nft)
+{
+	const struct nft_timing *timing = nft->timing;
+	unsigned int i;
+
+	nft_print(&nft->output, "{\"timing\": {");
+	for (i = 0; i < __NFT_TIMING_MAX; i++) {
+		nft_print(&nft->output, "%s\"%s\": {\"count\": %u",
+			  i ? ", " : "", nft_timing_names[i],
+			  timing->count[i]);
+		if (nft->debug_mask & NFT_DEBUG_TIMING)
+			nft_print(&nft->output, ", \"usec\": %" PRIu64,
+				  timing->nsec[i] / 1000);
+		if (nft->debug_mask & NFT_DEBUG_MEMORY)
+			nft_print(&nft->output,
+				  ", \"alloc_bytes\": %" PRIu64
+				  ", \"alloc_objects\": %" PRIu64
+				  ", \"max_rss_kb\": %" PRIu64,
+				  timing->mem[i].bytes, timing->mem[i].objects,
+				  timing->max_rss[i]);
+		nft_print(&nft->output, "}");
+	}
+	nft_print(&nft->output, "}}\n");
+}
+
+void nft_timing_print(struct nft_ctx *nft)
+{
+	const struct nft_timing *timing = nft->timing;
+	unsigned int i;
+
+	if (!(nft->debug_mask & NFT_DEBUG_TIMING_MASK))
+		return;
+
+	if (nft_output_json(&nft->output)) {
+		nft_timing_print_json(nft);
+		return;
+	}
+
+	nft_print(&nft->output, "%-10s %8s", "phase", "count");
+	if (nft->debug_mask & NFT_DEBUG_TIMING)
+		nft_print(&nft->output, " %10s", "usec");
+	if (nft->debug_mask & NFT_DEBUG_MEMORY)
+		nft_print(&nft->output, " %12s %10s %10s",
+			  "alloc_kb", "objects", "max_rss_kb");
+	nft_print(&nft->output, "\n");
+
+	for (i = 0; i < __NFT_TIMING_MAX; i++) {
+		if (!timing->count[i])
+			continue;
+
+		nft_print(&nft->output, "%-10s %8u",
+			  nft_timing_names[i], timing->count[i]);
+		if (nft->debug_mask & NFT_DEBUG_TIMING)
+			nft_print(&nft->output, " %10" PRIu64,
+				  timing->nsec[i] / 1000);
+		if (nft->debug_mask & NFT_DEBUG_MEMORY)
+			nft_print(&nft->output,
+				  " %12" PRIu64 " %10" PRIu64 " %10" PRIu64,
+				  timing->mem[i].bytes / 1024,
+				  timing->mem[i].objects, timing->max_rss[i]);
+		nft_print(&nft->output, "\n");
+	}
+}
+
+EXPORT_SYMBOL(nft_ctx_get_timing);
+int nft_ctx_get_timing(struct nft_ctx *nft, struct nft_timing_stat *stats,
+		       unsigned int num)
+{
+	const struct nft_timing *timing = nft->timing;
+	unsigned int i;
+
+	for (i = 0; i < num && i < __NFT_TIMING_MAX; i++) {
+		stats[i].phase = nft_timing_names[i];
+		stats[i].nsec = timing->nsec[i];
+		stats[i].count = timing->count[i];
+		stats[i].alloc_bytes = timing->mem[i].bytes;
+		stats[i].alloc_objects = timing->mem[i].objects;
+		stats[i].max_rss_kb = timing->max_rss[i];
+	}
+
+	return __NFT_TIMING_MAX;
+}
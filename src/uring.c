@@ -0,0 +1,440 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * io_uring backend for netlink I/O. A request and the reception of its
+ * replies are submitted at once, the sendmsg() linked to a multishot
+ * recvmsg() that picks receive buffers from a ring registered with the
+ * kernel, so a whole dump or all the acknowledgments of a batch are read
+ * with a handful of system calls.
+ *
+ * The receive is non-blocking: it ends once the socket is drained, or when
+ * it runs out of buffers. Buffers are only handed back to the kernel after
+ * the receive has ended, so a lack of buffers can be told apart from the
+ * socket reporting ENOBUFS because the kernel dropped messages.
+ *
+ * This talks to the kernel directly, without liburing. Support is probed
+ * once per process, callers fall back to plain system calls if the kernel
+ * lacks provided buffer rings or multishot receive (Linux 6.0), or if
+ * io_uring is disabled.
+ */
+
+#include <nft.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <uring.h>
+#include <utils.h>
+
+#define NFT_URING_ENTRIES	8
+#define NFT_URING_BUFS		16
+#define NFT_URING_BGID		0
+
+enum {
+	NFT_URING_SEND	= 1,
+	NFT_URING_RECV,
+	NFT_URING_PROBE,
+};
+
+struct nft_uring {
+	int			fd;
+	void			*rings;
+	size_t			rings_size;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		sqe_tail;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	struct io_uring_buf_ring *br;
+	char			*buf;
+	size_t			bufsiz;
+	uint16_t		br_tail;
+	uint16_t		used[NFT_URING_BUFS];
+	unsigned int		num_used;
+
+	/* no address nor control data, payload follows the header */
+	struct msghdr		msg;
+	bool			armed;
+	int			send_err;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Entries are made visible to the kernel by nft_uring_submit(). */
+static struct io_uring_sqe *nft_uring_get_sqe(struct nft_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = &ring->sqes[ring->sqe_tail++ & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+static void nft_uring_prep_recv(struct nft_uring *ring, int fd, uint64_t tag)
+{
+	struct io_uring_sqe *sqe = nft_uring_get_sqe(ring);
+
+	sqe->opcode	= IORING_OP_RECVMSG;
+	sqe->fd		= fd;
+	sqe->addr	= (uintptr_t)&ring->msg;
+	sqe->msg_flags	= MSG_DONTWAIT;
+	sqe->ioprio	= IORING_RECV_MULTISHOT;
+	sqe->flags	= IOSQE_BUFFER_SELECT;
+	sqe->buf_group	= NFT_URING_BGID;
+	sqe->user_data	= tag;
+}
+
+static int nft_uring_submit(struct nft_uring *ring, unsigned int wait)
+{
+	unsigned int to_submit;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	do {
+		to_submit = ring->sqe_tail -
+			    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		ret = io_uring_enter(ring->fd, to_submit, wait,
+				     wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Wait for the next completion and consume it. */
+static int nft_uring_wait(struct nft_uring *ring, struct io_uring_cqe *cqe,
+			  unsigned int *calls)
+{
+	unsigned int head = *ring->cq_head;
+
+	while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (nft_uring_submit(ring, 1) < 0)
+			return -1;
+		if (calls)
+			(*calls)++;
+	}
+
+	*cqe = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void nft_uring_buf_add(struct nft_uring *ring, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring->br->bufs[ring->br_tail & (NFT_URING_BUFS - 1)];
+	buf->addr = (uintptr_t)(ring->buf + bid * ring->bufsiz);
+	buf->len = ring->bufsiz;
+	buf->bid = bid;
+	ring->br_tail++;
+}
+
+/* Hand the buffers of the last receive back to the kernel. */
+static void nft_uring_buf_recycle(struct nft_uring *ring)
+{
+	unsigned int i;
+
+	for (i = 0; i < ring->num_used; i++)
+		nft_uring_buf_add(ring, ring->used[i]);
+
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+	ring->num_used = 0;
+}
+
+/* Multishot receive was added after provided buffer rings, check that the
+ * kernel accepts it. Receiving from a pipe fails with ENOTSOCK if it does,
+ * the request is rejected with EINVAL otherwise.
+ */
+static bool nft_uring_probe(struct nft_uring *ring)
+{
+	struct io_uring_cqe cqe;
+	int pipefd[2];
+	bool ret;
+
+	if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) < 0)
+		return false;
+
+	nft_uring_prep_recv(ring, pipefd[0], NFT_URING_PROBE);
+	ret = nft_uring_wait(ring, &cqe, NULL) == 0 && cqe.res != -EINVAL;
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	return ret;
+}
+
+static int nft_uring_map(struct nft_uring *ring, const struct io_uring_params *p)
+{
+	size_t sq_size, cq_size;
+	unsigned int i;
+	char *rings;
+
+	sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+
+	rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+		return -1;
+	ring->rings = rings;
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int *)(rings + p->sq_off.head);
+	ring->sq_tail = (unsigned int *)(rings + p->sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(rings + p->sq_off.ring_mask);
+	ring->cq_head = (unsigned int *)(rings + p->cq_off.head);
+	ring->cq_tail = (unsigned int *)(rings + p->cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(rings + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + p->cq_off.cqes);
+
+	/* Submission entries are always used in order. */
+	for (i = 0; i < p->sq_entries; i++)
+		((unsigned int *)(rings + p->sq_off.array))[i] = i;
+
+	return 0;
+}
+
+static int nft_uring_buf_init(struct nft_uring *ring, size_t bufsiz)
+{
+	struct io_uring_buf_reg reg = {
+		.ring_entries	= NFT_URING_BUFS,
+		.bgid		= NFT_URING_BGID,
+	};
+	size_t size = NFT_URING_BUFS * sizeof(struct io_uring_buf);
+	unsigned int i;
+
+	ring->br = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		return -1;
+	}
+
+	reg.ring_addr = (uintptr_t)ring->br;
+	if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	ring->bufsiz = bufsiz + sizeof(struct io_uring_recvmsg_out);
+	ring->buf = xmalloc(NFT_URING_BUFS * ring->bufsiz);
+	for (i = 0; i < NFT_URING_BUFS; i++)
+		ring->used[ring->num_used++] = i;
+	nft_uring_buf_recycle(ring);
+
+	return 0;
+}
+
+static struct nft_uring *__nft_uring_open(size_t bufsiz)
+{
+	struct io_uring_params p = {
+		.flags		= IORING_SETUP_CQSIZE,
+		.cq_entries	= 4 * NFT_URING_BUFS,
+	};
+	struct nft_uring *ring;
+
+	ring = xzalloc(sizeof(*ring));
+	ring->fd = io_uring_setup(NFT_URING_ENTRIES, &p);
+	if (ring->fd < 0)
+		goto err;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    nft_uring_map(ring, &p) < 0 ||
+	    nft_uring_buf_init(ring, bufsiz) < 0)
+		goto err;
+
+	return ring;
+err:
+	nft_uring_free(ring);
+	return NULL;
+}
+
+static pthread_once_t nft_uring_once = PTHREAD_ONCE_INIT;
+static bool nft_uring_supported;
+
+static void nft_uring_check(void)
+{
+	struct nft_uring *ring;
+
+	ring = __nft_uring_open(0);
+	nft_uring_supported = ring && nft_uring_probe(ring);
+	nft_uring_free(ring);
+}
+
+/* Set up a ring with receive buffers for datagrams up to @bufsiz bytes,
+ * returns NULL if io_uring is not usable.
+ */
+struct nft_uring *nft_uring_open(size_t bufsiz)
+{
+	pthread_once(&nft_uring_once, nft_uring_check);
+	if (!nft_uring_supported)
+		return NULL;
+
+	return __nft_uring_open(bufsiz);
+}
+
+void nft_uring_free(struct nft_uring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->rings)
+		munmap(ring->rings, ring->rings_size);
+	if (ring->br)
+		munmap(ring->br, NFT_URING_BUFS * sizeof(struct io_uring_buf));
+	free(ring->buf);
+	free(ring);
+}
+
+/* Send @msg and start receiving the replies in the same system call, fetch
+ * them with nft_uring_recv(), which also reports send errors. If the send
+ * fails, the receive is cancelled.
+ */
+int nft_uring_sendmsg(struct nft_uring *ring, int fd, const struct msghdr *msg)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = nft_uring_get_sqe(ring);
+	sqe->opcode	= IORING_OP_SENDMSG;
+	sqe->fd		= fd;
+	sqe->addr	= (uintptr_t)msg;
+	sqe->flags	= IOSQE_IO_LINK;
+	sqe->user_data	= NFT_URING_SEND;
+
+	nft_uring_prep_recv(ring, fd, NFT_URING_RECV);
+	ring->armed = true;
+	ring->send_err = 0;
+
+	if (nft_uring_submit(ring, 0) < 0) {
+		/* nothing was consumed, take the entries back */
+		ring->sqe_tail = *ring->sq_head;
+		__atomic_store_n(ring->sq_tail, ring->sqe_tail,
+				 __ATOMIC_RELEASE);
+		ring->armed = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Pass the datagrams queued on @fd to @cb until the socket is drained or @cb
+ * stops, returns 0 in the first case, the return value of @cb otherwise.
+ * @calls, if set, is incremented for each wait for completions.
+ */
+int nft_uring_recv(struct nft_uring *ring, int fd, nft_uring_cb_t cb,
+		   void *data, unsigned int *calls)
+{
+	const struct io_uring_recvmsg_out *out;
+	struct io_uring_cqe cqe;
+	int ret = 1, err = 0;
+	bool rearm;
+	uint16_t bid;
+
+	if (!ring->armed) {
+		nft_uring_prep_recv(ring, fd, NFT_URING_RECV);
+		ring->armed = true;
+		ring->send_err = 0;
+	}
+
+	while (ring->armed) {
+		/* Nothing to recover from, the receive would be left behind. */
+		if (nft_uring_wait(ring, &cqe, calls) < 0)
+			BUG("io_uring wait failed: %s\n", strerror(errno));
+
+		if (cqe.user_data == NFT_URING_SEND) {
+			if (cqe.res < 0)
+				ring->send_err = -cqe.res;
+			continue;
+		}
+
+		rearm = false;
+		if (cqe.res < 0) {
+			/* Out of buffers, not the socket reporting ENOBUFS. */
+			if (cqe.res == -ENOBUFS &&
+			    ring->num_used == NFT_URING_BUFS)
+				rearm = true;
+			else if (cqe.res != -EAGAIN && !err)
+				err = -cqe.res;
+		} else {
+			bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			ring->used[ring->num_used++] = bid;
+
+			/* Ended without error, the next receive tells whether
+			 * the socket is drained.
+			 */
+			rearm = !(cqe.flags & IORING_CQE_F_MORE);
+
+			out = (void *)(ring->buf + bid * ring->bufsiz);
+			if (ret <= 0) {
+				/* Stopped, drop the rest. */
+			} else if (out->flags & MSG_TRUNC) {
+				errno = ENOSPC;
+				ret = -1;
+			} else {
+				ret = cb(out + 1, cqe.res - sizeof(*out), data);
+			}
+		}
+
+		if (cqe.flags & IORING_CQE_F_MORE)
+			continue;
+
+		ring->armed = false;
+		nft_uring_buf_recycle(ring);
+		if (rearm && ret > 0 && !err && !ring->send_err) {
+			nft_uring_prep_recv(ring, fd, NFT_URING_RECV);
+			ring->armed = true;
+		}
+	}
+
+	if (ring->send_err) {
+		errno = ring->send_err;
+		return -1;
+	}
+	if (err && ret > 0) {
+		errno = err;
+		return -1;
+	}
+
+	return ret > 0 ? 0 : ret;
+}
@@ -24,6 +24,17 @@ void __noreturn __memory_allocation_error(const char *filename, uint32_t line)
 	exit(NFT_EXIT_NOMEM);
 }
 
+__thread struct mem_stats *mem_stats;
+
+static void mem_stats_account(size_t size)
+{
+	if (!mem_stats)
+		return;
+
+	mem_stats->bytes += size;
+	mem_stats->objects++;
+}
+
 void *xmalloc(size_t size)
 {
 	void *ptr;
@@ -31,6 +42,7 @@ void *xmalloc(size_t size)
 	ptr = malloc(size);
 	if (ptr == NULL)
 		memory_allocation_error();
+	mem_stats_account(size);
 	return ptr;
 }
 
@@ -60,6 +72,7 @@ void *xrealloc(void *ptr, size_t size)
 	ptr = realloc(ptr, size);
 	if (ptr == NULL && size != 0)
 		memory_allocation_error();
+	mem_stats_account(size);
 	return ptr;
 }
 
@@ -72,6 +85,43 @@ void *xzalloc(size_t size)
 	return ptr;
 }
 
+void *node_cache_zalloc(struct node_cache *cache, size_t size)
+{
+	void *ptr = cache->head;
+
+	if (!ptr)
+		return xzalloc(size);
+
+	cache->head = *(void **)ptr;
+	cache->count--;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void node_cache_free(struct node_cache *cache, void *ptr)
+{
+	if (cache->count >= NODE_CACHE_MAX) {
+		free(ptr);
+		return;
+	}
+
+	*(void **)ptr = cache->head;
+	cache->head = ptr;
+	cache->count++;
+}
+
+void node_cache_release(struct node_cache *cache)
+{
+	void *ptr;
+
+	while (cache->head) {
+		ptr = cache->head;
+		cache->head = *(void **)ptr;
+		free(ptr);
+	}
+	cache->count = 0;
+}
+
 char *xstrdup(const char *s)
 {
 	char *res;
@@ -80,6 +130,7 @@ char *xstrdup(const char *s)
 	res = strdup(s);
 	if (res == NULL)
 		memory_allocation_error();
+	mem_stats_account(strlen(res) + 1);
 	return res;
 }
 
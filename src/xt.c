@@ -30,44 +30,42 @@
 #include <xtables.h>
 
 static void *xt_entry_alloc(const struct xt_stmt *xt, uint32_t af);
-#endif
 
-void xt_stmt_xlate(const struct stmt *stmt, struct output_ctx *octx)
+/*
+ * Returns 1 if libxtables translated the statement into @xl, 0 if it has no
+ * translation for it and -1 if the extension is not available.
+ */
+static int __xt_stmt_xlate(const struct xt_stmt *xt, struct output_ctx *octx,
+			   struct xt_xlate *xl)
 {
-	static const char *typename[NFT_XT_MAX] = {
-		[NFT_XT_MATCH]		= "match",
-		[NFT_XT_TARGET]		= "target",
-		[NFT_XT_WATCHER]	= "watcher",
-	};
-	int rc = 0;
-#ifdef HAVE_LIBXTABLES
-	struct xt_xlate *xl = xt_xlate_alloc(10240);
 	struct xtables_target *tg;
 	struct xt_entry_target *t;
 	struct xtables_match *mt;
 	struct xt_entry_match *m;
+	int rc = 0;
 	size_t size;
 	void *entry;
 
-	xtables_set_nfproto(stmt->xt.family);
-	entry = xt_entry_alloc(&stmt->xt, stmt->xt.family);
+	xtables_set_nfproto(xt->family);
+	entry = xt_entry_alloc(xt, xt->family);
 
-	switch (stmt->xt.type) {
+	switch (xt->type) {
 	case NFT_XT_MATCH:
-		mt = xtables_find_match(stmt->xt.name, XTF_TRY_LOAD, NULL);
+		mt = xtables_find_match(xt->name, XTF_TRY_LOAD, NULL);
 		if (!mt) {
 			fprintf(octx->error_fp,
 				"# Warning: XT match %s not found\n",
-				stmt->xt.name);
+				xt->name);
+			rc = -1;
 			break;
 		}
-		size = XT_ALIGN(sizeof(*m)) + stmt->xt.infolen;
+		size = XT_ALIGN(sizeof(*m)) + xt->infolen;
 
 		m = xzalloc(size);
-		memcpy(&m->data, stmt->xt.info, stmt->xt.infolen);
+		memcpy(&m->data, xt->info, xt->infolen);
 
 		m->u.match_size = size;
-		m->u.user.revision = stmt->xt.rev;
+		m->u.user.revision = xt->rev;
 
 		if (mt->xlate) {
 			struct xt_xlate_mt_params params = {
@@ -82,20 +80,21 @@ void xt_stmt_xlate(const struct stmt *stmt, struct output_ctx *octx)
 		break;
 	case NFT_XT_WATCHER:
 	case NFT_XT_TARGET:
-		tg = xtables_find_target(stmt->xt.name, XTF_TRY_LOAD);
+		tg = xtables_find_target(xt->name, XTF_TRY_LOAD);
 		if (!tg) {
 			fprintf(octx->error_fp,
 				"# Warning: XT target %s not found\n",
-				stmt->xt.name);
+				xt->name);
+			rc = -1;
 			break;
 		}
-		size = XT_ALIGN(sizeof(*t)) + stmt->xt.infolen;
+		size = XT_ALIGN(sizeof(*t)) + xt->infolen;
 
 		t = xzalloc(size);
-		memcpy(&t->data, stmt->xt.info, stmt->xt.infolen);
+		memcpy(&t->data, xt->info, xt->infolen);
 
 		t->u.target_size = size;
-		t->u.user.revision = stmt->xt.rev;
+		t->u.user.revision = xt->rev;
 
 		strcpy(t->u.user.name, tg->name);
 
@@ -111,15 +110,140 @@ void xt_stmt_xlate(const struct stmt *stmt, struct output_ctx *octx)
 		free(t);
 		break;
 	}
+	free(entry);
+
+	return rc;
+}
+
+/*
+ * Translations only depend on the statement, so they are kept for the life
+ * of the context: rulesets converted from iptables-nft repeat the same
+ * matches and targets in many rules. @xlate is NULL if libxtables has no
+ * translation for the statement.
+ */
+#define XT_XLATE_CACHE_SIZE	256
+
+struct xt_xlate_entry {
+	struct xt_xlate_entry	*next;
+	struct xt_stmt		xt;
+	char			*xlate;
+};
+
+struct xt_xlate_cache {
+	struct xt_xlate_entry	*buckets[XT_XLATE_CACHE_SIZE];
+};
+
+static uint32_t xt_xlate_hash(const struct xt_stmt *xt)
+{
+	const unsigned char *info = xt->info;
+	const char *name = xt->name;
+	uint32_t hash = 5381;
+	size_t i;
+
+	for (; *name; name++)
+		hash = ((hash << 5) + hash) ^ *name;
+	hash = ((hash << 5) + hash) ^ xt->family;
+	hash = ((hash << 5) + hash) ^ xt->type;
+	hash = ((hash << 5) + hash) ^ xt->rev;
+	hash = ((hash << 5) + hash) ^ xt->proto;
+	for (i = 0; i < xt->infolen; i++)
+		hash = ((hash << 5) + hash) ^ info[i];
+
+	return hash % XT_XLATE_CACHE_SIZE;
+}
+
+static bool xt_xlate_match(const struct xt_stmt *a, const struct xt_stmt *b)
+{
+	return a->family == b->family &&
+	       a->type == b->type &&
+	       a->rev == b->rev &&
+	       a->proto == b->proto &&
+	       a->infolen == b->infolen &&
+	       !strcmp(a->name, b->name) &&
+	       !memcmp(a->info, b->info, a->infolen);
+}
+
+static const struct xt_xlate_entry *xt_xlate_lookup(struct output_ctx *octx,
+						    const struct xt_stmt *xt)
+{
+	struct xt_xlate_entry *entry, **head;
+	struct xt_xlate *xl;
+	int rc;
 
+	if (!octx->xt_cache)
+		octx->xt_cache = xzalloc(sizeof(*octx->xt_cache));
+
+	head = &octx->xt_cache->buckets[xt_xlate_hash(xt)];
+	for (entry = *head; entry; entry = entry->next) {
+		if (xt_xlate_match(&entry->xt, xt))
+			return entry;
+	}
+
+	xl = xt_xlate_alloc(10240);
+	rc = __xt_stmt_xlate(xt, octx, xl);
+	if (rc < 0) {
+		/* not cached, so the warning is repeated for every listing. */
+		xt_xlate_free(xl);
+		return NULL;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->xt = *xt;
+	entry->xt.name = xstrdup(xt->name);
+	entry->xt.info = xmalloc(xt->infolen);
+	memcpy(entry->xt.info, xt->info, xt->infolen);
 	if (rc == 1)
-		nft_print(octx, "%s", xt_xlate_get(xl));
+		entry->xlate = xstrdup(xt_xlate_get(xl));
 	xt_xlate_free(xl);
-	free(entry);
+
+	entry->next = *head;
+	*head = entry;
+
+	return entry;
+}
+#endif
+
+void xt_stmt_xlate(const struct stmt *stmt, struct output_ctx *octx)
+{
+	static const char *typename[NFT_XT_MAX] = {
+		[NFT_XT_MATCH]		= "match",
+		[NFT_XT_TARGET]		= "target",
+		[NFT_XT_WATCHER]	= "watcher",
+	};
+#ifdef HAVE_LIBXTABLES
+	const struct xt_xlate_entry *entry;
+
+	entry = xt_xlate_lookup(octx, &stmt->xt);
+	if (entry && entry->xlate) {
+		nft_print(octx, "%s", entry->xlate);
+		return;
+	}
+#endif
+	nft_print(octx, "xt %s \"%s\"",
+		  typename[stmt->xt.type], stmt->xt.name);
+}
+
+void xt_xlate_cache_free(struct output_ctx *octx)
+{
+#ifdef HAVE_LIBXTABLES
+	struct xt_xlate_entry *entry, *next;
+	unsigned int i;
+
+	if (!octx->xt_cache)
+		return;
+
+	for (i = 0; i < XT_XLATE_CACHE_SIZE; i++) {
+		for (entry = octx->xt_cache->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			free_const(entry->xt.name);
+			free(entry->xt.info);
+			free(entry->xlate);
+			free(entry);
+		}
+	}
+	free(octx->xt_cache);
+	octx->xt_cache = NULL;
 #endif
-	if (!rc)
-		nft_print(octx, "xt %s \"%s\"",
-			  typename[stmt->xt.type], stmt->xt.name);
 }
 
 void xt_stmt_destroy(struct stmt *stmt)
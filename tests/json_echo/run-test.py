@@ -307,3 +307,19 @@ if shandle != get_handle(out, add_set["add"]):
 
 if rhandle != get_handle(out, add_rule["add"]):
     exit_err("rule handle mismatch!")
+
+print("doing multi add with handles-only echo")
+do_flush()
+nftables.set_echo_output(False)
+nftables.set_echo_handles_output(True)
+do_command(add_multi)
+handles = nftables.get_echo_handles()
+nftables.set_echo_handles_output(False)
+nftables.set_echo_output(True)
+
+out = do_list_ruleset()
+if handles != [(0, "table", get_handle(out, add_table["add"])),
+               (1, "chain", get_handle(out, add_chain["add"])),
+               (2, "set", get_handle(out, add_set["add"])),
+               (3, "rule", get_handle(out, add_rule["add"]))]:
+    exit_err("handles-only echo mismatch: {}".format(handles))
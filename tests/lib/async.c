@@ -0,0 +1,116 @@
+/* nft_ctx_async_fd(), nft_async_submit(), _cancel() and _process() */
+
+#include <errno.h>
+#include <poll.h>
+#include "test.h"
+
+#define NUM_RUNS	4
+
+struct run {
+	struct nft_async	*op;
+	int			rc;
+	bool			done;
+	bool			cancelled;
+	bool			output;
+	bool			error;
+};
+
+static struct run runs[NUM_RUNS];
+static unsigned int num_done;
+
+static void run_cb(struct nft_async *op, int rc, const char *output,
+		   const char *error, void *data)
+{
+	struct run *run = data;
+
+	/* callbacks come in the order the runs were submitted */
+	check(run == &runs[num_done]);
+	check(run->op == op && !run->done && !run->cancelled);
+
+	run->rc = rc;
+	run->done = true;
+	run->output = strstr(output, "table inet t") != NULL;
+	run->error = strstr(error, "bogus") != NULL;
+	num_done++;
+}
+
+/* Process finished runs until @num callbacks were called in total. */
+static void wait_runs(struct nft_ctx *nft, int fd, unsigned int num)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int n;
+
+	while (num_done < num) {
+		check(poll(&pfd, 1, 10000) == 1);
+		n = nft_async_process(nft);
+		check(n >= 0);
+	}
+	check(num_done == num);
+}
+
+int main(void)
+{
+	static const char *cmds[NUM_RUNS] = {
+		"add table inet t",
+		"add chain inet t c",
+		"add rule inet t c bogus",
+		"list ruleset",
+	};
+	unsigned int i, expected;
+	struct nft_ctx *nft;
+	int fd;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+	test_run(nft, "flush ruleset");
+
+	fd = nft_ctx_async_fd(nft);
+	check(fd >= 0);
+	check(nft_ctx_async_fd(nft) == fd);
+
+	/* nothing has finished yet */
+	check(nft_async_process(nft) == 0);
+
+	check(nft_async_submit(nft, "list ruleset", NULL, NULL) == NULL);
+
+	for (i = 0; i < NUM_RUNS; i++) {
+		runs[i].op = nft_async_submit(nft, cmds[i], run_cb, &runs[i]);
+		check(runs[i].op != NULL);
+	}
+	wait_runs(nft, fd, NUM_RUNS);
+
+	check(runs[0].rc == 0 && runs[1].rc == 0 && runs[3].rc == 0);
+	check(runs[2].rc != 0 && runs[2].error);
+	check(runs[3].output);
+
+	/* a run that has not started yet is dropped without callback, one
+	 * that has started cannot be cancelled.
+	 */
+	memset(runs, 0, sizeof(runs));
+	num_done = 0;
+	runs[0].op = nft_async_submit(nft, "add set inet t s { type ipv4_addr; }",
+				      run_cb, &runs[0]);
+	runs[1].op = nft_async_submit(nft, "add element inet t s { 10.0.0.1 }",
+				      run_cb, &runs[1]);
+	check(runs[0].op != NULL && runs[1].op != NULL);
+	if (nft_async_cancel(runs[1].op) == 0) {
+		runs[1].cancelled = true;
+		expected = 1;
+	} else {
+		expected = 2;
+	}
+	wait_runs(nft, fd, expected);
+	check(runs[0].rc == 0);
+	check(runs[1].cancelled == !runs[1].done);
+	check(test_output_has(nft, "list set inet t s", "10.0.0.1") ==
+	      runs[1].done);
+
+	/* the context stays in its network namespace while runs are used */
+	errno = 0;
+	check(nft_ctx_set_netns(nft, "/proc/self/ns/net") != 0);
+	check(errno == EBUSY);
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/* nft_counters_dump(), nft_counters_free() and nft_set_counters_dump() */
+
+#include <stdint.h>
+#include <linux/netfilter.h>
+#include "test.h"
+
+static const struct nft_counter *find(const struct nft_counter *counters,
+				      size_t n, uint32_t type,
+				      const char *table, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (counters[i].type == type &&
+		    !strcmp(counters[i].table, table) &&
+		    !strcmp(counters[i].name, name))
+			return &counters[i];
+	}
+
+	return NULL;
+}
+
+struct set_counters {
+	unsigned int	num;
+	uint64_t	packets;
+	uint64_t	bytes;
+};
+
+static void set_counter_cb(const struct nft_set_counter *counter, void *data)
+{
+	static const uint8_t key[4] = { 10, 0, 0, 1 };
+	struct set_counters *sc = data;
+
+	check(counter->key_len == sizeof(key));
+	sc->num++;
+	if (!memcmp(counter->key, key, sizeof(key))) {
+		sc->packets = counter->packets;
+		sc->bytes = counter->bytes;
+	}
+}
+
+int main(void)
+{
+	struct set_counters sc = {};
+	const struct nft_counter *c;
+	struct nft_counter *counters;
+	struct nft_ctx *nft;
+	size_t n;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+
+	test_run(nft, "flush ruleset;"
+		      "add table inet t;"
+		      "add counter inet t c1 { packets 5 bytes 300 };"
+		      "add quota inet t q { over 1000 bytes used 200 bytes };"
+		      "add chain inet t c;"
+		      "add rule inet t c counter packets 3 bytes 120 accept;"
+		      "add rule inet t c accept;"
+		      "add set inet t s { type ipv4_addr; counter; };"
+		      "add element inet t s { 10.0.0.1 counter packets 7 bytes 70, 10.0.0.2 };"
+		      "add table ip u;"
+		      "add counter ip u c2;");
+
+	check(nft_counters_dump(nft, "inet", "t", 0, &counters, &n) == 0);
+	check(n == 2);
+	c = find(counters, n, NFT_COUNTER_OBJ, "t", "c1");
+	check(c && c->family == NFPROTO_INET &&
+	      c->packets == 5 && c->bytes == 300);
+	c = find(counters, n, NFT_COUNTER_QUOTA, "t", "q");
+	check(c && c->bytes == 200 && c->quota == 1000);
+	nft_counters_free(counters, n);
+
+	/* rules without counter are skipped */
+	check(nft_counters_dump(nft, "inet", "t", NFT_COUNTERS_RULES,
+				&counters, &n) == 0);
+	check(n == 3);
+	c = find(counters, n, NFT_COUNTER_RULE, "t", "c");
+	check(c && c->handle && c->packets == 3 && c->bytes == 120);
+	nft_counters_free(counters, n);
+
+	/* all tables of all families */
+	check(nft_counters_dump(nft, NULL, NULL, 0, &counters, &n) == 0);
+	check(n == 3);
+	c = find(counters, n, NFT_COUNTER_OBJ, "u", "c2");
+	check(c && c->family == NFPROTO_IPV4 && c->packets == 0);
+	nft_counters_free(counters, n);
+
+	/* reset returns the values before the reset */
+	check(nft_counters_dump(nft, "inet", "t",
+				NFT_COUNTERS_RULES | NFT_COUNTERS_RESET,
+				&counters, &n) == 0);
+	c = find(counters, n, NFT_COUNTER_OBJ, "t", "c1");
+	check(c && c->packets == 5);
+	nft_counters_free(counters, n);
+	check(nft_counters_dump(nft, "inet", "t", NFT_COUNTERS_RULES,
+				&counters, &n) == 0);
+	c = find(counters, n, NFT_COUNTER_OBJ, "t", "c1");
+	check(c && c->packets == 0 && c->bytes == 0);
+	c = find(counters, n, NFT_COUNTER_QUOTA, "t", "q");
+	check(c && c->bytes == 0 && c->quota == 1000);
+	c = find(counters, n, NFT_COUNTER_RULE, "t", "c");
+	check(c && c->packets == 0);
+	nft_counters_free(counters, n);
+
+	test_flush_output(nft);
+	check(nft_counters_dump(nft, "nosuch", NULL, 0, &counters, &n) != 0);
+	check(test_error_has(nft, "unknown family `nosuch'"));
+
+	/* counters of set elements */
+	check(nft_set_counters_dump(nft, "inet", "t", "s", 0, set_counter_cb,
+				    &sc) == 0);
+	check(sc.num == 2 && sc.packets == 7 && sc.bytes == 70);
+
+	memset(&sc, 0, sizeof(sc));
+	check(nft_set_counters_dump(nft, "inet", "t", "s", NFT_COUNTERS_RESET,
+				    set_counter_cb, &sc) == 0);
+	check(sc.num == 2 && sc.packets == 7);
+	memset(&sc, 0, sizeof(sc));
+	check(nft_set_counters_dump(nft, "inet", "t", "s", 0, set_counter_cb,
+				    &sc) == 0);
+	check(sc.num == 2 && sc.packets == 0 && sc.bytes == 0);
+
+	check(nft_set_counters_dump(nft, "inet", "t", "nosuch", 0,
+				    set_counter_cb, &sc) != 0);
+	check(nft_set_counters_dump(nft, "nosuch", "t", "s", 0,
+				    set_counter_cb, &sc) != 0);
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
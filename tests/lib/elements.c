@@ -0,0 +1,113 @@
+/* nft_set_elements_add(), _delete(), _get() and _query() */
+
+#include <stdint.h>
+#include "test.h"
+
+#define NUM_KEYS	5
+/* more than one window of pipelined requests */
+#define NUM_MANY	200
+
+/* 10.0.0.1 to 10.0.0.5 in network byte order */
+static const uint8_t keys[NUM_KEYS][4] = {
+	{ 10, 0, 0, 1 }, { 10, 0, 0, 2 }, { 10, 0, 0, 3 },
+	{ 10, 0, 0, 4 }, { 10, 0, 0, 5 },
+};
+
+int main(void)
+{
+	const uint8_t ports[2][2] = { { 0, 22 }, { 0, 80 } };
+	struct nft_elements_opts opts = {};
+	const uint64_t timeouts[1] = { 60000 };
+	const uint64_t packets[1] = { 5 };
+	const uint64_t bytes[1] = { 300 };
+	uint8_t many[NUM_MANY][4], many_bitmap[(NUM_MANY + 7) / 8];
+	bool found[NUM_KEYS];
+	struct nft_ctx *nft;
+	uint8_t bitmap[1];
+	unsigned int i;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+
+	test_run(nft, "flush ruleset;"
+		      "add table inet t;"
+		      "add set inet t s { type ipv4_addr; };"
+		      "add map inet t m { type ipv4_addr : inet_service; };"
+		      "add set inet t tc { type ipv4_addr; flags timeout; counter; };");
+
+	check(nft_set_elements_add(nft, "inet", "t", "s", keys, 4, 3,
+				   NULL) == 0);
+	check(test_output_has(nft, "list set inet t s",
+			      "elements = { 10.0.0.1, 10.0.0.2, 10.0.0.3 }"));
+
+	check(nft_set_elements_query(nft, "inet", "t", "s", keys, 4,
+				     NUM_KEYS, bitmap) == 0);
+	check(bitmap[0] == 0x07);
+
+	check(nft_set_elements_delete(nft, "inet", "t", "s", keys[1], 4,
+				      1) == 0);
+	check(nft_set_elements_get(nft, "inet", "t", "s", keys, 4, NUM_KEYS,
+				   found) == 0);
+	check(found[0] && !found[1] && found[2] && !found[3] && !found[4]);
+
+	/* a missing element fails the whole batch, with its index */
+	test_flush_output(nft);
+	check(nft_set_elements_delete(nft, "inet", "t", "s", keys, 4, 2) != 0);
+	check(test_error_has(nft, "Could not process element 1 of set s"));
+	check(nft_set_elements_get(nft, "inet", "t", "s", keys, 4, 1,
+				   found) == 0);
+	check(found[0]);
+
+	/* the kernel checks the key length */
+	check(nft_set_elements_add(nft, "inet", "t", "s", keys, 2, 2,
+				   NULL) != 0);
+	check(nft_set_elements_add(nft, "inet", "t", "nosuch", keys, 4, 1,
+				   NULL) != 0);
+	check(nft_set_elements_add(nft, "nosuch", "t", "s", keys, 4, 1,
+				   NULL) != 0);
+	check(test_error_has(nft, "unknown family `nosuch'"));
+	check(nft_set_elements_query(nft, "inet", "t", "nosuch", keys, 4, 1,
+				     bitmap) != 0);
+
+	/* data of maps, timeouts and counters */
+	opts.data = ports;
+	opts.data_len = sizeof(ports[0]);
+	check(nft_set_elements_add(nft, "inet", "t", "m", keys, 4, 2,
+				   &opts) == 0);
+	check(test_output_has(nft, "list map inet t m",
+			      "elements = { 10.0.0.1 : 22, 10.0.0.2 : 80 }"));
+
+	opts.data_len = 4;
+	check(nft_set_elements_add(nft, "inet", "t", "m", keys[2], 4, 1,
+				   &opts) != 0);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.timeouts = timeouts;
+	opts.packets = packets;
+	opts.bytes = bytes;
+	check(nft_set_elements_add(nft, "inet", "t", "tc", keys, 4, 1,
+				   &opts) == 0);
+	check(test_output_has(nft, "list set inet t tc",
+			      "10.0.0.1 counter packets 5 bytes 300 timeout 1m"));
+
+	/* replies of several windows are matched to their keys, every third
+	 * key is in the set.
+	 */
+	for (i = 0; i < NUM_MANY; i++) {
+		many[i][0] = 192;
+		many[i][1] = 168;
+		many[i][2] = i / 256;
+		many[i][3] = i % 256;
+		if (i % 3 == 0)
+			check(nft_set_elements_add(nft, "inet", "t", "s",
+						   many[i], 4, 1, NULL) == 0);
+	}
+	check(nft_set_elements_query(nft, "inet", "t", "s", many, 4, NUM_MANY,
+				     many_bitmap) == 0);
+	for (i = 0; i < NUM_MANY; i++)
+		check(!!(many_bitmap[i / 8] & (1 << (i % 8))) == (i % 3 == 0));
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+/* nft_ctx_set_netns(), nft_run_cmd_parallel() and nft_run_results_free() */
+
+#include <errno.h>
+#include "test.h"
+
+#define NUM_NS	3
+
+int main(int argc, char *argv[])
+{
+	static const char * const ports[NUM_NS] = { "port=22", "port=80",
+						     "port=bogus" };
+	struct nft_ctx *ctxs[NUM_NS], *nft;
+	struct nft_run_result *results;
+	int i;
+
+	/* the namespaces to bind to are created by the caller */
+	check(argc == NUM_NS + 1);
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+	test_run(nft, "flush ruleset");
+
+	errno = 0;
+	check(nft_ctx_set_netns(nft, "/nonexistent") != 0 && errno != 0);
+
+	for (i = 0; i < NUM_NS; i++) {
+		ctxs[i] = test_ctx_new(NFT_CTX_DEFAULT);
+		check(nft_ctx_set_netns(ctxs[i], argv[i + 1]) == 0);
+		test_run(ctxs[i], "flush ruleset");
+		check(nft_ctx_add_var(ctxs[i], ports[i]) == 0);
+	}
+
+	/* variables of each context fill in the template, the run with the
+	 * bogus service fails on its own.
+	 */
+	check(nft_run_cmd_parallel(ctxs, NUM_NS,
+				   "add table ip t;"
+				   "add set ip t s { type inet_service; elements = { $port } };"
+				   "list set ip t s", 2, &results) == 1);
+	check(results[0].rc == 0 &&
+	      strstr(results[0].output, "elements = { 22 }"));
+	check(results[1].rc == 0 &&
+	      strstr(results[1].output, "elements = { 80 }"));
+	check(results[2].rc != 0 &&
+	      strstr(results[2].error, "Could not resolve service"));
+	nft_run_results_free(results, NUM_NS);
+
+	/* each context changed the ruleset of its own namespace only */
+	check(!test_output_has(nft, "list tables", "table ip t"));
+	check(test_output_has(ctxs[0], "list set ip t s", "elements = { 22 }"));
+	check(test_output_has(ctxs[1], "list set ip t s", "elements = { 80 }"));
+	check(!test_output_has(ctxs[2], "list tables", "table ip t"));
+
+	/* rebinding drops the cache of the former namespace */
+	check(nft_ctx_set_netns(ctxs[1], argv[1]) == 0);
+	check(test_output_has(ctxs[1], "list set ip t s", "elements = { 22 }"));
+
+	for (i = 0; i < NUM_NS; i++) {
+		test_run(ctxs[i], "flush ruleset");
+		nft_ctx_free(ctxs[i]);
+	}
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/* nft_ctx_set_output_cb() */
+
+#include "test.h"
+
+#define NUM_ELEMS	20000
+#define CHUNK_SIZE	65536
+
+struct collect {
+	char		*buf;
+	size_t		len;
+	unsigned int	calls;
+	bool		partial;
+};
+
+static int collect_cb(const char *buf, size_t len, void *data)
+{
+	struct collect *c = data;
+
+	/* only the last chunk of a run is shorter */
+	check(len > 0 && len <= CHUNK_SIZE);
+	check(!c->partial);
+	c->partial = len < CHUNK_SIZE;
+
+	c->buf = realloc(c->buf, c->len + len + 1);
+	check(c->buf != NULL);
+	memcpy(c->buf + c->len, buf, len);
+	c->len += len;
+	c->buf[c->len] = '\0';
+	c->calls++;
+
+	return 0;
+}
+
+int main(void)
+{
+	struct collect c = {};
+	struct nft_ctx *nft;
+	char *cmd, *expected;
+	size_t len = 0;
+	int i;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+
+	cmd = malloc(NUM_ELEMS * 16 + 128);
+	check(cmd != NULL);
+	len += sprintf(cmd, "flush ruleset; add table ip t;"
+			    "add set ip t s { type ipv4_addr; elements = { ");
+	for (i = 0; i < NUM_ELEMS; i++)
+		len += sprintf(cmd + len, "10.0.%u.%u, ", i / 256, i % 256);
+	sprintf(cmd + len, "192.168.0.1 }; }");
+	test_run(nft, cmd);
+	free(cmd);
+
+	check(test_output_has(nft, "list set ip t s", "192.168.0.1"));
+	expected = strdup(nft_ctx_get_output_buffer(nft));
+	check(expected != NULL);
+
+	/* not together with output buffering */
+	check(nft_ctx_set_output_cb(nft, collect_cb, &c) != 0);
+	check(nft_ctx_unbuffer_output(nft) == 0);
+	check(nft_ctx_set_output_cb(nft, NULL, NULL) != 0);
+	check(nft_ctx_set_output_cb(nft, collect_cb, &c) == 0);
+	check(nft_ctx_buffer_output(nft) != 0);
+	check(!strcmp(nft_ctx_get_output_buffer(nft), ""));
+
+	/* the listing comes in full chunks, then the rest before the run
+	 * returns.
+	 */
+	check(nft_run_cmd_from_buffer(nft, "list set ip t s") == 0);
+	check(strlen(expected) > 2 * CHUNK_SIZE);
+	check(c.calls == (strlen(expected) + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	check(!strcmp(c.buf, expected));
+
+	/* commands without output do not call it */
+	c.calls = 0;
+	check(nft_run_cmd_from_buffer(nft,
+				      "add element ip t s { 192.168.0.2 }") == 0);
+	check(c.calls == 0);
+
+	check(nft_ctx_set_output_cb(nft, NULL, NULL) == 0);
+	check(nft_ctx_buffer_output(nft) == 0);
+	test_run(nft, "flush ruleset");
+
+	free(c.buf);
+	free(expected);
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
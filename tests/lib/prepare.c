@@ -0,0 +1,117 @@
+/* nft_prepare(), nft_bind_*(), nft_execute(), nft_execute_on() and
+ * nft_stmt_free()
+ */
+
+#include <stdint.h>
+#include "test.h"
+
+int main(void)
+{
+	const uint8_t addr[4] = { 10, 0, 0, 3 };
+	struct nft_stmt *stmt, *rule, *tpl;
+	struct nft_ctx *nft, *other;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+
+	test_run(nft, "flush ruleset;"
+		      "add table inet t;"
+		      "add set inet t s { type ipv4_addr . inet_service; };"
+		      "add chain inet t c;");
+
+	/* the set must exist when the commands are evaluated */
+	check(nft_prepare(nft, "add element inet t x { $ip . $port }") == NULL);
+
+	stmt = nft_prepare(nft, "add element inet t s { $ip . $port }");
+	check(stmt != NULL);
+
+	/* placeholders must be bound before executing */
+	check(nft_execute(stmt) != 0);
+
+	check(nft_bind_str(stmt, "ip", "10.0.0.1") == 0);
+	check(nft_bind_u64(stmt, "port", 22) == 0);
+	check(nft_execute(stmt) == 0);
+
+	/* values stay bound until they are bound again */
+	check(nft_bind_var(stmt, "ip=10.0.0.2") == 0);
+	check(nft_execute(stmt) == 0);
+
+	check(nft_bind_data(stmt, "ip", addr, sizeof(addr)) == 0);
+	check(nft_bind_str(stmt, "port", "80") == 0);
+	check(nft_execute(stmt) == 0);
+
+	check(test_output_has(nft, "list set inet t s", "10.0.0.1 . 22"));
+	check(test_output_has(nft, "list set inet t s", "10.0.0.2 . 22"));
+	check(test_output_has(nft, "list set inet t s", "10.0.0.3 . 80"));
+
+	/* binding errors leave the previous values in place */
+	check(nft_bind_str(stmt, "nosuch", "1") != 0);
+	check(test_error_has(nft, "unknown placeholder $nosuch"));
+	check(nft_bind_str(stmt, "ip", "10.0.0.300") != 0);
+	check(nft_bind_str(stmt, "ip", "10.0.0.0/24") != 0);
+	check(nft_bind_u64(stmt, "port", 65536) != 0);
+	check(nft_bind_data(stmt, "ip", addr, 2) != 0);
+	check(nft_bind_var(stmt, "10.0.0.4") != 0);
+	check(nft_execute(stmt) == 0);
+
+	/* rules are templates too, the same values can be sent again */
+	rule = nft_prepare(nft, "add rule inet t c ip saddr $ip counter accept");
+	check(rule != NULL);
+	check(nft_bind_str(rule, "ip", "192.168.0.1") == 0);
+	check(nft_execute(rule) == 0);
+	check(nft_execute(rule) == 0);
+	check(nft_bind_str(rule, "ip", "192.168.0.2") == 0);
+	check(nft_execute(rule) == 0);
+	check(test_output_has(nft, "list chain inet t c",
+			      "ip saddr 192.168.0.1 counter packets 0 bytes 0 accept\n"
+			      "\t\tip saddr 192.168.0.1 counter packets 0 bytes 0 accept\n"
+			      "\t\tip saddr 192.168.0.2 counter packets 0 bytes 0 accept\n"));
+	nft_stmt_free(rule);
+
+	/* whole rulesets are templates, values are patched into rules and
+	 * elements of sets without intervals.
+	 */
+	check(nft_prepare(nft, "add set inet t r { type ipv4_addr; "
+			       "flags interval; elements = { $ip } }") == NULL);
+	check(test_error_has(nft, "placeholder $ip cannot be bound here"));
+
+	tpl = nft_prepare(nft, "table inet tpl {\n"
+			       "	set allow {\n"
+			       "		type inet_service\n"
+			       "		elements = { $port }\n"
+			       "	}\n"
+			       "	chain c {\n"
+			       "		iifname $dev tcp dport @allow accept\n"
+			       "	}\n"
+			       "}");
+	check(tpl != NULL);
+	check(nft_bind_var(tpl, "port=22") == 0);
+	check(nft_bind_var(tpl, "dev=eth0") == 0);
+	check(nft_execute(tpl) == 0);
+	check(test_output_has(nft, "list set inet tpl allow",
+			      "elements = { 22 }"));
+	check(test_output_has(nft, "list chain inet tpl c",
+			      "iifname \"eth0\" tcp dport @allow accept"));
+
+	/* the template applies to the ruleset of another context */
+	other = test_ctx_new(NFT_CTX_DEFAULT);
+	test_run(other, "delete table inet tpl");
+	check(nft_bind_var(tpl, "port=80") == 0);
+	check(nft_bind_var(tpl, "dev=eth1") == 0);
+	check(nft_execute_on(tpl, other) == 0);
+	check(test_output_has(other, "list set inet tpl allow",
+			      "elements = { 80 }"));
+	check(test_output_has(other, "list chain inet tpl c",
+			      "iifname \"eth1\" tcp dport @allow accept"));
+	nft_ctx_free(other);
+	nft_stmt_free(tpl);
+
+	/* the statement does not notice that the set is gone */
+	test_run(nft, "delete set inet t s");
+	check(nft_execute(stmt) != 0);
+	nft_stmt_free(stmt);
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/* nft_ctx_session_new() */
+
+#include <pthread.h>
+#include "test.h"
+
+#define NUM_SESSIONS	4
+#define NUM_LISTS	50
+#define NUM_TABLES	20
+
+static void *list_thread(void *data)
+{
+	struct nft_ctx *session = data;
+	int i;
+
+	/* the parent adds tables meanwhile, the ruleset is always complete */
+	for (i = 0; i < NUM_LISTS; i++)
+		check(test_output_has(session, "list ruleset",
+				      "chain c {\n\t\tip saddr 10.0.0.1 accept\n\t}"));
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct nft_ctx *nft, *sessions[NUM_SESSIONS];
+	pthread_t threads[NUM_SESSIONS];
+	char cmd[64];
+	int i;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+	test_run(nft, "flush ruleset;"
+		      "add table inet t;"
+		      "add chain inet t c;"
+		      "add rule inet t c ip saddr 10.0.0.1 accept");
+
+	for (i = 0; i < NUM_SESSIONS; i++) {
+		sessions[i] = nft_ctx_session_new(nft);
+		check(sessions[i] != NULL);
+		check(nft_ctx_buffer_output(sessions[i]) == 0);
+		check(nft_ctx_buffer_error(sessions[i]) == 0);
+	}
+	check(nft_ctx_session_new(sessions[0]) == NULL);
+
+	/* sessions only list */
+	test_flush_output(sessions[0]);
+	check(nft_run_cmd_from_buffer(sessions[0], "add table ip x") != 0);
+
+	for (i = 0; i < NUM_SESSIONS; i++)
+		check(pthread_create(&threads[i], NULL, list_thread,
+				     sessions[i]) == 0);
+
+	for (i = 0; i < NUM_TABLES; i++) {
+		snprintf(cmd, sizeof(cmd), "add table ip t%d", i);
+		test_run(nft, cmd);
+	}
+
+	for (i = 0; i < NUM_SESSIONS; i++)
+		check(pthread_join(threads[i], NULL) == 0);
+
+	/* every session sees the last change */
+	snprintf(cmd, sizeof(cmd), "table ip t%d", NUM_TABLES - 1);
+	for (i = 0; i < NUM_SESSIONS; i++)
+		check(test_output_has(sessions[i], "list tables", cmd));
+
+	test_run(nft, "delete table inet t");
+	check(!test_output_has(sessions[0], "list tables", "table inet t\n"));
+
+	for (i = 0; i < NUM_SESSIONS; i++)
+		nft_ctx_free(sessions[i]);
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
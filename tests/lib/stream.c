@@ -0,0 +1,87 @@
+/* NFT_CTX_STREAM_LIST */
+
+#include "test.h"
+
+static const char ruleset[] =
+	"flush ruleset\n"
+	"table inet t {\n"
+	"	set s {\n"
+	"		type ipv4_addr\n"
+	"		flags interval\n"
+	"		elements = { 10.0.0.0/8, 192.168.0.1 }\n"
+	"	}\n"
+	"	map m {\n"
+	"		type inet_service : verdict\n"
+	"		elements = { 22 : accept, 80 : jump c }\n"
+	"	}\n"
+	"	chain c {\n"
+	"		ip saddr @s counter accept\n"
+	"		tcp dport { 22, 80, 443 } drop\n"
+	"	}\n"
+	"	chain input {\n"
+	"		type filter hook input priority filter; policy accept;\n"
+	"		tcp dport vmap @m\n"
+	"		ip daddr 10.0.0.1 jump {\n"
+	"			ip saddr 10.0.0.2 accept\n"
+	"		}\n"
+	"		jump c\n"
+	"	}\n"
+	"}\n"
+	"table ip empty {\n"
+	"}\n";
+
+/* The listing of @nft, which must succeed if @must is set. */
+static char *list_ruleset(struct nft_ctx *nft, bool must)
+{
+	test_flush_output(nft);
+	if (nft_run_cmd_from_buffer(nft, "list ruleset") != 0) {
+		check(!must);
+		return NULL;
+	}
+
+	return strdup(nft_ctx_get_output_buffer(nft));
+}
+
+int main(void)
+{
+	struct nft_ctx *nft, *stream;
+	char *expected, *output;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+	stream = test_ctx_new(NFT_CTX_STREAM_LIST);
+
+	test_run(nft, ruleset);
+
+	/* rules and elements are fetched chain by chain and set by set,
+	 * the listing is the same.
+	 */
+	expected = list_ruleset(nft, true);
+	output = list_ruleset(stream, true);
+	check(strstr(output, "jump {") && strstr(output, "10.0.0.0/8"));
+	check(!strcmp(expected, output));
+	free(expected);
+	free(output);
+
+	/* JSON output is streamed too, if it is built */
+	nft_ctx_output_set_flags(nft, NFT_CTX_OUTPUT_JSON);
+	nft_ctx_output_set_flags(stream, NFT_CTX_OUTPUT_JSON);
+	expected = list_ruleset(nft, false);
+	if (expected) {
+		output = list_ruleset(stream, true);
+		check(!strcmp(expected, output));
+		free(output);
+		free(expected);
+	}
+
+	/* other listings are printed from the full cache as before */
+	nft_ctx_output_set_flags(nft, 0);
+	nft_ctx_output_set_flags(stream, 0);
+	check(test_output_has(stream, "list table inet t; list table ip empty",
+			      "table ip empty"));
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(stream);
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,72 @@
+#ifndef NFTABLES_TESTS_LIB_TEST_H
+#define NFTABLES_TESTS_LIB_TEST_H
+
+/*
+ * Helpers of the library API test programs. These are built by make check
+ * and run as root from an unshared network namespace by the tests in
+ * tests/shell/testcases/libnftables, they exit with a non-zero status and
+ * tell which check failed on the first error.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nftables/libnftables.h>
+
+#define check(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+/* Context with buffered output and errors, no DNS lookups. */
+static inline struct nft_ctx *test_ctx_new(unsigned int flags)
+{
+	struct nft_ctx *nft;
+
+	nft = nft_ctx_new(flags);
+	check(nft != NULL);
+	nft_ctx_input_set_flags(nft, NFT_CTX_INPUT_NO_DNS);
+	check(nft_ctx_buffer_output(nft) == 0);
+	check(nft_ctx_buffer_error(nft) == 0);
+
+	return nft;
+}
+
+/* Drop what was buffered so far. */
+static inline void test_flush_output(struct nft_ctx *nft)
+{
+	nft_ctx_get_output_buffer(nft);
+	nft_ctx_get_error_buffer(nft);
+}
+
+/* Run @buf, which must succeed. */
+static inline void test_run(struct nft_ctx *nft, const char *buf)
+{
+	test_flush_output(nft);
+	if (nft_run_cmd_from_buffer(nft, buf) != 0) {
+		fprintf(stderr, "%s: %s", buf, nft_ctx_get_error_buffer(nft));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Whether the output of @buf contains @str. */
+static inline bool test_output_has(struct nft_ctx *nft, const char *buf,
+				   const char *str)
+{
+	test_run(nft, buf);
+
+	return strstr(nft_ctx_get_output_buffer(nft), str) != NULL;
+}
+
+/* Whether the errors reported so far contain @str. */
+static inline bool test_error_has(struct nft_ctx *nft, const char *str)
+{
+	return strstr(nft_ctx_get_error_buffer(nft), str) != NULL;
+}
+
+#endif /* NFTABLES_TESTS_LIB_TEST_H */
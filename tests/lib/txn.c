@@ -0,0 +1,68 @@
+/* nft_txn_begin(), nft_txn_add_cmd(), nft_txn_commit() and nft_txn_abort() */
+
+#include "test.h"
+
+int main(void)
+{
+	struct nft_ctx *nft, *other, *session;
+	struct nft_txn *txn;
+
+	nft = test_ctx_new(NFT_CTX_DEFAULT);
+	other = test_ctx_new(NFT_CTX_DEFAULT);
+
+	test_run(nft, "flush ruleset");
+
+	/* commands can refer to objects added by previous calls */
+	txn = nft_txn_begin(nft);
+	check(txn != NULL);
+	check(nft_txn_add_cmd(txn, "add table inet t") == 0);
+	check(nft_txn_add_cmd(txn, "add chain inet t c") == 0);
+	check(nft_txn_add_cmd(txn, "add set inet t s { type ipv4_addr; }") == 0);
+	check(nft_txn_add_cmd(txn, "add element inet t s { 10.0.0.1 }") == 0);
+	check(nft_txn_add_cmd(txn, "add rule inet t c ip saddr @s accept") == 0);
+
+	/* failed calls are not added, the transaction stays usable */
+	test_flush_output(nft);
+	check(nft_txn_add_cmd(txn, "add rule inet t c ip saddr @x accept") != 0);
+	check(nft_txn_add_cmd(txn, "add rule inet t c bogus") != 0);
+	check(nft_txn_add_cmd(txn, "list ruleset") != 0);
+	check(test_error_has(nft, "only commands that update the ruleset are supported in transactions"));
+
+	/* nothing is sent before the commit */
+	check(!test_output_has(other, "list ruleset", "table inet t"));
+
+	check(nft_txn_commit(txn) == 0);
+	check(test_output_has(other, "list set inet t s",
+			      "elements = { 10.0.0.1 }"));
+	check(test_output_has(other, "list chain inet t c",
+			      "ip saddr @s accept"));
+
+	/* a command rejected by the kernel fails the whole transaction */
+	txn = nft_txn_begin(nft);
+	check(txn != NULL);
+	check(nft_txn_add_cmd(txn, "add table inet u") == 0);
+	check(nft_txn_add_cmd(txn, "create element inet t s { 10.0.0.1 }") == 0);
+	test_flush_output(nft);
+	check(nft_txn_commit(txn) != 0);
+	check(test_error_has(nft, "create element inet t s { 10.0.0.1 }"));
+	check(!test_output_has(other, "list tables", "table inet u"));
+
+	/* nothing is sent on abort */
+	txn = nft_txn_begin(nft);
+	check(txn != NULL);
+	check(nft_txn_add_cmd(txn, "add table inet v") == 0);
+	nft_txn_abort(txn);
+	check(!test_output_has(other, "list tables", "table inet v"));
+
+	/* listing sessions cannot start transactions */
+	session = nft_ctx_session_new(nft);
+	check(session != NULL);
+	check(nft_txn_begin(session) == NULL);
+	nft_ctx_free(session);
+
+	test_run(nft, "flush ruleset");
+	nft_ctx_free(other);
+	nft_ctx_free(nft);
+
+	return EXIT_SUCCESS;
+}
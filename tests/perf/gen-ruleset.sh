@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Generate large, reproducible inputs for the performance tests.
+#
+# usage: gen-ruleset.sh <kind> <count>
+#
+# Output goes to stdout, in nft -f syntax. The same kind and count always
+# produce the same input.
+
+kind=$1
+count=$2
+
+if [ -z "$kind" ] || [ -z "$count" ]; then
+	echo "usage: $0 <hash|interval|concat|map|rules> <count>" >&2
+	exit 1
+fi
+
+# elements are generated by awk, which is much faster than a shell loop.
+# Addresses start at 10.0.0.0, @step apart.
+elements() { # (step, format)
+	awk -v n="$count" -v step="$1" -v fmt="$2" 'BEGIN {
+		for (i = 0; i < n; i++) {
+			a = 167772160 + i * step;
+			ip = sprintf("%d.%d.%d.%d", int(a / 16777216) % 256,
+				     int(a / 65536) % 256, int(a / 256) % 256,
+				     a % 256);
+			printf(fmt (i + 1 < n ? ",\n" : "\n"), ip, 1024 + i % 60000);
+		}
+	}'
+}
+
+echo "table inet perf {"
+
+case $kind in
+hash)
+	echo "	set s {"
+	echo "		type ipv4_addr"
+	echo "		size $((count * 2))"
+	echo "		elements = {"
+	elements 1 "%s"
+	echo "		}"
+	echo "	}"
+	;;
+interval)
+	echo "	set s {"
+	echo "		type ipv4_addr"
+	echo "		flags interval"
+	echo "		elements = {"
+	elements 8 "%s/30"
+	echo "		}"
+	echo "	}"
+	;;
+concat)
+	echo "	set s {"
+	echo "		type ipv4_addr . inet_service"
+	echo "		size $((count * 2))"
+	echo "		elements = {"
+	elements 1 "%s . %d"
+	echo "		}"
+	echo "	}"
+	;;
+map)
+	echo "	map m {"
+	echo "		type ipv4_addr : verdict"
+	echo "		size $((count * 2))"
+	echo "		elements = {"
+	elements 1 "%s : accept"
+	echo "		}"
+	echo "	}"
+	;;
+rules)
+	# no hook, the rules are only loaded and listed.
+	echo "	chain c {"
+	awk -v n="$count" 'BEGIN {
+		for (i = 0; i < n; i++) {
+			a = 167772160 + i;
+			printf("\t\tip saddr %d.%d.%d.%d tcp dport %d counter accept\n",
+			       int(a / 16777216) % 256, int(a / 65536) % 256,
+			       int(a / 256) % 256, a % 256, 1024 + i % 60000);
+		}
+	}'
+	echo "	}"
+	;;
+*)
+	echo "unknown kind $kind" >&2
+	exit 1
+	;;
+esac
+
+echo "}"
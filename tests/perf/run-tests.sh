@@ -0,0 +1,250 @@
+#!/bin/bash
+#
+# Timed scenarios for nft, see README.
+
+unset LANGUAGE
+export LANG=C
+export LC_ALL=C
+
+cd $(dirname $0)
+nft=${NFT:-../../src/nft}
+gen=$PWD/gen-ruleset.sh
+
+scale=1
+large=false
+trace=false
+results=""
+baseline=""
+threshold=10
+
+usage() {
+	cat <<EOF
+usage: $0 [options] [scenario...]
+
+  -n <nft>	nft binary to test (default: $nft)
+  -q		quick run, 1/100 of the default sizes
+  -s <scale>	multiply the default sizes by <scale>
+  -L		also run the 10M element loads
+  -S		count syscalls and netlink bytes, with strace
+  -o <file>	append results to <file> (default: stdout)
+  -b <file>	compare against the results in <file>
+  -t <percent>	regression threshold for -b (default: $threshold)
+EOF
+}
+
+err() {
+	echo "$*" >&2
+}
+
+die() {
+	err "$*"
+	exit 1
+}
+
+while getopts "n:qs:LSo:b:t:h" opt; do
+	case $opt in
+	n) nft=$OPTARG ;;
+	q) scale=0.01 ;;
+	s) scale=$OPTARG ;;
+	L) large=true ;;
+	S) trace=true ;;
+	o) results=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	h) usage; exit 0 ;;
+	*) usage; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ "$(id -u)" != "0" ] ; then
+	die "this requires root!"
+fi
+
+[ -x /usr/bin/time ] || die "GNU time is required in /usr/bin/time"
+if $trace && ! command -v strace >/dev/null; then
+	die "strace is required for -S"
+fi
+[ -z "$baseline" ] || [ -r "$baseline" ] || die "cannot read $baseline"
+
+workdir=$(mktemp -d)
+[ -d "$workdir" ] || die "Failed to create work directory"
+trap 'rm -rf $workdir; $nft flush ruleset' EXIT
+
+size() { # (count)
+	awk -v n="$1" -v s="$scale" 'BEGIN { n = int(n * s); print n ? n : 1 }'
+}
+
+# inputs are generated once per kind and size, lazily.
+input() { # (kind, count)
+	local file=$workdir/$1-$2.nft
+
+	[ -f $file ] || $gen $1 $2 >$file || die "cannot generate $1 $2"
+	echo $file
+}
+
+flush() {
+	$nft flush ruleset || die "cannot flush ruleset"
+}
+
+# (name, wall seconds, peak rss kb, syscalls, netlink bytes, extra json)
+report() {
+	local line
+
+	line=$(printf '{"scenario": "%s", "scale": %s, "wall_s": %s, "max_rss_kb": %s' \
+		      "$1" "$scale" "$2" "$3")
+	[ -n "$4" ] && line+=$(printf ', "syscalls": %s, "netlink_bytes": %s' "$4" "$5")
+	[ -n "$6" ] && line+=", $6"
+	line+="}"
+
+	if [ -n "$results" ]; then
+		echo "$line" >>$results
+	else
+		echo "$line"
+	fi
+	compare "$1" "$2" "$3"
+}
+
+regressions=0
+
+# report a regression of wall time or peak rss over the baseline.
+compare() { # (name, wall seconds, peak rss kb)
+	local old
+
+	[ -n "$baseline" ] || return 0
+
+	old=$(grep "\"scenario\": \"$1\"," $baseline | tail -n 1)
+	[ -n "$old" ] || return 0
+
+	awk -v name="$1" -v t="$threshold" -v wall="$2" -v rss="$3" \
+	    -v old_wall="$(sed 's/.*"wall_s": \([0-9.]*\).*/\1/' <<<"$old")" \
+	    -v old_rss="$(sed 's/.*"max_rss_kb": \([0-9]*\).*/\1/' <<<"$old")" '
+	function check(what, new, old) {
+		if (old > 0 && new > old * (1 + t / 100)) {
+			printf("REGRESSION %s: %s %s -> %s (+%.1f%%)\n", name,
+			       what, old, new, (new / old - 1) * 100) > "/dev/stderr";
+			bad = 1;
+		}
+	}
+	BEGIN {
+		check("wall_s", wall, old_wall);
+		check("max_rss_kb", rss, old_rss);
+		exit bad;
+	}' || regressions=$((regressions + 1))
+}
+
+# Run a command once under time, and once more under strace with -S. Each
+# run is preceded by the setup function, if any.
+measure() { # (name, setup, command...)
+	local name=$1 setup=$2 wall rss calls bytes
+	shift 2
+
+	[ -n "$setup" ] && $setup
+	/usr/bin/time -f "%e %M" -o $workdir/time "$@" \
+		>$workdir/out 2>$workdir/err || {
+		err "$name: command failed: $*"
+		cat $workdir/err >&2
+		return 1
+	}
+	read wall rss < <(tail -n 1 $workdir/time)
+
+	if $trace; then
+		[ -n "$setup" ] && $setup
+		strace -f -qq -o $workdir/strace "$@" >/dev/null 2>&1
+		calls=$(grep -cv '^[0-9]* *+++\|resumed>' $workdir/strace)
+		bytes=$(awk '/(sendmsg|recvmsg|sendto|recvfrom)\(/ &&
+			     $NF ~ /^[0-9]+$/ { n += $NF } END { print n + 0 }' \
+			$workdir/strace)
+	fi
+
+	report "$name" "$wall" "$rss" "$calls" "$bytes"
+}
+
+scenario_enabled() { # (name)
+	local s
+
+	[ $# -gt 0 ] || return 0
+	[ ${#scenarios[@]} -eq 0 ] && return 0
+	for s in "${scenarios[@]}"; do
+		[[ "$1" == $s ]] && return 0
+	done
+	return 1
+}
+
+run_load() { # (name, kind, count)
+	scenario_enabled "$1" || return 0
+	measure "$1" flush $nft -f $(input $2 $3)
+}
+
+setup_listing() {
+	flush
+	$nft -f $(input hash $(size 1000000)) &&
+	$nft -f $(input rules $(size 100000)) ||
+		die "cannot load listing ruleset"
+}
+
+run_monitor() { # (name, count)
+	local file events start end pid i
+
+	scenario_enabled "$1" || return 0
+	flush
+
+	file=$(input rules $2)
+	/usr/bin/time -f "%e %M" -o $workdir/time.monitor \
+		$nft monitor rules >$workdir/monitor &
+	pid=$!
+	sleep 0.5
+
+	start=$(date +%s.%N)
+	$nft -f $file || die "$1: cannot load rules"
+	# rules are echoed one per line, wait until all of them are seen.
+	for i in $(seq 600); do
+		events=$(grep -c '^add rule' $workdir/monitor)
+		[ $events -ge $2 ] && break
+		sleep 0.1
+	done
+	end=$(date +%s.%N)
+	# stop nft, not time, which reports once nft exits.
+	pkill -TERM -P $pid
+	wait $pid
+
+	read wall rss < <(tail -n 1 $workdir/time.monitor)
+	report "$1" $(awk -v s=$start -v e=$end 'BEGIN { printf("%.2f", e - s) }') \
+		"$rss" "" "" "\"events\": $events"
+}
+
+scenarios=("$@")
+
+run_load load-hash-1M hash $(size 1000000)
+run_load load-interval-1M interval $(size 1000000)
+run_load load-concat-1M concat $(size 1000000)
+run_load load-map-1M map $(size 1000000)
+if $large; then
+	run_load load-hash-10M hash $(size 10000000)
+	run_load load-interval-10M interval $(size 10000000)
+	run_load load-concat-10M concat $(size 10000000)
+fi
+run_load load-rules-100k rules $(size 100000)
+
+if scenario_enabled list-ruleset || scenario_enabled list-ruleset-json ||
+   scenario_enabled load-json; then
+	setup_listing
+	scenario_enabled list-ruleset &&
+		measure list-ruleset "" $nft list ruleset
+	scenario_enabled list-ruleset-json &&
+		measure list-ruleset-json "" $nft -j list ruleset
+
+	if scenario_enabled load-json; then
+		$nft -j list ruleset >$workdir/ruleset.json ||
+			die "cannot list ruleset in json"
+		measure load-json flush $nft -j -f $workdir/ruleset.json
+	fi
+fi
+
+scenario_enabled optimize-100k &&
+	measure optimize-100k flush $nft -c -o -f $(input rules $(size 100000))
+
+run_monitor monitor-100k $(size 100000)
+
+[ $regressions -eq 0 ] || die "$regressions regression(s) over $baseline"
+exit 0
@@ -0,0 +1,5 @@
+#!/bin/sh
+
+# Detect whether nft was built with io_uring support, the kernel support is
+# probed at runtime and may still be missing.
+$NFT -V | grep -q "io_uring:[[:space:]]*yes"